@@ -27,18 +27,24 @@
 #include "dfu.h"
 
 // Internal flash-programming state machine
-static unsigned fl_current_addr = 0;
+static unsigned fl_current_addr = 0;    // Sector being erased or programmed
+static unsigned fl_block_end = 0;       // End of the current block's data in flash
 static enum {
     flsIDLE = 0,
     flsERASING,
-    flsPROGRAMMING
+    flsPROGRAMMING,
+    flsERASING_AHEAD        // Erasing the sector the next block should start at
 } fl_state;
 
 static dfu_state_t dfu_state = dfuIDLE;
 static dfu_status_t dfu_status = OK;
 static unsigned dfu_poll_timeout = 1;
 
-// Programming buffer in MK20DX128 FlexRAM, where the flash controller can quickly access it.
+/*
+ * Programming buffer in MK20DX128 FlexRAM, where the flash controller can quickly access it.
+ * A block fills all of FlexRAM, two flash sectors. Program Section always reads from the
+ * start of FlexRAM, so the second sector is moved down once the first is programmed.
+ */
 static __attribute__ ((section(".flexram"))) uint8_t dfu_buffer[DFU_TRANSFER_SIZE];
 
 static void *memcpy(void *dst, const void *src, size_t cnt) {
@@ -103,7 +109,7 @@ static void ftfl_begin_program_section(uint32_t address, uint32_t numLWords)
 
 static uint32_t address_for_block(unsigned blockNum)
 {
-    return 0x1000 + (blockNum << 10);
+    return APP_FLASH_START + blockNum * DFU_TRANSFER_SIZE;
 }
 
 void dfu_init()
@@ -144,7 +150,7 @@ bool dfu_download(unsigned blockNum, unsigned blockLength,
         return false;
     }
 
-    if (ftfl_busy() || fl_state != flsIDLE) {
+    if (fl_state != flsIDLE && fl_state != flsERASING_AHEAD) {
         // Flash controller shouldn't be busy now!
         dfu_state = dfuERROR;
         dfu_status = errUNKNOWN;
@@ -158,10 +164,15 @@ bool dfu_download(unsigned blockNum, unsigned blockLength,
         return true;
     }
 
-    // Start programming a block by erasing the corresponding flash sector
+    // Start programming a block by erasing its first flash sector, unless that's already underway
+    fl_block_end = address_for_block(blockNum) + blockLength;
+    if (fl_state != flsERASING_AHEAD || fl_current_addr != address_for_block(blockNum)) {
+        // Blocks out of order. Any erase we guessed at has to finish first.
+        ftfl_busy_wait();
+        fl_current_addr = address_for_block(blockNum);
+        ftfl_begin_erase_sector(fl_current_addr);
+    }
     fl_state = flsERASING;
-    fl_current_addr = address_for_block(blockNum);
-    ftfl_begin_erase_sector(fl_current_addr);
 
     dfu_state = dfuDNLOAD_SYNC;
     dfu_status = OK;
@@ -225,16 +236,35 @@ static void fl_state_poll()
             if (!fl_handle_status(fstat, errERASE)) {
                 // Done! Move on to programming the sector.
                 fl_state = flsPROGRAMMING;
-                ftfl_begin_program_section(fl_current_addr, DFU_TRANSFER_SIZE/4);
+                ftfl_begin_program_section(fl_current_addr, DFU_SECTOR_SIZE/4);
             }
             break;
 
         case flsPROGRAMMING:
             if (!fl_handle_status(fstat, errVERIFY)) {
-                // Done!
-                fl_state = flsIDLE;
+                fl_current_addr += DFU_SECTOR_SIZE;
+
+                if (fl_current_addr < fl_block_end) {
+                    // On to this block's second sector
+                    memcpy(dfu_buffer, dfu_buffer + DFU_SECTOR_SIZE, DFU_SECTOR_SIZE);
+                    fl_state = flsERASING;
+                    ftfl_begin_erase_sector(fl_current_addr);
+
+                } else if (fl_current_addr < APP_FLASH_END) {
+                    // Done! Blocks arrive in order, so erase for the next one while the host sends it.
+                    fl_state = flsERASING_AHEAD;
+                    ftfl_begin_erase_sector(fl_current_addr);
+
+                } else {
+                    // Done, and that was the end of flash.
+                    fl_state = flsIDLE;
+                }
             }
             break;
+
+        case flsERASING_AHEAD:
+            // Waiting for the next block. Any error is reported if it turns out we need this sector.
+            break;
     }
 }
 
@@ -249,7 +279,7 @@ bool dfu_getstatus(uint8_t *status)
 
             if (dfu_state == dfuERROR) {
                 // An error occurred inside fl_state_poll();
-            } else if (fl_state == flsIDLE) {
+            } else if (fl_state == flsIDLE || fl_state == flsERASING_AHEAD) {
                 dfu_state = dfuDNLOAD_IDLE;
             } else {
                 dfu_state = dfuDNBUSY;
@@ -257,6 +287,12 @@ bool dfu_getstatus(uint8_t *status)
             break;
 
         case dfuMANIFEST_SYNC:
+            if (ftfl_busy()) {
+                // Still erasing ahead, for a block that never came. Don't reboot in the middle.
+                break;
+            }
+            fl_state = flsIDLE;
+
             // Ready to reboot. The main thread will take care of this. Also let the DFU tool
             // know to leave us alone until this happens.
             dfu_state = dfuMANIFEST;
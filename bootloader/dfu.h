@@ -60,7 +60,12 @@ typedef enum {
 
 #define DFU_INTERFACE             0
 #define DFU_DETACH_TIMEOUT        10000     // 10 second timer
-#define DFU_TRANSFER_SIZE         1024      // Flash sector size
+#define DFU_SECTOR_SIZE           1024      // Flash sector size
+#define DFU_TRANSFER_SIZE         2048      // Two sectors per block, all of FlexRAM
+
+// Application flash, after the bootloader's protected 4 kB
+#define APP_FLASH_START           0x1000
+#define APP_FLASH_END             0x20000
 
 // Main thread
 void dfu_init();
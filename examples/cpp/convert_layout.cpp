@@ -0,0 +1,43 @@
+// Converts a JSON layout to the binary format from lib/binary_layout.h,
+// which any EffectRunner -layout option also accepts. Numeric attributes
+// are kept; anything else in the JSON, like strings, is dropped.
+
+#include <stdio.h>
+#include "lib/effect.h"
+#include "lib/binary_layout.h"
+#include "lib/rapidjson/filestream.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s INPUT.json OUTPUT\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    rapidjson::Document layout;
+    rapidjson::FileStream istr(f);
+    layout.ParseStream<0>(istr);
+    fclose(f);
+
+    if (layout.HasParseError() || !layout.IsArray() || layout.Size() == 0) {
+        fprintf(stderr, "Can't load layout from %s\n", argv[1]);
+        return 1;
+    }
+
+    Effect::FrameInfo frame;
+    frame.init(layout);
+
+    if (!BinaryLayout::write(argv[2], frame)) {
+        fprintf(stderr, "Can't write %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%s: %u pixels\n", argv[2], (unsigned) frame.pixels.size());
+    return 0;
+}
@@ -0,0 +1,307 @@
+// Benchmark for the example effects. Runs each one for a number of frames on one
+// or more layouts, without any OPC output, and reports the cost per pixel, frame
+// time percentiles, and how that scales with threads from the shared pool.
+//
+// Frames are rendered the same way EffectRunner does it: beginFrame(), shading
+// on the pool (or serially with one thread), postProcess() and endFrame().
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <time.h>
+#include "lib/effect_runner.h"
+#include "lib/effect_mixer.h"
+#include "lib/effect_thread_pool.h"
+#include "lib/binary_layout.h"
+
+#include "rings.h"
+#include "spokes.h"
+#include "dot.h"
+#include "particle_trail.h"
+
+struct Layout {
+    std::string name;
+    rapidjson::Document json;
+    Effect::FrameInfo frame;
+};
+
+struct Benchmark {
+    const char *name;
+    Effect *effect;
+};
+
+struct PostProcessContext {
+    Effect *effect;
+    const Effect::FrameInfo *frame;
+    std::vector<Vec3> *colors;
+};
+
+static double seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void postProcessRange(void *context, unsigned begin, unsigned end)
+{
+    PostProcessContext *c = (PostProcessContext*) context;
+    c->effect->postProcessBatch(Effect::PixelBatch(*c->frame, begin, end),
+        &(*c->colors)[begin], EffectThreadPool::currentThread());
+}
+
+static void renderFrame(Effect *effect, Effect::FrameInfo &frame, std::vector<Vec3> &colors, bool parallel)
+{
+    EffectThreadPool &pool = EffectThreadPool::shared();
+
+    effect->beginFrame(frame);
+
+    if (parallel) {
+        pool.add(effect, frame, colors);
+        pool.run();
+    } else {
+        colors.assign(frame.pixels.size(), Vec3(0, 0, 0));
+        effect->shadeBatch(Effect::PixelBatch(frame, 0, colors.size()), &colors[0]);
+    }
+
+    if (effect->hasParallelPostProcess()) {
+        PostProcessContext context = { effect, &frame, &colors };
+        if (parallel) {
+            pool.add(postProcessRange, &context, colors.size());
+            pool.run();
+        } else {
+            postProcessRange(&context, 0, colors.size());
+        }
+    } else {
+        for (unsigned i = 0; i < colors.size(); i++) {
+            if (frame.isMapped(i)) {
+                effect->postProcess(colors[i], frame.pixels[i]);
+            }
+        }
+    }
+
+    effect->endFrame(frame);
+}
+
+static bool loadLayout(Layout &layout, const char *filename)
+{
+    layout.name = filename;
+
+    if (BinaryLayout::isBinary(filename)) {
+        BinaryLayout binary;
+        if (!binary.open(filename)) {
+            return false;
+        }
+        binary.load(layout.frame);
+        return true;
+    }
+
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        return false;
+    }
+
+    rapidjson::FileStream istr(f);
+    layout.json.ParseStream<0>(istr);
+    fclose(f);
+
+    if (layout.json.HasParseError() || !layout.json.IsArray() || layout.json.Size() == 0) {
+        return false;
+    }
+
+    layout.frame.init(layout.json);
+    return true;
+}
+
+static void makePointCloud(Layout &layout, unsigned count)
+{
+    // Random points in a 4 x 2 x 2 box, the same every time, so results compare between runs
+    rapidjson::Document::AllocatorType &allocator = layout.json.GetAllocator();
+    layout.json.SetArray();
+    srand(1);
+
+    for (unsigned i = 0; i < count; i++) {
+        rapidjson::Value point(rapidjson::kArrayType);
+        point.PushBack(rand() * 4.0 / RAND_MAX - 2.0, allocator);
+        point.PushBack(rand() * 2.0 / RAND_MAX - 1.0, allocator);
+        point.PushBack(rand() * 2.0 / RAND_MAX - 1.0, allocator);
+
+        rapidjson::Value pixel(rapidjson::kObjectType);
+        pixel.AddMember("point", point, allocator);
+        layout.json.PushBack(pixel, allocator);
+    }
+
+    char name[64];
+    snprintf(name, sizeof name, "%u random points", count);
+    layout.name = name;
+    layout.frame.init(layout.json);
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    return sorted[std::min<size_t>(sorted.size() - 1, sorted.size() * p)];
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [-frames N] [-points N] [-threads N] [-spatial] [-layout FILE ...] [EFFECT ...]\n"
+        "\n"
+        "Effects are rings, spokes, dot, particle_trail and mixer, all by default. Without\n"
+        "-layout, we use grid32x16z and a cloud of -points random points (100000 by default,\n"
+        "or 0 for none). Every effect runs at 1, 2, 4... threads, up to -threads (by default,\n"
+        "the number of CPUs). With -spatial, pixels are shaded in spatial order.\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned frames = 300;
+    unsigned points = 100000;
+    unsigned maxThreads = 0;
+    bool spatial = false;
+    std::vector<const char*> layoutFiles;
+    std::vector<std::string> only;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-frames") && i+1 < argc) {
+            frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-points") && i+1 < argc) {
+            points = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-threads") && i+1 < argc) {
+            maxThreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-spatial")) {
+            spatial = true;
+        } else if (!strcmp(argv[i], "-layout") && i+1 < argc) {
+            layoutFiles.push_back(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            only.push_back(argv[i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (frames == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Layouts
+
+    std::vector<Layout*> layouts;
+    bool defaultLayouts = layoutFiles.empty();
+    if (defaultLayouts) {
+        layoutFiles.push_back("../layouts/grid32x16z.json");
+    }
+    for (unsigned i = 0; i < layoutFiles.size(); i++) {
+        Layout *layout = new Layout;
+        if (!loadLayout(*layout, layoutFiles[i])) {
+            fprintf(stderr, "Can't read layout %s\n", layoutFiles[i]);
+            return 1;
+        }
+        layouts.push_back(layout);
+    }
+    if (defaultLayouts && points) {
+        Layout *layout = new Layout;
+        makePointCloud(*layout, points);
+        layouts.push_back(layout);
+    }
+
+    // Effects. The mixer gets its own channels, at full fader, so it costs all three.
+
+    RingsEffect rings("data/glass.png");
+    SpokesEffect spokes;
+    DotEffect dot("data/dot.png");
+    ParticleTrailEffect trail;
+
+    RingsEffect mixRings("data/glass.png");
+    SpokesEffect mixSpokes;
+    DotEffect mixDot("data/dot.png");
+    EffectMixer mixer;
+    mixer.add(&mixRings);
+    mixer.add(&mixDot);
+    mixer.add(&mixSpokes);
+
+    Benchmark all[] = {
+        { "rings", &rings },
+        { "spokes", &spokes },
+        { "dot", &dot },
+        { "particle_trail", &trail },
+        { "mixer", &mixer },
+    };
+
+    std::vector<Benchmark> benchmarks;
+    for (unsigned i = 0; i < sizeof all / sizeof all[0]; i++) {
+        if (only.empty() || std::find(only.begin(), only.end(), all[i].name) != only.end()) {
+            benchmarks.push_back(all[i]);
+        }
+    }
+    if (benchmarks.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Thread counts: powers of two, and the maximum
+
+    if (!maxThreads) {
+        maxThreads = std::max(1u, tthread::thread::hardware_concurrency());
+    }
+    std::vector<unsigned> threadCounts;
+    for (unsigned n = 1; n < maxThreads; n *= 2) {
+        threadCounts.push_back(n);
+    }
+    threadCounts.push_back(maxThreads);
+
+    printf("%-28s %-15s %7s %8s %9s %8s %8s %8s %8s %8s\n",
+        "layout", "effect", "threads", "pixels", "ns/pixel", "p50 ms", "p90 ms", "p99 ms", "max ms", "speedup");
+
+    std::vector<Vec3> colors;
+    std::vector<double> times(frames);
+    const unsigned warmupFrames = 10;
+
+    for (unsigned l = 0; l < layouts.size(); l++) {
+        Effect::FrameInfo &frame = layouts[l]->frame;
+        frame.timeDelta = 1.0f / 60;
+        frame.setSpatialOrder(spatial);
+
+        for (unsigned b = 0; b < benchmarks.size(); b++) {
+            double singleThreadMean = 0;
+
+            for (unsigned t = 0; t < threadCounts.size(); t++) {
+                unsigned threads = threadCounts[t];
+                EffectThreadPool::shared().setConcurrency(threads);
+                bool parallel = threads > 1;
+
+                // Let the pool and any per-layout setup in the effect settle before timing
+                for (unsigned i = 0; i < warmupFrames; i++) {
+                    renderFrame(benchmarks[b].effect, frame, colors, parallel);
+                }
+
+                double total = 0;
+                for (unsigned i = 0; i < frames; i++) {
+                    double start = seconds();
+                    renderFrame(benchmarks[b].effect, frame, colors, parallel);
+                    times[i] = seconds() - start;
+                    total += times[i];
+                }
+
+                double mean = total / frames;
+                if (t == 0) {
+                    singleThreadMean = mean;
+                }
+
+                std::vector<double> sorted(times);
+                std::sort(sorted.begin(), sorted.end());
+
+                printf("%-28s %-15s %7u %8u %9.1f %8.3f %8.3f %8.3f %8.3f %7.2fx\n",
+                    layouts[l]->name.c_str(), benchmarks[b].name, threads, (unsigned) frame.pixels.size(),
+                    mean * 1e9 / frame.pixels.size(),
+                    percentile(sorted, 0.5) * 1e3, percentile(sorted, 0.9) * 1e3,
+                    percentile(sorted, 0.99) * 1e3, sorted.back() * 1e3,
+                    singleThreadMean / mean);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return 0;
+}
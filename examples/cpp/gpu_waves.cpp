@@ -0,0 +1,63 @@
+// GPU example effect:
+// Rainbow waves rolling out from the origin, shaded by an OpenGL ES compute shader.
+// The same effect runs on the CPU when there's no GPU to use.
+//
+// Build with "make gpu"; this needs EGL and OpenGL ES 3.1.
+
+#include <math.h>
+#include "lib/effect_runner.h"
+#include "lib/gpu_effect.h"
+
+class GpuWaves : public GpuEffect
+{
+public:
+    GpuWaves()
+        : cycle (0) {}
+
+    float cycle;
+
+    virtual void beginFrame(const FrameInfo &f)
+    {
+        const float speed = 4.0;
+        cycle = fmodf(cycle + f.timeDelta * speed, 2 * M_PI);
+    }
+
+    virtual const char *kernelSource() const
+    {
+        return
+            "uniform float cycle;\n"
+            "vec3 shade(vec3 point, uint index) {\n"
+            "    float phase = 3.0 * length(point) - cycle;\n"
+            "    float level = 0.5 + 0.5 * sin(phase);\n"
+            "    return level * (0.5 + 0.5 * cos(0.5 * phase + vec3(0.0, 2.1, 4.2)));\n"
+            "}\n";
+    }
+
+    virtual void setUniforms(const FrameInfo &f)
+    {
+        setUniform("cycle", cycle);
+    }
+
+    virtual void shader(Vec3& rgb, const PixelInfo &p) const
+    {
+        float phase = 3.0f * len(p.point) - cycle;
+        float level = 0.5f + 0.5f * sinf(phase);
+        for (unsigned i = 0; i < 3; i++) {
+            rgb[i] = level * (0.5f + 0.5f * cosf(0.5f * phase + 2.1f * i));
+        }
+    }
+};
+
+int main(int argc, char **argv)
+{
+    EffectRunner r;
+
+    GpuWaves e;
+    r.addEffect(&e);
+
+    // Defaults, overridable with command line options
+    r.setMaxFrameRate(100);
+    r.setLayout("../layouts/grid32x16z.json");
+
+    return r.main(argc, argv);
+}
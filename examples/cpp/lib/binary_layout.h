@@ -0,0 +1,340 @@
+/*
+ * Compact binary layout files, for layouts too big to parse as JSON quickly.
+ *
+ * A binary layout has columns rather than objects: every pixel's point, a bit
+ * saying whether it's mapped, and any other numeric attributes from the JSON
+ * they were converted from, as 32-bit floats. Files are memory mapped and copied
+ * straight into a FrameInfo, so nothing like a JSON DOM is kept around. The
+ * catch is that PixelInfo::layout is null; use FrameInfo::getAttribute() to get
+ * at the attributes.
+ *
+ * File format, all little-endian 32-bit words:
+ *
+ *   "FCL1", pixel count, attribute count
+ *   Mapped pixels, one bit per pixel, in (pixel count + 31) / 32 words
+ *   Points, packed (x, y, z) per pixel, as floats
+ *   For each attribute:
+ *      Number of components, name length in bytes (a multiple of 4)
+ *      Name, padded with NUL bytes
+ *      Values, one run of components per pixel, as floats
+ *
+ * The "point" attribute isn't stored again, it comes from the points.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "effect.h"
+
+
+class BinaryLayout {
+public:
+    BinaryLayout();
+    ~BinaryLayout();
+
+    // Memory map a binary layout file, checking that it's all there
+    bool open(const char *filename);
+    void close();
+
+    // Does this file start like a binary layout? Anything else is taken to be JSON.
+    static bool isBinary(const char *filename);
+
+    // Set up a FrameInfo from the open layout, as FrameInfo::init() does from JSON
+    void load(Effect::FrameInfo &frame) const;
+
+    // Save a FrameInfo's points and attributes, however it was loaded
+    static bool write(const char *filename, const Effect::FrameInfo &frame);
+
+    unsigned getPixelCount() const;
+
+private:
+    static const uint32_t HEADER_WORDS = 3;
+
+    struct Attribute {
+        const char *name;
+        unsigned components;
+        const uint8_t *values;
+    };
+
+    const uint8_t *data;
+    size_t size;
+    unsigned pixelCount;
+    const uint8_t *mappedBits;
+    const uint8_t *points;
+    std::vector<Attribute> attributes;
+
+    static void putLE32(uint8_t *p, uint32_t value);
+    static uint32_t getLE32(const uint8_t *p);
+    static float getFloat(const uint8_t *p);
+    static bool writeWord(FILE *f, uint32_t value);
+    static bool writeFloat(FILE *f, float value);
+
+    bool parse();
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline BinaryLayout::BinaryLayout()
+    : data(0), size(0), pixelCount(0), mappedBits(0), points(0)
+{}
+
+inline BinaryLayout::~BinaryLayout()
+{
+    close();
+}
+
+inline void BinaryLayout::close()
+{
+    if (data) {
+        munmap((void*) data, size);
+        data = 0;
+        size = 0;
+    }
+    pixelCount = 0;
+    mappedBits = 0;
+    points = 0;
+    attributes.clear();
+}
+
+inline bool BinaryLayout::isBinary(const char *filename)
+{
+    uint8_t magic[4];
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        return false;
+    }
+    bool binary = fread(magic, 1, sizeof magic, f) == sizeof magic && !memcmp(magic, "FCL1", 4);
+    fclose(f);
+    return binary;
+}
+
+inline bool BinaryLayout::open(const char *filename)
+{
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) (HEADER_WORDS * 4)) {
+        mapping = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+    data = (const uint8_t*) mapping;
+    size = st.st_size;
+    if (!parse()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+inline bool BinaryLayout::parse()
+{
+    // Find each column, without reading any of them yet. Sizes are checked
+    // in 64-bit, so a corrupt count can't wrap around.
+
+    if (memcmp(data, "FCL1", 4)) {
+        return false;
+    }
+    pixelCount = getLE32(data + 4);
+    unsigned attributeCount = getLE32(data + 8);
+    if (pixelCount == 0) {
+        return false;
+    }
+
+    uint64_t offset = HEADER_WORDS * 4;
+    mappedBits = data + offset;
+    offset += (uint64_t(pixelCount) + 31) / 32 * 4;
+    points = data + offset;
+    offset += uint64_t(pixelCount) * 3 * 4;
+
+    for (unsigned i = 0; i < attributeCount; i++) {
+        if (offset + 8 > size) {
+            return false;
+        }
+        Attribute a;
+        a.components = getLE32(data + offset);
+        uint32_t nameLength = getLE32(data + offset + 4);
+        offset += 8;
+
+        if (a.components == 0 || nameLength == 0 || nameLength % 4 || offset + nameLength > size
+            || data[offset + nameLength - 1] != '\0') {
+            return false;
+        }
+        a.name = (const char*) data + offset;
+        offset += nameLength;
+
+        a.values = data + offset;
+        offset += uint64_t(pixelCount) * a.components * 4;
+        attributes.push_back(a);
+    }
+
+    return offset <= size;
+}
+
+inline unsigned BinaryLayout::getPixelCount() const
+{
+    return pixelCount;
+}
+
+inline void BinaryLayout::load(Effect::FrameInfo &frame) const
+{
+    frame.timeDelta = 0;
+    frame.pixels.clear();
+    frame.pixels.reserve(pixelCount);
+
+    for (unsigned i = 0; i < pixelCount; i++) {
+        bool mapped = (getLE32(mappedBits + i / 32 * 4) >> (i % 32)) & 1;
+        const uint8_t *p = points + i * 12;
+        Vec3 point(getFloat(p), getFloat(p + 4), getFloat(p + 8));
+        frame.pixels.push_back(Effect::PixelInfo(i, mapped ? point : Vec3(0, 0, 0), mapped));
+    }
+
+    frame.attributes.clear();
+    for (unsigned a = 0; a < attributes.size(); a++) {
+        Effect::FrameInfo::AttributeArray &array = frame.attributes[attributes[a].name];
+        unsigned count = pixelCount * attributes[a].components;
+        array.components = attributes[a].components;
+        array.values.resize(count);
+        for (unsigned i = 0; i < count; i++) {
+            array.values[i] = getFloat(attributes[a].values + i * 4);
+        }
+    }
+
+    Effect::FrameInfo::AttributeArray &point = frame.attributes["point"];
+    point.components = 3;
+    point.values.resize(pixelCount * 3);
+    for (unsigned i = 0; i < pixelCount; i++) {
+        for (unsigned j = 0; j < 3; j++) {
+            point.values[i*3 + j] = frame.pixels[i].point[j];
+        }
+    }
+
+    frame.finishInit();
+}
+
+inline bool BinaryLayout::write(const char *filename, const Effect::FrameInfo &frame)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        return false;
+    }
+
+    unsigned count = frame.pixels.size();
+    std::map<std::string, Effect::FrameInfo::AttributeArray>::const_iterator a, e;
+    unsigned attributeCount = 0;
+    for (a = frame.attributes.begin(), e = frame.attributes.end(); a != e; ++a) {
+        attributeCount += a->first != "point";
+    }
+
+    // Files are always in wiring order, even if the frame is in spatial order
+    std::vector<unsigned> order = frame.wiringPermutation();
+
+    bool ok = fwrite("FCL1", 4, 1, f) == 1 && writeWord(f, count) && writeWord(f, attributeCount);
+
+    for (unsigned i = 0; ok && i < count; i += 32) {
+        uint32_t bits = 0;
+        for (unsigned j = 0; j < 32 && i + j < count; j++) {
+            bits |= uint32_t(frame.isMapped(order[i + j])) << j;
+        }
+        ok = writeWord(f, bits);
+    }
+    for (unsigned i = 0; ok && i < count * 3; i++) {
+        ok = writeFloat(f, frame.points[order[i / 3] * 3 + i % 3]);
+    }
+
+    for (a = frame.attributes.begin(); ok && a != e; ++a) {
+        if (a->first == "point") {
+            continue;
+        }
+
+        // Name, with at least one NUL, rounded up to a whole word
+        std::vector<char> name(a->first.begin(), a->first.end());
+        name.resize((name.size() + 4) & ~3, '\0');
+
+        ok = writeWord(f, a->second.components) && writeWord(f, name.size())
+            && fwrite(&name[0], name.size(), 1, f) == 1;
+        unsigned components = a->second.components;
+        for (unsigned i = 0; ok && i < count * components; i++) {
+            ok = writeFloat(f, a->second.values[order[i / components] * components + i % components]);
+        }
+    }
+
+    return fclose(f) == 0 && ok;
+}
+
+inline void BinaryLayout::putLE32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+inline uint32_t BinaryLayout::getLE32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+inline float BinaryLayout::getFloat(const uint8_t *p)
+{
+    uint32_t bits = getLE32(p);
+    float value;
+    memcpy(&value, &bits, sizeof value);
+    return value;
+}
+
+inline bool BinaryLayout::writeWord(FILE *f, uint32_t value)
+{
+    uint8_t bytes[4];
+    putLE32(bytes, value);
+    return fwrite(bytes, sizeof bytes, 1, f) == 1;
+}
+
+inline bool BinaryLayout::writeFloat(FILE *f, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    return writeWord(f, bits);
+}
@@ -29,6 +29,7 @@
 #pragma once
 
 #include "effect.h"
+#include "effect_thread_pool.h"
 
 
 class Brightness : public Effect {
@@ -53,7 +54,12 @@ public:
     virtual void beginFrame(const FrameInfo& f);
     virtual bool endFrame(const FrameInfo& f);
     virtual void debug(const DebugInfo& f);
+    virtual void prepare(const FrameInfo& f);
+
+    // Unchanged when the next effect is, since the scale is then unchanged too
+    virtual bool isFrameUnchanged(const FrameInfo& f) const;
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
+    virtual void shadeBatch(const PixelBatch& batch, Vec3* out) const;
 
 private:
     Effect &next;
@@ -71,6 +77,23 @@ private:
     static const unsigned gammaTableSize = 256;
     float gammaTable[gammaTableSize];
     float gamma;
+
+    // Partial sums from each pool thread, while the next effect is shaded
+    struct Totals {
+        unsigned count;
+        float delta;
+        float average;
+    };
+    std::vector<Totals> threadTotals;
+    const FrameInfo *frame;
+    float trialScale;
+    bool unchanged;
+    bool rescale;       // Settings changed, so measure again even if 'next' didn't
+
+    float linearBrightness(const Vec3& rgb, float scale) const;
+    static void shadeRange(void *context, unsigned begin, unsigned end);
+    static void averageRange(void *context, unsigned begin, unsigned end);
+    float totalAverage();
 };
 
 
@@ -86,7 +109,11 @@ inline Brightness::Brightness(Effect &next)
       currentScale(1),
       latestAverage(0),
       totalBrightnessDelta(0),
-      numIters(0)
+      numIters(0),
+      frame(0),
+      trialScale(1),
+      unchanged(false),
+      rescale(true)
 {
     // Fadecandy default
     setAssumedGamma(2.5);
@@ -98,17 +125,20 @@ inline Brightness::Brightness(Effect &next)
 inline void Brightness::set(float averageBrightness)
 {
     lowerLimit = upperLimit = averageBrightness;
+    rescale = true;
 }
 
 inline void Brightness::set(float lowerLimit, float upperLimit)
 {
     this->lowerLimit = lowerLimit;
     this->upperLimit = upperLimit;
+    rescale = true;
 }
 
 inline void Brightness::setAssumedGamma(float gamma)
 {
     this->gamma = gamma;
+    rescale = true;
     for (unsigned i = 0; i < gammaTableSize; i++) {
         gammaTable[i] = powf(i / float(gammaTableSize + 1), gamma);
     }
@@ -126,42 +156,58 @@ inline float Brightness::getTotalBrightnessDelta() const
 
 inline void Brightness::beginFrame(const FrameInfo& f)
 {
+    const float deltaAccumulatorFilterRate = 0.05;
+
     next.beginFrame(f);
-    std::swap(nextColors, prevColors);
 
     if (colorBuffer[0].size() != f.pixels.size()) {
         for (unsigned i = 0; i < 2; i++) {
            colorBuffer[i].resize(f.pixels.size());
            std::fill(colorBuffer[i].begin(), colorBuffer[i].end(), Vec3(0,0,0));
         }
-    }
-
-    unsigned count = 0;
-    float deltaAccumulator = 0;
+        unchanged = false;
 
-    // Calculate the next effect's pixels, storing them all. Also count the total number
-    // of mapped pixels, ignoring any unmapped ones.
-
-    {
-        PixelInfoIter pi = f.pixels.begin();
-        PixelInfoIter pe = f.pixels.end();
-        std::vector<Vec3>::iterator nci = nextColors->begin();
-        std::vector<Vec3>::iterator pci = prevColors->begin();
+    } else if (!rescale && frame == &f && next.isFrameUnchanged(f)) {
+        // Same colors as last frame, and the same scale. There's no brightness change.
+        unchanged = true;
+        totalBrightnessDelta -= totalBrightnessDelta * deltaAccumulatorFilterRate;
+        return;
 
-        for (;pi != pe; ++pi, ++nci, ++pci) {
-            if (pi->isMapped()) {
-                Vec3 rgb(0, 0, 0);
-                next.shader(rgb, *pi);
-                next.postProcess(rgb, *pi);
-                count++;
+    } else {
+        unchanged = false;
+    }
 
-                *nci = rgb;
-                deltaAccumulator += sqrlen(rgb - *pci);
-            }
+    std::swap(nextColors, prevColors);
+    rescale = false;
+
+    /*
+     * Shade the next effect on the thread pool. Each batch is measured right after it's
+     * shaded, while it's still in cache: the number of mapped pixels, their change
+     * since last frame, and their brightness at a scale of 1, which is where the
+     * iterations below start.
+     */
+
+    EffectThreadPool &pool = EffectThreadPool::shared();
+    Totals zero = { 0, 0, 0 };
+    threadTotals.assign(pool.getConcurrency(), zero);
+    frame = &f;
+
+    if (!f.pixels.empty()) {
+        pool.add(shadeRange, this, f.pixels.size());
+        pool.run();
+
+        if (!next.hasParallelPostProcess()) {
+            next.postProcessBatch(PixelBatch(f, 0, f.pixels.size()), &(*nextColors)[0], 0);
         }
     }
 
-    const float deltaAccumulatorFilterRate = 0.05;
+    unsigned count = 0;
+    float deltaAccumulator = 0;
+    for (unsigned i = 0; i < threadTotals.size(); i++) {
+        count += threadTotals[i].count;
+        deltaAccumulator += threadTotals[i].delta;
+    }
+
     totalBrightnessDelta += (deltaAccumulator - totalBrightnessDelta) * deltaAccumulatorFilterRate;
 
     if (!(totalBrightnessDelta >= 0)) {
@@ -191,24 +237,17 @@ inline void Brightness::beginFrame(const FrameInfo& f)
 
     for (; iter < maxIters; iter++) {
 
-        std::vector<Vec3>::iterator ci = nextColors->begin();
-        std::vector<Vec3>::iterator ce = nextColors->end();
-        PixelInfoIter pi = f.pixels.begin();
-        avg = 0;
-
-        for (;ci != ce; ++ci, ++pi) {
-            Vec3& rgb = *ci;
-
-            // Simulated linear brightness, using current scale
-            if (pi->isMapped()) {
-                for (unsigned i = 0; i < 3; i++) {
-                    float c = rgb[i] * scale;
-                    avg += gammaTable[std::max<int>(0, std::min<int>(gammaTableSize - 1, c * float(gammaTableSize - 1)))];
-                }
+        // Simulated linear brightness, using current scale. We have the first one already.
+        if (iter) {
+            trialScale = scale;
+            for (unsigned i = 0; i < threadTotals.size(); i++) {
+                threadTotals[i].average = 0;
             }
+            pool.add(averageRange, this, f.pixels.size());
+            pool.run();
         }
 
-        avg /= count;
+        avg = totalAverage() / count;
 
         float adjustment;
         if (avg < lowerLimit) {
@@ -236,6 +275,82 @@ inline void Brightness::beginFrame(const FrameInfo& f)
     latestAverage = avg;
 }
 
+inline float Brightness::linearBrightness(const Vec3& rgb, float scale) const
+{
+    float total = 0;
+    for (unsigned i = 0; i < 3; i++) {
+        float c = rgb[i] * scale;
+        total += gammaTable[std::max<int>(0, std::min<int>(gammaTableSize - 1, c * float(gammaTableSize - 1)))];
+    }
+    return total;
+}
+
+inline float Brightness::totalAverage()
+{
+    float total = 0;
+    for (unsigned i = 0; i < threadTotals.size(); i++) {
+        total += threadTotals[i].average;
+    }
+    return total;
+}
+
+inline void Brightness::shadeRange(void *context, unsigned begin, unsigned end)
+{
+    Brightness *self = (Brightness*) context;
+    const FrameInfo &f = *self->frame;
+    Vec3 *colors = &(*self->nextColors)[0];
+    const Vec3 *prev = &(*self->prevColors)[0];
+    PixelBatch batch(f, begin, end);
+
+    std::fill(colors + begin, colors + end, Vec3(0, 0, 0));
+    self->next.shadeBatch(batch, colors + begin);
+
+    unsigned thread = EffectThreadPool::currentThread();
+    if (self->next.hasParallelPostProcess()) {
+        self->next.postProcessBatch(batch, colors + begin, thread);
+    }
+
+    Totals t = { 0, 0, 0 };
+    for (unsigned i = begin; i < end; i++) {
+        if (f.isMapped(i)) {
+            t.count++;
+            t.delta += sqrlen(colors[i] - prev[i]);
+            t.average += self->linearBrightness(colors[i], 1.0f);
+        }
+    }
+
+    Totals &total = self->threadTotals[thread];
+    total.count += t.count;
+    total.delta += t.delta;
+    total.average += t.average;
+}
+
+inline void Brightness::averageRange(void *context, unsigned begin, unsigned end)
+{
+    Brightness *self = (Brightness*) context;
+    const FrameInfo &f = *self->frame;
+    const Vec3 *colors = &(*self->nextColors)[0];
+
+    float average = 0;
+    for (unsigned i = begin; i < end; i++) {
+        if (f.isMapped(i)) {
+            average += self->linearBrightness(colors[i], self->trialScale);
+        }
+    }
+
+    self->threadTotals[EffectThreadPool::currentThread()].average += average;
+}
+
+inline void Brightness::prepare(const FrameInfo& f)
+{
+    next.prepare(f);
+}
+
+inline bool Brightness::isFrameUnchanged(const FrameInfo&) const
+{
+    return unchanged;
+}
+
 inline bool Brightness::endFrame(const FrameInfo& f)
 {
     next.endFrame(f);
@@ -256,3 +371,15 @@ inline void Brightness::shader(Vec3& rgb, const PixelInfo& p) const
 {
     rgb = (*nextColors)[p.index] * currentScale;
 }
+
+inline void Brightness::shadeBatch(const PixelBatch& batch, Vec3* out) const
+{
+    if (!batch.count) {
+        return;
+    }
+
+    const Vec3 *src = &(*nextColors)[batch.pixels[0].index];
+    for (unsigned i = 0; i < batch.count; i++) {
+        out[i] = src[i] * currentScale;
+    }
+}
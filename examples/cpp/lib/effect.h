@@ -29,24 +29,35 @@
 
 #include <cmath>
 #include <unistd.h>
+#include <stdint.h>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
 #include <cstring>
 #include <cstdlib>
+#include <time.h>
 
 #include "nanoflann.h"  // Tiny KD-tree library
+#include "fixed.h"
 #include "svl/SVL.h"
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/document.h"
 
 class EffectRunner;
+class BinaryLayout;
+class LayoutCache;
 
 
 // Abstract base class for one LED effect
 class Effect {
 public:
     class PixelInfo;
+    class PixelBatch;
     class FrameInfo;
     class DebugInfo;
+    class PhaseTimes;
+    template <class Visitor> class VisitorResultSet;
 
     /*
      * Calculate a pixel value, using floating point RGB in the nominal range [0, 1].
@@ -61,6 +72,18 @@ public:
      */
     virtual void shader(Vec3& rgb, const PixelInfo& p) const = 0;
 
+    /*
+     * Optional batched version of shader(), for a run of consecutive pixels. Point
+     * coordinates come in separate arrays, so effects can calculate several pixels
+     * at once with SIMD instructions.
+     *
+     * 'out' has one color per pixel in the batch, each initialized to (0, 0, 0).
+     * Colors calculated for unmapped pixels are ignored, so a batch shader doesn't
+     * need to skip them. The same rules apply as for shader(). By default, this
+     * calls shader() for each mapped pixel.
+     */
+    virtual void shadeBatch(const PixelBatch& batch, Vec3* out) const;
+
     /*
      * Serialized post-processing on one pixel. This runs after shader(), once
      * per mapped pixel, with the ability to modify Effect data. This shoudln't
@@ -69,55 +92,201 @@ public:
      */
     virtual void postProcess(const Vec3& rgb, const PixelInfo& p);
 
+    /*
+     * Optional parallel post-processing. An effect that returns true from
+     * hasParallelPostProcess() gets postProcessBatch() calls instead of postProcess(),
+     * for disjoint batches on several threads at once. 'colors' are the batch's results
+     * from shadeBatch(), with unmapped pixels included.
+     *
+     * 'thread' is less than EffectThreadPool::getConcurrency(), and calls running at the
+     * same time never share one. Sum into one accumulator per thread, and add those up
+     * in endFrame(). By default, this calls postProcess() for each mapped pixel.
+     */
+    virtual bool hasParallelPostProcess() const;
+    virtual void postProcessBatch(const PixelBatch& batch, const Vec3* colors, unsigned thread);
+
+    /*
+     * Optional fixed point shading, for CPUs without fast floating point. An effect that
+     * returns true from hasFixedShader() is run by EffectRunner with shadeFixedBatch()
+     * instead of shadeBatch(), and its Q16 colors go straight to 8-bit with integer math.
+     * postProcess() isn't called on that path. By default, this calls shader() for each
+     * mapped pixel and converts. See FixedEffect, which does the reverse.
+     */
+    virtual bool hasFixedShader() const;
+    virtual void shadeFixedBatch(const PixelBatch& batch, FixedVec3* out) const;
+
+    /*
+     * Optional whole-frame shading, for effects that render somewhere other than this
+     * CPU, like GpuEffect. An effect that returns true from hasFrameShader() is run by
+     * EffectRunner with shadeFrame(), which writes finished 8-bit RGB for every pixel,
+     * in the frame's order, to 'rgb'. There's no postProcess() or dithering on that path.
+     * If shadeFrame() returns false, this frame is shaded with shadeBatch() instead.
+     */
+    virtual bool hasFrameShader() const;
+    virtual bool shadeFrame(const FrameInfo& f, uint8_t* rgb);
+
     // Optional begin/end frame callbacks
     virtual void beginFrame(const FrameInfo& f);
     virtual bool endFrame(const FrameInfo& f);
 
+    /*
+     * Optional, called once before EffectRunner::main() first plays the effect, to load
+     * assets or build indexes ahead of time. For every effect after the first, this runs
+     * on a background thread while the one before it plays. It mustn't touch anything
+     * that effect uses, but it may use EffectThreadPool::shared(), which is its own there.
+     */
+    virtual void prepare(const FrameInfo& f);
+
+    /*
+     * Optional, for effects that sit still. Called after beginFrame(); return true if
+     * every pixel would come out exactly as it did last frame. EffectRunner then skips
+     * shading and postProcess(), keeps its last frame, and doesn't send it again except
+     * for an occasional refresh. By default, every frame is new.
+     */
+    virtual bool isFrameUnchanged(const FrameInfo& f) const;
+
     // Optional callback, invoked once per second when verbose mode is enabled.
     // This can print parameters out to the console.
     virtual void debug(const DebugInfo& d);
 
+    // Optional, for effects made of other effects, like EffectMixer. Append the time
+    // spent on each one since the last call, and start those over. EffectRunner shows
+    // these along with its own times, in verbose mode and with -profile.
+    virtual void collectChildTimes(std::vector<PhaseTimes>& times);
+
 
     // Information about one LED pixel
     class PixelInfo {
     public:
         PixelInfo(unsigned index, const rapidjson::Value* layout);
 
+        // A pixel from a layout that isn't JSON, like a BinaryLayout
+        PixelInfo(unsigned index, Vec3 point, bool mapped);
+
         // Point coordinates
         Vec3 point;
 
-        // Index in the framebuffer
+        // Index in the frame's per-pixel arrays, like pointX and the colors being
+        // shaded. It's the index in the framebuffer too, unless the frame is in
+        // spatial order; see FrameInfo::setSpatialOrder().
         unsigned index;
 
-        // Parsed JSON for this pixel's layout
+        // Parsed JSON for this pixel's layout, or null if the layout wasn't JSON
         const rapidjson::Value* layout;
 
         // Is this pixel being used, or is it a placeholder?
         bool isMapped() const;
 
-        // Look up data from the JSON layout
+        // Look up data from the JSON layout. This searches by name every time;
+        // shaders should prefer an attribute handle from FrameInfo::getAttribute().
+        // Without JSON, everything reads as null.
         const rapidjson::Value& get(const char *attribute) const;
         double getNumber(const char *attribute) const;
         double getArrayNumber(const char *attribute, int index) const;
         Vec2 getVec2(const char *attribute) const;
         Vec3 getVec3(const char *attribute) const;
+
+    private:
+        bool mapped;
     };
 
     typedef std::vector<PixelInfo> PixelInfoVec;
     typedef std::vector<PixelInfo>::const_iterator PixelInfoIter;
 
+    // Handle for one numeric layout attribute, read from arrays parsed ahead of time.
+    // Missing attributes, components, or non-numeric values read as zero.
+    class Attribute {
+    public:
+        Attribute();
+
+        bool isValid() const;
+        Real getNumber(const PixelInfo& p, unsigned component = 0) const;
+        Vec2 getVec2(const PixelInfo& p) const;
+        Vec3 getVec3(const PixelInfo& p) const;
+
+    private:
+        friend class FrameInfo;
+        const Real *values;
+        unsigned components;
+    };
+
+    // A run of consecutive pixels from one frame, for shadeBatch()
+    class PixelBatch {
+    public:
+        PixelBatch(const FrameInfo& f, unsigned begin, unsigned end);
+
+        // Part of another batch, 'count' pixels from 'first'
+        PixelBatch(const PixelBatch& batch, unsigned first, unsigned count);
+
+        // Number of pixels in the batch
+        unsigned count;
+
+        // Point coordinates, one array per axis
+        const Real *x;
+        const Real *y;
+        const Real *z;
+
+        // The same coordinates in Q16 fixed point
+        const Fixed *fixedX;
+        const Fixed *fixedY;
+        const Fixed *fixedZ;
+
+        // Everything else about each pixel
+        const PixelInfo *pixels;
+
+        // Same as pixels[i].isMapped(), without touching the PixelInfo
+        bool isMapped(unsigned i) const;
+
+    private:
+        const FrameInfo &frame;
+        unsigned begin;
+    };
+
     // Information about one Effect frame
     class FrameInfo {
     public:
         FrameInfo();
         void init(const rapidjson::Value &layout);
 
+        // The same layout as another frame, to render it somewhere else at the same time
+        void init(const FrameInfo &other);
+
         // Seconds passed since the last frame
         float timeDelta;
 
         // Info for every pixel
         PixelInfoVec pixels;
 
+        // Point coordinates for every pixel, one array per axis, for PixelBatch
+        std::vector<Real> pointX, pointY, pointZ;
+
+        // The same, in Q16 fixed point
+        std::vector<Fixed> fixedX, fixedY, fixedZ;
+
+        // Point coordinates again, packed (x, y, z) per pixel, for the K-D tree
+        std::vector<Real> points;
+
+        // Is pixels[index] mapped? Reads a bitmask instead of the JSON layout.
+        bool isMapped(unsigned index) const;
+
+        /*
+         * Keep pixels in spatial order, along a Morton (Z-order) curve through the
+         * model, rather than in the layout's wiring order. Nearby pixels are then
+         * nearby in every per-pixel array, so shading batches and K-D tree visits
+         * stay in cache. Unmapped pixels go last. This reorders the current layout
+         * right away, and any layout loaded later.
+         */
+        void setSpatialOrder(bool enable = true);
+        bool isSpatialOrder() const;
+
+        // Where each pixel goes in the framebuffer, or empty when that's its index
+        std::vector<unsigned> outputIndex;
+
+        // Find a numeric attribute (a number or array of numbers) from the layout
+        // JSON, by name. Look this up once, in beginFrame() for example, and use the
+        // handle in shader(). Handles are valid until the layout changes.
+        Attribute getAttribute(const char *name) const;
+
         // Model axis-aligned bounding box
         Vec3 modelMin, modelMax;
 
@@ -139,8 +308,42 @@ public:
 
         void radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const;
 
+        // Calls visitor(index, dist2) for each point within 'radius', in no
+        // particular order. Unlike radiusSearch(), nothing is stored or allocated.
+        template <class Visitor> void forEachHit(Vec3 point, float radius, Visitor &visitor) const;
+
         IndexTree tree;
 
+    private:
+        friend class ::BinaryLayout;
+        friend class ::LayoutCache;
+
+        // One bit per pixel, set for mapped pixels
+        std::vector<uint32_t> mapped;
+
+        // Every numeric layout attribute, parsed by init(). Values for pixel
+        // 'i' start at values[i * components].
+        struct AttributeArray {
+            unsigned components;
+            std::vector<Real> values;
+        };
+        std::map<std::string, AttributeArray> attributes;
+
+        void parseAttributes(const rapidjson::Value &layout);
+
+        bool spatialOrder;
+
+        // Put the pixels in order after loading them, and set up everything else from them
+        void finishInit();
+        void initPoints();
+
+        // Move pixels[order[i]] and its attributes to index i
+        void reorder(const std::vector<unsigned> &order);
+        std::vector<unsigned> spatialPermutation() const;
+        std::vector<unsigned> wiringPermutation() const;
+        static uint32_t mortonSpread(uint32_t x);
+
+    public:
         // Adapter functions for the K-D tree implementation
 
         inline size_t kdtree_get_point_count() const {
@@ -148,14 +351,15 @@ public:
         }
 
         inline Real kdtree_distance(const Real *p1, const size_t idx_p2, size_t size) const {
-            Real d0 = p1[0] - pixels[idx_p2].point[0];
-            Real d1 = p1[1] - pixels[idx_p2].point[1];
-            Real d2 = p1[2] - pixels[idx_p2].point[2];
+            const Real *p2 = &points[idx_p2 * 3];
+            Real d0 = p1[0] - p2[0];
+            Real d1 = p1[1] - p2[1];
+            Real d2 = p1[2] - p2[2];
             return d0*d0 + d1*d1 + d2*d2;
         }
 
         Real kdtree_get_pt(const size_t idx, int dim) const {
-            return pixels[idx].point[dim];
+            return points[idx * 3 + dim];
         }
 
         template <class BBOX> bool kdtree_get_bbox(BBOX &bb) const {
@@ -177,6 +381,37 @@ public:
         EffectRunner &runner;
     };
 
+    // Time spent on each part of rendering some number of frames, in nanoseconds
+    class PhaseTimes {
+    public:
+        PhaseTimes();
+        void clear();
+
+        unsigned frames;
+        unsigned long long beginFrame;
+        unsigned long long shading;         // Summed over pool threads, when it runs on the pool
+        unsigned long long postProcess;
+        unsigned long long endFrame;
+
+        // Monotonic clock for measuring them
+        static unsigned long long now();
+    };
+
+    // nanoflann result set that hands each hit within a radius straight to a
+    // visitor, called as visitor(index, dist2), instead of storing it.
+    template <class Visitor> class VisitorResultSet {
+    public:
+        VisitorResultSet(Real radius2, Visitor &visitor) : radius2(radius2), visitor(visitor) {}
+
+        bool full() const { return true; }
+        Real worstDist() const { return radius2; }
+        void addPoint(Real dist2, size_t index) { visitor(index, dist2); }
+
+    private:
+        Real radius2;
+        Visitor &visitor;
+    };
+
     Effect(): number_frames(0), frame_count(0) {}
     unsigned long number_frames;
     unsigned long frame_count;
@@ -189,19 +424,24 @@ public:
 
 
 inline Effect::PixelInfo::PixelInfo(unsigned index, const rapidjson::Value* layout)
-    : index(index), layout(layout)
+    : index(index), layout(layout), mapped(layout && layout->IsObject())
 {
     point = isMapped() ? getVec3("point") : Vec3(0, 0, 0);
 }
 
+inline Effect::PixelInfo::PixelInfo(unsigned index, Vec3 point, bool mapped)
+    : point(point), index(index), layout(0), mapped(mapped)
+{}
+
 inline bool Effect::PixelInfo::isMapped() const
 {
-    return layout && layout->IsObject();
+    return mapped;
 }
 
 inline const rapidjson::Value& Effect::PixelInfo::get(const char *attribute) const
 {
-    return (*layout)[attribute];
+    static const rapidjson::Value null;
+    return layout ? (*layout)[attribute] : null;
 }
 
 inline double Effect::PixelInfo::getNumber(const char *attribute) const
@@ -235,8 +475,39 @@ inline Vec3 Effect::PixelInfo::getVec3(const char *attribute) const
                  getArrayNumber(attribute, 2) );
 }
 
+inline Effect::PixelBatch::PixelBatch(const FrameInfo& f, unsigned begin, unsigned end)
+    : count(end - begin),
+      x(&f.pointX[0] + begin),
+      y(&f.pointY[0] + begin),
+      z(&f.pointZ[0] + begin),
+      fixedX(&f.fixedX[0] + begin),
+      fixedY(&f.fixedY[0] + begin),
+      fixedZ(&f.fixedZ[0] + begin),
+      pixels(&f.pixels[0] + begin),
+      frame(f),
+      begin(begin)
+{}
+
+inline Effect::PixelBatch::PixelBatch(const PixelBatch& batch, unsigned first, unsigned count)
+    : count(count),
+      x(batch.x + first),
+      y(batch.y + first),
+      z(batch.z + first),
+      fixedX(batch.fixedX + first),
+      fixedY(batch.fixedY + first),
+      fixedZ(batch.fixedZ + first),
+      pixels(batch.pixels + first),
+      frame(batch.frame),
+      begin(batch.begin + first)
+{}
+
+inline bool Effect::PixelBatch::isMapped(unsigned i) const
+{
+    return frame.isMapped(begin + i);
+}
+
 inline Effect::FrameInfo::FrameInfo()
-    : timeDelta(0), tree(3, *this)
+    : timeDelta(0), tree(3, *this), spatialOrder(false)
 {}
 
 inline void Effect::FrameInfo::init(const rapidjson::Value &layout)
@@ -251,6 +522,53 @@ inline void Effect::FrameInfo::init(const rapidjson::Value &layout)
         pixels.push_back(p);
     }
 
+    parseAttributes(layout);
+    finishInit();
+}
+
+inline void Effect::FrameInfo::init(const FrameInfo &other)
+{
+    // Not timeDelta, which is the one thing the other frame changes as it goes
+    timeDelta = 0;
+    pixels = other.pixels;
+    attributes = other.attributes;
+    outputIndex = other.outputIndex;
+    spatialOrder = other.spatialOrder;
+    initPoints();
+}
+
+inline void Effect::FrameInfo::finishInit()
+{
+    outputIndex.clear();
+    if (spatialOrder) {
+        reorder(spatialPermutation());
+    }
+    initPoints();
+}
+
+inline void Effect::FrameInfo::initPoints()
+{
+    pointX.resize(pixels.size());
+    pointY.resize(pixels.size());
+    pointZ.resize(pixels.size());
+    fixedX.resize(pixels.size());
+    fixedY.resize(pixels.size());
+    fixedZ.resize(pixels.size());
+    points.resize(pixels.size() * 3);
+    mapped.assign((pixels.size() + 31) / 32, 0);
+
+    for (unsigned i = 0; i < pixels.size(); i++) {
+        pointX[i] = points[i*3 + 0] = pixels[i].point[0];
+        pointY[i] = points[i*3 + 1] = pixels[i].point[1];
+        pointZ[i] = points[i*3 + 2] = pixels[i].point[2];
+        fixedX[i] = fixed_from_float(pointX[i]);
+        fixedY[i] = fixed_from_float(pointY[i]);
+        fixedZ[i] = fixed_from_float(pointZ[i]);
+        if (pixels[i].isMapped()) {
+            mapped[i / 32] |= 1u << (i % 32);
+        }
+    }
+
     // Calculate min/max
 
     modelMin = modelMax = pixels[0].point;
@@ -273,6 +591,219 @@ inline void Effect::FrameInfo::init(const rapidjson::Value &layout)
     tree.buildIndex();
 }
 
+inline bool Effect::FrameInfo::isMapped(unsigned index) const
+{
+    return (mapped[index / 32] >> (index % 32)) & 1;
+}
+
+inline void Effect::FrameInfo::setSpatialOrder(bool enable)
+{
+    if (enable == spatialOrder) {
+        return;
+    }
+    spatialOrder = enable;
+
+    if (!pixels.empty()) {
+        reorder(enable ? spatialPermutation() : wiringPermutation());
+        initPoints();
+    }
+}
+
+inline bool Effect::FrameInfo::isSpatialOrder() const
+{
+    return spatialOrder;
+}
+
+inline void Effect::FrameInfo::reorder(const std::vector<unsigned> &order)
+{
+    PixelInfoVec oldPixels;
+    oldPixels.swap(pixels);
+    pixels.reserve(order.size());
+
+    std::vector<unsigned> newOutputIndex(order.size());
+    bool identity = true;
+
+    for (unsigned i = 0; i < order.size(); i++) {
+        PixelInfo p = oldPixels[order[i]];
+        p.index = i;
+        pixels.push_back(p);
+
+        newOutputIndex[i] = outputIndex.empty() ? order[i] : outputIndex[order[i]];
+        identity = identity && newOutputIndex[i] == i;
+    }
+
+    if (identity) {
+        outputIndex.clear();
+    } else {
+        outputIndex.swap(newOutputIndex);
+    }
+
+    for (std::map<std::string, AttributeArray>::iterator a = attributes.begin(), e = attributes.end(); a != e; ++a) {
+        unsigned components = a->second.components;
+        std::vector<Real> values(a->second.values.size());
+        for (unsigned i = 0; i < order.size(); i++) {
+            for (unsigned j = 0; j < components; j++) {
+                values[i * components + j] = a->second.values[order[i] * components + j];
+            }
+        }
+        a->second.values.swap(values);
+    }
+}
+
+inline uint32_t Effect::FrameInfo::mortonSpread(uint32_t x)
+{
+    // Spread the low 10 bits out to every third bit
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+inline std::vector<unsigned> Effect::FrameInfo::spatialPermutation() const
+{
+    // Bounds of the mapped pixels only, since unmapped ones sit at the origin
+
+    Vec3 low(0, 0, 0), high(0, 0, 0);
+    bool any = false;
+    for (unsigned i = 0; i < pixels.size(); i++) {
+        if (pixels[i].isMapped()) {
+            for (unsigned j = 0; j < 3; j++) {
+                low[j] = any ? std::min(low[j], pixels[i].point[j]) : pixels[i].point[j];
+                high[j] = any ? std::max(high[j], pixels[i].point[j]) : pixels[i].point[j];
+            }
+            any = true;
+        }
+    }
+
+    // Sort by Morton code, with 10 bits per axis, then by framebuffer index. Unmapped
+    // pixels get a code past any real one.
+
+    std::vector<std::pair<uint64_t, unsigned> > keys(pixels.size());
+    for (unsigned i = 0; i < pixels.size(); i++) {
+        uint64_t code = 1 << 30;
+        if (pixels[i].isMapped()) {
+            uint32_t q[3];
+            for (unsigned j = 0; j < 3; j++) {
+                Real size = high[j] - low[j];
+                q[j] = size > 0 ? std::min<Real>(1023, (pixels[i].point[j] - low[j]) * (1024 / size)) : 0;
+            }
+            code = mortonSpread(q[0]) | (mortonSpread(q[1]) << 1) | (mortonSpread(q[2]) << 2);
+        }
+        unsigned output = outputIndex.empty() ? i : outputIndex[i];
+        keys[i] = std::make_pair((code << 32) | output, i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<unsigned> order(pixels.size());
+    for (unsigned i = 0; i < pixels.size(); i++) {
+        order[i] = keys[i].second;
+    }
+    return order;
+}
+
+inline std::vector<unsigned> Effect::FrameInfo::wiringPermutation() const
+{
+    std::vector<unsigned> order(pixels.size());
+    for (unsigned i = 0; i < pixels.size(); i++) {
+        order[outputIndex.empty() ? i : outputIndex[i]] = i;
+    }
+    return order;
+}
+
+inline void Effect::FrameInfo::parseAttributes(const rapidjson::Value &layout)
+{
+    attributes.clear();
+
+    // Find every numeric attribute, and the most components it has on any pixel
+
+    for (unsigned i = 0; i < layout.Size(); i++) {
+        const rapidjson::Value &pixel = layout[i];
+        if (!pixel.IsObject()) {
+            continue;
+        }
+        for (rapidjson::Value::ConstMemberIterator m = pixel.MemberBegin(), e = pixel.MemberEnd(); m != e; ++m) {
+            unsigned components = m->value.IsNumber() ? 1 : m->value.IsArray() ? m->value.Size() : 0;
+            if (components) {
+                std::map<std::string, AttributeArray>::iterator a = attributes.find(m->name.GetString());
+                if (a == attributes.end()) {
+                    attributes[m->name.GetString()].components = components;
+                } else {
+                    a->second.components = std::max(a->second.components, components);
+                }
+            }
+        }
+    }
+
+    // Copy values into each attribute's array
+
+    for (std::map<std::string, AttributeArray>::iterator a = attributes.begin(), e = attributes.end(); a != e; ++a) {
+        a->second.values.assign(layout.Size() * a->second.components, 0);
+    }
+
+    for (unsigned i = 0; i < layout.Size(); i++) {
+        const rapidjson::Value &pixel = layout[i];
+        if (!pixel.IsObject()) {
+            continue;
+        }
+        for (rapidjson::Value::ConstMemberIterator m = pixel.MemberBegin(), e = pixel.MemberEnd(); m != e; ++m) {
+            std::map<std::string, AttributeArray>::iterator a = attributes.find(m->name.GetString());
+            if (a == attributes.end()) {
+                continue;
+            }
+            Real *values = &a->second.values[i * a->second.components];
+
+            if (m->value.IsNumber()) {
+                values[0] = m->value.GetDouble();
+            } else if (m->value.IsArray()) {
+                for (unsigned j = 0; j < m->value.Size(); j++) {
+                    const rapidjson::Value &n = m->value[j];
+                    values[j] = n.IsNumber() ? n.GetDouble() : 0.0;
+                }
+            }
+        }
+    }
+}
+
+inline Effect::Attribute Effect::FrameInfo::getAttribute(const char *name) const
+{
+    Attribute handle;
+    std::map<std::string, AttributeArray>::const_iterator a = attributes.find(name);
+    if (a != attributes.end() && !a->second.values.empty()) {
+        handle.values = &a->second.values[0];
+        handle.components = a->second.components;
+    }
+    return handle;
+}
+
+inline Effect::Attribute::Attribute()
+    : values(0), components(0)
+{}
+
+inline bool Effect::Attribute::isValid() const
+{
+    return values != 0;
+}
+
+inline Real Effect::Attribute::getNumber(const PixelInfo& p, unsigned component) const
+{
+    return component < components ? values[p.index * components + component] : 0;
+}
+
+inline Vec2 Effect::Attribute::getVec2(const PixelInfo& p) const
+{
+    return Vec2( getNumber(p, 0),
+                 getNumber(p, 1) );
+}
+
+inline Vec3 Effect::Attribute::getVec3(const PixelInfo& p) const
+{
+    return Vec3( getNumber(p, 0),
+                 getNumber(p, 1),
+                 getNumber(p, 2) );
+}
+
 inline Vec3 Effect::FrameInfo::modelCenter() const
 {
     return (modelMin + modelMax) * 0.5;
@@ -302,11 +833,38 @@ inline void Effect::FrameInfo::radiusSearch(ResultSet_t& hits, Vec3 point, float
     tree.radiusSearch(&point[0], radius * radius, hits, params);
 }
 
+template <class Visitor>
+inline void Effect::FrameInfo::forEachHit(Vec3 point, float radius, Visitor &visitor) const
+{
+    VisitorResultSet<Visitor> results(radius * radius, visitor);
+    tree.findNeighbors(results, &point[0], nanoflann::SearchParams());
+}
+
 inline Effect::DebugInfo::DebugInfo(EffectRunner &runner)
     : runner(runner) {}
 
+inline Effect::PhaseTimes::PhaseTimes()
+{
+    clear();
+}
+
+inline void Effect::PhaseTimes::clear()
+{
+    frames = 0;
+    beginFrame = shading = postProcess = endFrame = 0;
+}
+
+inline unsigned long long Effect::PhaseTimes::now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
 
 inline void Effect::beginFrame( const FrameInfo & ) {}
+inline bool Effect::isFrameUnchanged( const FrameInfo & ) const { return false; }
+inline void Effect::prepare( const FrameInfo & ) {}
 inline bool Effect::endFrame( const FrameInfo & )
 {
    if( number_frames )
@@ -320,7 +878,44 @@ inline bool Effect::endFrame( const FrameInfo & )
    return false;
 }
 inline void Effect::debug( const DebugInfo & ) {}
+inline void Effect::collectChildTimes( std::vector<PhaseTimes>& ) {}
 inline void Effect::postProcess( const Vec3&, const PixelInfo& ) {}
+inline bool Effect::hasParallelPostProcess() const { return false; }
+
+inline void Effect::postProcessBatch(const PixelBatch& batch, const Vec3* colors, unsigned)
+{
+    for (unsigned i = 0; i < batch.count; i++) {
+        if (batch.isMapped(i)) {
+            postProcess(colors[i], batch.pixels[i]);
+        }
+    }
+}
+
+inline void Effect::shadeBatch(const PixelBatch& batch, Vec3* out) const
+{
+    for (unsigned i = 0; i < batch.count; i++) {
+        if (batch.isMapped(i)) {
+            shader(out[i], batch.pixels[i]);
+        }
+    }
+}
+
+inline bool Effect::hasFixedShader() const { return false; }
+
+inline void Effect::shadeFixedBatch(const PixelBatch& batch, FixedVec3* out) const
+{
+    for (unsigned i = 0; i < batch.count; i++) {
+        if (batch.isMapped(i)) {
+            Vec3 rgb(0, 0, 0);
+            shader(rgb, batch.pixels[i]);
+            out[i] = FixedVec3(rgb);
+        }
+    }
+}
+
+inline bool Effect::hasFrameShader() const { return false; }
+
+inline bool Effect::shadeFrame(const FrameInfo&, uint8_t*) { return false; }
 
 
 static inline float sq(float a)
@@ -34,17 +34,23 @@
 
 #pragma once
 
-#include <queue>
+#include <algorithm>
 #include <vector>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #include "effect.h"
-#include "tinythread.h"
+#include "effect_thread_pool.h"
 
 
 class EffectMixer : public Effect {
 public:
     EffectMixer();
-    ~EffectMixer();
 
     // Managing channels
     int numChannels();
@@ -57,57 +63,64 @@ public:
     void setFader(int channel, float fader);
     void setFader(Effect *effect, float fader);
 
-    // Set number of threads. By default, we auto-detect
+    // Set number of threads in the shared pool. By default, we auto-detect
     void setConcurrency(unsigned numThreads);
 
+    /*
+     * Channels with a fader below 'threshold' (but above zero) only shade once every
+     * 'frameInterval' frames, and mix in their last colors in between. During a
+     * crossfade, the fading effect costs a fraction of a full render once it's faint
+     * enough not to notice. Every channel still sees beginFrame() and endFrame() on
+     * each frame. Off by default, with a threshold of zero.
+     */
+    void setLowFaderRendering(float threshold, unsigned frameInterval = 2);
+
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
+    virtual void shadeBatch(const PixelBatch& batch, Vec3* out) const;
     virtual void postProcess(const Vec3& rgb, const PixelInfo& p);
+    virtual bool hasParallelPostProcess() const;
+    virtual void postProcessBatch(const PixelBatch& batch, const Vec3* colors, unsigned thread);
     virtual void beginFrame(const FrameInfo& f);
     virtual bool endFrame(const FrameInfo& f);
     virtual void debug(const DebugInfo& d);
+    virtual void prepare(const FrameInfo& f);
+
+    // Unchanged if no channel was shaded this frame, and no fader or channel changed.
+    // Channels that report an unchanged frame aren't shaded.
+    virtual bool isFrameUnchanged(const FrameInfo& f) const;
+
+    // One entry per channel. Shading time is summed over pool threads. Of post-processing,
+    // only postProcessBatch() is timed; serial postProcess() counts towards the mixer's.
+    virtual void collectChildTimes(std::vector<PhaseTimes>& times);
 
 private:
     struct Channel {
         Effect *effect;
         float fader;
         std::vector<Vec3> colors;
+        unsigned framesSkipped;     // Since 'colors' was last shaded
+        bool colorsCurrent;         // 'colors' is from the effect's last frame
+        PhaseTimes times;           // Since the last collectChildTimes()
     };
 
-    struct Task {
-        Channel *channel;
-        const Effect::PixelInfo *pixelInfo;
-        unsigned begin;
-        unsigned end;
-    };
+    float lowFaderThreshold;
+    unsigned lowFaderInterval;
 
-    struct ThreadContext {
-        EffectMixer *mixer;
-        tthread::thread *thread;
-        bool runFlag;
-    };
+    // Set when 'mixed' needs blending again, even if no channel is shaded
+    bool channelsChanged;
+    bool unchanged;
+
+    bool needsShading(Channel &c, const FrameInfo& f);
 
     // Channels only to be modified when threads are idle
     std::vector<Channel> channels;
 
-    // Running threads
-    std::vector<ThreadContext*> threads;
-    unsigned numThreadsConfigured;
-
-    // Lock rank: Acquire taskLock prior to completeLock.
-
-    // Task queue
-    tthread::mutex taskLock;
-    tthread::condition_variable taskCond;
-    std::queue<Task> tasks;
+    // Every channel's colors, scaled by its fader and summed. Blended once per frame
+    // by beginFrame(), in long runs through each channel buffer.
+    std::vector<Vec3> mixed;
 
-    // Completion status
-    tthread::mutex completeLock;
-    tthread::condition_variable completeCond;
-    unsigned pendingTasks;
-
-    void changeNumberOfThreads(unsigned count);
-    static void threadFunc(void *context);
-    void worker(ThreadContext &context);
+    static void blendRange(void *context, unsigned begin, unsigned end);
+    static void blend(Real *dest, const Real *src, float fader, unsigned count, bool first);
 };
 
 
@@ -117,18 +130,21 @@ private:
 
 
 inline EffectMixer::EffectMixer()
-    : numThreadsConfigured(0)   // Auto-detect
+    : lowFaderThreshold(0),
+      lowFaderInterval(1),
+      channelsChanged(true),
+      unchanged(false)
 {}
 
-inline EffectMixer::~EffectMixer()
+inline void EffectMixer::setLowFaderRendering(float threshold, unsigned frameInterval)
 {
-    changeNumberOfThreads(0);
+    lowFaderThreshold = threshold;
+    lowFaderInterval = std::max(1u, frameInterval);
 }
 
 inline void EffectMixer::setConcurrency(unsigned numThreads)
 {
-    // Threads created/destroyed lazily
-    numThreadsConfigured = numThreads;
+    EffectThreadPool::shared().setConcurrency(numThreads);
 }
 
 inline int EffectMixer::numChannels()
@@ -142,6 +158,9 @@ inline int EffectMixer::add(Effect *effect, float fader)
 
     c.effect = effect;
     c.fader = fader;
+    c.framesSkipped = 0;
+    c.colorsCurrent = false;
+    channelsChanged = true;
 
     int index = channels.size();
     channels.push_back(c);
@@ -151,6 +170,7 @@ inline int EffectMixer::add(Effect *effect, float fader)
 inline void EffectMixer::clear()
 {
     channels.clear();
+    channelsChanged = true;
 }
 
 inline void EffectMixer::set(Effect *effect)
@@ -173,6 +193,7 @@ inline void EffectMixer::remove(int index)
 {
     if (index >= 0 && index < (int)channels.size()) {
         channels.erase(channels.begin() + index);
+        channelsChanged = true;
     }
 }
 
@@ -183,8 +204,9 @@ inline void EffectMixer::remove(Effect *effect)
 
 inline void EffectMixer::setFader(int channel, float fader)
 {
-    if (channel >= 0 && channel < (int)channels.size()) {
+    if (channel >= 0 && channel < (int)channels.size() && channels[channel].fader != fader) {
         channels[channel].fader = fader;
+        channelsChanged = true;
     }
 }
 
@@ -195,19 +217,84 @@ inline void EffectMixer::setFader(Effect *effect, float fader)
 
 inline void EffectMixer::shader(Vec3& rgb, const PixelInfo& p) const
 {
-    // Mix together results from channel buffers.
-    // Assumes the channel's color buffer has already been set up and sized by beginFrame().
+    // Channels were already mixed by beginFrame()
+    rgb = mixed[p.index];
+}
 
-    Vec3 total(0,0,0);
+inline void EffectMixer::shadeBatch(const PixelBatch& batch, Vec3* out) const
+{
+    if (batch.count) {
+        const Vec3 *src = &mixed[batch.pixels[0].index];
+        std::copy(src, src + batch.count, out);
+    }
+}
 
-    for (std::vector<Channel>::const_iterator i = channels.begin(), e = channels.end(); i != e; ++i) {
-        float f = i->fader;
-        if (f) {
-            total += i->colors[p.index] * f;
+inline void EffectMixer::blendRange(void *context, unsigned begin, unsigned end)
+{
+    // Mix pixels [begin, end) from every active channel, one channel at a time
+
+    EffectMixer *self = (EffectMixer*) context;
+    Real *dest = &self->mixed[begin][0];
+    unsigned count = (end - begin) * 3;
+    bool first = true;
+
+    for (std::vector<Channel>::const_iterator i = self->channels.begin(), e = self->channels.end(); i != e; ++i) {
+        if (i->fader) {
+            blend(dest, &i->colors[begin][0], i->fader, count, first);
+            first = false;
         }
     }
 
-    rgb = total;
+    if (first) {
+        memset(dest, 0, count * sizeof(Real));
+    }
+}
+
+inline void EffectMixer::blend(Real *dest, const Real *src, float fader, unsigned count, bool first)
+{
+    // dest = src * fader, or dest += src * fader if this isn't the first channel
+
+    unsigned j = 0;
+
+#if defined(VL_DOUBLE)
+    // Scalar only
+#elif defined(__SSE2__)
+    const __m128 f = _mm_set1_ps(fader);
+    if (first) {
+        for (; j + 8 <= count; j += 8) {
+            _mm_storeu_ps(dest + j + 0, _mm_mul_ps(_mm_loadu_ps(src + j + 0), f));
+            _mm_storeu_ps(dest + j + 4, _mm_mul_ps(_mm_loadu_ps(src + j + 4), f));
+        }
+    } else {
+        for (; j + 8 <= count; j += 8) {
+            _mm_storeu_ps(dest + j + 0, _mm_add_ps(_mm_loadu_ps(dest + j + 0), _mm_mul_ps(_mm_loadu_ps(src + j + 0), f)));
+            _mm_storeu_ps(dest + j + 4, _mm_add_ps(_mm_loadu_ps(dest + j + 4), _mm_mul_ps(_mm_loadu_ps(src + j + 4), f)));
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const float32x4_t f = vdupq_n_f32(fader);
+    if (first) {
+        for (; j + 8 <= count; j += 8) {
+            vst1q_f32(dest + j + 0, vmulq_f32(vld1q_f32(src + j + 0), f));
+            vst1q_f32(dest + j + 4, vmulq_f32(vld1q_f32(src + j + 4), f));
+        }
+    } else {
+        for (; j + 8 <= count; j += 8) {
+            vst1q_f32(dest + j + 0, vmlaq_f32(vld1q_f32(dest + j + 0), vld1q_f32(src + j + 0), f));
+            vst1q_f32(dest + j + 4, vmlaq_f32(vld1q_f32(dest + j + 4), vld1q_f32(src + j + 4), f));
+        }
+    }
+#endif
+
+    if (first) {
+        for (; j < count; j++) {
+            dest[j] = src[j] * fader;
+        }
+    } else {
+        for (; j < count; j++) {
+            dest[j] += src[j] * fader;
+        }
+    }
 }
 
 inline void EffectMixer::postProcess(const Vec3& rgb, const PixelInfo& p)
@@ -223,11 +310,44 @@ inline void EffectMixer::postProcess(const Vec3& rgb, const PixelInfo& p)
     }
 }
 
+inline bool EffectMixer::hasParallelPostProcess() const
+{
+    // Only if every active channel can. One serial channel keeps the whole mixer serial.
+
+    for (std::vector<Channel>::const_iterator i = channels.begin(), e = channels.end(); i != e; ++i) {
+        if (i->fader && !i->effect->hasParallelPostProcess()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void EffectMixer::postProcessBatch(const PixelBatch& batch, const Vec3*, unsigned thread)
+{
+    if (!batch.count) {
+        return;
+    }
+
+    unsigned begin = batch.pixels[0].index;
+    for (std::vector<Channel>::iterator i = channels.begin(), e = channels.end(); i != e; ++i) {
+        Channel &c = *i;
+        if (c.fader) {
+            unsigned long long start = PhaseTimes::now();
+            c.effect->postProcessBatch(batch, &c.colors[begin], thread);
+            __atomic_add_fetch(&c.times.postProcess, PhaseTimes::now() - start, __ATOMIC_RELAXED);
+        }
+    }
+}
+
 inline bool EffectMixer::endFrame(const FrameInfo& f)
 {
     bool lastFrame = false;
     for (unsigned i = 0; i < channels.size(); ++i) {
-        lastFrame |= channels[i].effect->endFrame(f);
+        Channel &c = channels[i];
+        unsigned long long start = PhaseTimes::now();
+        lastFrame |= c.effect->endFrame(f);
+        c.times.endFrame += PhaseTimes::now() - start;
+        c.times.frames++;
     }
     return lastFrame | Effect::endFrame(f);
 }
@@ -239,143 +359,88 @@ inline void EffectMixer::debug(const DebugInfo& d)
     }
 }
 
-inline void EffectMixer::changeNumberOfThreads(unsigned count)
+inline void EffectMixer::prepare(const FrameInfo& f)
 {
-    while (threads.size() < numThreadsConfigured) {
-        // Create thread
-        ThreadContext *tc = new ThreadContext;
-        tc->mixer = this;
-        tc->runFlag = true;
-        tc->thread = new tthread::thread(threadFunc, tc);
-        threads.push_back(tc);
+    for (unsigned i = 0; i < channels.size(); ++i) {
+        channels[i].effect->prepare(f);
     }
+}
 
-    while (threads.size() > numThreadsConfigured) {
-        // Signal a thread to stop
-        ThreadContext *tc = threads.back();
-        threads.pop_back();
-
-        tc->runFlag = false;
-        taskCond.notify_all();
+inline bool EffectMixer::isFrameUnchanged(const FrameInfo&) const
+{
+    return unchanged;
+}
 
-        tc->thread->join();
-        delete tc->thread;
-        delete tc;
+inline void EffectMixer::collectChildTimes(std::vector<PhaseTimes>& times)
+{
+    for (unsigned i = 0; i < channels.size(); ++i) {
+        times.push_back(channels[i].times);
+        channels[i].times.clear();
     }
 }
 
-inline void EffectMixer::beginFrame(const FrameInfo& f)
+inline bool EffectMixer::needsShading(Channel &c, const FrameInfo& f)
 {
-    // Auto-detect thread count
-    if (numThreadsConfigured == 0) {
-        numThreadsConfigured = tthread::thread::hardware_concurrency();
+    if (!c.fader) {
+        // Colors go stale while we're off, so shade right away once the fader comes up
+        c.framesSkipped = lowFaderInterval;
+        c.colorsCurrent = false;
+        return false;
     }
 
-    // Create/destroy threads, to reach the requested pool size
-    changeNumberOfThreads(numThreadsConfigured);
+    // Keep the colors from an effect that hasn't changed
+    if (c.colorsCurrent && c.colors.size() == f.pixels.size() && c.effect->isFrameUnchanged(f)) {
+        return false;
+    }
 
-    /*
-     * Setup for each effect:
-     *   - Send a beginFrame() message
-     *   - Keep track of the total pixel count, for sizing our batches
-     *   - Size our channel's color buffer
-     */
+    // Faint channels reuse their colors for a few frames, if they have any yet
+    if (c.fader < lowFaderThreshold && c.colors.size() == f.pixels.size()
+        && ++c.framesSkipped < lowFaderInterval) {
+        c.colorsCurrent = false;
+        return false;
+    }
 
-    unsigned totalPixels = 0;
-    unsigned modelPixels = f.pixels.size();
+    c.framesSkipped = 0;
+    c.colorsCurrent = true;
+    return true;
+}
 
+inline void EffectMixer::beginFrame(const FrameInfo& f)
+{
+    // Send a beginFrame() message to every effect first. They may use the thread pool themselves.
     for (unsigned i = 0; i < channels.size(); ++i) {
         Channel &c = channels[i];
-
+        unsigned long long start = PhaseTimes::now();
         c.effect->beginFrame(f);
-        c.colors.resize(modelPixels);
-        if (c.fader) {
-            totalPixels += modelPixels;
-        }
+        c.times.beginFrame += PhaseTimes::now() - start;
     }
 
-    // Try to size the batches so we give each CPU a few tasks, so that if our
-    // workload is asymmetric we'll end up with room to rebalance.
-
-    unsigned batchSize = 1 + totalPixels / (numThreadsConfigured * 3);
-
-    // Create tasks for each active effect, and wait for our thread pool to process them.
-    // Note our lock ranking requirements: taskLock acquired before completeLock.
-
-    taskLock.lock();
-    unsigned numTasks = 0;
-
+    // Queue up shading for each active effect, into the channel's color buffer
+    bool shading = false;
     for (unsigned i = 0; i < channels.size(); ++i) {
         Channel &c = channels[i];
-        if (c.fader) {
-            Task t;
-            t.channel = &c;
-            t.pixelInfo = &f.pixels[0];
-            t.begin = 0;
-
-            while (t.begin < modelPixels) {
-                t.end = std::min<unsigned>(modelPixels, t.begin + batchSize);
-                tasks.push(t);
-                t.begin = t.end;
-                numTasks++;
-            }
+        if (needsShading(c, f)) {
+            EffectThreadPool::shared().add(c.effect, f, c.colors, &c.times.shading);
+            shading = true;
+        } else {
+            c.colors.resize(f.pixels.size());
         }
     }
 
-    completeLock.lock();
-    pendingTasks = numTasks;
-    taskCond.notify_all();
-    taskLock.unlock();
-
-    while (pendingTasks) {
-        completeCond.wait(completeLock);
+    // Nothing to mix that we haven't already
+    unchanged = !shading && !channelsChanged && mixed.size() == f.pixels.size();
+    if (unchanged) {
+        return;
     }
+    channelsChanged = false;
 
-    completeLock.unlock();
-}
-
-inline void EffectMixer::threadFunc(void *context)
-{
-    ThreadContext* c = (ThreadContext*) context;
-    c->mixer->worker(*c);
-}
-
-inline void EffectMixer::worker(ThreadContext &context)
-{
-    while (true) {
-        Task currentTask;
-
-        // Dequeue a task
-        taskLock.lock();
-        while (tasks.empty()) {
-            if (!context.runFlag) {
-                // Thread exiting
-                return;
-            }
-            taskCond.wait(taskLock);
-        }
-        currentTask = tasks.front();
-        tasks.pop();
-        taskLock.unlock();
-
-        // Process a block of pixels
-
-        Channel &c = *currentTask.channel;
-        Effect *effect = c.effect;
-
-        for (unsigned i = currentTask.begin; i != currentTask.end; ++i) {
-            const Effect::PixelInfo &p = currentTask.pixelInfo[i];
-            if (p.isMapped()) {
-                Vec3 color(0, 0, 0);
-                effect->shader(color, p);
-                c.colors[i] = color;
-            }
-        }
+    // Wait for the thread pool to process them
+    EffectThreadPool::shared().run();
 
-        // Completion notification
-        completeLock.lock();
-        pendingTasks--;
-        completeCond.notify_all();
-        completeLock.unlock();
+    // Mix the channels together, so shading the mixer itself is only a copy
+    mixed.resize(f.pixels.size());
+    if (!mixed.empty()) {
+        EffectThreadPool::shared().add(blendRange, this, mixed.size());
+        EffectThreadPool::shared().run();
     }
 }
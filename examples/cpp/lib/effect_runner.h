@@ -36,8 +36,22 @@
 #include <cstring>
 #include <cstdlib>
 #include <ctime>
+#include <cerrno>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #include "effect.h"
+#include "effect_thread_pool.h"
+#include "binary_layout.h"
+#include "layout_cache.h"
 #include "opc_client.h"
 #include "svl/SVL.h"
 #include "rapidjson/rapidjson.h"
@@ -48,14 +62,85 @@
 class EffectRunner {
 public:
     EffectRunner();
+    virtual ~EffectRunner();
 
     bool setServer(const char *hostport);
+
+    /*
+     * Send a range of pixels to one OPC channel, on the server from setServer() if
+     * 'hostport' is empty, or on any other server. Use this to split big layouts, or
+     * to drive several servers from one renderer. With no outputs, the whole layout
+     * goes to channel 0 of the default server. If it's too big for one OPC message,
+     * it's split across channels 1, 2, 3 and so on.
+     */
+    bool addOutput(const char *hostport, unsigned channel, unsigned firstPixel, unsigned numPixels);
+
+    // Send from a background thread per server, so servers are sent to in parallel
+    // and rendering never waits on the network. See OPCClient::setAsync().
+    void setAsync(bool enable = true);
+
+    // Load a JSON layout, or a binary one from BinaryLayout::write(). Binary layouts
+    // load much faster, but getLayout() is empty and so is PixelInfo::layout.
     bool setLayout(const char *filename);
+
+    /*
+     * Cache what's worked out from each layout in this directory, including the K-D
+     * tree, so the next run with the same layout file starts right away. Set this
+     * before setLayout(). See LayoutCache.
+     */
+    void setLayoutCache(const char *directory);
+
     void setEffect(Effect* effect);
     void addEffect(Effect* effect);
     void setMaxFrameRate(float fps);
     void setVerbose(bool verbose = true);
 
+    // Throttle to the max frame rate by sleeping until absolute deadlines on the monotonic
+    // clock, one frame period apart, rather than by adjusting a delay after each frame.
+    // This keeps frame times steady even when the busy time per frame varies.
+    void setFramePacing(bool absoluteDeadlines = true);
+
+    // Shade on this many threads of the shared pool, or 0 to auto-detect. By default we use just one.
+    void setConcurrency(unsigned numThreads);
+
+    // Shade pixels in spatial order instead of wiring order, for better cache locality on
+    // big layouts. Colors are put back in wiring order as they're converted to 8-bit.
+    // See FrameInfo::setSpatialOrder().
+    void setSpatialOrder(bool enable = true);
+
+    /*
+     * Run this many frames of each effect in main() before it's shown, on a background
+     * thread while the effect before it plays, so switching effects doesn't stutter.
+     * That's after Effect::prepare(). Warm-up frames see a timeDelta of zero and aren't
+     * sent anywhere. None by default.
+     */
+    void setWarmupFrames(unsigned frames);
+
+    // Ordered dithering when converting to 8-bit color, for servers that don't dither
+    // on their own. Off by default, since Fadecandy boards already dither.
+    void setDither(bool enable = true);
+
+    /*
+     * Save every frame's final 8-bit pixels to a file, along with the effect time between
+     * frames. Frames are rendered and saved even when no server is connected.
+     */
+    bool setRecording(const char *filename);
+
+    /*
+     * Replay a file from setRecording() instead of running any effect, keeping its timing
+     * (scaled by -speed) with absolute deadlines. The file is memory mapped, and neither a
+     * layout nor much CPU is needed, so slower computers can play back anything.
+     */
+    bool setPlayback(const char *filename);
+
+    /*
+     * Append a line of JSON to a file once a second, with the average time per frame spent
+     * in each phase: beginFrame(), shading, postProcess(), endFrame(), conversion to 8-bit,
+     * and sending. Effects made of other effects, like EffectMixer, add a list of times
+     * for each of those. The same times are in the verbose debug output.
+     */
+    bool setProfile(const char *filename);
+
     bool hasLayout() const;
     const rapidjson::Document& getLayout() const;
     Effect* getEffect() const;
@@ -100,12 +185,49 @@ protected:
 private:
     OPCClient opc;
     rapidjson::Document layout;
+    LayoutCache layoutCache;
     Effect *effect;
     std::vector<Effect*> effects;
     std::vector<uint8_t> frameBuffer;
     Effect::FrameInfo frameInfo;
 
+    // Shaded colors for the current frame. Calculated on the thread pool when concurrency isn't 1.
+    std::vector<Vec3> colors;
+    bool parallel;
+
+    // Shaded colors instead, for effects with a fixed point shader
+    std::vector<FixedVec3> fixedColors;
+
+    // The effect whose last frame is in 'colors' or 'fixedColors', if they're current
+    const Effect *shadedEffect;
+
+    // Seconds since the frame was last sent, while the effect is unchanged
+    float unchangedTimer;
+
+    // Getting the next effect in main() ready, on 'warmupThread'. That thread has its
+    // own copy of the layout in 'warmupInfo' once 'warmupInfoCurrent' is set.
+    unsigned warmupFrames;
+    std::vector<Effect*> preparedEffects;
+    Effect *warmupEffect;
+    bool warmupPrepare;
+    tthread::thread *warmupThread;
+    Effect::FrameInfo warmupInfo;
+    bool warmupInfoCurrent;
+
+    void startWarmup(Effect *effect);
+    void finishWarmup();
+    static void warmupThreadFunc(void *context);
+
+    // 8-bit colors in the frame's spatial order, before they're scattered to the framebuffer
+    std::vector<uint8_t> spatialPixels;
+
+    // Output conversion
+    bool dither;
+    unsigned ditherPhase;
+
     float minTimeDelta;
+    bool absolutePacing;
+    int64_t deadline;       // Monotonic nanoseconds, or 0 before the first paced frame
     float currentDelay;
     float filteredTimeDelta;
     float debugTimer;
@@ -115,8 +237,75 @@ private:
     float jitterStatsMin;
     float jitterStatsMax;
 
+    // Time spent on each phase since the last debug output or profile line
+    Effect::PhaseTimes phaseTimes;
+    std::vector<Effect::PhaseTimes> childTimes;
+    unsigned long long convertTime;
+    unsigned long long sendTime;
+    FILE *profileFile;
+
+    void writeProfile();
+    static float msPerFrame(unsigned long long nanoseconds, unsigned frames);
+
     void usage(const char *name);
     void debug();
+    void convertColors(uint8_t *dest);
+    void convertFixedColors(uint8_t *dest);
+    void scatterPixels();
+    float waitForDeadline(float period);
+    static int64_t monotonicNanoseconds();
+
+    // Most pixels one SET_PIXEL_COLORS message can carry
+    static const unsigned MAX_MESSAGE_PIXELS = 0xFFFF / 3;
+
+    struct Output {
+        unsigned server;
+        unsigned channel;
+        unsigned firstPixel;
+        unsigned numPixels;
+    };
+
+    struct OutputServer {
+        std::string hostport;
+        OPCClient *client;              // Owned, unless it's 'opc'
+        std::vector<OPCClient::Header> headers; // One OPC message per output, for each frame
+        std::vector<struct iovec> parts;        // Each header, then its pixels in frameBuffer
+    };
+
+    std::vector<Output> outputs;        // From addOutput()
+    std::vector<Output> activeOutputs;  // What we actually send; empty means all of frameBuffer
+    std::vector<OutputServer> servers;
+    bool async;
+
+    void planOutputs();
+    bool tryConnect();
+    void sendFrame();
+    static void postProcessRange(void *context, unsigned begin, unsigned end);
+    static void shadeFixedRange(void *context, unsigned begin, unsigned end);
+    void shadeFloat();
+    void shadeFixed();
+    bool shadeFrame(uint8_t *dest);
+
+    /*
+     * Recording file format: the magic "FCR1" and a little-endian uint32 pixel count,
+     * then for each frame a little-endian uint32 time since the last frame in
+     * microseconds, followed by 3 bytes per pixel. A partial frame at the end is ignored.
+     */
+    static const unsigned RECORDING_HEADER_SIZE = 8;
+    static const unsigned RECORDING_FRAME_HEADER_SIZE = 4;
+
+    FILE *recordFile;
+    const uint8_t *playbackData;    // Mapped from the file, or null when not playing
+    size_t playbackSize;
+    unsigned playbackPixels;
+    unsigned playbackFrames;
+    unsigned playbackFrame;
+
+    void recordFrame();
+    void playFrame();
+    const uint8_t *playbackRecord(unsigned frame) const;
+    static void putLE32(uint8_t *p, uint32_t value);
+    static uint32_t getLE32(const uint8_t *p);
 };
 
 
@@ -132,14 +321,37 @@ inline EffectRunner::EffectRunner()
       effects(),
       frameBuffer(),
       frameInfo(),
+      colors(),
+      parallel(false),
+      shadedEffect(0),
+      unchangedTimer(0),
+      warmupFrames(0),
+      warmupEffect(0),
+      warmupPrepare(false),
+      warmupThread(0),
+      warmupInfoCurrent(false),
+      dither(false),
+      ditherPhase(0),
       minTimeDelta(0),
+      absolutePacing(false),
+      deadline(0),
       currentDelay(0),
       filteredTimeDelta(0),
       debugTimer(0),
       speed(1.0),
       verbose(false),
       jitterStatsMin(1),
-      jitterStatsMax(0)
+      jitterStatsMax(0),
+      convertTime(0),
+      sendTime(0),
+      profileFile(0),
+      async(false),
+      recordFile(0),
+      playbackData(0),
+      playbackSize(0),
+      playbackPixels(0),
+      playbackFrames(0),
+      playbackFrame(0)
 {
     lastTime.tv_sec = 0;
     lastTime.tv_usec = 0;
@@ -147,6 +359,24 @@ inline EffectRunner::EffectRunner()
     // Defaults
     setMaxFrameRate(300);
     setServer("localhost");
+
+    OutputServer s;
+    s.client = &opc;
+    servers.push_back(s);
+}
+
+inline EffectRunner::~EffectRunner()
+{
+    finishWarmup();
+    setRecording(0);
+    setPlayback(0);
+    setProfile(0);
+
+    for (unsigned i = 0; i < servers.size(); i++) {
+        if (servers[i].client != &opc) {
+            delete servers[i].client;
+        }
+    }
 }
 
 inline void EffectRunner::setMaxFrameRate(float fps)
@@ -154,41 +384,235 @@ inline void EffectRunner::setMaxFrameRate(float fps)
     minTimeDelta = 1.0 / fps;
 }
 
+inline void EffectRunner::setFramePacing(bool absoluteDeadlines)
+{
+    absolutePacing = absoluteDeadlines;
+    deadline = 0;
+}
+
 inline void EffectRunner::setVerbose(bool verbose)
 {
     this->verbose = verbose;
 }
 
+inline void EffectRunner::setConcurrency(unsigned numThreads)
+{
+    parallel = numThreads != 1;
+    if (parallel) {
+        EffectThreadPool::shared().setConcurrency(numThreads);
+        parallel = EffectThreadPool::shared().getConcurrency() > 1;
+    }
+}
+
+inline void EffectRunner::setSpatialOrder(bool enable)
+{
+    frameInfo.setSpatialOrder(enable);
+    shadedEffect = 0;
+    warmupInfoCurrent = false;
+}
+
+inline void EffectRunner::setWarmupFrames(unsigned frames)
+{
+    warmupFrames = frames;
+}
+
+inline void EffectRunner::setDither(bool enable)
+{
+    dither = enable;
+}
+
 inline bool EffectRunner::setServer(const char *hostport)
 {
     return opc.resolve(hostport);
 }
 
-inline bool EffectRunner::setLayout(const char *filename)
+inline bool EffectRunner::addOutput(const char *hostport, unsigned channel, unsigned firstPixel, unsigned numPixels)
 {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
+    if (channel > 0xFF || numPixels > MAX_MESSAGE_PIXELS) {
         return false;
     }
 
-    rapidjson::FileStream istr(f);
-    layout.ParseStream<0>(istr);
-    fclose(f);
+    // Find or resolve the server by name
+    unsigned server = 0;
+    if (hostport && *hostport) {
+        for (server = 1; server < servers.size(); server++) {
+            if (servers[server].hostport == hostport) {
+                break;
+            }
+        }
+        if (server == servers.size()) {
+            OutputServer s;
+            s.hostport = hostport;
+            s.client = new OPCClient();
+            if (!s.client->resolve(hostport)) {
+                delete s.client;
+                return false;
+            }
+            s.client->setAsync(async);
+            servers.push_back(s);
+        }
+    }
 
-    if (layout.HasParseError()) {
-        return false;
+    Output o;
+    o.server = server;
+    o.channel = channel;
+    o.firstPixel = firstPixel;
+    o.numPixels = numPixels;
+    outputs.push_back(o);
+
+    planOutputs();
+    return true;
+}
+
+inline void EffectRunner::setAsync(bool enable)
+{
+    async = enable;
+    for (unsigned i = 0; i < servers.size(); i++) {
+        servers[i].client->setAsync(enable);
     }
-    if (!layout.IsArray()) {
-        return false;
+}
+
+inline void EffectRunner::planOutputs()
+{
+    activeOutputs = outputs;
+
+    unsigned numPixels = frameBuffer.size() > sizeof(OPCClient::Header) ?
+        (frameBuffer.size() - sizeof(OPCClient::Header)) / 3 : 0;
+    if (activeOutputs.empty() && numPixels > MAX_MESSAGE_PIXELS) {
+        // Too big for channel 0 alone. Fill consecutive channels instead.
+        for (unsigned first = 0, channel = 1; first < numPixels && channel <= 0xFF; first += MAX_MESSAGE_PIXELS, channel++) {
+            Output o;
+            o.server = 0;
+            o.channel = channel;
+            o.firstPixel = first;
+            o.numPixels = std::min(MAX_MESSAGE_PIXELS, numPixels - first);
+            activeOutputs.push_back(o);
+        }
     }
 
-    // Set up an empty framebuffer, with OPC packet header
-    int frameBytes = layout.Size() * 3;
-    frameBuffer.resize(sizeof(OPCClient::Header) + frameBytes);
-    OPCClient::Header::view(frameBuffer).init(0, opc.SET_PIXEL_COLORS, frameBytes);
+    // Clip to the layout we have
+    for (unsigned i = 0; i < activeOutputs.size(); i++) {
+        Output &o = activeOutputs[i];
+        o.firstPixel = std::min(o.firstPixel, numPixels);
+        o.numPixels = std::min(o.numPixels, numPixels - o.firstPixel);
+    }
+}
 
-    // Init pixel info
-    frameInfo.init(layout);
+inline bool EffectRunner::tryConnect()
+{
+    if (activeOutputs.empty()) {
+        return opc.tryConnect();
+    }
+
+    // Worth rendering if anyone's listening. Give every server a chance to connect.
+    bool any = false;
+    for (unsigned i = 0; i < servers.size(); i++) {
+        any |= servers[i].client->tryConnect();
+    }
+    return any;
+}
+
+inline void EffectRunner::sendFrame()
+{
+    if (activeOutputs.empty()) {
+        opc.write(frameBuffer);
+        return;
+    }
+
+    // Each server gets a batch of messages, with headers of their own and pixels straight
+    // from frameBuffer. If there's more than one, a commit tells fcserver it has them all.
+
+    uint8_t *pixels = OPCClient::Header::view(frameBuffer).data();
+
+    for (unsigned i = 0; i < servers.size(); i++) {
+        servers[i].headers.clear();
+        servers[i].parts.clear();
+    }
+
+    for (unsigned i = 0; i < activeOutputs.size(); i++) {
+        const Output &o = activeOutputs[i];
+        OPCClient::Header header;
+        header.init(o.channel, OPCClient::SET_PIXEL_COLORS, o.numPixels * 3);
+        servers[o.server].headers.push_back(header);
+    }
+
+    for (unsigned i = 0; i < activeOutputs.size(); i++) {
+        const Output &o = activeOutputs[i];
+        OutputServer &s = servers[o.server];
+        struct iovec header = { &s.headers[s.parts.size() / 2], sizeof(OPCClient::Header) };
+        struct iovec data = { pixels + o.firstPixel * 3, o.numPixels * 3 };
+        s.parts.push_back(header);
+        s.parts.push_back(data);
+    }
+
+    for (unsigned i = 0; i < servers.size(); i++) {
+        OutputServer &s = servers[i];
+        if (!s.parts.empty() && s.client->tryConnect()) {
+            s.client->writeBatch(&s.parts[0], s.parts.size(), s.headers.size() > 1);
+        }
+    }
+}
+
+inline void EffectRunner::setLayoutCache(const char *directory)
+{
+    layoutCache.setDirectory(directory);
+}
+
+inline bool EffectRunner::setLayout(const char *filename)
+{
+    uint64_t cacheKey = layoutCache.isEnabled() ? layoutCache.key(filename, frameInfo.isSpatialOrder()) : 0;
+    bool cached = false;
+
+    if (BinaryLayout::isBinary(filename)) {
+        cached = layoutCache.load(cacheKey, frameInfo);
+        if (!cached) {
+            BinaryLayout binary;
+            if (!binary.open(filename)) {
+                return false;
+            }
+            binary.load(frameInfo);
+        }
+        layout.SetNull();
+
+    } else {
+        FILE *f = fopen(filename, "r");
+        if (!f) {
+            return false;
+        }
+
+        rapidjson::FileStream istr(f);
+        layout.ParseStream<0>(istr);
+        fclose(f);
+
+        if (layout.HasParseError()) {
+            return false;
+        }
+        if (!layout.IsArray()) {
+            return false;
+        }
+
+        // Init pixel info
+        cached = layoutCache.load(cacheKey, frameInfo, &layout);
+        if (!cached) {
+            frameInfo.init(layout);
+        }
+    }
+
+    if (cacheKey && !cached) {
+        layoutCache.save(cacheKey, frameInfo);
+    }
+
+    // Set up an empty framebuffer, with OPC packet header. A recording being
+    // played back decides its own size.
+    if (!playbackData) {
+        int frameBytes = frameInfo.pixels.size() * 3;
+        frameBuffer.resize(sizeof(OPCClient::Header) + frameBytes);
+        OPCClient::Header::view(frameBuffer).init(0, opc.SET_PIXEL_COLORS, frameBytes);
+    }
+
+    planOutputs();
+    shadedEffect = 0;
+    warmupInfoCurrent = false;
 
     return true;
 }
@@ -200,7 +624,7 @@ inline const rapidjson::Document& EffectRunner::getLayout() const
 
 inline bool EffectRunner::hasLayout() const
 {
-    return layout.IsArray();
+    return !frameInfo.pixels.empty();
 }
 
 inline void EffectRunner::setEffect(Effect *effect)
@@ -290,32 +714,82 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
     jitterStatsMin = std::min(jitterStatsMin, frameStatus.timeDelta);
     jitterStatsMax = std::max(jitterStatsMax, frameStatus.timeDelta);
 
-    if (getEffect() && hasLayout()) {
+    if (playbackData) {
+        playFrame();
+        frameStatus.lastFrame = playbackFrame == 0;
+
+    } else if (getEffect() && hasLayout()) {
+        unsigned long long start = Effect::PhaseTimes::now();
         effect->beginFrame(frameInfo);
+        phaseTimes.beginFrame += Effect::PhaseTimes::now() - start;
 
-        // Only calculate the effect if we have a connection
-        if (opc.tryConnect()) {
+        // Only calculate the effect if we have a connection, or we're recording it
+        bool connected = tryConnect();
+        if (connected || recordFile) {
 
+            // An unchanged effect keeps its last colors. Dithering still moves each frame,
+            // so those are converted again, but otherwise we keep the last frame too.
+            bool unchanged = shadedEffect == effect && effect->isFrameUnchanged(frameInfo);
+            bool converting = !unchanged || dither;
+
+            // Spatially ordered colors convert to a scratch buffer first
             uint8_t *dest = OPCClient::Header::view(frameBuffer).data();
+            if (!frameInfo.outputIndex.empty()) {
+                spatialPixels.resize(frameInfo.pixels.size() * 3);
+                dest = &spatialPixels[0];
+            }
 
-            for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end(); i != e; ++i) {
-                Vec3 rgb(0, 0, 0);
-                const Effect::PixelInfo &p = *i;
+            // A frame shader's colors are already finished, and only change when it runs
+            bool finished = effect->hasFrameShader() && (unchanged || shadeFrame(dest));
 
-                if (p.isMapped()) {
-                    effect->shader(rgb, p);
-                    effect->postProcess(rgb, p);
+            if (finished) {
+                converting = !unchanged;
+                start = Effect::PhaseTimes::now();
+            } else if (effect->hasFixedShader()) {
+                if (!unchanged) {
+                    shadeFixed();
                 }
-
-                for (unsigned i = 0; i < 3; i++) {
-                    *(dest++) = std::min<int>(255, std::max<int>(0, rgb[i] * 255 + 0.5));
+                start = Effect::PhaseTimes::now();
+                if (converting && !fixedColors.empty()) {
+                    convertFixedColors(dest);
+                }
+            } else {
+                if (!unchanged) {
+                    shadeFloat();
+                }
+                start = Effect::PhaseTimes::now();
+                if (converting && !colors.empty()) {
+                    convertColors(dest);
                 }
             }
+            if (converting && !frameInfo.outputIndex.empty()) {
+                scatterPixels();
+            }
+            convertTime += Effect::PhaseTimes::now() - start;
+            shadedEffect = effect;
+
+            if (recordFile) {
+                recordFrame();
+            }
 
-            opc.write(frameBuffer);
+            // Still send the same frame now and then, in case it was lost or the server restarted
+            const float unchangedResendInterval = 1.0f;
+            unchangedTimer = converting ? 0 : unchangedTimer + timeDelta;
+            if (connected && (converting || unchangedTimer > unchangedResendInterval)) {
+                unchangedTimer = 0;
+                start = Effect::PhaseTimes::now();
+                sendFrame();
+                sendTime += Effect::PhaseTimes::now() - start;
+            }
+        } else {
+            // The effect moves on without us
+            shadedEffect = 0;
         }
 
+        start = Effect::PhaseTimes::now();
         frameStatus.lastFrame = effect->endFrame(frameInfo);
+        phaseTimes.endFrame += Effect::PhaseTimes::now() - start;
+        phaseTimes.frames++;
     }
 
     // Low-pass filter for timeDelta, to estimate our frame rate
@@ -325,30 +799,324 @@ inline EffectRunner::FrameStatus EffectRunner::doFrame(float timeDelta)
     // Negative feedback loop to adjust the delay until we hit a target frame rate.
     // This lets us hit the target rate smoothly, without a lot of jitter between frames.
     // If we calculated a new delay value on each frame, we'd easily end up alternating
-    // between too-long and too-short frame delays.
-    currentDelay += (minTimeDelta - timeDelta) * filterGain;
+    // between too-long and too-short frame delays. With absolute pacing, this is
+    // instead a filtered measurement of the time we sleep, below.
+    if (!absolutePacing && !playbackData) {
+        currentDelay += (minTimeDelta - timeDelta) * filterGain;
+    }
 
     // Make sure filteredTimeDelta >= currentDelay. (The "busy time" estimate will be >= 0)
     filteredTimeDelta = std::max(filteredTimeDelta, currentDelay);
 
-    // Periodically output debug info, if we're in verbose mode
-    if (verbose) {
+    // Periodically output debug info, if we're in verbose mode, and profile times
+    if (verbose || profileFile) {
         const float debugInterval = 1.0f;
         if ((debugTimer += timeDelta) > debugInterval) {
             debugTimer = fmodf(debugTimer, debugInterval);
-            frameStatus.debugOutput = true;
-            debug();
+
+            childTimes.clear();
+            if (effect) {
+                effect->collectChildTimes(childTimes);
+            }
+
+            if (verbose) {
+                frameStatus.debugOutput = true;
+                debug();
+            }
+            if (profileFile) {
+                writeProfile();
+            }
+
+            phaseTimes.clear();
+            convertTime = 0;
+            sendTime = 0;
         }
     }
 
     // Add the extra delay, if we have one. This is how we throttle down the frame rate.
-    if (currentDelay > 0) {
+    // Playback always waits for the next recorded frame's deadline.
+    if (playbackData) {
+        float period = getLE32(playbackRecord(playbackFrame)) * 1e-6f / speed;
+        currentDelay += (waitForDeadline(period) - currentDelay) * filterGain;
+    } else if (absolutePacing) {
+        currentDelay += (waitForDeadline(minTimeDelta) - currentDelay) * filterGain;
+    } else if (currentDelay > 0) {
         usleep(currentDelay * 1e6);
     }
 
     return frameStatus;
 }
 
+inline int64_t EffectRunner::monotonicNanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+inline void EffectRunner::shadeFloat()
+{
+    unsigned long long start = Effect::PhaseTimes::now();
+
+    // Shade every pixel first, in batches. postProcess() stays serial, below,
+    // unless the effect can take it in parallel batches.
+    if (parallel) {
+        EffectThreadPool::shared().add(effect, frameInfo, colors);
+        EffectThreadPool::shared().run();
+    } else {
+        colors.assign(frameInfo.pixels.size(), Vec3(0, 0, 0));
+        if (!colors.empty()) {
+            effect->shadeBatch(Effect::PixelBatch(frameInfo, 0, colors.size()), &colors[0]);
+        }
+    }
+
+    unsigned long long shaded = Effect::PhaseTimes::now();
+    phaseTimes.shading += shaded - start;
+
+    if (effect->hasParallelPostProcess()) {
+        if (parallel) {
+            EffectThreadPool::shared().add(postProcessRange, this, colors.size());
+            EffectThreadPool::shared().run();
+        } else {
+            postProcessRange(this, 0, colors.size());
+        }
+
+    } else {
+        for (Effect::PixelInfoIter i = frameInfo.pixels.begin(), e = frameInfo.pixels.end(); i != e; ++i) {
+            const Effect::PixelInfo &p = *i;
+
+            if (frameInfo.isMapped(p.index)) {
+                effect->postProcess(colors[p.index], p);
+            } else {
+                colors[p.index] = Vec3(0, 0, 0);
+            }
+        }
+    }
+
+    phaseTimes.postProcess += Effect::PhaseTimes::now() - shaded;
+}
+
+inline void EffectRunner::shadeFixed()
+{
+    unsigned long long start = Effect::PhaseTimes::now();
+
+    // Fixed point shaders have no postProcess(), and unmapped pixels stay zero
+    fixedColors.assign(frameInfo.pixels.size(), FixedVec3(0, 0, 0));
+    if (parallel) {
+        EffectThreadPool::shared().add(shadeFixedRange, this, fixedColors.size());
+        EffectThreadPool::shared().run();
+    } else if (!fixedColors.empty()) {
+        shadeFixedRange(this, 0, fixedColors.size());
+    }
+
+    phaseTimes.shading += Effect::PhaseTimes::now() - start;
+}
+
+inline bool EffectRunner::shadeFrame(uint8_t *dest)
+{
+    unsigned long long start = Effect::PhaseTimes::now();
+    bool shaded = effect->shadeFrame(frameInfo, dest);
+    phaseTimes.shading += Effect::PhaseTimes::now() - start;
+    return shaded;
+}
+
+inline void EffectRunner::shadeFixedRange(void *context, unsigned begin, unsigned end)
+{
+    EffectRunner *self = (EffectRunner*) context;
+    self->effect->shadeFixedBatch(Effect::PixelBatch(self->frameInfo, begin, end), &self->fixedColors[begin]);
+}
+
+inline void EffectRunner::postProcessRange(void *context, unsigned begin, unsigned end)
+{
+    EffectRunner *self = (EffectRunner*) context;
+    const Effect::FrameInfo &f = self->frameInfo;
+
+    self->effect->postProcessBatch(Effect::PixelBatch(f, begin, end),
+        &self->colors[begin], EffectThreadPool::currentThread());
+
+    for (unsigned i = begin; i < end; i++) {
+        if (!f.isMapped(i)) {
+            self->colors[i] = Vec3(0, 0, 0);
+        }
+    }
+}
+
+inline float EffectRunner::waitForDeadline(float periodSeconds)
+{
+    // Sleep until the end of this frame's period, and return how long we slept, in seconds
+
+    int64_t now = monotonicNanoseconds();
+    int64_t period = periodSeconds * 1e9;
+
+    deadline = deadline ? deadline + period : now + period;
+
+    if (now - deadline > period) {
+        // More than a frame behind. Start over from here, rather than catch up in a burst.
+        deadline = now;
+        return 0;
+    }
+    if (deadline <= now) {
+        return 0;
+    }
+
+    struct timespec t;
+#ifdef TIMER_ABSTIME
+    t.tv_sec = deadline / 1000000000LL;
+    t.tv_nsec = deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0) == EINTR);
+#else
+    // No absolute sleep here. A relative one from a fresh clock reading is close.
+    int64_t remaining = deadline - monotonicNanoseconds();
+    if (remaining > 0) {
+        t.tv_sec = remaining / 1000000000LL;
+        t.tv_nsec = remaining % 1000000000LL;
+        nanosleep(&t, 0);
+    }
+#endif
+
+    return (deadline - now) * 1e-9f;
+}
+
+inline void EffectRunner::putLE32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+inline uint32_t EffectRunner::getLE32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+inline bool EffectRunner::setProfile(const char *filename)
+{
+    if (profileFile) {
+        fclose(profileFile);
+        profileFile = 0;
+    }
+    if (!filename) {
+        return true;
+    }
+
+    profileFile = fopen(filename, "a");
+    return profileFile != 0;
+}
+
+inline bool EffectRunner::setRecording(const char *filename)
+{
+    if (recordFile) {
+        fclose(recordFile);
+        recordFile = 0;
+    }
+    if (!filename) {
+        return true;
+    }
+
+    recordFile = fopen(filename, "wb");
+    if (!recordFile) {
+        return false;
+    }
+
+    // The pixel count is filled in with the first frame, once the layout is certain
+    uint8_t header[RECORDING_HEADER_SIZE] = { 'F', 'C', 'R', '1' };
+    fwrite(header, 1, sizeof header, recordFile);
+    return true;
+}
+
+inline void EffectRunner::recordFrame()
+{
+    const OPCClient::Header &h = OPCClient::Header::view(frameBuffer);
+    unsigned numPixels = (frameBuffer.size() - sizeof h) / 3;
+
+    if (ftell(recordFile) == RECORDING_HEADER_SIZE) {
+        uint8_t count[4];
+        putLE32(count, numPixels);
+        fseek(recordFile, 4, SEEK_SET);
+        fwrite(count, 1, sizeof count, recordFile);
+        fseek(recordFile, RECORDING_HEADER_SIZE, SEEK_SET);
+    }
+
+    uint8_t delta[RECORDING_FRAME_HEADER_SIZE];
+    putLE32(delta, frameInfo.timeDelta * 1e6f + 0.5f);
+    fwrite(delta, 1, sizeof delta, recordFile);
+    fwrite(h.data(), 1, numPixels * 3, recordFile);
+}
+
+inline bool EffectRunner::setPlayback(const char *filename)
+{
+    if (playbackData) {
+        munmap((void*) playbackData, playbackSize);
+        playbackData = 0;
+        playbackSize = 0;
+        playbackFrames = 0;
+        playbackFrame = 0;
+    }
+    if (!filename) {
+        return true;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) RECORDING_HEADER_SIZE) {
+        data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    const uint8_t *bytes = (const uint8_t*) data;
+    unsigned numPixels = getLE32(bytes + 4);
+    size_t frameSize = RECORDING_FRAME_HEADER_SIZE + numPixels * 3;
+    unsigned numFrames = (st.st_size - RECORDING_HEADER_SIZE) / frameSize;
+
+    if (memcmp(bytes, "FCR1", 4) || numFrames == 0) {
+        munmap(data, st.st_size);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    playbackData = bytes;
+    playbackSize = st.st_size;
+    playbackPixels = numPixels;
+    playbackFrames = numFrames;
+    playbackFrame = 0;
+
+    int frameBytes = numPixels * 3;
+    frameBuffer.resize(sizeof(OPCClient::Header) + frameBytes);
+    OPCClient::Header::view(frameBuffer).init(0, opc.SET_PIXEL_COLORS, frameBytes);
+    planOutputs();
+    return true;
+}
+
+inline const uint8_t *EffectRunner::playbackRecord(unsigned frame) const
+{
+    size_t frameSize = RECORDING_FRAME_HEADER_SIZE + playbackPixels * 3;
+    return playbackData + RECORDING_HEADER_SIZE + frame * frameSize;
+}
+
+inline void EffectRunner::playFrame()
+{
+    // Send one recorded frame, and move on to the next. Loops back to the beginning.
+
+    if (tryConnect()) {
+        memcpy(OPCClient::Header::view(frameBuffer).data(),
+            playbackRecord(playbackFrame) + RECORDING_FRAME_HEADER_SIZE, playbackPixels * 3);
+        sendFrame();
+    }
+
+    if (++playbackFrame == playbackFrames) {
+        playbackFrame = 0;
+    }
+}
+
 inline OPCClient& EffectRunner::getClient()
 {
     return opc;
@@ -372,6 +1140,112 @@ inline void EffectRunner::getPixelColor(unsigned index, Vec3 &rgb) const
     }
 }
 
+inline void EffectRunner::convertColors(uint8_t *dest)
+{
+    /*
+     * Clamp and round the shaded colors into 8-bit OPC pixel data, 16 channels at a time.
+     *
+     * Channel 'j' has offset[j % 16] added before it's truncated. That's 0.5 for plain
+     * rounding, or a threshold from a 4x4 Bayer matrix when dithering. The thresholds
+     * rotate by one step each frame, so every channel cycles through all of them.
+     */
+
+    static const uint8_t bayer[16] = { 0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5 };
+    float offset[16];
+    for (unsigned j = 0; j < 16; j++) {
+        offset[j] = dither ? (bayer[(j + ditherPhase) % 16] + 0.5f) / 16.0f : 0.5f;
+    }
+    ditherPhase++;
+
+    const Real *src = &colors[0][0];
+    unsigned count = colors.size() * 3;
+    unsigned j = 0;
+
+#if defined(VL_DOUBLE)
+    // Scalar only
+#elif defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 lower = _mm_setzero_ps();
+    const __m128 upper = _mm_set1_ps(255.0f);
+    const __m128 o0 = _mm_loadu_ps(offset + 0);
+    const __m128 o1 = _mm_loadu_ps(offset + 4);
+    const __m128 o2 = _mm_loadu_ps(offset + 8);
+    const __m128 o3 = _mm_loadu_ps(offset + 12);
+
+    for (; j + 16 <= count; j += 16) {
+        // Max with zero first, which also turns NaN into zero
+        __m128i c0 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + j + 0), scale), o0), lower), upper));
+        __m128i c1 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + j + 4), scale), o1), lower), upper));
+        __m128i c2 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + j + 8), scale), o2), lower), upper));
+        __m128i c3 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + j + 12), scale), o3), lower), upper));
+        _mm_storeu_si128((__m128i*) (dest + j), _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3)));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const float32x4_t scale = vdupq_n_f32(255.0f);
+    const float32x4_t lower = vdupq_n_f32(0.0f);
+    const float32x4_t upper = vdupq_n_f32(255.0f);
+    const float32x4_t o0 = vld1q_f32(offset + 0);
+    const float32x4_t o1 = vld1q_f32(offset + 4);
+    const float32x4_t o2 = vld1q_f32(offset + 8);
+    const float32x4_t o3 = vld1q_f32(offset + 12);
+
+    for (; j + 16 <= count; j += 16) {
+        // NaN gets through the clamp, but converts to zero
+        uint32x4_t c0 = vcvtq_u32_f32(vminq_f32(vmaxq_f32(vmlaq_f32(o0, vld1q_f32(src + j + 0), scale), lower), upper));
+        uint32x4_t c1 = vcvtq_u32_f32(vminq_f32(vmaxq_f32(vmlaq_f32(o1, vld1q_f32(src + j + 4), scale), lower), upper));
+        uint32x4_t c2 = vcvtq_u32_f32(vminq_f32(vmaxq_f32(vmlaq_f32(o2, vld1q_f32(src + j + 8), scale), lower), upper));
+        uint32x4_t c3 = vcvtq_u32_f32(vminq_f32(vmaxq_f32(vmlaq_f32(o3, vld1q_f32(src + j + 12), scale), lower), upper));
+        uint16x8_t lo = vcombine_u16(vmovn_u32(c0), vmovn_u32(c1));
+        uint16x8_t hi = vcombine_u16(vmovn_u32(c2), vmovn_u32(c3));
+        vst1q_u8(dest + j, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+    }
+#endif
+
+    for (; j < count; j++) {
+        dest[j] = std::min<Real>(255, std::max<Real>(0, src[j] * 255 + offset[j % 16]));
+    }
+}
+
+inline void EffectRunner::scatterPixels()
+{
+    // Put spatially ordered pixels back in wiring order
+    uint8_t *dest = OPCClient::Header::view(frameBuffer).data();
+    const uint8_t *src = &spatialPixels[0];
+    const unsigned *output = &frameInfo.outputIndex[0];
+    unsigned count = frameInfo.outputIndex.size();
+
+    for (unsigned i = 0; i < count; i++, src += 3) {
+        uint8_t *p = dest + output[i] * 3;
+        p[0] = src[0];
+        p[1] = src[1];
+        p[2] = src[2];
+    }
+}
+
+inline void EffectRunner::convertFixedColors(uint8_t *dest)
+{
+    /*
+     * Same as convertColors(), for Q16 colors, with only integer math. A clamped
+     * channel is at most FIXED_ONE, so scaling it to 255 and adding the offset
+     * (in 16ths) can't overflow.
+     */
+
+    static const uint8_t bayer[16] = { 0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5 };
+    Fixed offset[16];
+    for (unsigned j = 0; j < 16; j++) {
+        offset[j] = dither ? (bayer[(j + ditherPhase) % 16] * 2 + 1) << 11 : FIXED_ONE / 2;
+    }
+    ditherPhase++;
+
+    const Fixed *src = fixedColors[0].v;
+    unsigned count = fixedColors.size() * 3;
+
+    for (unsigned j = 0; j < count; j++) {
+        Fixed c = std::min(FIXED_ONE, std::max(0, src[j]));
+        dest[j] = std::min(255, (c * 255 + offset[j % 16]) >> 16);
+    }
+}
+
 inline bool EffectRunner::parseArguments(int argc, char **argv)
 {
     for (int i = 1; i < argc; i++) {
@@ -397,17 +1271,94 @@ inline int EffectRunner::main(int argc, char **argv, bool loop)
 
     do
     {
-       for( std::vector<Effect*>::iterator i( effects.begin() );
-            i != effects.end(); ++i )
-       {
-          effect = *i;
+       if (playbackData) {
+          // The recording stands in for every effect
+          run();
+          continue;
+       }
+
+       for (unsigned i = 0; i < effects.size(); i++) {
+          effect = effects[i];
+
+          // Usually the effect was made ready while the last one played
+          finishWarmup();
+          if (std::find(preparedEffects.begin(), preparedEffects.end(), effect) == preparedEffects.end()) {
+             preparedEffects.push_back(effect);
+             effect->prepare(frameInfo);
+          }
+
+          // Now get the next one ready
+          if (effects.size() > 1 && (loop || i + 1 < effects.size())) {
+             startWarmup(effects[(i + 1) % effects.size()]);
+          }
+
           run();
        }
     }
     while( loop );
+
+    finishWarmup();
     return 0;
 }
 
+inline void EffectRunner::startWarmup(Effect *effect)
+{
+    warmupEffect = effect;
+    warmupPrepare = std::find(preparedEffects.begin(), preparedEffects.end(), effect) == preparedEffects.end();
+    if (!warmupPrepare && !warmupFrames) {
+        return;
+    }
+    if (warmupPrepare) {
+        preparedEffects.push_back(effect);
+    }
+
+    warmupThread = new tthread::thread(warmupThreadFunc, this);
+}
+
+inline void EffectRunner::finishWarmup()
+{
+    if (warmupThread) {
+        warmupThread->join();
+        delete warmupThread;
+        warmupThread = 0;
+    }
+}
+
+inline void EffectRunner::warmupThreadFunc(void *context)
+{
+    EffectRunner *self = (EffectRunner*) context;
+    Effect *effect = self->warmupEffect;
+    Effect::FrameInfo &f = self->warmupInfo;
+
+    // Frames being shown keep the shared pool and frameInfo to themselves
+    EffectThreadPool pool;
+    pool.setConcurrency(1);
+    EffectThreadPool::setThreadPool(&pool);
+
+    if (!self->warmupInfoCurrent) {
+        f.init(self->frameInfo);
+        self->warmupInfoCurrent = true;
+    }
+
+    if (self->warmupPrepare) {
+        effect->prepare(f);
+    }
+
+    std::vector<Vec3> colors;
+    for (unsigned i = 0; i < self->warmupFrames; i++) {
+        f.timeDelta = 0;
+        effect->beginFrame(f);
+        pool.add(effect, f, colors);
+        pool.run();
+        effect->endFrame(f);
+    }
+
+    // Only frames that are shown count towards Effect::number_frames
+    effect->frame_count = 0;
+
+    EffectThreadPool::setThreadPool(0);
+}
+
 inline void EffectRunner::usage(const char *name)
 {
     fprintf(stderr, "usage: %s ", name);
@@ -427,12 +1378,60 @@ inline void EffectRunner::debug()
     jitterStatsMax = 0;
     jitterStatsMin = 1e10;
 
-    if (effect) {
+    if (phaseTimes.frames) {
+        unsigned n = phaseTimes.frames;
+        fprintf(stderr, "\t[timing] ms/frame: beginFrame %.3f, shading %.3f, postProcess %.3f, "
+            "endFrame %.3f, convert %.3f, send %.3f\n",
+            msPerFrame(phaseTimes.beginFrame, n), msPerFrame(phaseTimes.shading, n),
+            msPerFrame(phaseTimes.postProcess, n), msPerFrame(phaseTimes.endFrame, n),
+            msPerFrame(convertTime, n), msPerFrame(sendTime, n));
+
+        for (unsigned i = 0; i < childTimes.size(); ++i) {
+            const Effect::PhaseTimes &t = childTimes[i];
+            fprintf(stderr, "\t[timing] channel %u ms/frame: beginFrame %.3f, shading %.3f, "
+                "postProcess %.3f, endFrame %.3f\n", i,
+                msPerFrame(t.beginFrame, t.frames), msPerFrame(t.shading, t.frames),
+                msPerFrame(t.postProcess, t.frames), msPerFrame(t.endFrame, t.frames));
+        }
+    }
+
+    if (playbackData) {
+        fprintf(stderr, "\tPlaying frame %u of %u\n", playbackFrame + 1, playbackFrames);
+    } else if (effect) {
         Effect::DebugInfo d(*this);
         effect->debug(d);
     }
 }
 
+inline float EffectRunner::msPerFrame(unsigned long long nanoseconds, unsigned frames)
+{
+    return frames ? nanoseconds * 1e-6f / frames : 0.0f;
+}
+
+inline void EffectRunner::writeProfile()
+{
+    unsigned n = phaseTimes.frames;
+    fprintf(profileFile, "{\"frames\":%u,\"fps\":%.2f,\"ms_per_frame\":{\"begin_frame\":%.4f,"
+        "\"shading\":%.4f,\"post_process\":%.4f,\"end_frame\":%.4f,\"convert\":%.4f,\"send\":%.4f},"
+        "\"channels\":[",
+        n, getFrameRate(),
+        msPerFrame(phaseTimes.beginFrame, n), msPerFrame(phaseTimes.shading, n),
+        msPerFrame(phaseTimes.postProcess, n), msPerFrame(phaseTimes.endFrame, n),
+        msPerFrame(convertTime, n), msPerFrame(sendTime, n));
+
+    for (unsigned i = 0; i < childTimes.size(); ++i) {
+        const Effect::PhaseTimes &t = childTimes[i];
+        fprintf(profileFile, "%s{\"frames\":%u,\"begin_frame\":%.4f,\"shading\":%.4f,"
+            "\"post_process\":%.4f,\"end_frame\":%.4f}",
+            i ? "," : "", t.frames,
+            msPerFrame(t.beginFrame, t.frames), msPerFrame(t.shading, t.frames),
+            msPerFrame(t.postProcess, t.frames), msPerFrame(t.endFrame, t.frames));
+    }
+
+    fprintf(profileFile, "]}\n");
+    fflush(profileFile);
+}
+
 inline bool EffectRunner::parseArgument(int &i, int &argc, char **argv)
 {
     if (!strcmp(argv[i], "-v")) {
@@ -459,6 +1458,85 @@ inline bool EffectRunner::parseArgument(int &i, int &argc, char **argv)
         return true;
     }
 
+    if (!strcmp(argv[i], "-threads") && (i+1 < argc)) {
+        int threads = atoi(argv[++i]);
+        if (threads < 0) {
+            fprintf(stderr, "Invalid thread count\n");
+            return false;
+        }
+        setConcurrency(threads);
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-pace")) {
+        setFramePacing();
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-async")) {
+        setAsync();
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-output") && (i+1 < argc)) {
+        // HOST[:port],CHANNEL,FIRST,COUNT
+        std::string arg = argv[++i];
+        size_t comma = arg.find(',');
+        unsigned channel, first, count;
+        char extra;
+        if (comma == std::string::npos ||
+            sscanf(arg.c_str() + comma + 1, "%u,%u,%u%c", &channel, &first, &count, &extra) != 3 ||
+            !addOutput(arg.substr(0, comma).c_str(), channel, first, count)) {
+            fprintf(stderr, "Invalid output %s\n", argv[i]);
+            return false;
+        }
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-record") && (i+1 < argc)) {
+        if (!setRecording(argv[++i])) {
+            fprintf(stderr, "Can't record to %s\n", argv[i]);
+            return false;
+        }
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-play") && (i+1 < argc)) {
+        if (!setPlayback(argv[++i])) {
+            fprintf(stderr, "Can't play recording %s\n", argv[i]);
+            return false;
+        }
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-profile") && (i+1 < argc)) {
+        if (!setProfile(argv[++i])) {
+            fprintf(stderr, "Can't write profile to %s\n", argv[i]);
+            return false;
+        }
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-spatial")) {
+        setSpatialOrder();
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-warmup") && (i+1 < argc)) {
+        setWarmupFrames(atoi(argv[++i]));
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-dither")) {
+        setDither();
+        return true;
+    }
+
+    if (!strcmp(argv[i], "-layout-cache") && (i+1 < argc)) {
+        setLayoutCache(argv[++i]);
+        return true;
+    }
+
     if (!strcmp(argv[i], "-layout") && (i+1 < argc)) {
         if (!setLayout(argv[++i])) {
             fprintf(stderr, "Can't load layout from %s\n", argv[i]);
@@ -480,7 +1558,7 @@ inline bool EffectRunner::parseArgument(int &i, int &argc, char **argv)
 
 inline bool EffectRunner::validateArguments()
 {
-    if (!hasLayout()) {
+    if (!hasLayout() && !playbackData) {
         fprintf(stderr, "No layout specified\n");
         return false;
     }
@@ -490,5 +1568,6 @@ inline bool EffectRunner::validateArguments()
 
 inline void EffectRunner::argumentUsage()
 {
-    fprintf(stderr, "[-v] [-fps LIMIT] [-speed MULTIPLIER] [-layout FILE.json] [-server HOST[:port]]");
+    fprintf(stderr, "[-v] [-fps LIMIT] [-pace] [-speed MULTIPLIER] [-threads N] [-async] [-spatial] [-warmup FRAMES] [-dither] [-layout-cache DIR] [-layout FILE] [-server [udp://]HOST[:port] | unix://PATH | shm://NAME]\n"
+        "\t[-output [[udp://]HOST[:port]],CHANNEL,FIRST,COUNT ...] [-record FILE | -play FILE] [-profile FILE]");
 }
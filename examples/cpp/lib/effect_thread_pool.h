@@ -0,0 +1,510 @@
+/*
+ * LED Effect thread pool: Runs Effect shaders over many pixels on
+ * multiple CPU cores.
+ *
+ * Shaders have no side-effects, so they can be calculated for any
+ * number of pixels at once. Queue up work for one or more effects
+ * with add(), then run() splits it into batches and waits for the
+ * pool to finish them. Used by EffectMixer, and by EffectRunner
+ * when it's given more than one thread.
+ *
+ * Those share one process-wide pool, shared(), so that effects
+ * nested in a mixer don't each have a set of threads of their own.
+ * Like the rest of the effect framework, it expects to be used
+ * from one rendering thread.
+ *
+ * Batches are sized from how long each effect's shader took on
+ * previous frames, aiming for batches long enough that queueing
+ * them costs little, but short enough to balance.
+ *
+ * Each thread has its own queue of batches, and steals from the
+ * others once its own runs dry, so threads rarely contend for a
+ * lock. Completion is an atomic count with a single wakeup at the
+ * end of the frame. Between frames, threads spin for a little
+ * while before they sleep, so a new frame at a high frame rate
+ * doesn't have to wait for them to be woken up.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#include <sys/time.h>
+
+#include "effect.h"
+#include "tinythread.h"
+
+
+class EffectThreadPool {
+public:
+    EffectThreadPool();
+    ~EffectThreadPool();
+
+    // The pool shared by everything in this process, unless this thread was given its own
+    static EffectThreadPool& shared();
+
+    // Make shared() return 'pool' on the calling thread, or the process-wide pool again
+    // with 0. Background work, like EffectRunner's warm-up frames, uses its own pool so
+    // it never gets mixed up with the frames being rendered.
+    static void setThreadPool(EffectThreadPool *pool);
+
+    // Set number of threads. By default, we auto-detect
+    void setConcurrency(unsigned numThreads);
+    unsigned getConcurrency();
+
+    // Queue up shadeBatch() calls covering every pixel in the frame, storing results in 'colors'.
+    // If 'nanoseconds' is given, run() adds the time all threads spent on these to it.
+    void add(const Effect *effect, const Effect::FrameInfo &frame, std::vector<Vec3> &colors,
+        unsigned long long *nanoseconds = 0);
+
+    // Queue up any other work, in pieces. 'func' gets called with ranges covering [0, count).
+    typedef void (*RangeFunc)(void *context, unsigned begin, unsigned end);
+    void add(RangeFunc func, void *context, unsigned count);
+
+    // Calculate everything queued since the last run(), and wait for it to finish
+    void run();
+
+    // Which pool thread is calling, from 0 to getConcurrency() - 1. Zero outside the pool.
+    static unsigned currentThread();
+
+private:
+    struct Job {
+        const Effect *effect;
+        const Effect::FrameInfo *frame;
+        Vec3 *colors;
+        RangeFunc func;
+        void *context;
+        unsigned count;
+        unsigned long long nanoseconds;     // Time spent on all of this job's batches
+        unsigned long long *totalNanoseconds;   // Optional, from add()
+    };
+
+    struct Task {
+        Job *job;
+        unsigned begin;
+        unsigned end;
+    };
+
+    struct ThreadContext {
+        EffectThreadPool *pool;
+        tthread::thread *thread;
+        unsigned index;
+        unsigned lastGeneration;    // Most recent run() this thread has seen
+        bool runFlag;
+
+        // This thread's batches. It takes from the back, other threads steal from the front.
+        // The deque is only locked against another thread stealing at the same time.
+        tthread::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    // How many times an idle thread checks for a new frame before it sleeps
+    static const unsigned SPIN_COUNT = 2000;
+
+    // Batch length we aim for, once we know how long the work takes
+    static const unsigned TARGET_BATCH_NANOSECONDS = 100000;
+
+    // Measured cost of each effect or RangeFunc, in nanoseconds per item
+    std::map<const void*, float> costs;
+    static const unsigned MAX_COSTS = 1024;
+
+    // Work for the next run(). Only modified when threads are idle.
+    std::vector<Job> jobs;
+
+    // Running threads. Only changed while none are running.
+    std::vector<ThreadContext*> threads;
+    unsigned numThreadsConfigured;
+
+    // Incremented to start each run(). Sleeping threads wait on wakeCond.
+    unsigned generation;
+    tthread::mutex wakeLock;
+    tthread::condition_variable wakeCond;
+
+    // Tasks not yet finished. The thread that finishes the last one signals completeCond.
+    unsigned pendingTasks;
+    tthread::mutex completeLock;
+    tthread::condition_variable completeCond;
+
+    void changeNumberOfThreads(unsigned count);
+    static void threadFunc(void *context);
+    void worker(ThreadContext &context);
+    bool waitForWork(ThreadContext &context);
+    bool nextTask(ThreadContext &context, Task &task);
+    void runTask(const Task &task);
+    unsigned batchSize(const Job &job, unsigned numThreads);
+    void updateCosts();
+    static const void *costKey(const Job &job);
+    static unsigned &currentThreadSlot();
+    static EffectThreadPool *&threadPoolSlot();
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline EffectThreadPool::EffectThreadPool()
+    : numThreadsConfigured(0),  // Auto-detect
+      generation(0),
+      pendingTasks(0)
+{}
+
+inline EffectThreadPool::~EffectThreadPool()
+{
+    changeNumberOfThreads(0);
+}
+
+inline EffectThreadPool& EffectThreadPool::shared()
+{
+    static EffectThreadPool pool;
+    EffectThreadPool *threadPool = threadPoolSlot();
+    return threadPool ? *threadPool : pool;
+}
+
+inline void EffectThreadPool::setThreadPool(EffectThreadPool *pool)
+{
+    threadPoolSlot() = pool;
+}
+
+inline EffectThreadPool *&EffectThreadPool::threadPoolSlot()
+{
+    static __thread EffectThreadPool *pool;
+    return pool;
+}
+
+inline void EffectThreadPool::setConcurrency(unsigned numThreads)
+{
+    // Threads created/destroyed lazily
+    numThreadsConfigured = numThreads;
+}
+
+inline unsigned EffectThreadPool::getConcurrency()
+{
+    if (numThreadsConfigured == 0) {
+        numThreadsConfigured = std::max(1u, tthread::thread::hardware_concurrency());
+    }
+    return numThreadsConfigured;
+}
+
+inline void EffectThreadPool::add(const Effect *effect,
+    const Effect::FrameInfo &frame, std::vector<Vec3> &colors, unsigned long long *nanoseconds)
+{
+    colors.resize(frame.pixels.size());
+    if (frame.pixels.empty()) {
+        return;
+    }
+
+    Job j;
+    j.effect = effect;
+    j.frame = &frame;
+    j.colors = &colors[0];
+    j.func = 0;
+    j.context = 0;
+    j.count = frame.pixels.size();
+    j.nanoseconds = 0;
+    j.totalNanoseconds = nanoseconds;
+    jobs.push_back(j);
+}
+
+inline void EffectThreadPool::add(RangeFunc func, void *context, unsigned count)
+{
+    if (!count) {
+        return;
+    }
+
+    Job j;
+    j.effect = 0;
+    j.frame = 0;
+    j.colors = 0;
+    j.func = func;
+    j.context = context;
+    j.count = count;
+    j.nanoseconds = 0;
+    j.totalNanoseconds = 0;
+    jobs.push_back(j);
+}
+
+inline void EffectThreadPool::changeNumberOfThreads(unsigned count)
+{
+    /*
+     * Threads look at each other's queues, so rather than resize the pool while
+     * it's running, stop every thread and start over with the new count.
+     */
+
+    if (threads.size() == count) {
+        return;
+    }
+
+    wakeLock.lock();
+    for (unsigned i = 0; i < threads.size(); ++i) {
+        threads[i]->runFlag = false;
+    }
+    wakeCond.notify_all();
+    wakeLock.unlock();
+
+    // Any thread may still be stealing from any other queue, until they've all exited
+    for (unsigned i = 0; i < threads.size(); ++i) {
+        threads[i]->thread->join();
+    }
+    for (unsigned i = 0; i < threads.size(); ++i) {
+        delete threads[i]->thread;
+        delete threads[i];
+    }
+    threads.clear();
+
+    // All queues exist before any thread starts looking at them
+    for (unsigned i = 0; i < count; ++i) {
+        ThreadContext *tc = new ThreadContext;
+        tc->pool = this;
+        tc->thread = 0;
+        tc->index = i;
+        tc->lastGeneration = generation;
+        tc->runFlag = true;
+        threads.push_back(tc);
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        threads[i]->thread = new tthread::thread(threadFunc, threads[i]);
+    }
+}
+
+inline void EffectThreadPool::run()
+{
+    // Create/destroy threads, to reach the requested pool size
+    unsigned numThreads = getConcurrency();
+    changeNumberOfThreads(numThreads);
+
+    if (jobs.empty()) {
+        return;
+    }
+
+    std::vector<unsigned> batchSizes(jobs.size());
+    unsigned numTasks = 0;
+    for (unsigned i = 0; i < jobs.size(); ++i) {
+        batchSizes[i] = batchSize(jobs[i], numThreads);
+        numTasks += (jobs[i].count + batchSizes[i] - 1) / batchSizes[i];
+    }
+
+    // A thread still looking for work from the last frame may pick these up as soon as
+    // they're queued, so the count has to be in place first.
+    __atomic_store_n(&pendingTasks, numTasks, __ATOMIC_RELEASE);
+
+    // Deal out consecutive batches to each thread, so neighboring pixels stay together.
+
+    unsigned taskIndex = 0;
+    for (unsigned i = 0; i < jobs.size(); ++i) {
+        Task t;
+        t.job = &jobs[i];
+        t.begin = 0;
+
+        while (t.begin < t.job->count) {
+            t.end = std::min<unsigned>(t.job->count, t.begin + batchSizes[i]);
+            ThreadContext *tc = threads[(unsigned long long) taskIndex * numThreads / numTasks];
+            tc->lock.lock();
+            tc->tasks.push_front(t);
+            tc->lock.unlock();
+            t.begin = t.end;
+            taskIndex++;
+        }
+    }
+
+    // One wakeup for the whole frame. Spinning threads see the new generation on their own.
+    wakeLock.lock();
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    wakeCond.notify_all();
+    wakeLock.unlock();
+
+    completeLock.lock();
+    while (__atomic_load_n(&pendingTasks, __ATOMIC_ACQUIRE)) {
+        completeCond.wait(completeLock);
+    }
+    completeLock.unlock();
+
+    for (unsigned i = 0; i < jobs.size(); ++i) {
+        if (jobs[i].totalNanoseconds) {
+            *jobs[i].totalNanoseconds += jobs[i].nanoseconds;
+        }
+    }
+
+    updateCosts();
+    jobs.clear();
+}
+
+inline const void *EffectThreadPool::costKey(const Job &job)
+{
+    return job.effect ? (const void*) job.effect : (const void*) job.func;
+}
+
+inline unsigned EffectThreadPool::batchSize(const Job &job, unsigned numThreads)
+{
+    std::map<const void*, float>::const_iterator cost = costs.find(costKey(job));
+
+    if (cost == costs.end()) {
+        // Nothing measured yet. Give each CPU a few tasks, so that if our
+        // workload is asymmetric we'll end up with room to rebalance.
+        return 1 + job.count / (numThreads * 3);
+    }
+
+    // Aim for our target batch length, but always leave every thread something to do
+    float items = TARGET_BATCH_NANOSECONDS / std::max(cost->second, 1e-3f);
+    unsigned perThread = (job.count + numThreads - 1) / numThreads;
+    return std::max(1u, std::min(perThread, (unsigned) std::min(items, 1e9f)));
+}
+
+inline void EffectThreadPool::updateCosts()
+{
+    // Keep a running average per effect, so one slow frame doesn't throw it off
+
+    if (costs.size() > MAX_COSTS) {
+        // Probably effects coming and going. Start over.
+        costs.clear();
+    }
+
+    for (unsigned i = 0; i < jobs.size(); ++i) {
+        const Job &job = jobs[i];
+        float cost = job.nanoseconds / float(job.count);
+
+        std::map<const void*, float>::iterator j = costs.find(costKey(job));
+        if (j == costs.end()) {
+            costs[costKey(job)] = cost;
+        } else {
+            j->second += (cost - j->second) * 0.25f;
+        }
+    }
+}
+
+inline unsigned &EffectThreadPool::currentThreadSlot()
+{
+    static __thread unsigned index;
+    return index;
+}
+
+inline unsigned EffectThreadPool::currentThread()
+{
+    return currentThreadSlot();
+}
+
+inline void EffectThreadPool::threadFunc(void *context)
+{
+    ThreadContext* c = (ThreadContext*) context;
+    currentThreadSlot() = c->index;
+    c->pool->worker(*c);
+}
+
+inline void EffectThreadPool::worker(ThreadContext &context)
+{
+    while (waitForWork(context)) {
+        Task task;
+
+        while (nextTask(context, task)) {
+            runTask(task);
+
+            if (__atomic_sub_fetch(&pendingTasks, 1, __ATOMIC_ACQ_REL) == 0) {
+                // Finished the frame. Taking the lock means run() is either waiting, or hasn't checked yet.
+                completeLock.lock();
+                completeCond.notify_all();
+                completeLock.unlock();
+            }
+        }
+    }
+}
+
+inline bool EffectThreadPool::waitForWork(ThreadContext &context)
+{
+    // Wait for the next run(), or for the pool to shut down. Returns false to exit.
+
+    for (unsigned i = 0; i < SPIN_COUNT; ++i) {
+        unsigned current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+        if (current != context.lastGeneration) {
+            context.lastGeneration = current;
+            return true;
+        }
+        tthread::this_thread::yield();
+    }
+
+    wakeLock.lock();
+    while (__atomic_load_n(&generation, __ATOMIC_ACQUIRE) == context.lastGeneration && context.runFlag) {
+        wakeCond.wait(wakeLock);
+    }
+    bool running = context.runFlag;
+    context.lastGeneration = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    wakeLock.unlock();
+
+    return running;
+}
+
+inline bool EffectThreadPool::nextTask(ThreadContext &context, Task &task)
+{
+    // Our own batches first, in order, then steal from the far end of someone else's.
+
+    context.lock.lock();
+    if (!context.tasks.empty()) {
+        task = context.tasks.back();
+        context.tasks.pop_back();
+        context.lock.unlock();
+        return true;
+    }
+    context.lock.unlock();
+
+    for (unsigned i = 1; i < threads.size(); ++i) {
+        ThreadContext &victim = *threads[(context.index + i) % threads.size()];
+
+        victim.lock.lock();
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            victim.lock.unlock();
+            return true;
+        }
+        victim.lock.unlock();
+    }
+
+    return false;
+}
+
+inline void EffectThreadPool::runTask(const Task &task)
+{
+    Job &job = *task.job;
+    struct timeval start, end;
+    gettimeofday(&start, 0);
+
+    if (job.func) {
+        job.func(job.context, task.begin, task.end);
+
+    } else {
+        // Process a block of pixels
+        std::fill(job.colors + task.begin, job.colors + task.end, Vec3(0, 0, 0));
+        job.effect->shadeBatch(Effect::PixelBatch(*job.frame, task.begin, task.end),
+            job.colors + task.begin);
+    }
+
+    gettimeofday(&end, 0);
+    unsigned long long ns = (end.tv_sec - start.tv_sec) * 1000000000LL
+        + (end.tv_usec - start.tv_usec) * 1000LL;
+    __atomic_add_fetch(&job.nanoseconds, ns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,312 @@
+/*
+ * Fixed point math for effects, on CPUs without fast floating point.
+ *
+ * Values are Q16: signed 32-bit integers with 16 fractional bits, so 1.0 is
+ * 0x10000 and the range is about +/- 32768. Products go through 64 bits, which
+ * is a single multiply on ARM. There's a 3D noise function and an HSV color
+ * conversion that match the floating point ones in noise.h and color.h, and a
+ * matching FixedVec3 for points and colors.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "noise.h"
+#include "svl/SVL.h"
+
+typedef int32_t Fixed;
+
+static const Fixed FIXED_ONE = 1 << 16;
+static const Fixed FIXED_HALF_PI = 102944;
+static const Fixed FIXED_PI = 205887;
+
+
+static inline Fixed fixed_from_float(float a)
+{
+    // Round to nearest
+    return Fixed(a * 65536.0f + (a < 0 ? -0.5f : 0.5f));
+}
+
+static inline float fixed_to_float(Fixed a)
+{
+    return a * (1.0f / 65536.0f);
+}
+
+static inline Fixed fixed_mul(Fixed a, Fixed b)
+{
+    return Fixed((int64_t(a) * b) >> 16);
+}
+
+static inline Fixed fixed_div(Fixed a, Fixed b)
+{
+    return Fixed((int64_t(a) << 16) / b);
+}
+
+static inline Fixed fixed_ratio(Fixed a, Fixed b)
+{
+    /*
+     * a / b for 0 <= a <= b, b > 0, so the result is in [0, FIXED_ONE]. This only
+     * needs a 32-bit divide, which matters on ARM cores that do division in software.
+     * Both are shifted down until a << 16 fits, which keeps at least 15 bits of 'b'.
+     */
+
+    int shift = 16 - __builtin_clz(b);
+    if (shift > 0) {
+        a >>= shift;
+        b >>= shift;
+    }
+    return Fixed((uint32_t(a) << 16) / uint32_t(b));
+}
+
+static inline Fixed fixed_sq(Fixed a)
+{
+    return fixed_mul(a, a);
+}
+
+static inline Fixed fixed_abs(Fixed a)
+{
+    return a < 0 ? -a : a;
+}
+
+static inline Fixed fixed_min(Fixed a, Fixed b)
+{
+    return a < b ? a : b;
+}
+
+static inline Fixed fixed_max(Fixed a, Fixed b)
+{
+    return a > b ? a : b;
+}
+
+static inline Fixed fixed_sin(Fixed x)
+{
+    /*
+     * Same parabola approximation as fast_sin() in noise.h, with the extra
+     * precision step. 'x' is in radians. We convert to turns, where wrapping
+     * around is just the fractional bits, then to [-1, 1) for half a turn
+     * either side of pi. Since sin(pi + a) = -sin(a), the result is negated.
+     */
+
+    const Fixed turnsPerRadian = 10430;     // 1 / (2 pi)
+    Fixed a = (fixed_mul(x, turnsPerRadian) & 0xFFFF) * 2 - FIXED_ONE;
+
+    Fixed y = 4 * (a - fixed_mul(a, fixed_abs(a)));
+    const Fixed p = 14746;                  // 0.225
+    y = fixed_mul(p, fixed_mul(y, fixed_abs(y)) - y) + y;
+    return -y;
+}
+
+static inline Fixed fixed_atan2(Fixed y, Fixed x)
+{
+    /*
+     * Polynomial approximation on the first octant, accurate to about 0.0015 radians:
+     * atan(z) = pi/4 z - z (z - 1) (0.2447 + 0.0663 z), for z in [0, 1]. Other octants
+     * are reflections of it. Result is in (-pi, pi], like atan2f().
+     */
+
+    Fixed ax = fixed_abs(x);
+    Fixed ay = fixed_abs(y);
+    if (ax == 0 && ay == 0) {
+        return 0;
+    }
+
+    Fixed z = ax >= ay ? fixed_ratio(ay, ax) : fixed_ratio(ax, ay);
+    Fixed a = fixed_mul(z, 51472) - fixed_mul(fixed_mul(z, z - FIXED_ONE), 16037 + fixed_mul(4345, z));
+
+    if (ay > ax) a = FIXED_HALF_PI - a;
+    if (x < 0) a = FIXED_PI - a;
+    return y < 0 ? -a : a;
+}
+
+static inline void fixed_hsv2rgb(Fixed rgb[3], Fixed h, Fixed s, Fixed v)
+{
+    /*
+     * Same as hsv2rgb() in color.h, with all values in Q16. Hue wraps, which
+     * for fixed point is just taking the fractional bits.
+     */
+
+    h = (h & 0xFFFF) * 6;
+
+    int i = h >> 16;
+    Fixed f = h & 0xFFFF;
+    Fixed p = fixed_mul(v, FIXED_ONE - s);
+    Fixed q = fixed_mul(v, FIXED_ONE - fixed_mul(f, s));
+    Fixed t = fixed_mul(v, FIXED_ONE - fixed_mul(FIXED_ONE - f, s));
+
+    switch (i) {
+        case 0: rgb[0] = v; rgb[1] = t; rgb[2] = p; break;
+        case 1: rgb[0] = q; rgb[1] = v; rgb[2] = p; break;
+        case 2: rgb[0] = p; rgb[1] = v; rgb[2] = t; break;
+        case 3: rgb[0] = p; rgb[1] = q; rgb[2] = v; break;
+        case 4: rgb[0] = t; rgb[1] = p; rgb[2] = v; break;
+        case 5: rgb[0] = v; rgb[1] = p; rgb[2] = q; break;
+    }
+}
+
+// Integer copy of GRAD3 from noise.h
+const signed char FIXED_GRAD3[][3] = {
+    {1,1,0},{-1,1,0},{1,-1,0},{-1,-1,0},
+    {1,0,1},{-1,0,1},{1,0,-1},{-1,0,-1},
+    {0,1,1},{0,-1,1},{0,1,-1},{0,-1,-1}};
+
+static inline Fixed fixed_noise3(Fixed x, Fixed y, Fixed z)
+{
+    /*
+     * Simplex noise, the same as noise3() in noise.h to within rounding, using the same
+     * permutation table. Inputs should stay within about +/- 10000, so their sum fits.
+     * Skewing uses 64-bit products with the factors in Q32, so the lattice cell and
+     * the position inside it stay exact even far from the origin.
+     */
+
+    int c, o1[3], o2[3], g[4];
+    Fixed pos[4][3];
+    Fixed noise = 0;
+
+    // s = (x + y + z) / 3
+    Fixed s = Fixed(((int64_t(x) + y + z) * 1431655765LL) >> 32);
+    int i = (x + s) >> 16;
+    int j = (y + s) >> 16;
+    int k = (z + s) >> 16;
+
+    // t = (i + j + k) / 6, in Q16
+    Fixed t = Fixed((int64_t(i + j + k) * 715827883LL) >> 16);
+
+    pos[0][0] = x - (i << 16) + t;
+    pos[0][1] = y - (j << 16) + t;
+    pos[0][2] = z - (k << 16) + t;
+
+    if (pos[0][0] >= pos[0][1]) {
+        if (pos[0][1] >= pos[0][2]) {
+            ASSIGN(o1, 1, 0, 0);
+            ASSIGN(o2, 1, 1, 0);
+        } else if (pos[0][0] >= pos[0][2]) {
+            ASSIGN(o1, 1, 0, 0);
+            ASSIGN(o2, 1, 0, 1);
+        } else {
+            ASSIGN(o1, 0, 0, 1);
+            ASSIGN(o2, 1, 0, 1);
+        }
+    } else {
+        if (pos[0][1] < pos[0][2]) {
+            ASSIGN(o1, 0, 0, 1);
+            ASSIGN(o2, 0, 1, 1);
+        } else if (pos[0][0] < pos[0][2]) {
+            ASSIGN(o1, 0, 1, 0);
+            ASSIGN(o2, 0, 1, 1);
+        } else {
+            ASSIGN(o1, 0, 1, 0);
+            ASSIGN(o2, 1, 1, 0);
+        }
+    }
+
+    const Fixed g3 = 10923;     // 1/6
+    for (c = 0; c <= 2; c++) {
+        pos[3][c] = pos[0][c] - FIXED_ONE + 3 * g3;
+        pos[2][c] = pos[0][c] - (o2[c] << 16) + 2 * g3;
+        pos[1][c] = pos[0][c] - (o1[c] << 16) + g3;
+    }
+
+    int I = i & 255;
+    int J = j & 255;
+    int K = k & 255;
+    g[0] = PERM[I + PERM[J + PERM[K]]] % 12;
+    g[1] = PERM[I + o1[0] + PERM[J + o1[1] + PERM[o1[2] + K]]] % 12;
+    g[2] = PERM[I + o2[0] + PERM[J + o2[1] + PERM[o2[2] + K]]] % 12;
+    g[3] = PERM[I + 1 + PERM[J + 1 + PERM[K + 1]]] % 12;
+
+    for (c = 0; c <= 3; c++) {
+        // 0.6 - |pos|^2
+        Fixed f = 39322 - fixed_sq(pos[c][0]) - fixed_sq(pos[c][1]) - fixed_sq(pos[c][2]);
+        if (f > 0) {
+            const signed char *grad = FIXED_GRAD3[g[c]];
+            Fixed d = grad[0] * pos[c][0] + grad[1] * pos[c][1] + grad[2] * pos[c][2];
+            f = fixed_sq(f);
+            noise += fixed_mul(fixed_sq(f), d);
+        }
+    }
+
+    return noise * 32;
+}
+
+static inline Fixed fixed_fbm_noise3(Fixed x, Fixed y, Fixed z, int octaves)
+{
+    // Same as fbm_noise3() with the default persistence of 0.5 and lacunarity of 2.
+    // The total is normalized by 'max', which is in [1, 2).
+    Fixed amp = FIXED_ONE;
+    Fixed max = FIXED_ONE;
+    Fixed total = fixed_noise3(x, y, z);
+
+    for (int i = 1; i < octaves; ++i) {
+        x *= 2;
+        y *= 2;
+        z *= 2;
+        amp >>= 1;
+        max += amp;
+        total += fixed_mul(fixed_noise3(x, y, z), amp);
+    }
+    return fixed_mul(total, fixed_ratio(FIXED_ONE / 2, max) * 2);
+}
+
+
+// A point or color in Q16
+class FixedVec3 {
+public:
+    FixedVec3() {}
+    FixedVec3(Fixed x, Fixed y, Fixed z) { v[0] = x; v[1] = y; v[2] = z; }
+    explicit FixedVec3(const Vec3 &a)
+    {
+        v[0] = fixed_from_float(a[0]);
+        v[1] = fixed_from_float(a[1]);
+        v[2] = fixed_from_float(a[2]);
+    }
+
+    Vec3 toVec3() const
+    {
+        return Vec3(fixed_to_float(v[0]), fixed_to_float(v[1]), fixed_to_float(v[2]));
+    }
+
+    Fixed &operator[] (int i) { return v[i]; }
+    const Fixed &operator[] (int i) const { return v[i]; }
+
+    FixedVec3 operator+ (const FixedVec3 &a) const { return FixedVec3(v[0] + a[0], v[1] + a[1], v[2] + a[2]); }
+    FixedVec3 operator- (const FixedVec3 &a) const { return FixedVec3(v[0] - a[0], v[1] - a[1], v[2] - a[2]); }
+    FixedVec3 operator* (Fixed s) const { return FixedVec3(fixed_mul(v[0], s), fixed_mul(v[1], s), fixed_mul(v[2], s)); }
+
+    FixedVec3 &operator+= (const FixedVec3 &a) { v[0] += a[0]; v[1] += a[1]; v[2] += a[2]; return *this; }
+    FixedVec3 &operator-= (const FixedVec3 &a) { v[0] -= a[0]; v[1] -= a[1]; v[2] -= a[2]; return *this; }
+
+    Fixed v[3];
+};
+
+static inline Fixed sqrlen(const FixedVec3 &a)
+{
+    return fixed_sq(a[0]) + fixed_sq(a[1]) + fixed_sq(a[2]);
+}
+
+static inline void fixed_hsv2rgb(FixedVec3 &rgb, Fixed h, Fixed s, Fixed v)
+{
+    fixed_hsv2rgb(rgb.v, h, s, v);
+}
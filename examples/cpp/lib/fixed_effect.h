@@ -0,0 +1,103 @@
+/*
+ * Base class for effects written in fixed point, for renderers on CPUs
+ * without fast floating point.
+ *
+ * Subclasses write fixedShader(), and optionally a batched shadeFixedBatch(),
+ * in the Q16 math from fixed.h. Connected directly to the EffectRunner, the
+ * effect is shaded and converted to 8-bit without any floating point per pixel.
+ * Anywhere else, like in an EffectMixer or behind Brightness, the float shader()
+ * and shadeBatch() convert its results, so it still works as any other Effect.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include "effect.h"
+#include "fixed.h"
+
+
+class FixedEffect : public Effect {
+public:
+    /*
+     * Calculate a pixel value in Q16, for a pixel at 'point'. The color is nominally
+     * in [0, FIXED_ONE], and 'rgb' is initialized to zero. The same rules apply as
+     * for shader(); p.point is there too, but reading it means floating point math.
+     */
+    virtual void fixedShader(FixedVec3& rgb, const FixedVec3& point, const PixelInfo& p) const = 0;
+
+    // By default, this calls fixedShader() for each mapped pixel
+    virtual void shadeFixedBatch(const PixelBatch& batch, FixedVec3* out) const;
+    virtual bool hasFixedShader() const;
+
+    // Floating point versions, converted from the fixed point ones
+    virtual void shader(Vec3& rgb, const PixelInfo& p) const;
+    virtual void shadeBatch(const PixelBatch& batch, Vec3* out) const;
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline bool FixedEffect::hasFixedShader() const
+{
+    return true;
+}
+
+inline void FixedEffect::shadeFixedBatch(const PixelBatch& batch, FixedVec3* out) const
+{
+    for (unsigned i = 0; i < batch.count; i++) {
+        if (batch.isMapped(i)) {
+            fixedShader(out[i], FixedVec3(batch.fixedX[i], batch.fixedY[i], batch.fixedZ[i]), batch.pixels[i]);
+        }
+    }
+}
+
+inline void FixedEffect::shader(Vec3& rgb, const PixelInfo& p) const
+{
+    FixedVec3 color(0, 0, 0);
+    fixedShader(color, FixedVec3(p.point), p);
+    rgb = color.toVec3();
+}
+
+inline void FixedEffect::shadeBatch(const PixelBatch& batch, Vec3* out) const
+{
+    // Shade short pieces of the batch at a time, into a buffer on the stack
+    static const unsigned chunk = 64;
+    FixedVec3 colors[chunk];
+
+    for (unsigned base = 0; base < batch.count; base += chunk) {
+        unsigned n = std::min(chunk, batch.count - base);
+
+        std::fill(colors, colors + n, FixedVec3(0, 0, 0));
+        shadeFixedBatch(PixelBatch(batch, base, n), colors);
+
+        for (unsigned i = 0; i < n; i++) {
+            out[base + i] = colors[i].toVec3();
+        }
+    }
+}
@@ -0,0 +1,389 @@
+/*
+ * Base class for effects that shade on a GPU, with an OpenGL ES 3.1 compute shader.
+ *
+ * Subclasses supply GLSL for a function "vec3 shade(vec3 point, uint index)",
+ * with any uniforms it declares, and set those uniforms in setUniforms() each
+ * frame. Connected directly to the EffectRunner, every pixel is shaded at once on
+ * the GPU and read back as finished 8-bit RGB, ready to send. Points go to the GPU
+ * once per layout. Colors take turns between two buffers, and each frame reads
+ * back the last one's while the GPU works on this one, so the CPU doesn't sit
+ * waiting on the GPU. That makes the output one frame behind, and the very first
+ * frame is shown twice.
+ *
+ * The float shader() is still needed, for anywhere else: in an EffectMixer, behind
+ * Brightness, or without a GPU. If there's no ES 3.1 context to be had or the
+ * shader doesn't compile, the effect says why on stderr and shades on the CPU.
+ *
+ * This needs EGL and OpenGL ES 3.1; link with -lEGL -lGLESv2. There's no window,
+ * so it runs headless on a surfaceless context, even on Mesa's software renderer.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES3/gl31.h>
+#include "effect.h"
+
+
+class GpuEffect : public Effect {
+public:
+    GpuEffect();
+    virtual ~GpuEffect();
+
+    // GLSL source for shade(), returning colors in [0, 1], and its uniforms
+    virtual const char *kernelSource() const = 0;
+
+    // Optional, called each frame with the shader bound, to set uniforms with setUniform()
+    virtual void setUniforms(const FrameInfo& f);
+
+    // Shades on the GPU, unless that has failed
+    virtual bool hasFrameShader() const;
+    virtual bool shadeFrame(const FrameInfo& f, uint8_t* rgb);
+
+    // Has a frame been shaded on the GPU, with nothing going wrong since?
+    bool isGpuReady() const;
+
+protected:
+    void setUniform(const char *name, float value);
+    void setUniform(const char *name, int value);
+    void setUniform(const char *name, Vec2 value);
+    void setUniform(const char *name, Vec3 value);
+
+private:
+    // Each invocation shades four pixels, which pack into three whole words of RGB
+    static const unsigned PIXELS_PER_INVOCATION = 4;
+    static const unsigned WORKGROUP_SIZE = 64;       // local_size_x, in compile()
+    static const unsigned READBACK_TIMEOUT_NS = 1000000000;
+
+    EGLDisplay display;
+    EGLContext context;
+    GLuint program;
+    GLuint pointBuffer;
+    GLuint colorBuffers[2];
+    GLsync fences[2];
+    bool shaded[2];
+    unsigned turn;
+    bool ready;
+    bool failed;
+
+    // The layout whose points are on the GPU
+    const Real *uploadedPoints;
+    unsigned uploadedCount;
+
+    bool init();
+    bool compile();
+    void uploadPoints(const FrameInfo& f);
+    bool readColors(unsigned buffer, uint8_t* rgb);
+    bool fail(const char *why);
+    void release();
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline GpuEffect::GpuEffect()
+    : display(EGL_NO_DISPLAY), context(EGL_NO_CONTEXT), program(0), pointBuffer(0),
+      turn(0), ready(false), failed(false), uploadedPoints(0), uploadedCount(0)
+{
+    for (unsigned i = 0; i < 2; i++) {
+        colorBuffers[i] = 0;
+        fences[i] = 0;
+        shaded[i] = false;
+    }
+}
+
+inline GpuEffect::~GpuEffect()
+{
+    release();
+}
+
+inline void GpuEffect::setUniforms(const FrameInfo&) {}
+
+inline bool GpuEffect::hasFrameShader() const
+{
+    return !failed;
+}
+
+inline bool GpuEffect::isGpuReady() const
+{
+    return ready && !failed;
+}
+
+inline bool GpuEffect::init()
+{
+    // A display with no window system, if EGL has one
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0);
+    }
+#endif
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, 0, 0) || !eglBindAPI(EGL_OPENGL_ES_API)) {
+        return fail("can't open an EGL display");
+    }
+
+    // Any ES 3 config will do, since nothing gets drawn. Without one, ask for none.
+    static const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR, EGL_NONE };
+    static const EGLint contextAttribs[] = { EGL_CONTEXT_MAJOR_VERSION_KHR, 3, EGL_CONTEXT_MINOR_VERSION_KHR, 1, EGL_NONE };
+    EGLConfig config = 0;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) {
+        config = 0;
+    }
+
+    context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        return fail("can't create an OpenGL ES 3.1 context");
+    }
+    if (!compile()) {
+        return false;
+    }
+
+    glGenBuffers(1, &pointBuffer);
+    glGenBuffers(2, colorBuffers);
+    ready = true;
+    return true;
+}
+
+inline bool GpuEffect::compile()
+{
+    // shade() is called for mapped pixels only; the rest stay black. Channels are
+    // rounded to bytes, and four pixels' worth pack into three little-endian words.
+
+    std::string source =
+        "#version 310 es\n"
+        "layout(local_size_x = 64) in;\n"
+        "layout(std430, binding = 0) readonly buffer Points { vec4 points[]; };\n"
+        "layout(std430, binding = 1) writeonly buffer Colors { uint colors[]; };\n"
+        "uniform uint pixelCount;\n"
+        "#line 1\n";
+    source += kernelSource();
+    source +=
+        "\n"
+        "void main() {\n"
+        "    uint first = gl_GlobalInvocationID.x * 4u;\n"
+        "    if (first >= pixelCount) return;\n"
+        "    uint bytes[12];\n"
+        "    for (uint i = 0u; i < 4u; i++) {\n"
+        "        vec3 rgb = vec3(0.0);\n"
+        "        uint n = first + i;\n"
+        "        if (n < pixelCount && points[n].w != 0.0) rgb = shade(points[n].xyz, n);\n"
+        "        uvec3 c = uvec3(clamp(rgb, 0.0, 1.0) * 255.0 + 0.5);\n"
+        "        bytes[i*3u] = c.r; bytes[i*3u + 1u] = c.g; bytes[i*3u + 2u] = c.b;\n"
+        "    }\n"
+        "    for (uint j = 0u; j < 3u; j++) {\n"
+        "        colors[gl_GlobalInvocationID.x * 3u + j] = bytes[j*4u] | (bytes[j*4u + 1u] << 8) |\n"
+        "            (bytes[j*4u + 2u] << 16) | (bytes[j*4u + 3u] << 24);\n"
+        "    }\n"
+        "}\n";
+
+    const char *text = source.c_str();
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &text, 0);
+    glCompileShader(shader);
+
+    GLint ok = 0;
+    char log[2048];
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        glGetShaderInfoLog(shader, sizeof log, 0, log);
+        fprintf(stderr, "GPU effect shader doesn't compile:\n%s\n", log);
+        glDeleteShader(shader);
+        return fail("shader error");
+    }
+
+    program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        glGetProgramInfoLog(program, sizeof log, 0, log);
+        fprintf(stderr, "GPU effect shader doesn't link:\n%s\n", log);
+        return fail("shader error");
+    }
+    return true;
+}
+
+inline void GpuEffect::uploadPoints(const FrameInfo& f)
+{
+    // Whole invocations' worth, with mapped-ness in the fourth component
+
+    unsigned count = f.pixels.size();
+    unsigned padded = (count + PIXELS_PER_INVOCATION - 1) / PIXELS_PER_INVOCATION * PIXELS_PER_INVOCATION;
+    std::vector<float> points(padded * 4, 0.0f);
+    for (unsigned i = 0; i < count; i++) {
+        points[i*4 + 0] = f.pointX[i];
+        points[i*4 + 1] = f.pointY[i];
+        points[i*4 + 2] = f.pointZ[i];
+        points[i*4 + 3] = f.isMapped(i);
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, points.size() * sizeof points[0], &points[0], GL_STATIC_DRAW);
+    for (unsigned i = 0; i < 2; i++) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, colorBuffers[i]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, padded * 3, 0, GL_STREAM_READ);
+        if (fences[i]) {
+            glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+        shaded[i] = false;
+    }
+
+    uploadedPoints = &f.points[0];
+    uploadedCount = count;
+}
+
+inline bool GpuEffect::shadeFrame(const FrameInfo& f, uint8_t* rgb)
+{
+    if (failed || f.pixels.empty()) {
+        return false;
+    }
+    if (!ready) {
+        if (!init()) {
+            return false;
+        }
+    } else if (eglGetCurrentContext() != context) {
+        // Another GpuEffect has been running
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+    }
+
+    if (uploadedPoints != &f.points[0] || uploadedCount != f.pixels.size()) {
+        uploadPoints(f);
+    }
+
+    unsigned current = turn;
+    unsigned last = turn ^ 1;
+    unsigned invocations = (uploadedCount + PIXELS_PER_INVOCATION - 1) / PIXELS_PER_INVOCATION;
+
+    glUseProgram(program);
+    glUniform1ui(glGetUniformLocation(program, "pixelCount"), uploadedCount);
+    setUniforms(f);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, pointBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, colorBuffers[current]);
+    glDispatchCompute((invocations + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    fences[current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    shaded[current] = true;
+    turn = last;
+
+    // The last frame's colors, unless this is the first since the layout was uploaded
+    return readColors(shaded[last] ? last : current, rgb);
+}
+
+inline bool GpuEffect::readColors(unsigned buffer, uint8_t* rgb)
+{
+    if (fences[buffer]) {
+        GLenum status = glClientWaitSync(fences[buffer], GL_SYNC_FLUSH_COMMANDS_BIT, READBACK_TIMEOUT_NS);
+        glDeleteSync(fences[buffer]);
+        fences[buffer] = 0;
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            return fail("the GPU isn't finishing frames");
+        }
+    }
+
+    unsigned size = uploadedCount * 3;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, colorBuffers[buffer]);
+    const void *colors = glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, size, GL_MAP_READ_BIT);
+    if (!colors) {
+        return fail("can't read colors back from the GPU");
+    }
+    memcpy(rgb, colors, size);
+    glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+    return true;
+}
+
+inline void GpuEffect::setUniform(const char *name, float value)
+{
+    glUniform1f(glGetUniformLocation(program, name), value);
+}
+
+inline void GpuEffect::setUniform(const char *name, int value)
+{
+    glUniform1i(glGetUniformLocation(program, name), value);
+}
+
+inline void GpuEffect::setUniform(const char *name, Vec2 value)
+{
+    glUniform2f(glGetUniformLocation(program, name), value[0], value[1]);
+}
+
+inline void GpuEffect::setUniform(const char *name, Vec3 value)
+{
+    glUniform3f(glGetUniformLocation(program, name), value[0], value[1], value[2]);
+}
+
+inline bool GpuEffect::fail(const char *why)
+{
+    fprintf(stderr, "GPU effect: %s, shading on the CPU instead\n", why);
+    release();
+    failed = true;
+    return false;
+}
+
+inline void GpuEffect::release()
+{
+    if (context != EGL_NO_CONTEXT) {
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+        for (unsigned i = 0; i < 2; i++) {
+            if (fences[i]) {
+                glDeleteSync(fences[i]);
+                fences[i] = 0;
+            }
+        }
+        glDeleteBuffers(2, colorBuffers);
+        glDeleteBuffers(1, &pointBuffer);
+        glDeleteProgram(program);
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        context = EGL_NO_CONTEXT;
+    }
+
+    // The display stays initialized, since EGL shares it with everyone else in the process
+    ready = false;
+    program = 0;
+    pointBuffer = 0;
+    colorBuffers[0] = colorBuffers[1] = 0;
+    uploadedPoints = 0;
+    uploadedCount = 0;
+}
@@ -0,0 +1,465 @@
+/*
+ * On-disk cache of everything FrameInfo works out from a layout, for renderers
+ * that restart often. A cache file has the pixels' points in frame order, where
+ * each pixel goes in the framebuffer, the mapped bits, bounds, parsed attributes,
+ * and the built K-D tree. Loading one is a memory map and a few copies, with no
+ * attribute parsing, spatial sorting, or tree building.
+ *
+ * Files are named by a key: a hash of the layout file's contents, mixed with
+ * whether it's loaded in spatial order, the cache format, and this build's type
+ * sizes. Editing the layout gives it a new key, so a stale entry is never used,
+ * but it isn't removed either. The directory can be emptied at any time.
+ * Entries are written under a temporary name and renamed into place. A file
+ * whose contents don't match the hash in its header is ignored.
+ *
+ * File format, in this machine's byte order and type sizes:
+ *
+ *   "FCC1", format version (u32), key, payload hash, payload bytes (u64 each)
+ *   Payload:
+ *      Pixel count, output index count (0 or the pixel count), attribute count,
+ *         tree bytes (u32 each)
+ *      Model min, model max, model radius (Reals)
+ *      Output index (u32 per pixel)
+ *      Mapped pixels, one bit per pixel, in (pixel count + 31) / 32 u32 words
+ *      Points, packed (x, y, z) per pixel, as Reals
+ *      For each attribute:
+ *         Number of components, name length in bytes (a multiple of 4; u32 each)
+ *         Name, padded with NUL bytes
+ *         Values, one run of components per pixel, as Reals
+ *      The K-D tree, from nanoflann's saveIndex()
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "effect.h"
+
+
+class LayoutCache {
+public:
+    LayoutCache();
+
+    // Keep cache files in this directory, creating it (and its parent) if need be
+    void setDirectory(const char *directory);
+    bool isEnabled() const;
+
+    // Key for a layout file, or zero if it can't be read
+    uint64_t key(const char *filename, bool spatialOrder) const;
+
+    /*
+     * Set up a FrameInfo from a cache entry, as FrameInfo::init() does from a layout.
+     * For a JSON layout, pass the parsed document so each PixelInfo points into it;
+     * it has to have the same number of pixels. Returns false on a miss.
+     */
+    bool load(uint64_t key, Effect::FrameInfo &frame, const rapidjson::Value *layout = 0) const;
+
+    // Write a cache entry for a FrameInfo that's just been loaded
+    bool save(uint64_t key, const Effect::FrameInfo &frame) const;
+
+private:
+    static const uint32_t VERSION = 1;
+    static const unsigned HEADER_BYTES = 32;
+
+    std::string directory;
+
+    std::string path(uint64_t key) const;
+    static uint64_t hash(const uint8_t *data, size_t size, uint64_t seed);
+    static bool makeDirectory(const std::string &dir);
+
+    // Bounds-checked reads through a payload
+    struct Attribute {
+        const char *name;
+        unsigned components;
+        const uint8_t *values;
+    };
+
+    struct Reader {
+        const uint8_t *p, *end;
+        bool ok;
+        const uint8_t *take(uint64_t bytes);
+        uint32_t word();
+        void copy(void *dest, uint64_t bytes);
+    };
+
+    static void writeBytes(FILE *f, const void *data, size_t size, bool &ok);
+    static void writeWord(FILE *f, uint32_t value, bool &ok);
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline LayoutCache::LayoutCache() {}
+
+inline void LayoutCache::setDirectory(const char *dir)
+{
+    directory = dir ? dir : "";
+    if (!directory.empty() && !makeDirectory(directory)) {
+        fprintf(stderr, "Can't create layout cache directory %s\n", dir);
+        directory.clear();
+    }
+}
+
+inline bool LayoutCache::isEnabled() const
+{
+    return !directory.empty();
+}
+
+inline bool LayoutCache::makeDirectory(const std::string &dir)
+{
+    // Good enough for something like ~/.cache/fadecandy that's missing one level
+    if (mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST) {
+        return true;
+    }
+    size_t slash = dir.find_last_of('/');
+    if (errno != ENOENT || slash == std::string::npos || slash == 0) {
+        return false;
+    }
+    std::string parent = dir.substr(0, slash);
+    return (mkdir(parent.c_str(), 0755) == 0 || errno == EEXIST)
+        && (mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST);
+}
+
+inline std::string LayoutCache::path(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof name, "/%016llx.fcc", (unsigned long long) key);
+    return directory + name;
+}
+
+inline uint64_t LayoutCache::hash(const uint8_t *data, size_t size, uint64_t seed)
+{
+    // FNV-1a, a word at a time. Quick, and plenty to tell layouts apart.
+    const uint64_t prime = 0x100000001b3ULL;
+    uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof word);
+        h = (h ^ word) * prime;
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i]) * prime;
+    }
+    return h;
+}
+
+inline uint64_t LayoutCache::key(const char *filename, bool spatialOrder) const
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        mapping = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return 0;
+    }
+
+    uint64_t seed = VERSION | (uint64_t(spatialOrder) << 8) | (uint64_t(sizeof(Real)) << 16)
+        | (uint64_t(sizeof(size_t)) << 24) | (uint64_t(sizeof(void*)) << 32);
+    uint64_t k = hash((const uint8_t*) mapping, st.st_size, seed);
+    munmap(mapping, st.st_size);
+    return k ? k : 1;
+}
+
+inline const uint8_t *LayoutCache::Reader::take(uint64_t bytes)
+{
+    if (!ok || bytes > uint64_t(end - p)) {
+        ok = false;
+        return 0;
+    }
+    const uint8_t *result = p;
+    p += bytes;
+    return result;
+}
+
+inline uint32_t LayoutCache::Reader::word()
+{
+    uint32_t value = 0;
+    copy(&value, sizeof value);
+    return value;
+}
+
+inline void LayoutCache::Reader::copy(void *dest, uint64_t bytes)
+{
+    const uint8_t *src = take(bytes);
+    if (src && bytes) {
+        memcpy(dest, src, bytes);
+    }
+}
+
+inline bool LayoutCache::load(uint64_t key, Effect::FrameInfo &frame, const rapidjson::Value *layout) const
+{
+    if (!isEnabled() || !key) {
+        return false;
+    }
+
+    std::string filename = path(key);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) HEADER_BYTES) {
+        mapping = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    const uint8_t *data = (const uint8_t*) mapping;
+    uint32_t version;
+    uint64_t fileKey, payloadHash, payloadBytes;
+    memcpy(&version, data + 4, 4);
+    memcpy(&fileKey, data + 8, 8);
+    memcpy(&payloadHash, data + 16, 8);
+    memcpy(&payloadBytes, data + 24, 8);
+
+    // Nothing is used until the whole payload checks out
+    bool ok = !memcmp(data, "FCC1", 4) && version == VERSION && fileKey == key
+        && payloadBytes == uint64_t(st.st_size) - HEADER_BYTES
+        && hash(data + HEADER_BYTES, payloadBytes, key) == payloadHash;
+
+    Reader r = { data + HEADER_BYTES, data + st.st_size, ok };
+    uint32_t pixelCount = r.word();
+    uint32_t outputCount = r.word();
+    uint32_t attributeCount = r.word();
+    uint32_t treeBytes = r.word();
+    r.ok = r.ok && pixelCount > 0 && (outputCount == 0 || outputCount == pixelCount)
+        && (!layout || (layout->IsArray() && layout->Size() == pixelCount));
+
+    Vec3 modelMin, modelMax;
+    Real modelRadius = 0;
+    for (unsigned j = 0; j < 3; j++) {
+        r.copy(&modelMin[j], sizeof(Real));
+    }
+    for (unsigned j = 0; j < 3; j++) {
+        r.copy(&modelMax[j], sizeof(Real));
+    }
+    r.copy(&modelRadius, sizeof modelRadius);
+
+    const uint8_t *outputs = r.take(uint64_t(outputCount) * 4);
+    const uint8_t *mappedBits = r.take((uint64_t(pixelCount) + 31) / 32 * 4);
+    const uint8_t *points = r.take(uint64_t(pixelCount) * 3 * sizeof(Real));
+
+    std::vector<Attribute> attributes;
+    for (unsigned a = 0; r.ok && a < attributeCount; a++) {
+        Attribute attr;
+        attr.components = r.word();
+        uint32_t nameLength = r.word();
+        attr.name = (const char*) r.take(nameLength);
+        if (!r.ok || attr.components == 0 || nameLength == 0 || nameLength % 4 || attr.name[nameLength - 1] != '\0') {
+            r.ok = false;
+            break;
+        }
+        attr.values = r.take(uint64_t(pixelCount) * attr.components * sizeof(Real));
+        attributes.push_back(attr);
+    }
+
+    // Checked, so nanoflann reads exactly what it wrote
+    const uint8_t *tree = r.take(treeBytes);
+    FILE *treeFile = r.ok && r.p == r.end ? fmemopen((void*) tree, treeBytes, "rb") : 0;
+    if (!treeFile) {
+        munmap(mapping, st.st_size);
+        return false;
+    }
+
+    frame.timeDelta = 0;
+    frame.outputIndex.resize(outputCount);
+    frame.mapped.resize((pixelCount + 31) / 32);
+    frame.points.resize(pixelCount * 3);
+    if (outputCount) {
+        memcpy(&frame.outputIndex[0], outputs, outputCount * 4);
+    }
+    memcpy(&frame.mapped[0], mappedBits, frame.mapped.size() * 4);
+    memcpy(&frame.points[0], points, frame.points.size() * sizeof(Real));
+
+    frame.attributes.clear();
+    for (unsigned a = 0; a < attributes.size(); a++) {
+        Effect::FrameInfo::AttributeArray &array = frame.attributes[attributes[a].name];
+        array.components = attributes[a].components;
+        array.values.resize(pixelCount * array.components);
+        memcpy(&array.values[0], attributes[a].values, array.values.size() * sizeof(Real));
+    }
+
+    frame.pixels.clear();
+    frame.pixels.reserve(pixelCount);
+    frame.pointX.resize(pixelCount);
+    frame.pointY.resize(pixelCount);
+    frame.pointZ.resize(pixelCount);
+    frame.fixedX.resize(pixelCount);
+    frame.fixedY.resize(pixelCount);
+    frame.fixedZ.resize(pixelCount);
+
+    for (unsigned i = 0; i < pixelCount; i++) {
+        const Real *p = &frame.points[i * 3];
+        Effect::PixelInfo info(i, Vec3(p[0], p[1], p[2]), frame.isMapped(i));
+        if (layout) {
+            info.layout = &(*layout)[outputCount ? frame.outputIndex[i] : i];
+        }
+        frame.pixels.push_back(info);
+
+        frame.pointX[i] = p[0];
+        frame.pointY[i] = p[1];
+        frame.pointZ[i] = p[2];
+        frame.fixedX[i] = fixed_from_float(p[0]);
+        frame.fixedY[i] = fixed_from_float(p[1]);
+        frame.fixedZ[i] = fixed_from_float(p[2]);
+    }
+
+    frame.modelMin = modelMin;
+    frame.modelMax = modelMax;
+    frame.modelRadius = modelRadius;
+
+    frame.tree.freeIndex();
+    frame.tree.loadIndex(treeFile);
+    fclose(treeFile);
+    munmap(mapping, st.st_size);
+    return true;
+}
+
+inline void LayoutCache::writeBytes(FILE *f, const void *data, size_t size, bool &ok)
+{
+    ok = ok && (size == 0 || fwrite(data, size, 1, f) == 1);
+}
+
+inline void LayoutCache::writeWord(FILE *f, uint32_t value, bool &ok)
+{
+    writeBytes(f, &value, sizeof value, ok);
+}
+
+inline bool LayoutCache::save(uint64_t key, const Effect::FrameInfo &frame) const
+{
+    if (!isEnabled() || !key || frame.pixels.empty()) {
+        return false;
+    }
+
+    std::string filename = path(key);
+    char suffix[32];
+    snprintf(suffix, sizeof suffix, ".%d.tmp", (int) getpid());
+    std::string temporary = filename + suffix;
+
+    FILE *f = fopen(temporary.c_str(), "w+b");
+    if (!f) {
+        fprintf(stderr, "Can't write layout cache %s\n", temporary.c_str());
+        return false;
+    }
+
+    // Header for now, filled in once the payload can be hashed
+    uint8_t header[HEADER_BYTES];
+    memset(header, 0, sizeof header);
+    bool ok = true;
+    writeBytes(f, header, sizeof header, ok);
+
+    unsigned count = frame.pixels.size();
+    writeWord(f, count, ok);
+    writeWord(f, frame.outputIndex.size(), ok);
+    writeWord(f, frame.attributes.size(), ok);
+    long treeSizeOffset = ftell(f);
+    writeWord(f, 0, ok);
+
+    for (unsigned j = 0; j < 3; j++) {
+        writeBytes(f, &frame.modelMin[j], sizeof(Real), ok);
+    }
+    for (unsigned j = 0; j < 3; j++) {
+        writeBytes(f, &frame.modelMax[j], sizeof(Real), ok);
+    }
+    writeBytes(f, &frame.modelRadius, sizeof(Real), ok);
+
+    if (!frame.outputIndex.empty()) {
+        for (unsigned i = 0; i < count; i++) {
+            writeWord(f, frame.outputIndex[i], ok);
+        }
+    }
+    writeBytes(f, &frame.mapped[0], frame.mapped.size() * 4, ok);
+    writeBytes(f, &frame.points[0], frame.points.size() * sizeof(Real), ok);
+
+    std::map<std::string, Effect::FrameInfo::AttributeArray>::const_iterator a, e;
+    for (a = frame.attributes.begin(), e = frame.attributes.end(); a != e; ++a) {
+        std::vector<char> name(a->first.begin(), a->first.end());
+        name.resize((name.size() + 4) & ~3, '\0');
+        writeWord(f, a->second.components, ok);
+        writeWord(f, name.size(), ok);
+        writeBytes(f, &name[0], name.size(), ok);
+        writeBytes(f, &a->second.values[0], a->second.values.size() * sizeof(Real), ok);
+    }
+
+    long treeStart = ftell(f);
+    const_cast<Effect::FrameInfo::IndexTree&>(frame.tree).saveIndex(f);
+    long end = ftell(f);
+    uint32_t treeBytes = end - treeStart;
+    ok = ok && treeStart > 0 && end >= treeStart && fseek(f, treeSizeOffset, SEEK_SET) == 0;
+    writeWord(f, treeBytes, ok);
+
+    // Hash the payload as it landed in the file
+    ok = ok && fflush(f) == 0;
+    uint64_t payloadBytes = end - HEADER_BYTES;
+    uint64_t payloadHash = 0;
+    if (ok) {
+        void *mapping = mmap(0, end, PROT_READ, MAP_SHARED, fileno(f), 0);
+        ok = mapping != MAP_FAILED;
+        if (ok) {
+            payloadHash = hash((const uint8_t*) mapping + HEADER_BYTES, payloadBytes, key);
+            munmap(mapping, end);
+        }
+    }
+
+    uint32_t version = VERSION;
+    memcpy(header, "FCC1", 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &key, 8);
+    memcpy(header + 16, &payloadHash, 8);
+    memcpy(header + 24, &payloadBytes, 8);
+    ok = ok && fseek(f, 0, SEEK_SET) == 0;
+    writeBytes(f, header, sizeof header, ok);
+
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(temporary.c_str(), filename.c_str()) == 0;
+    if (!ok) {
+        fprintf(stderr, "Can't write layout cache %s\n", filename.c_str());
+        unlink(temporary.c_str());
+    }
+    return ok;
+}
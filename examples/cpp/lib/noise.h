@@ -424,3 +424,317 @@ static inline float
 fbm_noise4(Vec4 v, int octaves, float persistence = 0.5, float lacunarity = 2.0) {
   return fbm_noise4(v[0], v[1], v[2], v[3], octaves, persistence, lacunarity);
 }
+
+
+/*
+ * Batch versions of noise2(), noise3() and their fbm variants, for many points
+ * at once. Coordinates come in separate arrays, one per axis. With SSE2 or NEON,
+ * four points are calculated side by side; only the permutation table lookups
+ * are done one lane at a time. Results match the scalar functions to within
+ * float rounding.
+ */
+
+static inline void noise2_batch(const float *x, const float *y, float *out, unsigned count);
+static inline void noise3_batch(const float *x, const float *y, const float *z, float *out, unsigned count);
+
+static inline void fbm_noise2_batch(const float *x, const float *y, float *out, unsigned count,
+    int octaves, float persistence = 0.5, float lacunarity = 2.0);
+static inline void fbm_noise3_batch(const float *x, const float *y, const float *z, float *out, unsigned count,
+    int octaves, float persistence = 0.5, float lacunarity = 2.0);
+
+
+#if defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define NOISE_SIMD 1
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef __m128 noise_vf;
+typedef __m128 noise_mask;
+
+static inline noise_vf noise_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void noise_store(float *p, noise_vf a) { _mm_storeu_ps(p, a); }
+static inline noise_vf noise_set1(float a) { return _mm_set1_ps(a); }
+static inline noise_vf noise_add(noise_vf a, noise_vf b) { return _mm_add_ps(a, b); }
+static inline noise_vf noise_sub(noise_vf a, noise_vf b) { return _mm_sub_ps(a, b); }
+static inline noise_vf noise_mul(noise_vf a, noise_vf b) { return _mm_mul_ps(a, b); }
+static inline noise_vf noise_max(noise_vf a, noise_vf b) { return _mm_max_ps(a, b); }
+static inline noise_mask noise_gt(noise_vf a, noise_vf b) { return _mm_cmpgt_ps(a, b); }
+static inline noise_mask noise_ge(noise_vf a, noise_vf b) { return _mm_cmpge_ps(a, b); }
+static inline noise_mask noise_and(noise_mask a, noise_mask b) { return _mm_and_ps(a, b); }
+static inline noise_mask noise_or(noise_mask a, noise_mask b) { return _mm_or_ps(a, b); }
+static inline noise_mask noise_not(noise_mask a) { return _mm_xor_ps(a, _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+static inline noise_vf noise_ones(noise_mask m) { return _mm_and_ps(m, _mm_set1_ps(1.0f)); }
+static inline void noise_store_int(int *p, noise_vf a) { _mm_storeu_si128((__m128i*) p, _mm_cvttps_epi32(a)); }
+
+static inline noise_vf noise_floor(noise_vf a)
+{
+    // Truncate, then step down where that rounded up
+    noise_vf t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+}
+
+#else
+#include <arm_neon.h>
+
+typedef float32x4_t noise_vf;
+typedef uint32x4_t noise_mask;
+
+static inline noise_vf noise_load(const float *p) { return vld1q_f32(p); }
+static inline void noise_store(float *p, noise_vf a) { vst1q_f32(p, a); }
+static inline noise_vf noise_set1(float a) { return vdupq_n_f32(a); }
+static inline noise_vf noise_add(noise_vf a, noise_vf b) { return vaddq_f32(a, b); }
+static inline noise_vf noise_sub(noise_vf a, noise_vf b) { return vsubq_f32(a, b); }
+static inline noise_vf noise_mul(noise_vf a, noise_vf b) { return vmulq_f32(a, b); }
+static inline noise_vf noise_max(noise_vf a, noise_vf b) { return vmaxq_f32(a, b); }
+static inline noise_mask noise_gt(noise_vf a, noise_vf b) { return vcgtq_f32(a, b); }
+static inline noise_mask noise_ge(noise_vf a, noise_vf b) { return vcgeq_f32(a, b); }
+static inline noise_mask noise_and(noise_mask a, noise_mask b) { return vandq_u32(a, b); }
+static inline noise_mask noise_or(noise_mask a, noise_mask b) { return vorrq_u32(a, b); }
+static inline noise_mask noise_not(noise_mask a) { return vmvnq_u32(a); }
+static inline void noise_store_int(int *p, noise_vf a) { vst1q_s32(p, vcvtq_s32_f32(a)); }
+
+static inline noise_vf noise_ones(noise_mask m)
+{
+    return vreinterpretq_f32_u32(vandq_u32(m, vreinterpretq_u32_f32(vdupq_n_f32(1.0f))));
+}
+
+static inline noise_vf noise_floor(noise_vf a)
+{
+    // Truncate, then step down where that rounded up
+    noise_vf t = vcvtq_f32_s32(vcvtq_s32_f32(a));
+    return vsubq_f32(t, noise_ones(vcgtq_f32(t, a)));
+}
+
+#endif
+
+// One simplex corner's contribution, given its offset and gradient
+static inline noise_vf
+noise_corner2(noise_vf r2, noise_vf xx, noise_vf yy, const float *gx, const float *gy)
+{
+  noise_vf f = noise_max(noise_sub(r2, noise_add(noise_mul(xx, xx), noise_mul(yy, yy))), noise_set1(0.0f));
+  f = noise_mul(f, f);
+  return noise_mul(noise_mul(f, f), noise_add(noise_mul(noise_load(gx), xx), noise_mul(noise_load(gy), yy)));
+}
+
+static inline noise_vf
+noise_corner3(noise_vf xx, noise_vf yy, noise_vf zz, const float *gx, const float *gy, const float *gz)
+{
+  noise_vf f = noise_max(noise_sub(noise_set1(0.6f),
+      noise_add(noise_add(noise_mul(xx, xx), noise_mul(yy, yy)), noise_mul(zz, zz))), noise_set1(0.0f));
+  f = noise_mul(f, f);
+  return noise_mul(noise_mul(f, f), noise_add(noise_add(
+      noise_mul(noise_load(gx), xx), noise_mul(noise_load(gy), yy)), noise_mul(noise_load(gz), zz)));
+}
+
+// Four points of noise2()
+static inline noise_vf
+noise2_v4(noise_vf x, noise_vf y)
+{
+  noise_vf s = noise_mul(noise_add(x, y), noise_set1(F2));
+  noise_vf i = noise_floor(noise_add(x, s));
+  noise_vf j = noise_floor(noise_add(y, s));
+  noise_vf t = noise_mul(noise_add(i, j), noise_set1(G2));
+
+  noise_vf x0 = noise_sub(x, noise_sub(i, t));
+  noise_vf y0 = noise_sub(y, noise_sub(j, t));
+
+  noise_mask m = noise_gt(x0, y0);
+  noise_vf i1 = noise_ones(m);
+  noise_vf j1 = noise_ones(noise_not(m));
+
+  noise_vf x1 = noise_add(noise_sub(x0, i1), noise_set1(G2));
+  noise_vf y1 = noise_add(noise_sub(y0, j1), noise_set1(G2));
+  noise_vf x2 = noise_add(x0, noise_set1(G2 * 2.0f - 1.0f));
+  noise_vf y2 = noise_add(y0, noise_set1(G2 * 2.0f - 1.0f));
+
+  // Gradient lookups, one lane at a time
+  int I[4], J[4];
+  float o[4], g[3][2][4];
+  noise_store_int(I, i);
+  noise_store_int(J, j);
+  noise_store(o, i1);
+
+  for (int c = 0; c < 4; c++) {
+    int a = I[c] & 255, b = J[c] & 255, di = o[c] != 0.0f;
+    int g0 = PERM[a + PERM[b]] % 12;
+    int g1 = PERM[a + di + PERM[b + !di]] % 12;
+    int g2 = PERM[a + 1 + PERM[b + 1]] % 12;
+    g[0][0][c] = GRAD3[g0][0]; g[0][1][c] = GRAD3[g0][1];
+    g[1][0][c] = GRAD3[g1][0]; g[1][1][c] = GRAD3[g1][1];
+    g[2][0][c] = GRAD3[g2][0]; g[2][1][c] = GRAD3[g2][1];
+  }
+
+  noise_vf r2 = noise_set1(0.5f);
+  noise_vf n = noise_add(noise_add(
+      noise_corner2(r2, x0, y0, g[0][0], g[0][1]),
+      noise_corner2(r2, x1, y1, g[1][0], g[1][1])),
+      noise_corner2(r2, x2, y2, g[2][0], g[2][1]));
+  return noise_mul(n, noise_set1(70.0f));
+}
+
+// Four points of noise3()
+static inline noise_vf
+noise3_v4(noise_vf x, noise_vf y, noise_vf z)
+{
+  noise_vf s = noise_mul(noise_add(noise_add(x, y), z), noise_set1(F3));
+  noise_vf i = noise_floor(noise_add(x, s));
+  noise_vf j = noise_floor(noise_add(y, s));
+  noise_vf k = noise_floor(noise_add(z, s));
+  noise_vf t = noise_mul(noise_add(noise_add(i, j), k), noise_set1(G3));
+
+  noise_vf x0 = noise_sub(x, noise_sub(i, t));
+  noise_vf y0 = noise_sub(y, noise_sub(j, t));
+  noise_vf z0 = noise_sub(z, noise_sub(k, t));
+
+  // Same simplex as the branches in noise3(), written as masks
+  noise_mask a = noise_ge(x0, y0);
+  noise_mask b = noise_ge(y0, z0);
+  noise_mask c = noise_ge(x0, z0);
+  noise_mask na = noise_not(a), nb = noise_not(b), nc = noise_not(c);
+
+  noise_vf o1x = noise_ones(noise_and(a, noise_or(b, c)));
+  noise_vf o1y = noise_ones(noise_and(na, b));
+  noise_vf o1z = noise_ones(noise_and(nb, noise_or(na, nc)));
+  noise_vf o2x = noise_ones(noise_or(a, noise_and(b, c)));
+  noise_vf o2y = noise_ones(noise_or(na, b));
+  noise_vf o2z = noise_ones(noise_or(noise_and(a, nb), noise_and(na, noise_not(noise_and(b, c)))));
+
+  noise_vf x1 = noise_add(noise_sub(x0, o1x), noise_set1(G3));
+  noise_vf y1 = noise_add(noise_sub(y0, o1y), noise_set1(G3));
+  noise_vf z1 = noise_add(noise_sub(z0, o1z), noise_set1(G3));
+  noise_vf x2 = noise_add(noise_sub(x0, o2x), noise_set1(2.0f * G3));
+  noise_vf y2 = noise_add(noise_sub(y0, o2y), noise_set1(2.0f * G3));
+  noise_vf z2 = noise_add(noise_sub(z0, o2z), noise_set1(2.0f * G3));
+  noise_vf x3 = noise_add(x0, noise_set1(3.0f * G3 - 1.0f));
+  noise_vf y3 = noise_add(y0, noise_set1(3.0f * G3 - 1.0f));
+  noise_vf z3 = noise_add(z0, noise_set1(3.0f * G3 - 1.0f));
+
+  // Gradient lookups, one lane at a time
+  int I[4], J[4], K[4];
+  float o[6][4], g[4][3][4];
+  noise_store_int(I, i);
+  noise_store_int(J, j);
+  noise_store_int(K, k);
+  noise_store(o[0], o1x); noise_store(o[1], o1y); noise_store(o[2], o1z);
+  noise_store(o[3], o2x); noise_store(o[4], o2y); noise_store(o[5], o2z);
+
+  for (int l = 0; l < 4; l++) {
+    int ii = I[l] & 255, jj = J[l] & 255, kk = K[l] & 255;
+    int a1 = o[0][l] != 0.0f, b1 = o[1][l] != 0.0f, c1 = o[2][l] != 0.0f;
+    int a2 = o[3][l] != 0.0f, b2 = o[4][l] != 0.0f, c2 = o[5][l] != 0.0f;
+    int gi[4];
+    gi[0] = PERM[ii + PERM[jj + PERM[kk]]] % 12;
+    gi[1] = PERM[ii + a1 + PERM[jj + b1 + PERM[c1 + kk]]] % 12;
+    gi[2] = PERM[ii + a2 + PERM[jj + b2 + PERM[c2 + kk]]] % 12;
+    gi[3] = PERM[ii + 1 + PERM[jj + 1 + PERM[kk + 1]]] % 12;
+    for (int n = 0; n < 4; n++) {
+      g[n][0][l] = GRAD3[gi[n]][0];
+      g[n][1][l] = GRAD3[gi[n]][1];
+      g[n][2][l] = GRAD3[gi[n]][2];
+    }
+  }
+
+  noise_vf n = noise_add(noise_add(
+      noise_corner3(x0, y0, z0, g[0][0], g[0][1], g[0][2]),
+      noise_corner3(x1, y1, z1, g[1][0], g[1][1], g[1][2])), noise_add(
+      noise_corner3(x2, y2, z2, g[2][0], g[2][1], g[2][2]),
+      noise_corner3(x3, y3, z3, g[3][0], g[3][1], g[3][2])));
+  return noise_mul(n, noise_set1(32.0f));
+}
+
+static inline noise_vf
+fbm_noise2_v4(noise_vf x, noise_vf y, int octaves, float persistence, float lacunarity)
+{
+  float freq = 1.0f, amp = 1.0f, max = 1.0f;
+  noise_vf total = noise2_v4(x, y);
+
+  for (int i = 1; i < octaves; ++i) {
+    freq *= lacunarity;
+    amp *= persistence;
+    max += amp;
+    noise_vf f = noise_set1(freq);
+    total = noise_add(total, noise_mul(noise2_v4(noise_mul(x, f), noise_mul(y, f)), noise_set1(amp)));
+  }
+  return noise_mul(total, noise_set1(1.0f / max));
+}
+
+static inline noise_vf
+fbm_noise3_v4(noise_vf x, noise_vf y, noise_vf z, int octaves, float persistence, float lacunarity)
+{
+  float freq = 1.0f, amp = 1.0f, max = 1.0f;
+  noise_vf total = noise3_v4(x, y, z);
+
+  for (int i = 1; i < octaves; ++i) {
+    freq *= lacunarity;
+    amp *= persistence;
+    max += amp;
+    noise_vf f = noise_set1(freq);
+    total = noise_add(total, noise_mul(noise3_v4(noise_mul(x, f), noise_mul(y, f), noise_mul(z, f)), noise_set1(amp)));
+  }
+  return noise_mul(total, noise_set1(1.0f / max));
+}
+
+// Runs 'body' over groups of four points, padding the last group with zeroes
+#define NOISE_BATCH_LOOP(count, body) \
+  for (unsigned b = 0; b < (count); b += 4) { \
+    unsigned n = (count) - b < 4 ? (count) - b : 4; \
+    float px[4] = {0}, py[4] = {0}, pz[4] = {0}, r[4]; \
+    for (unsigned c = 0; c < n; c++) { \
+      px[c] = x[b + c]; py[c] = y[b + c]; if (z) pz[c] = z[b + c]; \
+    } \
+    noise_vf vx = noise_load(px), vy = noise_load(py), vz = noise_load(pz); \
+    (void) vz; \
+    noise_store(r, body); \
+    for (unsigned c = 0; c < n; c++) out[b + c] = r[c]; \
+  }
+
+#endif  // NOISE_SIMD
+
+static inline void
+noise2_batch(const float *x, const float *y, float *out, unsigned count)
+{
+#ifdef NOISE_SIMD
+  const float *z = 0;
+  NOISE_BATCH_LOOP(count, noise2_v4(vx, vy));
+#else
+  for (unsigned i = 0; i < count; i++)
+    out[i] = noise2(x[i], y[i]);
+#endif
+}
+
+static inline void
+noise3_batch(const float *x, const float *y, const float *z, float *out, unsigned count)
+{
+#ifdef NOISE_SIMD
+  NOISE_BATCH_LOOP(count, noise3_v4(vx, vy, vz));
+#else
+  for (unsigned i = 0; i < count; i++)
+    out[i] = noise3(x[i], y[i], z[i]);
+#endif
+}
+
+static inline void
+fbm_noise2_batch(const float *x, const float *y, float *out, unsigned count,
+    int octaves, float persistence, float lacunarity)
+{
+#ifdef NOISE_SIMD
+  const float *z = 0;
+  NOISE_BATCH_LOOP(count, fbm_noise2_v4(vx, vy, octaves, persistence, lacunarity));
+#else
+  for (unsigned i = 0; i < count; i++)
+    out[i] = fbm_noise2(x[i], y[i], octaves, persistence, lacunarity);
+#endif
+}
+
+static inline void
+fbm_noise3_batch(const float *x, const float *y, const float *z, float *out, unsigned count,
+    int octaves, float persistence, float lacunarity)
+{
+#ifdef NOISE_SIMD
+  NOISE_BATCH_LOOP(count, fbm_noise3_v4(vx, vy, vz, octaves, persistence, lacunarity));
+#else
+  for (unsigned i = 0; i < count; i++)
+    out[i] = fbm_noise3(x[i], y[i], z[i], octaves, persistence, lacunarity);
+#endif
+}
@@ -29,15 +29,30 @@
 
 #include <vector>
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <signal.h>
+#include <string>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "tinythread.h"
 
 
 class OPCClient {
@@ -45,13 +60,35 @@ public:
     OPCClient();
     ~OPCClient();
 
+    // Use "[udp://]host[:port]". With the udp:// prefix, each OPC message in a
+    // write() is sent as its own datagram, followed by a sequence number.
+    // "unix://path" connects to a Unix domain socket, as from fcserver's "opcListen".
+    // "shm://name" writes into the shared memory ring that an fcserver on this
+    // computer opened with its "shmListen" option, on Linux only.
     bool resolve(const char *hostport, int defaultPort = 7890);
     bool write(const uint8_t *data, ssize_t length);
     bool write(const std::vector<uint8_t> &data);
 
+    /*
+     * Send one frame made of several OPC messages, each from its own memory, with a
+     * single writev(). With 'commit', a Fadecandy "Commit Frame" SysEx goes at the end,
+     * so an fcserver with "frameBarrier" shows every channel in the batch together.
+     * Async, UDP and shared memory clients gather the parts into one buffer for write().
+     */
+    bool writeBatch(const struct iovec *parts, unsigned count, bool commit = false);
+
     bool tryConnect();
     bool isConnected();
 
+    /*
+     * In async mode, write() copies the frame and returns right away. A background
+     * thread connects and sends. If frames arrive faster than the socket takes them,
+     * only the newest one waiting is sent, and older ones are dropped. tryConnect()
+     * never blocks; it asks the background thread to connect, and reports whether
+     * we're connected already.
+     */
+    void setAsync(bool enable = true);
+
     struct Header {
         uint8_t channel;
         uint8_t command;
@@ -85,9 +122,68 @@ public:
 
 private:
     int fd;
+    bool connected;         // Written by whichever thread owns 'fd', read from any
+    bool udp;
+    bool shm;
+    bool local;
     struct sockaddr_in address;
+    struct sockaddr_un localAddress;
+    std::string shmName;
     bool connectSocket();
     void closeSocket();
+    bool sendFrame(const uint8_t *data, ssize_t length);
+    bool sendAll(const uint8_t *data, ssize_t length);
+    bool sendDatagrams(const uint8_t *data, ssize_t length);
+    bool sendParts(struct iovec *parts, unsigned count);
+
+    // Scratch space for writeBatch()
+    std::vector<struct iovec> batchParts;
+    std::vector<uint8_t> batchBuffer;
+
+    // Last UDP sequence number sent on each OPC channel
+    uint32_t sequence[256];
+
+    // Largest UDP payload over IPv4
+    static const unsigned MAX_DATAGRAM = 65507;
+
+    /*
+     * Shared memory ring, laid out as in fcserver's shmnetserver.h. While it's mapped,
+     * 'fd' is the shared memory object. Each write() is one record: its length, then
+     * the OPC messages, padded to a multiple of 4. If the ring is too full, because
+     * fcserver fell behind or stopped, the frame is dropped and the ring is reopened
+     * on the next write().
+     */
+    struct RingHeader {
+        char magic[4];
+        uint32_t size;
+        uint32_t head;
+        uint32_t tail;
+        uint32_t waiting;
+        uint32_t writer;
+        uint32_t reserved[10];
+    };
+    static const uint32_t WRAP_RECORD = 0xFFFFFFFF;
+    RingHeader *ring;
+    size_t ringMapSize;
+    bool connectRing();
+    void closeRing();
+    bool sendRecord(const uint8_t *data, ssize_t length);
+
+    // Async mode. The send thread owns 'fd' and 'sendingFrame'; the rest is under 'sendLock'.
+    tthread::thread *sendThread;
+    tthread::mutex sendLock;
+    tthread::condition_variable sendCond;
+    std::vector<uint8_t> pendingFrame;
+    std::vector<uint8_t> sendingFrame;
+    bool framePending;
+    bool connectPending;
+    bool stopping;
+
+    // Wait this long between attempts to connect in the background
+    static const unsigned RECONNECT_MILLISECONDS = 100;
+
+    static void sendThreadFunc(void *arg);
+    void sendLoop();
 };
 
 
@@ -97,27 +193,140 @@ private:
 
 
 inline OPCClient::OPCClient()
+    : fd(-1),
+      connected(false),
+      udp(false),
+      shm(false),
+      local(false),
+      ring(0),
+      ringMapSize(0),
+      sendThread(0),
+      framePending(false),
+      connectPending(false),
+      stopping(false)
 {
-    fd = -1;
     memset(&address, 0, sizeof address);
+    memset(&localAddress, 0, sizeof localAddress);
+    memset(sequence, 0, sizeof sequence);
 }
 
 inline OPCClient::~OPCClient()
 {
+    setAsync(false);
     closeSocket();
 }
 
 inline void OPCClient::closeSocket()
 {
-    if (isConnected()) {
+    closeRing();
+    if (fd > 0) {
         close(fd);
-        fd = -1;
     }
+    fd = -1;
+    __atomic_store_n(&connected, false, __ATOMIC_RELEASE);
+}
+
+inline void OPCClient::setAsync(bool enable)
+{
+    if (enable == (sendThread != 0)) {
+        return;
+    }
+
+    if (enable) {
+        stopping = false;
+        sendThread = new tthread::thread(sendThreadFunc, this);
+    } else {
+        sendLock.lock();
+        stopping = true;
+        sendCond.notify_all();
+        sendLock.unlock();
+
+        sendThread->join();
+        delete sendThread;
+        sendThread = 0;
+        framePending = false;
+        connectPending = false;
+    }
+}
+
+inline void OPCClient::sendThreadFunc(void *arg)
+{
+    ((OPCClient*) arg)->sendLoop();
+}
+
+inline void OPCClient::sendLoop()
+{
+    sendLock.lock();
+
+    while (!stopping) {
+        if (!framePending && !connectPending) {
+            sendCond.wait(sendLock);
+            continue;
+        }
+
+        // Take the newest frame. Anything written while we send it replaces the next one.
+        bool haveFrame = framePending;
+        if (haveFrame) {
+            sendingFrame.swap(pendingFrame);
+            framePending = false;
+        }
+        connectPending = false;
+        sendLock.unlock();
+
+        bool ok = (fd > 0) || connectSocket();
+        if (ok && haveFrame && !sendFrame(&sendingFrame[0], sendingFrame.size())) {
+            closeSocket();
+        }
+        if (!ok) {
+            // Server isn't there. Don't spin on it; the next tryConnect() will ask again.
+            tthread::this_thread::sleep_for(tthread::chrono::milliseconds(RECONNECT_MILLISECONDS));
+        }
+
+        sendLock.lock();
+    }
+
+    sendLock.unlock();
 }
 
 inline bool OPCClient::resolve(const char *hostport, int defaultPort)
 {
-    fd = -1;
+    // The send thread can't be using the socket while we replace it
+    bool async = sendThread != 0;
+    setAsync(false);
+    closeSocket();
+
+    shm = !strncmp(hostport, "shm://", 6);
+    local = !strncmp(hostport, "unix://", 7);
+    udp = false;
+    if (local) {
+        hostport += 7;
+        localAddress.sun_family = AF_UNIX;
+        bool fits = *hostport && strlen(hostport) < sizeof localAddress.sun_path;
+        if (fits) {
+            strcpy(localAddress.sun_path, hostport);
+        }
+        setAsync(async);
+        return fits;
+    }
+
+    if (shm) {
+        // Named like fcserver's "shmListen", with or without the leading slash
+        hostport += 6;
+        shmName = *hostport == '/' ? hostport : std::string("/") + hostport;
+        setAsync(async);
+        #ifdef __linux__
+            return shmName.size() > 1;
+        #else
+            return false;
+        #endif
+    }
+
+    udp = !strncmp(hostport, "udp://", 6);
+    if (udp) {
+        hostport += 6;
+    } else if (!strncmp(hostport, "tcp://", 6)) {
+        hostport += 6;
+    }
 
     char *host = strdup(hostport);
     char *colon = strchr(host, ':');
@@ -130,8 +339,10 @@ inline bool OPCClient::resolve(const char *hostport, int defaultPort)
     }
 
     if (port) {
-        struct addrinfo *addr;
-        getaddrinfo(*host ? host : "localhost", 0, 0, &addr);
+        struct addrinfo *addr = 0;
+        if (getaddrinfo(*host ? host : "localhost", 0, 0, &addr)) {
+            addr = 0;
+        }
 
         for (struct addrinfo *i = addr; i; i = i->ai_next) {
             if (i->ai_family == PF_INET) {
@@ -141,33 +352,111 @@ inline bool OPCClient::resolve(const char *hostport, int defaultPort)
                 break;
             }
         }
-        freeaddrinfo(addr);
+        if (addr) {
+            freeaddrinfo(addr);
+        }
     }
 
     free(host);
+    setAsync(async);
     return success;
 }
 
 inline bool OPCClient::isConnected()
 {
-    return fd > 0;
+    return __atomic_load_n(&connected, __ATOMIC_ACQUIRE);
 }
 
 inline bool OPCClient::tryConnect()
 {
-    return isConnected() || connectSocket();
+    if (isConnected()) {
+        return true;
+    }
+
+    if (sendThread) {
+        sendLock.lock();
+        connectPending = true;
+        sendCond.notify_all();
+        sendLock.unlock();
+        return false;
+    }
+
+    return connectSocket();
 }
 
 inline bool OPCClient::write(const uint8_t *data, ssize_t length)
 {
+    if (sendThread) {
+        sendLock.lock();
+        pendingFrame.assign(data, data + length);
+        framePending = true;
+        sendCond.notify_all();
+        sendLock.unlock();
+        return isConnected();
+    }
+
     if (!tryConnect()) {
         return false;
     }
 
+    if (!sendFrame(data, length)) {
+        closeSocket();
+        return false;
+    }
+
+    return true;
+}
+
+inline bool OPCClient::sendFrame(const uint8_t *data, ssize_t length)
+{
+    if (shm) {
+        return sendRecord(data, length);
+    }
+    return udp ? sendDatagrams(data, length) : sendAll(data, length);
+}
+
+inline bool OPCClient::sendDatagrams(const uint8_t *data, ssize_t length)
+{
+    // Split into OPC messages. Each one gets a datagram, with a big-endian sequence number
+    // for its channel on the end, so the server can drop datagrams that arrive out of order.
+
+    while (length > 0) {
+        if (length < (ssize_t) sizeof(Header)) {
+            return false;
+        }
+
+        const Header &header = *(const Header*) data;
+        ssize_t messageLength = sizeof(Header) + ((header.length[0] << 8) | header.length[1]);
+        if (messageLength > length || messageLength + 4 > MAX_DATAGRAM) {
+            return false;
+        }
+
+        uint32_t seq = ++sequence[header.channel];
+        uint8_t seqBytes[4] = { uint8_t(seq >> 24), uint8_t(seq >> 16), uint8_t(seq >> 8), uint8_t(seq) };
+
+        struct iovec iov[2];
+        iov[0].iov_base = (void*) data;
+        iov[0].iov_len = messageLength;
+        iov[1].iov_base = seqBytes;
+        iov[1].iov_len = sizeof seqBytes;
+
+        if (writev(fd, iov, 2) != messageLength + (ssize_t) sizeof seqBytes) {
+            return false;
+        }
+
+        data += messageLength;
+        length -= messageLength;
+    }
+
+    return true;
+}
+
+inline bool OPCClient::sendAll(const uint8_t *data, ssize_t length)
+{
+    // Keep going after partial writes, until everything is sent or the socket fails
     while (length > 0) {
-        int result = send(fd, data, length, 0);
+        ssize_t result = send(fd, data, length, 0);
         if (result <= 0) {
-            closeSocket();
             return false;
         }
         length -= result;
@@ -182,17 +471,92 @@ inline bool OPCClient::write(const std::vector<uint8_t> &data)
     return write(&data[0], data.size());
 }
 
-inline bool OPCClient::connectSocket()
+inline bool OPCClient::writeBatch(const struct iovec *parts, unsigned count, bool commit)
 {
-    fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    // SysEx to system 0x0001 (Fadecandy), command 0x0003
+    static const uint8_t COMMIT_FRAME[8] = { 0, 0xFF, 0, 4, 0x00, 0x01, 0x00, 0x03 };
+
+    if (sendThread || udp || shm) {
+        batchBuffer.clear();
+        for (unsigned i = 0; i < count; i++) {
+            const uint8_t *data = (const uint8_t*) parts[i].iov_base;
+            batchBuffer.insert(batchBuffer.end(), data, data + parts[i].iov_len);
+        }
+        if (commit) {
+            batchBuffer.insert(batchBuffer.end(), COMMIT_FRAME, COMMIT_FRAME + sizeof COMMIT_FRAME);
+        }
+        return !batchBuffer.empty() && write(batchBuffer);
+    }
+
+    batchParts.assign(parts, parts + count);
+    if (commit) {
+        struct iovec iov = { (void*) COMMIT_FRAME, sizeof COMMIT_FRAME };
+        batchParts.push_back(iov);
+    }
+    if (batchParts.empty()) {
+        return false;
+    }
+
+    if (!tryConnect()) {
+        return false;
+    }
 
-    if (connect(fd, (struct sockaddr*) &address, sizeof address) < 0) {
+    if (!sendParts(&batchParts[0], batchParts.size())) {
         closeSocket();
         return false;
     }
 
+    return true;
+}
+
+inline bool OPCClient::sendParts(struct iovec *parts, unsigned count)
+{
+    // Like sendAll(), but a partial writev() can end partway through any part
+    while (count > 0) {
+        ssize_t result = writev(fd, parts, count < IOV_MAX ? count : IOV_MAX);
+        if (result <= 0) {
+            return false;
+        }
+        while (count > 0 && (size_t) result >= parts->iov_len) {
+            result -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0) {
+            parts->iov_base = (uint8_t*) parts->iov_base + result;
+            parts->iov_len -= result;
+        }
+    }
+
+    return true;
+}
+
+inline bool OPCClient::connectSocket()
+{
+    if (shm) {
+        return connectRing();
+    }
+
+    if (local) {
+        fd = socket(PF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*) &localAddress, sizeof localAddress) < 0) {
+            closeSocket();
+            return false;
+        }
+    } else {
+        fd = udp ? socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP) : socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        // For UDP, this only picks the destination for our datagrams
+        if (connect(fd, (struct sockaddr*) &address, sizeof address) < 0) {
+            closeSocket();
+            return false;
+        }
+    }
+
     int flag = 1;
-    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*) &flag, sizeof flag);
+    if (!udp && !local) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*) &flag, sizeof flag);
+    }
 
     #ifdef SO_NOSIGPIPE
         flag = 1;
@@ -201,5 +565,108 @@ inline bool OPCClient::connectSocket()
         signal(SIGPIPE, SIG_IGN);
     #endif
 
+    __atomic_store_n(&connected, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+#ifdef __linux__
+
+inline bool OPCClient::connectRing()
+{
+    fd = shm_open(shmName.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t) sizeof(RingHeader)) {
+        mapping = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        closeSocket();
+        return false;
+    }
+
+    // Is fcserver done setting it up, and does the size make sense?
+    RingHeader *r = (RingHeader*) mapping;
+    uint32_t magic;
+    memcpy(&magic, "FCR1", sizeof magic);
+    uint32_t size = r->size;
+    bool valid = __atomic_load_n((uint32_t*) r->magic, __ATOMIC_ACQUIRE) == magic
+        && size >= 4096 && !(size & (size - 1)) && sizeof(RingHeader) + size <= (size_t) st.st_size;
+
+    // Claim it. A writer that exited without letting go can be replaced.
+    uint32_t pid = getpid();
+    uint32_t owner = 0;
+    bool claimed = valid && (
+        __atomic_compare_exchange_n(&r->writer, &owner, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+        (kill(owner, 0) < 0 && errno == ESRCH &&
+        __atomic_compare_exchange_n(&r->writer, &owner, pid, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)));
+
+    if (!claimed) {
+        munmap(mapping, st.st_size);
+        closeSocket();
+        return false;
+    }
+
+    ring = r;
+    ringMapSize = st.st_size;
+    __atomic_store_n(&connected, true, __ATOMIC_RELEASE);
     return true;
 }
+
+inline void OPCClient::closeRing()
+{
+    if (ring) {
+        uint32_t pid = getpid();
+        __atomic_compare_exchange_n(&ring->writer, &pid, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        munmap(ring, ringMapSize);
+        ring = 0;
+        ringMapSize = 0;
+    }
+}
+
+inline bool OPCClient::sendRecord(const uint8_t *data, ssize_t length)
+{
+    uint32_t size = ring->size;
+    uint32_t recordLength = 4 + ((length + 3) & ~3);
+    if (length <= 0 || recordLength > size / 2) {
+        return false;
+    }
+
+    // We're the only writer, so 'head' is ours. Records can't wrap around the end.
+    uint8_t *records = (uint8_t*) &ring[1];
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t position = head & (size - 1);
+    uint32_t space = size - position;
+    uint32_t skip = space < recordLength ? space : 0;
+
+    if (head - tail + skip + recordLength > size) {
+        return false;
+    }
+
+    if (skip) {
+        *(uint32_t*) (records + position) = WRAP_RECORD;
+        position = 0;
+    }
+    *(uint32_t*) (records + position) = length;
+    memcpy(records + position + 4, data, length);
+
+    // Publish, then wake fcserver if it might be asleep. This pairs with its check of
+    // 'head' after setting 'waiting', so one side always sees the other.
+    __atomic_store_n(&ring->head, head + skip + recordLength, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return true;
+}
+
+#else
+
+inline bool OPCClient::connectRing() { return false; }
+inline void OPCClient::closeRing() {}
+inline bool OPCClient::sendRecord(const uint8_t *data, ssize_t length) { return false; }
+
+#endif
@@ -28,6 +28,7 @@
 #pragma once
 
 #include "effect.h"
+#include "effect_thread_pool.h"
 #include "nanoflann.h"  // Tiny KD-tree library
 
 
@@ -48,11 +49,15 @@ public:
 
     virtual void beginFrame(const FrameInfo& f);
     virtual void shader(Vec3& rgb, const PixelInfo& p) const;
+    virtual void shadeBatch(const PixelBatch& batch, Vec3* out) const;
     virtual void debug(const DebugInfo& d);
 
     // Sample the particle space in various ways
     Vec3 sampleColor(Vec3 location) const;
     float sampleIntensity(Vec3 location) const;
+
+    // Exact gradient of sampleIntensity(). It used to be a finite difference over
+    // 'epsilon', which is still accepted but no longer used.
     Vec3 sampleIntensityGradient(Vec3 location, float epsilon = 1e-3) const;
 
 protected:
@@ -67,6 +72,51 @@ protected:
 
     void buildIndex();
 
+    // Particle systems this big measure their bounds on the shared thread pool
+    static const unsigned PARALLEL_INDEX_PARTICLES = 16384;
+
+    /*
+     * The KD-tree is only rebuilt once some particle has moved farther than this,
+     * as a fraction of radiusMax, since the last build. Until then, searches look
+     * that much farther to make up for it. Zero rebuilds every frame. Subclasses
+     * may change this.
+     */
+    float indexRebuildThreshold;
+
+    /*
+     * Which spatial index to use. A uniform grid with cells as big as the largest
+     * particle is cheaper to build and search, as long as particles are about the
+     * same size. INDEX_AUTO picks the grid when there are enough particles and
+     * radiusMax isn't far beyond the average radius.
+     */
+    enum IndexType { INDEX_AUTO, INDEX_KDTREE, INDEX_GRID };
+    IndexType indexType;
+
+    static const unsigned GRID_MIN_PARTICLES = 256;
+    static constexpr float GRID_MAX_RADIUS_RATIO = 2.0f;
+
+    /*
+     * How shader() finds each pixel's color. RENDER_GATHER searches the particle
+     * index once per pixel. RENDER_SPLAT turns that around: beginFrame() searches
+     * the layout's KD-tree once per particle, adding each one into a color buffer
+     * that shader() just reads back. Splatting does one search per particle
+     * instead of one per pixel, and each search only covers that particle's own
+     * radius rather than radiusMax. RENDER_AUTO splats when there are at least
+     * SPLAT_MIN_PIXEL_RATIO pixels per particle.
+     *
+     * Subclasses that replace shader() with their own sampling should choose
+     * RENDER_GATHER, so the splat buffer isn't computed for nothing.
+     */
+    enum RenderMode { RENDER_AUTO, RENDER_GATHER, RENDER_SPLAT };
+    RenderMode renderMode;
+
+    static const unsigned SPLAT_MIN_PIXEL_RATIO = 1;
+
+    // Splatting this many particles or more happens on the shared thread pool
+    static const unsigned PARALLEL_SPLAT_PARTICLES = 128;
+
+    void renderSplats(const FrameInfo& f);
+
     // Low-level sampling utilities, for use on an index search result set
     Vec3 sampleColor(ResultSet_t &hits) const;
     float sampleIntensity(ResultSet_t &hits) const;
@@ -74,9 +124,15 @@ protected:
 
     /*
      * KD-tree as a spatial index for finding particles quickly by location.
-     * This index is rebuilt each frame during ParticleEffect::buildFrame().
+     * This index is updated each frame during ParticleEffect::buildIndex().
      * The ParticleEffect itself uses this index for calculating pixel values,
      * but subclasses may also want to use it for phyiscs or interaction.
+     *
+     * Searches may return particles up to 'slack' beyond the requested radius,
+     * while the tree is out of date. Check distances against the result.
+     *
+     * When the grid is in use instead, the tree isn't kept up to date, but the
+     * same search functions work on either, with the same slack.
      */
 
     typedef nanoflann::KDTreeSingleIndexAdaptor<
@@ -89,13 +145,79 @@ protected:
         void radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const;
         void radiusSearch(ResultSet_t& hits, Vec3 point) const;
 
+        // Call visitor(particleIndex, distanceSquared) for each search hit, without allocating
+        template <class Visitor> void forEachHit(Vec3 point, float radius, Visitor &visitor) const;
+
+        ParticleEffect &effect;
+
         Vec3 aabbMin;
         Vec3 aabbMax;
         float radiusMax;
         IndexTree tree;
         bool treeIsValid;
+
+        // Particle locations when the tree was built, and the farthest any has moved since
+        std::vector<Vec3> builtPoints;
+        bool measureDisplacement;
+        float displacement2;
+        float slack;
+
+        // Guards the bounds while they're measured in parallel
+        tthread::mutex boundsLock;
+        float radiusTotal;
+
+        /*
+         * Uniform grid, stored as a hash table of cells. Particle indices are sorted
+         * by bucket; each bucket's particles start at bucketStart[bucket]. Buckets may
+         * hold more than one cell, so every entry also has its cell's key.
+         */
+        struct Grid {
+            float cellSize;
+            Vec3 origin;
+            unsigned dims[3];
+            unsigned mask;
+            std::vector<unsigned> bucketStart;
+            std::vector<unsigned> particles;
+            std::vector<uint64_t> keys;
+            std::vector<uint64_t> particleKeys;
+
+            static uint64_t cellKey(unsigned x, unsigned y, unsigned z);
+            unsigned bucket(uint64_t key) const;
+        } grid;
+        bool gridIsValid;
+
+        void buildGrid();
+        template <class Visitor> void forEachGridHit(Vec3 point, float radius, Visitor &visitor) const;
     } index;
 
+    static void measureBounds(void *context, unsigned begin, unsigned end);
+
+    /*
+     * Per-frame results from splat rendering. In parallel, particles are split
+     * into chunks that each accumulate into their own buffer; chunk 0 uses
+     * 'colors' directly, and the rest are summed into it afterwards.
+     */
+    struct Splats {
+        bool isValid;
+        const FrameInfo *frame;
+        unsigned numChunks;
+        std::vector<Vec3> colors;
+        std::vector<std::vector<Vec3> > chunkColors;
+
+        Vec3 *chunkBuffer(unsigned chunk);
+    } splats;
+
+    static void splatChunks(void *context, unsigned begin, unsigned end);
+    static void mergeSplats(void *context, unsigned begin, unsigned end);
+    void splatParticles(unsigned begin, unsigned end, Vec3 *colors) const;
+
+    // Visitors for Index::forEachHit()
+    struct CollectHits;
+    struct SampleColorVisitor;
+    struct SampleIntensityVisitor;
+    struct SampleIntensityGradientVisitor;
+    struct SplatVisitor;
+
     /*
      * Kernel function; determines particle shape
      * Poly6 kernel, Müller, Charypar, & Gross (2003)
@@ -110,6 +232,9 @@ protected:
     // First derivative of kernel()
     static float kernelDerivative(float q);
 
+    // Derivative of kernel2() with respect to q^2
+    static float kernel2Derivative(float q2);
+
 public:
     // Implementation glue for our KD-tree index
 
@@ -152,28 +277,204 @@ public:
 
 
 inline ParticleEffect::ParticleEffect()
-    : index(*this)
-{}
+    : indexRebuildThreshold(0.25),
+      indexType(INDEX_AUTO),
+      renderMode(RENDER_AUTO),
+      index(*this)
+{
+    splats.isValid = false;
+    splats.frame = 0;
+    splats.numChunks = 0;
+}
 
 inline ParticleEffect::Index::Index(ParticleEffect& e)
-    : aabbMin(0, 0, 0),
+    : effect(e),
+      aabbMin(0, 0, 0),
       aabbMax(0, 0, 0),
       radiusMax(0),
       tree(3, e),
-      treeIsValid(false)
+      treeIsValid(false),
+      measureDisplacement(false),
+      displacement2(0),
+      slack(0),
+      radiusTotal(0),
+      gridIsValid(false)
 {}
 
+struct ParticleEffect::CollectHits {
+    ResultSet_t &hits;
+    CollectHits(ResultSet_t &hits) : hits(hits) {}
+    void operator()(unsigned i, float dist2) {
+        hits.push_back(std::make_pair(size_t(i), Real(dist2)));
+    }
+};
+
+struct ParticleEffect::SampleColorVisitor {
+    const AppearanceVector &appearance;
+    Vec3 accumulator;
+    SampleColorVisitor(const AppearanceVector &a) : appearance(a), accumulator(0, 0, 0) {}
+    void operator()(unsigned i, float dist2);
+};
+
+struct ParticleEffect::SampleIntensityVisitor {
+    const AppearanceVector &appearance;
+    float accumulator;
+    SampleIntensityVisitor(const AppearanceVector &a) : appearance(a), accumulator(0) {}
+    void operator()(unsigned i, float dist2);
+};
+
+struct ParticleEffect::SampleIntensityGradientVisitor {
+    const AppearanceVector &appearance;
+    Vec3 location;
+    Vec3 accumulator;
+    SampleIntensityGradientVisitor(const AppearanceVector &a, Vec3 location)
+        : appearance(a), location(location), accumulator(0, 0, 0) {}
+    void operator()(unsigned i, float dist2);
+};
+
+struct ParticleEffect::SplatVisitor {
+    Vec3 color;
+    float radius2;
+    Vec3 *colors;
+    SplatVisitor(const ParticleAppearance &p, Vec3 *colors)
+        : color(p.color * p.intensity), radius2(sq(p.radius)), colors(colors) {}
+    void operator()(size_t pixel, float dist2);
+};
+
 inline void ParticleEffect::Index::radiusSearch(ResultSet_t& hits, Vec3 point, float radius) const
 {
-    if (treeIsValid) {
+    if (gridIsValid) {
+        hits.clear();
+        CollectHits collect(hits);
+        forEachGridHit(point, radius, collect);
+    } else if (treeIsValid) {
         nanoflann::SearchParams params;
         params.sorted = false;
-        tree.radiusSearch(&point[0], radius * radius, hits, params);
+        tree.radiusSearch(&point[0], sq(radius + slack), hits, params);
     } else {
         hits.clear();
     }
 }
 
+template <class Visitor>
+inline void ParticleEffect::Index::forEachHit(Vec3 point, float radius, Visitor &visitor) const
+{
+    if (gridIsValid) {
+        forEachGridHit(point, radius, visitor);
+    } else if (treeIsValid) {
+        VisitorResultSet<Visitor> results(sq(radius + slack), visitor);
+        tree.findNeighbors(results, &point[0], nanoflann::SearchParams());
+    }
+}
+
+inline uint64_t ParticleEffect::Index::Grid::cellKey(unsigned x, unsigned y, unsigned z)
+{
+    return x | (uint64_t(y) << 21) | (uint64_t(z) << 42);
+}
+
+inline unsigned ParticleEffect::Index::Grid::bucket(uint64_t key) const
+{
+    return unsigned((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+template <class Visitor>
+inline void ParticleEffect::Index::forEachGridHit(Vec3 point, float radius, Visitor &visitor) const
+{
+    // Visit every cell the search sphere touches. Coordinates are clamped to the grid
+    // first, so far-away searches and huge radii stay cheap.
+
+    radius += slack;
+
+    unsigned lo[3], hi[3];
+    for (unsigned j = 0; j < 3; j++) {
+        float a = floorf((point[j] - radius - grid.origin[j]) / grid.cellSize);
+        float b = floorf((point[j] + radius - grid.origin[j]) / grid.cellSize);
+        if (b < 0 || a >= grid.dims[j]) {
+            return;
+        }
+        lo[j] = std::max(0.0f, a);
+        hi[j] = std::min(float(grid.dims[j] - 1), b);
+    }
+
+    const AppearanceVector &appearance = effect.appearance;
+    float r2 = sq(radius);
+
+    for (unsigned z = lo[2]; z <= hi[2]; z++) {
+        for (unsigned y = lo[1]; y <= hi[1]; y++) {
+            for (unsigned x = lo[0]; x <= hi[0]; x++) {
+                uint64_t key = Grid::cellKey(x, y, z);
+                unsigned b = grid.bucket(key);
+
+                for (unsigned k = grid.bucketStart[b], e = grid.bucketStart[b + 1]; k != e; k++) {
+                    if (grid.keys[k] == key) {
+                        unsigned i = grid.particles[k];
+                        float dist2 = sqrlen(appearance[i].point - point);
+                        if (dist2 <= r2) {
+                            visitor(i, dist2);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+inline void ParticleEffect::Index::buildGrid()
+{
+    // Cells as big as the largest particle, but no more than 2^21 of them per axis
+    const AppearanceVector &appearance = effect.appearance;
+    Vec3 extent = aabbMax - aabbMin;
+    float maxExtent = std::max(extent[0], std::max(extent[1], extent[2]));
+
+    grid.cellSize = std::max(radiusMax, maxExtent / float((1 << 21) - 2));
+    grid.origin = aabbMin;
+    for (unsigned j = 0; j < 3; j++) {
+        grid.dims[j] = unsigned(extent[j] / grid.cellSize) + 1;
+    }
+
+    // Hash table with at least twice as many buckets as particles
+    unsigned numBuckets = 1;
+    while (numBuckets < appearance.size() * 2) {
+        numBuckets <<= 1;
+    }
+    grid.mask = numBuckets - 1;
+
+    // Counting sort of particles by bucket
+
+    grid.bucketStart.assign(numBuckets + 1, 0);
+    grid.particleKeys.resize(appearance.size());
+    grid.particles.resize(appearance.size());
+    grid.keys.resize(appearance.size());
+
+    for (unsigned i = 0; i < appearance.size(); i++) {
+        Vec3 c = (appearance[i].point - grid.origin) / grid.cellSize;
+        uint64_t key = Grid::cellKey(
+            std::min<unsigned>(grid.dims[0] - 1, c[0]),
+            std::min<unsigned>(grid.dims[1] - 1, c[1]),
+            std::min<unsigned>(grid.dims[2] - 1, c[2]));
+        grid.particleKeys[i] = key;
+        grid.bucketStart[grid.bucket(key) + 1]++;
+    }
+
+    for (unsigned b = 0; b < numBuckets; b++) {
+        grid.bucketStart[b + 1] += grid.bucketStart[b];
+    }
+
+    // Fill each bucket from the back, using the next bucket's start as a cursor
+    for (unsigned i = appearance.size(); i--;) {
+        uint64_t key = grid.particleKeys[i];
+        unsigned k = --grid.bucketStart[grid.bucket(key) + 1];
+        grid.particles[k] = i;
+        grid.keys[k] = key;
+    }
+
+    // Each cursor ended at the start of the bucket before it; shift them into place
+    for (unsigned b = 0; b < numBuckets; b++) {
+        grid.bucketStart[b] = grid.bucketStart[b + 1];
+    }
+    grid.bucketStart[numBuckets] = appearance.size();
+}
+
 inline void ParticleEffect::Index::radiusSearch(ResultSet_t& hits, Vec3 point) const
 {
     radiusSearch(hits, point, radiusMax);
@@ -197,9 +498,101 @@ inline float ParticleEffect::kernelDerivative(float q)
     return -6.0f * q * a * a;
 }
 
+inline float ParticleEffect::kernel2Derivative(float q2)
+{
+    float a = 1 - q2;
+    return -3.0f * a * a;
+}
+
 inline void ParticleEffect::beginFrame(const FrameInfo& f)
 {
     buildIndex();
+
+    bool useSplats = !f.pixels.empty() && (renderMode == RENDER_SPLAT ||
+        (renderMode == RENDER_AUTO && appearance.size() * SPLAT_MIN_PIXEL_RATIO <= f.pixels.size()));
+
+    if (useSplats) {
+        renderSplats(f);
+    } else {
+        splats.isValid = false;
+    }
+}
+
+inline void ParticleEffect::renderSplats(const FrameInfo& f)
+{
+    splats.frame = &f;
+    splats.colors.resize(f.pixels.size());
+
+    EffectThreadPool &pool = EffectThreadPool::shared();
+    unsigned numChunks = appearance.size() >= PARALLEL_SPLAT_PARTICLES ? pool.getConcurrency() : 1;
+
+    if (numChunks > 1) {
+        splats.numChunks = numChunks;
+        splats.chunkColors.resize(numChunks - 1);
+        pool.add(splatChunks, this, numChunks);
+        pool.run();
+        pool.add(mergeSplats, this, f.pixels.size());
+        pool.run();
+    } else {
+        std::fill(splats.colors.begin(), splats.colors.end(), Vec3(0, 0, 0));
+        splatParticles(0, appearance.size(), &splats.colors[0]);
+    }
+
+    splats.frame = 0;
+    splats.isValid = true;
+}
+
+inline Vec3 *ParticleEffect::Splats::chunkBuffer(unsigned chunk)
+{
+    return chunk ? &chunkColors[chunk - 1][0] : &colors[0];
+}
+
+inline void ParticleEffect::splatChunks(void *context, unsigned begin, unsigned end)
+{
+    // Splat each chunk's share of the particles into that chunk's own buffer
+
+    ParticleEffect &e = *(ParticleEffect*) context;
+    unsigned numParticles = e.appearance.size();
+    unsigned numPixels = e.splats.colors.size();
+
+    for (unsigned chunk = begin; chunk < end; ++chunk) {
+        if (chunk) {
+            e.splats.chunkColors[chunk - 1].resize(numPixels);
+        }
+        Vec3 *colors = e.splats.chunkBuffer(chunk);
+        std::fill(colors, colors + numPixels, Vec3(0, 0, 0));
+
+        e.splatParticles(
+            (unsigned long long) chunk * numParticles / e.splats.numChunks,
+            (unsigned long long) (chunk + 1) * numParticles / e.splats.numChunks,
+            colors);
+    }
+}
+
+inline void ParticleEffect::mergeSplats(void *context, unsigned begin, unsigned end)
+{
+    // Sum the other chunks' buffers into chunk 0, for a range of pixels
+
+    ParticleEffect &e = *(ParticleEffect*) context;
+    Vec3 *colors = &e.splats.colors[0];
+
+    for (unsigned chunk = 1; chunk < e.splats.numChunks; ++chunk) {
+        const Vec3 *chunkColors = &e.splats.chunkColors[chunk - 1][0];
+        for (unsigned i = begin; i < end; ++i) {
+            colors[i] += chunkColors[i];
+        }
+    }
+}
+
+inline void ParticleEffect::splatParticles(unsigned begin, unsigned end, Vec3 *colors) const
+{
+    for (unsigned i = begin; i < end; ++i) {
+        const ParticleAppearance &particle = appearance[i];
+        if (particle.radius > 0) {
+            SplatVisitor v(particle, colors);
+            splats.frame->forEachHit(particle.point, particle.radius, v);
+        }
+    }
 }
 
 inline void ParticleEffect::buildIndex()
@@ -210,42 +603,145 @@ inline void ParticleEffect::buildIndex()
         index.aabbMax = Vec3(0, 0, 0);
         index.radiusMax = 0;
         index.treeIsValid = false;
+        index.gridIsValid = false;
+        index.builtPoints.clear();
+        index.slack = 0;
 
     } else {
         // Measure bounding box and largest radius in 'particles'
         index.aabbMin = appearance[0].point;
         index.aabbMax = appearance[0].point;
         index.radiusMax = appearance[0].radius;
-        for (unsigned i = 1; i < appearance.size(); ++i) {
-            const ParticleAppearance& particle = appearance[i];
-            
-            index.aabbMin[0] = std::min(index.aabbMin[0], particle.point[0]);
-            index.aabbMin[1] = std::min(index.aabbMin[1], particle.point[1]);
-            index.aabbMin[2] = std::min(index.aabbMin[2], particle.point[2]);
-            
-            index.aabbMax[0] = std::max(index.aabbMax[0], particle.point[0]);
-            index.aabbMax[1] = std::max(index.aabbMax[1], particle.point[1]);
-            index.aabbMax[2] = std::max(index.aabbMax[2], particle.point[2]);
-            
-            index.radiusMax = std::max(index.radiusMax, particle.radius);
+
+        // Also see how far particles moved, if the index has the same ones
+        index.measureDisplacement = (index.treeIsValid || index.gridIsValid) &&
+            index.builtPoints.size() == appearance.size();
+        index.displacement2 = 0;
+        index.radiusTotal = 0;
+
+        if (appearance.size() >= PARALLEL_INDEX_PARTICLES) {
+            EffectThreadPool::shared().add(measureBounds, this, appearance.size());
+            EffectThreadPool::shared().run();
+        } else {
+            measureBounds(this, 0, appearance.size());
         }
 
-        // Rebuild KD-tree. Fails if we have zero particles.
-        index.tree.buildIndex();
-        index.treeIsValid = true;
+        bool useGrid = index.radiusMax > 0 && (indexType == INDEX_GRID || (indexType == INDEX_AUTO &&
+            appearance.size() >= GRID_MIN_PARTICLES &&
+            index.radiusMax <= GRID_MAX_RADIUS_RATIO * index.radiusTotal / appearance.size()));
+
+        // An index built from older locations still finds everything, if we search
+        // farther by the distance particles have moved since.
+        float displacement = sqrtf(index.displacement2);
+        if (index.measureDisplacement && useGrid == index.gridIsValid &&
+            displacement <= indexRebuildThreshold * index.radiusMax) {
+            index.slack = displacement;
+            return;
+        }
+
+        if (useGrid) {
+            index.buildGrid();
+            index.gridIsValid = true;
+            index.treeIsValid = false;
+        } else {
+            // Rebuild KD-tree. Fails if we have zero particles.
+            index.tree.buildIndex();
+            index.treeIsValid = true;
+            index.gridIsValid = false;
+        }
+        index.slack = 0;
+
+        index.builtPoints.resize(appearance.size());
+        for (unsigned i = 0; i < appearance.size(); ++i) {
+            index.builtPoints[i] = appearance[i].point;
+        }
     }
 }
 
+inline void ParticleEffect::measureBounds(void *context, unsigned begin, unsigned end)
+{
+    // Measure part of the particle system, and merge it into the index bounds
+
+    ParticleEffect &e = *(ParticleEffect*) context;
+    Vec3 aabbMin = e.appearance[begin].point;
+    Vec3 aabbMax = e.appearance[begin].point;
+    float radiusMax = e.appearance[begin].radius;
+    float displacement2 = 0;
+    float radiusTotal = 0;
+
+    for (unsigned i = begin; i < end; ++i) {
+        const ParticleAppearance& particle = e.appearance[i];
+
+        if (e.index.measureDisplacement) {
+            displacement2 = std::max(displacement2, sqrlen(particle.point - e.index.builtPoints[i]));
+        }
+
+        aabbMin[0] = std::min(aabbMin[0], particle.point[0]);
+        aabbMin[1] = std::min(aabbMin[1], particle.point[1]);
+        aabbMin[2] = std::min(aabbMin[2], particle.point[2]);
+
+        aabbMax[0] = std::max(aabbMax[0], particle.point[0]);
+        aabbMax[1] = std::max(aabbMax[1], particle.point[1]);
+        aabbMax[2] = std::max(aabbMax[2], particle.point[2]);
+
+        radiusMax = std::max(radiusMax, particle.radius);
+        radiusTotal += particle.radius;
+    }
+
+    e.index.boundsLock.lock();
+    for (unsigned j = 0; j < 3; ++j) {
+        e.index.aabbMin[j] = std::min(e.index.aabbMin[j], aabbMin[j]);
+        e.index.aabbMax[j] = std::max(e.index.aabbMax[j], aabbMax[j]);
+    }
+    e.index.radiusMax = std::max(e.index.radiusMax, radiusMax);
+    e.index.displacement2 = std::max(e.index.displacement2, displacement2);
+    e.index.radiusTotal += radiusTotal;
+    e.index.boundsLock.unlock();
+}
+
+inline void ParticleEffect::SplatVisitor::operator()(size_t pixel, float dist2)
+{
+    // Hits are always strictly inside the particle's radius
+    colors[pixel] += color * kernel2(dist2 / radius2);
+}
+
 inline void ParticleEffect::shader(Vec3& rgb, const PixelInfo& p) const
 {
-    rgb = sampleColor(p.point);
+    if (splats.isValid) {
+        rgb = splats.colors[p.index];
+    } else {
+        rgb = sampleColor(p.point);
+    }
+}
+
+inline void ParticleEffect::shadeBatch(const PixelBatch& batch, Vec3* out) const
+{
+    if (splats.isValid) {
+        if (batch.count) {
+            const Vec3 *colors = &splats.colors[batch.pixels[0].index];
+            std::copy(colors, colors + batch.count, out);
+        }
+    } else {
+        Effect::shadeBatch(batch, out);
+    }
 }
 
 inline Vec3 ParticleEffect::sampleColor(Vec3 location) const
 {
-    ResultSet_t hits;
-    index.radiusSearch(hits, location);
-    return sampleColor(hits);
+    SampleColorVisitor v(appearance);
+    index.forEachHit(location, index.radiusMax, v);
+    return v.accumulator;
+}
+
+inline void ParticleEffect::SampleColorVisitor::operator()(unsigned i, float dist2)
+{
+    const ParticleAppearance &particle = appearance[i];
+
+    // Normalized distance
+    float q2 = dist2 / sq(particle.radius);
+    if (q2 < 1.0f) {
+        accumulator += particle.color * (particle.intensity * kernel2(q2));
+    }
 }
 
 inline Vec3 ParticleEffect::sampleColor(ResultSet_t &hits) const
@@ -268,9 +764,20 @@ inline Vec3 ParticleEffect::sampleColor(ResultSet_t &hits) const
 
 inline float ParticleEffect::sampleIntensity(Vec3 location) const
 {
-    ResultSet_t hits;
-    index.radiusSearch(hits, location);
-    return sampleIntensity(hits);
+    SampleIntensityVisitor v(appearance);
+    index.forEachHit(location, index.radiusMax, v);
+    return v.accumulator;
+}
+
+inline void ParticleEffect::SampleIntensityVisitor::operator()(unsigned i, float dist2)
+{
+    const ParticleAppearance &particle = appearance[i];
+
+    // Normalized distance
+    float q2 = dist2 / sq(particle.radius);
+    if (q2 < 1.0f) {
+        accumulator += particle.intensity * kernel2(q2);
+    }
 }
 
 inline float ParticleEffect::sampleIntensity(ResultSet_t &hits) const
@@ -313,26 +820,37 @@ inline float ParticleEffect::sampleIntensity(ResultSet_t &hits, Vec3 point) cons
     return accumulator;
 }
 
-inline Vec3 ParticleEffect::sampleIntensityGradient(Vec3 location, float epsilon) const
+inline Vec3 ParticleEffect::sampleIntensityGradient(Vec3 location, float) const
 {
-    ResultSet_t hits;
-    index.radiusSearch(hits, location, index.radiusMax + epsilon);
+    SampleIntensityGradientVisitor v(appearance, location);
+    index.forEachHit(location, index.radiusMax, v);
+    return v.accumulator;
+}
 
-    Vec3 ex(epsilon, 0, 0);
-    Vec3 ey(0, epsilon, 0);
-    Vec3 ez(0, 0, epsilon);
-    float d = 0.5f / epsilon;
+inline void ParticleEffect::SampleIntensityGradientVisitor::operator()(unsigned i, float dist2)
+{
+    // Chain rule: q^2 = |location - point|^2 / r^2, so its gradient
+    // is 2 (location - point) / r^2.
 
-    // Finite difference approximation
-    return d * Vec3(
-        sampleIntensity(hits, location + ex) - sampleIntensity(hits, location - ex),
-        sampleIntensity(hits, location + ey) - sampleIntensity(hits, location - ey),
-        sampleIntensity(hits, location + ez) - sampleIntensity(hits, location - ez));
+    const ParticleAppearance &particle = appearance[i];
+    float r2 = sq(particle.radius);
+    float q2 = dist2 / r2;
+
+    if (q2 < 1.0f) {
+        float scale = particle.intensity * kernel2Derivative(q2) * 2.0f / r2;
+        accumulator += (location - particle.point) * scale;
+    }
 }
 
 inline void ParticleEffect::debug(const DebugInfo& d)
 {
-    fprintf(stderr, "\t[particle] %.1f kB, radiusMax = %.1f\n",
-        index.tree.usedMemory() / 1024.0f,
-        index.radiusMax);
+    if (index.gridIsValid) {
+        fprintf(stderr, "\t[particle] grid %d x %d x %d, radiusMax = %.1f, slack = %.3f\n",
+            index.grid.dims[0], index.grid.dims[1], index.grid.dims[2],
+            index.radiusMax, index.slack);
+    } else {
+        fprintf(stderr, "\t[particle] %.1f kB, radiusMax = %.1f, slack = %.3f\n",
+            index.tree.usedMemory() / 1024.0f,
+            index.radiusMax, index.slack);
+    }
 }
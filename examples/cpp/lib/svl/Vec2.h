@@ -13,17 +13,17 @@
 // --- Vec2 Class -------------------------------------------------------------
 
 
-class Vec2
+class alignas(2 * sizeof(Real)) Vec2
 {
 public:
 
     // Constructors
 
-                Vec2();
-                Vec2(Real x, Real y);       // (x, y)
-                Vec2(const Vec2 &v);        // Copy constructor
-                Vec2(ZeroOrOne k);          // v[i] = vl_zero
-                Vec2(Axis k);               // v[k] = 1
+                Vec2() = default;
+    constexpr   Vec2(Real x, Real y) : elt{x, y} {}             // (x, y)
+                Vec2(const Vec2 &v) = default;                  // Copy constructor
+    constexpr   Vec2(ZeroOrOne k) : elt{Real(k), Real(k)} {}    // v[i] = vl_zero
+                Vec2(Axis k);                                   // v[k] = 1
 
     // Accessor functions
 
@@ -35,7 +35,7 @@ public:
 
     // Assignment operators
 
-    Vec2        &operator =  (const Vec2 &a);
+    Vec2        &operator =  (const Vec2 &a) = default;
     Vec2        &operator =  (ZeroOrOne k);
     Vec2        &operator =  (Axis k);
 
@@ -105,35 +105,11 @@ inline const Real &Vec2::operator [] (Int i) const
     return(elt[i]);
 }
 
-inline Vec2::Vec2()
-{
-}
-
-inline Vec2::Vec2(Real x, Real y)
-{
-    elt[0] = x;
-    elt[1] = y;
-}
-
-inline Vec2::Vec2(const Vec2 &v)
-{
-    elt[0] = v[0];
-    elt[1] = v[1];
-}
-
 inline Real *Vec2::Ref() const
 {
     return((Real *) elt);
 }
 
-inline Vec2 &Vec2::operator = (const Vec2 &v)
-{
-    elt[0] = v[0];
-    elt[1] = v[1];
-
-    return(SELF);
-}
-
 inline Vec2 &Vec2::operator += (const Vec2 &v)
 {
     elt[0] += v[0];
@@ -324,12 +300,6 @@ inline Vec2 &Vec2::Normalise()
 }
 
 
-inline Vec2::Vec2(ZeroOrOne k)
-{
-    elt[0] = k;
-    elt[1] = k;
-}
-
 inline Vec2::Vec2(Axis k)
 {
     MakeUnit(k, vl_one);
@@ -21,11 +21,11 @@ public:
 
     // Constructors
 
-                Vec3();
-                Vec3(Real x, Real y, Real z);   // [x, y, z]
-                Vec3(const Vec3 &v);            // Copy constructor
-                Vec3(const Vec2 &v, Real w);    // Hom. 2D vector
-                Vec3(ZeroOrOne k);
+                Vec3() = default;
+    constexpr   Vec3(Real x, Real y, Real z) : elt{x, y, z} {}              // [x, y, z]
+                Vec3(const Vec3 &v) = default;                              // Copy constructor
+                Vec3(const Vec2 &v, Real w);                                // Hom. 2D vector
+    constexpr   Vec3(ZeroOrOne k) : elt{Real(k), Real(k), Real(k)} {}
                 Vec3(Axis a);
 
     // Accessor functions
@@ -39,7 +39,7 @@ public:
 
     // Assignment operators
 
-    Vec3        &operator =  (const Vec3 &a);
+    Vec3        &operator =  (const Vec3 &a) = default;
     Vec3        &operator =  (ZeroOrOne k);
     Vec3        &operator += (const Vec3 &a);
     Vec3        &operator -= (const Vec3 &a);
@@ -110,24 +110,6 @@ inline const Real &Vec3::operator [] (Int i) const
     return(elt[i]);
 }
 
-inline Vec3::Vec3()
-{
-}
-
-inline Vec3::Vec3(Real x, Real y, Real z)
-{
-    elt[0] = x;
-    elt[1] = y;
-    elt[2] = z;
-}
-
-inline Vec3::Vec3(const Vec3 &v)
-{
-    elt[0] = v[0];
-    elt[1] = v[1];
-    elt[2] = v[2];
-}
-
 inline Vec3::Vec3(const Vec2 &v, Real w)
 {
     elt[0] = v[0];
@@ -140,15 +122,6 @@ inline Real *Vec3::Ref() const
     return((Real *) elt);
 }
 
-inline Vec3 &Vec3::operator = (const Vec3 &v)
-{
-    elt[0] = v[0];
-    elt[1] = v[1];
-    elt[2] = v[2];
-
-    return(SELF);
-}
-
 inline Vec3 &Vec3::operator += (const Vec3 &v)
 {
     elt[0] += v[0];
@@ -322,11 +295,6 @@ inline Vec3 &Vec3::Normalise()
 }
 
 
-inline Vec3::Vec3(ZeroOrOne k)
-{
-    elt[0] = k; elt[1] = k; elt[2] = k;
-}
-
 inline Vec3 &Vec3::operator = (ZeroOrOne k)
 {
     elt[0] = k; elt[1] = k; elt[2] = k;
@@ -15,17 +15,17 @@
 
 // --- Vec4 Class -------------------------------------------------------------
 
-class Vec4
+class alignas(16) Vec4
 {
 public:
 
     // Constructors
 
-                Vec4();
-                Vec4(Real x, Real y, Real z, Real w);   // [x, y, z, w]
-                Vec4(const Vec4 &v);                    // Copy constructor
-                Vec4(const Vec3 &v, Real w);            // Hom. 3D vector
-                Vec4(ZeroOrOne k);
+                Vec4() = default;
+    constexpr   Vec4(Real x, Real y, Real z, Real w) : elt{x, y, z, w} {}   // [x, y, z, w]
+                Vec4(const Vec4 &v) = default;                              // Copy constructor
+                Vec4(const Vec3 &v, Real w);                                // Hom. 3D vector
+    constexpr   Vec4(ZeroOrOne k) : elt{Real(k), Real(k), Real(k), Real(k)} {}
                 Vec4(Axis k);
 
     // Accessor functions
@@ -39,7 +39,7 @@ public:
 
     // Assignment operators
 
-    Vec4        &operator =  (const Vec4 &a);
+    Vec4        &operator =  (const Vec4 &a) = default;
     Vec4        &operator =  (ZeroOrOne k);
     Vec4        &operator =  (Axis k);
     Vec4        &operator += (const Vec4 &a);
@@ -112,26 +112,6 @@ inline const Real &Vec4::operator [] (Int i) const
 }
 
 
-inline Vec4::Vec4()
-{
-}
-
-inline Vec4::Vec4(Real x, Real y, Real z, Real w)
-{
-    elt[0] = x;
-    elt[1] = y;
-    elt[2] = z;
-    elt[3] = w;
-}
-
-inline Vec4::Vec4(const Vec4 &v)
-{
-    elt[0] = v[0];
-    elt[1] = v[1];
-    elt[2] = v[2];
-    elt[3] = v[3];
-}
-
 inline Vec4::Vec4(const Vec3 &v, Real w)
 {
     elt[0] = v[0];
@@ -145,16 +125,6 @@ inline Real *Vec4::Ref() const
     return((Real *) elt);
 }
 
-inline Vec4 &Vec4::operator = (const Vec4 &v)
-{
-    elt[0] = v[0];
-    elt[1] = v[1];
-    elt[2] = v[2];
-    elt[3] = v[3];
-
-    return(SELF);
-}
-
 inline Vec4 &Vec4::operator += (const Vec4 &v)
 {
     elt[0] += v[0];
@@ -324,11 +294,6 @@ inline Vec4 &Vec4::Normalise()
     return(SELF);
 }
 
-inline Vec4::Vec4(ZeroOrOne k)
-{
-    MakeBlock(k);
-}
-
 inline Vec4::Vec4(Axis k)
 {
     MakeUnit(k, vl_1);
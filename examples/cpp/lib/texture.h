@@ -2,7 +2,16 @@
  * Simple 2D texture sampler.
  *
  * Textures are loaded from PNG files on disk,
- * and sampled with bilinear interpolation.
+ * and sampled with bilinear interpolation. A prefiltered
+ * mipmap chain avoids aliasing when the texture has more
+ * detail than the LEDs sampling it.
+ *
+ * Decoding a big PNG takes a while, so the decoded pixels are
+ * kept in a sidecar file next to it, "image.png.fct", which
+ * later loads memory map instead. Processes using the same
+ * texture share those pages. A sidecar is only used if it has
+ * the PNG's size and content hash, and if one can't be written,
+ * the PNG is simply decoded every time.
  *
  * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
  *
@@ -32,8 +41,14 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <string>
 #include <vector>
 #include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "picopng.h"
 #include "svl/SVL.h"
@@ -43,23 +58,85 @@ class Texture {
 public:
     Texture();
     Texture(const char *filename);
+    Texture(const Texture &other);
+    Texture& operator=(const Texture &other);
+    ~Texture();
 
-    bool load(const char *filename);
+    // From a PNG file, through its sidecar unless 'useCache' is false
+    bool load(const char *filename, bool useCache = true);
     bool load(std::vector<unsigned char> png);
+    bool load(const uint8_t *rgba, unsigned long width, unsigned long height);
     bool isLoaded() const;
 
     // Interpolated sampling. Texture coordinates in the range [0, 1]
     Vec3 sample(Vec2 texcoord) const;
     Vec3 sample(float x, float y) const;
 
+    /*
+     * Filtered sampling. 'footprint' is the distance between neighboring samples,
+     * in texture coordinates; for LEDs, roughly their spacing divided by the size of
+     * the texture in model units. Footprints smaller than a texel sample the full
+     * image exactly like sample(), larger ones blend between mipmap levels.
+     */
+    Vec3 sample(Vec2 texcoord, float footprint) const;
+    Vec3 sample(float x, float y, float footprint) const;
+
+    // Filtered sampling for many points with the same footprint
+    void sample(const float *x, const float *y, Vec3 *out, unsigned count, float footprint = 0) const;
+
     // Raw sampling, integer pixel coordinates.
     const uint8_t *sampleIntRGBA32(int x, int y) const;
     Vec3 sampleInt(int x, int y) const;
 
 private:
     unsigned long width, height;
+
+    // RGBA pixels, in 'pixels' or in a mapped sidecar file
+    const uint8_t *rgba;
     std::vector<unsigned char> pixels;
+    void *mapping;
+    size_t mappingSize;
+
+    /*
+     * Sidecar format, in this machine's byte order: "FCT1", 0x01020304,
+     * width, height (u32 each), the PNG's size and hash (u64 each), then
+     * the RGBA pixels.
+     */
+    static const unsigned SIDECAR_HEADER_BYTES = 32;
+
+    bool loadSidecar(const std::string &path, uint64_t pngSize, uint64_t pngHash);
+    void saveSidecar(const std::string &path, uint64_t pngSize, uint64_t pngHash) const;
+    static uint64_t hash(const uint8_t *data, size_t size);
+    void unmap();
+
+    /*
+     * Float RGBA copies of the image, each level half the size of the last, box
+     * filtered. Texels are stored in 4x4 tiles, so a row of a tile is one 64-byte
+     * cache line and most bilinear samples touch only one or two lines.
+     */
+    struct MipLevel {
+        unsigned width, height, tilesX;
+        std::vector<float> texels;
+
+        void resize(unsigned w, unsigned h);
+        float *texel(unsigned x, unsigned y);
+        const float *texel(int x, int y) const;  // Clamped to the edges
+
+        // A texel's offset in 'texels' is the sum of one from each axis
+        unsigned columnOffset(int x) const;  // Clamped to the edges
+        unsigned rowOffset(int y) const;
+    };
+    std::vector<MipLevel> levels;
+
     void init();
+    void buildMipmaps();
+
+    // Bilinear sample on one level, with 'u' and 'v' in full-size texels
+    Vec3 sampleLevel(unsigned level, float u, float v) const;
+
+    // Level of detail for a footprint; zero is the full-size image
+    float levelOfDetail(float footprint) const;
+    Vec3 sampleLOD(float x, float y, float lod) const;
 };
 
 
@@ -69,22 +146,63 @@ private:
 
 
 inline Texture::Texture()
+    : rgba(0), mapping(0), mappingSize(0)
 {
     init();
 }
 
 inline Texture::Texture(const char *filename)
+    : rgba(0), mapping(0), mappingSize(0)
 {
     load(filename);
 }
 
+inline Texture::Texture(const Texture &other)
+    : rgba(0), mapping(0), mappingSize(0)
+{
+    *this = other;
+}
+
+inline Texture& Texture::operator=(const Texture &other)
+{
+    // Copies get their own pixels, even if the original's are mapped
+    if (this != &other) {
+        init();
+        width = other.width;
+        height = other.height;
+        if (other.rgba) {
+            pixels.assign(other.rgba, other.rgba + width * height * 4);
+            rgba = &pixels[0];
+        }
+        levels = other.levels;
+    }
+    return *this;
+}
+
+inline Texture::~Texture()
+{
+    unmap();
+}
+
 inline void Texture::init()
 {
     width = 0;
     height = 0;
+    levels.clear();
+    unmap();
+}
+
+inline void Texture::unmap()
+{
+    if (mapping) {
+        munmap(mapping, mappingSize);
+        mapping = 0;
+        mappingSize = 0;
+    }
+    rgba = 0;
 }
 
-inline bool Texture::load(const char *filename)
+inline bool Texture::load(const char *filename, bool useCache)
 {
     init();
 
@@ -102,8 +220,17 @@ inline bool Texture::load(const char *filename)
     if (size > 0) {
         buffer.resize((size_t)size);
         if (fread(&buffer[0], size, 1, f) == 1) {
+            std::string sidecar = std::string(filename) + ".fct";
+            uint64_t pngHash = useCache ? hash(&buffer[0], buffer.size()) : 0;
+
+            if (useCache && loadSidecar(sidecar, size, pngHash)) {
+                fclose(f);
+                return true;
+            }
             if (load(buffer)) {
-                // Success
+                if (useCache) {
+                    saveSidecar(sidecar, size, pngHash);
+                }
                 fclose(f);
                 return true;
             }
@@ -117,14 +244,187 @@ inline bool Texture::load(const char *filename)
 
 inline bool Texture::load(std::vector<unsigned char> png)
 {
+    unmap();
     if (decodePNG(pixels, width, height, &png[0], png.size()) != 0) {
         init();
         return false;
     }
 
+    rgba = &pixels[0];
+    buildMipmaps();
+    return true;
+}
+
+inline bool Texture::load(const uint8_t *rgba, unsigned long width, unsigned long height)
+{
+    unmap();
+    this->width = width;
+    this->height = height;
+    pixels.assign(rgba, rgba + width * height * 4);
+    this->rgba = pixels.empty() ? 0 : &pixels[0];
+    buildMipmaps();
+    return true;
+}
+
+inline uint64_t Texture::hash(const uint8_t *data, size_t size)
+{
+    // 64-bit FNV-1a over whole words, then the leftover bytes
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof word);
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+inline bool Texture::loadSidecar(const std::string &path, uint64_t pngSize, uint64_t pngHash)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) SIDECAR_HEADER_BYTES) {
+        map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const uint8_t *data = (const uint8_t*) map;
+    uint32_t order, w, h;
+    uint64_t size, contentHash;
+    memcpy(&order, data + 4, 4);
+    memcpy(&w, data + 8, 4);
+    memcpy(&h, data + 12, 4);
+    memcpy(&size, data + 16, 8);
+    memcpy(&contentHash, data + 24, 8);
+
+    if (memcmp(data, "FCT1", 4) || order != 0x01020304 || size != pngSize || contentHash != pngHash
+        || w == 0 || h == 0 || uint64_t(st.st_size) != SIDECAR_HEADER_BYTES + uint64_t(w) * h * 4) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    mapping = map;
+    mappingSize = st.st_size;
+    width = w;
+    height = h;
+    rgba = data + SIDECAR_HEADER_BYTES;
+    std::vector<unsigned char>().swap(pixels);
+    buildMipmaps();
     return true;
 }
 
+inline void Texture::saveSidecar(const std::string &path, uint64_t pngSize, uint64_t pngHash) const
+{
+    // Written under a temporary name, so nobody maps half of one. Failing is fine;
+    // the directory may well be read-only.
+
+    char suffix[32];
+    snprintf(suffix, sizeof suffix, ".%d.tmp", (int) getpid());
+    std::string temporary = path + suffix;
+    FILE *f = fopen(temporary.c_str(), "wb");
+    if (!f) {
+        return;
+    }
+
+    uint8_t header[SIDECAR_HEADER_BYTES];
+    uint32_t order = 0x01020304, w = width, h = height;
+    memcpy(header, "FCT1", 4);
+    memcpy(header + 4, &order, 4);
+    memcpy(header + 8, &w, 4);
+    memcpy(header + 12, &h, 4);
+    memcpy(header + 16, &pngSize, 8);
+    memcpy(header + 24, &pngHash, 8);
+
+    bool ok = fwrite(header, sizeof header, 1, f) == 1 && fwrite(rgba, width * height * 4, 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+    }
+}
+
+inline void Texture::MipLevel::resize(unsigned w, unsigned h)
+{
+    width = w;
+    height = h;
+    tilesX = (w + 3) >> 2;
+    texels.resize(tilesX * ((h + 3) >> 2) * 16 * 4);
+}
+
+inline unsigned Texture::MipLevel::columnOffset(int x) const
+{
+    unsigned cx = std::max<int>(0, std::min<int>(width - 1, x));
+    return ((cx >> 2) << 6) + ((cx & 3) << 2);
+}
+
+inline unsigned Texture::MipLevel::rowOffset(int y) const
+{
+    unsigned cy = std::max<int>(0, std::min<int>(height - 1, y));
+    return (cy >> 2) * (tilesX << 6) + ((cy & 3) << 4);
+}
+
+inline float *Texture::MipLevel::texel(unsigned x, unsigned y)
+{
+    return &texels[columnOffset(x) + rowOffset(y)];
+}
+
+inline const float *Texture::MipLevel::texel(int x, int y) const
+{
+    return &texels[columnOffset(x) + rowOffset(y)];
+}
+
+inline void Texture::buildMipmaps()
+{
+    // Reuses the existing levels' memory, for textures that get reloaded often
+    unsigned numLevels = 1;
+    for (unsigned long w = width, h = height; w > 1 || h > 1; w >>= 1, h >>= 1) {
+        numLevels++;
+    }
+    levels.resize(numLevels);
+    levels[0].resize(width, height);
+
+    for (unsigned y = 0; y < height; y++) {
+        for (unsigned x = 0; x < width; x++) {
+            const uint8_t *src = &rgba[(x + y * width) << 2];
+            float *t = levels[0].texel(x, y);
+            for (unsigned c = 0; c < 4; c++) {
+                t[c] = src[c] / 255.0f;
+            }
+        }
+    }
+
+    // Each texel averages a 2x2 block of the level above, repeating edge texels
+    // when a dimension is odd.
+    for (unsigned level = 1; level < numLevels; level++) {
+        const MipLevel &src = levels[level - 1];
+        MipLevel &dest = levels[level];
+        dest.resize(std::max(1u, src.width >> 1), std::max(1u, src.height >> 1));
+
+        for (unsigned y = 0; y < dest.height; y++) {
+            for (unsigned x = 0; x < dest.width; x++) {
+                const float *a = src.texel(int(x*2),     int(y*2));
+                const float *b = src.texel(int(x*2 + 1), int(y*2));
+                const float *c = src.texel(int(x*2),     int(y*2 + 1));
+                const float *d = src.texel(int(x*2 + 1), int(y*2 + 1));
+                float *t = dest.texel(x, y);
+                for (unsigned i = 0; i < 4; i++) {
+                    t[i] = 0.25f * (a[i] + b[i] + c[i] + d[i]);
+                }
+            }
+        }
+    }
+}
+
 inline bool Texture::isLoaded() const
 {
     return width && height;
@@ -138,7 +438,7 @@ inline const uint8_t* Texture::sampleIntRGBA32(int x, int y) const
 
     x = std::max<int>(0, std::min<int>(width - 1, x));
     y = std::max<int>(0, std::min<int>(height - 1, y));
-    return &pixels[ (x + y * width) << 2 ];
+    return &rgba[ (x + y * width) << 2 ];
 }
 
 inline Vec3 Texture::sampleInt(int x, int y) const
@@ -157,22 +457,94 @@ inline Vec3 Texture::sample(Vec2 texcoord) const
 
 inline Vec3 Texture::sample(float x, float y) const
 {
-    float fx = x * width;
-    float fy = y * height;
+    if (!isLoaded()) {
+        return Vec3(0, 0, 0);
+    }
+    return sampleLevel(0, x * width, y * height);
+}
 
-    int ix = fx;
-    int iy = fy;
+inline Vec3 Texture::sample(Vec2 texcoord, float footprint) const
+{
+    return sample(texcoord[0], texcoord[1], footprint);
+}
 
-    // Sample four points
-    Vec3 aa = sampleInt(ix,     iy);
-    Vec3 ba = sampleInt(ix + 1, iy);
-    Vec3 ab = sampleInt(ix,     iy + 1);
-    Vec3 bb = sampleInt(ix + 1, iy + 1);
+inline Vec3 Texture::sample(float x, float y, float footprint) const
+{
+    if (!isLoaded()) {
+        return Vec3(0, 0, 0);
+    }
+    return sampleLOD(x, y, levelOfDetail(footprint));
+}
+
+inline void Texture::sample(const float *x, const float *y, Vec3 *out, unsigned count, float footprint) const
+{
+    if (!isLoaded()) {
+        std::fill(out, out + count, Vec3(0, 0, 0));
+        return;
+    }
+
+    float lod = levelOfDetail(footprint);
+    for (unsigned i = 0; i < count; i++) {
+        out[i] = sampleLOD(x[i], y[i], lod);
+    }
+}
 
-    // X interpolation
-    Vec3 ca = aa + (ba - aa) * (fx - ix);
-    Vec3 cb = ab + (bb - ab) * (fx - ix);
+inline float Texture::levelOfDetail(float footprint) const
+{
+    float texels = footprint * std::max(width, height);
+    return texels > 1.0f ? std::min<float>(log2f(texels), levels.size() - 1) : 0.0f;
+}
+
+inline Vec3 Texture::sampleLOD(float x, float y, float lod) const
+{
+    float u = x * width;
+    float v = y * height;
+
+    unsigned level = lod;
+    float blend = lod - level;
+    Vec3 result = sampleLevel(level, u, v);
+
+    if (blend > 0 && level + 1 < levels.size()) {
+        result += (sampleLevel(level + 1, u, v) - result) * blend;
+    }
+    return result;
+}
+
+inline Vec3 Texture::sampleLevel(unsigned level, float u, float v) const
+{
+    const MipLevel &m = levels[level];
+
+    if (level) {
+        // Texel 'j' on this level averages full-size texels [j << level, (j+1) << level),
+        // whose sample positions center on (j + 0.5) * scale - 0.5.
+        float invScale = 1.0f / (1 << level);
+        u = (u + 0.5f) * invScale - 0.5f;
+        v = (v + 0.5f) * invScale - 0.5f;
+    }
 
-    // Y interpolation
-    return ca + (cb - ca) * (fy - iy);
+    // Level 0 truncates like the original sampler did, so it matches exactly
+    int ix = level ? (int) floorf(u) : (int) u;
+    int iy = level ? (int) floorf(v) : (int) v;
+    float fx = u - ix;
+    float fy = v - iy;
+
+    // Sample four points
+    unsigned x0 = m.columnOffset(ix), x1 = m.columnOffset(ix + 1);
+    unsigned y0 = m.rowOffset(iy), y1 = m.rowOffset(iy + 1);
+    const float *aa = &m.texels[x0 + y0];
+    const float *ba = &m.texels[x1 + y0];
+    const float *ab = &m.texels[x0 + y1];
+    const float *bb = &m.texels[x1 + y1];
+
+    // All four channels, which vectorizes better than three
+    float result[4];
+    for (unsigned c = 0; c < 4; c++) {
+        // X interpolation
+        float ca = aa[c] + (ba[c] - aa[c]) * fx;
+        float cb = ab[c] + (bb[c] - ab[c]) * fx;
+
+        // Y interpolation
+        result[c] = ca + (cb - ca) * fy;
+    }
+    return Vec3(result[0], result[1], result[2]);
 }
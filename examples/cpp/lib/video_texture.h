@@ -0,0 +1,436 @@
+/*
+ * Streaming texture source, for playing back pre-rendered video.
+ *
+ * Frames come from a raw RGBA file, which is memory mapped, or from a
+ * numbered sequence of PNG files. A background thread decodes a few frames
+ * ahead of the one being shown, so the render loop never waits on disk I/O
+ * or PNG decoding.
+ *
+ * Copyright (c) 2014 Micah Elizabeth Scott <micah@scanlime.org>
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "texture.h"
+#include "tinythread.h"
+
+
+class VideoTexture {
+public:
+    VideoTexture();
+    ~VideoTexture();
+
+    // Raw RGBA frames back to back, as written by
+    // "ffmpeg -i video.mp4 -f rawvideo -pix_fmt rgba video.rgba"
+    bool openRaw(const char *filename, unsigned width, unsigned height);
+
+    // Numbered PNG files, from a printf() pattern like "frames/%04d.png".
+    // Numbering may start at 0 or 1, and ends at the first missing file.
+    bool openSequence(const char *pattern);
+
+    void close();
+    bool isOpen() const;
+    unsigned getFrameCount() const;
+
+    /*
+     * Choose the frame to show, usually from beginFrame(). This never waits: if
+     * that frame hasn't been decoded yet, the last one stays up and it counts as
+     * late. Either way, the background thread starts on the frames after it.
+     */
+    void setFrame(unsigned index);
+
+    // Choose a frame by playback time, looping at the end
+    void setTime(double seconds, double frameRate);
+
+    // Frames that weren't ready in time, since open
+    unsigned getLateFrames() const;
+
+    // The frame being shown, and the same sampling functions as Texture
+    const Texture& current() const;
+    bool isLoaded() const;
+    Vec3 sample(Vec2 texcoord) const;
+    Vec3 sample(float x, float y) const;
+    Vec3 sample(Vec2 texcoord, float footprint) const;
+    Vec3 sample(float x, float y, float footprint) const;
+    void sample(const float *x, const float *y, Vec3 *out, unsigned count, float footprint = 0) const;
+
+private:
+    // Decoded frames. The background thread only writes a slot that isn't shown
+    // and isn't marked ready; everything but 'texture' is under 'lock'.
+    static const unsigned NUM_SLOTS = 4;
+    struct Slot {
+        Texture texture;
+        int frame;
+        bool ready;
+    } slots[NUM_SLOTS];
+    int currentSlot;
+    Texture empty;
+
+    unsigned frameCount;
+    unsigned wantedFrame;
+    unsigned lateFrames;
+
+    // Raw file mapping
+    const uint8_t *rawData;
+    size_t rawSize;
+    unsigned rawWidth, rawHeight;
+
+    // Image sequence
+    std::string pattern;
+    unsigned firstIndex;
+
+    tthread::thread *thread;
+    tthread::mutex lock;
+    tthread::condition_variable cond;
+    bool stopping;
+
+    void start(unsigned count);
+    std::string sequencePath(unsigned index) const;
+    bool decode(unsigned frame, Texture &texture);
+
+    static void threadFunc(void *arg);
+    void prefetchLoop();
+    bool isSlotBusy(unsigned slot, unsigned window) const;
+};
+
+
+/*****************************************************************************************
+ *                                   Implementation
+ *****************************************************************************************/
+
+
+inline VideoTexture::VideoTexture()
+    : currentSlot(-1),
+      frameCount(0),
+      wantedFrame(0),
+      lateFrames(0),
+      rawData(0),
+      rawSize(0),
+      rawWidth(0),
+      rawHeight(0),
+      firstIndex(0),
+      thread(0),
+      stopping(false)
+{
+    for (unsigned i = 0; i < NUM_SLOTS; i++) {
+        slots[i].frame = -1;
+        slots[i].ready = false;
+    }
+}
+
+inline VideoTexture::~VideoTexture()
+{
+    close();
+}
+
+inline bool VideoTexture::openRaw(const char *filename, unsigned width, unsigned height)
+{
+    close();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open video %s\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    size_t frameSize = (size_t) width * height * 4;
+    if (fstat(fd, &st) < 0 || frameSize == 0 || (size_t) st.st_size < frameSize) {
+        fprintf(stderr, "Video %s doesn't hold any %dx%d RGBA frames\n", filename, width, height);
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Can't map video %s\n", filename);
+        return false;
+    }
+
+    // Frames are mostly read in order, so let the kernel read ahead
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    rawData = (const uint8_t*) data;
+    rawSize = st.st_size;
+    rawWidth = width;
+    rawHeight = height;
+    start(st.st_size / frameSize);
+    return true;
+}
+
+inline bool VideoTexture::openSequence(const char *pattern)
+{
+    close();
+    this->pattern = pattern;
+
+    firstIndex = access(sequencePath(0).c_str(), R_OK) == 0 ? 0 : 1;
+    unsigned count = 0;
+    while (access(sequencePath(firstIndex + count).c_str(), R_OK) == 0) {
+        count++;
+    }
+
+    if (!count) {
+        fprintf(stderr, "Can't find any video frames named %s\n", pattern);
+        return false;
+    }
+
+    start(count);
+    return true;
+}
+
+inline std::string VideoTexture::sequencePath(unsigned index) const
+{
+    char path[1024];
+    snprintf(path, sizeof path, pattern.c_str(), index);
+    return path;
+}
+
+inline void VideoTexture::start(unsigned count)
+{
+    frameCount = count;
+    wantedFrame = 0;
+    lateFrames = 0;
+    currentSlot = -1;
+    stopping = false;
+
+    // Have the first frame up right away; opening is allowed to take a while
+    if (decode(0, slots[0].texture)) {
+        slots[0].frame = 0;
+        slots[0].ready = true;
+        currentSlot = 0;
+    }
+    thread = new tthread::thread(threadFunc, this);
+}
+
+inline void VideoTexture::close()
+{
+    if (thread) {
+        lock.lock();
+        stopping = true;
+        cond.notify_all();
+        lock.unlock();
+
+        thread->join();
+        delete thread;
+        thread = 0;
+    }
+
+    if (rawData) {
+        munmap((void*) rawData, rawSize);
+        rawData = 0;
+        rawSize = 0;
+    }
+
+    for (unsigned i = 0; i < NUM_SLOTS; i++) {
+        slots[i].frame = -1;
+        slots[i].ready = false;
+    }
+    currentSlot = -1;
+    frameCount = 0;
+}
+
+inline bool VideoTexture::isOpen() const
+{
+    return frameCount != 0;
+}
+
+inline unsigned VideoTexture::getFrameCount() const
+{
+    return frameCount;
+}
+
+inline unsigned VideoTexture::getLateFrames() const
+{
+    return lateFrames;
+}
+
+inline void VideoTexture::setFrame(unsigned index)
+{
+    if (!frameCount) {
+        return;
+    }
+
+    lock.lock();
+    wantedFrame = index % frameCount;
+
+    bool found = false;
+    for (unsigned i = 0; i < NUM_SLOTS; i++) {
+        if (slots[i].ready && slots[i].frame == (int) wantedFrame) {
+            currentSlot = i;
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        lateFrames++;
+    }
+
+    cond.notify_all();
+    lock.unlock();
+}
+
+inline void VideoTexture::setTime(double seconds, double frameRate)
+{
+    if (frameCount) {
+        double frame = fmod(floor(seconds * frameRate), frameCount);
+        setFrame(frame < 0 ? frame + frameCount : frame);
+    }
+}
+
+inline void VideoTexture::threadFunc(void *arg)
+{
+    ((VideoTexture*) arg)->prefetchLoop();
+}
+
+inline bool VideoTexture::isSlotBusy(unsigned slot, unsigned window) const
+{
+    // Is this slot shown, being decoded, or holding a frame we'll want soon?
+
+    const Slot &s = slots[slot];
+    if ((int) slot == currentSlot || (s.frame >= 0 && !s.ready)) {
+        return true;
+    }
+    unsigned ahead = (s.frame - wantedFrame + frameCount) % frameCount;
+    return s.frame >= 0 && ahead < window;
+}
+
+inline void VideoTexture::prefetchLoop()
+{
+    // Keep the wanted frame and the ones right after it decoded, using every
+    // slot except the one on display.
+    unsigned window = std::min(NUM_SLOTS - 1, frameCount);
+
+    lock.lock();
+
+    while (!stopping) {
+        // Earliest frame in the window that no slot has yet
+        int frame = -1;
+        for (unsigned k = 0; k < window && frame < 0; k++) {
+            unsigned f = (wantedFrame + k) % frameCount;
+            frame = f;
+            for (unsigned i = 0; i < NUM_SLOTS; i++) {
+                if (slots[i].frame == (int) f) {
+                    frame = -1;
+                }
+            }
+        }
+
+        int slot = -1;
+        for (unsigned i = 0; frame >= 0 && i < NUM_SLOTS && slot < 0; i++) {
+            if (!isSlotBusy(i, window)) {
+                slot = i;
+            }
+        }
+
+        if (slot < 0) {
+            cond.wait(lock);
+            continue;
+        }
+
+        Slot &s = slots[slot];
+        s.frame = frame;
+        s.ready = false;
+        lock.unlock();
+
+        bool ok = decode(frame, s.texture);
+
+        lock.lock();
+        if (ok) {
+            s.ready = true;
+        } else {
+            // Show the last good frame instead. Don't retry until playback moves on.
+            s.frame = -1;
+            if (frameCount > 1) {
+                wantedFrame = (wantedFrame + 1) % frameCount;
+            }
+        }
+    }
+
+    lock.unlock();
+}
+
+inline bool VideoTexture::decode(unsigned frame, Texture &texture)
+{
+    if (rawData) {
+        size_t frameSize = (size_t) rawWidth * rawHeight * 4;
+        const uint8_t *data = rawData + frame * frameSize;
+
+        // Start reading the next frame from disk while we copy this one
+        size_t next = (frame + 1) * frameSize;
+        if (next + frameSize <= rawSize) {
+            size_t page = sysconf(_SC_PAGESIZE);
+            size_t begin = next & ~(page - 1);
+            madvise((void*) (rawData + begin), next + frameSize - begin, MADV_WILLNEED);
+        }
+
+        return texture.load(data, rawWidth, rawHeight);
+    }
+
+    // No sidecars for every frame; decoding ahead already hides the time
+    return texture.load(sequencePath(firstIndex + frame).c_str(), false);
+}
+
+inline const Texture& VideoTexture::current() const
+{
+    return currentSlot < 0 ? empty : slots[currentSlot].texture;
+}
+
+inline bool VideoTexture::isLoaded() const
+{
+    return current().isLoaded();
+}
+
+inline Vec3 VideoTexture::sample(Vec2 texcoord) const
+{
+    return current().sample(texcoord);
+}
+
+inline Vec3 VideoTexture::sample(float x, float y) const
+{
+    return current().sample(x, y);
+}
+
+inline Vec3 VideoTexture::sample(Vec2 texcoord, float footprint) const
+{
+    return current().sample(texcoord, footprint);
+}
+
+inline Vec3 VideoTexture::sample(float x, float y, float footprint) const
+{
+    return current().sample(x, y, footprint);
+}
+
+inline void VideoTexture::sample(const float *x, const float *y, Vec3 *out, unsigned count, float footprint) const
+{
+    current().sample(x, y, out, count, footprint);
+}
@@ -36,6 +36,7 @@ int main(int argc, char **argv)
 
     // Defaults, overridable with command line options
     r.setLayout("../layouts/grid32x16z.json");
+    r.setWarmupFrames(3);
 
     return r.main(argc, argv);
 }
@@ -19,6 +19,9 @@ int main(int argc, char **argv)
     mixer.add(&dot);
     mixer.add(&spokes);
 
+    // Faint effects near the ends of a crossfade only render every other frame
+    mixer.setLowFaderRendering(0.1f);
+
     EffectRunner r;
     r.setEffect(&mixer);
     r.setLayout("../layouts/grid32x16z.json");
@@ -17,6 +17,7 @@
 #include <cstdlib>
 #include "lib/color.h"
 #include "lib/effect.h"
+#include "lib/effect_thread_pool.h"
 #include "lib/noise.h"
 #include "lib/texture.h"
 
@@ -61,6 +62,13 @@ public:
     float colorParam;
     float pixelTotalNumerator;
     unsigned pixelTotalDenominator;
+
+    // Brightness totals from postProcessBatch(), one per thread
+    struct PixelTotal {
+        float numerator;
+        unsigned denominator;
+    };
+    std::vector<PixelTotal> threadTotals;
     bool is3D;
     Vec3 center;
 
@@ -90,12 +98,13 @@ public:
         // Reset pixel total accumulators, used for the brightness calc in endFrame
         pixelTotalNumerator = 0;
         pixelTotalDenominator = 0;
+        PixelTotal zero = { 0, 0 };
+        threadTotals.assign(EffectThreadPool::shared().getConcurrency(), zero);
 
         // Is this 2D or 3D?
         is3D = false;
-        for (Effect::PixelInfoIter i = f.pixels.begin(), e = f.pixels.end(); i != e; ++i) {
-            const Effect::PixelInfo &p = *i;
-            if (p.point[1] != 0.0f) {
+        for (unsigned i = 0; i < f.pointY.size(); ++i) {
+            if (f.pointY[i] != 0.0f) {
                 is3D = true;
             }
         }
@@ -176,12 +185,41 @@ public:
         }
     }
 
+    virtual bool hasParallelPostProcess() const
+    {
+        return true;
+    }
+
+    virtual void postProcessBatch(const PixelBatch& batch, const Vec3* colors, unsigned thread)
+    {
+        // Same totals as postProcess(), kept separately for each thread until endFrame()
+        float numerator = 0;
+        unsigned denominator = 0;
+
+        for (unsigned i = 0; i < batch.count; i++) {
+            if (batch.isMapped(i)) {
+                for (unsigned j = 0; j < 3; j++) {
+                    numerator += sq(std::min(1.0f, std::max(0.0f, colors[i][j])));
+                }
+                denominator += 3;
+            }
+        }
+
+        threadTotals[thread].numerator += numerator;
+        threadTotals[thread].denominator += denominator;
+    }
+
     virtual bool endFrame(const FrameInfo &f)
     {
         // Per-frame brightness calculations.
         // Adjust threshold in brightness-determining noise function, in order
         // to try and keep the average pixel brightness at a particular level.
 
+        for (unsigned i = 0; i < threadTotals.size(); i++) {
+            pixelTotalNumerator += threadTotals[i].numerator;
+            pixelTotalDenominator += threadTotals[i].denominator;
+        }
+
         float target = targetBrightness;
         float current = pixelTotalDenominator ? pixelTotalNumerator / pixelTotalDenominator : 0.0f;
         bool blackLevel = current <= 0.0f;
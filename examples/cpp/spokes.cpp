@@ -4,9 +4,21 @@
 int main(int argc, char **argv)
 {
     SpokesEffect e;
+    FixedSpokesEffect fixed;
+
+    // "-fixed" shades in fixed point, for computers without fast floating point
+    bool useFixed = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-fixed")) {
+            useFixed = true;
+            std::copy(argv + i + 1, argv + argc, argv + i);
+            argc--;
+            break;
+        }
+    }
 
     // Global brightness control
-    Brightness br(e);
+    Brightness br(useFixed ? (Effect&) fixed : (Effect&) e);
     br.set(0.2);
 
     EffectRunner r;
@@ -14,4 +26,3 @@ int main(int argc, char **argv)
     r.setLayout("../layouts/grid32x16z.json");
     return r.main(argc, argv);
 }
-
@@ -11,12 +11,13 @@
 #include "lib/effect.h"
 #include "lib/noise.h"
 #include "lib/brightness.h"
+#include "lib/fixed_effect.h"
 
 class SpokesEffect : public Effect
 {
 public:
     SpokesEffect()
-        : spin(0) {}
+        : spin(0), cycle(0), noiseOffset(0, 0, 0) {}
 
     static constexpr float cycleRate = 0.001;
     static constexpr float wanderSpeed = 40.0;
@@ -73,4 +74,98 @@ public:
             sq(std::max(0.0f, sinf(angle * 5.0f))) * std::min(0.8f, sqrlen(s))
         );
     }
+
+    virtual void shadeBatch(const PixelBatch &b, Vec3 *out) const
+    {
+        // Same as shader(), but split into a batched noise pass and a pass of plain
+        // arithmetic on short arrays, which the compiler can vectorize.
+
+        static const unsigned chunk = 64;
+        float nx[chunk], ny[chunk], nz[chunk], noise[chunk];
+        float sx[chunk], sz[chunk], angle[chunk], value[chunk];
+
+        for (unsigned base = 0; base < b.count; base += chunk) {
+            unsigned n = std::min(chunk, b.count - base);
+            const Real *x = b.x + base;
+            const Real *y = b.y + base;
+            const Real *z = b.z + base;
+
+            for (unsigned i = 0; i < n; i++) {
+                nx[i] = x[i] * noiseScale + noiseOffset[0];
+                ny[i] = y[i] * noiseScale + noiseOffset[1];
+                nz[i] = z[i] * noiseScale + noiseOffset[2];
+            }
+            fbm_noise3_batch(nx, ny, nz, noise, n, 4);
+
+            for (unsigned i = 0; i < n; i++) {
+                sx[i] = x[i] - center[0] + noise[i] * noiseDepth;
+                sz[i] = z[i] - center[2];
+            }
+
+            for (unsigned i = 0; i < n; i++) {
+                float sy = y[i] - center[1];
+                angle[i] = atan2f(sz[i], sx[i]) + spin;
+                value[i] = sq(std::max(0.0f, sinf(angle[i] * 5.0f)))
+                    * std::min(0.8f, sx[i]*sx[i] + sy*sy + sz[i]*sz[i]);
+            }
+
+            for (unsigned i = 0; i < n; i++) {
+                hsv2rgb(out[base + i], hue + angle[i] * hueShift, saturation, value[i]);
+            }
+        }
+    }
+};
+
+
+/*
+ * The same effect, shaded in fixed point, for CPUs without fast floating point.
+ * Per-frame parameters still come from a SpokesEffect, converted once per frame.
+ */
+
+class FixedSpokesEffect : public FixedEffect
+{
+public:
+    FixedSpokesEffect()
+        : noiseScale(fixed_from_float(SpokesEffect::noiseScale)),
+          noiseDepth(fixed_from_float(SpokesEffect::noiseDepth)),
+          hueShift(fixed_from_float(SpokesEffect::hueShift)),
+          maxValue(fixed_from_float(0.8f)) {}
+
+    SpokesEffect params;
+
+    // Constants, converted
+    const Fixed noiseScale, noiseDepth, hueShift, maxValue;
+
+    // Calculated once per frame, from params
+    Fixed spin, hue, saturation;
+    FixedVec3 center, noiseOffset;
+
+    virtual void beginFrame(const FrameInfo &f)
+    {
+        params.beginFrame(f);
+
+        spin = fixed_from_float(params.spin);
+        hue = fixed_from_float(params.hue);
+        saturation = fixed_from_float(params.saturation);
+        center = FixedVec3(params.center);
+        noiseOffset = FixedVec3(params.noiseOffset);
+    }
+
+    virtual void fixedShader(FixedVec3& rgb, const FixedVec3& point, const PixelInfo &p) const
+    {
+        // Vector to center
+        FixedVec3 s = point - center;
+
+        // Distort with noise function
+        FixedVec3 n = point * noiseScale + noiseOffset;
+        s[0] += fixed_mul(fixed_fbm_noise3(n[0], n[1], n[2], 4), noiseDepth);
+
+        Fixed angle = fixed_atan2(s[2], s[0]) + spin;
+
+        fixed_hsv2rgb(rgb,
+            hue + fixed_mul(angle, hueShift),
+            saturation,
+            fixed_mul(fixed_sq(fixed_max(0, fixed_sin(angle * 5))), fixed_min(maxValue, sqrlen(s)))
+        );
+    }
 };
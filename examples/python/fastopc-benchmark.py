@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+
+# Measure how fast fastopc can push frames to an OPC server.
+#
+# Sends animated frames as fast as possible for a few seconds each way:
+# uint8 arrays, which go out without any copies, and float arrays, which are
+# clipped and converted first the way most effects' output would be.
+#
+# usage: fastopc-benchmark.py [server] [pixels] [seconds]
+
+import sys
+import time
+import numpy
+import fastopc
+
+server = sys.argv[1] if len(sys.argv) > 1 else None
+pixels = int(sys.argv[2]) if len(sys.argv) > 2 else 10000
+seconds = float(sys.argv[3]) if len(sys.argv) > 3 else 5.0
+
+# Stay under the 64 kB OPC message limit by splitting into 512-pixel channels,
+# like a Fadecandy layout would.
+CHANNEL_PIXELS = 512
+
+client = fastopc.FastOPC(server)
+if not client.connect():
+    print("Can't connect to %s" % client.server)
+    sys.exit(1)
+
+ramp = numpy.arange(pixels * 3, dtype=numpy.float32).reshape(pixels, 3)
+
+
+def run(name, makeFrame):
+    frames = 0
+    start = time.time()
+    while time.time() - start < seconds:
+        frame = makeFrame(frames)
+        for first in range(0, pixels, CHANNEL_PIXELS):
+            client.putPixels(1 + first // CHANNEL_PIXELS, frame[first:first + CHANNEL_PIXELS])
+        frames += 1
+
+    elapsed = time.time() - start
+    print("%-8s %8.1f frames/sec  %8.2f MB/sec" % (
+        name, frames / elapsed, frames * pixels * 3 / elapsed / 1e6))
+
+
+ramp8 = (numpy.arange(pixels * 3) % 256).astype(numpy.uint8).reshape(pixels, 3)
+frame8 = numpy.empty_like(ramp8)
+
+def uint8Frame(n):
+    numpy.add(ramp8, n % 256, out=frame8)
+    return frame8
+
+def floatFrame(n):
+    return (ramp + n) % 256
+
+print("%d pixels to %s" % (pixels, client.server))
+run('uint8', uint8Frame)
+run('float', floatFrame)
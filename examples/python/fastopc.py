@@ -27,44 +27,109 @@ import socket
 import struct
 import time
 
+try:
+    _bufferTypes = (bytes, bytearray, memoryview, buffer)
+except NameError:
+    _bufferTypes = (bytes, bytearray, memoryview)
+
 
 class FastOPC(object):
     """High-performance Open Pixel Control client, using Numeric Python.
        By default, assumes the OPC server is running on localhost. This may be overridden
        with the OPC_SERVER environment variable, or the 'server' keyword argument.
+       A server that starts with '/' is a Unix domain socket path, as from fcserver's
+       "opcListen" option.
+
+       Frames are sent without joining them into one string first. NumPy arrays of
+       8-bit pixels go straight from the array's memory into a single sendmsg() call,
+       after a header that's reused for every frame.
        """
 
     def __init__(self, server=None):
         self.server = server or os.getenv('OPC_SERVER') or '127.0.0.1:7890'
-        self.host, port = self.server.split(':')
-        self.port = int(port)
+        if self.server.startswith('/'):
+            self.family = socket.AF_UNIX
+            self.address = self.server
+        else:
+            self.family = socket.AF_INET
+            self.host, port = self.server.split(':')
+            self.port = int(port)
+            self.address = (self.host, self.port)
         self.socket = None
+        self.header = bytearray(4)
+
+    def connect(self):
+        """Connect to the OPC server if we aren't already. Returns True on success."""
+
+        if self.socket is None:
+            try:
+                self.socket = socket.socket(self.family, socket.SOCK_STREAM)
+                self.socket.connect(self.address)
+                if self.family == socket.AF_INET:
+                    self.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, True)
+            except socket.error:
+                self.socket = None
+
+        if self.socket is None:
+            # Limit CPU usage when polling for a server
+            time.sleep(0.1)
+            return False
 
+        return True
 
     def send(self, packet):
         """Send a low-level packet to the OPC server, connecting if necessary
            and handling disconnects. Returns True on success.
            """
 
-        if self.socket is None:
-            try:
-                self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-                self.socket.connect((self.host, self.port))
-                self.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, True)
-            except socket.error:
-                self.socket = None
+        return self.sendParts([packet], len(packet))
 
-        if self.socket is not None:        
-            try:
-                self.socket.send(packet)
-                return True
-            except socket.error:
-                self.socket = None
+    def sendParts(self, parts, length):
+        """Send a packet made of several buffers, 'length' bytes in all, with one
+           system call where the platform has sendmsg(). Returns True on success.
+           """
 
-        # Limit CPU usage when polling for a server
-        time.sleep(0.1)
+        if not self.connect():
+            return False
+
+        try:
+            sent = 0
+            if hasattr(self.socket, 'sendmsg'):
+                sent = self.socket.sendmsg(parts)
+            if sent < length:
+                # No sendmsg(), or it was interrupted. Send whatever is left the slow way.
+                self.socket.sendall(b''.join(memoryview(p).tobytes() for p in parts)[sent:])
+            return True
+        except socket.error:
+            self.socket = None
+            return False
+
+    def pixelBuffer(self, source):
+        """Turn one pixel source for putPixels() into a (buffer, length) pair,
+           without copying it if it's already contiguous 8-bit data.
+           """
 
-        return False
+        if isinstance(source, _bufferTypes):
+            if not isinstance(source, (bytes, bytearray, memoryview)):
+                source = bytes(source)
+            view = memoryview(source)
+            if view.itemsize != 1:
+                raise ValueError("Pixel buffers must hold 8-bit values, not %d-byte items" % view.itemsize)
+            if view.ndim != 1 or not getattr(view, 'contiguous', True):
+                # len() of an (N, 3) view is only N, so send a flat view of the bytes
+                if getattr(view, 'contiguous', False):
+                    view = view.cast('B')
+                else:
+                    view = memoryview(view.tobytes())
+            return view, getattr(view, 'nbytes', len(view))
+
+        if not isinstance(source, numpy.ndarray):
+            source = numpy.array(source)
+        if source.dtype != numpy.uint8:
+            numpy.clip(source, 0, 255, source)
+            source = source.astype(numpy.uint8)
+        source = numpy.ascontiguousarray(source)
+        return memoryview(source), source.nbytes
 
     def putPixels(self, channel, *sources):
         """Send a list of 8-bit colors to the indicated channel. (OPC command 0x00).
@@ -73,29 +138,23 @@ class FastOPC(object):
 
             - Strings or buffer objects containing pre-formatted 8-bit RGB pixel data
             - NumPy arrays or sequences containing 8-bit RGB pixel data.
-              If values are out of range, the array is modified.
+              Arrays of uint8 are sent as they are. Other arrays are clipped to
+              the 8-bit range; if values are out of range, the array is modified.
            """
 
-        parts = []
-        bytes = 0
+        parts = [self.header]
+        length = 0
 
         for source in sources:
-            if isinstance(source, buffer):
-                source = str(source)
-            elif not isinstance(source, str):
-                if not isinstance(source, numpy.ndarray):
-                    source = numpy.array(source)
-                numpy.clip(source, 0, 255, source)
-                source = source.astype('B').tostring()
-
-            bytes += len(source)
-            parts.append(source)
+            view, size = self.pixelBuffer(source)
+            length += size
+            parts.append(view)
 
-        parts.insert(0, struct.pack('>BBH', channel, 0, bytes))
-        self.send(''.join(parts))
+        struct.pack_into('>BBH', self.header, 0, channel, 0, length)
+        return self.sendParts(parts, len(self.header) + length)
 
     def sysEx(self, systemId, commandId, msg):
         self.send(struct.pack(">BBHHH", 0, 0xFF, len(msg) + 4, systemId, commandId) + msg)
 
     def setGlobalColorCorrection(self, gamma, r, g, b):
-        self.sysEx(1, 1, json.dumps({'gamma': gamma, 'whitepoint':[r,g,b]}))
+        self.sysEx(1, 1, json.dumps({'gamma': gamma, 'whitepoint':[r,g,b]}).encode('utf-8'))
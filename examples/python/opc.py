@@ -44,6 +44,8 @@ class Client(object):
 
         server_ip_port should be an ip:port or hostname:port as a single string.
         For example: '127.0.0.1:7890' or 'localhost:7890'
+        An absolute path like '/run/fcserver.sock' connects to a Unix domain
+        socket instead, such as fcserver's "opcListen" socket.
 
         There are two connection modes:
         * In long connection mode, we try to maintain a single long-lived
@@ -65,8 +67,14 @@ class Client(object):
 
         self._long_connection = long_connection
 
-        self._ip, self._port = server_ip_port.split(':')
-        self._port = int(self._port)
+        if server_ip_port.startswith('/'):
+            self._family = socket.AF_UNIX
+            self._address = server_ip_port
+        else:
+            self._family = socket.AF_INET
+            self._ip, self._port = server_ip_port.split(':')
+            self._port = int(self._port)
+            self._address = (self._ip, self._port)
 
         self._socket = None  # will be None when we're not connected
 
@@ -86,8 +94,8 @@ class Client(object):
 
         try:
             self._debug('_ensure_connected: trying to connect...')
-            self._socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-            self._socket.connect((self._ip, self._port))
+            self._socket = socket.socket(self._family, socket.SOCK_STREAM)
+            self._socket.connect(self._address)
             self._debug('_ensure_connected:    ...success')
             return True
         except socket.error:
@@ -29,6 +29,8 @@
 
 
 uint16_t OctoWS2811z::stripLen;
+uint8_t OctoWS2811z::bytesPerLed;
+uint16_t OctoWS2811z::activeLen;
 void * OctoWS2811z::frameBuffer;
 void * OctoWS2811z::drawBuffer;
 uint8_t OctoWS2811z::params;
@@ -42,8 +44,10 @@ static uint32_t update_completed_at = 0;
 OctoWS2811z::OctoWS2811z(uint32_t numPerStrip, void *buffer, uint8_t config)
 {
     stripLen = numPerStrip;
+    activeLen = numPerStrip;
+    bytesPerLed = (config & WS2811_32BIT) ? 32 : 24;
     frameBuffer = buffer;
-    drawBuffer = (24 * numPerStrip) + (uint8_t*) buffer;
+    drawBuffer = (config & WS2811_SINGLE_BUFFER) ? buffer : (bytesPerLed * numPerStrip) + (uint8_t*) buffer;
     params = config;
 }
 
@@ -70,7 +74,7 @@ void OctoWS2811z::begin(void)
 {
     uint32_t bufsize, frequency;
 
-    bufsize = stripLen*24;
+    bufsize = stripLen * bytesPerLed;
 
     // Clear both front and back buffers
     for (unsigned i = 0; i < bufsize; i++) {
@@ -181,14 +185,46 @@ int OctoWS2811z::busy(void)
     return 0;
 }
 
+uint32_t OctoWS2811z::pixelsSent(void)
+{
+    /*
+     * Channel 2's major loop count is the number of bytes it has left to send. When
+     * it finishes, the count reloads to the full frame before our interrupt clears
+     * update_in_progress, so for that moment this says nothing was sent. That's only
+     * ever too early, never too late.
+     */
+    if (!update_in_progress) return stripLen;
+    uint32_t bufsize = activeLen * bytesPerLed;
+    return (bufsize - DMA_TCD2_CITER_ELINKNO) / bytesPerLed;
+}
+
 void OctoWS2811z::show(void)
+{
+    show(activeLen);
+}
+
+void OctoWS2811z::show(uint32_t numPerStrip)
 {
     uint32_t cv, sc;
 
     // wait for any prior DMA operation
     while (update_in_progress) ; 
 
-    // Swap buffer pointers without copying
+    // Shorter strips take proportionally less time. The DMA channels are idle now.
+    numPerStrip = std::min<uint32_t>(numPerStrip, stripLen);
+    if (numPerStrip != activeLen) {
+        uint32_t bufsize = numPerStrip * bytesPerLed;
+        activeLen = numPerStrip;
+        DMA_TCD1_CITER_ELINKNO = bufsize;
+        DMA_TCD1_BITER_ELINKNO = bufsize;
+        DMA_TCD2_SLAST = -bufsize;
+        DMA_TCD2_CITER_ELINKNO = bufsize;
+        DMA_TCD2_BITER_ELINKNO = bufsize;
+        DMA_TCD3_CITER_ELINKNO = bufsize;
+        DMA_TCD3_BITER_ELINKNO = bufsize;
+    }
+
+    // Swap buffer pointers without copying. With a single buffer, they're the same.
     std::swap(frameBuffer, drawBuffer);
     DMA_TCD2_SADDR = frameBuffer;
 
@@ -28,11 +28,13 @@
 
 #define WS2811_800kHz 0x00  // Nearly all WS2811 are 800 kHz
 #define WS2811_400kHz 0x10  // Adafruit's Flora Pixels
+#define WS2811_32BIT  0x20  // Four color channels per LED, as on SK6812 RGBW
+#define WS2811_SINGLE_BUFFER 0x40  // Draw into the buffer being sent, behind the DMA
 
 
 class OctoWS2811z {
 public:
-    // Buffers: 48 bytes * numPerStrip
+    // Buffers: 48 bytes * numPerStrip, or 64 with WS2811_32BIT. Half that with WS2811_SINGLE_BUFFER.
     OctoWS2811z(uint32_t numPerStrip, void *buffer, uint8_t config = 0);
     void begin(void);
 
@@ -41,10 +43,19 @@ public:
     }
 
     void show(void);
+
+    // The same, sending only the first numPerStrip pixels of each strip
+    void show(uint32_t numPerStrip);
     int busy(void);
 
+    // Pixels per strip the DMA is done reading, all of them when it's idle. With a
+    // single buffer, draw pixel 'i' only once this is more than 'i'.
+    uint32_t pixelsSent(void);
+
 private:
     static uint16_t stripLen;
+    static uint8_t bytesPerLed;
+    static uint16_t activeLen;
     static void *frameBuffer;
     static void *drawBuffer;
     static uint8_t params;
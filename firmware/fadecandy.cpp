@@ -33,9 +33,12 @@
 static fcBuffers buffers;
 fcLinearLUT fcBuffers::lutCurrent;
 
-// Double-buffered DMA memory for raw bit planes of output
-static DMAMEM int ledBuffer[LEDS_PER_STRIP * 12];
-static OctoWS2811z leds(LEDS_PER_STRIP, ledBuffer, WS2811_800kHz);
+// Double-buffered DMA memory for raw bit planes of output, one bit per strip per color bit.
+// Single-buffered with FC_SINGLE_BUFFER, which draws behind the DMA instead.
+static DMAMEM int ledBuffer[LEDS_PER_STRIP * CHANNELS_PER_LED * (FC_SINGLE_BUFFER ? 2 : 4)];
+static OctoWS2811z leds(LEDS_PER_STRIP, ledBuffer,
+    (FC_400KHZ ? WS2811_400kHz : WS2811_800kHz) | (FC_RGBW ? WS2811_32BIT : 0) |
+    (FC_SINGLE_BUFFER ? WS2811_SINGLE_BUFFER : 0));
 
 /*
  * Residuals for temporal dithering. Usually 8 bits is enough, but
@@ -51,45 +54,81 @@ extern uint32_t boot_token;
 /*
  * Low-level drawing code, which we want to compile in the same unit as the main loop.
  * We compile this multiple times, with different config flags.
+ *
+ * The "settled" variants are for when keyframe interpolation has reached fbNext.
+ * They skip the per-channel blend, but unlike the I0 variants they still interpolate
+ * the LUT, so their output is identical to I1 at a coefficient of 0x10000.
  */
 
 #define FCP_INTERPOLATION   0
+#define FCP_SETTLED         0
 #define FCP_DITHERING       0
 #define FCP_FN(name)        name##_I0_D0
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
+#undef FCP_SETTLED
 #undef FCP_DITHERING
 #undef FCP_FN
 
 #define FCP_INTERPOLATION   1
+#define FCP_SETTLED         0
 #define FCP_DITHERING       0
 #define FCP_FN(name)        name##_I1_D0
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
+#undef FCP_SETTLED
 #undef FCP_DITHERING
 #undef FCP_FN
 
 #define FCP_INTERPOLATION   0
+#define FCP_SETTLED         0
 #define FCP_DITHERING       1
 #define FCP_FN(name)        name##_I0_D1
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
+#undef FCP_SETTLED
 #undef FCP_DITHERING
 #undef FCP_FN
 
 #define FCP_INTERPOLATION   1
+#define FCP_SETTLED         0
 #define FCP_DITHERING       1
 #define FCP_FN(name)        name##_I1_D1
 #include "fc_pixel_lut.cpp"
 #include "fc_pixel.cpp"
 #include "fc_draw.cpp"
 #undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   1
+#define FCP_SETTLED         1
+#define FCP_DITHERING       0
+#define FCP_FN(name)        name##_IS_D0
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   1
+#define FCP_SETTLED         1
+#define FCP_DITHERING       1
+#define FCP_FN(name)        name##_IS_D1
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
 #undef FCP_DITHERING
 #undef FCP_FN
 
@@ -107,16 +146,38 @@ static inline uint32_t calculateInterpCoefficient()
      * fbNext's timestamp indicates when both fbPrev and fbNext entered their current
      * position in the keyframe queue. The difference between fbPrev and fbNext indicate
      * how long the interpolation between those keyframes should take.
+     *
+     * If the host told us fbNext's duration, we use that instead. It follows the
+     * frames' original timing, without any jitter they picked up on the way here.
+     *
+     * Timestamps are in microseconds, so that each step is still small at high keyframe
+     * rates. micros() wraps after about 71 minutes, so once we reach fbNext we stay
+     * there until the next keyframe, rather than trusting the timestamps again.
      */
 
-    uint32_t now = millis();
+    static uint32_t settledKeyframe = ~0;
+    if (settledKeyframe == perf_receivedKeyframeCounter) {
+        return 0x10000;
+    }
+
+    uint32_t now = micros();
     uint32_t tsPrev = buffers.fbPrev->timestamp;
     uint32_t tsNext = buffers.fbNext->timestamp;
-    uint32_t tsDiff = tsNext - tsPrev;
+    uint32_t tsDiff = buffers.fbNext->duration ? buffers.fbNext->duration * 1000 : tsNext - tsPrev;
     uint32_t tsElapsed = now - tsNext;
 
-    // Careful to avoid overflows if the frames stop coming...
-    return (std::min<uint32_t>(tsElapsed, tsDiff) << 16) / tsDiff;
+    if (tsElapsed >= tsDiff) {
+        settledKeyframe = perf_receivedKeyframeCounter;
+        return 0x10000;
+    }
+
+    // Scale both down until the shift below can't overflow
+    if (tsDiff > 0xFFFF) {
+        unsigned shift = 16 - __builtin_clz(tsDiff);
+        tsDiff >>= shift;
+        tsElapsed >>= shift;
+    }
+    return (tsElapsed << 16) / tsDiff;
 }
 
 static void dfu_reboot()
@@ -139,7 +200,10 @@ static void dfu_reboot()
 extern "C" int usb_rx_handler(usb_packet_t *packet)
 {
     // USB packet interrupt handler. Invoked by the ISR dispatch code in usb_dev.c
-    return buffers.handleUSB(packet);
+    uint32_t start = ARM_DWT_CYCCNT;
+    int result = buffers.handleUSB(packet);
+    perf_usbCycles += ARM_DWT_CYCCNT - start;
+    return result;
 }
 
 extern "C" int main()
@@ -147,6 +211,10 @@ extern "C" int main()
     pinMode(LED_BUILTIN, OUTPUT);
     leds.begin();
 
+    // Cycle counter, for the CPU profile
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
     // Announce firmware version
     serial_begin(BAUD2DIV(115200));
     serial_print("Fadecandy v" DEVICE_VER_STRING "\r\n");
@@ -154,30 +222,61 @@ extern "C" int main()
     // Application main loop
     while (usb_dfu_state == DFU_appIDLE) {
         watchdog_refresh();
+        uint32_t drawStart = ARM_DWT_CYCCNT;
+        uint32_t interpCoefficient;
+
+        // Strips may be shorter than LEDS_PER_STRIP. Draw and send only what's there.
+        unsigned stripLength = buffers.stripLength;
 
         // Select a different drawing loop based on our firmware config flags
         switch (buffers.flags & (CFLAG_NO_INTERPOLATION | CFLAG_NO_DITHERING)) {
             case 0:
             default:
-                updateDrawBuffer_I1_D1(calculateInterpCoefficient());
+                interpCoefficient = calculateInterpCoefficient();
+                if (interpCoefficient == 0x10000) {
+                    updateDrawBuffer_IS_D1(interpCoefficient, stripLength);
+                } else {
+                    updateDrawBuffer_I1_D1(interpCoefficient, stripLength);
+                }
                 break;
             case CFLAG_NO_INTERPOLATION:
-                updateDrawBuffer_I0_D1(0x10000);
+                updateDrawBuffer_I0_D1(0x10000, stripLength);
                 break;
             case CFLAG_NO_DITHERING:
-                updateDrawBuffer_I1_D0(calculateInterpCoefficient());
+                interpCoefficient = calculateInterpCoefficient();
+                if (interpCoefficient == 0x10000) {
+                    updateDrawBuffer_IS_D0(interpCoefficient, stripLength);
+                } else {
+                    updateDrawBuffer_I1_D0(interpCoefficient, stripLength);
+                }
                 break;
             case CFLAG_NO_INTERPOLATION | CFLAG_NO_DITHERING:
-                updateDrawBuffer_I0_D0(0x10000);
+                updateDrawBuffer_I0_D0(0x10000, stripLength);
                 break;
         }
 
-        // Start sending the next frame over DMA
-        leds.show();
+        uint32_t drawEnd = ARM_DWT_CYCCNT;
 
-        // We can switch to the next frame's buffer now.
+        /*
+         * We're done with this frame's keyframes, so we can switch to the next frame's
+         * buffers now. Drawing already overlaps the previous frame's DMA, since the LED
+         * buffer is double-buffered, or since drawing follows right behind the DMA with
+         * FC_SINGLE_BUFFER. Doing the rest of the frame's bookkeeping before leds.show()
+         * overlaps that too, leaving only the buffer swap after the wait.
+         *
+         * With FC_SINGLE_BUFFER, drawing time includes waiting on the DMA.
+         */
         buffers.finalizeFrame();
 
+        // Start sending the next frame over DMA. This waits for the previous frame first.
+        uint32_t showStart = ARM_DWT_CYCCNT;
+        leds.show(stripLength);
+        uint32_t showEnd = ARM_DWT_CYCCNT;
+
+        // Drawing time includes any interrupts taken meanwhile, USB included
+        perf_drawCycles += drawEnd - drawStart;
+        perf_showCycles += showEnd - showStart;
+
         // Performance counter, for monitoring frame rate externally
         perf_frameCounter++;
     }
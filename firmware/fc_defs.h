@@ -27,9 +27,65 @@
 
 #pragma once
 
+/*
+ * LED output format, chosen at build time so RGB strips don't pay for the others.
+ *
+ * "make FC_RGBW=1" drives 32-bit RGBW LEDs such as the SK6812 RGBW. Pixels still arrive
+ * over USB as RGB. After the color LUT, in linear intensity, the white LED takes the
+ * part that all three colors share. Dithering then covers all four channels.
+ *
+ * "make FC_400KHZ=1" clocks the LEDs at 400 kHz, for older WS2811 pixels.
+ */
+#ifndef FC_RGBW
+#define FC_RGBW                 0
+#endif
+
+#ifndef FC_400KHZ
+#define FC_400KHZ               0
+#endif
+
+#define CHANNELS_PER_LED        (FC_RGBW ? 4 : 3)
+
+/*
+ * "make FC_SINGLE_BUFFER=1" keeps one DMA buffer of bit planes instead of two. Each
+ * pixel of the next frame is drawn into it as soon as the DMA has sent that pixel of
+ * this one, pacing off the DMA's remaining byte count. Frames still overlap drawing
+ * with output, but drawing can't run ahead of the LEDs. The other buffer's RAM goes
+ * to more USB packet buffers; see NUM_USB_BUFFERS.
+ */
+#ifndef FC_SINGLE_BUFFER
+#define FC_SINGLE_BUFFER        0
+#endif
+
+/*
+ * Strip length is a build option: "make LEDS_PER_STRIP=128". Buffers are sized to
+ * match, so the default of 64 is as long as fits in the MK20DX128's 16 kB of RAM.
+ * RGBW output needs larger draw and dithering buffers, so it defaults to 48.
+ * Longer strips need a part with more RAM, and a linker script to match.
+ */
+#ifndef LEDS_PER_STRIP
+#if FC_RGBW
+#define LEDS_PER_STRIP          48
+#else
 #define LEDS_PER_STRIP          64
+#endif
+#endif
+
 #define LEDS_TOTAL              (LEDS_PER_STRIP * 8)
-#define CHANNELS_TOTAL          (LEDS_TOTAL * 3)
+#define CHANNELS_TOTAL          (LEDS_TOTAL * CHANNELS_PER_LED)
+
+/*
+ * Bit remapping kernel for the OctoWS2811 draw buffer: 0 for per-bit BFI, 1 for an
+ * 8x8 block transpose. Benchmark with "make FC_BLOCK_TRANSPOSE=1". RGBW output only
+ * has the block transpose.
+ */
+#ifndef FC_BLOCK_TRANSPOSE
+#define FC_BLOCK_TRANSPOSE      FC_RGBW
+#endif
+
+#if FC_RGBW && !FC_BLOCK_TRANSPOSE
+#error FC_RGBW needs FC_BLOCK_TRANSPOSE
+#endif
 
 #define LUT_CH_SIZE             257
 #define LUT_TOTAL_SIZE          (LUT_CH_SIZE * 3)
@@ -37,10 +93,70 @@
 // USB packet layout
 #define PIXELS_PER_PACKET       21
 #define LUTENTRIES_PER_PACKET   31
-#define PACKETS_PER_FRAME       25
-#define PACKETS_PER_LUT         25
+#define PACKETS_PER_FRAME       ((LEDS_TOTAL + PIXELS_PER_PACKET - 1) / PIXELS_PER_PACKET)
+#define PACKETS_PER_LUT         25      // At most 32, for fcBuffers::receivedLUTPackets
+
+// Framebuffer packets past 31 use a second packet type, for up to 64 packets per frame
+#define MAX_PACKETS_PER_FRAME   64
+
+#if PACKETS_PER_FRAME > MAX_PACKETS_PER_FRAME
+#error LEDS_PER_STRIP is too long for the USB protocol
+#endif
+
+// Feature flags, reported with the LED capacity
+#define FEATURE_PARTIAL_FRAMES  (1 << 0)    // Packets left out of a frame carry forward
+#define FEATURE_HOST_TIMING     (1 << 1)    // Frames may carry their duration, see below
+#define FEATURE_RLE_FRAMES      (1 << 2)    // Frames may be sent run-length encoded
+#define FEATURE_RGBW            (1 << 3)    // LEDs have a white channel, derived from RGB
+#define FEATURE_SCHEDULED_FRAMES (1 << 4)   // Queued frames may carry a time to show them
+
+/*
+ * With FEATURE_HOST_TIMING, the host may put a frame duration in milliseconds in the
+ * last two bytes of the frame's last packet, little-endian. It's how long to interpolate
+ * from the previous frame, with zero meaning we time it ourselves. That needs the last
+ * packet to have spare room, which it doesn't if the pixels fill it exactly.
+ */
+#define PIXELS_IN_LAST_PACKET   (LEDS_TOTAL - (PACKETS_PER_FRAME - 1) * PIXELS_PER_PACKET)
+#define HAS_HOST_TIMING         (PIXELS_IN_LAST_PACKET < PIXELS_PER_PACKET)
+
+#define FEATURES                (FEATURE_PARTIAL_FRAMES | FEATURE_RLE_FRAMES | \
+                                 (HAS_HOST_TIMING ? FEATURE_HOST_TIMING : 0) | \
+                                 (FC_RGBW ? FEATURE_RGBW : 0) | \
+                                 (HAS_SCHEDULED_FRAMES ? FEATURE_SCHEDULED_FRAMES : 0))
+
+/*
+ * Keyframe buffers: fbPrev and fbNext for interpolation, and fbNew receiving. A fourth
+ * lets us accept one complete frame ahead instead of deferring USB packets until the
+ * main loop catches up, and each one past that queues another. They cost a frame of USB
+ * buffers each, which only fits on the MK20DX128 with a shorter LEDS_PER_STRIP or the
+ * RAM from FC_SINGLE_BUFFER. Build with "make NUM_FRAMEBUFFERS=4", up to 8.
+ */
+#ifndef NUM_FRAMEBUFFERS
+#define NUM_FRAMEBUFFERS        3
+#endif
+
+#if NUM_FRAMEBUFFERS < 3 || NUM_FRAMEBUFFERS > 8
+#error NUM_FRAMEBUFFERS must be from 3 to 8
+#endif
+
+// Complete frames that can wait for the main loop, past fbPrev, fbNext and fbNew
+#define FRAME_QUEUE_SIZE        (NUM_FRAMEBUFFERS - 3)
+
+/*
+ * With a frame queue, FEATURE_SCHEDULED_FRAMES lets the host send frames early and say
+ * when to show each one. The time goes just before the duration, in the four bytes at
+ * offsets 58-61 of the last packet, as microseconds on the host's clock. The host sets
+ * that clock with a config packet; see fcBuffers::handleUSB(). That needs six spare
+ * bytes after the last packet's pixels.
+ */
+#define HAS_SCHEDULED_FRAMES    (FRAME_QUEUE_SIZE > 0 && PIXELS_IN_LAST_PACKET <= PIXELS_PER_PACKET - 2)
+
+// A second draw buffer's worth of 68-byte USB packets, when there's only one
+#define SPARE_USB_BUFFERS       (FC_SINGLE_BUFFER ? LEDS_PER_STRIP * CHANNELS_PER_LED * 8 / 68 : 0)
 
-#define NUM_USB_BUFFERS         104       // Three full frames (3*25), one LUT buffer (25), a little extra (4)
+// Full frames, one LUT buffer, a little extra (4). 104 with the default strip length,
+// or 126 with FC_SINGLE_BUFFER.
+#define NUM_USB_BUFFERS         (PACKETS_PER_FRAME * NUM_FRAMEBUFFERS + PACKETS_PER_LUT + 4 + SPARE_USB_BUFFERS)
 
 #define VENDOR_ID               0x1d50    // OpenMoko
 #define PRODUCT_ID              0x607a    // Assigned to Fadecandy project
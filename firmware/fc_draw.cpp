@@ -22,7 +22,78 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
-static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
+#if FC_BLOCK_TRANSPOSE
+
+ALWAYS_INLINE static inline
+void FCP_FN(transposeBits)(uint32_t x, uint32_t y, uint32_t *out)
+{
+    /*
+     * Transpose an 8x8 bit matrix: one byte of color per strip, strips 0-3 in 'x' and
+     * 4-7 in 'y', least significant byte first. Each output byte holds one bit from
+     * every strip, from the most significant bit down, in two words. The three steps
+     * swap 1x1, 2x2, then 4x4 blocks, and the byte reversal puts the MSB first.
+     */
+
+    uint32_t t;
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA;
+    x ^= t ^ (t << 7);
+    t = (y ^ (y >> 7)) & 0x00AA00AA;
+    y ^= t ^ (t << 7);
+
+    t = (x ^ (x >> 14)) & 0x0000CCCC;
+    x ^= t ^ (t << 14);
+    t = (y ^ (y >> 14)) & 0x0000CCCC;
+    y ^= t ^ (t << 14);
+
+    t = (x ^ (y << 4)) & 0xF0F0F0F0;
+    x ^= t;
+    y ^= t >> 4;
+
+    out[0] = __REV(y);
+    out[1] = __REV(x);
+}
+
+ALWAYS_INLINE static inline
+void FCP_FN(transposeStrips)(uint32_t *out, uint32_t p0, uint32_t p1, uint32_t p2, uint32_t p3,
+    uint32_t p4, uint32_t p5, uint32_t p6, uint32_t p7)
+{
+    /*
+     * Block transpose alternative to the BFI bit remapping in updateDrawBuffer().
+     * First regroup the pixels by color, four strips to a word, then transpose
+     * the bits of each color at once.
+     */
+
+#if FC_RGBW
+    // GRBW pixels have one color per byte, so a byte lane gathers the same color
+    for (int shift = 24; shift >= 0; shift -= 8, out += 2) {
+        uint32_t x = ((p0 >> shift) & 0xFF) | (((p1 >> shift) & 0xFF) << 8) |
+                     (((p2 >> shift) & 0xFF) << 16) | (((p3 >> shift) & 0xFF) << 24);
+        uint32_t y = ((p4 >> shift) & 0xFF) | (((p5 >> shift) & 0xFF) << 8) |
+                     (((p6 >> shift) & 0xFF) << 16) | (((p7 >> shift) & 0xFF) << 24);
+        FCP_FN(transposeBits)(x, y, out);
+    }
+#else
+    // Blue and green bytes interleaved, then red bytes, two strips at a time
+    uint32_t bg01 = (p0 & 0x00FF00FF) | ((p1 & 0x00FF00FF) << 8);
+    uint32_t bg23 = (p2 & 0x00FF00FF) | ((p3 & 0x00FF00FF) << 8);
+    uint32_t bg45 = (p4 & 0x00FF00FF) | ((p5 & 0x00FF00FF) << 8);
+    uint32_t bg67 = (p6 & 0x00FF00FF) | ((p7 & 0x00FF00FF) << 8);
+    uint32_t r01 = ((p0 >> 8) & 0xFF) | (p1 & 0xFF00);
+    uint32_t r23 = ((p2 >> 8) & 0xFF) | (p3 & 0xFF00);
+    uint32_t r45 = ((p4 >> 8) & 0xFF) | (p5 & 0xFF00);
+    uint32_t r67 = ((p6 >> 8) & 0xFF) | (p7 & 0xFF00);
+
+    // Output order is green, red, blue, each most significant bit first
+    FCP_FN(transposeBits)((bg01 >> 16) | (bg23 & 0xFFFF0000), (bg45 >> 16) | (bg67 & 0xFFFF0000), out);
+    FCP_FN(transposeBits)(r01 | (r23 << 16), r45 | (r67 << 16), out + 2);
+    FCP_FN(transposeBits)((bg01 & 0xFFFF) | (bg23 << 16), (bg45 & 0xFFFF) | (bg67 << 16), out + 4);
+#endif
+}
+
+#endif  // FC_BLOCK_TRANSPOSE
+
+static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient, int stripLength)
 {
     /*
      * Update the LED draw buffer. In one step, we do the interpolation,
@@ -32,6 +103,9 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
      * "interpCoefficient" indicates how far between fbPrev and fbNext
      * we are. It is a fixed point value in the range [0x0000, 0x10000],
      * corresponding to 100% fbPrev and 100% fbNext, respectively.
+     *
+     * Only the first "stripLength" pixels of each strip are drawn, and only those
+     * are sent to the LEDs.
      */
 
     // For each pixel, this is a 24-byte stream of bits (6 words)
@@ -58,8 +132,14 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
 
     residual_t *pResidual = residual;
 
-    for (int i = 0; i < LEDS_PER_STRIP; ++i, pResidual += 3) {
+#if FC_SINGLE_BUFFER
+    // How far the DMA has read through the only buffer, sending the last frame
+    unsigned sent = leds.pixelsSent();
+#endif
 
+    for (int i = 0; i < stripLength; ++i, pResidual += CHANNELS_PER_LED) {
+
+#if !FC_BLOCK_TRANSPOSE
         // Six output words
         union {
             uint32_t word;
@@ -70,18 +150,29 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
                          p0d:1, p1d:1, p2d:1, p3d:1, p4d:1, p5d:1, p6d:1, p7d:1;
             };
         } o0, o1, o2, o3, o4, o5;
+#endif
+
+#if FCP_INTERPOLATION && !FCP_SETTLED
+        // Strips with the same pixel in fbPrev and fbNext here, which can skip the blend
+        unsigned stable = buffers.stablePixels[i];
+#else
+        const unsigned stable = 0xFF;
+#endif
 
         /*
          * Remap bits.
          *
          * This generates compact and efficient code using the BFI instruction.
+         * With FC_BLOCK_TRANSPOSE, all eight pixels are remapped together at the end.
          */
 
         uint32_t p0 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 0),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 0),
-            pResidual + LEDS_PER_STRIP * 3 * 0);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 0,
+            stable & (1 << 0));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p0d = p0;
         o5.p0c = p0 >> 1;
         o5.p0b = p0 >> 2;
@@ -106,12 +197,15 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p0c = p0 >> 21;
         o0.p0b = p0 >> 22;
         o0.p0a = p0 >> 23;
+#endif
 
         uint32_t p1 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 1),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 1),
-            pResidual + LEDS_PER_STRIP * 3 * 1);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 1,
+            stable & (1 << 1));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p1d = p1;
         o5.p1c = p1 >> 1;
         o5.p1b = p1 >> 2;
@@ -136,12 +230,15 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p1c = p1 >> 21;
         o0.p1b = p1 >> 22;
         o0.p1a = p1 >> 23;
+#endif
 
         uint32_t p2 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 2),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 2),
-            pResidual + LEDS_PER_STRIP * 3 * 2);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 2,
+            stable & (1 << 2));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p2d = p2;
         o5.p2c = p2 >> 1;
         o5.p2b = p2 >> 2;
@@ -166,12 +263,15 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p2c = p2 >> 21;
         o0.p2b = p2 >> 22;
         o0.p2a = p2 >> 23;
+#endif
 
         uint32_t p3 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 3),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 3),
-            pResidual + LEDS_PER_STRIP * 3 * 3);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 3,
+            stable & (1 << 3));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p3d = p3;
         o5.p3c = p3 >> 1;
         o5.p3b = p3 >> 2;
@@ -196,12 +296,15 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p3c = p3 >> 21;
         o0.p3b = p3 >> 22;
         o0.p3a = p3 >> 23;
+#endif
 
         uint32_t p4 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 4),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 4),
-            pResidual + LEDS_PER_STRIP * 3 * 4);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 4,
+            stable & (1 << 4));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p4d = p4;
         o5.p4c = p4 >> 1;
         o5.p4b = p4 >> 2;
@@ -226,12 +329,15 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p4c = p4 >> 21;
         o0.p4b = p4 >> 22;
         o0.p4a = p4 >> 23;
+#endif
 
         uint32_t p5 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 5),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 5),
-            pResidual + LEDS_PER_STRIP * 3 * 5);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 5,
+            stable & (1 << 5));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p5d = p5;
         o5.p5c = p5 >> 1;
         o5.p5b = p5 >> 2;
@@ -256,12 +362,15 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p5c = p5 >> 21;
         o0.p5b = p5 >> 22;
         o0.p5a = p5 >> 23;
+#endif
 
         uint32_t p6 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 6),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 6),
-            pResidual + LEDS_PER_STRIP * 3 * 6);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 6,
+            stable & (1 << 6));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p6d = p6;
         o5.p6c = p6 >> 1;
         o5.p6b = p6 >> 2;
@@ -286,12 +395,15 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p6c = p6 >> 21;
         o0.p6b = p6 >> 22;
         o0.p6a = p6 >> 23;
+#endif
 
         uint32_t p7 = FCP_FN(updatePixel)(icPrev, icNext,
             buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 7),
             buffers.fbNext->pixel(i + LEDS_PER_STRIP * 7),
-            pResidual + LEDS_PER_STRIP * 3 * 7);
+            pResidual + LEDS_PER_STRIP * CHANNELS_PER_LED * 7,
+            stable & (1 << 7));
 
+#if !FC_BLOCK_TRANSPOSE
         o5.p7d = p7;
         o5.p7c = p7 >> 1;
         o5.p7b = p7 >> 2;
@@ -316,12 +428,25 @@ static void FCP_FN(updateDrawBuffer)(unsigned interpCoefficient)
         o0.p7c = p7 >> 21;
         o0.p7b = p7 >> 22;
         o0.p7a = p7 >> 23;
+#endif
+
+#if FC_SINGLE_BUFFER
+        // This pixel's words are still the last frame's until the DMA has read them
+        while (unsigned(i) >= sent) {
+            sent = leds.pixelsSent();
+        }
+#endif
 
+#if FC_BLOCK_TRANSPOSE
+        FCP_FN(transposeStrips)(out, p0, p1, p2, p3, p4, p5, p6, p7);
+        out += 2 * CHANNELS_PER_LED;
+#else
         *(out++) = o0.word;
         *(out++) = o1.word;
         *(out++) = o2.word;
         *(out++) = o3.word;
         *(out++) = o4.word;
         *(out++) = o5.word;
+#endif
     }
 }
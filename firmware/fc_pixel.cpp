@@ -23,7 +23,7 @@
  */
 
 static uint32_t FCP_FN(updatePixel)(uint32_t icPrev, uint32_t icNext,
-    const uint8_t *pixelPrev, const uint8_t *pixelNext, residual_t *pResidual)
+    const uint8_t *pixelPrev, const uint8_t *pixelNext, residual_t *pResidual, unsigned stable)
 {
     /*
      * Update pipeline for one pixel:
@@ -35,14 +35,24 @@ static uint32_t FCP_FN(updatePixel)(uint32_t icPrev, uint32_t icNext,
      * icPrev in range [0, 0x1010000]
      * icNext in range [0, 0x1010000]
      * icPrev + icNext = 0x1010000
+     *
+     * A nonzero 'stable' means pixelPrev and pixelNext are the same, so the blend
+     * would give exactly pixelNext * 0x101.
      */
 
-#if FCP_INTERPOLATION
-    // Per-channel linear interpolation and conversion to 16-bit color.
-    // Result range: [0, 0xFFFF] 
-    int iR = (pixelPrev[0] * icPrev + pixelNext[0] * icNext) >> 16;
-    int iG = (pixelPrev[1] * icPrev + pixelNext[1] * icNext) >> 16;
-    int iB = (pixelPrev[2] * icPrev + pixelNext[2] * icNext) >> 16;
+#if FCP_INTERPOLATION && !FCP_SETTLED
+    int iR, iG, iB;
+    if (stable) {
+        iR = pixelNext[0] * 0x101;
+        iG = pixelNext[1] * 0x101;
+        iB = pixelNext[2] * 0x101;
+    } else {
+        // Per-channel linear interpolation and conversion to 16-bit color.
+        // Result range: [0, 0xFFFF] 
+        iR = (pixelPrev[0] * icPrev + pixelNext[0] * icNext) >> 16;
+        iG = (pixelPrev[1] * icPrev + pixelNext[1] * icNext) >> 16;
+        iB = (pixelPrev[2] * icPrev + pixelNext[2] * icNext) >> 16;
+    }
 #else
     int iR = pixelNext[0] * 0x101;
     int iG = pixelNext[1] * 0x101;
@@ -55,11 +65,22 @@ static uint32_t FCP_FN(updatePixel)(uint32_t icPrev, uint32_t icNext,
     iG = FCP_FN(lutInterpolate)(buffers.lutCurrent.g, iG);
     iB = FCP_FN(lutInterpolate)(buffers.lutCurrent.b, iB);
 
+#if FC_RGBW
+    // The white LED takes the intensity all three colors share. LUT output is linear.
+    int iW = std::min(iR, std::min(iG, iB));
+    iR -= iW;
+    iG -= iW;
+    iB -= iW;
+#endif
+
 #if FCP_DITHERING
     // Incorporate the residual from last frame
     iR += pResidual[0];
     iG += pResidual[1];
     iB += pResidual[2];
+#if FC_RGBW
+    iW += pResidual[3];
+#endif
 #endif
 
     /*
@@ -76,14 +97,25 @@ static uint32_t FCP_FN(updatePixel)(uint32_t icPrev, uint32_t icNext,
     int r8 = __USAT(iR + 0x80, 16) >> 8;
     int g8 = __USAT(iG + 0x80, 16) >> 8;
     int b8 = __USAT(iB + 0x80, 16) >> 8;
+#if FC_RGBW
+    int w8 = __USAT(iW + 0x80, 16) >> 8;
+#endif
 
 #if FCP_DITHERING
     // Compute the error, after expanding the 8-bit value back to 16-bit.
     pResidual[0] = iR - (r8 * 257);
     pResidual[1] = iG - (g8 * 257);
     pResidual[2] = iB - (b8 * 257);
+#if FC_RGBW
+    pResidual[3] = iW - (w8 * 257);
+#endif
 #endif
 
+#if FC_RGBW
+    // Pack the result, in GRBW order.
+    return (g8 << 24) | (r8 << 16) | (b8 << 8) | w8;
+#else
     // Pack the result, in GRB order.
     return (g8 << 16) | (r8 << 8) | b8;
+#endif
 }
@@ -33,6 +33,24 @@
 #define TYPE_FRAMEBUFFER    0x00
 #define TYPE_LUT            0x40
 #define TYPE_CONFIG         0x80
+#define TYPE_FRAMEBUFFER_HI 0xC0    // Framebuffer packets 32 and up, for long strips
+
+#define INDEX_CONFIG        0       // Config packet indices
+#define INDEX_RLE_FRAME     1       // Run-length encoded framebuffer, see decodeRLE()
+#define INDEX_CLOCK_SYNC    2       // Host clock, for scheduled frames
+
+// Scheduled frames further ahead than this, in microseconds, are shown right away
+#define MAX_SCHEDULE_AHEAD  1000000
+
+// Clock sync limits, in microseconds; see syncClock()
+#define CLOCK_SLEW          200         // Most we slew back per sync
+#define CLOCK_STEP          100000      // Jump straight to a change bigger than this
+
+/*
+ * There's no 16-bit framebuffer type. Three 16-bit keyframes would need another 81
+ * USB packet buffers, and there isn't enough RAM. fcserver takes 16-bit pixels over
+ * OPC and dithers them to 8-bit keyframes itself; see FCDevice::ditherFramebuffer().
+ */
 
 
 void fcBuffers::finalizeFrame()
@@ -50,10 +68,69 @@ void fcBuffers::finalizeFrame()
     }
     handledAnyPacketsThisFrame = false;
 
+#if FRAME_QUEUE_SIZE
+    /*
+     * With a frame queue, the ISR swaps in a fresh fbNew as soon as a frame is complete
+     * and leaves the finished one queued. Only the pointer shuffle needs interrupts off;
+     * the ISR doesn't touch queued frames. Frames move up in order, so a partial frame
+     * carries forward from the one before it. Scheduled frames wait until they're due.
+     */
+    bool newKeyframe = false;
+
+    while (queueReady) {
+        fcFramebuffer *frame = fbQueue[queueHead];
+        uint32_t now = micros();
+        uint32_t timestamp = now;
+        bool scheduled = false;
+
+#if HAS_SCHEDULED_FRAMES
+        scheduled = frameSchedule(frame, timestamp);
+        if (scheduled && int32_t(timestamp - now) > 0) {
+            break;
+        }
+#endif
+
+        finalizeFramebuffer(frame, timestamp);
+
+        __disable_irq();
+        fbQueue[queueHead] = fbPrev;
+        fbPrev = fbNext;
+        fbNext = frame;
+        queueHead = (queueHead + 1) % FRAME_QUEUE_SIZE;
+        queueReady--;
+        if (pendingFinalizeFrame) {
+            // The frame after that is complete too, and now there's room for it
+            queueFrame();
+            pendingFinalizeFrame = false;
+        }
+        __enable_irq();
+
+        perf_receivedKeyframeCounter++;
+        newKeyframe = true;
+
+        // Late scheduled frames catch up all at once, others move up one per frame drawn
+        if (!scheduled) {
+            break;
+        }
+    }
+
+    if (newKeyframe) {
+        updateStablePixels();
+    }
+#else
     if (pendingFinalizeFrame) {
-        finalizeFramebuffer();
+        finalizeFramebuffer(fbNew, micros());
+
+        fcFramebuffer *recycle = fbPrev;
+        fbPrev = fbNext;
+        fbNext = fbNew;
+        fbNew = recycle;
         pendingFinalizeFrame = false;
+
+        perf_receivedKeyframeCounter++;
+        updateStablePixels();
     }
+#endif
 
     if (pendingFinalizeLUT) {
         finalizeLUT();
@@ -82,15 +159,32 @@ bool fcBuffers::handleUSB(usb_packet_t *packet)
                 return false;
             }
 
+            checkPacketOrder(index);
             fbNew->store(index, packet);
+            fbNew->markReceived(index);
             if (final) {
-                pendingFinalizeFrame = true;
+                frameComplete();
+            }
+            break;
+
+        case TYPE_FRAMEBUFFER_HI:
+            // The same, for the second half of a long framebuffer
+            if (pendingFinalizeFrame) {
+                return false;
+            }
+
+            checkPacketOrder(index + (INDEX_BITS + 1));
+            fbNew->store(index + (INDEX_BITS + 1), packet);
+            fbNew->markReceived(index + (INDEX_BITS + 1));
+            if (final) {
+                frameComplete();
             }
             break;
 
         case TYPE_LUT:
             // LUT accesses are not synchronized
             lutNew.store(index, packet);
+            receivedLUTPackets |= 1 << index;
 
             if (final) {
                 // Finalize the LUT on the main thread, it's less async than doing it in the ISR.
@@ -98,11 +192,76 @@ bool fcBuffers::handleUSB(usb_packet_t *packet)
             }
             break;
 
-        case TYPE_CONFIG:
+        case TYPE_CONFIG: {
+            if (index == INDEX_RLE_FRAME) {
+                // Synchronized like any other framebuffer packet
+                if (pendingFinalizeFrame) {
+                    return false;
+                }
+
+                // Each packet has a sequence number, so a torn stream can't go unnoticed
+                unsigned sequence = packet->buf[1];
+                if (sequence == 0) {
+                    if (rleSequence || nextPacket) {
+                        discardFrame();
+                    }
+                    rleSkip = false;
+                } else if (sequence != rleSequence && !rleSkip) {
+                    discardFrame();
+                    rleSkip = true;
+                }
+                rleSequence = sequence + 1;
+
+                if (!rleSkip && packet->len > 2) {
+                    decodeRLE(packet->buf + 2, packet->len - 2);
+                }
+                usb_free(packet);
+
+                if (final) {
+                    if (rleSkip) {
+                        // Nothing worth showing. Start over with the next frame.
+                        rleSkip = false;
+                        rleSequence = 0;
+                        nextPacket = 0;
+                    } else {
+                        frameComplete();
+                    }
+                }
+                break;
+            }
+
+            if (index == INDEX_CLOCK_SYNC) {
+                // The host's clock, in microseconds, for the times on scheduled frames
+#if HAS_SCHEDULED_FRAMES
+                syncClock(packet->buf[1] | (packet->buf[2] << 8) |
+                    (packet->buf[3] << 16) | (uint32_t(packet->buf[4]) << 24));
+#endif
+                usb_free(packet);
+                break;
+            }
+
             // Config changes take effect immediately.
             flags = packet->buf[1];
+
+            // A new brightness re-linearizes the whole LUT, on the main thread
+            uint32_t b = 0x10000;
+            if (flags & CFLAG_BRIGHTNESS) {
+                b = packet->buf[2] | (packet->buf[3] << 8);
+                b += b >> 15;
+            }
+            if (b != brightness) {
+                brightness = b;
+                receivedLUTPackets = ~0;
+                pendingFinalizeLUT = true;
+            }
+
+            // Strip length, zero for all of LEDS_PER_STRIP. Applies from the next frame drawn.
+            uint32_t length = packet->buf[4] | (packet->buf[5] << 8);
+            stripLength = length && length < LEDS_PER_STRIP ? length : LEDS_PER_STRIP;
+
             usb_free(packet);
             break;
+        }
 
         default:
             usb_free(packet);
@@ -114,14 +273,225 @@ bool fcBuffers::handleUSB(usb_packet_t *packet)
     return true;
 }
 
-void fcBuffers::finalizeFramebuffer()
+void fcBuffers::frameComplete()
+{
+    // Interrupt context. fbNew has its final packet.
+
+    rlePosition = 0;
+    nextPacket = 0;
+    rleSequence = 0;
+    rleSkip = false;
+
+#if FRAME_QUEUE_SIZE
+    if (queueReady < FRAME_QUEUE_SIZE) {
+        // Keep receiving into a spare while the main loop picks this one up
+        queueFrame();
+        return;
+    }
+#endif
+
+    // Defer further framebuffer packets until finalizeFrame() frees up a buffer
+    pendingFinalizeFrame = true;
+}
+
+#if FRAME_QUEUE_SIZE
+void fcBuffers::queueFrame()
+{
+    // Interrupts off. Swap the complete fbNew for the first spare buffer in the queue.
+
+    unsigned tail = (queueHead + queueReady) % FRAME_QUEUE_SIZE;
+    fcFramebuffer *spare = fbQueue[tail];
+    fbQueue[tail] = fbNew;
+    fbNew = spare;
+    queueReady++;
+}
+#endif
+
+#if HAS_SCHEDULED_FRAMES
+void fcBuffers::syncClock(uint32_t hostTime)
+{
+    /*
+     * Interrupt context. The host reads its clock as it submits a sync packet, so one held
+     * up behind other transfers makes the host's clock look behind. The biggest offset
+     * seen is the closest, so we step up to any bigger one right away, but only slew
+     * back by CLOCK_SLEW per sync. That's still faster than two crystals drift apart
+     * between syncs. Boards synced from the same host then agree on the time to within
+     * their quickest sync's delay, so scheduled frames start interpolating together.
+     *
+     * A big change either way means the host's clock restarted, so we jump to that.
+     */
+
+    uint32_t offset = hostTime - micros();
+    int32_t error = int32_t(offset - clockOffset);
+
+    if (!clockSynced || error > 0 || error < -CLOCK_STEP) {
+        clockOffset = offset;
+    } else {
+        clockOffset -= std::min<uint32_t>(-error, CLOCK_SLEW);
+    }
+    clockSynced = true;
+}
+
+bool fcBuffers::frameSchedule(fcFramebuffer *frame, uint32_t &time)
+{
+    /*
+     * Main loop context. If this queued frame has a host clock time to be shown at, and
+     * we know the host's clock, convert that to our micros() in 'time'. A frame scheduled
+     * implausibly far past 'time' is treated as unscheduled, so a host that restarted
+     * its clock can't stall the queue.
+     */
+
+    uint32_t hostTime = frame->scheduledTime();
+    if (!hostTime || !clockSynced) {
+        return false;
+    }
+
+    uint32_t t = hostTime - clockOffset;
+    if (int32_t(t - time) > MAX_SCHEDULE_AHEAD) {
+        return false;
+    }
+
+    time = t;
+    return true;
+}
+#endif
+
+void fcBuffers::checkPacketOrder(unsigned position)
+{
+    /*
+     * Interrupt context. With CFLAG_FRAME_CHECK, a frame's packets must arrive in
+     * increasing order. One that doesn't means the rest of the frame was lost, as
+     * when the host cancels a transfer partway, and this packet starts a new frame.
+     */
+
+    if ((flags & CFLAG_FRAME_CHECK) && (position < nextPacket || rleSequence)) {
+        discardFrame();
+    }
+    nextPacket = position + 1;
+}
+
+void fcBuffers::discardFrame()
+{
+    // Interrupt context. Forget what fbNew received, so it carries forward fbNext instead.
+
+    for (unsigned i = 0; i < sizeof fbNew->received / sizeof fbNew->received[0]; ++i) {
+        fbNew->received[i] = 0;
+    }
+    rlePosition = 0;
+    nextPacket = 0;
+    rleSequence = 0;
+    perf_tornFrames++;
+}
+
+void fcBuffers::decodeRLE(const uint8_t *ops, unsigned len)
+{
+    /*
+     * Interrupt context. Run-length encoded pixels, copied into the packets fbNew already
+     * owns. Each op is a header byte, then:
+     *
+     *   0x01 - 0x7F   That many literal pixels
+     *   0x80 - 0xFF   One pixel, repeated (header - 0x7F) times
+     *   0x00          End of this packet
+     *
+     * Ops don't span packets, but the pixel position carries on to the next packet
+     * until the frame's final one. Pixels are numbered by slot, 21 per packet, so the
+     * encoding also covers the unused slots in the last packet and its frame duration.
+     */
+
+    const unsigned numSlots = PACKETS_PER_FRAME * PIXELS_PER_PACKET;
+    const uint8_t *end = ops + len;
+    unsigned pos = rlePosition;
+
+    while (ops < end && *ops) {
+        unsigned header = *ops++;
+        unsigned count = header & 0x80 ? header - 0x7F : header;
+
+        while (count && pos < numSlots && end - ops >= 3) {
+            unsigned p = pos / PIXELS_PER_PACKET;
+            uint8_t *dest = &fbNew->packets[p]->buf[1 + (pos % PIXELS_PER_PACKET) * 3];
+            dest[0] = ops[0];
+            dest[1] = ops[1];
+            dest[2] = ops[2];
+            fbNew->markReceived(p);
+
+            pos++;
+            count--;
+            if (!(header & 0x80)) {
+                ops += 3;
+            }
+        }
+
+        if (header & 0x80) {
+            ops += 3;
+        }
+    }
+
+    rlePosition = pos;
+}
+
+void fcBuffers::finalizeFramebuffer(fcFramebuffer *frame, uint32_t timestamp)
 {
-    fcFramebuffer *recycle = fbPrev;
-    fbNew->timestamp = millis();
-    fbPrev = fbNext;
-    fbNext = fbNew;
-    fbNew = recycle;
-    perf_receivedKeyframeCounter++;
+    /*
+     * A frame may leave out packets that haven't changed (FEATURE_PARTIAL_FRAMES).
+     * 'frame' still holds whatever it had a few frames ago in those, so copy them forward
+     * from fbNext. The copy goes into packets 'frame' already owns, so it doesn't need
+     * any more USB buffers. Full frames have nothing to copy.
+     */
+
+    for (unsigned p = 0; p < PACKETS_PER_FRAME; ++p) {
+        if (!(frame->received[p >> 5] & (1 << (p & 31)))) {
+            uint32_t *dest = (uint32_t*) frame->packets[p]->buf;
+            const uint32_t *src = (const uint32_t*) fbNext->packets[p]->buf;
+            for (unsigned w = 0; w < sizeof frame->packets[p]->buf / 4; ++w) {
+                dest[w] = src[w];
+            }
+        }
+    }
+    for (unsigned i = 0; i < sizeof frame->received / sizeof frame->received[0]; ++i) {
+        frame->received[i] = 0;
+    }
+
+#if HAS_HOST_TIMING
+    const uint8_t *last = frame->packets[PACKETS_PER_FRAME - 1]->buf;
+    frame->duration = last[sizeof frame->packets[0]->buf - 2] | (last[sizeof frame->packets[0]->buf - 1] << 8);
+#else
+    frame->duration = 0;
+#endif
+
+    frame->timestamp = timestamp;
+}
+
+void fcBuffers::updateStablePixels()
+{
+    /*
+     * Compare fbPrev and fbNext a packet at a time. Any packet that hasn't changed since
+     * the previous keyframe marks all of its pixels as stable. Control bytes depend only
+     * on the packet index, so we can compare whole words.
+     */
+
+    for (unsigned i = 0; i < LEDS_PER_STRIP; ++i) {
+        stablePixels[i] = 0;
+    }
+
+    for (unsigned p = 0; p < PACKETS_PER_FRAME; ++p) {
+        const uint32_t *a = (const uint32_t*) fbPrev->packets[p]->buf;
+        const uint32_t *b = (const uint32_t*) fbNext->packets[p]->buf;
+        unsigned w;
+
+        for (w = 0; w < sizeof fbPrev->packets[p]->buf / 4; ++w) {
+            if (a[w] != b[w]) {
+                break;
+            }
+        }
+        if (w < sizeof fbPrev->packets[p]->buf / 4) {
+            continue;
+        }
+
+        unsigned last = std::min<unsigned>((p + 1) * PIXELS_PER_PACKET, LEDS_TOTAL);
+        for (unsigned i = p * PIXELS_PER_PACKET; i < last; ++i) {
+            stablePixels[i % LEDS_PER_STRIP] |= 1 << (i / LEDS_PER_STRIP);
+        }
+    }
 }
 
 void fcBuffers::finalizeLUT()
@@ -129,12 +499,30 @@ void fcBuffers::finalizeLUT()
     /*
      * To keep LUT lookups super-fast, we copy the LUT into a linear array at this point.
      * LUT changes are intended to be infrequent (initialization or configuration-time only),
-     * so this isn't a performance bottleneck.
+     * but a host animating brightness may update it every frame. Only the packets that
+     * arrived since last time are linearized, and the server only sends packets whose
+     * contents changed.
      *
-     * Note the right shift by 1. See lutInterpolate() for an explanation.
+     * This runs between frames, so updating lutCurrent in place can't tear a frame.
+     *
+     * Each entry is scaled by the master brightness, which also does the right shift
+     * by 1 at full brightness. See lutInterpolate() for an explanation of that.
      */
 
-    for (unsigned i = 0; i < LUT_TOTAL_SIZE; ++i) {
-        lutCurrent.entries[i] = lutNew.entry(i) >> 1;
+    __disable_irq();
+    uint32_t received = receivedLUTPackets;
+    uint32_t scale = brightness;
+    receivedLUTPackets = 0;
+    __enable_irq();
+
+    for (unsigned p = 0; p < PACKETS_PER_LUT; ++p) {
+        if (!(received & (1 << p))) {
+            continue;
+        }
+
+        unsigned last = std::min<unsigned>((p + 1) * LUTENTRIES_PER_PACKET, LUT_TOTAL_SIZE);
+        for (unsigned i = p * LUTENTRIES_PER_PACKET; i < last; ++i) {
+            lutCurrent.entries[i] = (lutNew.entry(i) * scale) >> 17;
+        }
     }
 }
@@ -69,10 +69,35 @@ struct fcPacketBuffer
 
 struct fcFramebuffer : public fcPacketBuffer<PACKETS_PER_FRAME>
 {
+    uint32_t duration;      // Host-provided duration in milliseconds, or zero
+
+    // Packets stored since this frame was last finalized, one bit each
+    uint32_t received[(PACKETS_PER_FRAME + 31) / 32];
+
+    void markReceived(unsigned index)
+    {
+        if (index < PACKETS_PER_FRAME) {
+            received[index >> 5] |= 1 << (index & 31);
+        }
+    }
+
     ALWAYS_INLINE const uint8_t* pixel(unsigned index)
     {
         return &packets[index / PIXELS_PER_PACKET]->buf[1 + (index % PIXELS_PER_PACKET) * 3];
     }
+
+#if HAS_SCHEDULED_FRAMES
+    // Host clock time to show this frame, or zero. Only if the frame sent its last packet.
+    uint32_t scheduledTime()
+    {
+        unsigned last = PACKETS_PER_FRAME - 1;
+        if (!(received[last >> 5] & (1 << (last & 31)))) {
+            return 0;
+        }
+        const uint8_t *p = &packets[last]->buf[sizeof packets[last]->buf - 6];
+        return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+    }
+#endif
 };
 
 
@@ -98,6 +123,8 @@ struct fcColorLUT : public fcPacketBuffer<PACKETS_PER_LUT>
 #define CFLAG_NO_INTERPOLATION  (1 << 1)
 #define CFLAG_NO_ACTIVITY_LED   (1 << 2)
 #define CFLAG_LED_CONTROL       (1 << 3)
+#define CFLAG_BRIGHTNESS        (1 << 5)    // Config bytes 2-3 hold a 16-bit brightness
+#define CFLAG_FRAME_CHECK       (1 << 6)    // Discard frames whose packets arrive out of order
 
 /*
  * Data type for current color LUT
@@ -123,18 +150,50 @@ struct fcBuffers
     fcFramebuffer *fbNext;      // Frame we're interpolating to
     fcFramebuffer *fbNew;       // Partial frame, getting ready to become fbNext
 
-    fcFramebuffer fb[3];        // Triple-buffered video frames
+#if FRAME_QUEUE_SIZE
+    /*
+     * A ring of the other buffers, starting at queueHead. First the complete frames
+     * waiting to become fbNext, oldest first, then empty buffers for fbNew once it's
+     * complete. The ISR adds frames and the main loop takes them.
+     */
+    fcFramebuffer *fbQueue[FRAME_QUEUE_SIZE];
+    unsigned queueHead;
+    volatile unsigned queueReady;
+#endif
+
+    fcFramebuffer fb[NUM_FRAMEBUFFERS];     // Triple or quadruple-buffered video frames
 
     fcColorLUT lutNew;                // Partial LUT, not yet finalized
     static fcLinearLUT lutCurrent;    // Active LUT, linearized for efficiency
 
     uint8_t flags;              // Configuration flags
 
+    // Master brightness, from 0 to 0x10000. Applied to the LUT as it's linearized.
+    volatile uint32_t brightness;
+
+    // Pixels actually connected on the longest strip, at most LEDS_PER_STRIP
+    volatile uint32_t stripLength;
+
+    /*
+     * Pixels that are identical in fbPrev and fbNext, so they don't need interpolating.
+     * Indexed by position along the strip, with one bit per strip.
+     */
+    uint8_t stablePixels[LEDS_PER_STRIP];
+
     fcBuffers()
     {
         fbPrev = &fb[0];
         fbNext = &fb[1];
         fbNew = &fb[2];
+#if FRAME_QUEUE_SIZE
+        for (unsigned i = 0; i < FRAME_QUEUE_SIZE; ++i) {
+            fbQueue[i] = &fb[3 + i];
+        }
+        queueHead = 0;
+        queueReady = 0;
+#endif
+        brightness = 0x10000;
+        stripLength = LEDS_PER_STRIP;
     }
 
     // Interrupt context
@@ -144,8 +203,33 @@ struct fcBuffers
     void finalizeFrame();
 
 private:
-    void finalizeFramebuffer();
+    void finalizeFramebuffer(fcFramebuffer *frame, uint32_t timestamp);
+    void frameComplete();
+    void queueFrame();
+    void decodeRLE(const uint8_t *ops, unsigned len);
+    void checkPacketOrder(unsigned position);
+    void discardFrame();
     void finalizeLUT();
+    void updateStablePixels();
+    // LUT packets received since the LUT was last finalized. Set in interrupt context.
+    volatile uint32_t receivedLUTPackets;
+
+    // Next pixel slot in fbNew for run-length encoded packets. Interrupt context only.
+    unsigned rlePosition;
+
+    // How far fbNew's frame has got, for spotting torn frames. Interrupt context only.
+    unsigned nextPacket;        // Lowest framebuffer packet index that's still in order
+    unsigned rleSequence;       // Next run-length encoded packet's sequence number
+    bool rleSkip;               // Ignoring the rest of a broken run-length stream
+
+#if HAS_SCHEDULED_FRAMES
+    // The host's clock minus our micros(), once a clock sync packet has set it
+    volatile uint32_t clockOffset;
+    volatile bool clockSynced;
+
+    void syncClock(uint32_t hostTime);
+    bool frameSchedule(fcFramebuffer *frame, uint32_t &time);
+#endif
 
     // Status communicated between handleUSB() and finalizeFrame()
     bool handledAnyPacketsThisFrame;
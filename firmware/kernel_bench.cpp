@@ -0,0 +1,410 @@
+/*
+ * Fadecandy Firmware: Host benchmark for the draw buffer kernels
+ *
+ * This builds fc_pixel_lut.cpp, fc_pixel.cpp and fc_draw.cpp for the host, the same
+ * way fadecandy.cpp builds them for the device, with stand-ins for the framebuffers,
+ * the LUT and the OctoWS2811z draw buffer. Each variant's output is compared bit for
+ * bit against a plain model of the pipeline before it's timed. Run "make kernel-bench".
+ *
+ * Host timings aren't Cortex-M4 cycles. They're for comparing kernel changes against
+ * each other; benchmark.py on real hardware has the final word.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include "fc_defs.h"
+
+#define ALWAYS_INLINE __attribute__ ((always_inline))
+
+/*
+ * Portable versions of the Cortex-M4 instructions the kernels use
+ */
+
+static inline uint32_t __USAT(int32_t value, unsigned bits)
+{
+    int32_t max = (1 << bits) - 1;
+    return value < 0 ? 0 : value > max ? max : value;
+}
+
+static inline uint32_t __SMUADX(uint32_t x, uint32_t y)
+{
+    return (int16_t)x * (int16_t)(y >> 16) + (int16_t)(x >> 16) * (int16_t)y;
+}
+
+static inline uint32_t __REV(uint32_t x)
+{
+    return __builtin_bswap32(x);
+}
+
+/*
+ * Stand-ins for the firmware's buffers, with the same memory layout where it matters
+ */
+
+struct benchFramebuffer
+{
+    uint8_t packets[PACKETS_PER_FRAME][64];
+
+    ALWAYS_INLINE const uint8_t* pixel(unsigned index)
+    {
+        return &packets[index / PIXELS_PER_PACKET][1 + (index % PIXELS_PER_PACKET) * 3];
+    }
+};
+
+union benchLinearLUT
+{
+    uint16_t entries[LUT_TOTAL_SIZE];
+    struct {
+        uint16_t r[LUT_CH_SIZE];
+        uint16_t g[LUT_CH_SIZE];
+        uint16_t b[LUT_CH_SIZE];
+    };
+};
+
+struct benchBuffers
+{
+    benchFramebuffer *fbPrev;
+    benchFramebuffer *fbNext;
+    benchLinearLUT lutCurrent;
+    uint8_t stablePixels[LEDS_PER_STRIP];
+};
+
+struct benchLeds
+{
+    uint32_t drawBuffer[LEDS_PER_STRIP * CHANNELS_PER_LED * 2];
+
+    void* getDrawBuffer() {
+        return drawBuffer;
+    }
+
+    // Never sending, so every pixel is free to draw
+    uint32_t pixelsSent() {
+        return LEDS_PER_STRIP;
+    }
+};
+
+static benchFramebuffer fbA, fbB;
+static benchBuffers buffers;
+static benchLeds leds;
+
+typedef int16_t residual_t;
+static residual_t residual[CHANNELS_TOTAL];
+
+/*
+ * The kernels, built exactly as fadecandy.cpp builds them
+ */
+
+#define FCP_INTERPOLATION   0
+#define FCP_SETTLED         0
+#define FCP_DITHERING       0
+#define FCP_FN(name)        name##_I0_D0
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   1
+#define FCP_SETTLED         0
+#define FCP_DITHERING       0
+#define FCP_FN(name)        name##_I1_D0
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   0
+#define FCP_SETTLED         0
+#define FCP_DITHERING       1
+#define FCP_FN(name)        name##_I0_D1
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   1
+#define FCP_SETTLED         0
+#define FCP_DITHERING       1
+#define FCP_FN(name)        name##_I1_D1
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   1
+#define FCP_SETTLED         1
+#define FCP_DITHERING       0
+#define FCP_FN(name)        name##_IS_D0
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+#define FCP_INTERPOLATION   1
+#define FCP_SETTLED         1
+#define FCP_DITHERING       1
+#define FCP_FN(name)        name##_IS_D1
+#include "fc_pixel_lut.cpp"
+#include "fc_pixel.cpp"
+#include "fc_draw.cpp"
+#undef FCP_INTERPOLATION
+#undef FCP_SETTLED
+#undef FCP_DITHERING
+#undef FCP_FN
+
+
+struct Variant
+{
+    const char *name;
+    void (*draw)(unsigned interpCoefficient, int stripLength);
+    bool interpolation;
+    bool settled;
+    bool dithering;
+};
+
+static const Variant variants[] = {
+    { "I0_D0", updateDrawBuffer_I0_D0, false, false, false },
+    { "I1_D0", updateDrawBuffer_I1_D0, true,  false, false },
+    { "IS_D0", updateDrawBuffer_IS_D0, true,  true,  false },
+    { "I0_D1", updateDrawBuffer_I0_D1, false, false, true },
+    { "I1_D1", updateDrawBuffer_I1_D1, true,  false, true },
+    { "IS_D1", updateDrawBuffer_IS_D1, true,  true,  true },
+};
+
+static const unsigned NUM_VARIANTS = sizeof variants / sizeof variants[0];
+static const unsigned CHECK_FRAMES = 64;
+static const unsigned TIMED_FRAMES = 20000;
+
+/*
+ * Model of the pipeline, written for clarity rather than speed
+ */
+
+static residual_t modelResidual[CHANNELS_TOTAL];
+static uint32_t modelBuffer[LEDS_PER_STRIP * CHANNELS_PER_LED * 2];
+
+static int modelLUT(const uint16_t *lut, int arg, bool interpolation)
+{
+    // LUT entries are 15-bit, see lutInterpolate()
+    if (!interpolation) {
+        return lut[arg >> 8] << 1;
+    }
+    int index = arg >> 8;
+    int alpha = arg & 0xFF;
+    return (lut[index] * (0x100 - alpha) + lut[index + 1] * alpha) >> 7;
+}
+
+static uint32_t modelPixel(const Variant &v, unsigned interpCoefficient,
+    const uint8_t *pixelPrev, const uint8_t *pixelNext, residual_t *pResidual)
+{
+    const uint16_t *luts[3] = { buffers.lutCurrent.r, buffers.lutCurrent.g, buffers.lutCurrent.b };
+    int value[CHANNELS_PER_LED];
+
+    for (unsigned c = 0; c < 3; ++c) {
+        int color = pixelNext[c] * 0x101;
+        if (v.interpolation && !v.settled) {
+            uint32_t icPrev = 257 * (0x10000 - interpCoefficient);
+            uint32_t icNext = 257 * interpCoefficient;
+            color = (pixelPrev[c] * icPrev + pixelNext[c] * icNext) >> 16;
+        }
+        value[c] = modelLUT(luts[c], color, v.interpolation);
+    }
+
+#if FC_RGBW
+    value[3] = std::min(value[0], std::min(value[1], value[2]));
+    for (unsigned c = 0; c < 3; ++c) {
+        value[c] -= value[3];
+    }
+#endif
+
+    int out[CHANNELS_PER_LED];
+    for (unsigned c = 0; c < CHANNELS_PER_LED; ++c) {
+        int v16 = value[c] + (v.dithering ? pResidual[c] : 0);
+        out[c] = std::max(0, std::min(0xFFFF, v16 + 0x80)) >> 8;
+        if (v.dithering) {
+            pResidual[c] = v16 - out[c] * 257;
+        }
+    }
+
+#if FC_RGBW
+    return (out[1] << 24) | (out[0] << 16) | (out[2] << 8) | out[3];
+#else
+    return (out[1] << 16) | (out[0] << 8) | out[2];
+#endif
+}
+
+static void modelDraw(const Variant &v, unsigned interpCoefficient, int stripLength)
+{
+    /*
+     * Each pixel is sent most significant bit first, as a run of bytes in the
+     * draw buffer. Each byte holds that bit for all eight strips, strip 0 in bit 0.
+     */
+
+    const unsigned bits = CHANNELS_PER_LED * 8;
+    uint8_t *out = (uint8_t*) modelBuffer;
+
+    for (int i = 0; i < stripLength; ++i) {
+        uint32_t pixels[8];
+        for (unsigned strip = 0; strip < 8; ++strip) {
+            unsigned index = i + LEDS_PER_STRIP * strip;
+            pixels[strip] = modelPixel(v, interpCoefficient, buffers.fbPrev->pixel(index),
+                buffers.fbNext->pixel(index), modelResidual + index * CHANNELS_PER_LED);
+        }
+        for (unsigned bit = 0; bit < bits; ++bit) {
+            uint8_t byte = 0;
+            for (unsigned strip = 0; strip < 8; ++strip) {
+                byte |= ((pixels[strip] >> (bits - 1 - bit)) & 1) << strip;
+            }
+            *(out++) = byte;
+        }
+    }
+}
+
+/*
+ * Test data
+ */
+
+static uint32_t randomState = 1;
+
+static uint32_t nextRandom()
+{
+    // xorshift32, so runs are repeatable on any host
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static void initLUT()
+{
+    // A typical gamma curve, prepared as fcBuffers::finalizeLUT() would
+    for (unsigned i = 0; i < LUT_TOTAL_SIZE; ++i) {
+        double x = (i % LUT_CH_SIZE) / double(LUT_CH_SIZE - 1);
+        buffers.lutCurrent.entries[i] = std::min(0xFFFF, int(pow(x, 2.5) * 0x10000)) >> 1;
+    }
+}
+
+static void randomFrames()
+{
+    /*
+     * New random contents for fbNext, with about a quarter of the pixels left the
+     * same as fbPrev, and stablePixels to match.
+     */
+
+    std::swap(buffers.fbPrev, buffers.fbNext);
+
+    for (unsigned i = 0; i < LEDS_TOTAL; ++i) {
+        const uint8_t *prev = buffers.fbPrev->pixel(i);
+        uint8_t *next = const_cast<uint8_t*>(buffers.fbNext->pixel(i));
+        bool same = (nextRandom() & 3) == 0;
+        for (unsigned c = 0; c < 3; ++c) {
+            next[c] = same ? prev[c] : nextRandom();
+        }
+    }
+
+    memset(buffers.stablePixels, 0, sizeof buffers.stablePixels);
+    for (unsigned i = 0; i < LEDS_TOTAL; ++i) {
+        if (!memcmp(buffers.fbPrev->pixel(i), buffers.fbNext->pixel(i), 3)) {
+            buffers.stablePixels[i % LEDS_PER_STRIP] |= 1 << (i / LEDS_PER_STRIP);
+        }
+    }
+}
+
+static bool checkVariant(const Variant &v)
+{
+    memset(residual, 0, sizeof residual);
+    memset(modelResidual, 0, sizeof modelResidual);
+
+    for (unsigned frame = 0; frame < CHECK_FRAMES; ++frame) {
+        randomFrames();
+
+        // Settled and non-interpolated kernels are only ever run at the keyframe
+        unsigned coefficient = (v.interpolation && !v.settled) ? nextRandom() % 0x10001 : 0x10000;
+        int stripLength = (frame & 1) ? LEDS_PER_STRIP : 1 + nextRandom() % LEDS_PER_STRIP;
+        unsigned bytes = stripLength * CHANNELS_PER_LED * 8;
+
+        v.draw(coefficient, stripLength);
+        modelDraw(v, coefficient, stripLength);
+
+        if (memcmp(leds.drawBuffer, modelBuffer, bytes) ||
+            memcmp(residual, modelResidual, sizeof residual)) {
+            printf("%s: output differs on frame %u, coefficient 0x%05x, strip length %d\n",
+                v.name, frame, coefficient, stripLength);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double timeVariant(const Variant &v)
+{
+    // Nanoseconds per full-length frame
+    randomFrames();
+    unsigned coefficient = (v.interpolation && !v.settled) ? 0x8000 : 0x10000;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (unsigned frame = 0; frame < TIMED_FRAMES; ++frame) {
+        v.draw(coefficient, LEDS_PER_STRIP);
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(end - start).count() / TIMED_FRAMES;
+}
+
+int main()
+{
+    buffers.fbPrev = &fbA;
+    buffers.fbNext = &fbB;
+    initLUT();
+
+    printf("%d LEDs per strip, %d channels, %s\n", LEDS_PER_STRIP, CHANNELS_PER_LED,
+        FC_BLOCK_TRANSPOSE ? "block transpose" : "BFI remapping");
+
+    bool ok = true;
+    for (unsigned i = 0; i < NUM_VARIANTS; ++i) {
+        const Variant &v = variants[i];
+        if (!checkVariant(v)) {
+            ok = false;
+            continue;
+        }
+        double ns = timeVariant(v);
+        printf("%s: %9.0f ns/frame, %6.2f ns/pixel\n", v.name, ns, ns / LEDS_TOTAL);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -55,6 +55,12 @@ static uint8_t reply_buffer[8];
 // Performance counters
 volatile uint32_t perf_frameCounter;
 volatile uint32_t perf_receivedKeyframeCounter;
+volatile uint32_t perf_drawCycles;
+volatile uint32_t perf_usbCycles;
+volatile uint32_t perf_showCycles;
+volatile uint32_t perf_usbBuffersMinFree;
+volatile uint32_t perf_deferredPackets;
+volatile uint32_t perf_tornFrames;
 
 #define BDT_OWN     0x80
 #define BDT_DATA1   0x40
@@ -263,12 +269,56 @@ static void usb_setup(void)
             case 1:
                 data = (uint8_t*) &perf_receivedKeyframeCounter;
                 break;
+            case 2: {
+                // Snapshot the free-running cycle counter, to measure the others against
+                uint32_t cycles = ARM_DWT_CYCCNT;
+                reply_buffer[0] = cycles;
+                reply_buffer[1] = cycles >> 8;
+                reply_buffer[2] = cycles >> 16;
+                reply_buffer[3] = cycles >> 24;
+                data = reply_buffer;
+                break;
+            }
+            case 3:
+                data = (uint8_t*) &perf_drawCycles;
+                break;
+            case 4:
+                data = (uint8_t*) &perf_usbCycles;
+                break;
+            case 5:
+                data = (uint8_t*) &perf_showCycles;
+                break;
+            case 6:
+                data = (uint8_t*) &perf_usbBuffersMinFree;
+                break;
+            case 7:
+                data = (uint8_t*) &perf_deferredPackets;
+                break;
+            case 8:
+                data = (uint8_t*) &perf_tornFrames;
+                break;
             default:
                 endpoint0_stall();
                 return;
         }
         break;
 
+      case 0x02C0:      // Read LED capacity
+      case 0x02C1:
+        // LEDs per strip, then framebuffer packets per frame. Both 16-bit, little-endian.
+        // Then 32-bit feature flags. Hosts that only want the capacity can ask for 4 bytes.
+        reply_buffer[0] = LEDS_PER_STRIP;
+        reply_buffer[1] = LEDS_PER_STRIP >> 8;
+        reply_buffer[2] = PACKETS_PER_FRAME;
+        reply_buffer[3] = PACKETS_PER_FRAME >> 8;
+        reply_buffer[4] = FEATURES;
+        reply_buffer[5] = 0;
+        reply_buffer[6] = 0;
+        reply_buffer[7] = 0;
+        data = reply_buffer;
+        datalen = 8;
+        break;
+
       case (MSFT_VENDOR_CODE << 8) | 0xC0:      // Get Microsoft descriptor
       case (MSFT_VENDOR_CODE << 8) | 0xC1:
         if (setup.wIndex == 0x0004) {
@@ -419,7 +469,7 @@ static void usb_control(uint32_t stat)
 }
 
 
-static void usb_try_rx(unsigned index)
+static void usb_try_rx(unsigned index, int retry)
 {
     // We have a packet waiting in a receive buffer. Try to deliver it
     // with usb_rx_handler. If it can't take the packet yet, defer processing
@@ -436,6 +486,10 @@ static void usb_try_rx(unsigned index)
         if (!usb_rx_handler(packet)) {
             // Deferred! We'll try again in usb_rx_resume()
 
+            if (!retry) {
+                perf_deferredPackets++;
+            }
+
             __disable_irq();
             bdt_deferred_map |= 1 << index;
             __enable_irq();
@@ -467,7 +521,7 @@ void usb_rx_resume()
     while (deferred) {
 
         if (deferred & 1) {
-            usb_try_rx(idx);
+            usb_try_rx(idx, 1);
         }
 
         idx++;
@@ -497,7 +551,7 @@ restart:
         } else if (stat & 0x08) {
             // We have no transmit endpoints; stub.
         } else {
-            usb_try_rx(stat2tableindex(stat));
+            usb_try_rx(stat2tableindex(stat), 0);
         }
 
         USB0_ISTAT = USB_ISTAT_TOKDNE;
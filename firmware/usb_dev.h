@@ -70,6 +70,20 @@ extern volatile uint8_t usb_dfu_state;
 extern volatile uint32_t perf_frameCounter;
 extern volatile uint32_t perf_receivedKeyframeCounter;
 
+// CPU profile, in DWT cycle counts. Each is a running total, wrapping at 32 bits.
+extern volatile uint32_t perf_drawCycles;
+extern volatile uint32_t perf_usbCycles;
+extern volatile uint32_t perf_showCycles;
+
+// Fewest free USB packet buffers seen since reset
+extern volatile uint32_t perf_usbBuffersMinFree;
+
+// Packets the firmware couldn't take yet, left in the serial engine to stall the host
+extern volatile uint32_t perf_deferredPackets;
+
+// Frames discarded because some of their packets were lost or out of order
+extern volatile uint32_t perf_tornFrames;
+
 
 #ifdef __cplusplus
 }
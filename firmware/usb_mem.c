@@ -39,14 +39,18 @@
 __attribute__ ((section(".usbbuffers"), used))
 unsigned char usb_buffer_memory[NUM_USB_BUFFERS * sizeof(usb_packet_t)];
 
-static uint32_t usb_buffer_available[4];
+// One bit per buffer. Long-strip builds have more than 128 buffers.
+static uint32_t usb_buffer_available[(NUM_USB_BUFFERS + 31) / 32];
+static unsigned int usb_buffers_used;
 
 void usb_init_mem()
 {
-    usb_buffer_available[0] = -1;
-    usb_buffer_available[1] = -1;
-    usb_buffer_available[2] = -1;
-    usb_buffer_available[3] = -1;
+    unsigned int i;
+    for (i = 0; i < sizeof(usb_buffer_available) / sizeof(usb_buffer_available[0]); i++) {
+        usb_buffer_available[i] = -1;
+    }
+    usb_buffers_used = 0;
+    perf_usbBuffersMinFree = NUM_USB_BUFFERS;
 }
 
 // use bitmask and CLZ instruction to implement fast free list
@@ -78,6 +82,12 @@ usb_packet_t * usb_malloc(void)
     }
 
     usb_buffer_available[idx] = avail & ~(0x80000000 >> (n & 31));
+
+    // Low-water mark, for profiling how close we come to running out
+    usb_buffers_used++;
+    if (NUM_USB_BUFFERS - usb_buffers_used < perf_usbBuffersMinFree) {
+        perf_usbBuffersMinFree = NUM_USB_BUFFERS - usb_buffers_used;
+    }
     __enable_irq();
 
     p = usb_buffer_memory + (n * sizeof(usb_packet_t));
@@ -96,6 +106,7 @@ void usb_free(usb_packet_t *p)
     mask = 0x80000000 >> (n & 31);
     __disable_irq();
     usb_buffer_available[idx] |= mask;
+    usb_buffers_used--;
     __enable_irq();
 }
 
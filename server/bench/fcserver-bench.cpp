@@ -0,0 +1,350 @@
+/*
+ * Microbenchmarks for the fcserver mapping, packing and reassembly paths
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Runs the per-frame CPU paths with synthetic configurations, without any
+ * USB or SPI hardware:
+ *
+ *   - PixelMap into Fadecandy-layout framebuffers, for 1, 16 and 64 boards,
+ *     with straight, reversed and swizzled maps
+ *   - Per-pixel fbPixel() addressing, as used by device_pixels
+ *   - APA102 mapping, color correction and SPI frame packing
+ *   - OPC stream reassembly from whole and fragmented TCP reads
+ *
+ * Each case prints ns/pixel and messages/s. With --check, the results are compared
+ * against a file written by an earlier --save run, and the exit status is nonzero
+ * if any case got more than 'tolerance' percent slower.
+ */
+
+#include "rapidjson/document.h"
+#include "pixelmap.h"
+#include "opcbuffer.h"
+#include "apa102spidevice.h"
+#include "opc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+typedef rapidjson::Value Value;
+
+// The Fadecandy USB framebuffer: 25 packets of 21 pixels, after one control byte
+static const unsigned FC_PIXELS = 512;
+static const unsigned FC_PIXELS_PER_PACKET = 21;
+static const unsigned FC_PACKET_BYTES = 64;
+static const unsigned FC_PACKETS = 25;
+
+// Each OPC channel feeds up to 32 boards, to stay inside the 64 KB message limit
+static const unsigned BOARDS_PER_CHANNEL = 32;
+
+static const double MIN_SECONDS = 0.5;
+
+struct Result {
+    std::string name;
+    double nsPerPixel;
+    double messagesPerSecond;
+};
+
+static std::vector<Result> gResults;
+
+static double seconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void report(const char *name, double elapsed, uint64_t iterations,
+    unsigned pixelsPerIteration, unsigned messagesPerIteration)
+{
+    Result r;
+    r.name = name;
+    r.nsPerPixel = elapsed * 1e9 / (double(iterations) * pixelsPerIteration);
+    r.messagesPerSecond = double(iterations) * messagesPerIteration / elapsed;
+    gResults.push_back(r);
+
+    printf("%-36s %10.3f ns/pixel %14.0f messages/s\n", name, r.nsPerPixel, r.messagesPerSecond);
+}
+
+static OPC::Message *newMessage(unsigned channel, unsigned numPixels)
+{
+    OPC::Message *msg = new OPC::Message;
+    msg->channel = channel;
+    msg->command = OPC::SetPixelColors;
+    msg->setLength(numPixels * 3);
+    for (unsigned i = 0; i < numPixels * 3; ++i) {
+        msg->data[i] = i * 7;
+    }
+    return msg;
+}
+
+static void benchPixelMap(const char *name, unsigned numBoards, int direction, const char *colors)
+{
+    /*
+     * One PixelMap per board, each with one 512-pixel span from its channel, the
+     * same shape as a default multi-board config. Every frame sends one message per
+     * channel to every board, like the server does with channel routing.
+     */
+
+    PixelLayout layout(FC_PIXELS, 1, 3, FC_PIXELS_PER_PACKET, FC_PACKET_BYTES);
+    std::vector<PixelMap> maps(numBoards);
+    std::vector<uint8_t> framebuffers(numBoards * FC_PACKETS * FC_PACKET_BYTES);
+    unsigned numChannels = (numBoards + BOARDS_PER_CHANNEL - 1) / BOARDS_PER_CHANNEL;
+    std::vector<OPC::Message*> messages;
+
+    for (unsigned c = 0; c < numChannels; ++c) {
+        unsigned boards = std::min(BOARDS_PER_CHANNEL, numBoards - c * BOARDS_PER_CHANNEL);
+        messages.push_back(newMessage(c + 1, boards * FC_PIXELS));
+    }
+
+    for (unsigned i = 0; i < numBoards; ++i) {
+        char json[128];
+        unsigned first = (i % BOARDS_PER_CHANNEL) * FC_PIXELS;
+        if (colors) {
+            snprintf(json, sizeof json, "[[%u, %u, %u, %d, \"%s\"]]", 1 + i / BOARDS_PER_CHANNEL,
+                first, direction > 0 ? 0 : FC_PIXELS - 1, direction * int(FC_PIXELS), colors);
+        } else {
+            snprintf(json, sizeof json, "[[%u, %u, %u, %d]]", 1 + i / BOARDS_PER_CHANNEL,
+                first, direction > 0 ? 0 : FC_PIXELS - 1, direction * int(FC_PIXELS));
+        }
+
+        rapidjson::Document map;
+        map.Parse<0>(json);
+        maps[i].compile(&map, layout, true);
+    }
+
+    uint64_t iterations = 0;
+    double start = seconds(), elapsed;
+    do {
+        for (unsigned i = 0; i < numBoards; ++i) {
+            maps[i].apply(*messages[i / BOARDS_PER_CHANNEL], &framebuffers[i * FC_PACKETS * FC_PACKET_BYTES]);
+        }
+        iterations++;
+        elapsed = seconds() - start;
+    } while (elapsed < MIN_SECONDS);
+
+    report(name, elapsed, iterations, numBoards * FC_PIXELS, numChannels);
+
+    for (unsigned c = 0; c < numChannels; ++c) {
+        delete messages[c];
+    }
+}
+
+static void benchFbPixel()
+{
+    // Same addressing as FCDevice::fbPixel(), one pixel at a time like writeDevicePixels()
+
+    std::vector<uint8_t> framebuffer(FC_PACKETS * FC_PACKET_BYTES);
+    uint8_t pixels[FC_PIXELS * 3];
+    for (unsigned i = 0; i < sizeof pixels; ++i) {
+        pixels[i] = i;
+    }
+
+    uint64_t iterations = 0;
+    double start = seconds(), elapsed;
+    do {
+        for (unsigned i = 0; i < FC_PIXELS; ++i) {
+            uint8_t *out = &framebuffer[(i / FC_PIXELS_PER_PACKET) * FC_PACKET_BYTES
+                + 1 + 3 * (i % FC_PIXELS_PER_PACKET)];
+            memcpy(out, pixels + i * 3, 3);
+        }
+        iterations++;
+        elapsed = seconds() - start;
+    } while (elapsed < MIN_SECONDS);
+
+    report("fbPixel, 1 board", elapsed, iterations, FC_PIXELS, 1);
+}
+
+static void benchAPA102(const char *name, unsigned numLights, const char *options)
+{
+    // Mapping, 16-bit color correction and brightness packing. Nothing is opened,
+    // so each frame stops at the SPI device's pending buffer.
+
+    char json[256];
+    snprintf(json, sizeof json, "{ \"map\": [[ 0, 0, 0, %u ]] %s }", numLights, options);
+
+    rapidjson::Document config;
+    config.Parse<0>(json);
+
+    rapidjson::Document color;
+    color.Parse<0>("{ \"gamma\": 2.5, \"whitepoint\": [1.0, 0.9, 0.8] }");
+
+    APA102SPIDevice dev(numLights, true);
+    dev.loadConfiguration(config);
+    dev.writeColorCorrection(color);
+
+    OPC::Message *msg = newMessage(0, numLights);
+
+    uint64_t iterations = 0;
+    double start = seconds(), elapsed;
+    do {
+        dev.writeMessage(*msg);
+        iterations++;
+        elapsed = seconds() - start;
+    } while (elapsed < MIN_SECONDS);
+
+    report(name, elapsed, iterations, numLights, 1);
+    delete msg;
+}
+
+static void countMessage(OPC::Message &msg, void *context)
+{
+    (*(uint64_t*) context)++;
+}
+
+static void benchReassembly(const char *name, unsigned messagePixels, unsigned fragment)
+{
+    /*
+     * A stream of back-to-back OPC messages, handed to OPCBuffer::receive() in
+     * 'fragment'-byte reads, the way the network thread sees a TCP stream.
+     * A fragment of 0 means each read holds exactly one message.
+     */
+
+    static const unsigned STREAM_MESSAGES = 64;
+    unsigned messageBytes = OPC::HEADER_BYTES + messagePixels * 3;
+    std::vector<uint8_t> stream(messageBytes * STREAM_MESSAGES);
+
+    OPC::Message *msg = newMessage(0, messagePixels);
+    for (unsigned i = 0; i < STREAM_MESSAGES; ++i) {
+        memcpy(&stream[i * messageBytes], msg, messageBytes);
+    }
+    delete msg;
+
+    unsigned readSize = fragment ? fragment : messageBytes;
+    OPCBuffer *buffer = OPCBuffer::alloc();
+    uint64_t dispatched = 0;
+    uint64_t iterations = 0;
+    double start = seconds(), elapsed;
+
+    do {
+        for (unsigned offset = 0; offset < stream.size(); offset += readSize) {
+            unsigned len = std::min<unsigned>(readSize, stream.size() - offset);
+            buffer->receive(&stream[offset], len, countMessage, &dispatched);
+        }
+        iterations++;
+        elapsed = seconds() - start;
+    } while (elapsed < MIN_SECONDS);
+
+    OPCBuffer::release(buffer);
+
+    if (dispatched != iterations * STREAM_MESSAGES) {
+        fprintf(stderr, "%s: dispatched %llu messages, expected %llu\n", name,
+            (unsigned long long) dispatched, (unsigned long long) (iterations * STREAM_MESSAGES));
+        exit(1);
+    }
+
+    report(name, elapsed, iterations, messagePixels * STREAM_MESSAGES, STREAM_MESSAGES);
+}
+
+static bool save(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror("Can't write results");
+        return false;
+    }
+    for (std::vector<Result>::iterator i = gResults.begin(), e = gResults.end(); i != e; ++i) {
+        fprintf(f, "%.6f %s\n", i->nsPerPixel, i->name.c_str());
+    }
+    fclose(f);
+    return true;
+}
+
+static bool check(const char *path, double tolerance)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Can't read baseline");
+        return false;
+    }
+
+    std::map<std::string, double> baseline;
+    char line[256];
+    while (fgets(line, sizeof line, f)) {
+        char *name;
+        double ns = strtod(line, &name);
+        if (name != line && *name == ' ') {
+            std::string s(name + 1);
+            while (!s.empty() && (s[s.size() - 1] == '\n' || s[s.size() - 1] == '\r')) {
+                s.resize(s.size() - 1);
+            }
+            baseline[s] = ns;
+        }
+    }
+    fclose(f);
+
+    bool ok = true;
+    for (std::vector<Result>::iterator i = gResults.begin(), e = gResults.end(); i != e; ++i) {
+        std::map<std::string, double>::iterator b = baseline.find(i->name);
+        if (b != baseline.end() && i->nsPerPixel > b->second * (1.0 + tolerance / 100.0)) {
+            printf("REGRESSION: %s, %.3f ns/pixel vs. %.3f baseline\n",
+                i->name.c_str(), i->nsPerPixel, b->second);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *savePath = 0;
+    const char *checkPath = 0;
+    double tolerance = 10.0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--save") && i + 1 < argc) {
+            savePath = argv[++i];
+        } else if (!strcmp(argv[i], "--check") && i + 1 < argc) {
+            checkPath = argv[++i];
+        } else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: fcserver-bench [--save <file>] [--check <file>] [--tolerance <percent>]\n");
+            return 2;
+        }
+    }
+
+    benchPixelMap("map straight, 1 board", 1, 1, 0);
+    benchPixelMap("map straight, 16 boards", 16, 1, 0);
+    benchPixelMap("map straight, 64 boards", 64, 1, 0);
+    benchPixelMap("map reversed, 16 boards", 16, -1, 0);
+    benchPixelMap("map swizzled, 16 boards", 16, 1, "bgr");
+    benchPixelMap("map luminosity, 16 boards", 16, 1, "lll");
+    benchFbPixel();
+    benchAPA102("apa102, 144 lights", 144, "");
+    benchAPA102("apa102, 1024 lights", 1024, "");
+    benchReassembly("opc reassembly, whole reads", 512, 0);
+    benchReassembly("opc reassembly, 1460 byte reads", 512, 1460);
+    benchReassembly("opc reassembly, 100 byte reads", 512, 100);
+
+    if (savePath && !save(savePath)) {
+        return 2;
+    }
+    if (checkPath && !check(checkPath, tolerance)) {
+        return 1;
+    }
+    return 0;
+}
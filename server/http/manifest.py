@@ -1,5 +1,9 @@
 # Manifest of files to include in the simple HTTP server.
 # Run this script to generate the httpdocs.cpp source file.
+#
+# Documents are stored gzip-compressed, with an ETag computed from their contents.
+# Redistributed libraries have version numbers in their paths, so browsers may
+# cache them for much longer than our own files.
 
 manifest = [
     ('/', 'index.html', 'text/html'),
@@ -21,7 +25,11 @@ manifest = [
     (None, '404.html', 'text/html'),
 ]
 
-import json, sys, os, zlib
+import json, sys, os, zlib, hashlib
+
+# Cache lifetimes, in seconds
+maxAgeDefault = 300
+maxAgeVersioned = 86400
 
 sys.stdout.write("""/*
  * HTTP Document data.
@@ -61,8 +69,20 @@ for path, filename, contentType in manifest:
         raw = open(filename, 'r').read().encode('UTF-8')
     else:
         raw = open(filename, 'rb').read()
-    data = zlib.compress(raw)
-    sys.stdout.write("{ %s, %s, %s, %d },\n" %
-        (quote(path), quote(data), quote(contentType), len(data)))
+
+    # gzip container (wbits 16 + 15) is understood by every browser, unlike raw deflate.
+    compressor = zlib.compressobj(9, zlib.DEFLATED, 31)
+    data = compressor.compress(raw) + compressor.flush()
+
+    etag = '"%s"' % hashlib.sha1(raw).hexdigest()[:16]
+    if path is None:
+        maxAge = 0
+    elif path.startswith('/dist/'):
+        maxAge = maxAgeVersioned
+    else:
+        maxAge = maxAgeDefault
+
+    sys.stdout.write("{ %s, %s, %s, %d, %s, %d },\n" %
+        (quote(path), quote(data), quote(contentType), len(data), quote(etag), maxAge))
 
 sys.stdout.write("};\n")
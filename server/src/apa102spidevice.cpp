@@ -28,46 +28,163 @@
 #include "opc.h"
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <stddef.h>
 
 const char* APA102SPIDevice::DEVICE_TYPE = "apa102spi";
 
 APA102SPIDevice::APA102SPIDevice(uint32_t numLights, bool verbose)
     : SPIDevice(DEVICE_TYPE, verbose),
-      mConfigMap(0),
-      mNumLights(numLights)
+      mNumLights(numLights),
+      mExtraFlush(false),
+      mMaxBrightness(DEFAULT_MAX_BRIGHTNESS),
+      mLayout(numLights, sizeof(PixelFrame) + offsetof(PixelFrame, b), sizeof(PixelFrame),
+          std::max<uint32_t>(numLights, 1), 0, true),
+      mOutputRate(0),
+      mDither(true),
+      mInterpolate(true),
+      mRenderThread(0),
+      mRenderStopping(false)
 {
-    uint32_t bufferSize = sizeof(PixelFrame) * (numLights + 2); // Number of lights plus start and end frames
-    mFrameBuffer = (PixelFrame*)malloc(bufferSize);
+    /*
+     * Each LED passes data on delayed by half a clock cycle, so the last pixel only
+     * arrives after another numLights/2 clock edges: one byte per 16 lights. SK9822
+     * parts also need a 32-bit zero frame before they latch. The end frame is all
+     * zeros rather than ones, so any extra LEDs past the end of the strip stay dark.
+     */
+
+    uint32_t endBytes = sizeof(PixelFrame) + (numLights + 15) / 16;
+    mFrameBytes = sizeof(PixelFrame) * (numLights + 1) + endBytes;
+    mOutputBuffer = (PixelFrame*)malloc(mFrameBytes);
+    mFrameBuffer = (PixelFrame*)malloc(sizeof(PixelFrame) * (numLights + 1));
 
     uint32_t flushCount = (numLights / 2) + (numLights % 2);
     mFlushBuffer = (PixelFrame*)malloc(flushCount);
 
     // Initialize all buffers to zero
     memset(mFlushBuffer, 0, flushCount);
-    memset(mFrameBuffer, 0, bufferSize);
+    memset(mOutputBuffer, 0, mFrameBytes);
+    memset(mFrameBuffer, 0, sizeof(PixelFrame) * (numLights + 1));
+
+    // The end frame is already zero
+    mOutputBuffer[0].value = START_FRAME;
 
-    // Initialize start and end frames
-    mFrameBuffer[0].value = START_FRAME;
-    mFrameBuffer[numLights + 1].value = END_FRAME;
+    buildBrightnessTables();
 }
 
 APA102SPIDevice::~APA102SPIDevice()
 {
-    free(mFrameBuffer);
-    free(mFlushBuffer);
+    if (mRenderThread) {
+        mRenderStopping = true;
+        mRenderThread->join();
+        delete mRenderThread;
+    }
 
+    // Queued output is copied, so the writer thread can finish it after we're gone
     flush();
+
+    free(mFrameBuffer);
+    free(mOutputBuffer);
+    free(mFlushBuffer);
 }
 
 void APA102SPIDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    mPixelMap.compile(findConfigMap(config), mLayout, mVerbose);
+    mCurrentLimiter.parse(config, mVerbose);
+
+    // The end frame is enough for the APA102 and SK9822. This is for anything that isn't.
+    const Value &extraFlush = config["extraFlush"];
+    if (extraFlush.IsBool()) {
+        mExtraFlush = extraFlush.IsTrue();
+    } else if (!extraFlush.IsNull() && mVerbose) {
+        std::clog << "The 'extraFlush' option must be true or false.\n";
+    }
+
+    const Value &maxBrightness = config["maxBrightness"];
+    if (maxBrightness.IsUint() && maxBrightness.GetUint() >= 1 && maxBrightness.GetUint() <= MAX_BRIGHTNESS) {
+        mMaxBrightness = maxBrightness.GetUint();
+        buildBrightnessTables();
+    } else if (!maxBrightness.IsNull() && mVerbose) {
+        std::clog << "The 'maxBrightness' option must be a number from 1 to " << MAX_BRIGHTNESS << ".\n";
+    }
+
+    const Value &outputRate = config["outputRate"];
+    const Value &dither = config["dither"];
+    const Value &interpolate = config["interpolate"];
+
+    if (outputRate.IsUint() && outputRate.GetUint() <= MAX_OUTPUT_RATE) {
+        mOutputRate = outputRate.GetUint();
+    } else if (!outputRate.IsNull() && mVerbose) {
+        std::clog << "The 'outputRate' option must be a number of frames per second, up to " << MAX_OUTPUT_RATE << ".\n";
+    }
+
+    if (dither.IsBool()) {
+        mDither = dither.IsTrue();
+    } else if (!dither.IsNull() && mVerbose) {
+        std::clog << "The 'dither' option must be true or false.\n";
+    }
+
+    if (interpolate.IsBool()) {
+        mInterpolate = interpolate.IsTrue();
+    } else if (!interpolate.IsNull() && mVerbose) {
+        std::clog << "The 'interpolate' option must be true or false.\n";
+    }
+
+    updateCurrentLimiter();
+
+    if (mOutputRate && mNumLights && !mRenderThread) {
+        mKeyframe.assign(mNumLights * 3, 0);
+        mRendered.assign(mNumLights * 3, 0);
+        mResidual.assign(mNumLights * 3, 0);
+        mInterpolator.resize(mNumLights * 3);
+        mRenderThread = new tthread::thread(renderThreadFunc, this);
+    }
+}
+
+void APA102SPIDevice::buildBrightnessTables()
+{
+    /*
+     * A full-scale 16-bit color is PWM 255 at mMaxBrightness. For dimmer pixels, use the
+     * lowest brightness that can still reach the brightest channel, and scale PWM up to
+     * match. Each brightness covers every color whose high byte maps to it, so PWM
+     * never needs more than 8 bits.
+     */
+
+    for (unsigned entry = 0; entry < 256; entry++) {
+        uint32_t top = (entry << 8) | 0xFF;
+        uint32_t level = (top * mMaxBrightness + 0xFFFE) / 0xFFFF;
+        mBrightnessTable[entry] = level < 1 ? 1 : level;
+    }
+
+    // PWM = color * 255 * mMaxBrightness / (0xFFFF * level), in 16.16 fixed point
+    mPwmScale[0] = 0;
+    for (unsigned level = 1; level <= MAX_BRIGHTNESS; level++) {
+        mPwmScale[level] = (255.0 * mMaxBrightness * 65536.0) / (65535.0 * level) + 0.5;
+    }
+}
+
+void APA102SPIDevice::writeColorCorrection(const Value &color)
+{
+    SPIDevice::writeColorCorrection(color);
+    updateCurrentLimiter();
+}
+
+void APA102SPIDevice::updateCurrentLimiter()
+{
+    // Full-scale color is PWM 255 at mMaxBrightness, out of the LED's full 31
+    mCurrentLimiter.setOutput(mColorLUT, double(mMaxBrightness) / MAX_BRIGHTNESS);
+}
+
+bool APA102SPIDevice::usesOpcChannel(unsigned channel)
+{
+    return mPixelMap.usesChannel(channel);
 }
 
 std::string APA102SPIDevice::getName()
 {
     std::ostringstream s;
-    s << "APA102/APA102C/SK9822 via SPI Port " << mPort;
+    s << "APA102/APA102C/SK9822 via SPI Bus " << mBus << " Port " << mPort;
     return s.str();
 }
 
@@ -77,16 +194,126 @@ void APA102SPIDevice::flush()
     * Flush the buffer by writing zeros through every LED
     *
     * This is nessecary in the event that we are not following up a writeBuffer()
-    * with another writeBuffer immediately.
+    * with another writeBuffer immediately, on strips that don't latch from the
+    * end frame alone. Off unless the "extraFlush" option is set.
     *
     */
+    if (!mExtraFlush) {
+        return;
+    }
+
     uint32_t flushCount = (mNumLights / 2) + (mNumLights % 2);
-    SPIDevice::write(mFlushBuffer, flushCount);
+    SPIDevice::append(mFlushBuffer, flushCount);
+}
+
+static inline uint8_t quantize(uint32_t value, uint16_t *residual)
+{
+    // 16.16 fixed point to an 8-bit PWM value, carrying the remainder if we're dithering
+
+    if (!residual) {
+        value = (value + 0x8000) >> 16;
+        return value > 255 ? 255 : value;
+    }
+
+    value += *residual;
+    if ((value >> 16) > 255) {
+        *residual = 0;
+        return 255;
+    }
+    *residual = value;
+    return value >> 16;
+}
+
+void APA102SPIDevice::formatPixel(PixelFrame *out, uint32_t r, uint32_t g, uint32_t b, uint16_t *residual)
+{
+    uint32_t brightest = std::max(r, std::max(g, b));
+    uint32_t level = mBrightnessTable[brightest >> 8];
+    uint32_t scale = mPwmScale[level];
+
+    out->l = BRIGHTNESS_MASK | level;
+    out->r = quantize(r * scale, residual);
+    out->g = quantize(g * scale, residual ? residual + 1 : 0);
+    out->b = quantize(b * scale, residual ? residual + 2 : 0);
 }
 
 void APA102SPIDevice::writeBuffer()
 {
-    SPIDevice::write(mFrameBuffer, sizeof(PixelFrame) * (mNumLights + 2));
+    /*
+     * Frames over the current limit are scaled after color correction, where current
+     * is linear. Interpolated frames blend between two keyframes that are both within
+     * budget, so they are too.
+     */
+
+    uint32_t scale = 0x10000;
+    if (mCurrentLimiter.isEnabled()) {
+        uint64_t total = 0;
+        for (uint32_t i = 0; i < mNumLights; i++) {
+            const PixelFrame *in = fbPixel(i);
+            total += mCurrentLimiter.pixelMicroamps(in->r, in->g, in->b);
+        }
+        scale = mCurrentLimiter.limit(total);
+    }
+
+    if (mRenderThread) {
+        // Hand the corrected colors to the render thread as a new keyframe
+        for (uint32_t i = 0; i < mNumLights; i++) {
+            const PixelFrame *in = fbPixel(i);
+            mKeyframe[i * 3 + 0] = (mColorLUT[0][in->r] * scale) >> 16;
+            mKeyframe[i * 3 + 1] = (mColorLUT[1][in->g] * scale) >> 16;
+            mKeyframe[i * 3 + 2] = (mColorLUT[2][in->b] * scale) >> 16;
+        }
+        mInterpolator.keyframe(&mKeyframe[0]);
+        return;
+    }
+
+    for (uint32_t i = 0; i < mNumLights; i++) {
+        const PixelFrame *in = fbPixel(i);
+        formatPixel(&mOutputBuffer[i + 1],
+            (mColorLUT[0][in->r] * scale) >> 16,
+            (mColorLUT[1][in->g] * scale) >> 16,
+            (mColorLUT[2][in->b] * scale) >> 16, 0);
+    }
+
+    SPIDevice::write(mOutputBuffer, mFrameBytes);
+}
+
+void APA102SPIDevice::renderThreadFunc(void *arg)
+{
+    APA102SPIDevice *self = (APA102SPIDevice*) arg;
+    self->renderLoop();
+}
+
+void APA102SPIDevice::renderLoop()
+{
+    /*
+     * Send a frame every 1/mOutputRate seconds, even if nothing new arrived. Dithering
+     * and interpolation both need the refreshes. If the SPI bus can't keep up, the
+     * writer thread drops the frames that would have waited.
+     */
+
+    const int64_t periodMicros = 1000000 / mOutputRate;
+
+    while (!mRenderStopping) {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+
+        mInterpolator.render(&mRendered[0], mInterpolate);
+
+        for (uint32_t i = 0; i < mNumLights; i++) {
+            formatPixel(&mOutputBuffer[i + 1],
+                mRendered[i * 3 + 0], mRendered[i * 3 + 1], mRendered[i * 3 + 2],
+                mDither ? &mResidual[i * 3] : 0);
+        }
+
+        // Rendered frames are in-betweens, not client frames, so they skip the frame barrier
+        queue(mOutputBuffer, mFrameBytes, false, false);
+
+        gettimeofday(&end, NULL);
+        int64_t elapsed = (int64_t)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+        if (elapsed >= 0 && elapsed < periodMicros) {
+            tthread::this_thread::sleep_for(tthread::chrono::microseconds(periodMicros - elapsed));
+        }
+    }
 }
 
 void APA102SPIDevice::writeMessage(Document &msg)
@@ -144,13 +371,35 @@ void APA102SPIDevice::writeDevicePixels(Document &msg)
             out->r = std::max(0, std::min(255, r.IsInt() ? r.GetInt() : 0));
             out->g = std::max(0, std::min(255, g.IsInt() ? g.GetInt() : 0));
             out->b = std::max(0, std::min(255, b.IsInt() ? b.GetInt() : 0));
-            out->l = 0xEF; // todo: fix so we actually pass brightness
-        }
+            }
 
         writeBuffer();
     }
 }
 
+void APA102SPIDevice::writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count)
+{
+    /*
+    * The same as above, for a pixel array that JsonPixelReader already clamped
+    * to bytes while parsing. 'msg' no longer has a "pixels" member.
+    */
+
+    uint32_t numPixels = count / 3;
+    if (numPixels > mNumLights)
+        numPixels = mNumLights;
+
+    for (uint32_t i = 0; i < numPixels; i++) {
+        PixelFrame *out = fbPixel(i);
+
+        out->r = pixels[i * 3 + 0];
+        out->g = pixels[i * 3 + 1];
+        out->b = pixels[i * 3 + 2];
+    }
+
+    writeBuffer();
+    flush();
+}
+
 void APA102SPIDevice::writeMessage(const OPC::Message &msg)
 {
     /*
@@ -177,95 +426,16 @@ void APA102SPIDevice::writeMessage(const OPC::Message &msg)
 void APA102SPIDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run through our device's compiled mapping, and store any relevant portions of 'msg'
+     * directly into our SPI frame buffer.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
-    }
-
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
-    }
-}
-
-void APA102SPIDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
-{
-    /*
-    * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-    * into our framebuffer. This looks for any mapping instructions that we
-    * recognize:
-    *
-    *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
-    */
-
-    unsigned msgPixelCount = msg.length() / 3;
-
-    if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            }
-            else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
-
-            if (channel != msg.channel) {
-                return;
-            }
-
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, mNumLights);
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                direction > 0 ? mNumLights - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            while (count--) {
-                PixelFrame *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-                outPtr->r = inPtr[0];
-                outPtr->g = inPtr[1];
-                outPtr->b = inPtr[2];
-                outPtr->l = 0xEF; // todo: fix so we actually pass brightness
-                inPtr += 3;
-            }
-
-            return;
-        }
-    }
-
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
-    }
+    mPixelMap.apply(msg, (uint8_t*) mFrameBuffer);
 }
 
 void APA102SPIDevice::describe(rapidjson::Value &object, Allocator &alloc)
 {
     SPIDevice::describe(object, alloc);
     object.AddMember("numLights", mNumLights, alloc);
+    mCurrentLimiter.describe(object, alloc);
 }
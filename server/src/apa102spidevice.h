@@ -25,6 +25,11 @@
 #pragma once
 #include "spidevice.h"
 #include "opc.h"
+#include "pixelmap.h"
+#include "frameinterpolator.h"
+#include "currentlimiter.h"
+#include "tinythread.h"
+#include <vector>
 #include <set>
 
 
@@ -37,6 +42,9 @@ public:
     virtual void loadConfiguration(const Value &config);
     virtual void writeMessage(const OPC::Message &msg);
     virtual void writeMessage(Document &msg);
+    virtual void writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count);
+    virtual bool usesOpcChannel(unsigned channel);
+    virtual void writeColorCorrection(const Value &color);
     virtual std::string getName();
     virtual void flush();
 
@@ -46,8 +54,10 @@ public:
 
 private:
     static const uint32_t START_FRAME = 0x00000000;
-    static const uint32_t END_FRAME = 0xFFFFFFFF;
     static const uint32_t BRIGHTNESS_MASK = 0xE0;
+    static const uint32_t MAX_BRIGHTNESS = 31;
+    static const uint32_t DEFAULT_MAX_BRIGHTNESS = 15;  // Same output level as the old fixed 0xEF
+    static const uint32_t MAX_OUTPUT_RATE = 1000;
 
     union PixelFrame
     {
@@ -62,10 +72,42 @@ private:
         uint32_t value;
     };
 
-    const Value *mConfigMap;
-    PixelFrame* mFrameBuffer;
+    PixelMap mPixelMap;
+    PixelFrame* mFrameBuffer;   // 8-bit colors from the mapper, laid out like mOutputBuffer
+    PixelFrame* mOutputBuffer;  // Color-corrected frames, ready for SPI
     PixelFrame* mFlushBuffer;
     uint32_t mNumLights;
+    uint32_t mFrameBytes;   // Start frame, pixels, and end frame
+    bool mExtraFlush;
+    uint32_t mMaxBrightness;
+    PixelLayout mLayout;
+
+    /*
+     * Colors are corrected to 16 bits by SPIDevice's LUT, then split into the 5-bit global brightness and
+     * 8-bit PWM value. All three channels share one brightness, picked from the
+     * brightest channel's high byte, and each PWM value is one multiply by a scale
+     * factor for that brightness.
+     */
+    uint8_t mBrightnessTable[256];
+    uint32_t mPwmScale[MAX_BRIGHTNESS + 1];
+
+    // Optional current limit, scaling the corrected 16-bit colors of frames over budget
+    CurrentLimiter mCurrentLimiter;
+    void updateCurrentLimiter();
+
+    /*
+     * Optional render stage. With an "outputRate", frames from clients become keyframes,
+     * and a render thread sends interpolated and dithered frames at that rate.
+     */
+    uint32_t mOutputRate;
+    bool mDither;
+    bool mInterpolate;
+    FrameInterpolator mInterpolator;
+    std::vector<uint16_t> mKeyframe;    // Corrected colors, written under the server's event lock
+    std::vector<uint16_t> mRendered;    // Render thread only
+    std::vector<uint16_t> mResidual;    // Render thread only. Dithering error, 16 fractional bits.
+    tthread::thread *mRenderThread;
+    volatile bool mRenderStopping;
 
     // buffer accessor
     PixelFrame *fbPixel(unsigned num) {
@@ -73,8 +115,12 @@ private:
     }
 
     void writeBuffer();
+    void buildBrightnessTables();
+    void formatPixel(PixelFrame *out, uint32_t r, uint32_t g, uint32_t b, uint16_t *residual);
+
+    static void renderThreadFunc(void *arg);
+    void renderLoop();
     void writeDevicePixels(Document &msg);
 
     void opcSetPixelColors(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
 };
@@ -0,0 +1,131 @@
+/*
+ * Color correction curve shared by Fadecandy and SPI devices
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "colorcurve.h"
+#include <math.h>
+#include <iostream>
+
+
+ColorCurve::ColorCurve()
+{
+    parse(rapidjson::Value(), false);
+}
+
+void ColorCurve::parse(const rapidjson::Value &color, bool verbose)
+{
+    // Default color LUT parameters
+    mGamma = 1.0;
+    mWhitepoint[0] = mWhitepoint[1] = mWhitepoint[2] = 1.0;
+    mLinearSlope = 1.0;
+    mLinearCutoff = 0.0;
+
+    if (color.IsObject()) {
+        const rapidjson::Value &vGamma = color["gamma"];
+        const rapidjson::Value &vWhitepoint = color["whitepoint"];
+        const rapidjson::Value &vLinearSlope = color["linearSlope"];
+        const rapidjson::Value &vLinearCutoff = color["linearCutoff"];
+
+        if (vGamma.IsNumber()) {
+            mGamma = vGamma.GetDouble();
+        } else if (!vGamma.IsNull() && verbose) {
+            std::clog << "Gamma value must be a number.\n";
+        }
+
+        if (vLinearSlope.IsNumber()) {
+            mLinearSlope = vLinearSlope.GetDouble();
+        } else if (!vLinearSlope.IsNull() && verbose) {
+            std::clog << "Linear slope value must be a number.\n";
+        }
+
+        if (vLinearCutoff.IsNumber()) {
+            mLinearCutoff = vLinearCutoff.GetDouble();
+        } else if (!vLinearCutoff.IsNull() && verbose) {
+            std::clog << "Linear cutoff value must be a number.\n";
+        }
+
+        if (vWhitepoint.IsArray() &&
+            vWhitepoint.Size() == 3 &&
+            vWhitepoint[0u].IsNumber() &&
+            vWhitepoint[1].IsNumber() &&
+            vWhitepoint[2].IsNumber()) {
+            mWhitepoint[0] = vWhitepoint[0u].GetDouble();
+            mWhitepoint[1] = vWhitepoint[1].GetDouble();
+            mWhitepoint[2] = vWhitepoint[2].GetDouble();
+        } else if (!vWhitepoint.IsNull() && verbose) {
+            std::clog << "Whitepoint value must be a list of 3 numbers.\n";
+        }
+
+    } else if (!color.IsNull() && verbose) {
+        std::clog << "Color correction value must be a JSON dictionary object.\n";
+    }
+}
+
+double ColorCurve::evaluate(unsigned channel, double input) const
+{
+    // Scale by whitepoint before anything else
+    input *= mWhitepoint[channel];
+
+    // Is this entry part of the linear section still?
+    if (input * mLinearSlope <= mLinearCutoff) {
+
+        // Output value is below linearCutoff. We're still in the linear portion of the curve
+        return input * mLinearSlope;
+    }
+
+    // Nonlinear portion of the curve. This starts right where the linear portion leaves
+    // off. We need to avoid any discontinuity.
+
+    double nonlinearInput = input - (mLinearSlope * mLinearCutoff);
+    double scale = 1.0 - mLinearCutoff;
+    return mLinearCutoff + pow(nonlinearInput / scale, mGamma) * scale;
+}
+
+uint16_t ColorCurve::evaluate16(unsigned channel, double input) const
+{
+    // Round to the nearest integer, and clamp. Overflow-safe.
+    int64_t longValue = (evaluate(channel, input) * 0xFFFF) + 0.5;
+    if (longValue < 0) {
+        return 0;
+    }
+    if (longValue > 0xFFFF) {
+        return 0xFFFF;
+    }
+    return longValue;
+}
+
+bool ColorCurve::operator==(const ColorCurve &other) const
+{
+    return mGamma == other.mGamma &&
+        mWhitepoint[0] == other.mWhitepoint[0] &&
+        mWhitepoint[1] == other.mWhitepoint[1] &&
+        mWhitepoint[2] == other.mWhitepoint[2] &&
+        mLinearSlope == other.mLinearSlope &&
+        mLinearCutoff == other.mLinearCutoff;
+}
+
+void ColorCurve::setWhitepoint(double r, double g, double b)
+{
+    mWhitepoint[0] = r;
+    mWhitepoint[1] = g;
+    mWhitepoint[2] = b;
+}
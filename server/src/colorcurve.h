@@ -0,0 +1,71 @@
+/*
+ * Color correction curve shared by Fadecandy and SPI devices
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include <stdint.h>
+
+
+/*
+ * The compound gamma curve used for color correction. It has a linear section and a
+ * nonlinear section. The linear section, near zero, avoids creating very low output
+ * values that will cause distracting flicker when dithered. This isn't a problem
+ * when the LEDs are viewed indirectly such that the flicker is below the threshold
+ * of perception, but in cases where the flicker is a problem this linear section can
+ * eliminate it entierly at the cost of some dynamic range.
+ *
+ * By default, the linear section is disabled (linearCutoff is zero). To enable the
+ * linear section, set linearCutoff to some nonzero value. A good starting point is
+ * 1/256.0, correspnding to the lowest 8-bit PWM level.
+ *
+ * Each device samples the curve into whatever kind of table its hardware needs.
+ */
+
+class ColorCurve
+{
+public:
+    ColorCurve();
+
+    // Load options from a JSON 'color' object, or reset to the identity curve if it's 'null'
+    void parse(const rapidjson::Value &color, bool verbose);
+
+    // Normalized output for a normalized input, on one color channel. The input ranges
+    // from 0 to 1, and the result may go slightly over 1 with a large whitepoint.
+    double evaluate(unsigned channel, double input) const;
+
+    // The same, rounded and clamped to 16 bits
+    uint16_t evaluate16(unsigned channel, double input) const;
+
+    // Change part of the curve, leaving the linear section as it was
+    void setGamma(double gamma) { mGamma = gamma; }
+    void setWhitepoint(double r, double g, double b);
+
+    // Same parameters, so the same curve?
+    bool operator==(const ColorCurve &other) const;
+
+private:
+    double mGamma;              // Power for nonlinear portion of curve
+    double mWhitepoint[3];      // White-point RGB value (also, global brightness)
+    double mLinearSlope;        // Slope (output / input) of linear section of the curve, near zero
+    double mLinearCutoff;       // Y (output) coordinate of intersection of linear and nonlinear curves
+};
@@ -0,0 +1,44 @@
+/*
+ * Device configuration lookup for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "configindex.h"
+
+
+ConfigIndex::ConfigIndex(const Value &devices)
+    : mDevices(devices)
+{
+    for (unsigned i = 0, e = size(); i != e; ++i) {
+        const Value &config = devices[i];
+        if (!config.IsObject()) {
+            continue;
+        }
+
+        // Entries with some other kind of "serial" can't match a device that has one
+        const Value &serial = config["serial"];
+        if (serial.IsNull()) {
+            mAnySerial.push_back(i);
+        } else if (serial.IsString()) {
+            mBySerial[std::string(serial.GetString(), serial.GetStringLength())].push_back(i);
+        }
+    }
+}
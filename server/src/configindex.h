@@ -0,0 +1,87 @@
+/*
+ * Device configuration lookup for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+/*
+ * Finds the entry in a "devices" list that a device should use, without comparing it
+ * against every entry. Entries are indexed by serial number when the configuration is
+ * loaded. A device with a serial only looks at the entries for that serial and the ones
+ * that don't name a serial at all, in their original order, so the first match still
+ * wins. Devices without a serial, like SPI and network devices, check every entry.
+ *
+ * The index refers to the "devices" array, which must outlive it.
+ */
+
+class ConfigIndex
+{
+public:
+    typedef rapidjson::Value Value;
+
+    explicit ConfigIndex(const Value &devices);
+
+    // The first entry that 'dev' accepts with matchConfiguration(), or NULL
+    template <class T> const Value *find(T *dev, const char *serial) const;
+
+    unsigned size() const { return mDevices.IsArray() ? mDevices.Size() : 0; }
+
+private:
+    const Value &mDevices;
+    typedef std::unordered_map<std::string, std::vector<unsigned> > SerialTable;
+    SerialTable mBySerial;
+    std::vector<unsigned> mAnySerial;
+};
+
+
+template <class T> const ConfigIndex::Value *ConfigIndex::find(T *dev, const char *serial) const
+{
+    if (!serial) {
+        for (unsigned i = 0, e = size(); i != e; ++i) {
+            if (dev->matchConfiguration(mDevices[i])) {
+                return &mDevices[i];
+            }
+        }
+        return 0;
+    }
+
+    // Merge the two candidate lists, which are each in configuration order
+    static const std::vector<unsigned> none;
+    SerialTable::const_iterator found = mBySerial.find(serial);
+    const std::vector<unsigned> &named = found == mBySerial.end() ? none : found->second;
+
+    std::vector<unsigned>::const_iterator a = named.begin(), aEnd = named.end();
+    std::vector<unsigned>::const_iterator b = mAnySerial.begin(), bEnd = mAnySerial.end();
+
+    while (a != aEnd || b != bEnd) {
+        unsigned i = (b == bEnd || (a != aEnd && *a < *b)) ? *a++ : *b++;
+        if (dev->matchConfiguration(mDevices[i])) {
+            return &mDevices[i];
+        }
+    }
+    return 0;
+}
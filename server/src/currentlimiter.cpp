@@ -0,0 +1,131 @@
+/*
+ * Estimated LED current, and a limit on it
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "currentlimiter.h"
+#include <algorithm>
+#include <iostream>
+#include <string.h>
+
+
+CurrentLimiter::CurrentLimiter()
+    : mBudgetMicroamps(0),
+      mOutputScale(1.0),
+      mLastMicroamps(0),
+      mPeakMicroamps(0),
+      mFrames(0),
+      mLimitedFrames(0),
+      mLastScale(0x10000)
+{
+    for (unsigned channel = 0; channel < 3; channel++) {
+        mLedMilliamps[channel] = DEFAULT_LED_MILLIAMPS;
+        for (unsigned entry = 0; entry < 256; entry++) {
+            mLUT[channel][entry] = entry * 0x101;
+        }
+    }
+    buildTables();
+}
+
+void CurrentLimiter::parse(const Value &config, bool verbose)
+{
+    /*
+     * "currentLimit" is the budget for the whole device, in milliamps. "ledCurrent" is
+     * what one LED color draws at full brightness, in milliamps: a single number for
+     * all three, or an [r, g, b] array. 20 mA is typical for WS2811 and APA102 pixels.
+     */
+
+    const Value &currentLimit = config["currentLimit"];
+    const Value &ledCurrent = config["ledCurrent"];
+
+    // Leaving the limit out of a reloaded configuration turns it off
+    mBudgetMicroamps = 0;
+    if (currentLimit.IsNumber() && currentLimit.GetDouble() > 0) {
+        mBudgetMicroamps = uint64_t(currentLimit.GetDouble() * 1000.0 + 0.5);
+    } else if (!currentLimit.IsNull() && verbose) {
+        std::clog << "The 'currentLimit' option must be a positive number of milliamps.\n";
+    }
+
+    for (unsigned channel = 0; channel < 3; channel++) {
+        mLedMilliamps[channel] = DEFAULT_LED_MILLIAMPS;
+    }
+    if (ledCurrent.IsNumber() && ledCurrent.GetDouble() >= 0) {
+        mLedMilliamps[0] = mLedMilliamps[1] = mLedMilliamps[2] = ledCurrent.GetDouble();
+    } else if (ledCurrent.IsArray() && ledCurrent.Size() == 3
+        && ledCurrent[0u].IsNumber() && ledCurrent[1].IsNumber() && ledCurrent[2].IsNumber()) {
+        for (unsigned channel = 0; channel < 3; channel++) {
+            mLedMilliamps[channel] = std::max(0.0, ledCurrent[channel].GetDouble());
+        }
+    } else if (!ledCurrent.IsNull() && verbose) {
+        std::clog << "The 'ledCurrent' option must be a number of milliamps, or an array of three.\n";
+    }
+
+    buildTables();
+}
+
+void CurrentLimiter::setOutput(const uint16_t lut[3][256], double outputScale)
+{
+    memcpy(mLUT, lut, sizeof mLUT);
+    mOutputScale = outputScale;
+    buildTables();
+}
+
+void CurrentLimiter::buildTables()
+{
+    for (unsigned channel = 0; channel < 3; channel++) {
+        double microampsPerLevel = mLedMilliamps[channel] * 1000.0 * mOutputScale / 0xFFFF;
+        for (unsigned entry = 0; entry < 256; entry++) {
+            mMicroamps[channel][entry] = uint32_t(mLUT[channel][entry] * microampsPerLevel + 0.5);
+        }
+    }
+}
+
+uint32_t CurrentLimiter::limit(uint64_t microamps)
+{
+    mFrames++;
+    mLastMicroamps = microamps;
+    mPeakMicroamps = std::max(mPeakMicroamps, microamps);
+
+    if (microamps <= mBudgetMicroamps) {
+        mLastScale = 0x10000;
+    } else {
+        // Round down, so the scaled frame never lands just over budget
+        mLastScale = uint32_t((mBudgetMicroamps << 16) / microamps);
+        mLimitedFrames++;
+    }
+    return mLastScale;
+}
+
+void CurrentLimiter::describe(Value &object, Allocator &alloc)
+{
+    if (!isEnabled()) {
+        return;
+    }
+
+    Value info(rapidjson::kObjectType);
+    info.AddMember("budget_ma", double(mBudgetMicroamps) / 1000.0, alloc);
+    info.AddMember("estimated_ma", double(mLastMicroamps) / 1000.0, alloc);
+    info.AddMember("peak_ma", double(mPeakMicroamps) / 1000.0, alloc);
+    info.AddMember("scale", mLastScale / 65536.0, alloc);
+    info.AddMember("frames", mFrames, alloc);
+    info.AddMember("limited_frames", mLimitedFrames, alloc);
+    object.AddMember("current_limit", info, alloc);
+}
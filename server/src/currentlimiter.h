@@ -0,0 +1,90 @@
+/*
+ * Estimated LED current, and a limit on it
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include <stdint.h>
+
+
+/*
+ * Keeps a device's estimated LED current under a budget, so power supplies don't have to
+ * be sized for every LED at full white.
+ *
+ * The estimate is a table lookup for each color byte of a frame, using the device's
+ * color correction: an LED draws current in proportion to its corrected output. When a
+ * frame's total goes over budget the device scales the whole frame down, after color
+ * correction, where current is linear. Disabled unless a "currentLimit" is configured.
+ */
+
+class CurrentLimiter
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+    CurrentLimiter();
+
+    // Load "currentLimit" and "ledCurrent" from a device configuration
+    void parse(const Value &config, bool verbose);
+
+    bool isEnabled() const { return mBudgetMicroamps != 0; }
+
+    /*
+     * How the device corrects each 8-bit color, as 16-bit output levels. A full-scale
+     * output draws 'outputScale' times the LED's full current, for devices that have
+     * their own fixed dimmer on top of the LUT.
+     */
+    void setOutput(const uint16_t lut[3][256], double outputScale = 1.0);
+
+    // Estimated current of one pixel, in microamps
+    uint32_t pixelMicroamps(uint8_t r, uint8_t g, uint8_t b) const {
+        return mMicroamps[0][r] + mMicroamps[1][g] + mMicroamps[2][b];
+    }
+
+    // Record one frame's estimated current. Returns a 16.16 fixed point scale for its
+    // output, 0x10000 if it's already within budget.
+    uint32_t limit(uint64_t microamps);
+
+    // Add a "current_limit" object with the budget and recent estimates, if enabled
+    void describe(Value &object, Allocator &alloc);
+
+private:
+    // Full-brightness current of each LED color, if the configuration doesn't say
+    static const unsigned DEFAULT_LED_MILLIAMPS = 20;
+
+    uint64_t mBudgetMicroamps;
+    double mLedMilliamps[3];
+    uint32_t mMicroamps[3][256];
+
+    uint16_t mLUT[3][256];
+    double mOutputScale;
+
+    // Statistics
+    uint64_t mLastMicroamps;
+    uint64_t mPeakMicroamps;
+    uint64_t mFrames;
+    uint64_t mLimitedFrames;
+    uint32_t mLastScale;
+
+    void buildTables();
+};
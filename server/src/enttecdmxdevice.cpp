@@ -29,11 +29,11 @@
 #include <iostream>
 
 
-EnttecDMXDevice::Transfer::Transfer(EnttecDMXDevice *device, void *buffer, int length)
-    : transfer(libusb_alloc_transfer(0)), finished(false)
+EnttecDMXDevice::Transfer::Transfer(EnttecDMXDevice *device)
+    : transfer(libusb_alloc_transfer(0)), pending(false), finished(false), orphaned(false)
 {
     libusb_fill_bulk_transfer(transfer, device->mHandle,
-        OUT_ENDPOINT, (uint8_t*) buffer, length, EnttecDMXDevice::completeTransfer, this, 2000);
+        OUT_ENDPOINT, (uint8_t*) &packet, 0, EnttecDMXDevice::completeTransfer, this, 2000);
 }
 
 EnttecDMXDevice::Transfer::~Transfer()
@@ -44,7 +44,12 @@ EnttecDMXDevice::Transfer::~Transfer()
 EnttecDMXDevice::EnttecDMXDevice(libusb_device *device, bool verbose)
     : USBDevice(device, "enttec", verbose),
       mFoundEnttecStrings(false),
-      mConfigMap(0)
+      mHasConstants(false),
+      mTransfer(0),
+      mFrameWaiting(false),
+      mRefreshRate(DEFAULT_REFRESH_RATE),
+      mFramesSubmitted(0),
+      mFramesCoalesced(0)
 {
     mSerialBuffer[0] = '\0';
     mSerialString = mSerialBuffer;
@@ -55,18 +60,25 @@ EnttecDMXDevice::EnttecDMXDevice(libusb_device *device, bool verbose)
     mChannelBuffer.label = SEND_DMX_PACKET;
     mChannelBuffer.data[0] = START_CODE;
     setChannel(1, 0);
+
+    mLastSubmitTime.tv_sec = 0;
+    mLastSubmitTime.tv_usec = 0;
 }
 
 EnttecDMXDevice::~EnttecDMXDevice()
 {
     /*
-     * If we have pending transfers, cancel them.
-     * The Transfer objects themselves will be freed once libusb completes them.
+     * If our transfer is in flight, cancel it.
+     * The Transfer object itself will be freed once libusb completes it.
      */
 
-    for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
-        Transfer *fct = *i;
-        libusb_cancel_transfer(fct->transfer);
+    if (mTransfer) {
+        if (mTransfer->pending) {
+            mTransfer->orphaned = true;
+            libusb_cancel_transfer(mTransfer->transfer);
+        } else {
+            delete mTransfer;
+        }
     }
 }
 
@@ -97,7 +109,7 @@ int EnttecDMXDevice::open()
         return r;
     }
 
-    r = libusb_open(mDevice, &mHandle);
+    r = libusb_open(mHandleDevice, &mHandle);
     if (r < 0) {
         return r;
     }
@@ -156,7 +168,16 @@ bool EnttecDMXDevice::probeAfterOpening()
 
 void EnttecDMXDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+    compileMap(findConfigMap(config));
+
+    const Value &refreshRate = config["refreshRate"];
+    if (refreshRate.IsUint() && refreshRate.GetUint() >= 1 && refreshRate.GetUint() <= MAX_REFRESH_RATE) {
+        mRefreshRate = refreshRate.GetUint();
+    } else if (!refreshRate.IsNull() && mVerbose) {
+        std::clog << "The 'refreshRate' option must be a number of frames per second, from 1 to "
+            << MAX_REFRESH_RATE << ".\n";
+    }
 }
 
 std::string EnttecDMXDevice::getName()
@@ -179,61 +200,99 @@ void EnttecDMXDevice::setChannel(unsigned n, uint8_t value)
     }
 }
 
-void EnttecDMXDevice::submitTransfer(Transfer *fct)
+void EnttecDMXDevice::completeTransfer(struct libusb_transfer *transfer)
 {
-    /*
-     * Submit a new USB transfer. The Transfer object is guaranteed to be freed eventually.
-     * On error, it's freed right away.
-     */
-
-    int r = libusb_submit_transfer(fct->transfer);
+    EnttecDMXDevice::Transfer *fct = static_cast<EnttecDMXDevice::Transfer*>(transfer->user_data);
 
-    if (r < 0) {
-        if (mVerbose && r != LIBUSB_ERROR_PIPE) {
-            std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
-        }
+    if (fct->orphaned) {
+        // The device is already gone
         delete fct;
     } else {
-        mPending.insert(fct);
+        fct->finished = true;
     }
 }
 
-void EnttecDMXDevice::completeTransfer(struct libusb_transfer *transfer)
+void EnttecDMXDevice::flush()
 {
-    EnttecDMXDevice::Transfer *fct = static_cast<EnttecDMXDevice::Transfer*>(transfer->user_data);
-    fct->finished = true;
+    // Our transfer is free again once it's finished
+
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+
+    if (mTransfer && mTransfer->finished) {
+        mTransfer->pending = false;
+        mTransfer->finished = false;
+    }
+
+    if (mFrameWaiting && !(mTransfer && mTransfer->pending) && millisUntilRefresh(mLastSubmitTime, mRefreshRate) == 0) {
+        submitDMXPacket();
+    }
 }
 
-void EnttecDMXDevice::flush()
+int EnttecDMXDevice::flushTimeoutMillis()
 {
-    // Erase any finished transfers
-
-    std::set<Transfer*>::iterator current = mPending.begin();
-    while (current != mPending.end()) {
-        std::set<Transfer*>::iterator next = current;
-        next++;
+    // A waiting frame needs flush() when the refresh interval is up. Transfer
+    // completions wake the main loop on their own.
 
-        Transfer *fct = *current;
-        if (fct->finished) {
-            mPending.erase(current);
-            delete fct;
-        }
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
 
-        current = next;
+    if (!mFrameWaiting || (mTransfer && mTransfer->pending)) {
+        return -1;
     }
+    return millisUntilRefresh(mLastSubmitTime, mRefreshRate);
 }
 
 void EnttecDMXDevice::writeDMXPacket()
 {
     /*
-     * Asynchronously write an FTDI packet containing an Enttec packet containing
-     * our set of DMX channels.
+     * Publish our set of DMX channels, to be sent asynchronously.
      *
-     * XXX: We should probably throttle this so that we don't send DMX messages
-     *      faster than the Enttec device can keep up!
+     * This usually runs on the network thread. The main loop sends the newest channel
+     * values from flush(), with at most one transfer in flight, and no faster than
+     * the configured refresh rate the Enttec device can keep up with.
+     */
+
+    if (mFrameWaiting) {
+        mFramesCoalesced++;
+    }
+    mFrameWaiting = true;
+}
+
+void EnttecDMXDevice::submitDMXPacket()
+{
+    /*
+     * Copy the latest channels into our transfer, and send it.
      */
 
-    submitTransfer(new Transfer(this, &mChannelBuffer, mChannelBuffer.length + 5));
+    if (!mTransfer) {
+        mTransfer = new Transfer(this);
+    }
+
+    int length = mChannelBuffer.length + 5;
+    memcpy(&mTransfer->packet, &mChannelBuffer, length);
+    mTransfer->transfer->length = length;
+
+    mFrameWaiting = false;
+    gettimeofday(&mLastSubmitTime, NULL);
+
+    int r = libusb_submit_transfer(mTransfer->transfer);
+    if (r < 0) {
+        if (mVerbose && r != LIBUSB_ERROR_PIPE) {
+            std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
+        }
+        return;
+    }
+
+    mTransfer->pending = true;
+    mFramesSubmitted++;
+}
+
+void EnttecDMXDevice::describe(rapidjson::Value &object, Allocator &alloc)
+{
+    USBDevice::describe(object, alloc);
+
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+    object.AddMember("frames_submitted", mFramesSubmitted, alloc);
+    object.AddMember("frames_coalesced", mFramesCoalesced, alloc);
 }
 
 void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
@@ -244,10 +303,13 @@ void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
 
     switch (msg.command) {
 
-        case OPC::SetPixelColors:
+        case OPC::SetPixelColors: {
+            // Channels are shared with flush()
+            tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
             opcSetPixelColors(msg);
             writeDMXPacket();
             return;
+        }
 
         case OPC::SystemExclusive:
             // No relevant SysEx for this device
@@ -259,61 +321,44 @@ void EnttecDMXDevice::writeMessage(const OPC::Message &msg)
     }
 }
 
-void EnttecDMXDevice::opcSetPixelColors(const OPC::Message &msg)
+bool EnttecDMXDevice::usesOpcChannel(unsigned channel)
 {
-    /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
-     */
-
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
+    // Constants are written along with pixels from any channel
+    if (mHasConstants) {
+        return true;
     }
-
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
+    for (std::vector<ChannelSpan>::const_iterator i = mChannelSpans.begin(), e = mChannelSpans.end(); i != e; ++i) {
+        if (i->channel == channel) {
+            return true;
+        }
     }
+    return false;
 }
 
-void EnttecDMXDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
+bool EnttecDMXDevice::parseInstruction(MapEntry &entry, const Value &inst)
 {
     /*
-     * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-     * into our framebuffer. This looks for any mapping instructions that we
-     * recognize:
+     * Parse one JSON mapping instruction. Returns false if it isn't one we recognize:
      *
      *   [ OPC Channel, OPC Pixel, Pixel Color, DMX Channel ]
+     *   [ Constant value, DMX Channel ]
      */
 
-    unsigned msgPixelCount = msg.length() / 3;
-
     if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
+        // Map one color of an OPC pixel to a DMX channel
 
         const Value &vChannel = inst[0u];
         const Value &vPixelIndex = inst[1];
         const Value &vPixelColor = inst[2];
         const Value &vDMXChannel = inst[3];
 
-        if (vChannel.IsUint() && vPixelIndex.IsUint() && vPixelColor.IsString() && vDMXChannel.IsUint()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned pixelIndex = vPixelIndex.GetUint();
-            const char *pixelColor = vPixelColor.GetString();
-            unsigned dmxChannel = vDMXChannel.GetUint();
-
-            if (channel != msg.channel || pixelIndex >= msgPixelCount) {
-                return;
-            }
-
-            const uint8_t *pixel = msg.data + (pixelIndex * 3);
-            uint8_t value;
-
-            if (OPC::pickColorChannel(value, pixelColor[0], pixel)) {
-                setChannel(dmxChannel, value);
-                return;
-            }
+        if (vChannel.IsUint() && vPixelIndex.IsUint() && vPixelColor.IsString() && vDMXChannel.IsUint() &&
+            PixelMap::parseColor(entry.color, vPixelColor.GetString()[0])) {
+            entry.channel = vChannel.GetUint();
+            entry.pixel = vPixelIndex.GetUint();
+            entry.dmx = vDMXChannel.GetUint();
+            entry.constant = false;
+            return true;
         }
     }
 
@@ -324,19 +369,158 @@ void EnttecDMXDevice::opcMapPixelColors(const OPC::Message &msg, const Value &in
         const Value &vDMXChannel = inst[1];
 
         if (vValue.IsUint() && vDMXChannel.IsUint()) {
-            unsigned value = vValue.GetUint();
-            unsigned dmxChannel = vDMXChannel.GetUint();
+            entry.pixel = uint8_t(vValue.GetUint());
+            entry.dmx = vDMXChannel.GetUint();
+            entry.constant = true;
+            return true;
+        }
+    }
 
-            setChannel(dmxChannel, value);
-            return;
+    return false;
+}
+
+unsigned EnttecDMXDevice::groupWidth(const std::vector<MapEntry> &entries, unsigned first)
+{
+    // How many entries from 'first' map colors of the same pixel to successive DMX channels?
+
+    const MapEntry &a = entries[first];
+    unsigned width = 1;
+
+    while (width < 3 && first + width < entries.size()) {
+        const MapEntry &b = entries[first + width];
+        if (b.constant || b.channel != a.channel || b.pixel != a.pixel || b.dmx != a.dmx + width) {
+            break;
         }
+        width++;
     }
+    return width;
+}
 
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+void EnttecDMXDevice::compileMap(const Value *map)
+{
+    /*
+     * All JSON type checking and DMX channel bounds checks happen here, once. Instructions
+     * for DMX channels outside 1 to 512, or OPC channels past 255, can never write
+     * anything, so they're dropped.
+     */
+
+    mChannelSpans.clear();
+    mHasConstants = false;
+
+    if (!map) {
+        // No mapping defined yet. This device is inactive.
+        return;
+    }
+
+    std::vector<MapEntry> entries;
+    for (unsigned i = 0, e = map->Size(); i != e; i++) {
+        const Value &inst = (*map)[i];
+        MapEntry entry;
+
+        if (!parseInstruction(entry, inst)) {
+            if (mVerbose) {
+                rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
+                rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+                inst.Accept(writer);
+                std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+            }
+            continue;
+        }
+
+        if (entry.dmx >= 1 && entry.dmx <= 512 && (entry.constant || entry.channel <= 0xFF)) {
+            entries.push_back(entry);
+        }
+    }
+
+    unsigned i = 0;
+    while (i < entries.size()) {
+        const MapEntry &first = entries[i];
+        ChannelSpan span;
+
+        span.firstOPC = first.pixel;
+        span.firstDMX = first.dmx;
+        span.count = 1;
+        span.channel = first.constant ? 0 : first.channel;
+        span.kernel = 0;
+
+        if (first.constant) {
+            span.width = 0;
+            mHasConstants = true;
+            mChannelSpans.push_back(span);
+            i++;
+            continue;
+        }
+
+        span.width = groupWidth(entries, i);
+        for (unsigned c = 0; c < span.width; c++) {
+            span.colors[c] = entries[i + c].color;
+        }
+        i += span.width;
+
+        // Take in the next pixel's group, for as long as it carries on where we left off
+        while (i + span.width <= entries.size() && groupWidth(entries, i) >= span.width) {
+            const MapEntry &next = entries[i];
+            bool same = next.channel == span.channel &&
+                next.pixel == span.firstOPC + span.count &&
+                next.dmx == span.firstDMX + span.count * span.width;
+            for (unsigned c = 0; same && c < span.width; c++) {
+                same = entries[i + c].color == span.colors[c];
+            }
+            if (!same) {
+                break;
+            }
+            span.count++;
+            i += span.width;
+        }
+
+        if (span.width == 3) {
+            span.kernel = PixelMap::kernel(span.colors);
+        }
+        mChannelSpans.push_back(span);
     }
 }
+
+void EnttecDMXDevice::opcSetPixelColors(const OPC::Message &msg)
+{
+    // Store any relevant portions of 'msg' in the framebuffer, following the compiled map
+
+    for (std::vector<ChannelSpan>::const_iterator i = mChannelSpans.begin(), e = mChannelSpans.end(); i != e; ++i) {
+        applySpan(msg, *i);
+    }
+}
+
+void EnttecDMXDevice::applySpan(const OPC::Message &msg, const ChannelSpan &span)
+{
+    if (!span.width) {
+        setChannel(span.firstDMX, span.firstOPC);
+        return;
+    }
+
+    unsigned msgPixelCount = msg.length() / 3;
+    if (span.channel != msg.channel || span.firstOPC >= msgPixelCount) {
+        return;
+    }
+
+    unsigned count = std::min<unsigned>(span.count, msgPixelCount - span.firstOPC);
+    const uint8_t *in = msg.data + span.firstOPC * 3;
+    uint8_t *out = mChannelBuffer.data + span.firstDMX;
+
+    if (span.kernel) {
+        span.kernel(out, in, count, 3);
+    } else {
+        for (unsigned i = 0; i < count; i++) {
+            for (unsigned c = 0; c < span.width; c++) {
+                uint8_t color = span.colors[c];
+                out[c] = color == PixelMap::LUMINOSITY ?
+                    (unsigned(in[0]) + unsigned(in[1]) + unsigned(in[2])) / 3 : in[color];
+            }
+            out += span.width;
+            in += 3;
+        }
+    }
+
+    // Extend the packet to cover the last channel written, as setChannel() would
+    unsigned len = std::max<unsigned>(mChannelBuffer.length, span.firstDMX + count * span.width);
+    mChannelBuffer.length = len;
+    mChannelBuffer.data[len] = END_OF_MESSAGE;
+}
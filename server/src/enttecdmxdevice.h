@@ -24,7 +24,8 @@
 #pragma once
 #include "usbdevice.h"
 #include "opc.h"
-#include <set>
+#include "pixelmap.h"
+#include <vector>
 
 
 class EnttecDMXDevice : public USBDevice
@@ -39,8 +40,11 @@ public:
     virtual bool probeAfterOpening();
     virtual void loadConfiguration(const Value &config);
     virtual void writeMessage(const OPC::Message &msg);
+    virtual bool usesOpcChannel(unsigned channel);
     virtual std::string getName();
     virtual void flush();
+    virtual int flushTimeoutMillis();
+    virtual void describe(rapidjson::Value &object, Allocator &alloc);
 
     void writeDMXPacket();
     void setChannel(unsigned n, uint8_t value);
@@ -52,6 +56,10 @@ private:
     static const unsigned SEND_DMX_PACKET = 0x06;
     static const unsigned START_CODE = 0x00;
 
+    // A full 512-channel universe takes about 22.7 ms on the wire
+    static const unsigned DEFAULT_REFRESH_RATE = 44;
+    static const unsigned MAX_REFRESH_RATE = 1000;
+
     struct Packet {
         uint8_t start;
         uint8_t label;
@@ -59,22 +67,67 @@ private:
         uint8_t data[514];
     };
 
+    // Our one DMX transfer. It owns a copy of the packet, so it can outlive the device.
     struct Transfer {
-        Transfer(EnttecDMXDevice *device, void *buffer, int length);
+        Transfer(EnttecDMXDevice *device);
         ~Transfer();
         libusb_transfer *transfer;
+        Packet packet;
+        bool pending;
         bool finished;
+        bool orphaned;
     };
 
     char mSerialBuffer[256];
     bool mFoundEnttecStrings;
-    const Value *mConfigMap;
     Packet mChannelBuffer;
-    std::set<Transfer*> mPending;
 
-    void submitTransfer(Transfer *fct);
+    /*
+     * The JSON 'map', compiled when the configuration is loaded. Each instruction maps
+     * one color of one OPC pixel, or a constant, to one DMX channel. Successive
+     * instructions that map up to three colors of a pixel to successive DMX channels
+     * form a group, and groups for successive pixels with the same colors form a span.
+     * So a universe of RGB fixtures is one span, copied with the same kernels PixelMap
+     * uses. Spans keep the map's order, constants included.
+     */
+    struct ChannelSpan {
+        unsigned firstOPC;      // First OPC pixel, or the value of a constant
+        unsigned firstDMX;      // First DMX channel, from 1
+        unsigned count;         // Pixel count
+        uint8_t channel;        // OPC channel
+        uint8_t width;          // DMX channels per pixel, from 1 to 3, or 0 for a constant
+        uint8_t colors[3];      // PixelMap::Color for each of a pixel's DMX channels
+        PixelMap::Kernel kernel;    // Copy loop for three channel spans
+    };
+
+    struct MapEntry {
+        unsigned channel, pixel, dmx;
+        uint8_t color;
+        bool constant;
+    };
+
+    std::vector<ChannelSpan> mChannelSpans;
+    bool mHasConstants;
+
+    void compileMap(const Value *map);
+    bool parseInstruction(MapEntry &entry, const Value &inst);
+    static unsigned groupWidth(const std::vector<MapEntry> &entries, unsigned first);
+    void applySpan(const OPC::Message &msg, const ChannelSpan &span);
+
+    /*
+     * Output scheduler. mChannelBuffer is a latest-wins mailbox: writeDMXPacket() marks it
+     * as waiting, and flush() sends it once the last transfer is done and the refresh
+     * interval has passed. Frames that get replaced while waiting are counted as coalesced.
+     */
+    Transfer *mTransfer;
+    bool mFrameWaiting;
+    unsigned mRefreshRate;
+    struct timeval mLastSubmitTime;
+    uint64_t mFramesSubmitted;
+    uint64_t mFramesCoalesced;
+
+    void submitDMXPacket();
     static LIBUSB_CALL void completeTransfer(struct libusb_transfer *transfer);
 
     void opcSetPixelColors(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
 };
@@ -22,56 +22,91 @@
  */
 
 #include "fcdevice.h"
+#include "colorcurve.h"
+#include "metrics.h"
+#include "trace.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include "opc.h"
-#include <math.h>
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 #include <stdio.h>
+#include <stddef.h>
 
 
-FCDevice::Transfer::Transfer(FCDevice *device, void *buffer, int length, PacketType type)
-    : transfer(libusb_alloc_transfer(0)),
-      type(type), finished(false)
-{
-    #if NEED_COPY_USB_TRANSFER_BUFFER
-        bufferCopy = malloc(length);
-        memcpy(bufferCopy, buffer, length);
-        uint8_t *data = (uint8_t*) bufferCopy;
-    #else
-        uint8_t *data = (uint8_t*) buffer;
-    #endif
+std::vector<FCDevice::CachedLUT*> FCDevice::sColorLUTCache;
+tthread::mutex FCDevice::sColorLUTCacheMutex;
+
 
-    libusb_fill_bulk_transfer(transfer, device->mHandle,
-        OUT_ENDPOINT, data, length, FCDevice::completeTransfer, this, 2000);
+FCDevice::Transfer::Transfer(FCDevice *device)
+    : device(device), transfer(libusb_alloc_transfer(0)),
+      type(OTHER), probed(false), pending(false), finished(false), orphaned(false)
+{
+    // The device handle isn't known until open(), so it's filled in by submitTransfer().
+    libusb_fill_bulk_transfer(transfer, 0, OUT_ENDPOINT, 0, 0, FCDevice::completeTransfer, this, 2000);
 }
 
 FCDevice::Transfer::~Transfer()
 {
     libusb_free_transfer(transfer);
+}
+
+void FCDevice::Transfer::fill(const void *buffer, int length, PacketType type)
+{
     #if NEED_COPY_USB_TRANSFER_BUFFER
-        free(bufferCopy);
+        memcpy(bufferCopy, buffer, length);
+        transfer->buffer = bufferCopy;
+    #else
+        transfer->buffer = (uint8_t*) buffer;
     #endif
+
+    transfer->length = length;
+    this->type = type;
+    probed = false;
+    finished = false;
 }
 
-FCDevice::FCDevice(libusb_device *device, bool verbose)
-    : USBDevice(device, "fadecandy", verbose),
-      mConfigMap(0), mNumFramesPending(0), mFrameWaitingForSubmit(false)
+FCDevice::FCDevice(libusb_device *device, bool verbose, const char *type)
+    : USBDevice(device, type, verbose),
+      mLayout(NUM_PIXELS, offsetof(Packet, data), 3, PIXELS_PER_PACKET, sizeof(Packet)),
+      mNumFramesPending(0), mMaxFramesPending(DEFAULT_FRAMES_PENDING),
+      mWriteFrame(0), mReadFrame(1), mSharedFrame(2), mFramesWritten(0),
+      mRefreshRate(0),
+      mProbeArmed(false), mFrameProbed(false),
+      mFrameBarrier(false), mFrameHeld(false),
+      mFramesSubmitted(0), mFramesCoalesced(0), mFrameBytesSent(0), mFramesCompleted(0), mFrameLatencyMicros(0),
+      mSkipUnchanged(false), mKeepaliveMillis(DEFAULT_KEEPALIVE_MILLIS),
+      mNumPixels(NUM_PIXELS), mFramebufferPackets(FRAMEBUFFER_PACKETS),
+      mPartialFramesSupported(false), mPartialFrames(true), mLastFramebufferValid(false),
+      mPartialFramesSent(0), mHostTimingSupported(false), mHostTiming(true),
+      mScheduledFramesSupported(false), mFrameScheduleMillis(0),
+      mRLEFramesSupported(false), mRLEFrames(true), mRLEFramesSent(0),
+      mFirmwareConfigSent(false), mCurrentScale(0x10000), mColorLUTSent(false), mColorLUTPacketsSent(0),
+      mHighDepth(false), mDither(true), mProfileSupported(true), mProfileWanted(false),
+      mProfileCounter(0), mProfileSamples(0)
 {
     mSerialBuffer[0] = '\0';
     mSerialString = mSerialBuffer;
+    memset(mLatencyHistogram, 0, sizeof mLatencyHistogram);
+
+    for (unsigned i = 0; i < NUM_TRANSFERS; ++i) {
+        mTransfers[i] = new Transfer(this);
+        mFreeTransfers[i] = mTransfers[i];
+    }
+    mNumFreeTransfers = NUM_TRANSFERS;
+    mNumCompletedTransfers = 0;
+    mProfileTransfer = new Transfer(this);
 
     memset(&mFirmwareConfig, 0, sizeof mFirmwareConfig);
     mFirmwareConfig.control = TYPE_CONFIG;
 
-    // Framebuffer headers
-    memset(mFramebuffer, 0, sizeof mFramebuffer);
-    for (unsigned i = 0; i < FRAMEBUFFER_PACKETS; ++i) {
-        mFramebuffer[i].control = TYPE_FRAMEBUFFER | i;
-    }
-    mFramebuffer[FRAMEBUFFER_PACKETS - 1].control |= FINAL;
+    setFramebufferSize(NUM_PIXELS, FRAMEBUFFER_PACKETS);
+    memset(&mLastFrameTime, 0, sizeof mLastFrameTime);
+    memset(mFrames, 0, sizeof mFrames);
+    memset(&mLastSubmittedWrittenTime, 0, sizeof mLastSubmittedWrittenTime);
+    memset(&mLastClockSyncTime, 0, sizeof mLastClockSyncTime);
+    memset(&mLastSubmitTime, 0, sizeof mLastSubmitTime);
 
     // Color LUT headers
     memset(mColorLUT, 0, sizeof mColorLUT);
@@ -84,14 +119,18 @@ FCDevice::FCDevice(libusb_device *device, bool verbose)
 FCDevice::~FCDevice()
 {
     /*
-     * If we have pending transfers, cancel them.
-     * The Transfer objects themselves will be freed
-     * once libusb completes them.
+     * If we have pending transfers, cancel them. They outlive us, and
+     * are freed once libusb completes them. Idle transfers are freed now.
      */
 
-    for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
-        Transfer *fct = *i;
-        libusb_cancel_transfer(fct->transfer);
+    for (unsigned i = 0; i <= NUM_TRANSFERS; ++i) {
+        Transfer *fct = i < NUM_TRANSFERS ? mTransfers[i] : mProfileTransfer;
+        if (fct->pending && !fct->finished) {
+            fct->orphaned = true;
+            libusb_cancel_transfer(fct->transfer);
+        } else {
+            delete fct;
+        }
     }
 }
 
@@ -114,7 +153,7 @@ int FCDevice::open()
         return r;
     }
 
-    r = libusb_open(mDevice, &mHandle);
+    r = libusb_open(mHandleDevice, &mHandle);
     if (r < 0) {
         return r;
     }
@@ -128,18 +167,182 @@ int FCDevice::open()
     unsigned minor = mDD.bcdDevice & 0xFF;
     snprintf(mVersionString, sizeof mVersionString, "%x.%02x", major, minor);
 
-    return libusb_get_string_descriptor_ascii(mHandle, mDD.iSerialNumber, 
+    r = libusb_get_string_descriptor_ascii(mHandle, mDD.iSerialNumber, 
         (uint8_t*)mSerialBuffer, sizeof mSerialBuffer);
+    if (r < 0) {
+        return r;
+    }
+
+    readLEDCapacity();
+    return r;
+}
+
+void FCDevice::readLEDCapacity()
+{
+    /*
+     * Firmware built for longer strips reports its LEDs per strip and framebuffer
+     * packet count, followed by feature flags. Older firmware stalls this request, and
+     * has the standard size and no extra features.
+     */
+
+    uint8_t buffer[8];
+    int r = libusb_control_transfer(mHandle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+        0x02, 0, 0, buffer, sizeof buffer, 1000);
+    if (r < 4) {
+        return;
+    }
+
+    if (r >= 8) {
+        uint32_t features = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | (uint32_t(buffer[7]) << 24);
+        mPartialFramesSupported = (features & FEATURE_PARTIAL_FRAMES) != 0;
+        mHostTimingSupported = (features & FEATURE_HOST_TIMING) != 0;
+        mRLEFramesSupported = (features & FEATURE_RLE_FRAMES) != 0;
+        mScheduledFramesSupported = (features & FEATURE_SCHEDULED_FRAMES) != 0;
+    }
+
+    unsigned ledsPerStrip = buffer[0] | (buffer[1] << 8);
+    unsigned numPackets = buffer[2] | (buffer[3] << 8);
+    unsigned numPixels = ledsPerStrip * 8;
+
+    if (numPackets < 1 || numPackets > MAX_FRAMEBUFFER_PACKETS ||
+        numPixels < 1 || numPixels > numPackets * PIXELS_PER_PACKET) {
+        if (mVerbose) {
+            std::clog << "Ignoring unsupported LED capacity (" << ledsPerStrip
+                << " LEDs per strip, " << numPackets << " packets) reported by "
+                << getName() << "\n";
+        }
+        return;
+    }
+
+    setFramebufferSize(numPixels, numPackets);
+
+    // The frame duration needs two spare bytes at the end of the last packet
+    if (numPixels == numPackets * PIXELS_PER_PACKET) {
+        mHostTimingSupported = false;
+    }
+
+    // The presentation time needs four more, before the duration
+    if (numPixels > numPackets * PIXELS_PER_PACKET - 2) {
+        mScheduledFramesSupported = false;
+    }
+}
+
+void FCDevice::setFramebufferSize(unsigned numPixels, unsigned numPackets)
+{
+    /*
+     * Packets past the 32 reachable with a 5-bit index use the TYPE_FRAMEBUFFER_HI
+     * packet type, numbered from zero again. Only the last packet is FINAL.
+     */
+
+    mNumPixels = numPixels;
+    mFramebufferPackets = numPackets;
+    mLayout = PixelLayout(numPixels, offsetof(Packet, data), 3, PIXELS_PER_PACKET, sizeof(Packet));
+
+    memset(mFramebuffer, 0, sizeof mFramebuffer);
+    for (unsigned i = 0; i < numPackets; ++i) {
+        if (i <= INDEX_BITS) {
+            mFramebuffer[i].control = TYPE_FRAMEBUFFER | i;
+        } else {
+            mFramebuffer[i].control = TYPE_FRAMEBUFFER_HI | (i - (INDEX_BITS + 1));
+        }
+    }
+    mFramebuffer[numPackets - 1].control |= FINAL;
+    memcpy(mLastFramebuffer, mFramebuffer, sizeof mFramebuffer);
+    mLastFramebufferValid = false;
 }
 
 void FCDevice::loadConfiguration(const Value &config)
 {
-    mConfigMap = findConfigMap(config);
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+
+    mFramebufferMutex.lock();
+    mPixelMap.compile(findConfigMap(config), mLayout, mVerbose);
+    mFramebufferMutex.unlock();
+
+    setFrameQueueDepth(config["frameQueueDepth"]);
+
+    // Options for skipping redundant frames
+    const Value &skipUnchanged = config["skipUnchanged"];
+    const Value &keepalive = config["keepalive"];
+
+    if (skipUnchanged.IsBool()) {
+        mSkipUnchanged = skipUnchanged.IsTrue();
+    } else if (!skipUnchanged.IsNull() && mVerbose) {
+        std::clog << "The 'skipUnchanged' option must be true or false.\n";
+    }
+
+    if (keepalive.IsUint()) {
+        mKeepaliveMillis = keepalive.GetUint();
+    } else if (!keepalive.IsNull() && mVerbose) {
+        std::clog << "The 'keepalive' option must be a number of milliseconds.\n";
+    }
+
+    const Value &refreshRate = config["refreshRate"];
+    if (refreshRate.IsUint() && refreshRate.GetUint() <= MAX_REFRESH_RATE) {
+        mRefreshRate = refreshRate.GetUint();
+    } else if (!refreshRate.IsNull() && mVerbose) {
+        std::clog << "The 'refreshRate' option must be a number of frames per second, from 1 to "
+            << MAX_REFRESH_RATE << ", or 0 for no limit.\n";
+    }
+
+    const Value &partialFrames = config["partialFrames"];
+    if (partialFrames.IsBool()) {
+        mPartialFrames = partialFrames.IsTrue();
+    } else if (!partialFrames.IsNull() && mVerbose) {
+        std::clog << "The 'partialFrames' option must be true or false.\n";
+    }
+
+    const Value &hostTiming = config["hostTiming"];
+    if (hostTiming.IsBool()) {
+        mHostTiming = hostTiming.IsTrue();
+    } else if (!hostTiming.IsNull() && mVerbose) {
+        std::clog << "The 'hostTiming' option must be true or false.\n";
+    }
+
+    const Value &frameSchedule = config["frameSchedule"];
+    if (frameSchedule.IsUint() && frameSchedule.GetUint() <= MAX_FRAME_SCHEDULE_MILLIS) {
+        mFrameScheduleMillis = frameSchedule.GetUint();
+    } else if (!frameSchedule.IsNull() && mVerbose) {
+        std::clog << "The 'frameSchedule' option must be a number of milliseconds, up to "
+            << MAX_FRAME_SCHEDULE_MILLIS << ", or 0 to show frames as they arrive.\n";
+    }
+
+    const Value &rleFrames = config["rleFrames"];
+    if (rleFrames.IsBool()) {
+        mRLEFrames = rleFrames.IsTrue();
+    } else if (!rleFrames.IsNull() && mVerbose) {
+        std::clog << "The 'rleFrames' option must be true or false.\n";
+    }
+
+    mCurrentLimiter.parse(config, mVerbose);
+    if (!mCurrentLimiter.isEnabled() && mCurrentScale != 0x10000) {
+        setCurrentScale(0x10000);
+    }
 
     // Initial firmware configuration from our device options
     writeFirmwareConfiguration(config);
 }
 
+void FCDevice::setFrameQueueDepth(const Value &depth)
+{
+    /*
+     * How many frames may be queued in USB at once? More frames in flight keep the
+     * bus busier, fewer keep latency down. This can change while frames are pending;
+     * a smaller depth takes effect as the extra frames complete.
+     */
+
+    if (depth.IsUint() && depth.GetUint() >= 1 && depth.GetUint() <= MAX_FRAMES_PENDING) {
+        __atomic_store_n(&mMaxFramesPending, depth.GetUint(), __ATOMIC_RELAXED);
+    } else if (!depth.IsNull() && mVerbose) {
+        std::clog << "The 'frameQueueDepth' option must be a number from 1 to " << MAX_FRAMES_PENDING << ".\n";
+    }
+}
+
+bool FCDevice::usesOpcChannel(unsigned channel)
+{
+    return mPixelMap.usesChannel(channel);
+}
+
 void FCDevice::writeFirmwareConfiguration(const Value &config)
 {
     /*
@@ -155,83 +358,364 @@ void FCDevice::writeFirmwareConfiguration(const Value &config)
     const Value &led = config["led"];
     const Value &dither = config["dither"];
     const Value &interpolate = config["interpolate"];
+    const Value &brightness = config["brightness"];
+    const Value &stripLength = config["stripLength"];
+    const Value &frameCheck = config["frameCheck"];
 
     if (!(led.IsTrue() || led.IsFalse() || led.IsNull())) {
         std::clog << "LED configuration must be true (always on), false (always off), or null (default).\n";
     }
 
-    mFirmwareConfig.data[0] =
+    /*
+     * Brightness is a master dimmer, applied by the firmware to its LUT output. Changing
+     * it costs just this one packet, where a new color LUT would be 25.
+     */
+    unsigned brightness16 = 0xFFFF;
+    if (brightness.IsNumber()) {
+        double b = std::max(0.0, std::min(1.0, brightness.GetDouble()));
+        brightness16 = unsigned(b * 0xFFFF + 0.5);
+    } else if (!brightness.IsNull()) {
+        std::clog << "The 'brightness' option must be a number from 0 to 1.\n";
+    }
+
+    uint8_t flags =
         (led.IsNull() ? 0 : CFLAG_NO_ACTIVITY_LED)             |
         (led.IsTrue() ? CFLAG_LED_CONTROL : 0)                 |
         (dither.IsFalse() ? CFLAG_NO_DITHERING : 0)            |
-        (interpolate.IsFalse() ? CFLAG_NO_INTERPOLATION : 0)   ;
+        (interpolate.IsFalse() ? CFLAG_NO_INTERPOLATION : 0)   |
+        (brightness16 != 0xFFFF ? CFLAG_BRIGHTNESS : 0)        |
+        (frameCheck.IsFalse() ? 0 : CFLAG_FRAME_CHECK)         ;
+
+    /*
+     * The firmware only draws and clocks out this many pixels per strip, so short strips
+     * get a proportionally higher frame rate. Zero means the whole strip.
+     */
+    unsigned length = 0;
+    if (stripLength.IsUint() && stripLength.GetUint() >= 1 && stripLength.GetUint() <= 0xFFFF) {
+        length = stripLength.GetUint();
+    } else if (!stripLength.IsNull()) {
+        std::clog << "The 'stripLength' option must be a number of LEDs, from 1 up.\n";
+    }
 
+    uint8_t data[5] = {
+        flags,
+        uint8_t(flags & CFLAG_BRIGHTNESS ? brightness16 : 0),
+        uint8_t(flags & CFLAG_BRIGHTNESS ? brightness16 >> 8 : 0),
+        uint8_t(length),
+        uint8_t(length >> 8),
+    };
+
+    if (mFirmwareConfigSent && !memcmp(data, mFirmwareConfig.data, sizeof data)) {
+        // The device already has this configuration, as when reloading with the same options
+        return;
+    }
+
+    memcpy(mFirmwareConfig.data, data, sizeof data);
     writeFirmwareConfiguration();
 }
 
-bool FCDevice::submitTransfer(Transfer *fct)
+bool FCDevice::submitTransfer(const void *buffer, int length, PacketType type)
 {
     /*
-     * Submit a new USB transfer. The Transfer object is guaranteed to be freed eventually.
-     * On error, it's freed right away.
+     * Submit a new USB transfer, using one of our preallocated Transfer objects.
+     * It's returned to the free list by flush() once it completes, or right away on error.
+     *
+     * Frames are limited by mMaxFramesPending, and they always have a Transfer
+     * reserved for them. Other packets may use whatever is left.
      */
 
-    int r = libusb_submit_transfer(fct->transfer);
+    TRACE_SCOPE("submitTransfer", type);
+
+    unsigned reserved = type == FRAME || mNumFramesPending >= mMaxFramesPending
+        ? 0 : mMaxFramesPending - mNumFramesPending;
+    if (mNumFreeTransfers <= reserved) {
+        if (mVerbose) {
+            std::clog << "Too many USB transfers pending, dropping a packet for " << getName() << "\n";
+        }
+        if (type == FRAME && mFrameProbed) {
+            mFrameProbed = false;
+            mFrameProbe.error = true;
+            finishLatencyProbe(mFrameProbe);
+        }
+        return false;
+    }
+
+    Transfer *fct = mFreeTransfers[--mNumFreeTransfers];
+    fct->fill(buffer, length, type);
+    fct->transfer->dev_handle = mHandle;
+
+    // A probed frame hands its probe to the transfer, before it can possibly complete
+    if (type == FRAME && mFrameProbed) {
+        mFrameProbed = false;
+        fct->probed = true;
+        fct->probe = mFrameProbe;
+        fct->probe.framesPending = mNumFramesPending;
+    }
+
+    int r = submitUSBTransfer(fct->transfer);
 
     if (r < 0) {
+        Metrics::add(Metrics::USB_SUBMIT_ERRORS);
         if (mVerbose && r != LIBUSB_ERROR_PIPE) {
             std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
         }
-        delete fct;
+        mFreeTransfers[mNumFreeTransfers++] = fct;
+        if (fct->probed) {
+            fct->probe.error = true;
+            finishLatencyProbe(fct->probe);
+            fct->probed = false;
+        }
         return false;
 
     } else {
-        mPending.insert(fct);
+        fct->pending = true;
+        if (type == FRAME) {
+            gettimeofday(&fct->submitted, NULL);
+            if (fct->probed) {
+                fct->probe.submitted = timeMicros(fct->submitted);
+            }
+        }
         return true;
     }
 }
 
+int FCDevice::submitUSBTransfer(libusb_transfer *transfer)
+{
+    return libusb_submit_transfer(transfer);
+}
+
 void FCDevice::completeTransfer(libusb_transfer *transfer)
 {
+    /*
+     * Runs inside libusb's event handling, on the main thread or our bus thread, which is
+     * also the only thread that deletes us once we're retired. The network thread may
+     * be using our free list, so completed transfers go onto a separate list that only
+     * that thread touches. Recycling them and submitting a waiting frame happens in
+     * flush(), under mDeviceMutex, right after libusb returns.
+     */
+
     FCDevice::Transfer *fct = static_cast<FCDevice::Transfer*>(transfer->user_data);
-    fct->finished = true;
+    TRACE_INSTANT("completeTransfer", fct->type);
+
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        Metrics::add(Metrics::USB_TRANSFER_ERRORS);
+    }
+
+    if (fct->orphaned) {
+        // The device is already gone
+        delete fct;
+    } else {
+        FCDevice *self = fct->device;
+        if (fct->type == FRAME) {
+            gettimeofday(&fct->completed, NULL);
+        }
+        fct->finished = true;
+        self->mCompletedTransfers[self->mNumCompletedTransfers++] = fct;
+    }
 }
 
 void FCDevice::flush()
 {
-    // Erase any finished transfers
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
 
-    std::set<Transfer*>::iterator current = mPending.begin();
-    while (current != mPending.end()) {
-        std::set<Transfer*>::iterator next = current;
-        next++;
+    // Return completed transfers to the free list
 
-        Transfer *fct = *current;
-        if (fct->finished) {
-            switch (fct->type) {
+    for (unsigned i = 0; i < mNumCompletedTransfers; ++i) {
+        Transfer *fct = mCompletedTransfers[i];
 
-                case FRAME:
-                    mNumFramesPending--;
-                    break;
+        switch (fct->type) {
 
-                default:
-                    break;
-            }
+            case FRAME:
+                if (fct->transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+                    // We don't know what the device has now
+                    mLastFramebufferValid = false;
+                }
+                __atomic_sub_fetch(&mNumFramesPending, 1, __ATOMIC_RELAXED);
+                recordFrameLatency((fct->completed.tv_sec - fct->submitted.tv_sec) * 1000000LL
+                    + (fct->completed.tv_usec - fct->submitted.tv_usec));
+                if (fct->probed) {
+                    fct->probe.completed = timeMicros(fct->completed);
+                    fct->probe.error = fct->transfer->status != LIBUSB_TRANSFER_COMPLETED;
+                    finishLatencyProbe(fct->probe);
+                    fct->probed = false;
+                }
+                break;
 
-            mPending.erase(current);
-            delete fct;
+            case PROFILE:
+                // Not part of the pool
+                fct->pending = false;
+                completeProfileRead(fct);
+                continue;
+
+            default:
+                break;
         }
 
-        current = next;
+        fct->pending = false;
+        mFreeTransfers[mNumFreeTransfers++] = fct;
+    }
+    mNumCompletedTransfers = 0;
+
+    // Keep reading a firmware profile sample, or start one that describe() asked for
+
+    if (mProfileSupported && !mProfileTransfer->pending && (mProfileWanted || mProfileCounter)) {
+        readProfileCounter();
     }
 
     // Submit new frames, if we had a queued frame waiting
 
-    if (mFrameWaitingForSubmit && mNumFramesPending < MAX_FRAMES_PENDING) {
+    if (isFrameWaiting() && mNumFramesPending < mMaxFramesPending && isRefreshDue()) {
+        submitFramebuffer();
+    }
+}
+
+bool FCDevice::isRefreshDue()
+{
+    return mRefreshRate == 0 || millisUntilRefresh(mLastSubmitTime, mRefreshRate) == 0;
+}
+
+int FCDevice::flushTimeoutMillis()
+{
+    // Only a waiting frame held back by the refresh rate needs a timer. Once the queue
+    // is full, transfer completions wake the main loop on their own.
+
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+
+    if (mProfileSupported && mProfileWanted && !mProfileTransfer->pending) {
+        return 0;
+    }
+    if (!mRefreshRate || !isFrameWaiting() || mNumFramesPending >= mMaxFramesPending) {
+        return -1;
+    }
+    return millisUntilRefresh(mLastSubmitTime, mRefreshRate);
+}
+
+void FCDevice::recordFrameLatency(int64_t micros)
+{
+    unsigned bucket = micros > 0 ? micros / LATENCY_BUCKET_MICROS : 0;
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+
+    mFramesCompleted++;
+    mFrameLatencyMicros += micros > 0 ? micros : 0;
+    mLatencyHistogram[bucket]++;
+}
+
+void FCDevice::resetFrameStats()
+{
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+    mFramesSubmitted = 0;
+    __atomic_store_n(&mFramesCoalesced, 0, __ATOMIC_RELAXED);
+    mFrameBytesSent = 0;
+    mFramesCompleted = 0;
+    mFrameLatencyMicros = 0;
+    memset(mLatencyHistogram, 0, sizeof mLatencyHistogram);
+}
+
+unsigned FCDevice::latencyPercentile(double fraction)
+{
+    // Upper edge of the histogram bucket containing this fraction of completed frames
+
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+
+    uint64_t target = uint64_t(fraction * mFramesCompleted + 0.5);
+    uint64_t total = 0;
+
+    for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        total += mLatencyHistogram[bucket];
+        if (total >= target && total > 0) {
+            return (bucket + 1) * LATENCY_BUCKET_MICROS;
+        }
+    }
+    return 0;
+}
+
+bool FCDevice::readPerfCounter(unsigned index, uint32_t &value)
+{
+    // A synchronous control request, so this is only for benchmarking
+    uint8_t buffer[4];
+    int r = libusb_control_transfer(mHandle, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+        0x01, 0, index, buffer, sizeof buffer, 1000);
+
+    if (r != sizeof buffer) {
+        if (mVerbose) {
+            std::clog << "Can't read performance counter " << index << " from " << getName() << "\n";
+        }
+        return false;
+    }
+
+    value = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (uint32_t(buffer[3]) << 24);
+    return true;
+}
+
+void FCDevice::setFrameBarrier(bool enabled)
+{
+    tthread::lock_guard<tthread::mutex> lock(mFramebufferMutex);
+    mFrameBarrier = enabled;
+    if (!enabled && mFrameHeld) {
+        mFrameHeld = false;
         writeFramebuffer();
     }
 }
 
+void FCDevice::commitFrame()
+{
+    tthread::lock_guard<tthread::mutex> lock(mFramebufferMutex);
+    if (mFrameHeld) {
+        mFrameHeld = false;
+        writeFramebuffer();
+    }
+}
+
+void FCDevice::syncClock()
+{
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+    if (mScheduledFramesSupported && mFrameScheduleMillis) {
+        writeClockSync();
+    }
+}
+
+bool FCDevice::hasPixelLock()
+{
+    // Pixels only touch the producer side of the triple buffer, under mFramebufferMutex
+    return true;
+}
+
+bool FCDevice::isQueueFull()
+{
+    // Backpressure polls this without mEventMutex
+    return __atomic_load_n(&mNumFramesPending, __ATOMIC_RELAXED) >=
+        __atomic_load_n(&mMaxFramesPending, __ATOMIC_RELAXED);
+}
+
+bool FCDevice::readPixels(std::vector<uint8_t> &rgb, unsigned step)
+{
+    // The newest frame, already mapped and dithered, whether or not it has been submitted yet
+    tthread::lock_guard<tthread::mutex> lock(mFramebufferMutex);
+    rgb.clear();
+    for (unsigned i = 0; i < mNumPixels; i += step) {
+        const uint8_t *pixel = fbPixel(i);
+        rgb.insert(rgb.end(), pixel, pixel + 3);
+    }
+    return true;
+}
+
+void FCDevice::readLatencyProbes(std::vector<LatencyProbe> &probes)
+{
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+    probes.insert(probes.end(), mFinishedProbes.begin(), mFinishedProbes.end());
+    mFinishedProbes.clear();
+}
+
+void FCDevice::finishLatencyProbe(const LatencyProbe &probe)
+{
+    // Nobody may be collecting these, so only the oldest few are kept
+    if (mFinishedProbes.size() < MAX_FINISHED_PROBES) {
+        mFinishedProbes.push_back(probe);
+    }
+}
+
 void FCDevice::writeColorCorrection(const Value &color)
 {
     /*
@@ -239,111 +723,132 @@ void FCDevice::writeColorCorrection(const Value &color)
      * and send the new color LUT out over USB.
      *
      * 'color' may be 'null' to load an identity-mapped LUT, or it may be
-     * a dictionary of options including 'gamma' and 'whitepoint'.
+     * a dictionary of options including 'gamma' and 'whitepoint'. See ColorCurve
+     * for the shape of the curve.
      *
-     * This calculates a compound curve with a linear section and a nonlinear
-     * section. The linear section, near zero, avoids creating very low output
-     * values that will cause distracting flicker when dithered. This isn't a problem
-     * when the LEDs are viewed indirectly such that the flicker is below the threshold
-     * of perception, but in cases where the flicker is a problem this linear section can
-     * eliminate it entierly at the cost of some dynamic range.
-     *
-     * By default, the linear section is disabled (linearCutoff is zero). To enable the
-     * linear section, set linearCutoff to some nonzero value. A good starting point is
-     * 1/256.0, correspnding to the lowest 8-bit PWM level.
+     * If the device already has a LUT for the same curve, there's nothing to send.
      */
 
-    // Default color LUT parameters
-    double gamma = 1.0;                         // Power for nonlinear portion of curve
-    double whitepoint[3] = {1.0, 1.0, 1.0};     // White-point RGB value (also, global brightness)
-    double linearSlope = 1.0;                   // Slope (output / input) of linear section of the curve, near zero
-    double linearCutoff = 0.0;                  // Y (output) coordinate of intersection of linear and nonlinear curves
+    ColorCurve curve;
+    curve.parse(color, mVerbose);
+
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
+    writeColorLUT(curve);
+}
 
+void FCDevice::writeColorLUT(const ColorCurve &curve)
+{
     /*
-     * Parse the JSON object
+     * Send the LUT for a new curve. The firmware keeps every LUT packet it has
+     * received, and only switches to the new table on the final packet. So once the
+     * device has a whole LUT, an update only needs the packets that changed, plus the
+     * final packet. Small whitepoint steps often change just a few of them.
      */
 
-    if (color.IsObject()) {
-        const Value &vGamma = color["gamma"];
-        const Value &vWhitepoint = color["whitepoint"];
-        const Value &vLinearSlope = color["linearSlope"];
-        const Value &vLinearCutoff = color["linearCutoff"];
-
-        if (vGamma.IsNumber()) {
-            gamma = vGamma.GetDouble();
-        } else if (!vGamma.IsNull() && mVerbose) {
-            std::clog << "Gamma value must be a number.\n";
+    // The current limit goes by the curve, even if the device already has its LUT
+    if (mCurrentLimiter.isEnabled()) {
+        uint16_t lut[3][256];
+        for (unsigned channel = 0; channel < 3; channel++) {
+            for (unsigned entry = 0; entry < 256; entry++) {
+                lut[channel][entry] = curve.evaluate16(channel, entry / 255.0);
+            }
         }
+        mCurrentLimiter.setOutput(lut);
+    }
 
-        if (vLinearSlope.IsNumber()) {
-            linearSlope = vLinearSlope.GetDouble();
-        } else if (!vLinearSlope.IsNull() && mVerbose) {
-            std::clog << "Linear slope value must be a number.\n";
+    if (mColorLUTSent && curve == mColorLUTCurve) {
+        return;
+    }
+
+    if (!mColorLUTSent) {
+        loadColorLUT(curve, mColorLUT);
+        mColorLUTCurve = curve;
+
+        // Start asynchronously sending the LUT.
+        mColorLUTSent = submitTransfer(&mColorLUT, sizeof mColorLUT);
+        if (mColorLUTSent) {
+            mColorLUTPacketsSent += LUT_PACKETS;
         }
+        return;
+    }
+
+    Packet lut[LUT_PACKETS];
+    memcpy(lut, mColorLUT, sizeof lut);
+    loadColorLUT(curve, lut);
 
-        if (vLinearCutoff.IsNumber()) {
-            linearCutoff = vLinearCutoff.GetDouble();
-        } else if (!vLinearCutoff.IsNull() && mVerbose) {
-            std::clog << "Linear slope value must be a number.\n";
+    unsigned count = 0;
+    for (unsigned i = 0; i < LUT_PACKETS; ++i) {
+        if (i == LUT_PACKETS - 1 || memcmp(&lut[i], &mColorLUT[i], sizeof lut[i])) {
+            mColorLUTUpdate[count++] = lut[i];
         }
+    }
+
+    if (count == 1 && !memcmp(&lut[LUT_PACKETS - 1], &mColorLUT[LUT_PACKETS - 1], sizeof lut[0])) {
+        // A different curve, but the same table
+        mColorLUTCurve = curve;
+        return;
+    }
 
-        if (vWhitepoint.IsArray() &&
-            vWhitepoint.Size() == 3 &&
-            vWhitepoint[0u].IsNumber() &&
-            vWhitepoint[1].IsNumber() &&
-            vWhitepoint[2].IsNumber()) {
-            whitepoint[0] = vWhitepoint[0u].GetDouble();
-            whitepoint[1] = vWhitepoint[1].GetDouble();
-            whitepoint[2] = vWhitepoint[2].GetDouble();
-        } else if (!vWhitepoint.IsNull() && mVerbose) {
-            std::clog << "Whitepoint value must be a list of 3 numbers.\n";
+    if (!submitTransfer(mColorLUTUpdate, count * sizeof mColorLUTUpdate[0])) {
+        // The device still has the old table, and the next update will try again
+        return;
+    }
+
+    memcpy(mColorLUT, lut, sizeof mColorLUT);
+    mColorLUTCurve = curve;
+    mColorLUTPacketsSent += count;
+}
+
+void FCDevice::loadColorLUT(const ColorCurve &curve, Packet *lut)
+{
+    /*
+     * Fill in the data for a color LUT, from the cache if we can. Every device uses
+     * the same LUT packets for the same curve, so they're shared by all devices.
+     * The cache is small, most recently used first.
+     */
+
+    tthread::lock_guard<tthread::mutex> lock(sColorLUTCacheMutex);
+
+    for (std::vector<CachedLUT*>::iterator i = sColorLUTCache.begin(), e = sColorLUTCache.end(); i != e; ++i) {
+        CachedLUT *cached = *i;
+        if (cached->curve == curve) {
+            sColorLUTCache.erase(i);
+            sColorLUTCache.insert(sColorLUTCache.begin(), cached);
+            memcpy(lut, cached->packets, sizeof cached->packets);
+            return;
         }
+    }
 
-    } else if (!color.IsNull() && mVerbose) {
-        std::clog << "Color correction value must be a JSON dictionary object.\n";
+    CachedLUT *cached;
+    if (sColorLUTCache.size() < COLOR_LUT_CACHE_SIZE) {
+        cached = new CachedLUT;
+    } else {
+        // Reuse the least recently used entry
+        cached = sColorLUTCache.back();
+        sColorLUTCache.pop_back();
     }
 
+    cached->curve = curve;
+    memcpy(cached->packets, lut, sizeof cached->packets);
+
     /*
      * Calculate the color LUT, stowing the result in an array of USB packets.
+     * The packet headers come from 'lut'.
      */
 
-    Packet *packet = mColorLUT;
+    Packet *packet = cached->packets;
     const unsigned firstByteOffset = 1;  // Skip padding byte
     unsigned byteOffset = firstByteOffset;
 
     for (unsigned channel = 0; channel < 3; channel++) {
         for (unsigned entry = 0; entry < LUT_ENTRIES; entry++) {
-            double output;
-
             /*
              * Normalized input value corresponding to this LUT entry.
              * Ranges from 0 to slightly higher than 1. (The last LUT entry
              * can't quite be reached.)
              */
             double input = (entry << 8) / 65535.0;
-
-            // Scale by whitepoint before anything else
-            input *= whitepoint[channel];
-
-            // Is this entry part of the linear section still?
-            if (input * linearSlope <= linearCutoff) {
-
-                // Output value is below linearCutoff. We're still in the linear portion of the curve
-                output = input * linearSlope;
-
-            } else {
-
-                // Nonlinear portion of the curve. This starts right where the linear portion leaves
-                // off. We need to avoid any discontinuity.
-
-                double nonlinearInput = input - (linearSlope * linearCutoff);
-                double scale = 1.0 - linearCutoff;
-                output = linearCutoff + pow(nonlinearInput / scale, gamma) * scale;
-            }
-
-            // Round to the nearest integer, and clamp. Overflow-safe.
-            int64_t longValue = (output * 0xFFFF) + 0.5;
-            int intValue = std::max<int64_t>(0, std::min<int64_t>(0xFFFF, longValue));
+            uint16_t intValue = curve.evaluate16(channel, input);
 
             // Store LUT entry, little-endian order.
             packet->data[byteOffset++] = uint8_t(intValue);
@@ -355,30 +860,375 @@ void FCDevice::writeColorCorrection(const Value &color)
         }
     }
 
-    // Start asynchronously sending the LUT.
-    submitTransfer(new Transfer(this, &mColorLUT, sizeof mColorLUT));
+    sColorLUTCache.insert(sColorLUTCache.begin(), cached);
+    memcpy(lut, cached->packets, sizeof cached->packets);
 }
 
 void FCDevice::writeFramebuffer()
 {
     /*
-     * Asynchronously write the current framebuffer.
+     * Publish the current framebuffer, to be written asynchronously. Call with
+     * mFramebufferMutex held.
      *
-     * TODO: Currently if this gets ahead of what the USB device is capable of,
-     *       we always drop frames. Alternatively, it would be nice to have end-to-end
-     *       flow control so that the client can produce frames slower.
+     * This usually runs on a network thread, and it doesn't touch libusb or anything
+     * flush() uses. The frame is copied into our write slot and swapped into the triple
+     * buffer, and the main loop sends it from flush() as soon as the USB frame queue has
+     * room. Any frames written in the meantime replace it, and are counted as coalesced.
+     */
+
+    if (mHighDepth) {
+        ditherFramebuffer();
+    }
+
+    Frame &frame = mFrames[mWriteFrame];
+    memcpy(frame.packets, mFramebuffer, sizeof(Packet) * mFramebufferPackets);
+    gettimeofday(&frame.written, NULL);
+    frame.sequence = ++mFramesWritten;
+
+    if (mProbeArmed) {
+        // The probe follows this frame, or whichever newer frame flush() takes instead
+        mProbeArmed = false;
+        mArmedProbe.mapped = timeMicros(frame.written);
+
+        PendingProbe pending = { frame.sequence, mArmedProbe };
+        mProbeMutex.lock();
+        if (mPendingProbes.size() < MAX_FINISHED_PROBES) {
+            mPendingProbes.push_back(pending);
+        }
+        mProbeMutex.unlock();
+    }
+
+    unsigned previous = __atomic_exchange_n(&mSharedFrame, mWriteFrame | FRAME_FRESH, __ATOMIC_ACQ_REL);
+    mWriteFrame = previous & FRAME_INDEX;
+
+    if (previous & FRAME_FRESH) {
+        __atomic_add_fetch(&mFramesCoalesced, 1, __ATOMIC_RELAXED);
+        Metrics::add(Metrics::FRAMES_COALESCED);
+    }
+}
+
+void FCDevice::takeLatencyProbes(const Frame &frame, bool sending)
+{
+    /*
+     * flush() took 'frame'. Probes that followed it or any older frame are done
+     * waiting. The newest one rides along with the frame if it's being sent, and
+     * the rest belonged to frames that never will be.
      */
 
-    if (mNumFramesPending >= MAX_FRAMES_PENDING) {
-        // Too many outstanding frames. Wait to submit until a previous frame completes.
-        mFrameWaitingForSubmit = true;
+    mProbeMutex.lock();
+    std::vector<PendingProbe>::iterator i = mPendingProbes.begin();
+    while (i != mPendingProbes.end() && i->frame <= frame.sequence) {
+        LatencyProbe probe = i->probe;
+        probe.framesCoalesced = unsigned(frame.sequence - i->frame);
+
+        if (sending && (i + 1 == mPendingProbes.end() || (i + 1)->frame > frame.sequence)) {
+            mFrameProbed = true;
+            mFrameProbe = probe;
+        } else {
+            finishLatencyProbe(probe);
+        }
+        ++i;
+    }
+    mPendingProbes.erase(mPendingProbes.begin(), i);
+    mProbeMutex.unlock();
+}
+
+void FCDevice::submitFramebuffer()
+{
+    /*
+     * Take the newest published frame and submit it, from the main loop. Timing,
+     * current limiting and packing all happen here on our read slot, which nobody else
+     * touches. Where the USB buffer would be mapped rather than copied, each pooled
+     * Transfer owns a copy buffer. On Linux the kernel copies OUT data during
+     * libusb_submit_transfer().
+     */
+
+    unsigned shared = __atomic_exchange_n(&mSharedFrame, mReadFrame, __ATOMIC_ACQ_REL);
+    mReadFrame = shared & FRAME_INDEX;
+    Frame &frame = mFrames[mReadFrame];
+
+    if (mSkipUnchanged && isFrameRedundant(frame)) {
+        // Nothing new to show, and it hasn't been long enough to need a keepalive frame.
+        // Any probes finish here, without ever reaching USB.
+        takeLatencyProbes(frame, false);
         return;
     }
 
-    if (submitTransfer(new Transfer(this, &mFramebuffer, sizeof mFramebuffer, FRAME))) {
-        mFrameWaitingForSubmit = false;
-        mNumFramesPending++;
+    takeLatencyProbes(frame, true);
+    gettimeofday(&mLastSubmitTime, NULL);
+
+    if (mHostTimingSupported && mHostTiming) {
+        writeFrameDuration(frame);
+    }
+    if (mScheduledFramesSupported && mFrameScheduleMillis) {
+        writeFrameSchedule(frame);
+    }
+
+    /*
+     * With a current limit, dim before a brighter frame goes out, but only brighten
+     * again after a dimmer one. The firmware applies the dimmer right away, while it's
+     * still fading from the last frame, so either order keeps the LEDs within budget.
+     */
+    uint32_t currentScale = mCurrentScale;
+    if (mCurrentLimiter.isEnabled()) {
+        currentScale = mCurrentLimiter.limit(estimateCurrent(frame));
+        if (currentScale < mCurrentScale) {
+            setCurrentScale(currentScale);
+        }
+    }
+
+    bool partial = mPartialFramesSupported && mPartialFrames && mLastFramebufferValid;
+    const Packet *packets = frame.packets;
+    unsigned count = mFramebufferPackets;
+    bool rle = false;
+
+    if (partial) {
+        packets = mPartialFramebuffer;
+        count = packPartialFrame(frame);
     }
+
+    if (mRLEFramesSupported && mRLEFrames && count > 1) {
+        unsigned rleCount = packRLEFrame(frame, count - 1);
+        if (rleCount) {
+            packets = mRLEFramebuffer;
+            count = rleCount;
+            partial = false;
+            rle = true;
+        }
+    }
+
+    unsigned length = sizeof(Packet) * count;
+    if (submitTransfer(packets, length, FRAME)) {
+        __atomic_add_fetch(&mNumFramesPending, 1, __ATOMIC_RELAXED);
+        mFramesSubmitted++;
+        mFrameBytesSent += length;
+        Metrics::add(Metrics::FRAMES_SUBMITTED);
+
+        if (partial) {
+            mPartialFramesSent++;
+        }
+        if (rle) {
+            mRLEFramesSent++;
+        }
+
+        if (mSkipUnchanged || mPartialFramesSupported) {
+            memcpy(mLastFramebuffer, frame.packets, sizeof(Packet) * mFramebufferPackets);
+            gettimeofday(&mLastFrameTime, NULL);
+            mLastFramebufferValid = true;
+        }
+    }
+
+    if (currentScale > mCurrentScale) {
+        setCurrentScale(currentScale);
+    }
+}
+
+uint32_t FCDevice::estimateCurrent(Frame &frame)
+{
+    // Total for the frame, in microamps, at the configured master dimmer
+
+    uint64_t total = 0;
+    for (unsigned i = 0; i < mNumPixels; ++i) {
+        const uint8_t *pixel = packetPixel(frame.packets, i);
+        total += mCurrentLimiter.pixelMicroamps(pixel[0], pixel[1], pixel[2]);
+    }
+
+    if (mFirmwareConfig.data[0] & CFLAG_BRIGHTNESS) {
+        unsigned brightness16 = mFirmwareConfig.data[1] | (mFirmwareConfig.data[2] << 8);
+        total = total * brightness16 / 0xFFFF;
+    }
+
+    return std::min<uint64_t>(total, 0xFFFFFFFF);
+}
+
+void FCDevice::setCurrentScale(uint32_t scale)
+{
+    mCurrentScale = scale;
+    writeFirmwareConfiguration();
+}
+
+void FCDevice::writeFrameDuration(Frame &frame)
+{
+    /*
+     * Time between when this frame and the last frame we submitted were written.
+     * Coalesced frames in between don't count, since the device never sees them.
+     */
+
+    int64_t millis = 0;
+    if (mLastSubmittedWrittenTime.tv_sec) {
+        millis = int64_t(frame.written.tv_sec - mLastSubmittedWrittenTime.tv_sec) * 1000 +
+            (frame.written.tv_usec - mLastSubmittedWrittenTime.tv_usec) / 1000;
+        millis = std::max<int64_t>(1, std::min<int64_t>(0xFFFF, millis));
+    }
+    mLastSubmittedWrittenTime = frame.written;
+
+    Packet &last = frame.packets[mFramebufferPackets - 1];
+    last.data[sizeof last.data - 2] = uint8_t(millis);
+    last.data[sizeof last.data - 1] = uint8_t(millis >> 8);
+}
+
+void FCDevice::writeFrameSchedule(Frame &frame)
+{
+    /*
+     * Show this frame mFrameScheduleMillis after it was written, in microseconds on our
+     * clock, truncated to 32 bits. Zero means unscheduled, so skip that one value.
+     * The first clock sync goes out ahead of the first frame, so the device has it.
+     */
+
+    if (!mLastClockSyncTime.tv_sec) {
+        writeClockSync();
+    }
+
+    uint32_t time = uint32_t(timeMicros(frame.written) + mFrameScheduleMillis * 1000);
+    if (!time) {
+        time = 1;
+    }
+
+    Packet &last = frame.packets[mFramebufferPackets - 1];
+    uint8_t *p = &last.data[sizeof last.data - 6];
+    p[0] = uint8_t(time);
+    p[1] = uint8_t(time >> 8);
+    p[2] = uint8_t(time >> 16);
+    p[3] = uint8_t(time >> 24);
+}
+
+void FCDevice::writeClockSync()
+{
+    /*
+     * Tell the device our clock, in microseconds. It's stamped as the transfer is
+     * submitted, so frames show later by however long it takes to reach the device.
+     * The firmware keeps the quickest sync it's seen, so that's about the same on every
+     * board. Resending it keeps crystal drift in check.
+     */
+
+    gettimeofday(&mLastClockSyncTime, NULL);
+    uint32_t time = uint32_t(timeMicros(mLastClockSyncTime));
+
+    memset(&mClockSyncPacket, 0, sizeof mClockSyncPacket);
+    mClockSyncPacket.control = TYPE_CONFIG | INDEX_CLOCK_SYNC;
+    mClockSyncPacket.data[0] = uint8_t(time);
+    mClockSyncPacket.data[1] = uint8_t(time >> 8);
+    mClockSyncPacket.data[2] = uint8_t(time >> 16);
+    mClockSyncPacket.data[3] = uint8_t(time >> 24);
+
+    if (!submitTransfer(&mClockSyncPacket, sizeof mClockSyncPacket)) {
+        // Try again with the next frame
+        memset(&mLastClockSyncTime, 0, sizeof mLastClockSyncTime);
+    }
+}
+
+unsigned FCDevice::packPartialFrame(const Frame &frame)
+{
+    /*
+     * Pack the packets that differ from mLastFramebuffer into mPartialFramebuffer,
+     * and return how many there are. The last one packed gets the FINAL bit. If nothing
+     * changed, the frame's last packet alone still commits a new keyframe.
+     */
+
+    unsigned count = 0;
+    for (unsigned i = 0; i < mFramebufferPackets; ++i) {
+        if (memcmp(&frame.packets[i], &mLastFramebuffer[i], sizeof(Packet))) {
+            mPartialFramebuffer[count] = frame.packets[i];
+            mPartialFramebuffer[count].control &= ~FINAL;
+            count++;
+        }
+    }
+
+    if (!count) {
+        mPartialFramebuffer[count++] = frame.packets[mFramebufferPackets - 1];
+    }
+
+    mPartialFramebuffer[count - 1].control |= FINAL;
+    return count;
+}
+
+unsigned FCDevice::packRLEFrame(Frame &frame, unsigned limit)
+{
+    /*
+     * Run-length encode the frame into mRLEFramebuffer, and return how many
+     * packets it took. Gives up and returns zero past 'limit' packets, since then the
+     * frame is smaller as it is.
+     *
+     * After each packet's sequence number, each op is a header byte: 0x01 - 0x7F for that
+     * many literal pixels, or 0x80 - 0xFF for one pixel repeated (header - 0x7F) times.
+     * Ops don't span packets, and a zero header ends a packet early. Pixels are numbered
+     * by packet slot, so the unused slots at the end of the last packet are encoded too,
+     * frame duration included.
+     */
+
+    unsigned numSlots = mFramebufferPackets * PIXELS_PER_PACKET;
+    unsigned count = 0;
+    unsigned used = sizeof(Packet);
+    unsigned slot = 0;
+    Packet *packets = frame.packets;
+
+    while (slot < numSlots) {
+        const uint8_t *pixel = packetPixel(packets, slot);
+        unsigned run = 1;
+        while (run < RLE_MAX_RUN && slot + run < numSlots && !memcmp(packetPixel(packets, slot + run), pixel, 3)) {
+            run++;
+        }
+
+        // Start a new packet unless this one has room for an op with one pixel
+        if (used + 4 > sizeof(Packet)) {
+            if (count == limit) {
+                return 0;
+            }
+            memset(&mRLEFramebuffer[count], 0, sizeof(Packet));
+            mRLEFramebuffer[count].control = TYPE_CONFIG | INDEX_RLE_FRAME;
+            mRLEFramebuffer[count].data[0] = count;
+            count++;
+            used = 2;
+        }
+        uint8_t *op = (uint8_t*) &mRLEFramebuffer[count - 1] + used;
+
+        if (run > 1) {
+            op[0] = 0x7F + run;
+            memcpy(op + 1, pixel, 3);
+            used += 4;
+            slot += run;
+
+        } else {
+            // Literal pixels, up to where the next run starts or this packet ends
+            unsigned room = (sizeof(Packet) - used - 1) / 3;
+            unsigned n = 1;
+            while (n < room && slot + n < numSlots &&
+                (slot + n + 1 == numSlots || memcmp(packetPixel(packets, slot + n), packetPixel(packets, slot + n + 1), 3))) {
+                n++;
+            }
+
+            op[0] = n;
+            for (unsigned i = 0; i < n; ++i) {
+                memcpy(op + 1 + 3 * i, packetPixel(packets, slot + i), 3);
+            }
+            used += 1 + 3 * n;
+            slot += n;
+        }
+    }
+
+    mRLEFramebuffer[count - 1].control |= FINAL;
+    return count;
+}
+
+bool FCDevice::isFrameRedundant(const Frame &frame)
+{
+    /*
+     * Is the frame identical to the last frame we submitted, recently enough that we
+     * don't need to send it again as a keepalive? Frame timing isn't stamped on the new
+     * frame yet, so the bytes it goes in are left out of the comparison.
+     */
+
+    unsigned timingBytes = mScheduledFramesSupported ? 6 : mHostTimingSupported ? 2 : 0;
+    if (memcmp(mLastFramebuffer, frame.packets, sizeof(Packet) * mFramebufferPackets - timingBytes)) {
+        return false;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int64_t elapsedMillis = int64_t(now.tv_sec - mLastFrameTime.tv_sec) * 1000 +
+        (now.tv_usec - mLastFrameTime.tv_usec) / 1000;
+    return elapsedMillis >= 0 && elapsedMillis < mKeepaliveMillis;
 }
 
 void FCDevice::writeMessage(Document &msg)
@@ -396,11 +1246,14 @@ void FCDevice::writeMessage(Document &msg)
 
     if (!strcmp(type, "device_options")) {
         /*
-         * TODO: Eventually this should turn into the same thing as 
-         *       loadConfiguration() and it shouldn't be device-specific,
-         *       but for now most of fcserver assumes the configuration is static.
+         * Firmware options for this one device, until the next reload. Changing the
+         * whole device configuration goes through the server's "server_reload".
          */
+        tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
         writeFirmwareConfiguration(msg["options"]);
+        if (msg["options"].IsObject()) {
+            setFrameQueueDepth(msg["options"]["frameQueueDepth"]);
+        }
         return;
     }
 
@@ -428,11 +1281,15 @@ void FCDevice::writeDevicePixels(Document &msg)
     if (!pixels.IsArray()) {
         msg.AddMember("error", "Pixel array is missing", msg.GetAllocator());
     } else {
+        tthread::lock_guard<tthread::mutex> lock(mFramebufferMutex);
+
+        // Raw pixels are 8-bit, and they replace any 16-bit frame
+        mHighDepth = false;
 
         // Truncate to the framebuffer size, and only deal in whole pixels.
         int numPixels = pixels.Size() / 3;
-        if (numPixels > NUM_PIXELS)
-            numPixels = NUM_PIXELS;
+        if (numPixels > int(mNumPixels))
+            numPixels = int(mNumPixels);
 
         for (int i = 0; i < numPixels; i++) {
             uint8_t *out = fbPixel(i);
@@ -450,6 +1307,27 @@ void FCDevice::writeDevicePixels(Document &msg)
     }
 }
 
+void FCDevice::writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count)
+{
+    /*
+     * The same as above, for a pixel array that JsonPixelReader already clamped
+     * to bytes while parsing. 'msg' no longer has a "pixels" member.
+     */
+
+    unsigned numPixels = count / 3;
+    if (numPixels > mNumPixels)
+        numPixels = mNumPixels;
+
+    tthread::lock_guard<tthread::mutex> lock(mFramebufferMutex);
+    mHighDepth = false;
+
+    for (unsigned i = 0; i < numPixels; i++) {
+        memcpy(fbPixel(i), pixels + i*3, 3);
+    }
+
+    writeFramebuffer();
+}
+
 void FCDevice::writeMessage(const OPC::Message &msg)
 {
     /*
@@ -459,13 +1337,25 @@ void FCDevice::writeMessage(const OPC::Message &msg)
     switch (msg.command) {
 
         case OPC::SetPixelColors:
-            opcSetPixelColors(msg);
-            writeFramebuffer();
+        case OPC::SetPixelColors16: {
+            // Only send a frame if this message touched any of our pixels
+            tthread::lock_guard<tthread::mutex> lock(mFramebufferMutex);
+            if (msg.command == OPC::SetPixelColors ? opcSetPixelColors(msg) : opcSetPixelColors16(msg)) {
+                if (mFrameBarrier) {
+                    mFrameHeld = true;
+                } else {
+                    writeFramebuffer();
+                }
+            }
             return;
+        }
 
-        case OPC::SystemExclusive:
+        case OPC::SystemExclusive: {
+            // Settings go out with the transfers flush() manages
+            tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
             opcSysEx(msg);
             return;
+        }
     }
 
     if (mVerbose) {
@@ -482,12 +1372,7 @@ void FCDevice::opcSysEx(const OPC::Message &msg)
         return;
     }
 
-    unsigned id = (unsigned(msg.data[0]) << 24) |
-                  (unsigned(msg.data[1]) << 16) |
-                  (unsigned(msg.data[2]) << 8)  |
-                   unsigned(msg.data[3])        ;
-
-    switch (id) {
+    switch (msg.sysExID()) {
 
         case OPC::FCSetGlobalColorCorrection:
             return opcSetGlobalColorCorrection(msg);
@@ -495,159 +1380,103 @@ void FCDevice::opcSysEx(const OPC::Message &msg)
         case OPC::FCSetFirmwareConfiguration:
             return opcSetFirmwareConfiguration(msg);
 
+        case OPC::FCSetDeviceColorCorrection:
+            return opcSetDeviceColorCorrection(msg);
+
+        case OPC::FCLatencyProbe:
+            return opcLatencyProbe(msg);
+
     }
 
     // Quietly ignore unhandled SysEx messages.
 }
 
-void FCDevice::opcSetPixelColors(const OPC::Message &msg)
+bool FCDevice::opcSetPixelColors(const OPC::Message &msg)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Run through our device's compiled mapping, and store any relevant portions of 'msg'
+     * directly into the USB packets of our framebuffer. Returns true if any pixels were stored.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
-        return;
+    if (mHighDepth) {
+        // 8-bit colors in 16-bit planes: each value x becomes x * 0x101
+        mPixelMap.apply(msg, (uint8_t*) mFramebufferLow);
+        return mPixelMap.apply(msg, (uint8_t*) mFramebufferHigh);
     }
 
-    const Value &map = *mConfigMap;
-    for (unsigned i = 0, e = map.Size(); i != e; i++) {
-        opcMapPixelColors(msg, map[i]);
-    }
+    return mPixelMap.apply(msg, (uint8_t*) mFramebuffer);
 }
 
-void FCDevice::opcMapPixelColors(const OPC::Message &msg, const Value &inst)
+bool FCDevice::opcSetPixelColors16(const OPC::Message &msg)
 {
     /*
-     * Parse one JSON mapping instruction, and copy any relevant parts of 'msg'
-     * into our framebuffer. This looks for any mapping instructions that we
-     * recognize:
+     * 16-bit colors, big-endian. The message is split into a high byte and a low
+     * byte message, and each one is mapped into its own plane with the usual spans.
+     * Luminosity spans average each plane separately, so they're approximate here.
      *
-     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
-     *   [ OPC Channel, First OPC Pixel, First output pixel, Color channels ]
-     */
-
-    unsigned msgPixelCount = msg.length() / 3;
-
-    if (inst.IsArray() && inst.Size() == 4) {
-        // Map a range from an OPC channel to our framebuffer
-
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()) {
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            } else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
+     * The firmware only has room for 8-bit keyframes. Once we've seen 16-bit pixels,
+     * writeFramebuffer() dithers the planes into mFramebuffer on every frame,
+     * so the extra precision comes through in the average over time.
+     */
 
-            if (channel != msg.channel) {
-                return;
-            }
+    unsigned count = msg.length() / 6 * 3;
+    unsigned planeBytes = OPC::HEADER_BYTES + count;
+    mPlaneMessages.resize(planeBytes * 2);
 
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, unsigned(NUM_PIXELS));
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                    direction > 0 ? NUM_PIXELS - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            while (count--) {
-                uint8_t *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-                outPtr[0] = inPtr[0];
-                outPtr[1] = inPtr[1];
-                outPtr[2] = inPtr[2];
-                inPtr += 3;
-            }
+    OPC::Message *high = (OPC::Message*) &mPlaneMessages[0];
+    OPC::Message *low = (OPC::Message*) &mPlaneMessages[planeBytes];
 
-            return;
-        }
+    high->channel = low->channel = msg.channel;
+    high->command = low->command = OPC::SetPixelColors;
+    high->setLength(count);
+    low->setLength(count);
+
+    for (unsigned i = 0; i < count; ++i) {
+        high->data[i] = msg.data[i * 2];
+        low->data[i] = msg.data[i * 2 + 1];
     }
 
-    if (inst.IsArray() && inst.Size() == 5) {
-        // Map a range from an OPC channel to our framebuffer, with color channel swizzling
+    if (!mHighDepth) {
+        // Start from the current 8-bit pixels
+        mHighDepth = true;
+        memcpy(mFramebufferHigh, mFramebuffer, sizeof(Packet) * mFramebufferPackets);
+        memcpy(mFramebufferLow, mFramebuffer, sizeof(Packet) * mFramebufferPackets);
+        memset(mResidual, 0, sizeof mResidual);
+    }
 
-        const Value &vChannel = inst[0u];
-        const Value &vFirstOPC = inst[1];
-        const Value &vFirstOut = inst[2];
-        const Value &vCount = inst[3];
-        const Value &vColorChannels = inst[4];
+    mPixelMap.apply(*low, (uint8_t*) mFramebufferLow);
+    return mPixelMap.apply(*high, (uint8_t*) mFramebufferHigh);
+}
 
-        if (vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt()
-            && vColorChannels.IsString() && vColorChannels.GetStringLength() == 3) {
+void FCDevice::ditherFramebuffer()
+{
+    /*
+     * Round the 16-bit planes to 8 bits in mFramebuffer. Like the firmware's own
+     * dithering, each channel's rounding error is carried into the next frame, and
+     * an 8-bit value x stands for x * 257. With dithering turned off, this just rounds.
+     */
 
-            unsigned channel = vChannel.GetUint();
-            unsigned firstOPC = vFirstOPC.GetUint();
-            unsigned firstOut = vFirstOut.GetUint();
-            unsigned count;
-            int direction;
-            if (vCount.GetInt() >= 0) {
-                count = vCount.GetInt();
-                direction = 1;
-            } else {
-                count = -vCount.GetInt();
-                direction = -1;
-            }
-            const char *colorChannels = vColorChannels.GetString();
+    int16_t *residual = mResidual;
 
-            if (channel != msg.channel) {
-                return;
+    for (unsigned p = 0; p < mFramebufferPackets; ++p) {
+        for (unsigned i = 0; i < sizeof mFramebuffer[p].data; ++i, ++residual) {
+            int value = (int(mFramebufferHigh[p].data[i]) << 8) | mFramebufferLow[p].data[i];
+            if (mDither) {
+                value += *residual;
             }
 
-            // Clamping, overflow-safe
-            firstOPC = std::min<unsigned>(firstOPC, msgPixelCount);
-            firstOut = std::min<unsigned>(firstOut, unsigned(NUM_PIXELS));
-            count = std::min<unsigned>(count, msgPixelCount - firstOPC);
-            count = std::min<unsigned>(count,
-                    direction > 0 ? NUM_PIXELS - firstOut : firstOut + 1);
-
-            // Copy pixels
-            const uint8_t *inPtr = msg.data + (firstOPC * 3);
-            unsigned outIndex = firstOut;
-            bool success = true;
-            while (count--) {
-                uint8_t *outPtr = fbPixel(outIndex);
-                outIndex += direction;
-
-                for (int channel = 0; channel < 3; channel++) {
-                    if (!OPC::pickColorChannel(outPtr[channel], colorChannels[channel], inPtr)) {
-                        success = false;
-                        break;
-                    }
-                }
-
-                inPtr += 3;
+            // The residual may take us a little past either end, so clamp
+            int out = (value + 0x80) >> 8;
+            if (out < 0) {
+                out = 0;
+            } else if (out > 0xFF) {
+                out = 0xFF;
             }
 
-            if (success) {
-                return;
-            }
+            *residual = value - out * 257;
+            mFramebuffer[p].data[i] = out;
         }
     }
-
-    // Still haven't found a match?
-    if (mVerbose) {
-        rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
-        rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
-        inst.Accept(writer);
-        std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
-    }
 }
 
 void FCDevice::opcSetGlobalColorCorrection(const OPC::Message &msg)
@@ -679,6 +1508,91 @@ void FCDevice::opcSetGlobalColorCorrection(const OPC::Message &msg)
     writeColorCorrection(doc);
 }
 
+void FCDevice::opcSetDeviceColorCorrection(const OPC::Message &msg)
+{
+    /*
+     * Binary gamma and whitepoint for individual devices, cheap enough to send with
+     * every frame. The message holds any number of fixed-size records, big-endian:
+     *
+     *   16 bytes   Serial number, NUL-padded. All zeroes matches every device.
+     *    2 bytes   Gamma, 8.8 fixed point
+     *    6 bytes   Whitepoint red, green and blue, 4.12 fixed point
+     *
+     * The linear section of the curve stays as it was. The last matching record wins.
+     */
+
+    const unsigned length = msg.length() - 4;
+    if (length % DEVICE_COLOR_RECORD_BYTES) {
+        if (mVerbose) {
+            std::clog << "Device color correction SysEx must be a list of " << DEVICE_COLOR_RECORD_BYTES
+                << "-byte records\n";
+        }
+        return;
+    }
+
+    const uint8_t *match = 0;
+
+    for (const uint8_t *record = msg.data + 4, *end = record + length; record != end;
+        record += DEVICE_COLOR_RECORD_BYTES) {
+
+        bool everyDevice = true;
+        for (unsigned i = 0; i < DEVICE_COLOR_SERIAL_BYTES; ++i) {
+            everyDevice = everyDevice && record[i] == 0;
+        }
+
+        if (everyDevice || !strncmp((const char*) record, mSerialString, DEVICE_COLOR_SERIAL_BYTES)) {
+            match = record;
+        }
+    }
+
+    if (!match) {
+        return;
+    }
+
+    const uint8_t *p = match + DEVICE_COLOR_SERIAL_BYTES;
+    ColorCurve curve = mColorLUTCurve;
+    curve.setGamma(((unsigned(p[0]) << 8) | p[1]) / 256.0);
+    curve.setWhitepoint(
+        ((unsigned(p[2]) << 8) | p[3]) / 4096.0,
+        ((unsigned(p[4]) << 8) | p[5]) / 4096.0,
+        ((unsigned(p[6]) << 8) | p[7]) / 4096.0);
+
+    writeColorLUT(curve);
+}
+
+void FCDevice::opcLatencyProbe(const OPC::Message &msg)
+{
+    /*
+     * Follow the next frame this device writes, to measure its latency. Big-endian:
+     *
+     *   4 bytes   Sequence number
+     *   8 bytes   Client timestamp, in any units
+     *
+     * Both are reported back as they were. An armed probe that hasn't seen a frame yet
+     * is replaced by a newer one.
+     */
+
+    if (msg.length() - 4 != LATENCY_PROBE_BYTES) {
+        if (mVerbose) {
+            std::clog << "Latency probe SysEx must have " << LATENCY_PROBE_BYTES << " bytes of data\n";
+        }
+        return;
+    }
+
+    const uint8_t *data = msg.data + 4;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    tthread::lock_guard<tthread::mutex> lock(mFramebufferMutex);
+    memset(&mArmedProbe, 0, sizeof mArmedProbe);
+    mArmedProbe.sequence = (uint32_t(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+    for (unsigned i = 4; i < LATENCY_PROBE_BYTES; ++i) {
+        mArmedProbe.clientTime = (mArmedProbe.clientTime << 8) | data[i];
+    }
+    mArmedProbe.received = timeMicros(now);
+    mProbeArmed = true;
+}
+
 void FCDevice::opcSetFirmwareConfiguration(const OPC::Message &msg)
 {
     /*
@@ -691,8 +1605,26 @@ void FCDevice::opcSetFirmwareConfiguration(const OPC::Message &msg)
 
 void FCDevice::writeFirmwareConfiguration()
 {
-    // Write mFirmwareConfig to the device
-    submitTransfer(new Transfer(this, &mFirmwareConfig, sizeof mFirmwareConfig));
+    // Write mFirmwareConfig to the device, with the master dimmer turned down as far
+    // as the current limit needs. The packet gets its own buffer, since it may differ.
+
+    mSentFirmwareConfig = mFirmwareConfig;
+
+    mFramebufferMutex.lock();
+    mDither = !(mFirmwareConfig.data[0] & CFLAG_NO_DITHERING);
+    mFramebufferMutex.unlock();
+
+    if (mCurrentScale < 0x10000) {
+        uint8_t *data = mSentFirmwareConfig.data;
+        unsigned brightness16 = data[0] & CFLAG_BRIGHTNESS ? data[1] | (data[2] << 8) : 0xFFFF;
+        brightness16 = (brightness16 * mCurrentScale) >> 16;
+
+        data[0] |= CFLAG_BRIGHTNESS;
+        data[1] = uint8_t(brightness16);
+        data[2] = uint8_t(brightness16 >> 8);
+    }
+
+    mFirmwareConfigSent = submitTransfer(&mSentFirmwareConfig, sizeof mSentFirmwareConfig);
 }
 
 std::string FCDevice::getName()
@@ -707,7 +1639,119 @@ std::string FCDevice::getName()
 
 void FCDevice::describe(rapidjson::Value &object, Allocator &alloc)
 {
+    tthread::lock_guard<tthread::recursive_mutex> lock(mDeviceMutex);
     USBDevice::describe(object, alloc);
     object.AddMember("version", mVersionString, alloc);
     object.AddMember("bcd_version", mDD.bcdDevice, alloc);
+    object.AddMember("num_pixels", mNumPixels, alloc);
+    object.AddMember("frames_submitted", mFramesSubmitted, alloc);
+    object.AddMember("frames_coalesced", getFramesCoalesced(), alloc);
+    object.AddMember("frame_bytes_sent", mFrameBytesSent, alloc);
+    object.AddMember("frame_queue_depth", mMaxFramesPending, alloc);
+    object.AddMember("refresh_rate", mRefreshRate, alloc);
+    object.AddMember("lut_packets_sent", mColorLUTPacketsSent, alloc);
+    object.AddMember("partial_frames_sent", mPartialFramesSent, alloc);
+    object.AddMember("rle_frames_sent", mRLEFramesSent, alloc);
+    object.AddMember("frame_schedule_ms",
+        mScheduledFramesSupported ? mFrameScheduleMillis : 0, alloc);
+    object.AddMember("frames_in_flight", mNumFramesPending, alloc);
+
+    // Average time from submitting a frame to its USB completion, in microseconds
+    uint64_t latency = mFramesCompleted ? mFrameLatencyMicros / mFramesCompleted : 0;
+    object.AddMember("frame_latency_us", latency, alloc);
+
+    mCurrentLimiter.describe(object, alloc);
+    describeFirmwareProfile(object, alloc);
+}
+
+void FCDevice::readProfileCounter()
+{
+    // Ask for the next counter of a sample. The reply comes back through flush().
+
+    if (!mProfileCounter) {
+        mProfileWanted = false;
+    }
+
+    Transfer *fct = mProfileTransfer;
+    libusb_fill_control_setup(fct->control, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR,
+        0x01, 0, mProfileCounter, 4);
+    libusb_fill_control_transfer(fct->transfer, mHandle, fct->control, completeTransfer, fct, 1000);
+    fct->type = PROFILE;
+    fct->finished = false;
+
+    int r = submitUSBTransfer(fct->transfer);
+    if (r < 0) {
+        // A stall means the firmware has no profile. Otherwise, try again when asked.
+        mProfileSupported = r != LIBUSB_ERROR_PIPE;
+        mProfileCounter = 0;
+    } else {
+        fct->pending = true;
+    }
+}
+
+void FCDevice::completeProfileRead(Transfer *fct)
+{
+    /*
+     * Firmware without the CPU profile stalls these requests. Give up after the first
+     * one, so we don't keep asking. Any other failure just drops the sample.
+     */
+
+    libusb_transfer *transfer = fct->transfer;
+
+    if (transfer->status == LIBUSB_TRANSFER_STALL) {
+        mProfileSupported = false;
+        mProfileCounter = 0;
+        return;
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != 4) {
+        mProfileCounter = 0;
+        return;
+    }
+
+    const uint8_t *buffer = libusb_control_transfer_get_data(transfer);
+    mProfileNext.counters[mProfileCounter++] =
+        buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | (uint32_t(buffer[3]) << 24);
+
+    if (mProfileCounter == PROFILE_COUNTERS) {
+        gettimeofday(&mProfileNext.time, NULL);
+        mLastProfile = mProfile;
+        mProfile = mProfileNext;
+        mProfileSamples++;
+        mProfileCounter = 0;
+    }
+}
+
+void FCDevice::describeFirmwareProfile(rapidjson::Value &object, Allocator &alloc)
+{
+    // The newest sample we have, without waiting for USB. The first request has none yet.
+
+    if (!mProfileSupported) {
+        return;
+    }
+    mProfileWanted = true;
+
+    if (!mProfileSamples) {
+        return;
+    }
+
+    const uint32_t *p = mProfile.counters;
+    object.AddMember("fw_usb_buffers_free_min", p[PERF_USB_BUFFERS_FREE], alloc);
+    object.AddMember("fw_usb_deferred_packets", p[PERF_DEFERRED_PACKETS], alloc);
+    object.AddMember("fw_torn_frames", p[PERF_TORN_FRAMES], alloc);
+
+    if (mProfileSamples > 1) {
+        const uint32_t *last = mLastProfile.counters;
+        int64_t millis = (mProfile.time.tv_sec - mLastProfile.time.tv_sec) * 1000LL +
+            (mProfile.time.tv_usec - mLastProfile.time.tv_usec) / 1000;
+        uint32_t cycles = p[PERF_CYCLE_COUNTER] - last[PERF_CYCLE_COUNTER];
+
+        if (millis > 0 && millis < PROFILE_MAX_INTERVAL_MILLIS && cycles) {
+            object.AddMember("fw_frame_rate", (p[PERF_FRAME_COUNTER] - last[PERF_FRAME_COUNTER]) * 1000.0 / millis, alloc);
+            object.AddMember("fw_draw_percent", (p[PERF_DRAW_CYCLES] - last[PERF_DRAW_CYCLES]) * 100.0 / cycles, alloc);
+            object.AddMember("fw_usb_percent", (p[PERF_USB_CYCLES] - last[PERF_USB_CYCLES]) * 100.0 / cycles, alloc);
+            object.AddMember("fw_show_wait_percent", (p[PERF_SHOW_CYCLES] - last[PERF_SHOW_CYCLES]) * 100.0 / cycles, alloc);
+            object.AddMember("fw_usb_deferred_rate",
+                (p[PERF_DEFERRED_PACKETS] - last[PERF_DEFERRED_PACKETS]) * 1000.0 / millis, alloc);
+        }
+    }
 }
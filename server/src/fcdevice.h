@@ -24,13 +24,17 @@
 #pragma once
 #include "usbdevice.h"
 #include "opc.h"
-#include <set>
+#include "pixelmap.h"
+#include "colorcurve.h"
+#include "currentlimiter.h"
+#include "tinythread.h"
+#include <vector>
 
 
 class FCDevice : public USBDevice
 {
 public:
-    FCDevice(libusb_device *device, bool verbose);
+    FCDevice(libusb_device *device, bool verbose, const char *type = "fadecandy");
     virtual ~FCDevice();
 
     static bool probe(libusb_device *device);
@@ -39,83 +43,409 @@ public:
     virtual void loadConfiguration(const Value &config);
     virtual void writeMessage(const OPC::Message &msg);
     virtual void writeMessage(Document &msg);
+    virtual void writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count);
+    virtual bool usesOpcChannel(unsigned channel);
     virtual void writeColorCorrection(const Value &color);
     virtual std::string getName();
     virtual void flush();
+    virtual int flushTimeoutMillis();
+    virtual bool hasPixelLock();
+    virtual bool isQueueFull();
+    virtual bool readPixels(std::vector<uint8_t> &rgb, unsigned step);
+    virtual void readLatencyProbes(std::vector<LatencyProbe> &probes);
+    virtual void setFrameBarrier(bool enabled);
+    virtual void commitFrame();
+    virtual void syncClock();
     virtual void describe(rapidjson::Value &object, Allocator &alloc);
 
+    // Pixels on a standard Fadecandy. Firmware built for longer strips reports more.
     static const unsigned NUM_PIXELS = 512;
 
-    // Send current buffer contents
+    unsigned getNumPixels() { return mNumPixels; }
+
+    /*
+     * Pixels are written into fbPixel() by any thread holding the framebuffer mutex,
+     * then writeFramebuffer() publishes them to be sent by flush(). The server's event
+     * lock isn't needed for either.
+     */
+    tthread::mutex &getFramebufferMutex() { return mFramebufferMutex; }
     void writeFramebuffer();
 
+    /*
+     * Benchmark support. Firmware performance counters are read with a vendor control
+     * request: counter 0 is frames rendered, counter 1 is keyframes received. Frame
+     * completion latency is kept as a histogram with LATENCY_BUCKET_MICROS per bucket.
+     *
+     * Newer firmware also has a CPU profile: running totals of CPU cycles spent drawing,
+     * in the USB packet handler, and in leds.show() waiting on DMA, next to a snapshot
+     * of the cycle counter itself. Plus the fewest free USB buffers seen since reset.
+     */
+    static const unsigned PERF_FRAME_COUNTER = 0;
+    static const unsigned PERF_KEYFRAME_COUNTER = 1;
+    static const unsigned PERF_CYCLE_COUNTER = 2;
+    static const unsigned PERF_DRAW_CYCLES = 3;
+    static const unsigned PERF_USB_CYCLES = 4;
+    static const unsigned PERF_SHOW_CYCLES = 5;
+    static const unsigned PERF_USB_BUFFERS_FREE = 6;
+    static const unsigned PERF_DEFERRED_PACKETS = 7;
+    static const unsigned PERF_TORN_FRAMES = 8;
+    static const unsigned LATENCY_BUCKETS = 500;
+    static const unsigned LATENCY_BUCKET_MICROS = 100;
+
+    virtual bool readPerfCounter(unsigned index, uint32_t &value);
+    void resetFrameStats();
+    unsigned latencyPercentile(double fraction);
+    uint64_t getFramesSubmitted() { return mFramesSubmitted; }
+    uint64_t getFrameBytesSent() { return mFrameBytesSent; }
+    uint64_t getFramesCoalesced() { return __atomic_load_n(&mFramesCoalesced, __ATOMIC_RELAXED); }
+
     // Framebuffer accessor
-    uint8_t *fbPixel(unsigned num) {
-        return &mFramebuffer[num / PIXELS_PER_PACKET].data[3 * (num % PIXELS_PER_PACKET)];
-    }
- 
+    uint8_t *fbPixel(unsigned num) { return packetPixel(mFramebuffer, num); }
+
+protected:
+    // Identity, filled in by open()
+    char mSerialBuffer[256];
+    char mVersionString[10];
+    libusb_device_descriptor mDD;
+
+    // Hand a filled-in transfer to the USB stack. Its callback runs when it completes.
+    virtual int submitUSBTransfer(libusb_transfer *transfer);
+
 private:
     static const unsigned PIXELS_PER_PACKET = 21;
     static const unsigned LUT_ENTRIES_PER_PACKET = 31;
     static const unsigned FRAMEBUFFER_PACKETS = 25;
+    static const unsigned MAX_FRAMEBUFFER_PACKETS = 64;
     static const unsigned LUT_PACKETS = 25;
     static const unsigned LUT_ENTRIES = 257;
     static const unsigned OUT_ENDPOINT = 1;
-    static const unsigned MAX_FRAMES_PENDING = 2;
+    static const unsigned DEFAULT_FRAMES_PENDING = 2;
+    static const unsigned MAX_FRAMES_PENDING = 8;
+    static const unsigned DEFAULT_KEEPALIVE_MILLIS = 1000;
+    static const unsigned MAX_REFRESH_RATE = 1000;
 
     static const uint8_t TYPE_FRAMEBUFFER = 0x00;
     static const uint8_t TYPE_LUT = 0x40;
     static const uint8_t TYPE_CONFIG = 0x80;
+    static const uint8_t TYPE_FRAMEBUFFER_HI = 0xC0;
+    static const uint8_t INDEX_BITS = 0x1F;
+    static const uint8_t INDEX_RLE_FRAME = 1;       // Config packet index for RLE pixels
+    static const uint8_t INDEX_CLOCK_SYNC = 2;      // Config packet index for our clock
+
+    // Feature flags, reported along with the LED capacity
+    static const uint32_t FEATURE_PARTIAL_FRAMES = (1 << 0);
+    static const uint32_t FEATURE_HOST_TIMING = (1 << 1);
+    static const uint32_t FEATURE_RLE_FRAMES = (1 << 2);
+    static const uint32_t FEATURE_SCHEDULED_FRAMES = (1 << 4);
     static const uint8_t FINAL = 0x20;
 
     static const uint8_t CFLAG_NO_DITHERING     = (1 << 0);
     static const uint8_t CFLAG_NO_INTERPOLATION = (1 << 1);
     static const uint8_t CFLAG_NO_ACTIVITY_LED  = (1 << 2);
     static const uint8_t CFLAG_LED_CONTROL      = (1 << 3);
+    static const uint8_t CFLAG_BRIGHTNESS       = (1 << 5);
+    static const uint8_t CFLAG_FRAME_CHECK      = (1 << 6);
 
     struct Packet {
         uint8_t control;
         uint8_t data[63];
     };
 
+    static uint8_t *packetPixel(Packet *packets, unsigned num) {
+        return &packets[num / PIXELS_PER_PACKET].data[3 * (num % PIXELS_PER_PACKET)];
+    }
+
+    static const unsigned FRAMEBUFFER_BYTES = 63 * MAX_FRAMEBUFFER_PACKETS;
+
     enum PacketType {
         OTHER = 0,
         FRAME,
+        PROFILE,
     };
 
+    // Largest transfer we send: a whole framebuffer or color LUT
+    static const unsigned MAX_TRANSFER_BYTES = sizeof(Packet) * MAX_FRAMEBUFFER_PACKETS;
+
+    // Transfers are preallocated. Room for a full frame queue, plus LUT and config packets.
+    static const unsigned NUM_TRANSFERS = MAX_FRAMES_PENDING + 8;
+
     struct Transfer {
-        Transfer(FCDevice *device, void *buffer, int length, PacketType type = OTHER);
+        Transfer(FCDevice *device);
         ~Transfer();
+        void fill(const void *buffer, int length, PacketType type);
+        FCDevice *device;
         libusb_transfer *transfer;
         #if NEED_COPY_USB_TRANSFER_BUFFER
-          void *bufferCopy;
+          uint8_t bufferCopy[MAX_TRANSFER_BYTES];
         #endif
         PacketType type;
+        uint8_t control[LIBUSB_CONTROL_SETUP_SIZE + 4];
+        struct timeval submitted;
+        struct timeval completed;
+        bool probed;
+        LatencyProbe probe;
+        bool pending;
         bool finished;
+        bool orphaned;
     };
 
-    const Value *mConfigMap;
-    std::set<Transfer*> mPending;
-    int mNumFramesPending;
-    bool mFrameWaitingForSubmit;
+    PixelLayout mLayout;
+    PixelMap mPixelMap;
+    Transfer *mTransfers[NUM_TRANSFERS];
+    Transfer *mFreeTransfers[NUM_TRANSFERS];
+    unsigned mNumFreeTransfers;
 
-    char mSerialBuffer[256];
-    char mVersionString[10];
+    // Transfers that libusb has completed, waiting for flush(). The pool, plus mProfileTransfer.
+    Transfer *mCompletedTransfers[NUM_TRANSFERS + 1];
+    unsigned mNumCompletedTransfers;
 
-    libusb_device_descriptor mDD;
-    Packet mFramebuffer[FRAMEBUFFER_PACKETS];
+    // Always written atomically, since isQueueFull() reads these from other threads
+    unsigned mNumFramesPending;
+    unsigned mMaxFramesPending;
+
+    /*
+     * Finished frames go from writeFramebuffer() to flush() through a triple buffer, so
+     * neither side waits on the other. Producers own mWriteFrame and flush() owns
+     * mReadFrame. The third slot is in mSharedFrame, which is only ever exchanged
+     * atomically, with FRAME_FRESH set if it holds a frame flush() hasn't taken yet.
+     * Publishing over a fresh frame replaces it, and counts as a coalesced frame.
+     *
+     * The producer side, mFramebuffer onwards, is protected by mFramebufferMutex, which
+     * only producers contend for. Everything flush() touches is under mDeviceMutex.
+     */
+    struct Frame {
+        Packet packets[MAX_FRAMEBUFFER_PACKETS];
+        struct timeval written;
+        uint64_t sequence;
+    };
+
+    static const unsigned FRAME_INDEX = 0x3;
+    static const unsigned FRAME_FRESH = 0x4;
+
+    Frame mFrames[3];
+    unsigned mWriteFrame;
+    unsigned mReadFrame;
+    unsigned mSharedFrame;
+    uint64_t mFramesWritten;
+    tthread::mutex mFramebufferMutex;
+
+    bool isFrameWaiting() { return (__atomic_load_n(&mSharedFrame, __ATOMIC_ACQUIRE) & FRAME_FRESH) != 0; }
+
+    /*
+     * Optional cap on frames per second, zero for none. A waiting frame stays in the
+     * shared slot until the interval since the last submitted frame is up, so a
+     * fast client only costs this device the frames it can use.
+     */
+    unsigned mRefreshRate;
+    struct timeval mLastSubmitTime;
+    bool isRefreshDue();
+
+    /*
+     * Latency probes. A probe SysEx is armed until the next frame is written, then waits
+     * in mPendingProbes with that frame's sequence number. flush() picks it up along
+     * with the frame, or a newer one that replaced it, and it rides in the Transfer.
+     * flush() finishes it when the transfer completes, and it waits in mFinishedProbes
+     * for readLatencyProbes(). Only mPendingProbes is shared, under mProbeMutex.
+     */
+    static const unsigned LATENCY_PROBE_BYTES = 12;
+    static const unsigned MAX_FINISHED_PROBES = 64;
+
+    struct PendingProbe {
+        uint64_t frame;
+        LatencyProbe probe;
+    };
+
+    bool mProbeArmed;
+    bool mFrameProbed;
+    LatencyProbe mArmedProbe;
+    LatencyProbe mFrameProbe;
+    std::vector<PendingProbe> mPendingProbes;
+    tthread::mutex mProbeMutex;
+    std::vector<LatencyProbe> mFinishedProbes;
+    void takeLatencyProbes(const Frame &frame, bool sending);
+    void finishLatencyProbe(const LatencyProbe &probe);
+
+    // With a frame barrier, mFramebuffer is only written out by commitFrame(). Producer side.
+    bool mFrameBarrier;
+    bool mFrameHeld;
+
+    // Frame statistics
+    uint64_t mFramesSubmitted;
+    uint64_t mFramesCoalesced;
+    uint64_t mFrameBytesSent;
+    uint64_t mFramesCompleted;
+    uint64_t mFrameLatencyMicros;
+    uint32_t mLatencyHistogram[LATENCY_BUCKETS];
+
+    // Optionally skip frames identical to the last one we sent, up to a keepalive interval
+    bool mSkipUnchanged;
+    unsigned mKeepaliveMillis;
+    struct timeval mLastFrameTime;
+
+    /*
+     * Framebuffer size, as reported by the firmware. Storage is sized for the largest
+     * supported strip; only the first mFramebufferPackets packets are sent. mFramebuffer
+     * is where producers map pixels; mLastFramebuffer is the last frame flush() sent.
+     */
+    unsigned mNumPixels;
+    unsigned mFramebufferPackets;
+
+    Packet mFramebuffer[MAX_FRAMEBUFFER_PACKETS];
+    Packet mLastFramebuffer[MAX_FRAMEBUFFER_PACKETS];
+
+    /*
+     * Partial frames. Firmware with FEATURE_PARTIAL_FRAMES carries forward any packets
+     * a frame leaves out, so we can send only the packets that changed since the last
+     * frame. That needs mLastFramebuffer to match the device, so the first frame, and
+     * any frame after a failed transfer, is sent whole.
+     */
+    bool mPartialFramesSupported;
+    bool mPartialFrames;
+    bool mLastFramebufferValid;
+    uint64_t mPartialFramesSent;
+    Packet mPartialFramebuffer[MAX_FRAMEBUFFER_PACKETS];
+    unsigned packPartialFrame(const Frame &frame);
+
+    /*
+     * Host frame timing. Firmware with FEATURE_HOST_TIMING interpolates each keyframe
+     * over the time between it and the previous frame as they were written here, rather
+     * than as they arrived over USB. The duration goes in the unused last two bytes of
+     * the frame's last packet, in milliseconds, with zero for unknown.
+     */
+    bool mHostTimingSupported;
+    bool mHostTiming;
+    struct timeval mLastSubmittedWrittenTime;
+    void writeFrameDuration(Frame &frame);
+
+    /*
+     * Scheduled frames, on firmware with FEATURE_SCHEDULED_FRAMES and a frame queue.
+     * With a frameSchedule delay, each frame is shown that long after it was written
+     * here, by our clock. Frames can then reach the device early, in bursts, and still
+     * be shown evenly. The device learns our clock from a clock sync packet, sent
+     * before the first scheduled frame and then whenever FCServer calls syncClock().
+     */
+    static const unsigned MAX_FRAME_SCHEDULE_MILLIS = 1000;
+    bool mScheduledFramesSupported;
+    unsigned mFrameScheduleMillis;
+    struct timeval mLastClockSyncTime;
+    Packet mClockSyncPacket;
+    void writeFrameSchedule(Frame &frame);
+    void writeClockSync();
+
+    /*
+     * Run-length encoded frames, on firmware with FEATURE_RLE_FRAMES. Used whenever the
+     * encoding takes fewer packets than the full or partial frame would, as it does for
+     * large areas of solid color.
+     */
+    static const unsigned RLE_MAX_RUN = 128;
+    bool mRLEFramesSupported;
+    bool mRLEFrames;
+    uint64_t mRLEFramesSent;
+    Packet mRLEFramebuffer[MAX_FRAMEBUFFER_PACKETS];
+    unsigned packRLEFrame(Frame &frame, unsigned limit);
     Packet mColorLUT[LUT_PACKETS];
     Packet mFirmwareConfig;
+    bool mFirmwareConfigSent;
+
+    /*
+     * Optional current limit. Each frame's current is estimated from the color LUT and
+     * the master dimmer, and frames over budget are dimmed through the firmware's master
+     * dimmer, which is linear like the current. The config packet actually sent has the
+     * dimmer turned down by mCurrentScale (16.16), while mFirmwareConfig keeps the
+     * configured value.
+     */
+    CurrentLimiter mCurrentLimiter;
+    uint32_t mCurrentScale;
+    Packet mSentFirmwareConfig;
+    uint32_t estimateCurrent(Frame &frame);
+    void setCurrentScale(uint32_t scale);
+
+    // The curve of the LUT this device last had sent, to skip sending an identical one
+    ColorCurve mColorLUTCurve;
+    bool mColorLUTSent;
+    uint64_t mColorLUTPacketsSent;
+
+    // Changed LUT packets, packed together for an incremental update
+    Packet mColorLUTUpdate[LUT_PACKETS];
 
-    bool submitTransfer(Transfer *fct);
+    static const unsigned DEVICE_COLOR_SERIAL_BYTES = 16;
+    static const unsigned DEVICE_COLOR_RECORD_BYTES = DEVICE_COLOR_SERIAL_BYTES + 8;
+
+    void writeColorLUT(const ColorCurve &curve);
+
+    // Color LUTs computed for recent curves, shared by every device
+    static const unsigned COLOR_LUT_CACHE_SIZE = 8;
+
+    struct CachedLUT {
+        ColorCurve curve;
+        Packet packets[LUT_PACKETS];
+    };
+
+    static std::vector<CachedLUT*> sColorLUTCache;
+    static tthread::mutex sColorLUTCacheMutex;
+    static void loadColorLUT(const ColorCurve &curve, Packet *lut);
+
+    void setFramebufferSize(unsigned numPixels, unsigned numPackets);
+    void readLEDCapacity();
+    bool submitTransfer(const void *buffer, int length, PacketType type = OTHER);
+    void submitFramebuffer();
     void writeFirmwareConfiguration();
     void writeFirmwareConfiguration(const Value &json);
+    void setFrameQueueDepth(const Value &depth);
     void writeDevicePixels(Document &msg);
     static LIBUSB_CALL void completeTransfer(libusb_transfer *transfer);
 
-    void opcSetPixelColors(const OPC::Message &msg);
+    /*
+     * 16-bit input. After a SetPixelColors16 message, mapped pixels go to a pair of
+     * 8-bit planes with the same layout as mFramebuffer, a high byte plane and a low
+     * byte plane. Each frame is dithered down into mFramebuffer from there. mDither
+     * follows the firmware configuration, for producers that can't read it.
+     */
+    bool mHighDepth;
+    bool mDither;
+    Packet mFramebufferHigh[MAX_FRAMEBUFFER_PACKETS];
+    Packet mFramebufferLow[MAX_FRAMEBUFFER_PACKETS];
+    int16_t mResidual[FRAMEBUFFER_BYTES];
+    std::vector<uint8_t> mPlaneMessages;
+
+    bool opcSetPixelColors16(const OPC::Message &msg);
+    void ditherFramebuffer();
+
+    /*
+     * The firmware CPU profile. describe() runs with the server's event lock held, so it
+     * can't wait on USB. It reports the last complete sample and asks for another, which
+     * flush() reads one counter at a time with asynchronous control requests on
+     * mProfileTransfer. Shares of CPU time are computed between the last two samples, as
+     * long as they're close enough together that the 32-bit cycle counters can't have
+     * wrapped more than once.
+     */
+    static const unsigned PROFILE_MAX_INTERVAL_MILLIS = 30000;
+    static const unsigned PROFILE_COUNTERS = PERF_TORN_FRAMES + 1;
+
+    struct FirmwareProfile {
+        uint32_t counters[PROFILE_COUNTERS];
+        struct timeval time;
+    };
+
+    bool mProfileSupported;
+    bool mProfileWanted;
+    unsigned mProfileCounter;
+    unsigned mProfileSamples;
+    Transfer *mProfileTransfer;
+    FirmwareProfile mProfileNext;
+    FirmwareProfile mProfile;
+    FirmwareProfile mLastProfile;
+
+    void readProfileCounter();
+    void completeProfileRead(Transfer *fct);
+    void describeFirmwareProfile(rapidjson::Value &object, Allocator &alloc);
+
+    bool isFrameRedundant(const Frame &frame);
+    void recordFrameLatency(int64_t micros);
+    bool opcSetPixelColors(const OPC::Message &msg);
     void opcSysEx(const OPC::Message &msg);
     void opcSetGlobalColorCorrection(const OPC::Message &msg);
     void opcSetFirmwareConfiguration(const OPC::Message &msg);
-    void opcMapPixelColors(const OPC::Message &msg, const Value &inst);
+    void opcSetDeviceColorCorrection(const OPC::Message &msg);
+    void opcLatencyProbe(const OPC::Message &msg);
 };
@@ -25,27 +25,71 @@
 #include "usbdevice.h"
 #include "apa102spidevice.h"
 #include "fcdevice.h"
+#include "simfcdevice.h"
 #include "version.h"
 #include "enttecdmxdevice.h"
+#include "metrics.h"
+#include "trace.h"
+#include "rapidjson/filestream.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
 #include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 #include <iostream>
+#include <unordered_set>
 
-#ifdef FCSERVER_HAS_WIRINGPI
-#include <wiringPi.h>
+#ifndef OS_WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
 #endif
 
 FCServer::FCServer(rapidjson::Document &config)
-    : mConfig(config),
+    : mConfig(&config),
       mListen(config["listen"]),
       mRelay(config["relay"]),
-      mColor(config["color"]),
-      mDevices(config["devices"]),
+      mOpcListen(config["opcListen"]),
+      mOpcThreads(config["opcThreads"]),
+      mUdpListen(config["udpListen"]),
+      mShmListen(config["shmListen"]),
+      mColor(&config["color"]),
+      mDevices(&config["devices"]),
       mVerbose(config["verbose"].IsTrue()),
+      mBackpressure(config["backpressure"].IsTrue()),
+      mFrameBarrier(config["frameBarrier"].IsTrue()),
+      mUSBBusThreadsEnabled(config["usbBusThreads"].IsTrue()),
       mPollForDevicesOnce(false),
-      mTcpNetServer(cbOpcMessage, cbJsonMessage, this, mVerbose),
+      mReloadPending(false),
+      mNumSimulatedDevices(0),
+      mSnapshotInterval(config["snapshotInterval"].IsUint() ?
+        config["snapshotInterval"].GetUint() : DEFAULT_SNAPSHOT_MILLIS),
+      mSnapshotStep(config["snapshotStep"].IsUint() ? config["snapshotStep"].GetUint() : 1),
+      mTcpNetServer(cbListenMessage, cbJsonMessage, this, mVerbose),
+      mOpcReaderPool(cbOpcListenMessage, this, mVerbose),
+      mUdpNetServer(cbUdpMessage, this, mVerbose),
+      mShmNetServer(cbShmMessage, this, mVerbose),
+      mOpcForwarder(mVerbose),
+      mOpcRecorder(mVerbose),
       mUSBHotplugThread(0),
-      mUSB(0)
+      mUSBInitThread(0),
+      mConfigGeneration(0),
+      mDeviceIndex(new ConfigIndex(config["devices"])),
+      mUSB(0),
+      mNumUSBBusThreads(0),
+      mDeviceSet(new DeviceSet()),
+      mWakeupPending(false),
+      mReplay(0)
 {
+    mWakeupPipe[0] = mWakeupPipe[1] = -1;
+    Metrics::addCollector(cbMetrics, this);
+    memset(mChannelsSinceCommit, 0, sizeof mChannelsSinceCommit);
+    memset(&mLastSnapshot, 0, sizeof mLastSnapshot);
+    memset(&mLastClockSync, 0, sizeof mLastClockSync);
+    memset(mUSBBusThreads, 0, sizeof mUSBBusThreads);
+    memset(mUSBBusThreadList, 0, sizeof mUSBBusThreadList);
+
     /*
      * Validate the listen [host, port] list.
      */
@@ -91,11 +135,125 @@ FCServer::FCServer(rapidjson::Document &config)
         mError << "The optional 'relay' configuration key must be a [host, post] list.\n";
     }
 
+    /*
+     * Validate the optional native OPC [host, port] list or socket path, and its thread count.
+     */
+
+    if (mOpcListen.IsArray() && mOpcListen.Size() == 2) {
+        const Value &host = mOpcListen[0u];
+        const Value &port = mOpcListen[1];
+
+        if (!(host.IsString() || host.IsNull())) {
+            mError << "Hostname in 'opcListen' must be null (any) or a hostname string.\n";
+        }
+
+        if (!port.IsUint()) {
+            mError << "The 'opcListen' port must be an integer.\n";
+        }
+    }
+    else if (!(mOpcListen.IsNull() || (mOpcListen.IsString() && mOpcListen.GetStringLength() > 0))) {
+        mError << "The optional 'opcListen' configuration key must be a [host, port] list or a socket path.\n";
+    }
+
+    if (!(mOpcThreads.IsNull() || (mOpcThreads.IsUint() && mOpcThreads.GetUint() >= 1 &&
+        mOpcThreads.GetUint() <= OpcReaderPool::MAX_THREADS))) {
+        mError << "The optional 'opcThreads' configuration key must be a number from 1 to "
+            << OpcReaderPool::MAX_THREADS << ".\n";
+    }
+
+    /*
+     * Validate the optional UDP [host, port] list.
+     */
+
+    if (mUdpListen.IsArray() && mUdpListen.Size() == 2) {
+        const Value &host = mUdpListen[0u];
+        const Value &port = mUdpListen[1];
+
+        if (!(host.IsString() || host.IsNull())) {
+            mError << "Hostname in 'udpListen' must be null (any) or a hostname string.\n";
+        }
+
+        if (!port.IsUint()) {
+            mError << "The 'udpListen' port must be an integer.\n";
+        }
+    }
+    else if (!mUdpListen.IsNull()) {
+        mError << "The optional 'udpListen' configuration key must be a [host, port] list.\n";
+    }
+
+    /*
+     * Shared memory names look like "/fcserver", with no other slashes.
+     */
+
+    if (!(mShmListen.IsNull() || (mShmListen.IsString() && mShmListen.GetString()[0] == '/'
+        && mShmListen.GetStringLength() > 1 && !strchr(mShmListen.GetString() + 1, '/')))) {
+        mError << "The optional 'shmListen' configuration key must be a name like \"/fcserver\".\n";
+    }
+
+    /*
+     * Merging between sources is optional.
+     */
+
+    mSourceMixer.parse(config["sources"], config["sourceMerge"], mError);
+
+    /*
+     * Thread scheduling and memory locking are optional too.
+     */
+
+    mThreadSettings.parse(config["threads"], config["lockMemory"], mError);
+
+    /*
+     * Forwarding channels to other servers is optional.
+     */
+
+    mOpcForwarder.parse(config["forward"], mError);
+
+    /*
+     * So is recording incoming messages.
+     */
+
+    mOpcRecorder.parse(config["record"], mError);
+
+    /*
+     * Flow control is optional.
+     */
+
+    const Value &backpressure = config["backpressure"];
+    if (!(backpressure.IsNull() || backpressure.IsBool())) {
+        mError << "The optional 'backpressure' configuration key must be true or false.\n";
+    }
+
+    const Value &usbBusThreads = config["usbBusThreads"];
+    if (!(usbBusThreads.IsNull() || usbBusThreads.IsBool())) {
+        mError << "The optional 'usbBusThreads' configuration key must be true or false.\n";
+    }
+
+    const Value &frameBarrier = config["frameBarrier"];
+    if (!(frameBarrier.IsNull() || frameBarrier.IsBool())) {
+        mError << "The optional 'frameBarrier' configuration key must be true or false.\n";
+    }
+
+    /*
+     * Pixel snapshots for monitoring are optional, and only sent to subscribers.
+     */
+
+    const Value &snapshotInterval = config["snapshotInterval"];
+    if (!(snapshotInterval.IsNull() || (snapshotInterval.IsUint() &&
+        snapshotInterval.GetUint() >= MIN_SNAPSHOT_MILLIS))) {
+        mError << "The optional 'snapshotInterval' configuration key must be a number of milliseconds, at least "
+            << MIN_SNAPSHOT_MILLIS << ".\n";
+    }
+
+    const Value &snapshotStep = config["snapshotStep"];
+    if (!(snapshotStep.IsNull() || (snapshotStep.IsUint() && snapshotStep.GetUint() >= 1))) {
+        mError << "The optional 'snapshotStep' configuration key must be a positive integer.\n";
+    }
+
     /*
      * Minimal validation on 'devices'
      */
 
-    if (!mDevices.IsArray()) {
+    if (!mDevices->IsArray()) {
         mError << "The required 'devices' configuration key must be an array.\n";
     }
 }
@@ -106,7 +264,8 @@ bool FCServer::start(libusb_context *usb)
     const Value &port = mListen[1];
     const char *hostStr = host.IsString() ? host.GetString() : NULL;
 
-    bool started = mTcpNetServer.start(hostStr, port.GetUint()) && startUSB(usb) && startSPI();
+    bool started = startWakeup() && mTcpNetServer.start(hostStr, port.GetUint()) && startUSB(usb) && startSPI() && startNetDMX()
+        && startSimulatedDevices();
 
     if (started && !mRelay.IsNull()) {
         const Value &relayHost = mRelay[0u];
@@ -115,12 +274,69 @@ bool FCServer::start(libusb_context *usb)
         mTcpNetServer.startRelay(relayHostStr, relayPort.GetUint());
     }
 
+    if (started && !mOpcListen.IsNull()) {
+        unsigned threads = mOpcThreads.IsUint() ? mOpcThreads.GetUint() : unsigned(OpcReaderPool::DEFAULT_THREADS);
+        if (mOpcListen.IsString()) {
+            started = mOpcReaderPool.startUnix(mOpcListen.GetString(), threads);
+        } else {
+            const Value &opcHost = mOpcListen[0u];
+            const Value &opcPort = mOpcListen[1];
+            const char *opcHostStr = opcHost.IsString() ? opcHost.GetString() : NULL;
+            started = mOpcReaderPool.start(opcHostStr, opcPort.GetUint(), threads);
+        }
+    }
+
+    if (started && !mUdpListen.IsNull()) {
+        const Value &udpHost = mUdpListen[0u];
+        const Value &udpPort = mUdpListen[1];
+        const char *udpHostStr = udpHost.IsString() ? udpHost.GetString() : NULL;
+        started = mUdpNetServer.start(udpHostStr, udpPort.GetUint());
+    }
+
+    if (started && !mShmListen.IsNull()) {
+        started = mShmNetServer.start(mShmListen.GetString());
+    }
+
+    if (started && mOpcForwarder.isEnabled()) {
+        started = mOpcForwarder.start();
+    }
+
+    if (started && mOpcRecorder.isEnabled()) {
+        started = mOpcRecorder.start();
+    }
+
+    if (started) {
+        startThreadSettings();
+    }
+
     return started;
 }
 
+void FCServer::startThreadSettings()
+{
+    /*
+     * Threads that exist by now get their scheduling settings here. The USB main loop
+     * gets its own when it starts, and bus threads as they're created. Memory is locked
+     * for the future as well, which covers devices and their transfers as they arrive.
+     */
+
+    mEventMutex.lock();
+
+    mThreadSettings.apply(ThreadSettings::LISTEN, mTcpNetServer.getThread());
+    for (unsigned i = 0; i < mOpcReaderPool.getNumThreads(); ++i) {
+        mThreadSettings.apply(ThreadSettings::OPC_LISTEN, mOpcReaderPool.getThread(i));
+    }
+    mThreadSettings.apply(ThreadSettings::UDP_LISTEN, mUdpNetServer.getThread());
+    mThreadSettings.apply(ThreadSettings::SHM_LISTEN, mShmNetServer.getThread());
+    mThreadSettings.lockMemory();
+
+    mEventMutex.unlock();
+}
+
 bool FCServer::startUSB(libusb_context *usb)
 {
     mUSB = usb;
+    mUSBInitThread = new tthread::thread(usbInitThreadFunc, this);
 
     // Enumerate all attached devices, and get notified of hotplug events
     libusb_hotplug_register_callback(mUSB,
@@ -140,28 +356,126 @@ bool FCServer::startUSB(libusb_context *usb)
     return true;
 }
 
+void FCServer::cbListenMessage(OPC::Message &msg, void *context)
+{
+    static_cast<FCServer*>(context)->sourceMessage(SourceMixer::LISTEN, msg);
+}
+
+void FCServer::cbOpcListenMessage(OPC::Message &msg, void *context)
+{
+    static_cast<FCServer*>(context)->sourceMessage(SourceMixer::OPC_LISTEN, msg);
+}
+
+void FCServer::cbUdpMessage(OPC::Message &msg, void *context)
+{
+    static_cast<FCServer*>(context)->sourceMessage(SourceMixer::UDP_LISTEN, msg);
+}
+
+void FCServer::cbShmMessage(OPC::Message &msg, void *context)
+{
+    static_cast<FCServer*>(context)->sourceMessage(SourceMixer::SHM_LISTEN, msg);
+}
+
+void FCServer::sourceMessage(SourceMixer::Source source, OPC::Message &msg)
+{
+    /*
+     * Without configured sources, or for anything but 8-bit pixels, messages go straight
+     * through. Otherwise the mixer decides what the channel shows now, if it changed.
+     * Its output is only good until the next mix(), so mixing and sending are one step.
+     */
+
+    if (!mSourceMixer.isEnabled() || msg.command != OPC::SetPixelColors) {
+        cbOpcMessage(msg, this);
+        return;
+    }
+
+    mSourceMutex.lock();
+    OPC::Message *mixed = mSourceMixer.mix(source, msg);
+    if (mixed) {
+        cbOpcMessage(*mixed, this);
+    } else {
+        Metrics::add(Metrics::OPC_MESSAGES_HIDDEN);
+    }
+    mSourceMutex.unlock();
+}
+
 void FCServer::cbOpcMessage(OPC::Message &msg, void *context)
 {
     /*
-     * Broadcast the OPC message to all configured devices.
+     * Pixel data goes only to the devices that map the message's channel.
+     * Everything else is broadcast to all configured devices.
      */
 
+    TRACE_SCOPE("cbOpcMessage", msg.channel);
+
     FCServer *self = static_cast<FCServer*>(context);
-    self->mEventMutex.lock();
+    bool routed = msg.isPixelColors();
 
-    for (std::vector<USBDevice*>::iterator i = self->mUSBDevices.begin(), e = self->mUSBDevices.end(); i != e; ++i) {
+    Metrics::add(Metrics::OPC_MESSAGES);
+    Metrics::add(Metrics::OPC_BYTES, msg.length());
+    self->mOpcRecorder.record(msg);
+
+    DeviceSet *devices = self->acquireDevices();
+
+    if (routed && self->mBackpressure) {
+        self->waitForDevices(*devices, msg);
+    }
+
+    // Pixels for devices that guard their own framebuffers don't wait on the main loop
+    bool locked = !routed || devices->lockedRoutes[msg.channel];
+
+    if (self->mFrameBarrier) {
+        self->mFrameBarrierMutex.lock();
+    }
+    if (locked) {
+        self->lockEvents();
+    }
+
+    if (self->mFrameBarrier && self->isFrameBoundary(msg)) {
+        self->commitFrames(*devices);
+    }
+
+    const std::vector<USBDevice*> &usbDevices = routed ? devices->usbRoutes[msg.channel] : devices->usbDevices;
+    const std::vector<SPIDevice*> &spiDevices = routed ? devices->spiRoutes[msg.channel] : devices->spiDevices;
+    const std::vector<NetDMXDevice*> &netDevices = routed ? devices->netRoutes[msg.channel] : devices->netDevices;
+
+    for (std::vector<USBDevice*>::const_iterator i = usbDevices.begin(), e = usbDevices.end(); i != e; ++i) {
         USBDevice *dev = *i;
         dev->writeMessage(msg);
     }
 
-    for (std::vector<SPIDevice*>::iterator i = self->mSPIDevices.begin(), e = self->mSPIDevices.end(); i != e; ++i) {
+    for (std::vector<SPIDevice*>::const_iterator i = spiDevices.begin(), e = spiDevices.end(); i != e; ++i) {
         SPIDevice *dev = *i;
         dev->writeMessage(msg);
     }
 
-    self->mEventMutex.unlock();
+    for (std::vector<NetDMXDevice*>::const_iterator i = netDevices.begin(), e = netDevices.end(); i != e; ++i) {
+        NetDMXDevice *dev = *i;
+        dev->writeMessage(msg);
+    }
+
+    if (self->mFrameBarrier && routed) {
+        if (msg.channel == 0) {
+            // Channel 0 is a broadcast, so it's a whole frame by itself
+            self->commitFrames(*devices);
+        } else {
+            self->mChannelsSinceCommit[msg.channel] = true;
+        }
+    }
+
+    if (locked) {
+        self->mEventMutex.unlock();
+    }
+    if (self->mFrameBarrier) {
+        self->mFrameBarrierMutex.unlock();
+    }
+    self->releaseDevices(devices);
+    self->wakeMainLoop();
 
-    // also forward the message to clients connected on the relay socket
+    // also forward the message to downstream servers, and clients connected on the relay socket
+    if (self->mOpcForwarder.isEnabled()) {
+        self->mOpcForwarder.forward(msg);
+    }
     self->mTcpNetServer.relayMessage(msg);
 }
 
@@ -169,16 +483,16 @@ int FCServer::cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotpl
 {
     FCServer *self = static_cast<FCServer*>(user_data);
 
-    self->mEventMutex.lock();
-
     if (event & LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-        self->usbDeviceArrived(device);
+        // Opened on the init thread. We can't make synchronous libusb calls from here.
+        self->queueUSBDevice(device);
     }
     if (event & LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+        self->mEventMutex.lock();
         self->usbDeviceLeft(device);
+        self->mEventMutex.unlock();
     }
 
-    self->mEventMutex.unlock();
     return false;
 }
 
@@ -186,6 +500,10 @@ void FCServer::usbDeviceArrived(libusb_device *device)
 {
     /*
      * New USB device. Is this a device we recognize?
+     *
+     * Runs on the init thread. Opening and configuring a device can be slow, so
+     * it happens before we take the event lock. Until the device is on mUSBDevices
+     * nobody else can see it, and the lock is only needed to add it to the list.
      */
 
     USBDevice *dev;
@@ -200,6 +518,10 @@ void FCServer::usbDeviceArrived(libusb_device *device)
         return;
     }
 
+    if (mUSBBusThreadsEnabled) {
+        openOnBusThread(dev, device);
+    }
+
     int r = dev->open();
     if (r < 0) {
         if (mVerbose) {
@@ -232,26 +554,97 @@ void FCServer::usbDeviceArrived(libusb_device *device)
         return;
     }
 
-    for (unsigned i = 0; i < mDevices.Size(); ++i) {
-        if (dev->matchConfiguration(mDevices[i])) {
-            // Found a matching configuration for this device. We're keeping it!
+    // The configuration may be reloaded while we work, so take a consistent snapshot
+    mEventMutex.lock();
+    const ConfigIndex &index = *mDeviceIndex;
+    const Value &color = *mColor;
+    unsigned generation = mConfigGeneration;
+    mEventMutex.unlock();
 
-            dev->loadConfiguration(mDevices[i]);
-            dev->writeColorCorrection(mColor);
-            mUSBDevices.push_back(dev);
+    const Value *match = index.find(dev, dev->getSerial());
+    if (match) {
+        // Found a matching configuration for this device. We're keeping it!
 
-            if (mVerbose) {
-                std::clog << "USB device " << dev->getName() << " attached.\n";
-            }
-            jsonConnectedDevicesChanged();
+        dev->loadConfiguration(*match);
+        dev->writeColorCorrection(color);
+        dev->setFrameBarrier(mFrameBarrier);
+
+        mEventMutex.lock();
+
+        if (usbDeviceDeparted(device)) {
+            // Unplugged while we were setting it up
+            mEventMutex.unlock();
+            delete dev;
             return;
         }
+
+        if (generation != mConfigGeneration) {
+            // Reloaded in the meantime. Catch up, like every other device did.
+            std::vector<USBDevice*> pending(1, dev);
+            reloadDevices(pending, jsonString(color) != jsonString(*mColor));
+            if (pending.empty()) {
+                updateChannelRoutes();
+                mEventMutex.unlock();
+                return;
+            }
+        }
+
+        mUSBDevices.push_back(dev);
+        updateChannelRoutes();
+
+        if (mVerbose) {
+            std::clog << "USB device " << dev->getName() << " attached.\n";
+        }
+        jsonConnectedDevicesChanged();
+        mEventMutex.unlock();
+        return;
     }
 
     if (mVerbose) {
         std::clog << "USB device " << dev->getName() << " has no matching configuration. Not using it.\n";
     }
     delete dev;
+
+    mEventMutex.lock();
+    if (generation != mConfigGeneration) {
+        // The new configuration may want this device after all
+        mPollForDevicesOnce = true;
+    }
+    mEventMutex.unlock();
+}
+
+void FCServer::openOnBusThread(USBDevice *dev, libusb_device *device)
+{
+    /*
+     * Runs on the init thread, the only one that starts bus threads. If the bus has no
+     * context of its own yet, or that context can't see the device yet, it stays on
+     * the hotplug context and the main loop looks after it.
+     */
+
+    uint8_t bus = libusb_get_bus_number(device);
+    USBBusThread *thread = mUSBBusThreads[bus];
+
+    if (!thread) {
+        thread = new USBBusThread(bus, mEventMutex, mVerbose);
+        if (!thread->start()) {
+            delete thread;
+            mUSBBusThreadsEnabled = false;
+            return;
+        }
+        mUSBBusThreads[bus] = thread;
+
+        mEventMutex.lock();
+        mThreadSettings.apply(ThreadSettings::USB, thread->getThread());
+        mEventMutex.unlock();
+
+        mUSBBusThreadList[mNumUSBBusThreads] = thread;
+        __atomic_store_n(&mNumUSBBusThreads, mNumUSBBusThreads + 1, __ATOMIC_RELEASE);
+    }
+
+    libusb_device *same = thread->findDevice(device);
+    if (same) {
+        dev->setHandleDevice(same);
+    }
 }
 
 void FCServer::usbDeviceLeft(libusb_device *device)
@@ -264,110 +657,982 @@ void FCServer::usbDeviceLeft(libusb_device *device)
         USBDevice *dev = *i;
         if (dev->getDevice() == device) {
             usbDeviceLeft(i);
-            break;
+            return;
         }
     }
+
+    // Not attached yet. If it's still being set up, the init thread will discard it.
+    tthread::lock_guard<tthread::mutex> lock(mUSBInitMutex);
+    if (mUSBInitializing.count(device)) {
+        mUSBDeparted.insert(device);
+    }
 }
 
-void FCServer::usbDeviceLeft(std::vector<USBDevice*>::iterator iter)
+void FCServer::queueUSBDevice(libusb_device *device)
 {
-    USBDevice *dev = *iter;
-    if (mVerbose) {
-        std::clog << "USB device " << dev->getName() << " removed.\n";
+    tthread::lock_guard<tthread::mutex> lock(mUSBInitMutex);
+
+    if (!mUSBInitializing.insert(device).second) {
+        // Already on its way. Polling can see a device again before it's attached.
+        return;
     }
-    mUSBDevices.erase(iter);
-    delete dev;
-    jsonConnectedDevicesChanged();
+
+    libusb_ref_device(device);
+    mUSBInitQueue.push_back(device);
+    mUSBInitCond.notify_one();
 }
 
-bool FCServer::startSPI()
+bool FCServer::usbDeviceDeparted(libusb_device *device)
 {
-#ifdef FCSERVER_HAS_WIRINGPI
-    wiringPiSetup();
-#endif
+    tthread::lock_guard<tthread::mutex> lock(mUSBInitMutex);
+    return mUSBDeparted.count(device) != 0;
+}
 
-    for (unsigned i = 0; i < mDevices.Size(); ++i) {
-        const Value &device = mDevices[i];
+void FCServer::usbInitThreadFunc(void *arg)
+{
+    FCServer *self = (FCServer*) arg;
+    self->usbInitLoop();
+}
 
-        const Value &vtype = device["type"];
-        const Value &vport = device["port"];
-        const Value &vnumLights = device["numLights"];
+void FCServer::usbInitLoop()
+{
+    for (;;) {
+        libusb_device *device;
 
-        if (vtype.IsNull() || (!vtype.IsString() || strcmp(vtype.GetString(), APA102SPIDevice::DEVICE_TYPE))) {
-            continue;
+        mUSBInitMutex.lock();
+        while (mUSBInitQueue.empty()) {
+            mUSBInitCond.wait(mUSBInitMutex);
         }
+        device = mUSBInitQueue.front();
+        mUSBInitQueue.pop_front();
+        mUSBInitMutex.unlock();
 
-        if (vport.IsNull() || (!vport.IsUint())) {
-            continue;
-        }
+        usbDeviceArrived(device);
 
-        if (vnumLights.IsNull() || (!vnumLights.IsUint())) {
-            continue;
-        }
+        mUSBInitMutex.lock();
+        mUSBInitializing.erase(device);
+        mUSBDeparted.erase(device);
+        mUSBInitMutex.unlock();
 
-        openAPA102SPIDevice(vport.GetUint(), vnumLights.GetUint());
+        libusb_unref_device(device);
     }
-
-    return true;
 }
 
-void FCServer::openAPA102SPIDevice(uint32_t port, int numLights)
+void FCServer::usbDeviceLeft(std::vector<USBDevice*>::iterator iter)
 {
-    APA102SPIDevice* dev = new APA102SPIDevice(numLights, mVerbose);
-
-    int r = dev->open(port);
-    if (r < 0) {
-        if (mVerbose) {
-            std::clog << "Error opening " << dev->getName() << "\n";
-        }
-        delete dev;
-        return;
+    USBDevice *dev = *iter;
+    if (mVerbose) {
+        std::clog << "USB device " << dev->getName() << " removed.\n";
     }
+    mUSBDevices.erase(iter);
+    retireDevice(dev);
+    updateChannelRoutes();
+    jsonConnectedDevicesChanged();
+}
 
-    for (unsigned i = 0; i < mDevices.Size(); ++i) {
-        if (dev->matchConfiguration(mDevices[i])) {
-            // Found a matching configuration for this device. We're keeping it!
+void FCServer::waitForDevices(const DeviceSet &devices, const OPC::Message &msg)
+{
+    /*
+     * Flow control for OPC clients. If any device that uses this message's channel
+     * already has a full frame queue, stall the network thread until it catches up.
+     * While we aren't reading, TCP flow control slows down the client rather than
+     * letting it render frames that would only be coalesced away.
+     *
+     * This runs on the network thread, while the main loop completes USB transfers.
+     * The wait is bounded, so a stuck device can't stop us from serving clients. Our
+     * reference to 'devices' keeps them alive, so polling doesn't need mEventMutex.
+     */
 
-            dev->loadConfiguration(mDevices[i]);
-            dev->writeColorCorrection(mColor);
-            mSPIDevices.push_back(dev);
+    const std::vector<USBDevice*> &routes = devices.usbRoutes[msg.channel];
 
-            if (mVerbose) {
-                std::clog << "SPI device " << dev->getName() << " attached.\n";
+    for (unsigned waited = 0; waited < MAX_BACKPRESSURE_MILLIS; waited++) {
+        bool full = false;
+
+        for (std::vector<USBDevice*>::const_iterator i = routes.begin(), e = routes.end(); i != e; ++i) {
+            if ((*i)->isQueueFull()) {
+                full = true;
+                break;
             }
-            jsonConnectedDevicesChanged();
+        }
+
+        if (!full) {
             return;
         }
+
+        tthread::this_thread::sleep_for(tthread::chrono::milliseconds(1));
     }
 }
 
-void FCServer::mainLoop()
+bool FCServer::isFrameBoundary(const OPC::Message &msg)
 {
-    for (;;) {
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
-
-        int err = libusb_handle_events_timeout_completed(mUSB, &timeout, 0);
-        if (err) {
-            std::clog << "Error handling USB events: " << libusb_strerror(libusb_error(err)) << "\n";
-            // Sometimes this happens on Windows during normal operation if we're queueing a lot of output URBs. Meh.
-        }
+    /*
+     * In frame barrier mode, is this message the start of a new frame? Clients can
+     * say so explicitly with the Fadecandy "commit frame" SysEx. Otherwise, we assume
+     * a client sweeps through its channels once per frame, so a frame ends when a
+     * channel is written a second time.
+     */
 
-        // We may have been asked for a one-shot poll, to retry connecting devices that failed.
-        if (mPollForDevicesOnce) {
-            mPollForDevicesOnce = false;
-            usbHotplugPoll();
-        }
+    if (msg.command == OPC::SystemExclusive) {
+        return msg.sysExID() == OPC::FCCommitFrame;
+    }
 
-        // Flush completed transfers
-        mEventMutex.lock();
-        for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
-            USBDevice *dev = *i;
-            dev->flush();
-        }
-        mEventMutex.unlock();
+    if (!msg.isPixelColors()) {
+        return false;
     }
+
+    return mChannelsSinceCommit[msg.channel];
+}
+
+void FCServer::commitFrames(DeviceSet &devices)
+{
+    /*
+     * Submit held frames to every USB device back-to-back, so all boards
+     * start displaying them as close together as possible. SPI devices each
+     * wake their own writer thread, so every bus starts at once. Network
+     * devices send each frame as a burst of universe packets.
+     *
+     * Called with mFrameBarrierMutex held. mEventMutex is recursive, so it's
+     * fine if the caller already has it too.
+     */
+
+    if (devices.lockedCommit) {
+        lockEvents();
+    }
+
+    for (std::vector<USBDevice*>::iterator i = devices.usbDevices.begin(), e = devices.usbDevices.end(); i != e; ++i) {
+        (*i)->commitFrame();
+    }
+    for (std::vector<SPIDevice*>::iterator i = devices.spiDevices.begin(), e = devices.spiDevices.end(); i != e; ++i) {
+        (*i)->commitFrame();
+    }
+    for (std::vector<NetDMXDevice*>::iterator i = devices.netDevices.begin(), e = devices.netDevices.end(); i != e; ++i) {
+        (*i)->commitFrame();
+    }
+
+    if (devices.lockedCommit) {
+        mEventMutex.unlock();
+    }
+
+    memset(mChannelsSinceCommit, 0, sizeof mChannelsSinceCommit);
+}
+
+void FCServer::updateChannelRoutes()
+{
+    /*
+     * Publish a new DeviceSet, with the table of devices that use each OPC channel so
+     * that pixel data only visits devices that need it. Must be called with mEventMutex
+     * held, whenever a device is added or removed. Devices retired since the last call
+     * are handed to the outgoing set, which deletes them once nobody is using it.
+     */
+
+    DeviceSet *set = new DeviceSet();
+    set->usbDevices = mUSBDevices;
+    set->spiDevices = mSPIDevices;
+    set->netDevices = mNetDevices;
+
+    // SPI and network devices always need mEventMutex, and so does any USB device without its own lock
+    set->lockedCommit = !mSPIDevices.empty() || !mNetDevices.empty();
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        set->lockedCommit = set->lockedCommit || !(*i)->hasPixelLock();
+    }
+
+    for (unsigned channel = 0; channel < 256; ++channel) {
+        for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+            if ((*i)->usesOpcChannel(channel)) {
+                set->usbRoutes[channel].push_back(*i);
+                set->lockedRoutes[channel] = set->lockedRoutes[channel] || !(*i)->hasPixelLock();
+            }
+        }
+
+        for (std::vector<SPIDevice*>::iterator i = mSPIDevices.begin(), e = mSPIDevices.end(); i != e; ++i) {
+            if ((*i)->usesOpcChannel(channel)) {
+                set->spiRoutes[channel].push_back(*i);
+            }
+        }
+
+        for (std::vector<NetDMXDevice*>::iterator i = mNetDevices.begin(), e = mNetDevices.end(); i != e; ++i) {
+            if ((*i)->usesOpcChannel(channel)) {
+                set->netRoutes[channel].push_back(*i);
+            }
+        }
+
+        set->lockedRoutes[channel] = set->lockedRoutes[channel] ||
+            !set->spiRoutes[channel].empty() || !set->netRoutes[channel].empty();
+    }
+
+    mDeviceSetMutex.lock();
+    DeviceSet *old = mDeviceSet;
+    mDeviceSet = set;
+    mDeviceSetMutex.unlock();
+
+    old->usbRetired.swap(mUSBRetired);
+    old->spiRetired.swap(mSPIRetired);
+    old->netRetired.swap(mNetRetired);
+    releaseDevices(old);
+
+    // Bus threads flush the devices opened through them, and the main loop does the rest
+    unsigned numBusThreads = __atomic_load_n(&mNumUSBBusThreads, __ATOMIC_ACQUIRE);
+    if (numBusThreads) {
+        std::vector<USBDevice*> onBus[256];
+        for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+            if (isOnBusThread(*i)) {
+                onBus[libusb_get_bus_number((*i)->getDevice())].push_back(*i);
+            }
+        }
+        for (unsigned i = 0; i < numBusThreads; ++i) {
+            mUSBBusThreadList[i]->setDevices(onBus[mUSBBusThreadList[i]->getBus()]);
+        }
+    }
+}
+
+FCServer::DeviceSet *FCServer::acquireDevices()
+{
+    mDeviceSetMutex.lock();
+    DeviceSet *set = mDeviceSet;
+    __atomic_add_fetch(&set->refs, 1, __ATOMIC_RELAXED);
+    mDeviceSetMutex.unlock();
+    return set;
+}
+
+void FCServer::releaseDevices(DeviceSet *set)
+{
+    if (__atomic_sub_fetch(&set->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    // Last reference, possibly on a network thread. The main loop deletes the devices.
+    mReleasedSetsMutex.lock();
+    mReleasedSets.push_back(set);
+    mReleasedSetsMutex.unlock();
+    wakeMainLoop();
+}
+
+void FCServer::deleteReleasedDevices()
+{
+    /*
+     * Called by the main loop with mEventMutex held, after libusb has handled our
+     * context's events. A device opened through a bus thread may still have transfers
+     * completing there, so that thread deletes it after its own event handling.
+     */
+
+    mReleasedSetsMutex.lock();
+    std::vector<DeviceSet*> sets;
+    sets.swap(mReleasedSets);
+    mReleasedSetsMutex.unlock();
+
+    for (std::vector<DeviceSet*>::iterator s = sets.begin(), se = sets.end(); s != se; ++s) {
+        DeviceSet *set = *s;
+
+        for (std::vector<USBDevice*>::iterator i = set->usbRetired.begin(), e = set->usbRetired.end(); i != e; ++i) {
+            if (isOnBusThread(*i)) {
+                mUSBBusThreads[libusb_get_bus_number((*i)->getDevice())]->retire(*i);
+            } else {
+                delete *i;
+            }
+        }
+        for (std::vector<SPIDevice*>::iterator i = set->spiRetired.begin(), e = set->spiRetired.end(); i != e; ++i) {
+            delete *i;
+        }
+        for (std::vector<NetDMXDevice*>::iterator i = set->netRetired.begin(), e = set->netRetired.end(); i != e; ++i) {
+            delete *i;
+        }
+
+        delete set;
+    }
+}
+
+template <class T> static bool isDeviceOpen(const std::vector<T*> &devices, const rapidjson::Value &config)
+{
+    for (typename std::vector<T*>::const_iterator i = devices.begin(), e = devices.end(); i != e; ++i) {
+        if ((*i)->matchConfiguration(config)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FCServer::startSPI()
+{
+    for (unsigned i = 0; i < mDevices->Size(); ++i) {
+        const Value &device = (*mDevices)[i];
+
+        const Value &vtype = device["type"];
+        const Value &vbus = device["bus"];
+        const Value &vport = device["port"];
+        const Value &vnumLights = device["numLights"];
+
+        if (vtype.IsNull() || (!vtype.IsString() || strcmp(vtype.GetString(), APA102SPIDevice::DEVICE_TYPE))) {
+            continue;
+        }
+
+        if (!vbus.IsNull() && !vbus.IsUint()) {
+            continue;
+        }
+
+        if (vport.IsNull() || (!vport.IsUint())) {
+            continue;
+        }
+
+        if (vnumLights.IsNull() || (!vnumLights.IsUint())) {
+            continue;
+        }
+
+        if (isDeviceOpen(mSPIDevices, device)) {
+            // Already running, from before a reload
+            continue;
+        }
+
+        openAPA102SPIDevice(vbus.IsUint() ? vbus.GetUint() : 0, vport.GetUint(), vnumLights.GetUint());
+    }
+
+    return true;
+}
+
+void FCServer::openAPA102SPIDevice(uint32_t bus, uint32_t port, int numLights)
+{
+    APA102SPIDevice* dev = new APA102SPIDevice(numLights, mVerbose);
+
+    int r = dev->open(bus, port);
+    if (r < 0) {
+        if (mVerbose) {
+            std::clog << "Error opening " << dev->getName() << "\n";
+        }
+        delete dev;
+        return;
+    }
+
+    for (unsigned i = 0; i < mDevices->Size(); ++i) {
+        if (dev->matchConfiguration((*mDevices)[i])) {
+            // Found a matching configuration for this device. We're keeping it!
+
+            dev->loadConfiguration((*mDevices)[i]);
+            dev->writeColorCorrection(*mColor);
+            dev->setFrameBarrier(mFrameBarrier);
+            mSPIDevices.push_back(dev);
+            updateChannelRoutes();
+
+            if (mVerbose) {
+                std::clog << "SPI device " << dev->getName() << " attached.\n";
+            }
+            jsonConnectedDevicesChanged();
+            return;
+        }
+    }
+}
+
+bool FCServer::startNetDMX()
+{
+    for (unsigned i = 0; i < mDevices->Size(); ++i) {
+        const Value &device = (*mDevices)[i];
+        const Value &vtype = device["type"];
+        NetDMXDevice::Protocol protocol;
+
+        if (vtype.IsString() && NetDMXDevice::parseType(vtype.GetString(), protocol)
+            && !isDeviceOpen(mNetDevices, device)) {
+            openNetDMXDevice(device);
+        }
+    }
+
+    return true;
+}
+
+void FCServer::openNetDMXDevice(const Value &config)
+{
+    NetDMXDevice::Protocol protocol;
+    NetDMXDevice::parseType(config["type"].GetString(), protocol);
+
+    const Value &vhost = config["host"];
+    const Value &vport = config["port"];
+    const Value &vuniverse = config["universe"];
+    const Value &vuniverses = config["universes"];
+
+    // Art-Net has a 15-bit port address, E1.31 numbers universes from 1 to 63999
+    unsigned minUniverse = protocol == NetDMXDevice::ARTNET ? 0 : 1;
+    unsigned maxUniverse = protocol == NetDMXDevice::ARTNET ? 32767 : 63999;
+    unsigned universe = vuniverse.IsUint() ? vuniverse.GetUint() : minUniverse;
+    unsigned universes = vuniverses.IsUint() ? vuniverses.GetUint() : 1;
+
+    if (!(vhost.IsNull() || vhost.IsString())) {
+        std::clog << "The optional 'host' for a network DMX device must be a string.\n";
+        return;
+    }
+    if (!(vport.IsNull() || (vport.IsUint() && vport.GetUint() <= 65535))) {
+        std::clog << "The optional 'port' for a network DMX device must be a UDP port number.\n";
+        return;
+    }
+    if (!(vuniverse.IsNull() || vuniverse.IsUint()) || universe < minUniverse || universe > maxUniverse) {
+        std::clog << "The 'universe' option must be a number from " << minUniverse << " to " << maxUniverse << ".\n";
+        return;
+    }
+    if (!(vuniverses.IsNull() || vuniverses.IsUint()) || universes < 1
+        || universes > NetDMXDevice::MAX_UNIVERSES || universe + universes - 1 > maxUniverse) {
+        std::clog << "The 'universes' option must be a number from 1 to " << NetDMXDevice::MAX_UNIVERSES
+            << ", within the protocol's universe range.\n";
+        return;
+    }
+
+    NetDMXDevice *dev = new NetDMXDevice(protocol, universe, universes, mVerbose);
+
+    int r = dev->open(vhost.IsString() ? vhost.GetString() : NULL, vport.IsUint() ? vport.GetUint() : 0);
+    if (r < 0) {
+        if (mVerbose) {
+            std::clog << "Error opening " << dev->getName() << "\n";
+        }
+        delete dev;
+        return;
+    }
+
+    dev->loadConfiguration(config);
+    dev->setFrameBarrier(mFrameBarrier);
+    mNetDevices.push_back(dev);
+    updateChannelRoutes();
+
+    if (mVerbose) {
+        std::clog << "Network device " << dev->getName() << " attached.\n";
+    }
+    jsonConnectedDevicesChanged();
+}
+
+bool FCServer::startSimulatedDevices()
+{
+    for (unsigned i = 0; i < mDevices->Size(); ++i) {
+        const Value &device = (*mDevices)[i];
+        const Value &vtype = device["type"];
+        const Value &vcount = device["count"];
+
+        if (!vtype.IsString() || strcmp(vtype.GetString(), SimFCDevice::DEVICE_TYPE)) {
+            continue;
+        }
+
+        if (!(vcount.IsNull() || (vcount.IsUint() && vcount.GetUint() >= 1 && vcount.GetUint() <= MAX_SIMULATED_DEVICES))) {
+            std::clog << "The 'count' option must be a number from 1 to " << MAX_SIMULATED_DEVICES << ".\n";
+            continue;
+        }
+
+        unsigned count = vcount.IsUint() ? vcount.GetUint() : 1;
+        for (unsigned n = 0; n < count; ++n) {
+            openSimulatedDevice(device);
+        }
+    }
+
+    return true;
+}
+
+void FCServer::openSimulatedDevice(const Value &config)
+{
+    SimFCDevice *dev = new SimFCDevice(mNumSimulatedDevices++, mVerbose);
+
+    int r = dev->open();
+    if (r < 0) {
+        if (mVerbose) {
+            std::clog << "Error opening " << dev->getName() << "\n";
+        }
+        delete dev;
+        return;
+    }
+
+    dev->loadConfiguration(config);
+    dev->writeColorCorrection(*mColor);
+    dev->setFrameBarrier(mFrameBarrier);
+
+    // The USB init thread may already be publishing real devices
+    mEventMutex.lock();
+    mUSBDevices.push_back(dev);
+    updateChannelRoutes();
+
+    if (mVerbose) {
+        std::clog << "USB device " << dev->getName() << " attached.\n";
+    }
+    jsonConnectedDevicesChanged();
+    mEventMutex.unlock();
+}
+
+bool FCServer::startWakeup()
+{
+    /*
+     * Other threads use a self-pipe to wake up the main loop right away, instead of
+     * waiting for its next poll timeout. Without it, we fall back on polling.
+     */
+
+#ifndef OS_WINDOWS
+    if (pipe(mWakeupPipe) < 0) {
+        std::clog << "Can't create a wakeup pipe for the main loop, falling back on polling.\n";
+        mWakeupPipe[0] = mWakeupPipe[1] = -1;
+        return true;
+    }
+
+    for (unsigned i = 0; i < 2; ++i) {
+        fcntl(mWakeupPipe[i], F_SETFL, fcntl(mWakeupPipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(mWakeupPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
+    return true;
+}
+
+void FCServer::wakeMainLoop()
+{
+    // Only one wakeup byte needs to be in flight at once
+
+#ifndef OS_WINDOWS
+    if (mWakeupPipe[1] >= 0 && !__atomic_exchange_n(&mWakeupPending, true, __ATOMIC_ACQ_REL)) {
+        char c = 0;
+        if (write(mWakeupPipe[1], &c, 1) < 0) {
+            // Pipe is full, so a wakeup is already on its way
+        }
+    }
+#endif
+
+    unsigned numBusThreads = __atomic_load_n(&mNumUSBBusThreads, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < numBusThreads; ++i) {
+        mUSBBusThreadList[i]->wake();
+    }
+}
+
+int FCServer::pollTimeoutMillis()
+{
+    // Longest we can sleep before some device's flush() has timed output to send
+
+    int timeoutMillis = MAX_POLL_MILLIS;
+
+    mEventMutex.lock();
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        if (isOnBusThread(*i)) {
+            continue;
+        }
+        int deviceMillis = (*i)->flushTimeoutMillis();
+        if (deviceMillis >= 0 && deviceMillis < timeoutMillis) {
+            timeoutMillis = deviceMillis;
+        }
+    }
+    mEventMutex.unlock();
+
+    int snapshotMillis = snapshotTimeoutMillis();
+    if (snapshotMillis >= 0 && snapshotMillis < timeoutMillis) {
+        timeoutMillis = snapshotMillis;
+    }
+
+    return timeoutMillis;
+}
+
+void FCServer::syncDeviceClocks()
+{
+    // With mEventMutex held, send every device a clock sync if it's time
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int64_t elapsed = int64_t(now.tv_sec - mLastClockSync.tv_sec) * 1000 +
+        (now.tv_usec - mLastClockSync.tv_usec) / 1000;
+    if (elapsed >= 0 && elapsed < CLOCK_SYNC_MILLIS) {
+        return;
+    }
+    mLastClockSync = now;
+
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        (*i)->syncClock();
+    }
+}
+
+int FCServer::snapshotTimeoutMillis()
+{
+    // How soon the next pixel snapshot is due, or -1 if nobody is subscribed
+
+    if (!mTcpNetServer.hasSubscribers("device_snapshot")) {
+        return -1;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int64_t elapsed = int64_t(now.tv_sec - mLastSnapshot.tv_sec) * 1000 +
+        (now.tv_usec - mLastSnapshot.tv_usec) / 1000;
+    if (elapsed < 0 || elapsed >= mSnapshotInterval) {
+        return 0;
+    }
+    return mSnapshotInterval - elapsed;
+}
+
+void FCServer::readSnapshots()
+{
+    // With mEventMutex held, copy out pixels and nothing else. Buffers are reused.
+
+    unsigned count = 0;
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        if (count == mSnapshots.size()) {
+            mSnapshots.push_back(Snapshot());
+        }
+        Snapshot &snapshot = mSnapshots[count];
+        if (dev->readPixels(snapshot.pixels, mSnapshotStep)) {
+            snapshot.type = dev->getTypeString();
+            snapshot.serial = dev->getSerial() ? dev->getSerial() : "";
+            count++;
+        }
+    }
+    mSnapshots.resize(count);
+}
+
+void FCServer::readLatencyProbes()
+{
+    // With mEventMutex held, take every device's finished probes
+
+    mLatencyReports.clear();
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        mLatencyProbes.clear();
+        dev->readLatencyProbes(mLatencyProbes);
+
+        for (unsigned j = 0; j < mLatencyProbes.size(); ++j) {
+            LatencyReport report;
+            report.type = dev->getTypeString();
+            report.serial = dev->getSerial() ? dev->getSerial() : "";
+            report.probe = mLatencyProbes[j];
+            mLatencyReports.push_back(report);
+        }
+    }
+}
+
+bool FCServer::waitForEvents()
+{
+    /*
+     * Sleep until there's USB activity, a timeout in libusb needs attention, or another
+     * thread wakes us. This is libusb's recipe for integrating with a poll() loop. Afterward,
+     * libusb can handle events without blocking.
+     *
+     * Returns false if we couldn't wait here, and libusb should wait on its own instead.
+     */
+
+#ifdef OS_WINDOWS
+    return false;
+#else
+    if (mWakeupPipe[0] < 0) {
+        return false;
+    }
+
+    const libusb_pollfd **usbFds = libusb_get_pollfds(mUSB);
+    if (!usbFds) {
+        return false;
+    }
+
+    mPollFds.clear();
+
+    struct pollfd wakeup;
+    wakeup.fd = mWakeupPipe[0];
+    wakeup.events = POLLIN;
+    wakeup.revents = 0;
+    mPollFds.push_back(wakeup);
+
+    for (const libusb_pollfd **i = usbFds; *i; ++i) {
+        struct pollfd p;
+        p.fd = (*i)->fd;
+        p.events = (*i)->events;
+        p.revents = 0;
+        mPollFds.push_back(p);
+    }
+    free(usbFds);
+
+    int timeoutMillis = pollTimeoutMillis();
+    struct timeval usbTimeout;
+    if (libusb_get_next_timeout(mUSB, &usbTimeout) == 1) {
+        int usbMillis = usbTimeout.tv_sec * 1000 + (usbTimeout.tv_usec + 999) / 1000;
+        timeoutMillis = std::min(timeoutMillis, usbMillis);
+    }
+
+    poll(&mPollFds[0], mPollFds.size(), timeoutMillis);
+
+    if (mPollFds[0].revents & POLLIN) {
+        // Clear the flag before draining, so later wakeups aren't lost
+        __atomic_store_n(&mWakeupPending, false, __ATOMIC_RELEASE);
+
+        char buffer[64];
+        while (read(mWakeupPipe[0], buffer, sizeof buffer) > 0);
+    }
+
+    return true;
+#endif
+}
+
+void FCServer::mainLoop()
+{
+    mEventMutex.lock();
+    mThreadSettings.applyToCurrentThread(ThreadSettings::USB);
+    mEventMutex.unlock();
+
+    for (;;) {
+        processEvents();
+    }
+}
+
+void FCServer::processEvents()
+{
+    TRACE_SCOPE("mainLoop");
+
+    // If we already waited for events, let libusb handle them without blocking
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = waitForEvents() ? 0 : pollTimeoutMillis() * 1000;
+
+    int err = libusb_handle_events_timeout_completed(mUSB, &timeout, 0);
+    if (err) {
+        Metrics::add(Metrics::USB_EVENT_ERRORS);
+        std::clog << "Error handling USB events: " << libusb_strerror(libusb_error(err)) << "\n";
+        // Sometimes this happens on Windows during normal operation if we're queueing a lot of output URBs. Meh.
+    }
+
+    // A reload from the config file can be requested from a signal handler
+    if (mReloadPending) {
+        mReloadPending = false;
+        reloadConfigFile();
+    }
+
+    // We may have been asked for a one-shot poll, to retry connecting devices that failed.
+    if (mPollForDevicesOnce) {
+        mPollForDevicesOnce = false;
+        usbHotplugPoll();
+    }
+
+    // Flush completed transfers
+    bool snapshotDue = snapshotTimeoutMillis() == 0;
+    lockEvents();
+    syncDeviceClocks();
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        if (!isOnBusThread(dev)) {
+            dev->flush();
+        }
+    }
+    if (snapshotDue) {
+        readSnapshots();
+    }
+    readLatencyProbes();
+    deleteReleasedDevices();
+    mEventMutex.unlock();
+
+    if (snapshotDue) {
+        gettimeofday(&mLastSnapshot, NULL);
+        jsonPublishSnapshots();
+    }
+    if (!mLatencyReports.empty() && mTcpNetServer.hasSubscribers("latency_probe")) {
+        jsonPublishLatencyProbes();
+    }
+}
+
+void FCServer::waitForStartup()
+{
+    // Give the init thread a moment to bring up boards that were already attached
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    do {
+        processEvents();
+        gettimeofday(&now, NULL);
+    } while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000 < 1000);
+}
+
+void FCServer::benchmark(unsigned seconds)
+{
+    /*
+     * Keep every Fadecandy board's USB frame queue full of synthetic frames, alternating
+     * between two patterns so nothing is skipped as unchanged. The firmware's own frame
+     * and keyframe counters are read before and after, through our existing device handle.
+     */
+
+    struct Board {
+        FCDevice *dev;
+        uint32_t frames;
+        uint32_t keyframes;
+    };
+
+    struct timeval start, now;
+
+    waitForStartup();
+
+    std::vector<Board> boards;
+
+    mEventMutex.lock();
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        if (strcmp((*i)->getTypeString(), "fadecandy")) {
+            continue;
+        }
+
+        Board board;
+        board.dev = static_cast<FCDevice*>(*i);
+        if (board.dev->readPerfCounter(FCDevice::PERF_FRAME_COUNTER, board.frames) &&
+            board.dev->readPerfCounter(FCDevice::PERF_KEYFRAME_COUNTER, board.keyframes)) {
+            board.dev->resetFrameStats();
+            boards.push_back(board);
+        }
+    }
+    mEventMutex.unlock();
+
+    if (boards.empty()) {
+        std::clog << "No Fadecandy devices to benchmark.\n";
+        return;
+    }
+
+    std::clog << "Benchmarking " << boards.size() << " Fadecandy device(s) for " << seconds << " seconds...\n";
+
+    uint8_t pattern = 0;
+    double elapsed;
+
+    gettimeofday(&start, NULL);
+    do {
+        processEvents();
+
+        mEventMutex.lock();
+        for (std::vector<Board>::iterator i = boards.begin(), e = boards.end(); i != e; ++i) {
+            FCDevice *dev = i->dev;
+            if (!dev->isQueueFull()) {
+                tthread::lock_guard<tthread::mutex> lock(dev->getFramebufferMutex());
+                for (unsigned pixel = 0; pixel < dev->getNumPixels(); ++pixel) {
+                    memset(dev->fbPixel(pixel), pattern, 3);
+                }
+                dev->writeFramebuffer();
+            }
+        }
+        mEventMutex.unlock();
+        pattern ^= 0x80;
+
+        gettimeofday(&now, NULL);
+        elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+    } while (elapsed < seconds);
+
+    // Boards unplugged during the run are no longer on mUSBDevices, and are skipped
+
+    mEventMutex.lock();
+    for (std::vector<Board>::iterator i = boards.begin(), e = boards.end(); i != e; ++i) {
+        FCDevice *dev = i->dev;
+        uint32_t frames, keyframes;
+
+        if (std::find(mUSBDevices.begin(), mUSBDevices.end(), dev) == mUSBDevices.end() ||
+            !dev->readPerfCounter(FCDevice::PERF_FRAME_COUNTER, frames) ||
+            !dev->readPerfCounter(FCDevice::PERF_KEYFRAME_COUNTER, keyframes)) {
+            std::clog << "\nLost a device during the benchmark.\n";
+            continue;
+        }
+
+        // Counters are 32 bits and may wrap
+        uint32_t rendered = frames - i->frames;
+        uint32_t received = keyframes - i->keyframes;
+        uint64_t submitted = dev->getFramesSubmitted();
+        uint64_t lost = submitted > received ? submitted - received : 0;
+
+        std::clog << "\n" << dev->getName() << "\n"
+            << "  keyframes/s:      " << received / elapsed << "\n"
+            << "  firmware frames/s: " << rendered / elapsed << "\n"
+            << "  USB frames/s:     " << submitted / elapsed << "\n"
+            << "  USB KB/s:         " << dev->getFrameBytesSent() / elapsed / 1000 << "\n"
+            << "  latency (us):     p50 " << dev->latencyPercentile(0.5)
+                << ", p90 " << dev->latencyPercentile(0.9)
+                << ", p99 " << dev->latencyPercentile(0.99) << "\n"
+            << "  frames coalesced: " << dev->getFramesCoalesced() << "\n"
+            << "  frames lost:      " << lost << "\n";
+    }
+    mEventMutex.unlock();
+}
+
+bool FCServer::replay(const char *path, bool maxSpeed)
+{
+    /*
+     * Messages from the log go through cbOpcMessage() just as they did when they were
+     * recorded, from a thread of their own, while this one runs the main loop. At the
+     * original speed each one waits for its recorded arrival time, relative to the start
+     * of its session. At maximum speed they're sent back-to-back, for benchmarking.
+     */
+
+    Replay replay;
+    if (!replay.log.open(path, std::clog)) {
+        return false;
+    }
+    replay.maxSpeed = maxSpeed;
+    replay.done = false;
+    replay.messages = 0;
+    replay.bytes = 0;
+    replay.recordedMicros = 0;
+    replay.handlerMicros = 0;
+    replay.lateMicros = 0;
+
+    // Don't record the replay on top of the log
+    mOpcRecorder.stop();
+
+    waitForStartup();
+
+    std::clog << "Replaying " << path << (maxSpeed ? " at maximum speed...\n" : "...\n");
+
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+
+    mReplay = &replay;
+    tthread::thread thread(replayThreadFunc, this);
+    while (!replay.done) {
+        processEvents();
+    }
+    thread.join();
+    mReplay = 0;
+
+    gettimeofday(&now, NULL);
+    double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) * 1e-6;
+    double messages = replay.messages ? double(replay.messages) : 1.0;
+
+    std::clog << "\n"
+        << "  messages:          " << replay.messages << "\n"
+        << "  bytes:             " << replay.bytes << "\n"
+        << "  recorded (s):      " << replay.recordedMicros * 1e-6 << "\n"
+        << "  replayed (s):      " << elapsed << "\n"
+        << "  messages/s:        " << replay.messages / elapsed << "\n"
+        << "  MB/s:              " << replay.bytes / elapsed / 1e6 << "\n"
+        << "  handler (us/msg):  " << replay.handlerMicros / messages << "\n";
+    if (!maxSpeed) {
+        std::clog << "  late (us/msg):     " << replay.lateMicros / messages << "\n";
+    }
+
+    return true;
+}
+
+void FCServer::replayThreadFunc(void *arg)
+{
+    FCServer *self = static_cast<FCServer*>(arg);
+    self->replayLoop(*self->mReplay);
+}
+
+void FCServer::replayLoop(Replay &replay)
+{
+    uint64_t time, sessionStart = 0, replayStart = 0, lastTime = 0;
+    OPC::Message *msg;
+    bool newSession;
+
+    while (replay.log.next(time, msg, newSession)) {
+        // Messages from different listener threads may be a little out of order
+        if (newSession) {
+            replay.recordedMicros += lastTime - sessionStart;
+            sessionStart = lastTime = time;
+            replayStart = OpcRecorder::now();
+        } else if (time > lastTime) {
+            lastTime = time;
+        }
+
+        uint64_t begin = OpcRecorder::now();
+        if (!replay.maxSpeed) {
+            uint64_t due = replayStart + (lastTime - sessionStart);
+            if (due > begin) {
+                tthread::this_thread::sleep_for(tthread::chrono::microseconds(due - begin));
+                begin = OpcRecorder::now();
+            }
+            if (begin > due) {
+                replay.lateMicros += begin - due;
+            }
+        }
+
+        cbOpcMessage(*msg, this);
+
+        replay.handlerMicros += OpcRecorder::now() - begin;
+        replay.messages++;
+        replay.bytes += OPC::HEADER_BYTES + msg->length();
+    }
+
+    replay.recordedMicros += lastTime - sessionStart;
+    replay.done = true;
+    wakeMainLoop();
 }
 
 bool FCServer::usbHotplugPoll()
@@ -396,40 +1661,64 @@ bool FCServer::usbHotplugPoll()
     // Take the lock after get_device_list completes
     mEventMutex.lock();
 
-    // Look for devices that were added
-    for (ssize_t listItem = 0; listItem < listSize; ++listItem) {
-        bool isNew = true;
+    /*
+     * Diff the list against mUSBDevices with hash sets, so each poll is linear in the
+     * number of devices. Removed devices are collected first and deleted together,
+     * so the channel routes and JSON clients only hear about them once.
+     */
 
-        for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
-            USBDevice *dev = *i;
-            if (dev->getDevice() == list[listItem]) {
-                isNew = false;
-            }
+    std::unordered_set<libusb_device*> present(list, list + listSize);
+    std::unordered_set<libusb_device*> attached;
+    std::vector<USBDevice*> kept, removed;
+
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        attached.insert(dev->getDevice());
+        if (!dev->getDevice() || present.count(dev->getDevice())) {
+            // Simulated devices have no libusb_device, and are never unplugged
+            kept.push_back(dev);
+        } else {
+            removed.push_back(dev);
         }
+    }
 
-        if (isNew) {
-            usbDeviceArrived(list[listItem]);
+    // Look for devices that were added. They're opened on the init thread.
+    std::vector<libusb_device*> added;
+    for (ssize_t listItem = 0; listItem < listSize; ++listItem) {
+        if (!attached.count(list[listItem])) {
+            added.push_back(list[listItem]);
         }
     }
 
-    // Look for devices that were removed
-    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
-        USBDevice *dev = *i;
-        libusb_device *usbdev = dev->getDevice();
-        bool isRemoved = true;
+    if (!removed.empty()) {
+        mUSBDevices.swap(kept);
 
-        for (ssize_t listItem = 0; listItem < listSize; ++listItem) {
-            if (list[listItem] == usbdev) {
-                isRemoved = false;
+        for (std::vector<USBDevice*>::iterator i = removed.begin(), e = removed.end(); i != e; ++i) {
+            USBDevice *dev = *i;
+            if (mVerbose) {
+                std::clog << "USB device " << dev->getName() << " removed.\n";
             }
+            retireDevice(dev);
         }
+        updateChannelRoutes();
+        jsonConnectedDevicesChanged();
+    }
 
-        if (isRemoved) {
-            usbDeviceLeft(i);
+    // Devices that vanished before the init thread finished with them
+    mUSBInitMutex.lock();
+    for (std::set<libusb_device*>::iterator i = mUSBInitializing.begin(), e = mUSBInitializing.end(); i != e; ++i) {
+        if (!present.count(*i)) {
+            mUSBDeparted.insert(*i);
         }
     }
+    mUSBInitMutex.unlock();
 
     mEventMutex.unlock();
+
+    for (std::vector<libusb_device*>::iterator i = added.begin(), e = added.end(); i != e; ++i) {
+        queueUSBDevice(*i);
+    }
+
     libusb_free_device_list(list, true);
     return true;
 }
@@ -443,7 +1732,8 @@ void FCServer::usbHotplugThreadFunc(void *arg)
     }
 }
 
-void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, void *context)
+void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message,
+    const JsonPixelReader *pixels, void *context)
 {
     // Received a JSON message from a WebSockets client.
     // Replies are formed by modifying the original message.
@@ -456,6 +1746,7 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
         return;
     }
     const char *type = vtype.GetString();
+    Metrics::add(Metrics::JSON_MESSAGES);
 
     // Hold the event lock while dispatching
     self->mEventMutex.lock();
@@ -464,13 +1755,24 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
         self->jsonListConnectedDevices(message);
     } else if (!strcmp(type, "server_info")) {
         self->jsonServerInfo(message);
+    } else if (!strcmp(type, "server_metrics")) {
+        self->jsonServerMetrics(message);
+    } else if (!strcmp(type, "server_trace")) {
+        self->jsonServerTrace(message);
+    } else if (!strcmp(type, "server_reload")) {
+        self->jsonServerReload(message);
+    } else if (!strcmp(type, "snapshot_subscribe")) {
+        self->jsonSnapshotSubscribe(wsi, message);
+    } else if (!strcmp(type, "latency_subscribe")) {
+        self->jsonLatencySubscribe(wsi, message);
     } else if (message.HasMember("device")) {
-        self->jsonDeviceMessage(message);
+        self->jsonDeviceMessage(message, pixels);
     } else {
         message.AddMember("error", "Unknown message type", message.GetAllocator());
     }
 
     self->mEventMutex.unlock();
+    self->wakeMainLoop();
 
     // Remove heavyweight members we should never reply with
     message.RemoveMember("pixels");
@@ -480,11 +1782,13 @@ void FCServer::cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, vo
     self->mTcpNetServer.jsonReply(wsi, message);
 }
 
-void FCServer::jsonDeviceMessage(rapidjson::Document &message)
+void FCServer::jsonDeviceMessage(rapidjson::Document &message, const JsonPixelReader *pixels)
 {
     /*
      * If this message has a "device" member and doesn't match any server-global
      * message types, give each matching device a chance to handle it.
+     *
+     * device_pixels messages from the fast path carry their pixels separately.
      */
 
     const Value &device = message["device"];
@@ -496,7 +1800,12 @@ void FCServer::jsonDeviceMessage(rapidjson::Document &message)
 
             if (usbDev->matchConfiguration(device)) {
                 matched = true;
-                usbDev->writeMessage(message);
+                if (pixels) {
+                    usbDev->writeDevicePixels(message, pixels->pixels(), pixels->pixelBytes());
+                } else {
+                    usbDev->writeMessage(message);
+                    forgetDescription(usbDev);
+                }
                 if (message.HasMember("error"))
                     break;
             }
@@ -506,7 +1815,12 @@ void FCServer::jsonDeviceMessage(rapidjson::Document &message)
 
             if (spiDev->matchConfiguration(device)) {
                 matched = true;
-                spiDev->writeMessage(message);
+                if (pixels) {
+                    spiDev->writeDevicePixels(message, pixels->pixels(), pixels->pixelBytes());
+                } else {
+                    spiDev->writeMessage(message);
+                    forgetDescription(spiDev);
+                }
                 if (message.HasMember("error"))
                     break;
             }
@@ -522,17 +1836,183 @@ void FCServer::jsonListConnectedDevices(rapidjson::Document &message)
 {
     message.AddMember("devices", rapidjson::kArrayType, message.GetAllocator());
     Value &list = message["devices"];
+    list.Reserve(mUSBDevices.size() + mSPIDevices.size() + mNetDevices.size(), message.GetAllocator());
 
     for (unsigned i = 0; i != mUSBDevices.size(); i++) {
-        USBDevice *usbDev = mUSBDevices[i];
-        list.PushBack(rapidjson::kObjectType, message.GetAllocator());
-        mUSBDevices[i]->describe(list[i], message.GetAllocator());
+        describeDevice(mUSBDevices[i], list, message);
     }
 
     for (unsigned i = 0; i != mSPIDevices.size(); i++) {
-        SPIDevice *spiDev = mSPIDevices[i];
-        list.PushBack(rapidjson::kObjectType, message.GetAllocator());
-        mSPIDevices[i]->describe(list[i], message.GetAllocator());
+        describeDevice(mSPIDevices[i], list, message);
+    }
+
+    for (unsigned i = 0; i != mNetDevices.size(); i++) {
+        describeDevice(mNetDevices[i], list, message);
+    }
+}
+
+template <class T> void FCServer::describeDevice(T *dev, Value &list, rapidjson::Document &message)
+{
+    // Append a copy of this device's description, refreshing it if it's too old
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    CachedDescription *&cached = mDescriptions[dev];
+    if (cached) {
+        int64_t elapsed = int64_t(now.tv_sec - cached->time.tv_sec) * 1000 +
+            (now.tv_usec - cached->time.tv_usec) / 1000;
+        if (elapsed < 0 || elapsed >= DESCRIBE_CACHE_MILLIS) {
+            delete cached;
+            cached = 0;
+        }
+    }
+
+    if (!cached) {
+        cached = new CachedDescription();
+        cached->json.SetObject();
+        cached->time = now;
+        dev->describe(cached->json, cached->json.GetAllocator());
+    }
+
+    Value copy(rapidjson::kObjectType);
+    message.DeepCopy(copy, cached->json);
+    list.PushBack(copy, message.GetAllocator());
+}
+
+void FCServer::forgetDescription(const void *dev)
+{
+    std::map<const void*, CachedDescription*>::iterator i = mDescriptions.find(dev);
+    if (i != mDescriptions.end()) {
+        delete i->second;
+        mDescriptions.erase(i);
+    }
+}
+
+void FCServer::forgetDescriptions()
+{
+    for (std::map<const void*, CachedDescription*>::iterator i = mDescriptions.begin(), e = mDescriptions.end(); i != e; ++i) {
+        delete i->second;
+    }
+    mDescriptions.clear();
+}
+
+void FCServer::jsonSnapshotSubscribe(libwebsocket *wsi, rapidjson::Document &message)
+{
+    // Start or stop device_snapshot messages for this client
+    const Value &enable = message["enable"];
+    mTcpNetServer.jsonSubscribe(wsi, "device_snapshot", !enable.IsFalse());
+
+    message.AddMember("interval", mSnapshotInterval, message.GetAllocator());
+    message.AddMember("step", mSnapshotStep, message.GetAllocator());
+}
+
+void FCServer::jsonLatencySubscribe(libwebsocket *wsi, rapidjson::Document &message)
+{
+    // Start or stop latency_probe messages for this client
+    const Value &enable = message["enable"];
+    mTcpNetServer.jsonSubscribe(wsi, "latency_probe", !enable.IsFalse());
+}
+
+void FCServer::jsonServerMetrics(rapidjson::Document &message)
+{
+    // Server-wide totals, plus each device's own statistics from list_connected_devices
+    message.AddMember("metrics", rapidjson::kObjectType, message.GetAllocator());
+    Metrics::describe(message["metrics"], message.GetAllocator());
+    jsonListConnectedDevices(message);
+}
+
+void FCServer::jsonServerTrace(rapidjson::Document &message)
+{
+    // The trace log, as a Chrome trace event list
+    if (!Trace::enabled()) {
+        message.AddMember("error", "Tracing isn't compiled into this server", message.GetAllocator());
+        return;
+    }
+
+    message.AddMember("traceEvents", rapidjson::kArrayType, message.GetAllocator());
+    Trace::dump(message["traceEvents"], message.GetAllocator());
+    message.AddMember("displayTimeUnit", "ms", message.GetAllocator());
+}
+
+void FCServer::lockEvents()
+{
+    // mEventMutex.lock(), timing how long we waited. An uncontended lock isn't timed.
+
+    if (mEventMutex.try_lock()) {
+        Metrics::record(Metrics::EVENT_LOCK_WAIT, 0);
+        return;
+    }
+
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+    mEventMutex.lock();
+    gettimeofday(&t2, NULL);
+
+    Metrics::record(Metrics::EVENT_LOCK_WAIT,
+        (t2.tv_sec - t1.tv_sec) * 1000000LL + (t2.tv_usec - t1.tv_usec));
+}
+
+void FCServer::cbMetrics(std::ostream &out, void *context)
+{
+    /*
+     * Per-device statistics for Prometheus. Every numeric field from describe()
+     * becomes fcserver_device_<field>, labelled with the device's name. Samples are
+     * grouped by field, since each metric family has to be contiguous.
+     */
+
+    FCServer *self = static_cast<FCServer*>(context);
+    rapidjson::Document message;
+    message.SetObject();
+
+    self->mEventMutex.lock();
+    self->jsonListConnectedDevices(message);
+    std::vector<std::string> names;
+    for (std::vector<USBDevice*>::iterator i = self->mUSBDevices.begin(), e = self->mUSBDevices.end(); i != e; ++i) {
+        names.push_back((*i)->getName());
+    }
+    for (std::vector<SPIDevice*>::iterator i = self->mSPIDevices.begin(), e = self->mSPIDevices.end(); i != e; ++i) {
+        names.push_back((*i)->getName());
+    }
+    for (std::vector<NetDMXDevice*>::iterator i = self->mNetDevices.begin(), e = self->mNetDevices.end(); i != e; ++i) {
+        names.push_back((*i)->getName());
+    }
+    self->mEventMutex.unlock();
+
+    const Value &list = message["devices"];
+    std::vector<std::string> fields;
+    std::map<std::string, std::ostringstream*> samples;
+
+    for (unsigned i = 0; i < list.Size(); ++i) {
+        const Value &device = list[i];
+        for (Value::ConstMemberIterator m = device.MemberBegin(), e = device.MemberEnd(); m != e; ++m) {
+            const char *field = m->name.GetString();
+            if (!m->value.IsNumber() || !strcmp(field, "timestamp")) {
+                continue;
+            }
+
+            std::ostringstream *&s = samples[field];
+            if (!s) {
+                s = new std::ostringstream;
+                fields.push_back(field);
+            }
+
+            *s << "fcserver_device_" << field << "{device=\"" << names[i] << "\",type=\""
+                << (device["type"].IsString() ? device["type"].GetString() : "") << "\"} ";
+            if (m->value.IsUint64()) {
+                *s << m->value.GetUint64();
+            } else if (m->value.IsInt64()) {
+                *s << m->value.GetInt64();
+            } else {
+                *s << m->value.GetDouble();
+            }
+            *s << "\n";
+        }
+    }
+
+    for (std::vector<std::string>::iterator i = fields.begin(), e = fields.end(); i != e; ++i) {
+        out << "# TYPE fcserver_device_" << *i << " gauge\n" << samples[*i]->str();
+        delete samples[*i];
     }
 }
 
@@ -543,7 +2023,196 @@ void FCServer::jsonServerInfo(rapidjson::Document &message)
 
     // Server configuration
     message.AddMember("config", rapidjson::kObjectType, message.GetAllocator());
-    message.DeepCopy(message["config"], mConfig);
+    message.DeepCopy(message["config"], *mConfig);
+
+    // Scheduling settings each thread actually got
+    mThreadSettings.describe(message, message.GetAllocator());
+}
+
+void FCServer::jsonServerReload(rapidjson::Document &message)
+{
+    /*
+     * Reload with the "config" object from this message, or from the config file.
+     * Problems with the new configuration are reported in "error", and leave the
+     * running configuration as it was.
+     */
+
+    const Value &config = message["config"];
+    std::ostringstream error;
+    bool ok;
+
+    if (config.IsObject()) {
+        Document *doc = new Document;
+        doc->SetObject();
+        doc->DeepCopy(*doc, config);
+        ok = reloadConfiguration(doc, error);
+    } else if (config.IsNull()) {
+        ok = reloadConfigFile();
+        if (!ok) {
+            error << "Couldn't reload the configuration file";
+        }
+    } else {
+        error << "The optional 'config' must be an object";
+        ok = false;
+    }
+
+    if (!ok) {
+        Value text(error.str().c_str(), message.GetAllocator());
+        message.AddMember("error", text, message.GetAllocator());
+    }
+}
+
+void FCServer::requestReload()
+{
+    // Only sets a flag and writes the wakeup pipe, so signal handlers can call it
+    mReloadPending = true;
+    wakeMainLoop();
+}
+
+bool FCServer::reloadConfigFile()
+{
+    if (mConfigPath.empty()) {
+        std::clog << "fcserver was started without a config file, there's nothing to reload.\n";
+        return false;
+    }
+
+    FILE *configFile = fopen(mConfigPath.c_str(), "r");
+    if (!configFile) {
+        perror("Error opening config file");
+        return false;
+    }
+
+    Document *doc = new Document;
+    rapidjson::FileStream istr(configFile);
+    doc->ParseStream<0>(istr);
+    fclose(configFile);
+
+    if (doc->HasParseError()) {
+        std::clog << "Parse error at character " << doc->GetErrorOffset() << ": " << doc->GetParseError()
+            << "\nNot reloading " << mConfigPath << "\n";
+        delete doc;
+        return false;
+    }
+
+    std::ostringstream error;
+    if (!reloadConfiguration(doc, error)) {
+        std::clog << "Configuration errors:\n" << error.str() << "Not reloading " << mConfigPath << "\n";
+        return false;
+    }
+    return true;
+}
+
+std::string FCServer::jsonString(const Value &value)
+{
+    // Serialized JSON, for comparing configurations
+    rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
+    rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+    value.Accept(writer);
+    return std::string(buffer.GetString(), buffer.Size());
+}
+
+bool FCServer::reloadConfiguration(Document *config, std::ostream &error)
+{
+    /*
+     * Switch to a new configuration without closing anything that doesn't need it.
+     * Takes ownership of 'config', and deletes it if it's rejected.
+     *
+     * Each open device is matched against the new "devices" list and loads its new
+     * settings in place. Pixel maps are recompiled, and LUT or firmware config packets
+     * only go out when their contents change. Devices with no matching configuration are
+     * closed, and newly configured SPI and network devices are opened. USB devices that
+     * weren't wanted before are found again by a one-shot hotplug poll.
+     */
+
+    const Value &devices = (*config)["devices"];
+    if (!config->IsObject() || !devices.IsArray()) {
+        error << "The required 'devices' configuration key must be an array.\n";
+        delete config;
+        return false;
+    }
+
+    lockEvents();
+
+    // Everything else was set up at startup, and stays as it was
+    static const char *restartKeys[] = {
+        "listen", "relay", "opcListen", "opcThreads", "udpListen", "shmListen", "sources", "sourceMerge", "verbose", "backpressure", "frameBarrier",
+        "snapshotInterval", "snapshotStep", "usbBusThreads", "threads", "lockMemory", "forward", "record"
+    };
+    for (unsigned i = 0; i < sizeof restartKeys / sizeof restartKeys[0]; ++i) {
+        if (jsonString((*config)[restartKeys[i]]) != jsonString((*mConfig)[restartKeys[i]])) {
+            std::clog << "The '" << restartKeys[i] << "' configuration key won't change until fcserver restarts.\n";
+        }
+    }
+
+    bool colorChanged = jsonString((*config)["color"]) != jsonString(*mColor);
+
+    mRetiredConfigs.push_back(const_cast<Document*>(mConfig));
+    mRetiredDeviceIndexes.push_back(mDeviceIndex);
+    mConfig = config;
+    mColor = &(*config)["color"];
+    mDevices = &devices;
+    mDeviceIndex = new ConfigIndex(devices);
+    forgetDescriptions();
+    mConfigGeneration++;
+
+    bool removed = reloadDevices(mUSBDevices, colorChanged);
+    removed = reloadDevices(mSPIDevices, colorChanged) || removed;
+    removed = reloadDevices(mNetDevices, colorChanged) || removed;
+
+    updateChannelRoutes();
+    if (removed) {
+        jsonConnectedDevicesChanged();
+    }
+
+    startSPI();
+    startNetDMX();
+    mPollForDevicesOnce = true;
+
+    if (mVerbose) {
+        std::clog << "Configuration reloaded.\n";
+    }
+
+    mEventMutex.unlock();
+    wakeMainLoop();
+    return true;
+}
+
+// Serial numbers narrow down the search for a configuration. Only USB devices have them.
+static const char *configSerial(USBDevice *dev) { return dev->getSerial(); }
+static const char *configSerial(SPIDevice *dev) { return 0; }
+static const char *configSerial(NetDMXDevice *dev) { return 0; }
+
+template <class T> bool FCServer::reloadDevices(std::vector<T*> &devices, bool colorChanged)
+{
+    /*
+     * Load the current configuration into each device, or close devices that aren't
+     * configured any more. Returns true if any were closed.
+     */
+
+    std::vector<T*> kept;
+
+    for (typename std::vector<T*>::iterator i = devices.begin(), e = devices.end(); i != e; ++i) {
+        T *dev = *i;
+        const Value *match = mDeviceIndex->find(dev, configSerial(dev));
+
+        if (!match) {
+            if (mVerbose) {
+                std::clog << "Device " << dev->getName() << " has no matching configuration any more. Closing it.\n";
+            }
+            retireDevice(dev);
+            continue;
+        }
+
+        dev->loadConfiguration(*match);
+        if (colorChanged) {
+            dev->writeColorCorrection(*mColor);
+        }
+        kept.push_back(dev);
+    }
+
+    bool removed = kept.size() != devices.size();
+    devices.swap(kept);
+    return removed;
 }
 
 void FCServer::jsonConnectedDevicesChanged()
@@ -557,3 +2226,98 @@ void FCServer::jsonConnectedDevicesChanged()
 
     mTcpNetServer.jsonBroadcast(message);
 }
+
+void FCServer::jsonPublishSnapshots()
+{
+    /*
+     * Format the pixels readSnapshots() copied out, without holding any of our locks.
+     * Like other broadcasts, a subscriber that falls behind just misses snapshots.
+     */
+
+    rapidjson::Document message;
+    rapidjson::Document::AllocatorType &alloc = message.GetAllocator();
+
+    message.SetObject();
+    message.AddMember("type", "device_snapshot", alloc);
+    message.AddMember("step", mSnapshotStep, alloc);
+    message.AddMember("devices", rapidjson::kArrayType, alloc);
+    Value &list = message["devices"];
+
+    for (std::vector<Snapshot>::iterator i = mSnapshots.begin(), e = mSnapshots.end(); i != e; ++i) {
+        Value device(rapidjson::kObjectType);
+        Value type(i->type.c_str(), i->type.size(), alloc);
+        device.AddMember("type", type, alloc);
+        if (!i->serial.empty()) {
+            Value serial(i->serial.c_str(), i->serial.size(), alloc);
+            device.AddMember("serial", serial, alloc);
+        }
+
+        Value pixels(rapidjson::kArrayType);
+        pixels.Reserve(i->pixels.size(), alloc);
+        for (unsigned j = 0; j < i->pixels.size(); ++j) {
+            pixels.PushBack(unsigned(i->pixels[j]), alloc);
+        }
+
+        Value snapshot(rapidjson::kObjectType);
+        snapshot.AddMember("device", device, alloc);
+        snapshot.AddMember("pixels", pixels, alloc);
+        list.PushBack(snapshot, alloc);
+    }
+
+    mTcpNetServer.jsonPublish(message);
+}
+
+void FCServer::jsonPublishLatencyProbes()
+{
+    /*
+     * Report the probes readLatencyProbes() collected. Each stage is in microseconds
+     * after the probe was received, and left out if the frame never got that far.
+     */
+
+    rapidjson::Document message;
+    rapidjson::Document::AllocatorType &alloc = message.GetAllocator();
+
+    message.SetObject();
+    message.AddMember("type", "latency_probe", alloc);
+    message.AddMember("probes", rapidjson::kArrayType, alloc);
+    Value &list = message["probes"];
+
+    for (std::vector<LatencyReport>::iterator i = mLatencyReports.begin(), e = mLatencyReports.end(); i != e; ++i) {
+        const USBDevice::LatencyProbe &probe = i->probe;
+
+        Value device(rapidjson::kObjectType);
+        Value type(i->type.c_str(), i->type.size(), alloc);
+        device.AddMember("type", type, alloc);
+        if (!i->serial.empty()) {
+            Value serial(i->serial.c_str(), i->serial.size(), alloc);
+            device.AddMember("serial", serial, alloc);
+        }
+
+        Value report(rapidjson::kObjectType);
+        Value clientTime(probe.clientTime);
+        Value received(probe.received);
+        report.AddMember("device", device, alloc);
+        report.AddMember("sequence", probe.sequence, alloc);
+        report.AddMember("client_time", clientTime, alloc);
+        report.AddMember("received_time_us", received, alloc);
+
+        if (probe.mapped) {
+            Value mapped(probe.mapped - probe.received);
+            report.AddMember("mapped_us", mapped, alloc);
+        }
+        if (probe.submitted) {
+            Value submitted(probe.submitted - probe.received);
+            report.AddMember("submitted_us", submitted, alloc);
+            report.AddMember("frames_pending", probe.framesPending, alloc);
+        }
+        if (probe.completed) {
+            Value completed(probe.completed - probe.received);
+            report.AddMember("completed_us", completed, alloc);
+        }
+        report.AddMember("frames_coalesced", probe.framesCoalesced, alloc);
+        report.AddMember("error", probe.error, alloc);
+        list.PushBack(report, alloc);
+    }
+
+    mTcpNetServer.jsonPublish(message);
+}
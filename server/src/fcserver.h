@@ -25,13 +25,31 @@
 #include "rapidjson/document.h"
 #include "opc.h"
 #include "tcpnetserver.h"
+#include "opcreaderpool.h"
+#include "udpnetserver.h"
+#include "shmnetserver.h"
+#include "sourcemixer.h"
+#include "configindex.h"
+#include "threadsettings.h"
+#include "opcforwarder.h"
+#include "opcrecorder.h"
 #include "usbdevice.h"
+#include "usbbusthread.h"
 #include "spidevice.h"
+#include "netdmxdevice.h"
 #include <sstream>
 #include <vector>
+#include <deque>
+#include <set>
+#include <map>
+#include <string.h>
 #include <libusb.h>
 #include "tinythread.h"
 
+#ifndef OS_WINDOWS
+#include <poll.h>
+#endif
+
 
 class FCServer
 {
@@ -47,47 +65,325 @@ public:
     bool start(libusb_context *usb);
     void mainLoop();
 
+    /*
+     * Configuration can be reloaded while running. The "color" and "devices" keys take
+     * effect right away, and everything else needs a restart. Reloading from the file
+     * is safe to request from a signal handler.
+     */
+    void setConfigPath(const char *path) { mConfigPath = path ? path : ""; }
+    void requestReload();
+
+    // Push synthetic frames to every Fadecandy board for 'seconds', then print a report
+    void benchmark(unsigned seconds);
+
+    // Feed a log written by "record" back through the server, then print a report
+    bool replay(const char *path, bool maxSpeed);
+
 private:
     std::ostringstream mError;
 
-    const Document& mConfig;
+    const Document *mConfig;
     const Value& mListen;
     const Value& mRelay;
-    const Value& mColor;
-    const Value& mDevices;
+    const Value& mOpcListen;
+    const Value& mOpcThreads;
+    const Value& mUdpListen;
+    const Value& mShmListen;
+    const Value *mColor;
+    const Value *mDevices;
     bool mVerbose;
-    bool mPollForDevicesOnce;
+    bool mBackpressure;
+    bool mFrameBarrier;
+    bool mUSBBusThreadsEnabled;
+    volatile bool mPollForDevicesOnce;
+    volatile bool mReloadPending;
+    unsigned mNumSimulatedDevices;
+    unsigned mSnapshotInterval;
+    unsigned mSnapshotStep;
 
     TcpNetServer mTcpNetServer;
+    OpcReaderPool mOpcReaderPool;
+    UdpNetServer mUdpNetServer;
+    ShmNetServer mShmNetServer;
+
+    // Sends channel ranges on to downstream servers, when "forward" is configured
+    OpcForwarder mOpcForwarder;
+
+    // Logs every OPC message with its arrival time, when "record" is configured
+    OpcRecorder mOpcRecorder;
+
+    // Merges pixels from several listeners, when "sources" is configured
+    SourceMixer mSourceMixer;
+    tthread::mutex mSourceMutex;
+
+    // Optional CPU affinity, real-time priorities and memory locking. Under mEventMutex.
+    ThreadSettings mThreadSettings;
     tthread::recursive_mutex mEventMutex;
     tthread::thread *mUSBHotplugThread;
 
+    /*
+     * New USB devices are opened and configured on their own thread, so slow control
+     * transfers don't hold up the main loop. mUSBInitializing has every device that's
+     * queued or being opened, and mUSBDeparted has those unplugged in the meantime.
+     */
+    tthread::thread *mUSBInitThread;
+    tthread::mutex mUSBInitMutex;
+    tthread::condition_variable mUSBInitCond;
+    std::deque<libusb_device*> mUSBInitQueue;
+    std::set<libusb_device*> mUSBInitializing;
+    std::set<libusb_device*> mUSBDeparted;
+
+    /*
+     * On reload, mConfig moves to a new Document. The old ones are kept, since devices
+     * and the USB init thread may still refer to them. mConfigGeneration counts reloads.
+     */
+    std::string mConfigPath;
+    std::vector<Document*> mRetiredConfigs;
+    unsigned mConfigGeneration;
+
+    // Index of mDevices, replaced and retired along with its Document
+    ConfigIndex *mDeviceIndex;
+    std::vector<ConfigIndex*> mRetiredDeviceIndexes;
+
     std::vector<USBDevice*> mUSBDevices;
     struct libusb_context *mUSB;
 
+    /*
+     * With "usbBusThreads", devices are opened through a USBBusThread for their bus.
+     * Threads are started by the init thread as buses turn up, and never go away.
+     * mUSBBusThreadList is read without locks, up to mNumUSBBusThreads.
+     */
+    USBBusThread *mUSBBusThreads[256];
+    USBBusThread *mUSBBusThreadList[256];
+    unsigned mNumUSBBusThreads;
+
     std::vector<SPIDevice*> mSPIDevices;
+    std::vector<NetDMXDevice*> mNetDevices;
+
+    /*
+     * The device lists above change under mEventMutex. OPC messages are routed with an
+     * immutable copy instead, a refcounted DeviceSet that updateChannelRoutes() replaces
+     * whenever a device is added or removed. A removed device is retired rather than
+     * deleted, and goes away with the last DeviceSet that still lists it, so a reader
+     * holding a set never sees a device disappear. The last reader can be any thread, so
+     * the set is queued on mReleasedSets and its devices are deleted by the thread that
+     * handles their USB events, never while libusb might be completing their transfers.
+     *
+     * Each device's own state is still protected by mEventMutex, except for pixels sent
+     * to devices with hasPixelLock(). A channel routed only to those is written without
+     * mEventMutex, so the main loop and the network threads don't wait on each other.
+     * USB devices also guard their transfers with a lock of their own, which lets bus
+     * threads flush them without mEventMutex.
+     */
+    struct DeviceSet {
+        unsigned refs;
+        std::vector<USBDevice*> usbDevices;
+        std::vector<SPIDevice*> spiDevices;
+        std::vector<NetDMXDevice*> netDevices;
+
+        // Devices that use each OPC channel
+        std::vector<USBDevice*> usbRoutes[256];
+        std::vector<SPIDevice*> spiRoutes[256];
+        std::vector<NetDMXDevice*> netRoutes[256];
+
+        // Do pixels on each channel, or a frame commit, need mEventMutex?
+        bool lockedRoutes[256];
+        bool lockedCommit;
+
+        // Devices removed while this set was current, deleted along with it
+        std::vector<USBDevice*> usbRetired;
+        std::vector<SPIDevice*> spiRetired;
+        std::vector<NetDMXDevice*> netRetired;
+
+        DeviceSet() : refs(1), lockedCommit(false) {
+            memset(lockedRoutes, 0, sizeof lockedRoutes);
+        }
+    };
+
+    // Only held long enough to swap mDeviceSet or take a reference to it
+    DeviceSet *mDeviceSet;
+    tthread::mutex mDeviceSetMutex;
+
+    // Sets with no readers left, waiting for processEvents() to delete their devices
+    std::vector<DeviceSet*> mReleasedSets;
+    tthread::mutex mReleasedSetsMutex;
+
+    // Devices removed since the last updateChannelRoutes()
+    std::vector<USBDevice*> mUSBRetired;
+    std::vector<SPIDevice*> mSPIRetired;
+    std::vector<NetDMXDevice*> mNetRetired;
+
+    // Longest we'll pause an OPC client while waiting for devices to catch up
+    static const unsigned MAX_BACKPRESSURE_MILLIS = 100;
+
+    // OPC channels written since the last frame barrier. Under mFrameBarrierMutex.
+    bool mChannelsSinceCommit[256];
+    tthread::mutex mFrameBarrierMutex;
+
+    // Longest the main loop sleeps when nothing is happening
+    static const unsigned MAX_POLL_MILLIS = 100;
+
+    /*
+     * Pixel snapshots for device_snapshot subscribers. The main loop copies pixels out of
+     * each device while it already holds mEventMutex for flushing, then formats and
+     * publishes them after letting go. mSnapshots is only used by the main loop.
+     */
+    struct Snapshot {
+        std::string type;
+        std::string serial;
+        std::vector<uint8_t> pixels;
+    };
+    static const unsigned DEFAULT_SNAPSHOT_MILLIS = 500;
+    static const unsigned MIN_SNAPSHOT_MILLIS = 20;
+    std::vector<Snapshot> mSnapshots;
+    struct timeval mLastSnapshot;
+
+    /*
+     * Firmware that schedules frames by our clock gets a clock sync every so often, to
+     * keep each board's interpolation in phase with the others. The main loop sends them
+     * to every device back-to-back. It wakes often enough that this needs no timer.
+     */
+    static const unsigned CLOCK_SYNC_MILLIS = 1000;
+    struct timeval mLastClockSync;
+
+    /*
+     * Finished latency probes, collected the same way for latency_probe subscribers.
+     * Devices get drained on every pass even with no subscribers, so nobody sees stale probes.
+     */
+    struct LatencyReport {
+        std::string type;
+        std::string serial;
+        USBDevice::LatencyProbe probe;
+    };
+    std::vector<LatencyReport> mLatencyReports;
+    std::vector<USBDevice::LatencyProbe> mLatencyProbes;
+
+    /*
+     * Each device's describe() output, reused by list_connected_devices for a short while.
+     * A description is dropped early when its device is reconfigured or retired, so only
+     * the counters can be stale. That keeps frequent dashboard polls and bursts of
+     * connected_devices_changed from formatting every device each time, while the
+     * main loop waits for the event lock. Guarded by mEventMutex.
+     */
+    struct CachedDescription {
+        rapidjson::Document json;
+        struct timeval time;
+    };
+    static const unsigned DESCRIBE_CACHE_MILLIS = 250;
+    std::map<const void*, CachedDescription*> mDescriptions;
+
+    template <class T> void describeDevice(T *dev, Value &list, rapidjson::Document &message);
+    void forgetDescription(const void *dev);
+    void forgetDescriptions();
+
+    // Self-pipe for waking up the main loop from other threads. mWakeupPending is atomic.
+    int mWakeupPipe[2];
+    bool mWakeupPending;
+#ifndef OS_WINDOWS
+    std::vector<struct pollfd> mPollFds;
+#endif
 
     static void cbOpcMessage(OPC::Message &msg, void *context);
-    static void cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message, void *context);
+
+    // Messages from each listener, on their way through the SourceMixer to cbOpcMessage()
+    static void cbListenMessage(OPC::Message &msg, void *context);
+    static void cbOpcListenMessage(OPC::Message &msg, void *context);
+    static void cbUdpMessage(OPC::Message &msg, void *context);
+    static void cbShmMessage(OPC::Message &msg, void *context);
+    void sourceMessage(SourceMixer::Source source, OPC::Message &msg);
+    static void cbJsonMessage(libwebsocket *wsi, rapidjson::Document &message,
+        const JsonPixelReader *pixels, void *context);
 
     static LIBUSB_CALL int cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data);
 
     bool startUSB(libusb_context *usb);
+    void startThreadSettings();
     void usbDeviceArrived(libusb_device *device);
+    void openOnBusThread(USBDevice *dev, libusb_device *device);
+    static bool isOnBusThread(USBDevice *dev) { return dev->getHandleDevice() != dev->getDevice(); }
+    void queueUSBDevice(libusb_device *device);
+    bool usbDeviceDeparted(libusb_device *device);
+    void usbInitLoop();
+    static void usbInitThreadFunc(void *arg);
     void usbDeviceLeft(libusb_device *device);
     void usbDeviceLeft(std::vector<USBDevice*>::iterator iter);
     bool usbHotplugPoll();
 
     static void usbHotplugThreadFunc(void *arg);
 
+    void updateChannelRoutes();
+    DeviceSet *acquireDevices();
+    void releaseDevices(DeviceSet *set);
+    void deleteReleasedDevices();
+    void retireDevice(USBDevice *dev) { forgetDescription(dev); mUSBRetired.push_back(dev); }
+    void retireDevice(SPIDevice *dev) { forgetDescription(dev); mSPIRetired.push_back(dev); }
+    void retireDevice(NetDMXDevice *dev) { forgetDescription(dev); mNetRetired.push_back(dev); }
+    void waitForDevices(const DeviceSet &devices, const OPC::Message &msg);
+    bool isFrameBoundary(const OPC::Message &msg);
+    void commitFrames(DeviceSet &devices);
+
+    void processEvents();
+    void waitForStartup();
+
+    /*
+     * Replay runs on its own thread, alongside the listeners, while the main loop
+     * keeps running. Results are read back once it's done.
+     */
+    struct Replay {
+        OpcRecorder::Reader log;
+        bool maxSpeed;
+        volatile bool done;
+        uint64_t messages;
+        uint64_t bytes;
+        uint64_t recordedMicros;
+        uint64_t handlerMicros;
+        uint64_t lateMicros;
+    };
+    Replay *mReplay;
+    static void replayThreadFunc(void *arg);
+    void replayLoop(Replay &replay);
+
+    bool startWakeup();
+    void wakeMainLoop();
+    bool waitForEvents();
+    int pollTimeoutMillis();
+    int snapshotTimeoutMillis();
+    void readSnapshots();
+    void syncDeviceClocks();
+    void readLatencyProbes();
+
     bool startSPI();
-    void openAPA102SPIDevice(uint32_t port, int numLights);
+    void openAPA102SPIDevice(uint32_t bus, uint32_t port, int numLights);
+
+    bool startNetDMX();
+    void openNetDMXDevice(const Value &config);
+
+    static const unsigned MAX_SIMULATED_DEVICES = 1024;
+    bool startSimulatedDevices();
+    void openSimulatedDevice(const Value &config);
+
+    bool reloadConfigFile();
+    bool reloadConfiguration(Document *config, std::ostream &error);
+    template <class T> bool reloadDevices(std::vector<T*> &devices, bool colorChanged);
+    static std::string jsonString(const Value &value);
 
     // JSON event broadcasters
     void jsonConnectedDevicesChanged();
+    void jsonPublishSnapshots();
+    void jsonPublishLatencyProbes();
 
     // JSON message handlers
     void jsonListConnectedDevices(rapidjson::Document &message);
     void jsonServerInfo(rapidjson::Document &message);
-    void jsonDeviceMessage(rapidjson::Document &message);
+    void jsonServerMetrics(rapidjson::Document &message);
+    void jsonServerTrace(rapidjson::Document &message);
+    void jsonServerReload(rapidjson::Document &message);
+    void jsonSnapshotSubscribe(libwebsocket *wsi, rapidjson::Document &message);
+    void jsonLatencySubscribe(libwebsocket *wsi, rapidjson::Document &message);
+
+    // Take mEventMutex, recording how long we waited
+    void lockEvents();
+
+    static void cbMetrics(std::ostream &out, void *context);
+    void jsonDeviceMessage(rapidjson::Document &message, const JsonPixelReader *pixels);
 };
@@ -0,0 +1,95 @@
+/*
+ * Host-side keyframe interpolation for devices without their own
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "frameinterpolator.h"
+
+
+static int64_t elapsedMicros(const struct timeval &from, const struct timeval &to)
+{
+    return (int64_t)(to.tv_sec - from.tv_sec) * 1000000 + (to.tv_usec - from.tv_usec);
+}
+
+FrameInterpolator::FrameInterpolator()
+    : mIntervalMicros(MAX_INTERVAL_MICROS)
+{
+    gettimeofday(&mKeyframeTime, NULL);
+}
+
+void FrameInterpolator::resize(unsigned numValues)
+{
+    tthread::lock_guard<tthread::mutex> lock(mMutex);
+    mPrev.assign(numValues, 0);
+    mNext.assign(numValues, 0);
+}
+
+void FrameInterpolator::keyframe(const uint16_t *values)
+{
+    tthread::lock_guard<tthread::mutex> lock(mMutex);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int64_t interval = elapsedMicros(mKeyframeTime, now);
+    if (interval < MIN_INTERVAL_MICROS) {
+        interval = MIN_INTERVAL_MICROS;
+    } else if (interval > MAX_INTERVAL_MICROS) {
+        interval = MAX_INTERVAL_MICROS;
+    }
+
+    // Like the firmware, the old target becomes the new starting point
+    mPrev.swap(mNext);
+    mNext.assign(values, values + mPrev.size());
+    mKeyframeTime = now;
+    mIntervalMicros = interval;
+}
+
+void FrameInterpolator::render(uint16_t *out, bool interpolate)
+{
+    tthread::lock_guard<tthread::mutex> lock(mMutex);
+
+    /*
+     * Blend factor, with 15 fractional bits so the weighted sum of two 16-bit values
+     * still fits in 32 bits.
+     */
+
+    uint32_t alpha = 0x8000;
+    if (interpolate) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+
+        int64_t elapsed = elapsedMicros(mKeyframeTime, now);
+        if (elapsed < 0) {
+            alpha = 0;
+        } else if (elapsed < mIntervalMicros) {
+            alpha = (elapsed << 15) / mIntervalMicros;
+        }
+    }
+
+    const uint16_t *prev = mPrev.empty() ? 0 : &mPrev[0];
+    const uint16_t *next = mNext.empty() ? 0 : &mNext[0];
+    uint32_t beta = 0x8000 - alpha;
+
+    for (unsigned i = 0, e = mNext.size(); i != e; ++i) {
+        out[i] = (prev[i] * beta + next[i] * alpha + 0x4000) >> 15;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Host-side keyframe interpolation for devices without their own
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "tinythread.h"
+#include <libusb.h> // Also brings in gettimeofday() in a portable way
+
+
+/*
+ * The Fadecandy firmware blends smoothly between the last two frames it received.
+ * This does the same on the host, for devices that only show exactly what we send.
+ *
+ * Keyframes are 16-bit color values, already color corrected. render() blends the
+ * previous keyframe toward the newest one, over the same interval that separated
+ * the two, so motion keeps the pace it arrived with.
+ *
+ * keyframe() and render() may be called from different threads.
+ */
+
+class FrameInterpolator
+{
+public:
+    FrameInterpolator();
+
+    void resize(unsigned numValues);
+
+    // Start moving toward a new frame, with one value per entry
+    void keyframe(const uint16_t *values);
+
+    // Current values. Without interpolation, this is just the newest keyframe.
+    void render(uint16_t *out, bool interpolate);
+
+private:
+    // Limits on the assumed frame interval, for the first frame or after a pause
+    static const unsigned MIN_INTERVAL_MICROS = 1000;
+    static const unsigned MAX_INTERVAL_MICROS = 1000000;
+
+    tthread::mutex mMutex;
+    std::vector<uint16_t> mPrev;
+    std::vector<uint16_t> mNext;
+    struct timeval mKeyframeTime;
+    unsigned mIntervalMicros;
+};
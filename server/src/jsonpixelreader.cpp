@@ -0,0 +1,244 @@
+/*
+ * Streaming parser for JSON device_pixels messages
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "jsonpixelreader.h"
+#include "rapidjson/reader.h"
+#include <string.h>
+#include <limits.h>
+
+
+bool JsonPixelReader::parse(const char *json, rapidjson::Document &message)
+{
+    mPixels.clear();
+    mRemainder.Clear();
+
+    Handler handler(*this);
+    rapidjson::StringStream stream(json);
+    rapidjson::Reader reader;
+
+    // The input isn't modified, so the caller can still parse it again if we decline
+    if (!reader.Parse<0>(stream, handler) || !handler.foundPixels || handler.type != "device_pixels") {
+        return false;
+    }
+
+    // Everything but the pixels, usually only a few dozen bytes
+    message.Parse<0>(mRemainder.GetString());
+    return !message.HasParseError() && message.IsObject();
+}
+
+JsonPixelReader::Handler::Handler(JsonPixelReader &reader)
+    : reader(reader), writer(reader.mRemainder), depth(0), pixelsDepth(0),
+      expectKey(false), keyIsPixels(false), keyIsType(false), foundPixels(false)
+{}
+
+bool JsonPixelReader::Handler::beginValue()
+{
+    /*
+     * Called before each value. Returns true if it belongs in the remainder document,
+     * or false if it's part of the pixel array.
+     */
+
+    if (inPixels()) {
+        return false;
+    }
+
+    if (depth == 1 && keyIsPixels) {
+        // "pixels" that isn't an array. Keep it, and let the device complain.
+        writer.String("pixels", 6);
+        keyIsPixels = false;
+    }
+
+    return true;
+}
+
+void JsonPixelReader::Handler::endValue()
+{
+    // After each complete member value, the top-level object expects another name
+    if (depth == 1) {
+        expectKey = true;
+    }
+}
+
+void JsonPixelReader::Handler::pixel(int value)
+{
+    // Only direct elements of the pixel array count. Like the DOM path, anything that
+    // isn't an int becomes zero, and ints are clamped to [0, 255].
+
+    if (depth == pixelsDepth) {
+        reader.mPixels.push_back(value < 0 ? 0 : value > 255 ? 255 : value);
+    }
+}
+
+void JsonPixelReader::Handler::Null()
+{
+    if (beginValue()) {
+        writer.Null();
+        endValue();
+    } else {
+        pixel(0);
+    }
+}
+
+void JsonPixelReader::Handler::Bool(bool b)
+{
+    if (beginValue()) {
+        writer.Bool(b);
+        endValue();
+    } else {
+        pixel(0);
+    }
+}
+
+void JsonPixelReader::Handler::Int(int i)
+{
+    if (beginValue()) {
+        writer.Int(i);
+        endValue();
+    } else {
+        pixel(i);
+    }
+}
+
+void JsonPixelReader::Handler::Uint(unsigned u)
+{
+    if (beginValue()) {
+        writer.Uint(u);
+        endValue();
+    } else {
+        pixel(u > INT_MAX ? 0 : int(u));
+    }
+}
+
+void JsonPixelReader::Handler::Int64(int64_t i)
+{
+    if (beginValue()) {
+        writer.Int64(i);
+        endValue();
+    } else {
+        pixel(0);
+    }
+}
+
+void JsonPixelReader::Handler::Uint64(uint64_t u)
+{
+    if (beginValue()) {
+        writer.Uint64(u);
+        endValue();
+    } else {
+        pixel(0);
+    }
+}
+
+void JsonPixelReader::Handler::Double(double d)
+{
+    if (beginValue()) {
+        writer.Double(d);
+        endValue();
+    } else {
+        pixel(0);
+    }
+}
+
+void JsonPixelReader::Handler::String(const Ch *str, rapidjson::SizeType length, bool copy)
+{
+    if (depth == 1 && expectKey) {
+        // Member name. Hold back "pixels" until we see what kind of value it has.
+        expectKey = false;
+        keyIsType = length == 4 && !memcmp(str, "type", 4);
+        keyIsPixels = length == 6 && !memcmp(str, "pixels", 6);
+        if (!keyIsPixels) {
+            writer.String(str, length, copy);
+        }
+        return;
+    }
+
+    if (beginValue()) {
+        if (depth == 1 && keyIsType) {
+            type.assign(str, length);
+        }
+        writer.String(str, length, copy);
+        endValue();
+    } else {
+        pixel(0);
+    }
+}
+
+void JsonPixelReader::Handler::StartObject()
+{
+    if (beginValue()) {
+        writer.StartObject();
+    } else {
+        pixel(0);
+    }
+
+    if (++depth == 1) {
+        expectKey = true;
+    }
+}
+
+void JsonPixelReader::Handler::EndObject(rapidjson::SizeType memberCount)
+{
+    bool skipped = inPixels();
+    depth--;
+
+    if (!skipped) {
+        // The count would be off by one without "pixels", but Writer doesn't use it
+        writer.EndObject();
+        endValue();
+    }
+}
+
+void JsonPixelReader::Handler::StartArray()
+{
+    if (depth == 1 && keyIsPixels && !inPixels()) {
+        // This is the pixel array. Its elements go straight to mPixels.
+        keyIsPixels = false;
+        foundPixels = true;
+        reader.mPixels.clear();
+        pixelsDepth = ++depth;
+        return;
+    }
+
+    if (beginValue()) {
+        writer.StartArray();
+    } else {
+        pixel(0);
+    }
+    depth++;
+}
+
+void JsonPixelReader::Handler::EndArray(rapidjson::SizeType elementCount)
+{
+    if (inPixels()) {
+        if (depth-- == pixelsDepth) {
+            // End of the pixel array itself
+            pixelsDepth = 0;
+            endValue();
+        }
+        return;
+    }
+
+    writer.EndArray();
+    depth--;
+    endValue();
+}
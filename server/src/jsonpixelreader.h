@@ -0,0 +1,95 @@
+/*
+ * Streaming parser for JSON device_pixels messages
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+
+
+/*
+ * A "device_pixels" message is mostly one big integer array. Parsing that into a
+ * rapidjson DOM costs a Value and an allocation per color component, only for the
+ * device to copy it into its framebuffer and throw the DOM away.
+ *
+ * This reader parses a JSON message with the SAX interface. Top-level "pixels" array
+ * elements are clamped and stored as bytes the moment they're parsed, and every other
+ * member is copied into a small Document that's used for dispatch and for the reply.
+ *
+ * Not thread-safe; keep one reader per thread so the pixel buffer is reused.
+ */
+
+class JsonPixelReader {
+public:
+    // Parse a JSON message. Returns true only for a device_pixels message with a pixel
+    // array. The message is then in 'message', without "pixels", and its pixels are in
+    // pixels(). For anything else, returns false and the caller should parse normally.
+    bool parse(const char *json, rapidjson::Document &message);
+
+    const uint8_t *pixels() const { return mPixels.empty() ? 0 : &mPixels[0]; }
+    unsigned pixelBytes() const { return mPixels.size(); }
+
+private:
+    typedef rapidjson::Writer<rapidjson::StringBuffer> Writer;
+
+    // SAX handler, called by rapidjson's GenericReader
+    struct Handler {
+        typedef char Ch;
+
+        JsonPixelReader &reader;
+        Writer writer;
+        unsigned depth;         // Object and array nesting, 1 inside the top-level object
+        unsigned pixelsDepth;   // Depth of the pixel array, or zero if we aren't in it
+        bool expectKey;         // The next string at depth 1 is a member name
+        bool keyIsPixels;       // The value coming up belongs to "pixels"
+        bool keyIsType;         // The value coming up belongs to "type"
+        bool foundPixels;
+        std::string type;
+
+        Handler(JsonPixelReader &reader);
+
+        void Null();
+        void Bool(bool b);
+        void Int(int i);
+        void Uint(unsigned u);
+        void Int64(int64_t i);
+        void Uint64(uint64_t u);
+        void Double(double d);
+        void String(const Ch *str, rapidjson::SizeType length, bool copy);
+        void StartObject();
+        void EndObject(rapidjson::SizeType memberCount);
+        void StartArray();
+        void EndArray(rapidjson::SizeType elementCount);
+
+        bool inPixels() const { return pixelsDepth && depth >= pixelsDepth; }
+        bool beginValue();
+        void endValue();
+        void pixel(int value);
+    };
+
+    std::vector<uint8_t> mPixels;
+    rapidjson::StringBuffer mRemainder;
+};
@@ -26,7 +26,9 @@
 #include "rapidjson/filestream.h"
 #include "fcserver.h"
 #include "version.h"
+#include <csignal>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 
 const char *kDefaultConfig =
@@ -49,10 +51,21 @@ const char *kDefaultConfig =
     "    }\n";
 
 const char *kSystemConfigPath = "/etc/fcserver/config.json";
+const unsigned kBenchmarkSeconds = 10;
+
+#ifdef SIGHUP
+static FCServer *gServer;
+
+static void reloadSignal(int)
+{
+    gServer->requestReload();
+}
+#endif
 
 int main(int argc, char **argv)
 {
     rapidjson::Document config;
+    const char *configPath = NULL;
 
     libusb_context *usb;
     if (libusb_init(&usb)) {
@@ -60,6 +73,25 @@ int main(int argc, char **argv)
         return 7;
     }
 
+    // Benchmark mode takes the same optional config file
+    bool benchmark = argc >= 2 && !strcmp(argv[1], "--benchmark");
+    if (benchmark) {
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
+    // So does replay, after the log to replay
+    const char *replayPath = NULL;
+    bool replayMaxSpeed = false;
+    if (!benchmark && argc >= 3 && (!strcmp(argv[1], "--replay") || !strcmp(argv[1], "--replay-fast"))) {
+        replayMaxSpeed = !strcmp(argv[1], "--replay-fast");
+        replayPath = argv[2];
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
     if (argc == 2 && argv[1][0] != '-') {
         // Load config from file
 
@@ -71,6 +103,7 @@ int main(int argc, char **argv)
 
         rapidjson::FileStream istr(configFile);
         config.ParseStream<0>(istr);
+        configPath = argv[1];
 
     } else if (argc == 1) {
         // Load default configuration
@@ -80,6 +113,7 @@ int main(int argc, char **argv)
             std::clog << "Using system config at " << kSystemConfigPath << "\n";
             rapidjson::FileStream istr(configFile);
             config.ParseStream<0>(istr);
+            configPath = kSystemConfigPath;
 
         } else {
             std::clog << "No system config file found, using default\n";
@@ -93,7 +127,19 @@ int main(int argc, char **argv)
             "Fadecandy Open Pixel Control server\n"
             "%s\n"
             "\n"
-            "usage: fcserver [<config.json>]\n"
+            "usage: fcserver [--benchmark] [<config.json>]\n"
+            "       fcserver --replay | --replay-fast <log> [<config.json>]\n"
+            "\n"
+            "With --benchmark, fcserver sends synthetic frames to every\n"
+            "attached Fadecandy as fast as it can for %u seconds, then\n"
+            "reports frame rates and USB latency for each board.\n"
+            "\n"
+            "With --replay, fcserver plays back OPC messages saved by the\n"
+            "\"record\" config option, at their original pace, then reports\n"
+            "how it kept up. --replay-fast sends them as fast as it can.\n"
+            "\n"
+            "On SIGHUP, fcserver reloads its config file. Color correction\n"
+            "and devices change in place, without closing other devices.\n"
             "\n"
             "To use multiple Fadecandy devices or to set up a custom\n"
             "mapping from OPC pixel to Fadecandy pixel, you can provide\n"
@@ -112,6 +158,7 @@ int main(int argc, char **argv)
             "available at the URL above.\n"
             "\n",
             kFCServerVersion,
+            kBenchmarkSeconds,
             kDefaultConfig);
         return 1;
     }
@@ -131,6 +178,20 @@ int main(int argc, char **argv)
         return 9;
     }
 
+    server.setConfigPath(configPath);
+#ifdef SIGHUP
+    gServer = &server;
+    signal(SIGHUP, reloadSignal);
+#endif
+
+    if (benchmark) {
+        server.benchmark(kBenchmarkSeconds);
+        return 0;
+    }
+    if (replayPath) {
+        return server.replay(replayPath, replayMaxSpeed) ? 0 : 6;
+    }
+
     server.mainLoop();
 
     // If mainLoop() exits, it was an error
@@ -0,0 +1,185 @@
+/*
+ * Counters and histograms for the fcserver hot path
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "metrics.h"
+#include <string.h>
+
+#ifdef _MSC_VER
+__declspec(thread) Metrics::Shard *Metrics::tShard;
+#else
+__thread Metrics::Shard *Metrics::tShard;
+#endif
+
+std::vector<Metrics::Shard*> Metrics::sShards;
+std::vector<Metrics::Collector> Metrics::sCollectors;
+tthread::mutex Metrics::sMutex;
+
+// Names are used as-is for JSON. Prometheus adds an "fcserver_" prefix, and "_total" on counters.
+const char *Metrics::counterNames[NUM_COUNTERS] = {
+    "opc_messages",
+    "opc_bytes",
+    "opc_messages_hidden",
+    "forward_bytes",
+    "forward_bytes_dropped",
+    "record_bytes",
+    "record_bytes_dropped",
+    "json_messages",
+    "bytes_mapped",
+    "frames_submitted",
+    "frames_coalesced",
+    "usb_submit_errors",
+    "usb_transfer_errors",
+    "usb_event_errors",
+};
+
+const char *Metrics::histogramNames[NUM_HISTOGRAMS] = {
+    "event_lock_wait_us",
+};
+
+
+Metrics::Shard &Metrics::newShard()
+{
+    Shard *s = new Shard;
+    for (unsigned i = 0; i < NUM_COUNTERS; ++i) {
+        s->counters[i].store(0);
+    }
+    for (unsigned h = 0; h < NUM_HISTOGRAMS; ++h) {
+        for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+            s->buckets[h][i].store(0);
+        }
+        s->sums[h].store(0);
+    }
+
+    sMutex.lock();
+    sShards.push_back(s);
+    sMutex.unlock();
+
+    tShard = s;
+    return *s;
+}
+
+void Metrics::record(Histogram histogram, uint64_t micros)
+{
+    // Bucket i holds values below 2^i microseconds. The last bucket has everything else.
+    unsigned bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && (micros >> bucket)) {
+        bucket++;
+    }
+
+    Shard &s = shard();
+    std::atomic<uint64_t> &b = s.buckets[histogram][bucket];
+    std::atomic<uint64_t> &sum = s.sums[histogram];
+    b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum.store(sum.load(std::memory_order_relaxed) + micros, std::memory_order_relaxed);
+}
+
+void Metrics::addCollector(collector_t collector, void *context)
+{
+    Collector c = { collector, context };
+    sMutex.lock();
+    sCollectors.push_back(c);
+    sMutex.unlock();
+}
+
+void Metrics::sum(Totals &totals)
+{
+    memset(&totals, 0, sizeof totals);
+
+    sMutex.lock();
+    for (std::vector<Shard*>::iterator i = sShards.begin(), e = sShards.end(); i != e; ++i) {
+        Shard &s = **i;
+        for (unsigned c = 0; c < NUM_COUNTERS; ++c) {
+            totals.counters[c] += s.counters[c].load(std::memory_order_relaxed);
+        }
+        for (unsigned h = 0; h < NUM_HISTOGRAMS; ++h) {
+            for (unsigned b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+                totals.buckets[h][b] += s.buckets[h][b].load(std::memory_order_relaxed);
+            }
+            totals.sums[h] += s.sums[h].load(std::memory_order_relaxed);
+        }
+    }
+    sMutex.unlock();
+}
+
+void Metrics::describe(Value &object, Allocator &alloc)
+{
+    Totals totals;
+    sum(totals);
+
+    for (unsigned c = 0; c < NUM_COUNTERS; ++c) {
+        object.AddMember(counterNames[c], totals.counters[c], alloc);
+    }
+
+    for (unsigned h = 0; h < NUM_HISTOGRAMS; ++h) {
+        object.AddMember(histogramNames[h], rapidjson::kObjectType, alloc);
+        Value &histogram = object[histogramNames[h]];
+
+        uint64_t count = 0;
+        histogram.AddMember("buckets", rapidjson::kArrayType, alloc);
+        for (unsigned b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            histogram["buckets"].PushBack(totals.buckets[h][b], alloc);
+            count += totals.buckets[h][b];
+        }
+        histogram.AddMember("count", count, alloc);
+        histogram.AddMember("sum", totals.sums[h], alloc);
+    }
+}
+
+void Metrics::writePrometheus(std::ostream &out)
+{
+    Totals totals;
+    sum(totals);
+
+    for (unsigned c = 0; c < NUM_COUNTERS; ++c) {
+        out << "# TYPE fcserver_" << counterNames[c] << "_total counter\n"
+            << "fcserver_" << counterNames[c] << "_total " << totals.counters[c] << "\n";
+    }
+
+    for (unsigned h = 0; h < NUM_HISTOGRAMS; ++h) {
+        const char *name = histogramNames[h];
+        uint64_t count = 0;
+
+        out << "# TYPE fcserver_" << name << " histogram\n";
+        for (unsigned b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+            count += totals.buckets[h][b];
+            out << "fcserver_" << name << "_bucket{le=\"";
+            if (b == HISTOGRAM_BUCKETS - 1) {
+                out << "+Inf";
+            } else {
+                // Integer microseconds below 2^b, so the upper bound is 2^b - 1
+                out << ((uint64_t(1) << b) - 1);
+            }
+            out << "\"} " << count << "\n";
+        }
+        out << "fcserver_" << name << "_sum " << totals.sums[h] << "\n"
+            << "fcserver_" << name << "_count " << count << "\n";
+    }
+
+    sMutex.lock();
+    std::vector<Collector> collectors = sCollectors;
+    sMutex.unlock();
+
+    for (std::vector<Collector>::iterator i = collectors.begin(), e = collectors.end(); i != e; ++i) {
+        i->fn(out, i->context);
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * Counters and histograms for the fcserver hot path
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include <vector>
+#include <atomic>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+
+
+/*
+ * A process-wide registry of hot path counters and latency histograms.
+ *
+ * Every thread that records a metric gets its own shard, so recording is a plain
+ * load and store on memory no other thread writes. Nothing is shared or locked
+ * until someone asks for a report, which sums the shards. Shards are never freed,
+ * so a thread's counts outlive it.
+ *
+ * Per-device statistics stay with the devices. Report writers call each collector
+ * registered with addCollector(), so the server can add them to Prometheus output.
+ */
+
+class Metrics
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+    enum Counter {
+        OPC_MESSAGES = 0,
+        OPC_BYTES,
+        OPC_MESSAGES_HIDDEN,
+        FORWARD_BYTES,
+        FORWARD_BYTES_DROPPED,
+        RECORD_BYTES,
+        RECORD_BYTES_DROPPED,
+        JSON_MESSAGES,
+        BYTES_MAPPED,
+        FRAMES_SUBMITTED,
+        FRAMES_COALESCED,
+        USB_SUBMIT_ERRORS,
+        USB_TRANSFER_ERRORS,
+        USB_EVENT_ERRORS,
+        NUM_COUNTERS
+    };
+
+    // Histograms are in microseconds, with power-of-two buckets
+    enum Histogram {
+        EVENT_LOCK_WAIT = 0,
+        NUM_HISTOGRAMS
+    };
+
+    static const unsigned HISTOGRAM_BUCKETS = 24;
+
+    typedef void (*collector_t)(std::ostream &out, void *context);
+
+    static void add(Counter counter, uint64_t amount = 1) {
+        std::atomic<uint64_t> &c = shard().counters[counter];
+        c.store(c.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    static void record(Histogram histogram, uint64_t micros);
+
+    // Add totals to a JSON object
+    static void describe(Value &object, Allocator &alloc);
+
+    // Prometheus text exposition format, including registered collectors
+    static void writePrometheus(std::ostream &out);
+
+    static void addCollector(collector_t collector, void *context);
+
+private:
+    struct Shard {
+        std::atomic<uint64_t> counters[NUM_COUNTERS];
+        std::atomic<uint64_t> buckets[NUM_HISTOGRAMS][HISTOGRAM_BUCKETS];
+        std::atomic<uint64_t> sums[NUM_HISTOGRAMS];
+    };
+
+    struct Totals {
+        uint64_t counters[NUM_COUNTERS];
+        uint64_t buckets[NUM_HISTOGRAMS][HISTOGRAM_BUCKETS];
+        uint64_t sums[NUM_HISTOGRAMS];
+    };
+
+    struct Collector {
+        collector_t fn;
+        void *context;
+    };
+
+    static Shard &shard() {
+        Shard *s = tShard;
+        return s ? *s : newShard();
+    }
+
+    static Shard &newShard();
+    static void sum(Totals &totals);
+
+    static const char *counterNames[NUM_COUNTERS];
+    static const char *histogramNames[NUM_HISTOGRAMS];
+
+#ifdef _MSC_VER
+    static __declspec(thread) Shard *tShard;
+#else
+    static __thread Shard *tShard;
+#endif
+    static std::vector<Shard*> sShards;
+    static std::vector<Collector> sCollectors;
+    static tthread::mutex sMutex;
+};
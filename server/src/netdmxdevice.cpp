@@ -0,0 +1,408 @@
+/*
+ * Art-Net and E1.31 (sACN) output devices for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "netdmxdevice.h"
+#include <iostream>
+#include <sstream>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef OS_WINDOWS
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#endif
+
+const char *NetDMXDevice::ARTNET_TYPE = "artnet";
+const char *NetDMXDevice::E131_TYPE = "e131";
+
+
+NetDMXDevice::NetDMXDevice(Protocol protocol, unsigned firstUniverse, unsigned numUniverses, bool verbose)
+    : mProtocol(protocol),
+      mFirstUniverse(firstUniverse),
+      mNumUniverses(numUniverses),
+      mPacketBytes(headerBytes(protocol) + DMX_CHANNELS),
+      mVerbose(verbose),
+      mSocket(-1),
+      mLayout(numUniverses * PIXELS_PER_UNIVERSE, headerBytes(protocol), 3,
+          PIXELS_PER_UNIVERSE, headerBytes(protocol) + DMX_CHANNELS),
+      mPackets(numUniverses * (headerBytes(protocol) + DMX_CHANNELS), 0),
+      mSequence(0),
+      mFrameBarrier(false),
+      mFrameHeld(false),
+      mFramesSent(0)
+{
+    gettimeofday(&mTimestamp, NULL);
+
+    // E1.31 wants a unique source ID. This one only needs to differ between servers.
+    for (unsigned i = 0; i < sizeof mCID; ++i) {
+        mCID[i] = uint8_t((mTimestamp.tv_usec >> (i % 4) * 8) ^ (mTimestamp.tv_sec >> (i % 3) * 8) ^ (i * 0x9D));
+    }
+
+    for (unsigned i = 0; i < mNumUniverses; ++i) {
+        initPacket(i);
+    }
+}
+
+NetDMXDevice::~NetDMXDevice()
+{
+#ifndef OS_WINDOWS
+    if (mSocket >= 0) {
+        close(mSocket);
+    }
+#endif
+}
+
+bool NetDMXDevice::parseType(const char *type, Protocol &protocol)
+{
+    if (!strcmp(type, ARTNET_TYPE)) {
+        protocol = ARTNET;
+        return true;
+    }
+    if (!strcmp(type, E131_TYPE)) {
+        protocol = E131;
+        return true;
+    }
+    return false;
+}
+
+unsigned NetDMXDevice::headerBytes(Protocol protocol)
+{
+    return protocol == ARTNET ? ARTNET_HEADER_BYTES : E131_HEADER_BYTES;
+}
+
+void NetDMXDevice::initPacket(unsigned index)
+{
+    /*
+     * Everything but the pixel data and sequence number is constant, so each packet
+     * header is filled in once here. Multi-byte fields are big-endian, apart from
+     * the Art-Net opcode.
+     */
+
+    uint8_t *p = packet(index);
+    unsigned universe = mFirstUniverse + index;
+
+    if (mProtocol == ARTNET) {
+        memcpy(p, "Art-Net", 8);
+        p[8] = 0x00;                    // OpDmx, little-endian
+        p[9] = 0x50;
+        p[10] = 0;                      // Protocol version 14
+        p[11] = 14;
+        p[12] = 0;                      // Sequence
+        p[13] = 0;                      // Physical port
+        p[14] = universe & 0xFF;        // SubUni
+        p[15] = (universe >> 8) & 0x7F; // Net
+        p[16] = DMX_CHANNELS >> 8;
+        p[17] = DMX_CHANNELS & 0xFF;
+        return;
+    }
+
+    // Root layer
+    p[0] = 0x00;                        // Preamble size
+    p[1] = 0x10;
+    p[2] = 0x00;                        // Postamble size
+    p[3] = 0x00;
+    memcpy(p + 4, "ASC-E1.17\0\0\0", 12);
+    p[16] = 0x70 | ((mPacketBytes - 16) >> 8);
+    p[17] = (mPacketBytes - 16) & 0xFF;
+    p[18] = 0;                          // VECTOR_ROOT_E131_DATA
+    p[19] = 0;
+    p[20] = 0;
+    p[21] = 0x04;
+    memcpy(p + 22, mCID, sizeof mCID);
+
+    // Framing layer
+    p[38] = 0x70 | ((mPacketBytes - 38) >> 8);
+    p[39] = (mPacketBytes - 38) & 0xFF;
+    p[40] = 0;                          // VECTOR_E131_DATA_PACKET
+    p[41] = 0;
+    p[42] = 0;
+    p[43] = 0x02;
+    memset(p + 44, 0, 64);
+    strcpy((char*) p + 44, "fcserver");
+    p[108] = 100;                       // Priority
+    p[109] = 0;                         // Synchronization address
+    p[110] = 0;
+    p[111] = 0;                         // Sequence
+    p[112] = 0;                         // Options
+    p[113] = universe >> 8;
+    p[114] = universe & 0xFF;
+
+    // DMP layer
+    p[115] = 0x70 | ((mPacketBytes - 115) >> 8);
+    p[116] = (mPacketBytes - 115) & 0xFF;
+    p[117] = 0x02;                      // VECTOR_DMP_SET_PROPERTY
+    p[118] = 0xA1;                      // Address and data type
+    p[119] = 0;                         // First property address
+    p[120] = 0;
+    p[121] = 0;                         // Address increment
+    p[122] = 1;
+    p[123] = (DMX_CHANNELS + 1) >> 8;   // Property count, including the start code
+    p[124] = (DMX_CHANNELS + 1) & 0xFF;
+    p[125] = 0;                         // DMX start code
+}
+
+bool NetDMXDevice::matchConfiguration(const Value &config)
+{
+    if (!config.IsObject()) {
+        return false;
+    }
+
+    const Value &vtype = config["type"];
+    const Value &vhost = config["host"];
+    const Value &vuniverse = config["universe"];
+    Protocol protocol;
+
+    if (!vtype.IsString() || !parseType(vtype.GetString(), protocol) || protocol != mProtocol) {
+        return false;
+    }
+
+    if (vhost.IsNull() ? !mHost.empty() : (!vhost.IsString() || mHost != vhost.GetString())) {
+        return false;
+    }
+
+    if (!vuniverse.IsNull() && (!vuniverse.IsUint() || vuniverse.GetUint() != mFirstUniverse)) {
+        return false;
+    }
+
+    return true;
+}
+
+void NetDMXDevice::loadConfiguration(const Value &config)
+{
+    const Value *map = 0;
+    const Value &vmap = config["map"];
+
+    if (vmap.IsArray()) {
+        map = &vmap;
+    } else if (!vmap.IsNull() && mVerbose) {
+        std::clog << "Device configuration 'map' must be an array.\n";
+    }
+
+    mPixelMap.compile(map, mLayout, mVerbose);
+}
+
+bool NetDMXDevice::usesOpcChannel(unsigned channel)
+{
+    return mPixelMap.usesChannel(channel);
+}
+
+void NetDMXDevice::writeMessage(const OPC::Message &msg)
+{
+    if (msg.command != OPC::SetPixelColors || !mPixelMap.apply(msg, &mPackets[0])) {
+        return;
+    }
+
+    if (mFrameBarrier) {
+        mFrameHeld = true;
+    } else {
+        sendFrame();
+    }
+}
+
+void NetDMXDevice::setFrameBarrier(bool enabled)
+{
+    mFrameBarrier = enabled;
+}
+
+void NetDMXDevice::commitFrame()
+{
+    if (mFrameHeld) {
+        mFrameHeld = false;
+        sendFrame();
+    }
+}
+
+std::string NetDMXDevice::getName()
+{
+    std::ostringstream s;
+    s << (mProtocol == ARTNET ? "Art-Net" : "E1.31") << " universe " << mFirstUniverse;
+    if (mNumUniverses > 1) {
+        s << "-" << (mFirstUniverse + mNumUniverses - 1);
+    }
+    if (!mHost.empty()) {
+        s << " on " << mHost;
+    }
+    return s.str();
+}
+
+void NetDMXDevice::describe(Value &object, Allocator &alloc)
+{
+    object.AddMember("type", mProtocol == ARTNET ? ARTNET_TYPE : E131_TYPE, alloc);
+    if (!mHost.empty()) {
+        object.AddMember("host", mHost.c_str(), alloc);
+    }
+    object.AddMember("universe", mFirstUniverse, alloc);
+    object.AddMember("universes", mNumUniverses, alloc);
+    object.AddMember("frames_sent", mFramesSent, alloc);
+
+    uint64_t timestamp = (uint64_t)mTimestamp.tv_sec * 1000 + mTimestamp.tv_usec / 1000;
+    object.AddMember("timestamp", timestamp, alloc);
+}
+
+#ifdef OS_WINDOWS
+
+int NetDMXDevice::open(const char *host, int port)
+{
+    std::clog << "Art-Net and E1.31 output isn't supported on this platform.\n";
+    return -1;
+}
+
+void NetDMXDevice::sendFrame() {}
+
+#else
+
+int NetDMXDevice::open(const char *host, int port)
+{
+    if (!port) {
+        port = mProtocol == ARTNET ? ARTNET_PORT : E131_PORT;
+    }
+
+    mAddrs.resize(mNumUniverses);
+
+    if (host) {
+        // Every universe goes to the same node
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+
+        char portStr[16];
+        snprintf(portStr, sizeof portStr, "%d", port);
+
+        struct addrinfo *addrs;
+        int r = getaddrinfo(host, portStr, &hints, &addrs);
+        if (r) {
+            if (mVerbose) {
+                std::clog << "Can't resolve " << host << ": " << gai_strerror(r) << "\n";
+            }
+            return -1;
+        }
+
+        mSocket = socket(addrs->ai_family, addrs->ai_socktype, addrs->ai_protocol);
+        mAddrLen = addrs->ai_addrlen;
+        for (unsigned i = 0; i < mNumUniverses; ++i) {
+            memcpy(&mAddrs[i], addrs->ai_addr, addrs->ai_addrlen);
+        }
+        freeaddrinfo(addrs);
+        mHost = host;
+
+        if (mSocket < 0) {
+            return -1;
+        }
+
+        // Harmless for unicast, and lets a configured subnet broadcast address work
+        int one = 1;
+        setsockopt(mSocket, SOL_SOCKET, SO_BROADCAST, &one, sizeof one);
+
+    } else {
+        /*
+         * Without a host, Art-Net broadcasts and E1.31 uses the standard multicast
+         * group for each universe, 239.255.<high byte>.<low byte>.
+         */
+
+        mSocket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (mSocket < 0) {
+            return -1;
+        }
+
+        int one = 1;
+        if (mProtocol == ARTNET) {
+            setsockopt(mSocket, SOL_SOCKET, SO_BROADCAST, &one, sizeof one);
+        }
+
+        mAddrLen = sizeof(struct sockaddr_in);
+        for (unsigned i = 0; i < mNumUniverses; ++i) {
+            unsigned universe = mFirstUniverse + i;
+            struct sockaddr_in *sin = (struct sockaddr_in*) &mAddrs[i];
+
+            memset(sin, 0, sizeof *sin);
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            sin->sin_addr.s_addr = htonl(mProtocol == ARTNET ? INADDR_BROADCAST
+                : (0xEFFF0000 | (universe & 0xFFFF)));
+        }
+    }
+
+#ifdef OS_LINUX
+    mIov.resize(mNumUniverses);
+    mMsgs.resize(mNumUniverses);
+    memset(&mMsgs[0], 0, mMsgs.size() * sizeof mMsgs[0]);
+
+    for (unsigned i = 0; i < mNumUniverses; ++i) {
+        mIov[i].iov_base = packet(i);
+        mIov[i].iov_len = mPacketBytes;
+        mMsgs[i].msg_hdr.msg_name = &mAddrs[i];
+        mMsgs[i].msg_hdr.msg_namelen = mAddrLen;
+        mMsgs[i].msg_hdr.msg_iov = &mIov[i];
+        mMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+    return 0;
+}
+
+void NetDMXDevice::sendFrame()
+{
+    // Art-Net reserves sequence 0 for "not sequenced", so both protocols count 1-255
+    if (++mSequence == 0) {
+        mSequence = 1;
+    }
+
+    unsigned seqOffset = mProtocol == ARTNET ? 12 : 111;
+    for (unsigned i = 0; i < mNumUniverses; ++i) {
+        packet(i)[seqOffset] = mSequence;
+    }
+
+#ifdef OS_LINUX
+    unsigned sent = 0;
+    while (sent < mNumUniverses) {
+        int r = sendmmsg(mSocket, &mMsgs[sent], mNumUniverses - sent, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (mVerbose) {
+                std::clog << "Error sending to " << getName() << ": " << strerror(errno) << "\n";
+            }
+            return;
+        }
+        sent += r;
+    }
+#else
+    for (unsigned i = 0; i < mNumUniverses; ++i) {
+        if (sendto(mSocket, packet(i), mPacketBytes, 0, (struct sockaddr*) &mAddrs[i], mAddrLen) < 0) {
+            if (mVerbose) {
+                std::clog << "Error sending to " << getName() << ": " << strerror(errno) << "\n";
+            }
+            return;
+        }
+    }
+#endif
+
+    mFramesSent++;
+}
+
+#endif
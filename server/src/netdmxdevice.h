@@ -0,0 +1,136 @@
+/*
+ * Art-Net and E1.31 (sACN) output devices for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "opc.h"
+#include "pixelmap.h"
+#include <libusb.h> // Also brings in gettimeofday() in a portable way
+
+#ifndef OS_WINDOWS
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+
+/*
+ * DMX universes sent over the network, to Art-Net or E1.31 (sACN) nodes.
+ *
+ * One device is a contiguous range of universes on one destination. Each universe
+ * holds 170 RGB pixels, and the usual Fadecandy-style 'map' places OPC pixels in them.
+ * The mapper writes straight into the outgoing packets, and a whole frame goes out
+ * with one sendmmsg() where we have it.
+ *
+ * Like SPI devices, these come from the configuration file rather than hotplug.
+ */
+
+class NetDMXDevice
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef rapidjson::Document Document;
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+    enum Protocol {
+        ARTNET,
+        E131,
+    };
+
+    static const char *ARTNET_TYPE;
+    static const char *E131_TYPE;
+
+    static const unsigned PIXELS_PER_UNIVERSE = 170;
+    static const unsigned MAX_UNIVERSES = 1024;
+
+    NetDMXDevice(Protocol protocol, unsigned firstUniverse, unsigned numUniverses, bool verbose);
+    ~NetDMXDevice();
+
+    // Which protocol does this device type string name? Returns false if neither.
+    static bool parseType(const char *type, Protocol &protocol);
+
+    // Create the socket and resolve the destination. A NULL host means the protocol's
+    // default: broadcast for Art-Net, or the universe's multicast group for E1.31.
+    int open(const char *host, int port);
+
+    bool matchConfiguration(const Value &config);
+    void loadConfiguration(const Value &config);
+    void writeMessage(const OPC::Message &msg);
+    bool usesOpcChannel(unsigned channel);
+
+    // Color correction isn't applied to DMX output
+    void writeColorCorrection(const Value &color) {}
+
+    // Frame barrier, the same as for other devices
+    void setFrameBarrier(bool enabled);
+    void commitFrame();
+
+    void describe(Value &object, Allocator &alloc);
+    std::string getName();
+
+private:
+    static const unsigned ARTNET_PORT = 6454;
+    static const unsigned E131_PORT = 5568;
+    static const unsigned ARTNET_HEADER_BYTES = 18;
+    static const unsigned E131_HEADER_BYTES = 126;
+    static const unsigned DMX_CHANNELS = 512;
+
+    Protocol mProtocol;
+    unsigned mFirstUniverse;
+    unsigned mNumUniverses;
+    unsigned mPacketBytes;
+    bool mVerbose;
+    std::string mHost;
+    struct timeval mTimestamp;
+
+    int mSocket;
+    PixelLayout mLayout;
+    PixelMap mPixelMap;
+
+    // One complete packet per universe, back to back. This is the framebuffer.
+    std::vector<uint8_t> mPackets;
+    uint8_t mSequence;
+    uint8_t mCID[16];
+
+    bool mFrameBarrier;
+    bool mFrameHeld;
+    uint64_t mFramesSent;
+
+#ifndef OS_WINDOWS
+    // Destination for each universe
+    std::vector<struct sockaddr_storage> mAddrs;
+    socklen_t mAddrLen;
+#endif
+#ifdef OS_LINUX
+    // Prebuilt message list, so a frame is one sendmmsg() call
+    std::vector<struct mmsghdr> mMsgs;
+    std::vector<struct iovec> mIov;
+#endif
+
+    static unsigned headerBytes(Protocol protocol);
+    uint8_t *packet(unsigned index) { return &mPackets[index * mPacketBytes]; }
+    void initPacket(unsigned index);
+    void sendFrame();
+};
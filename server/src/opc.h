@@ -28,13 +28,18 @@ namespace OPC {
 
     enum Command {
         SetPixelColors = 0x00,
+        SetPixelColors16 = 0x02,
         SystemExclusive = 0xFF,
     };
 
     // SysEx system and command IDs
     enum SysEx {
         FCSetGlobalColorCorrection = 0x00010001,
-        FCSetFirmwareConfiguration = 0x00010002
+        FCSetFirmwareConfiguration = 0x00010002,
+        FCCommitFrame = 0x00010003,
+        FCSetDeviceColorCorrection = 0x00010004,
+        FCLatencyProbe = 0x00010005,
+        FCRelayDelta = 0x00010006
     };
 
     struct Message
@@ -53,6 +58,20 @@ namespace OPC {
             lenLow = (uint8_t) l;
             lenHigh = (uint8_t) (l >> 8);
         }
+
+        // Pixel data, in either 8-bit or 16-bit color? These are routed by channel.
+        bool isPixelColors() const {
+            return command == SetPixelColors || command == SetPixelColors16;
+        }
+
+        // System and command ID of a SystemExclusive message, or zero if it's too short
+        unsigned sysExID() const {
+            if (length() < 4) {
+                return 0;
+            }
+            return (unsigned(data[0]) << 24) | (unsigned(data[1]) << 16) |
+                   (unsigned(data[2]) << 8) | unsigned(data[3]);
+        }
     };
 
     static const unsigned HEADER_BYTES = 4;
@@ -0,0 +1,148 @@
+/*
+ * Open Pixel Control reassembly buffers
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "opcbuffer.h"
+#include <algorithm>
+#include <string.h>
+
+tthread::mutex OPCBuffer::sPoolMutex;
+std::vector<OPCBuffer*> OPCBuffer::sPool;
+
+
+OPCBuffer *OPCBuffer::alloc()
+{
+    OPCBuffer *buffer = 0;
+
+    sPoolMutex.lock();
+    if (!sPool.empty()) {
+        buffer = sPool.back();
+        sPool.pop_back();
+    }
+    sPoolMutex.unlock();
+
+    if (!buffer) {
+        buffer = new OPCBuffer;
+    }
+
+    buffer->clear();
+    return buffer;
+}
+
+void OPCBuffer::release(OPCBuffer *buffer)
+{
+    // Keep a few idle buffers around, but don't hold on to memory forever after a burst
+
+    sPoolMutex.lock();
+    if (sPool.size() < MAX_POOLED_BUFFERS) {
+        sPool.push_back(buffer);
+        buffer = 0;
+    }
+    sPoolMutex.unlock();
+
+    delete buffer;
+}
+
+bool OPCBuffer::append(const uint8_t *in, unsigned len)
+{
+    if (len > spaceLength()) {
+        return false;
+    }
+    memcpy(mBuffer + mTail, in, len);
+    mTail += len;
+    return true;
+}
+
+uint8_t *OPCBuffer::space()
+{
+    /*
+     * Anything left over after dispatching is less than one whole message. If there's
+     * no longer room for a whole message after it, move it back to the start.
+     */
+
+    if (spaceLength() < MAX_MESSAGE_BYTES) {
+        unsigned len = length();
+        memmove(mBuffer, mBuffer + mHead, len);
+        mHead = 0;
+        mTail = len;
+    }
+    return mBuffer + mTail;
+}
+
+void OPCBuffer::dispatch(OPC::callback_t callback, void *context)
+{
+    mHead += dispatch(data(), length(), callback, context);
+    if (mHead == mTail) {
+        clear();
+    }
+}
+
+void OPCBuffer::received(unsigned len, OPC::callback_t callback, void *context)
+{
+    mTail += len;
+    dispatch(callback, context);
+}
+
+void OPCBuffer::receive(uint8_t *in, unsigned len, OPC::callback_t callback, void *context)
+{
+    // Finish a message we already have part of, copying only as much as it still needs
+
+    while (len && length()) {
+        unsigned have = length();
+        unsigned want = have < OPC::HEADER_BYTES ? OPC::HEADER_BYTES
+            : OPC::HEADER_BYTES + ((OPC::Message*) data())->length();
+        unsigned n = std::min(want - have, len);
+
+        memcpy(space(), in, n);
+        mTail += n;
+        in += n;
+        len -= n;
+
+        // Complete whenever we have a header, and exactly the length it asks for
+        dispatch(callback, context);
+    }
+
+    // Everything else is dispatched in place. Keep any partial message at the end.
+
+    unsigned used = dispatch(in, len, callback, context);
+    append(in + used, len - used);
+}
+
+unsigned OPCBuffer::dispatch(uint8_t *buffer, unsigned len, OPC::callback_t callback, void *context)
+{
+    unsigned used = 0;
+
+    while (len - used >= OPC::HEADER_BYTES) {
+        OPC::Message *msg = (OPC::Message*) (buffer + used);
+        unsigned msgLength = OPC::HEADER_BYTES + msg->length();
+
+        if (len - used < msgLength) {
+            // Waiting for more data
+            break;
+        }
+
+        callback(*msg, context);
+        used += msgLength;
+    }
+
+    return used;
+}
@@ -0,0 +1,85 @@
+/*
+ * Open Pixel Control reassembly buffers
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "tinythread.h"
+#include "opc.h"
+
+
+/*
+ * Receive buffer for one OPC stream. Big enough for two OPC packets.
+ *
+ * Complete messages are dispatched in place, by pointer. Data is consumed from the
+ * front of the buffer without moving anything; leftover bytes are only moved back to
+ * the start when there's no longer room for a whole message after them. Buffers
+ * come from a shared pool, so short-lived connections don't churn large allocations.
+ */
+
+class OPCBuffer {
+public:
+    // Get an empty buffer from the pool, or return one to it. Safe from any thread.
+    static OPCBuffer *alloc();
+    static void release(OPCBuffer *buffer);
+
+    // Bytes received but not yet dispatched
+    uint8_t *data() { return mBuffer + mHead; }
+    unsigned length() const { return mTail - mHead; }
+
+    // Save bytes without dispatching them. Returns false if they don't fit.
+    bool append(const uint8_t *in, unsigned len);
+
+    // Dispatch any complete messages we have buffered
+    void dispatch(OPC::callback_t callback, void *context);
+
+    /*
+     * For receiving directly into the buffer: space() always has room for at least one
+     * whole message. After writing 'len' bytes there, call received() to dispatch them.
+     */
+    uint8_t *space();
+    unsigned spaceLength() const { return sizeof mBuffer - mTail; }
+    void received(unsigned len, OPC::callback_t callback, void *context);
+
+    /*
+     * Reassemble from someone else's buffer. Complete messages in 'in' are dispatched
+     * where they are. Only the pieces of messages that span calls are copied.
+     */
+    void receive(uint8_t *in, unsigned len, OPC::callback_t callback, void *context);
+
+private:
+    static const unsigned MAX_MESSAGE_BYTES = OPC::HEADER_BYTES + 0xFFFF;
+    static const unsigned MAX_POOLED_BUFFERS = 16;
+
+    unsigned mHead;
+    unsigned mTail;
+    uint8_t mBuffer[2 * sizeof(OPC::Message)];
+
+    static tthread::mutex sPoolMutex;
+    static std::vector<OPCBuffer*> sPool;
+
+    void clear() { mHead = mTail = 0; }
+
+    // Dispatch complete messages from 'buffer', returning the number of bytes used
+    static unsigned dispatch(uint8_t *buffer, unsigned len, OPC::callback_t callback, void *context);
+};
@@ -0,0 +1,348 @@
+/*
+ * Forwarding OPC channels to other Fadecandy servers
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "opcforwarder.h"
+#include "metrics.h"
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef OS_WINDOWS
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+OpcForwarder::OpcForwarder(bool verbose)
+    : mVerbose(verbose)
+{}
+
+void OpcForwarder::parse(const Value &config, std::ostream &error)
+{
+    if (config.IsNull()) {
+        return;
+    }
+    if (!config.IsArray()) {
+        error << "The optional 'forward' configuration key must be a list of nodes.\n";
+        return;
+    }
+
+    for (unsigned i = 0; i < config.Size(); ++i) {
+        const Value &node = config[i];
+        if (!node.IsObject()) {
+            error << "Each node in 'forward' must be an object.\n";
+            continue;
+        }
+
+        const Value &host = node["host"];
+        const Value &port = node["port"];
+        const Value &channels = node["channels"];
+        const Value &offset = node["offset"];
+        const Value &protocol = node["protocol"];
+
+        Node *n = new Node();
+        n->owner = this;
+        n->port = 7890;
+        n->udp = false;
+        n->firstChannel = 1;
+        n->lastChannel = 255;
+        n->offset = 0;
+        n->sequence = 0;
+        n->fd = -1;
+        n->thread = 0;
+
+        bool ok = true;
+
+        if (host.IsString() && host.GetStringLength() > 0) {
+            n->host = host.GetString();
+        } else {
+            error << "Each node in 'forward' needs a 'host' string.\n";
+            ok = false;
+        }
+
+        if (port.IsUint() && port.GetUint() >= 1 && port.GetUint() <= 65535) {
+            n->port = port.GetUint();
+        } else if (!port.IsNull()) {
+            error << "A forwarding node's 'port' must be a port number.\n";
+            ok = false;
+        }
+
+        if (channels.IsArray() && channels.Size() == 2 && channels[0u].IsUint() && channels[1].IsUint() &&
+            channels[0u].GetUint() >= 1 && channels[0u].GetUint() <= channels[1].GetUint() &&
+            channels[1].GetUint() <= 255) {
+            n->firstChannel = channels[0u].GetUint();
+            n->lastChannel = channels[1].GetUint();
+        } else if (!channels.IsNull()) {
+            error << "A forwarding node's 'channels' must be a [first, last] range within 1 to 255.\n";
+            ok = false;
+        }
+
+        if (offset.IsInt()) {
+            n->offset = offset.GetInt();
+            if (int(n->firstChannel) + n->offset < 1 || int(n->lastChannel) + n->offset > 255) {
+                error << "A forwarding node's 'offset' must keep its channels within 1 to 255.\n";
+                ok = false;
+            }
+        } else if (!offset.IsNull()) {
+            error << "A forwarding node's 'offset' must be an integer.\n";
+            ok = false;
+        }
+
+        if (protocol.IsString() && !strcmp(protocol.GetString(), "udp")) {
+            n->udp = true;
+        } else if (!(protocol.IsNull() || (protocol.IsString() && !strcmp(protocol.GetString(), "tcp")))) {
+            error << "A forwarding node's 'protocol' must be \"tcp\" or \"udp\".\n";
+            ok = false;
+        }
+
+        if (ok) {
+            mNodes.push_back(n);
+        } else {
+            delete n;
+        }
+    }
+}
+
+void OpcForwarder::forward(const OPC::Message &msg)
+{
+    bool routed = msg.isPixelColors() && msg.channel != 0;
+
+    for (std::vector<Node*>::iterator i = mNodes.begin(), e = mNodes.end(); i != e; ++i) {
+        Node &node = **i;
+
+        if (!routed) {
+            queueMessage(node, msg, msg.channel);
+        } else if (msg.channel >= node.firstChannel && msg.channel <= node.lastChannel) {
+            queueMessage(node, msg, msg.channel + node.offset);
+        }
+    }
+}
+
+void OpcForwarder::queueMessage(Node &node, const OPC::Message &msg, uint8_t channel)
+{
+    const uint8_t *bytes = (const uint8_t*) &msg;
+    unsigned length = OPC::HEADER_BYTES + msg.length();
+
+    node.mutex.lock();
+
+    bool wake = node.queue.empty();
+    if (node.queue.size() + length > MAX_QUEUE_BYTES) {
+        // Too far behind. Everything waiting is older than this message anyway.
+        Metrics::add(Metrics::FORWARD_BYTES_DROPPED, node.queue.size());
+        node.queue.clear();
+    }
+
+    size_t start = node.queue.size();
+    node.queue.insert(node.queue.end(), bytes, bytes + length);
+    node.queue[start] = channel;
+
+    node.mutex.unlock();
+
+    if (wake) {
+        node.cond.notify_one();
+    }
+}
+
+void OpcForwarder::threadFunc(void *arg)
+{
+    Node *node = static_cast<Node*>(arg);
+    node->owner->senderLoop(*node);
+}
+
+void OpcForwarder::senderLoop(Node &node)
+{
+    for (;;) {
+        node.mutex.lock();
+        while (node.queue.empty()) {
+            node.cond.wait(node.mutex);
+        }
+        node.sending.swap(node.queue);
+        node.mutex.unlock();
+
+        if ((node.fd >= 0 || connectNode(node)) && sendQueue(node)) {
+            Metrics::add(Metrics::FORWARD_BYTES, node.sending.size());
+        } else {
+            // Nobody to send to. Drop what we had, and give the node a moment.
+            Metrics::add(Metrics::FORWARD_BYTES_DROPPED, node.sending.size());
+            closeNode(node);
+            tthread::this_thread::sleep_for(tthread::chrono::milliseconds(int(RECONNECT_MILLIS)));
+        }
+        node.sending.clear();
+    }
+}
+
+#ifdef OS_WINDOWS
+
+bool OpcForwarder::start()
+{
+    std::clog << "Forwarding to other servers isn't supported on this platform.\n";
+    return false;
+}
+
+bool OpcForwarder::connectNode(Node &node) { return false; }
+bool OpcForwarder::sendQueue(Node &node) { return false; }
+void OpcForwarder::closeNode(Node &node) {}
+
+#else
+
+bool OpcForwarder::start()
+{
+    for (std::vector<Node*>::iterator i = mNodes.begin(), e = mNodes.end(); i != e; ++i) {
+        Node &node = **i;
+        node.thread = new tthread::thread(threadFunc, &node);
+
+        if (mVerbose) {
+            std::clog << "Forwarding OPC channels " << node.firstChannel << " to " << node.lastChannel
+                << " to " << node.host << ":" << node.port << (node.udp ? " over UDP" : "") << "\n";
+        }
+    }
+    return true;
+}
+
+bool OpcForwarder::connectNode(Node &node)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = node.udp ? SOCK_DGRAM : SOCK_STREAM;
+
+    char portStr[16];
+    snprintf(portStr, sizeof portStr, "%u", node.port);
+
+    struct addrinfo *addrs;
+    int r = getaddrinfo(node.host.c_str(), portStr, &hints, &addrs);
+    if (r) {
+        if (mVerbose) {
+            std::clog << "Can't resolve forwarding node " << node.host << ": " << gai_strerror(r) << "\n";
+        }
+        return false;
+    }
+
+    for (struct addrinfo *a = addrs; a; a = a->ai_next) {
+        int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            node.fd = fd;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(addrs);
+
+    if (node.fd < 0) {
+        if (mVerbose) {
+            std::clog << "Can't connect to forwarding node " << node.host << ":" << node.port << "\n";
+        }
+        return false;
+    }
+
+    if (!node.udp) {
+        // Each send is already a whole batch, so don't wait to fill segments
+        int one = 1;
+        setsockopt(node.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    }
+
+    if (mVerbose) {
+        std::clog << "Connected to forwarding node " << node.host << ":" << node.port << "\n";
+    }
+    return true;
+}
+
+bool OpcForwarder::sendQueue(Node &node)
+{
+    const uint8_t *data = node.sending.empty() ? 0 : &node.sending[0];
+    size_t size = node.sending.size();
+
+    if (!node.udp) {
+        // The whole batch, in as few writes as the socket allows
+        while (size) {
+            ssize_t r = send(node.fd, data, size, MSG_NOSIGNAL);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                if (mVerbose) {
+                    std::clog << "Lost connection to forwarding node " << node.host << ":" << node.port << "\n";
+                }
+                return false;
+            }
+            data += r;
+            size -= r;
+        }
+        return true;
+    }
+
+    // One datagram per message, each with a big-endian sequence number after it
+    while (size >= OPC::HEADER_BYTES) {
+        const OPC::Message *msg = (const OPC::Message*) data;
+        unsigned length = OPC::HEADER_BYTES + msg->length();
+
+        if (length + 4 <= MAX_DATAGRAM_BYTES) {
+            uint32_t sequence = ++node.sequence;
+            uint8_t trailer[4] = { uint8_t(sequence >> 24), uint8_t(sequence >> 16),
+                                   uint8_t(sequence >> 8), uint8_t(sequence) };
+
+            struct iovec iov[2];
+            iov[0].iov_base = (void*) data;
+            iov[0].iov_len = length;
+            iov[1].iov_base = trailer;
+            iov[1].iov_len = sizeof trailer;
+
+            struct msghdr hdr;
+            memset(&hdr, 0, sizeof hdr);
+            hdr.msg_iov = iov;
+            hdr.msg_iovlen = 2;
+
+            // Datagrams are best effort. A node that isn't listening just misses them.
+            sendmsg(node.fd, &hdr, MSG_NOSIGNAL);
+        } else {
+            Metrics::add(Metrics::FORWARD_BYTES_DROPPED, length);
+        }
+
+        data += length;
+        size -= length;
+    }
+    return true;
+}
+
+void OpcForwarder::closeNode(Node &node)
+{
+    if (node.fd >= 0) {
+        close(node.fd);
+        node.fd = -1;
+    }
+}
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Forwarding OPC channels to other Fadecandy servers
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include "opc.h"
+
+
+/*
+ * Sends ranges of OPC channels on to downstream fcserver nodes, so one "head" server
+ * can take a whole show from a renderer and spread it over several computers, each
+ * with its own boards. Each entry in the "forward" configuration list is one node:
+ *
+ *   { "host": "10.0.0.2", "port": 7890, "channels": [1, 8], "offset": 0, "protocol": "tcp" }
+ *
+ * Set Pixel Colors messages for channels in the range go to that node, with "offset"
+ * added to their channel. Channel 0 and other commands go to every node unchanged,
+ * so frame commits and broadcasts reach all of them.
+ *
+ * Each node has a persistent connection and a sender thread. Messages queue up while
+ * it's busy, and each wakeup sends the whole queue at once: one write over TCP, or a
+ * datagram per message over UDP with the sequence numbers udpListen uses to drop late
+ * frames. If a node falls too far behind or its connection drops, the queue starts
+ * over from the newest message rather than delaying everything after it.
+ */
+
+class OpcForwarder
+{
+public:
+    typedef rapidjson::Value Value;
+
+    OpcForwarder(bool verbose = false);
+
+    // Load the "forward" list, describing problems on 'error'
+    void parse(const Value &config, std::ostream &error);
+
+    bool isEnabled() const { return !mNodes.empty(); }
+
+    // Start a sender thread for each node. Connections are made from those threads.
+    bool start();
+
+    // Queue a message for every node that wants it. Safe from any thread.
+    void forward(const OPC::Message &msg);
+
+private:
+    // Most a node can have waiting before we start its queue over
+    static const unsigned MAX_QUEUE_BYTES = 1 << 20;
+
+    // Wait between connection attempts
+    static const unsigned RECONNECT_MILLIS = 1000;
+
+    // Largest payload one UDP datagram can carry
+    static const unsigned MAX_DATAGRAM_BYTES = 65507;
+
+    struct Node {
+        OpcForwarder *owner;
+        std::string host;
+        unsigned port;
+        bool udp;
+        unsigned firstChannel;
+        unsigned lastChannel;
+        int offset;
+
+        // Messages waiting to be sent, back to back. Protected by 'mutex'.
+        std::vector<uint8_t> queue;
+        tthread::mutex mutex;
+        tthread::condition_variable cond;
+
+        // Owned by the sender thread
+        std::vector<uint8_t> sending;
+        uint32_t sequence;
+        int fd;
+        tthread::thread *thread;
+    };
+
+    bool mVerbose;
+    std::vector<Node*> mNodes;
+
+    static void threadFunc(void *arg);
+    void senderLoop(Node &node);
+    bool connectNode(Node &node);
+    bool sendQueue(Node &node);
+    void closeNode(Node &node);
+    static void queueMessage(Node &node, const OPC::Message &msg, uint8_t channel);
+};
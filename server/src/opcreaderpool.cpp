@@ -0,0 +1,274 @@
+/*
+ * Multi-threaded Open Pixel Control listener for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "opcreaderpool.h"
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef OS_WINDOWS
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+
+OpcReaderPool::OpcReaderPool(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose), mListenFd(-1)
+{}
+
+#ifdef OS_WINDOWS
+
+bool OpcReaderPool::start(const char *host, int port, unsigned numThreads)
+{
+    std::clog << "The multi-threaded OPC listener isn't supported on this platform.\n";
+    return false;
+}
+
+bool OpcReaderPool::startUnix(const char *path, unsigned numThreads)
+{
+    std::clog << "The multi-threaded OPC listener isn't supported on this platform.\n";
+    return false;
+}
+
+void OpcReaderPool::startWorkers(unsigned numThreads) {}
+void OpcReaderPool::threadFunc(void *arg) {}
+void OpcReaderPool::workerLoop(Worker &worker) {}
+void OpcReaderPool::acceptConnection(Worker &worker) {}
+bool OpcReaderPool::readConnection(Connection &conn) { return false; }
+
+#else
+
+bool OpcReaderPool::start(const char *host, int port, unsigned numThreads)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    char portStr[16];
+    snprintf(portStr, sizeof portStr, "%d", port);
+
+    struct addrinfo *addrs;
+    int r = getaddrinfo(host, portStr, &hints, &addrs);
+    if (r) {
+        std::clog << "Can't resolve OPC listen address: " << gai_strerror(r) << "\n";
+        return false;
+    }
+
+    for (struct addrinfo *a = addrs; a; a = a->ai_next) {
+        int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+        if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 16) == 0) {
+            mListenFd = fd;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(addrs);
+
+    if (mListenFd < 0) {
+        std::clog << "Can't listen for OPC on " << (host ? host : "*") << ":" << port
+            << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    startWorkers(numThreads);
+
+    if (mVerbose) {
+        std::clog << "OPC listening on " << (host ? host : "*") << ":" << port
+            << " with " << mWorkers.size() << " reader threads\n";
+    }
+
+    return true;
+}
+
+bool OpcReaderPool::startUnix(const char *path, unsigned numThreads)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof addr.sun_path) {
+        std::clog << "OPC socket path is too long: " << path << "\n";
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left behind by an earlier server would stop us binding. Anything else stays.
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && bind(fd, (struct sockaddr*) &addr, sizeof addr) == 0 && listen(fd, 16) == 0) {
+        mListenFd = fd;
+    } else {
+        std::clog << "Can't listen for OPC on " << path << ": " << strerror(errno) << "\n";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    startWorkers(numThreads);
+
+    if (mVerbose) {
+        std::clog << "OPC listening on " << path << " with " << mWorkers.size() << " reader threads\n";
+    }
+
+    return true;
+}
+
+void OpcReaderPool::startWorkers(unsigned numThreads)
+{
+    // Every reader thread waits on the listening socket, and whoever wakes first accepts
+    fcntl(mListenFd, F_SETFL, fcntl(mListenFd, F_GETFL) | O_NONBLOCK);
+
+    if (numThreads < 1) {
+        numThreads = 1;
+    } else if (numThreads > MAX_THREADS) {
+        numThreads = MAX_THREADS;
+    }
+
+    for (unsigned i = 0; i < numThreads; ++i) {
+        Worker *worker = new Worker;
+        worker->pool = this;
+        worker->thread = new tthread::thread(threadFunc, worker);
+        mWorkers.push_back(worker);
+    }
+}
+
+void OpcReaderPool::threadFunc(void *arg)
+{
+    Worker *worker = (Worker*) arg;
+    worker->pool->workerLoop(*worker);
+}
+
+void OpcReaderPool::workerLoop(Worker &worker)
+{
+    std::vector<struct pollfd> fds;
+
+    for (;;) {
+        // Listening socket first, then each of our connections in order
+        fds.resize(1 + worker.connections.size());
+
+        fds[0].fd = mListenFd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+
+        for (unsigned i = 0; i < worker.connections.size(); ++i) {
+            fds[i + 1].fd = worker.connections[i]->fd;
+            fds[i + 1].events = POLLIN;
+            fds[i + 1].revents = 0;
+        }
+
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::clog << "Error waiting for OPC connections: " << strerror(errno) << "\n";
+            return;
+        }
+
+        // Service existing connections before accepting, so the indices above stay valid
+        for (unsigned i = worker.connections.size(); i > 0; --i) {
+            if (!fds[i].revents) {
+                continue;
+            }
+
+            Connection *conn = worker.connections[i - 1];
+            if (!readConnection(*conn)) {
+                close(conn->fd);
+                OPCBuffer::release(conn->buffer);
+                delete conn;
+                worker.connections.erase(worker.connections.begin() + (i - 1));
+
+                if (mVerbose) {
+                    std::clog << "Open Pixel Control connection closed\n";
+                }
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            acceptConnection(worker);
+        }
+    }
+}
+
+void OpcReaderPool::acceptConnection(Worker &worker)
+{
+    int fd = accept(mListenFd, NULL, NULL);
+    if (fd < 0) {
+        // Another reader thread probably got there first
+        return;
+    }
+
+    Connection *conn = new Connection;
+    conn->fd = fd;
+    conn->buffer = OPCBuffer::alloc();
+    worker.connections.push_back(conn);
+
+    if (mVerbose) {
+        std::clog << "New Open Pixel Control connection\n";
+    }
+}
+
+bool OpcReaderPool::readConnection(Connection &conn)
+{
+    /*
+     * Read whatever is available, and dispatch any complete OPC packets.
+     * Returns false if the connection should be closed.
+     */
+
+    OPCBuffer *opcb = conn.buffer;
+    uint8_t *space = opcb->space();
+
+    ssize_t r = recv(conn.fd, space, opcb->spaceLength(), 0);
+    if (r < 0) {
+        return errno == EINTR || errno == EAGAIN;
+    }
+    if (r == 0) {
+        return false;
+    }
+
+    // Packets are dispatched in place
+    opcb->received(r, mOpcCallback, mUserContext);
+    return true;
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Multi-threaded Open Pixel Control listener for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "tinythread.h"
+#include "opc.h"
+#include "opcbuffer.h"
+
+
+/*
+ * A separate listening socket for native OPC clients only, with no HTTP or WebSockets.
+ *
+ * The main TcpNetServer handles every client on a single libwebsockets thread. Here,
+ * connections are spread over a pool of reader threads, each with its own poll() loop.
+ * Reading, reassembly and the OPC callback all run on the reader threads, so one
+ * slow or busy client only holds up the others on its own thread.
+ *
+ * The OPC callback may be called from any reader thread, concurrently.
+ */
+
+class OpcReaderPool {
+public:
+    OpcReaderPool(OPC::callback_t opcCallback, void *context, bool verbose = false);
+
+    // Start listening, and start 'numThreads' reader threads
+    bool start(const char *host, int port, unsigned numThreads);
+
+    // The same, but listening on a Unix domain socket at 'path' instead of TCP
+    bool startUnix(const char *path, unsigned numThreads);
+
+    // Reader threads, once started
+    unsigned getNumThreads() const { return mWorkers.size(); }
+    tthread::thread *getThread(unsigned index) { return mWorkers[index]->thread; }
+
+    static const unsigned DEFAULT_THREADS = 4;
+    static const unsigned MAX_THREADS = 64;
+
+private:
+    struct Connection {
+        int fd;
+        OPCBuffer *buffer;
+    };
+
+    struct Worker {
+        OpcReaderPool *pool;
+        tthread::thread *thread;
+        std::vector<Connection*> connections;
+    };
+
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+    int mListenFd;
+    std::vector<Worker*> mWorkers;
+
+    void startWorkers(unsigned numThreads);
+    static void threadFunc(void *arg);
+    void workerLoop(Worker &worker);
+    void acceptConnection(Worker &worker);
+    bool readConnection(Connection &conn);
+};
@@ -0,0 +1,263 @@
+/*
+ * Recording and replaying Open Pixel Control traffic
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "opcrecorder.h"
+#include "metrics.h"
+#include <libusb.h> // Also brings in gettimeofday() in a portable way
+#include <iostream>
+#include <string.h>
+
+const char OpcRecorder::MAGIC[8] = { 'F', 'C', 'O', 'P', 'C', 'L', 'O', 'G' };
+
+
+OpcRecorder::OpcRecorder(bool verbose)
+    : mVerbose(verbose),
+      mFile(0),
+      mThread(0),
+      mRunning(false),
+      mStopping(false),
+      mRing(0),
+      mHead(0),
+      mTail(0)
+{}
+
+void OpcRecorder::parse(const Value &config, std::ostream &error)
+{
+    if (config.IsString() && config.GetStringLength()) {
+        mPath = config.GetString();
+    } else if (!config.IsNull()) {
+        error << "The optional 'record' configuration key must be a file name.\n";
+    }
+}
+
+uint64_t OpcRecorder::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void OpcRecorder::putTime(uint8_t *out, uint64_t time)
+{
+    for (unsigned i = 0; i < TIME_BYTES; ++i) {
+        out[i] = uint8_t(time >> (i * 8));
+    }
+}
+
+uint64_t OpcRecorder::getTime(const uint8_t *in)
+{
+    uint64_t time = 0;
+    for (unsigned i = 0; i < TIME_BYTES; ++i) {
+        time |= uint64_t(in[i]) << (i * 8);
+    }
+    return time;
+}
+
+bool OpcRecorder::start()
+{
+    mFile = fopen(mPath.c_str(), "ab");
+    if (!mFile) {
+        perror("Error opening OPC record file");
+        return false;
+    }
+    if (fwrite(MAGIC, sizeof MAGIC, 1, mFile) != 1) {
+        perror("Error writing OPC record file");
+        fclose(mFile);
+        mFile = 0;
+        return false;
+    }
+
+    // 64-bit words keep every entry's size and time aligned
+    mRing = (uint8_t*) new uint64_t[RING_BYTES / 8];
+    memset(mRing, 0, RING_BYTES);
+
+    mRunning.store(true);
+    mThread = new tthread::thread(threadFunc, this);
+
+    if (mVerbose) {
+        std::clog << "Recording OPC messages to " << mPath << "\n";
+    }
+    return true;
+}
+
+void OpcRecorder::stop()
+{
+    if (!mThread) {
+        return;
+    }
+
+    // Messages still arriving are dropped from here on
+    mRunning.store(false);
+    mStopping.store(true);
+    mThread->join();
+    delete mThread;
+    mThread = 0;
+
+    fclose(mFile);
+    mFile = 0;
+}
+
+void OpcRecorder::append(const OPC::Message &msg)
+{
+    uint64_t time = now();
+    unsigned length = OPC::HEADER_BYTES + msg.length();
+    unsigned size = (ENTRY_HEADER_BYTES + length + 7) & ~7u;
+    uint64_t head = mHead.load(std::memory_order_relaxed);
+    unsigned padding;
+
+    // Claim space for the entry, plus padding if it would run off the end of the ring
+    do {
+        unsigned offset = head & (RING_BYTES - 1);
+        padding = offset + size > RING_BYTES ? RING_BYTES - offset : 0;
+
+        if (head + padding + size - mTail.load(std::memory_order_acquire) > RING_BYTES) {
+            Metrics::add(Metrics::RECORD_BYTES_DROPPED, length);
+            return;
+        }
+    } while (!mHead.compare_exchange_weak(head, head + padding + size, std::memory_order_relaxed));
+
+    if (padding) {
+        entrySize(head).store(padding | PADDING, std::memory_order_release);
+        head += padding;
+    }
+
+    uint8_t *entry = mRing + (head & (RING_BYTES - 1));
+    putTime(entry + 8, time);
+    memcpy(entry + ENTRY_HEADER_BYTES, &msg, length);
+
+    entrySize(head).store(size, std::memory_order_release);
+}
+
+void OpcRecorder::threadFunc(void *arg)
+{
+    static_cast<OpcRecorder*>(arg)->writerLoop();
+}
+
+void OpcRecorder::writerLoop()
+{
+    for (;;) {
+        // Once stopping, producers are done after one more pass
+        bool stopping = mStopping.load();
+
+        if (drain()) {
+            continue;
+        }
+        if (stopping) {
+            break;
+        }
+        tthread::this_thread::sleep_for(tthread::chrono::milliseconds(int(WRITER_MILLIS)));
+    }
+}
+
+bool OpcRecorder::drain()
+{
+    /*
+     * Copy out every complete entry at the tail, in order. An entry that's claimed but
+     * not finished yet holds back everything after it until the next pass. Freed space
+     * is zeroed, so any size word a later entry lands on reads as incomplete.
+     */
+
+    uint64_t tail = mTail.load(std::memory_order_relaxed);
+
+    for (;;) {
+        uint32_t size = entrySize(tail).load(std::memory_order_acquire);
+        if (!size) {
+            break;
+        }
+
+        uint8_t *entry = mRing + (tail & (RING_BYTES - 1));
+        if (!(size & PADDING)) {
+            const OPC::Message *msg = (const OPC::Message*) (entry + ENTRY_HEADER_BYTES);
+            size_t start = mPending.size();
+            mPending.resize(start + TIME_BYTES + OPC::HEADER_BYTES + msg->length());
+            memcpy(&mPending[start], entry + 8, mPending.size() - start);
+        }
+
+        size &= ~PADDING;
+        memset(entry, 0, size);
+        tail += size;
+        mTail.store(tail, std::memory_order_release);
+    }
+
+    if (mPending.empty()) {
+        return false;
+    }
+
+    if (fwrite(&mPending[0], mPending.size(), 1, mFile) == 1 && fflush(mFile) == 0) {
+        Metrics::add(Metrics::RECORD_BYTES, mPending.size());
+    } else {
+        Metrics::add(Metrics::RECORD_BYTES_DROPPED, mPending.size());
+    }
+    mPending.clear();
+    return true;
+}
+
+bool OpcRecorder::Reader::open(const char *path, std::ostream &error)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        error << "Can't open OPC record file " << path << "\n";
+        return false;
+    }
+
+    uint8_t buffer[64 * 1024];
+    size_t count;
+    mData.clear();
+    while ((count = fread(buffer, 1, sizeof buffer, f)) > 0) {
+        mData.insert(mData.end(), buffer, buffer + count);
+    }
+    fclose(f);
+
+    if (mData.size() < sizeof MAGIC || memcmp(&mData[0], MAGIC, sizeof MAGIC)) {
+        error << path << " is not an OPC record file\n";
+        return false;
+    }
+
+    mOffset = 0;
+    return true;
+}
+
+bool OpcRecorder::Reader::next(uint64_t &time, OPC::Message *&msg, bool &newSession)
+{
+    newSession = false;
+
+    while (mOffset + sizeof MAGIC <= mData.size() && !memcmp(&mData[mOffset], MAGIC, sizeof MAGIC)) {
+        newSession = true;
+        mOffset += sizeof MAGIC;
+    }
+
+    // A record cut short, say by a crash while writing, ends the log
+    if (mOffset + TIME_BYTES + OPC::HEADER_BYTES > mData.size()) {
+        return false;
+    }
+    OPC::Message *m = (OPC::Message*) &mData[mOffset + TIME_BYTES];
+    size_t size = TIME_BYTES + OPC::HEADER_BYTES + m->length();
+    if (mOffset + size > mData.size()) {
+        return false;
+    }
+
+    time = getTime(&mData[mOffset]);
+    msg = m;
+    mOffset += size;
+    return true;
+}
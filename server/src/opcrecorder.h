@@ -0,0 +1,139 @@
+/*
+ * Recording and replaying Open Pixel Control traffic
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include "opc.h"
+
+
+/*
+ * Records every OPC message fcserver handles, with its arrival time, so a problem seen
+ * in the field can be replayed later against the same devices. "record" names the log:
+ *
+ *   "record": "/var/log/fcserver/show.opclog"
+ *
+ * Recording must cost next to nothing on the hot path, where messages arrive on several
+ * listener threads at once. Each message is copied into a ring buffer after claiming
+ * its space with one compare-and-swap, then published by writing its size last, much
+ * like the trace buffer. A writer thread wakes every few milliseconds to drain the ring
+ * and append it to the file. If the disk can't keep up, whole messages are dropped
+ * rather than blocking anyone.
+ *
+ * The log is an 8-byte MAGIC, followed by one record per message: the arrival time in
+ * microseconds as a 64-bit little-endian integer, then the OPC message exactly as sent,
+ * header and all. Each server start appends MAGIC again before its own records, so a log
+ * can hold several sessions and replay doesn't wait out the gaps between them.
+ */
+
+class OpcRecorder
+{
+public:
+    typedef rapidjson::Value Value;
+
+    static const char MAGIC[8];
+    static const unsigned TIME_BYTES = 8;
+
+    OpcRecorder(bool verbose = false);
+
+    // Load the "record" path, describing problems on 'error'
+    void parse(const Value &config, std::ostream &error);
+
+    bool isEnabled() const { return !mPath.empty(); }
+
+    // Open the log for appending, and start the writer thread
+    bool start();
+
+    // Write out everything recorded so far, then close the log
+    void stop();
+
+    // Copy a message into the ring, if it's running. Safe from any thread.
+    void record(const OPC::Message &msg)
+    {
+        if (mRunning.load(std::memory_order_relaxed)) {
+            append(msg);
+        }
+    }
+
+    static uint64_t now();
+
+    /*
+     * Reads a whole log into memory, for replay. Records come back in order, along
+     * with whether each one starts a new session.
+     */
+    class Reader {
+    public:
+        bool open(const char *path, std::ostream &error);
+        bool next(uint64_t &time, OPC::Message *&msg, bool &newSession);
+
+    private:
+        std::vector<uint8_t> mData;
+        size_t mOffset;
+    };
+
+private:
+    // Ring size, a power of two comfortably larger than one maximum-length message
+    static const unsigned RING_BYTES = 1 << 22;
+
+    // How often the writer thread looks for new records
+    static const unsigned WRITER_MILLIS = 10;
+
+    /*
+     * Ring entries are 8-byte aligned: a size word, which is zero until the entry is
+     * complete, then the arrival time and the message. PADDING marks the unused space
+     * at the end of the ring when a message wrapped around to its start.
+     */
+    static const unsigned ENTRY_HEADER_BYTES = 16;
+    static const uint32_t PADDING = 0x80000000;
+
+    bool mVerbose;
+    std::string mPath;
+    FILE *mFile;
+    tthread::thread *mThread;
+    std::atomic<bool> mRunning;
+    std::atomic<bool> mStopping;
+
+    uint8_t *mRing;
+    std::atomic<uint64_t> mHead;    // Claimed by producers
+    std::atomic<uint64_t> mTail;    // Freed by the writer thread
+
+    // Owned by the writer thread
+    std::vector<uint8_t> mPending;
+
+    std::atomic<uint32_t> &entrySize(uint64_t position) {
+        return *reinterpret_cast<std::atomic<uint32_t>*>(mRing + (position & (RING_BYTES - 1)));
+    }
+
+    void append(const OPC::Message &msg);
+    static void threadFunc(void *arg);
+    void writerLoop();
+    bool drain();
+    static void putTime(uint8_t *out, uint64_t time);
+    static uint64_t getTime(const uint8_t *in);
+};
@@ -0,0 +1,354 @@
+/*
+ * Compiled pixel mapping, shared by all output devices.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "pixelmap.h"
+#include "metrics.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include <iostream>
+#include <string.h>
+
+
+PixelLayout::PixelLayout(unsigned numPixels, unsigned firstOffset, unsigned pixelStride,
+    unsigned pixelsPerBlock, unsigned blockStride, bool bgr)
+    : mOffsets(numPixels),
+      mForwardRun(numPixels),
+      mReverseRun(numPixels),
+      mPixelStride(pixelStride),
+      mBGR(bgr)
+{
+    mShape.numPixels = numPixels;
+    mShape.firstOffset = firstOffset;
+    mShape.pixelStride = pixelStride;
+    mShape.pixelsPerBlock = pixelsPerBlock;
+    mShape.blockStride = blockStride;
+    mShape.bgr = bgr;
+
+    for (unsigned i = 0; i < numPixels; i++) {
+        unsigned block = i / pixelsPerBlock;
+        unsigned index = i % pixelsPerBlock;
+
+        mOffsets[i] = firstOffset + block * blockStride + index * pixelStride;
+        mForwardRun[i] = std::min(pixelsPerBlock - index, numPixels - i);
+        mReverseRun[i] = index + 1;
+    }
+}
+
+template <unsigned A, unsigned B, unsigned C>
+void PixelMap::copyKernel(uint8_t *out, const uint8_t *in, unsigned count, int outStride)
+{
+    /*
+     * One instance of this loop exists for every possible color channel string,
+     * so all of the channel selection happens at compile time.
+     */
+
+    const bool needLuminosity = A == LUMINOSITY || B == LUMINOSITY || C == LUMINOSITY;
+
+    while (count--) {
+        uint8_t l = needLuminosity ? (unsigned(in[0]) + unsigned(in[1]) + unsigned(in[2])) / 3 : 0;
+        out[0] = A == LUMINOSITY ? l : in[A];
+        out[1] = B == LUMINOSITY ? l : in[B];
+        out[2] = C == LUMINOSITY ? l : in[C];
+        out += outStride;
+        in += 3;
+    }
+}
+
+// Kernel table, indexed by (colors[0] << 4) | (colors[1] << 2) | colors[2]
+#define KERNEL(a, b, c)     &PixelMap::copyKernel<a, b, c>
+#define KERNELS_4(a, b)     KERNEL(a, b, 0), KERNEL(a, b, 1), KERNEL(a, b, 2), KERNEL(a, b, 3)
+#define KERNELS_16(a)       KERNELS_4(a, 0), KERNELS_4(a, 1), KERNELS_4(a, 2), KERNELS_4(a, 3)
+
+const PixelMap::Kernel PixelMap::kKernels[64] = {
+    KERNELS_16(0), KERNELS_16(1), KERNELS_16(2), KERNELS_16(3)
+};
+
+#undef KERNEL
+#undef KERNELS_4
+#undef KERNELS_16
+
+PixelMap::PlanTable PixelMap::sPlans;
+tthread::mutex PixelMap::sPlanMutex;
+const std::vector<PixelMap::Span> PixelMap::sNoSpans;
+
+PixelMap::PixelMap()
+    : mPlan(0), mLayout(0)
+{}
+
+PixelMap::~PixelMap()
+{
+    releasePlan(mPlan);
+}
+
+void PixelMap::compile(const Value *map, const PixelLayout &layout, bool verbose)
+{
+    Plan *old = mPlan;
+    mPlan = 0;
+    mLayout = &layout;
+
+    if (!map) {
+        // No mapping defined. This device is inactive.
+        releasePlan(old);
+        return;
+    }
+
+    // Look for a plan compiled from the same JSON, for a layout of the same shape
+    rapidjson::GenericStringBuffer<rapidjson::UTF8<> > key;
+    rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > keyWriter(key);
+    map->Accept(keyWriter);
+    std::string json(key.GetString(), key.Size());
+
+    sPlanMutex.lock();
+
+    std::pair<PlanTable::iterator, PlanTable::iterator> range = sPlans.equal_range(json);
+    for (PlanTable::iterator i = range.first; i != range.second; ++i) {
+        if (i->second->shape == layout.shape()) {
+            mPlan = i->second;
+            mPlan->refs++;
+            break;
+        }
+    }
+
+    if (!mPlan) {
+        mPlan = new Plan();
+        mPlan->shape = layout.shape();
+        mPlan->refs = 1;
+
+        for (unsigned i = 0, e = map->Size(); i != e; i++) {
+            const Value &inst = (*map)[i];
+
+            if (!compileInstruction(mPlan->spans, inst, layout) && verbose) {
+                rapidjson::GenericStringBuffer<rapidjson::UTF8<> > buffer;
+                rapidjson::Writer<rapidjson::GenericStringBuffer<rapidjson::UTF8<> > > writer(buffer);
+                inst.Accept(writer);
+                std::clog << "Unsupported JSON mapping instruction: " << buffer.GetString() << "\n";
+            }
+        }
+        mPlan->entry = sPlans.insert(std::make_pair(json, mPlan));
+    }
+
+    sPlanMutex.unlock();
+
+    // Only after taking the new reference, so an unchanged map keeps its plan
+    releasePlan(old);
+}
+
+void PixelMap::releasePlan(Plan *plan)
+{
+    if (!plan) {
+        return;
+    }
+
+    tthread::lock_guard<tthread::mutex> lock(sPlanMutex);
+    if (--plan->refs == 0) {
+        sPlans.erase(plan->entry);
+        delete plan;
+    }
+}
+
+bool PixelMap::usesChannel(unsigned channel) const
+{
+    for (iterator i = begin(), e = end(); i != e; ++i) {
+        if (i->channel == channel) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PixelMap::parseColor(uint8_t &color, char selector)
+{
+    switch (selector) {
+        case 'r': case 'R': color = RED; return true;
+        case 'g': case 'G': color = GREEN; return true;
+        case 'b': case 'B': color = BLUE; return true;
+        case 'l': case 'L': color = LUMINOSITY; return true;
+        default: return false;
+    }
+}
+
+bool PixelMap::compileInstruction(std::vector<Span> &spans, const Value &inst, const PixelLayout &layout)
+{
+    /*
+     * Compile one JSON mapping instruction. Returns false if it isn't one we recognize:
+     *
+     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count ]
+     *   [ OPC Channel, First OPC Pixel, First output pixel, Pixel count, Color channels ]
+     */
+
+    if (!inst.IsArray() || (inst.Size() != 4 && inst.Size() != 5)) {
+        return false;
+    }
+
+    const Value &vChannel = inst[0u];
+    const Value &vFirstOPC = inst[1];
+    const Value &vFirstOut = inst[2];
+    const Value &vCount = inst[3];
+
+    if (!(vChannel.IsUint() && vFirstOPC.IsUint() && vFirstOut.IsUint() && vCount.IsInt())) {
+        return false;
+    }
+
+    unsigned numOutputs = layout.numPixels();
+
+    Span span;
+    span.colors[0] = RED;
+    span.colors[1] = GREEN;
+    span.colors[2] = BLUE;
+
+    if (inst.Size() == 5) {
+        // Color channel swizzling
+        const Value &vColorChannels = inst[4];
+        if (!vColorChannels.IsString() || vColorChannels.GetStringLength() != 3) {
+            return false;
+        }
+
+        const char *colorChannels = vColorChannels.GetString();
+        for (unsigned c = 0; c < 3; c++) {
+            if (!parseColor(span.colors[c], colorChannels[c])) {
+                return false;
+            }
+        }
+    }
+
+    // Pick a kernel that writes the output bytes in the layout's color order
+    if (layout.isBGR()) {
+        span.kernel = kKernels[(span.colors[2] << 4) | (span.colors[1] << 2) | span.colors[0]];
+    } else {
+        span.kernel = kKernels[(span.colors[0] << 4) | (span.colors[1] << 2) | span.colors[2]];
+    }
+    span.byteCopy = !layout.isBGR() && layout.pixelStride() == 3 &&
+        span.colors[0] == RED && span.colors[1] == GREEN && span.colors[2] == BLUE;
+
+    if (vChannel.GetUint() > 0xFF) {
+        // Recognized, but it can never match an OPC message
+        return true;
+    }
+
+    span.channel = vChannel.GetUint();
+    span.firstOPC = vFirstOPC.GetUint();
+    span.firstOut = vFirstOut.GetUint();
+
+    if (vCount.GetInt() >= 0) {
+        span.count = vCount.GetInt();
+        span.direction = 1;
+    } else {
+        span.count = -int64_t(vCount.GetInt());
+        span.direction = -1;
+    }
+
+    // Clamp to the output device, overflow-safe. Output pixels past the end are skipped.
+    if (span.direction > 0) {
+        if (span.firstOut >= numOutputs) {
+            return true;
+        }
+        span.count = std::min<unsigned>(span.count, numOutputs - span.firstOut);
+
+    } else {
+        if (numOutputs == 0) {
+            return true;
+        }
+        if (span.firstOut >= numOutputs) {
+            unsigned skip = span.firstOut - (numOutputs - 1);
+            if (skip >= span.count) {
+                return true;
+            }
+            span.firstOPC = std::min<uint64_t>(uint64_t(span.firstOPC) + skip, 0xFFFFFFFF);
+            span.count -= skip;
+            span.firstOut = numOutputs - 1;
+        }
+        span.count = std::min<unsigned>(span.count, span.firstOut + 1);
+    }
+
+    if (span.count) {
+        spans.push_back(span);
+    }
+    return true;
+}
+
+bool PixelMap::apply(const OPC::Message &msg, uint8_t *framebuffer) const
+{
+    bool written = false;
+
+    for (iterator i = begin(), e = end(); i != e; ++i) {
+        if (i->channel == msg.channel) {
+            written |= applySpan(msg, *i, framebuffer);
+        }
+    }
+
+    return written;
+}
+
+bool PixelMap::applySpan(const OPC::Message &msg, const Span &span, uint8_t *framebuffer) const
+{
+    /*
+     * Copy one span of 'msg' into the framebuffer. The span has already been
+     * validated and clamped to the layout, we only need to clamp it to the size
+     * of this particular message.
+     *
+     * The span is split into runs of evenly spaced output pixels, one per layout
+     * block. Each run is located with a table lookup. Forward runs of packed RGB
+     * are a plain memcpy(), and everything else uses the span's kernel.
+     */
+
+    const PixelLayout &layout = *mLayout;
+    unsigned count = span.clampCount(msg.length() / 3);
+    const uint8_t *inPtr = msg.data + (span.firstOPC * 3);
+    unsigned outIndex = span.firstOut;
+    int stride = layout.pixelStride();
+
+    if (!count) {
+        return false;
+    }
+    Metrics::add(Metrics::BYTES_MAPPED, count * 3);
+
+    if (span.direction > 0) {
+        while (count) {
+            uint8_t *outPtr = framebuffer + layout.offset(outIndex);
+            unsigned run = std::min(count, layout.forwardRun(outIndex));
+
+            if (span.byteCopy) {
+                memcpy(outPtr, inPtr, run * 3);
+            } else {
+                span.kernel(outPtr, inPtr, run, stride);
+            }
+
+            inPtr += run * 3;
+            outIndex += run;
+            count -= run;
+        }
+    } else {
+        while (count) {
+            uint8_t *outPtr = framebuffer + layout.offset(outIndex);
+            unsigned run = std::min(count, layout.reverseRun(outIndex));
+
+            span.kernel(outPtr, inPtr, run, -stride);
+
+            inPtr += run * 3;
+            outIndex -= run;
+            count -= run;
+        }
+    }
+
+    return true;
+}
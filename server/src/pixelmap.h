@@ -0,0 +1,198 @@
+/*
+ * Compiled pixel mapping, shared by all output devices.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "opc.h"
+#include "tinythread.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+
+/*
+ * Where each output pixel lives in a device's framebuffer.
+ *
+ * Devices describe their framebuffer layout once, and the layout is expanded into
+ * tables of byte offsets. The mapper then writes straight into the device's own
+ * buffer format (USB packets, SPI frames) without any per-pixel address arithmetic.
+ *
+ * Pixels are grouped into blocks, for example the 21 pixels in each Fadecandy USB
+ * packet. Within a block, pixels are 'pixelStride' bytes apart and the three color
+ * bytes are consecutive, in either RGB or BGR order.
+ */
+
+class PixelLayout
+{
+public:
+    PixelLayout(unsigned numPixels, unsigned firstOffset, unsigned pixelStride,
+        unsigned pixelsPerBlock, unsigned blockStride, bool bgr = false);
+
+    // The parameters a layout was built from. Layouts with the same shape are identical.
+    struct Shape {
+        unsigned numPixels, firstOffset, pixelStride, pixelsPerBlock, blockStride;
+        bool bgr;
+
+        bool operator==(const Shape &other) const {
+            return numPixels == other.numPixels && firstOffset == other.firstOffset &&
+                pixelStride == other.pixelStride && pixelsPerBlock == other.pixelsPerBlock &&
+                blockStride == other.blockStride && bgr == other.bgr;
+        }
+    };
+
+    const Shape &shape() const { return mShape; }
+
+    unsigned numPixels() const { return mOffsets.size(); }
+    unsigned pixelStride() const { return mPixelStride; }
+    bool isBGR() const { return mBGR; }
+
+    // Byte offset of the first color byte of a pixel
+    unsigned offset(unsigned pixel) const { return mOffsets[pixel]; }
+
+    // Number of evenly spaced pixels starting at 'pixel', going up or down
+    unsigned forwardRun(unsigned pixel) const { return mForwardRun[pixel]; }
+    unsigned reverseRun(unsigned pixel) const { return mReverseRun[pixel]; }
+
+private:
+    std::vector<unsigned> mOffsets;
+    std::vector<uint16_t> mForwardRun;
+    std::vector<uint16_t> mReverseRun;
+    unsigned mPixelStride;
+    bool mBGR;
+    Shape mShape;
+};
+
+
+/*
+ * A device's JSON 'map' array, compiled into a flat list of copy spans.
+ *
+ * All JSON type checking and clamping against the size of the output device
+ * happens once, when the configuration is loaded. The per-frame path only
+ * needs to compare channels and clamp each span to the length of the OPC message.
+ */
+
+class PixelMap
+{
+public:
+    typedef rapidjson::Value Value;
+
+    // Sources for each output color channel
+    enum Color {
+        RED = 0,
+        GREEN = 1,
+        BLUE = 2,
+        LUMINOSITY = 3,
+    };
+
+    /*
+     * Copy 'count' pixels, choosing color channels according to a span's swizzle.
+     * Input pixels are packed RGB. Output pixels are three consecutive bytes, spaced
+     * 'outStride' bytes apart. Negative strides are used for reversed spans.
+     */
+    typedef void (*Kernel)(uint8_t *out, const uint8_t *in, unsigned count, int outStride);
+
+    struct Span {
+        unsigned firstOPC;      // First OPC pixel
+        unsigned firstOut;      // First output pixel
+        unsigned count;         // Pixel count, already clamped to the output size
+        int direction;          // +1 for ascending output pixels, -1 for descending
+        uint8_t channel;        // OPC channel
+        bool byteCopy;          // Can forward runs be copied with memcpy()?
+        uint8_t colors[3];      // Color source for each output channel, in RGB order
+        Kernel kernel;          // Copy loop specialized for 'colors' and the layout's byte order
+
+        // Number of pixels to copy from a message containing 'msgPixelCount' pixels
+        unsigned clampCount(unsigned msgPixelCount) const {
+            return firstOPC < msgPixelCount ? std::min<unsigned>(count, msgPixelCount - firstOPC) : 0;
+        }
+    };
+
+    typedef std::vector<Span>::const_iterator iterator;
+
+    PixelMap();
+    ~PixelMap();
+
+    /*
+     * Compile the JSON 'map' for a device with the given framebuffer layout. 'map'
+     * may be NULL if the device has no mapping. Unsupported instructions are skipped,
+     * with a log message in verbose mode. The layout must outlive this PixelMap.
+     *
+     * Devices with identical maps and layout shapes share one compiled plan, so the
+     * message is only logged for the first of them.
+     */
+    void compile(const Value *map, const PixelLayout &layout, bool verbose);
+
+    // Store any portions of 'msg' that we map into a framebuffer with our layout.
+    // Returns true if any pixels were written.
+    bool apply(const OPC::Message &msg, uint8_t *framebuffer) const;
+
+    bool empty() const { return spans().empty(); }
+    bool usesChannel(unsigned channel) const;
+
+    // Parse a color channel letter, as in a map's color string
+    static bool parseColor(uint8_t &color, char selector);
+
+    // The copy loop for 'colors', for output in RGB byte order
+    static Kernel kernel(const uint8_t colors[3]) {
+        return kKernels[(colors[0] << 4) | (colors[1] << 2) | colors[2]];
+    }
+    iterator begin() const { return spans().begin(); }
+    iterator end() const { return spans().end(); }
+
+private:
+    /*
+     * Compiled spans, shared by every PixelMap with the same JSON map and layout shape.
+     * Plans are immutable once compiled, and deleted when their last user lets go.
+     */
+    struct Plan;
+    typedef std::multimap<std::string, Plan*> PlanTable;
+
+    struct Plan {
+        PixelLayout::Shape shape;
+        std::vector<Span> spans;
+        unsigned refs;
+        PlanTable::iterator entry;
+    };
+
+    static PlanTable sPlans;
+    static tthread::mutex sPlanMutex;
+    static const std::vector<Span> sNoSpans;
+
+    Plan *mPlan;
+    const PixelLayout *mLayout;
+
+    // Not copyable, because of the plan reference
+    PixelMap(const PixelMap&);
+    PixelMap& operator=(const PixelMap&);
+
+    const std::vector<Span> &spans() const { return mPlan ? mPlan->spans : sNoSpans; }
+    static void releasePlan(Plan *plan);
+
+    static bool compileInstruction(std::vector<Span> &spans, const Value &inst, const PixelLayout &layout);
+    bool applySpan(const OPC::Message &msg, const Span &span, uint8_t *framebuffer) const;
+
+    template <unsigned A, unsigned B, unsigned C>
+    static void copyKernel(uint8_t *out, const uint8_t *in, unsigned count, int outStride);
+    static const Kernel kKernels[64];
+};
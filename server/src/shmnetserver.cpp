@@ -0,0 +1,189 @@
+/*
+ * Open Pixel Control over shared memory for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "shmnetserver.h"
+#include <iostream>
+#include <string.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+
+ShmNetServer::ShmNetServer(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose),
+      mRing(0), mRecords(0), mThread(0)
+{}
+
+#ifndef __linux__
+
+bool ShmNetServer::start(const char *name)
+{
+    std::clog << "Open Pixel Control over shared memory isn't supported on this platform.\n";
+    return false;
+}
+
+void ShmNetServer::threadFunc(void *arg) {}
+void ShmNetServer::receiveLoop() {}
+void ShmNetServer::waitForRecords(uint32_t head) {}
+void ShmNetServer::handleRecord(uint8_t *data, uint32_t length) {}
+
+#else
+
+bool ShmNetServer::start(const char *name)
+{
+    // A ring left behind by a server that didn't exit cleanly has nobody reading it
+    shm_unlink(name);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        std::clog << "Can't create shared memory ring " << name << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    size_t size = sizeof(Header) + RING_BYTES;
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        std::clog << "Can't map shared memory ring " << name << ": " << strerror(errno) << "\n";
+        shm_unlink(name);
+        return false;
+    }
+
+    // A new segment is all zeroes. The magic goes in last, so clients never see half a header.
+    mRing = (Header*) mapping;
+    mRecords = (uint8_t*) &mRing[1];
+    uint32_t magic;
+    memcpy(&magic, "FCR1", sizeof magic);
+    mRing->size = RING_BYTES;
+    __atomic_store_n((uint32_t*) mRing->magic, magic, __ATOMIC_RELEASE);
+
+    if (mVerbose) {
+        std::clog << "Shared memory ring listening on " << name << "\n";
+    }
+
+    mThread = new tthread::thread(threadFunc, this);
+    return true;
+}
+
+void ShmNetServer::threadFunc(void *arg)
+{
+    ShmNetServer *self = (ShmNetServer*) arg;
+    self->receiveLoop();
+}
+
+void ShmNetServer::receiveLoop()
+{
+    uint32_t tail = 0;
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&mRing->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            waitForRecords(head);
+            continue;
+        }
+
+        if (head - tail > RING_BYTES) {
+            // Nothing a working client would write. Skip whatever it was.
+            if (mVerbose) {
+                std::clog << "Shared memory ring is corrupted, skipping to the newest record\n";
+            }
+            tail = head;
+            __atomic_store_n(&mRing->tail, tail, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        while (tail != head) {
+            uint32_t position = tail & (RING_BYTES - 1);
+            uint32_t space = RING_BYTES - position;
+            uint32_t length = *(const uint32_t*) (mRecords + position);
+
+            if (length == WRAP_RECORD) {
+                tail += space;
+            } else if (length > space - 4 || length + 4 > head - tail) {
+                if (mVerbose) {
+                    std::clog << "Ignoring shared memory record that doesn't fit in the ring\n";
+                }
+                tail = head;
+            } else {
+                handleRecord(mRecords + position + 4, length);
+                tail += 4 + ((length + 3) & ~3);
+            }
+
+            // The client can reuse this part of the ring now
+            __atomic_store_n(&mRing->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+void ShmNetServer::waitForRecords(uint32_t head)
+{
+    /*
+     * Sleep until 'head' moves. A client stores to 'head' before checking 'waiting', and
+     * we set 'waiting' before checking 'head', so one of us always sees the other. A
+     * wake-up that comes between our check and FUTEX_WAIT also works, since the kernel
+     * won't sleep if 'head' no longer has the value we saw.
+     */
+
+    __atomic_store_n(&mRing->waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&mRing->head, __ATOMIC_SEQ_CST) == head) {
+        syscall(SYS_futex, &mRing->head, FUTEX_WAIT, head, NULL, NULL, 0);
+    }
+
+    __atomic_store_n(&mRing->waiting, 0, __ATOMIC_RELAXED);
+}
+
+void ShmNetServer::handleRecord(uint8_t *data, uint32_t length)
+{
+    // One record can hold a whole frame, as any number of back-to-back OPC messages
+
+    while (length >= OPC::HEADER_BYTES) {
+        OPC::Message *msg = (OPC::Message*) data;
+        uint32_t msgLength = OPC::HEADER_BYTES + msg->length();
+
+        if (msgLength > length) {
+            if (mVerbose) {
+                std::clog << "Ignoring truncated OPC message in shared memory ring\n";
+            }
+            return;
+        }
+
+        mOpcCallback(*msg, mUserContext);
+        data += msgLength;
+        length -= msgLength;
+    }
+}
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Open Pixel Control over shared memory for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include "tinythread.h"
+#include "opc.h"
+
+
+/*
+ * Receives Open Pixel Control messages from a client on the same computer through
+ * a POSIX shared memory ring, without any socket reads or copies into our own buffers.
+ *
+ * fcserver creates the ring under a name like "/fcserver", and one client at a time
+ * maps it and claims it by writing its process ID. The client appends records: a
+ * 32-bit length in host byte order, then that many bytes of whole OPC messages,
+ * padded to a multiple of 4 bytes. A record never wraps around the end of the ring;
+ * a length of WRAP_RECORD instead means the rest of the ring is unused. 'head' and
+ * 'tail' count bytes since the ring was created, so they're free-running and only
+ * the low bits are a position.
+ *
+ * Our thread sleeps on a futex on 'head' while the ring is empty, and sets 'waiting'
+ * first so clients only make the wake-up system call when somebody is asleep.
+ * Messages are handed to the callback right where they are in the ring, and
+ * 'tail' moves past each record once its messages have been handled.
+ */
+
+class ShmNetServer {
+public:
+    ShmNetServer(OPC::callback_t opcCallback, void *context, bool verbose = false);
+
+    // Create the named ring, and start receiving on a separate thread
+    bool start(const char *name);
+
+    tthread::thread *getThread() { return mThread; }
+
+    // Shared layout at the beginning of the ring. Clients must agree on all of this.
+    struct Header {
+        char magic[4];          // "FCR1", written once everything else is ready
+        uint32_t size;          // Bytes of records after the header, a power of two
+        uint32_t head;          // End of the last record, written by the client
+        uint32_t tail;          // End of the last record handled, written by fcserver
+        uint32_t waiting;       // Nonzero while fcserver may be asleep on 'head'
+        uint32_t writer;        // Process ID of the client that claimed the ring, or zero
+        uint32_t reserved[10];
+    };
+
+    static const uint32_t RING_BYTES = 4 * 1024 * 1024;
+    static const uint32_t WRAP_RECORD = 0xFFFFFFFF;
+
+private:
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+    Header *mRing;
+    uint8_t *mRecords;
+    tthread::thread *mThread;
+
+    static void threadFunc(void *arg);
+    void receiveLoop();
+    void waitForRecords(uint32_t head);
+    void handleRecord(uint8_t *data, uint32_t length);
+};
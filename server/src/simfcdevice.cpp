@@ -0,0 +1,239 @@
+/*
+ * Simulated Fadecandy device, for load testing without hardware
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "simfcdevice.h"
+#include <iostream>
+#include <sstream>
+#include <stdio.h>
+
+const char *SimFCDevice::DEVICE_TYPE = "fadecandy-sim";
+
+
+SimFCDevice::SimFCDevice(unsigned index, bool verbose)
+    : FCDevice(0, verbose, DEVICE_TYPE),
+      mIndex(index),
+      mLatency(DEFAULT_LATENCY_MICROS),
+      mPacketTime(PACKET_BYTES * 1000000 / DEFAULT_BANDWIDTH),
+      mFramePeriod(1000000 / DEFAULT_FIRMWARE_FPS),
+      mBusTime(0),
+      mNextFrame(0),
+      mPendingFinalize(false),
+      mFrameCounter(0),
+      mKeyframeCounter(0)
+{}
+
+SimFCDevice::~SimFCDevice()
+{
+    // Transfers still on the bus are cancelled, so FCDevice can free them
+    while (!mQueue.empty()) {
+        libusb_transfer *transfer = mQueue.front().transfer;
+        mQueue.pop_front();
+        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        transfer->callback(transfer);
+    }
+}
+
+uint64_t SimFCDevice::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int SimFCDevice::open()
+{
+    snprintf(mSerialBuffer, sizeof mSerialBuffer, "SIM%05u", mIndex);
+    mDD.bcdDevice = 0x0107;
+    snprintf(mVersionString, sizeof mVersionString, "%x.%02x", mDD.bcdDevice >> 8, mDD.bcdDevice & 0xFF);
+
+    mNextFrame = now() + mFramePeriod;
+    return 0;
+}
+
+void SimFCDevice::loadConfiguration(const Value &config)
+{
+    const Value &latency = config["usbLatency"];
+    const Value &bandwidth = config["usbBandwidth"];
+    const Value &frameRate = config["firmwareFrameRate"];
+
+    if (latency.IsUint()) {
+        mLatency = latency.GetUint();
+    } else if (!latency.IsNull() && mVerbose) {
+        std::clog << "The 'usbLatency' option must be a number of microseconds.\n";
+    }
+
+    if (bandwidth.IsUint() && bandwidth.GetUint() >= PACKET_BYTES) {
+        mPacketTime = PACKET_BYTES * 1000000ULL / bandwidth.GetUint();
+    } else if (!bandwidth.IsNull() && mVerbose) {
+        std::clog << "The 'usbBandwidth' option must be a number of bytes per second.\n";
+    }
+
+    if (frameRate.IsUint() && frameRate.GetUint() >= 1 && frameRate.GetUint() <= 1000000) {
+        mFramePeriod = 1000000 / frameRate.GetUint();
+    } else if (!frameRate.IsNull() && mVerbose) {
+        std::clog << "The 'firmwareFrameRate' option must be a number of frames per second.\n";
+    }
+
+    FCDevice::loadConfiguration(config);
+}
+
+int SimFCDevice::submitUSBTransfer(libusb_transfer *transfer)
+{
+    // The model only takes bulk packets. Control requests stall, as the CPU profile's do
+    // on firmware without one.
+    if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+        return LIBUSB_ERROR_PIPE;
+    }
+
+    Pending p;
+    p.transfer = transfer;
+    p.start = now() + mLatency;
+    p.offset = 0;
+    mQueue.push_back(p);
+    return 0;
+}
+
+void SimFCDevice::firmwareFrame()
+{
+    // One pass of the firmware's main loop: finalize a waiting frame, then render
+    if (mPendingFinalize) {
+        mPendingFinalize = false;
+        mKeyframeCounter++;
+    }
+    mFrameCounter++;
+    mNextFrame += mFramePeriod;
+}
+
+void SimFCDevice::advance(uint64_t time)
+{
+    /*
+     * Run the model up to 'time', handling packets and frame boundaries in order.
+     * Transfers that finish get their completion callback, the same as from libusb.
+     */
+
+    while (!mQueue.empty()) {
+        Pending &p = mQueue.front();
+        const uint8_t *packet = p.transfer->buffer + p.offset;
+        bool framebuffer = isFramebufferPacket(packet[0]);
+
+        uint64_t ready = std::max(mBusTime, p.start);
+        bool refused = framebuffer && mPendingFinalize;
+        uint64_t accept = refused ? std::max(ready, mNextFrame) : ready;
+
+        if (mNextFrame <= accept) {
+            // A frame boundary comes first
+            if (mNextFrame > time) {
+                break;
+            }
+            firmwareFrame();
+            continue;
+        }
+
+        uint64_t done = accept + mPacketTime;
+        if (done > time) {
+            break;
+        }
+
+        mBusTime = done;
+        p.offset += PACKET_BYTES;
+        if (framebuffer && (packet[0] & 0x20)) {
+            mPendingFinalize = true;
+        }
+
+        if (p.offset >= p.transfer->length) {
+            libusb_transfer *transfer = p.transfer;
+            mQueue.pop_front();
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            transfer->actual_length = transfer->length;
+            transfer->callback(transfer);
+        }
+    }
+
+    // An idle bus doesn't hold up the firmware
+    if (mQueue.empty() && mBusTime < time) {
+        mBusTime = time;
+    }
+    while (mNextFrame <= time) {
+        firmwareFrame();
+    }
+}
+
+uint64_t SimFCDevice::nextEvent()
+{
+    // When the next packet could finish, if anything is waiting
+    const Pending &p = mQueue.front();
+    uint64_t ready = std::max(mBusTime, p.start);
+    if (isFramebufferPacket(p.transfer->buffer[p.offset]) && mPendingFinalize) {
+        ready = std::max(ready, mNextFrame);
+    }
+    return ready + mPacketTime;
+}
+
+void SimFCDevice::flush()
+{
+    advance(now());
+    FCDevice::flush();
+}
+
+int SimFCDevice::flushTimeoutMillis()
+{
+    // The sooner of our next simulated USB event, and a frame held by the refresh rate
+    int frameMillis = FCDevice::flushTimeoutMillis();
+    if (mQueue.empty()) {
+        return frameMillis;
+    }
+
+    uint64_t t = now();
+    uint64_t next = nextEvent();
+    int eventMillis = next <= t ? 0 : int((next - t + 999) / 1000);
+    return frameMillis >= 0 && frameMillis < eventMillis ? frameMillis : eventMillis;
+}
+
+std::string SimFCDevice::getName()
+{
+    std::ostringstream s;
+    s << "Simulated Fadecandy (Serial# " << mSerialString << ")";
+    return s.str();
+}
+
+bool SimFCDevice::readPerfCounter(unsigned index, uint32_t &value)
+{
+    // The simulated firmware only has the original two counters
+    switch (index) {
+        case PERF_FRAME_COUNTER:
+            value = mFrameCounter;
+            return true;
+        case PERF_KEYFRAME_COUNTER:
+            value = mKeyframeCounter;
+            return true;
+        default:
+            return false;
+    }
+}
+
+void SimFCDevice::describe(rapidjson::Value &object, Allocator &alloc)
+{
+    FCDevice::describe(object, alloc);
+    object.AddMember("sim_frames_rendered", mFrameCounter, alloc);
+    object.AddMember("sim_keyframes_received", mKeyframeCounter, alloc);
+}
@@ -0,0 +1,101 @@
+/*
+ * Simulated Fadecandy device, for load testing without hardware
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "fcdevice.h"
+#include <deque>
+
+
+/*
+ * A Fadecandy with no hardware behind it. Everything above USB is the real FCDevice:
+ * mapping, the transfer pool, frame queueing and flow control. Transfers go to a model
+ * of the USB bus and firmware instead of libusb, and complete from flush() in the
+ * main loop, where libusb callbacks would normally run.
+ *
+ * The model follows fcBuffers::handleUSB(). Packets cross the bus one at a time at
+ * 'usbBandwidth', after 'usbLatency' per transfer. Once a frame's final packet has
+ * arrived, further framebuffer packets are refused (NAKed, so they keep waiting)
+ * until the firmware's next frame boundary finalizes it. LUT and config packets are
+ * always accepted.
+ *
+ * Simulated devices are created from the configuration, and never unplugged.
+ */
+
+class SimFCDevice : public FCDevice
+{
+public:
+    SimFCDevice(unsigned index, bool verbose);
+    virtual ~SimFCDevice();
+
+    static const char *DEVICE_TYPE;
+
+    virtual int open();
+    virtual void loadConfiguration(const Value &config);
+    virtual void flush();
+    virtual int flushTimeoutMillis();
+    virtual std::string getName();
+    virtual void describe(rapidjson::Value &object, Allocator &alloc);
+    virtual bool readPerfCounter(unsigned index, uint32_t &value);
+
+protected:
+    virtual int submitUSBTransfer(libusb_transfer *transfer);
+
+private:
+    static const unsigned PACKET_BYTES = 64;
+    static const unsigned DEFAULT_LATENCY_MICROS = 125;
+    static const unsigned DEFAULT_BANDWIDTH = 1000000;
+    static const unsigned DEFAULT_FIRMWARE_FPS = 400;
+
+    struct Pending {
+        libusb_transfer *transfer;
+        uint64_t start;         // When the first packet can be sent
+        int offset;             // Bytes accepted so far
+    };
+
+    unsigned mIndex;
+    std::deque<Pending> mQueue;
+
+    // Model parameters, all in microseconds
+    unsigned mLatency;
+    unsigned mPacketTime;
+    unsigned mFramePeriod;
+
+    // Model state
+    uint64_t mBusTime;          // Bus is busy until this time
+    uint64_t mNextFrame;        // Next firmware frame boundary
+    bool mPendingFinalize;
+
+    // The firmware's performance counters
+    uint64_t mFrameCounter;
+    uint64_t mKeyframeCounter;
+
+    static uint64_t now();
+    void advance(uint64_t time);
+    void firmwareFrame();
+    uint64_t nextEvent();
+
+    // Framebuffer packets have type 0x00, or 0xC0 past the first 32 packets
+    static bool isFramebufferPacket(uint8_t control) {
+        return (control & 0xC0) == 0x00 || (control & 0xC0) == 0xC0;
+    }
+};
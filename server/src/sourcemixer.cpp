@@ -0,0 +1,208 @@
+/*
+ * Priority and HTP/LTP merging between Open Pixel Control sources
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "sourcemixer.h"
+#include <string.h>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+
+SourceMixer::SourceMixer()
+    : mEnabled(false), mHighestTakesPrecedence(false)
+{
+    for (unsigned i = 0; i < NUM_SOURCES; ++i) {
+        mSources[i].priority = 0;
+        mSources[i].timeoutMillis = DEFAULT_TIMEOUT_MILLIS;
+        for (unsigned c = 0; c < NUM_CHANNELS; ++c) {
+            mSources[i].layers[c].live = false;
+        }
+    }
+}
+
+void SourceMixer::parse(const Value &sources, const Value &merge, std::ostream &error)
+{
+    /*
+     * "sources" maps listener names to objects with an optional "priority" (higher wins,
+     * default 0) and "timeout" in milliseconds, after which a quiet source stops counting
+     * (default 2000, 0 for never). Unlisted sources have the defaults.
+     */
+
+    static const char *names[NUM_SOURCES] = { "listen", "opcListen", "udpListen", "shmListen" };
+
+    if (sources.IsNull()) {
+        return;
+    }
+    if (!sources.IsObject()) {
+        error << "The optional 'sources' configuration key must be an object.\n";
+        return;
+    }
+
+    for (Value::ConstMemberIterator i = sources.MemberBegin(), e = sources.MemberEnd(); i != e; ++i) {
+        unsigned index = 0;
+        while (index < NUM_SOURCES && strcmp(i->name.GetString(), names[index])) {
+            index++;
+        }
+        if (index == NUM_SOURCES) {
+            error << "Unknown source '" << i->name.GetString() << "' in 'sources'. Sources are "
+                "listen, opcListen, udpListen and shmListen.\n";
+            continue;
+        }
+
+        const Value &source = i->value;
+        const Value &priority = source["priority"];
+        const Value &timeout = source["timeout"];
+
+        if (!source.IsObject()) {
+            error << "Each source in 'sources' must be an object.\n";
+            continue;
+        }
+        if (priority.IsUint()) {
+            mSources[index].priority = priority.GetUint();
+        } else if (!priority.IsNull()) {
+            error << "A source's 'priority' must be a non-negative integer.\n";
+        }
+        if (timeout.IsUint()) {
+            mSources[index].timeoutMillis = timeout.GetUint();
+        } else if (!timeout.IsNull()) {
+            error << "A source's 'timeout' must be a number of milliseconds.\n";
+        }
+    }
+
+    if (merge.IsString() && !strcmp(merge.GetString(), "htp")) {
+        mHighestTakesPrecedence = true;
+    } else if (!(merge.IsNull() || (merge.IsString() && !strcmp(merge.GetString(), "ltp")))) {
+        error << "The optional 'sourceMerge' configuration key must be \"ltp\" or \"htp\".\n";
+    }
+
+    mEnabled = true;
+}
+
+bool SourceMixer::isLive(const Layer &layer, unsigned timeoutMillis, const struct timeval &now)
+{
+    if (!layer.live) {
+        return false;
+    }
+    if (timeoutMillis == 0) {
+        return true;
+    }
+    int64_t millis = int64_t(now.tv_sec - layer.updated.tv_sec) * 1000
+        + (now.tv_usec - layer.updated.tv_usec) / 1000;
+    return millis <= int64_t(timeoutMillis);
+}
+
+OPC::Message *SourceMixer::mix(Source source, OPC::Message &msg)
+{
+    unsigned channel = msg.channel;
+    unsigned length = msg.length();
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    Layer &layer = mSources[source].layers[channel];
+    layer.pixels.assign(msg.data, msg.data + length);
+    layer.updated = now;
+    layer.live = true;
+
+    // Who's on top? Stale layers are forgotten.
+
+    bool found = false;
+    unsigned top = 0;
+    unsigned winners = 0;
+
+    for (unsigned i = 0; i < NUM_SOURCES; ++i) {
+        Layer &l = mSources[i].layers[channel];
+        if (!isLive(l, mSources[i].timeoutMillis, now)) {
+            l.live = false;
+            continue;
+        }
+
+        unsigned priority = mSources[i].priority;
+        if (!found || priority > top) {
+            found = true;
+            top = priority;
+            winners = 0;
+        }
+        if (priority == top) {
+            winners++;
+        }
+    }
+
+    if (mSources[source].priority < top) {
+        // Hidden under a higher-priority source
+        return NULL;
+    }
+
+    if (winners == 1 || !mHighestTakesPrecedence) {
+        // The newest message wins. That's this one, since it was just stored.
+        return &msg;
+    }
+
+    // Highest Takes Precedence, over the longest of the tied layers
+
+    unsigned outputLength = 0;
+    for (unsigned i = 0; i < NUM_SOURCES; ++i) {
+        const Layer &l = mSources[i].layers[channel];
+        if (l.live && mSources[i].priority == top) {
+            outputLength = std::max<unsigned>(outputLength, l.pixels.size());
+        }
+    }
+
+    memset(mOutput.data, 0, outputLength);
+    for (unsigned i = 0; i < NUM_SOURCES; ++i) {
+        const Layer &l = mSources[i].layers[channel];
+        if (l.live && mSources[i].priority == top && !l.pixels.empty()) {
+            maxBytes(mOutput.data, &l.pixels[0], l.pixels.size());
+        }
+    }
+
+    mOutput.channel = channel;
+    mOutput.command = msg.command;
+    mOutput.setLength(outputLength);
+    return &mOutput;
+}
+
+void SourceMixer::maxBytes(uint8_t *dest, const uint8_t *src, unsigned length)
+{
+    unsigned i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (dest + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm_storeu_si128((__m128i*) (dest + i), _mm_max_epu8(a, b));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 16 <= length; i += 16) {
+        vst1q_u8(dest + i, vmaxq_u8(vld1q_u8(dest + i), vld1q_u8(src + i)));
+    }
+#endif
+
+    for (; i < length; ++i) {
+        dest[i] = std::max(dest[i], src[i]);
+    }
+}
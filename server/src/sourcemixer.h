@@ -0,0 +1,97 @@
+/*
+ * Priority and HTP/LTP merging between Open Pixel Control sources
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "opc.h"
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+#include <sys/time.h>
+
+
+/*
+ * Merges Set Pixel Colors messages from several OPC sources, so they don't take turns
+ * overwriting each other. A source is one of fcserver's listeners: "listen", "opcListen",
+ * "udpListen" or "shmListen". Each source keeps a layer with its latest pixels on each
+ * channel. A channel shows the highest-priority source that has sent it anything
+ * within that source's timeout. Sources tied for the top priority are merged, either
+ * Latest Takes Precedence (the newest message wins) or Highest Takes Precedence (the
+ * brightest value of each color byte wins).
+ *
+ * Messages from sources under the top priority only update their layer; nothing is
+ * sent, so they cost the devices nothing until the sources above them go quiet.
+ * Other commands aren't merged. Disabled unless "sources" is configured.
+ */
+
+class SourceMixer
+{
+public:
+    typedef rapidjson::Value Value;
+
+    enum Source {
+        LISTEN,
+        OPC_LISTEN,
+        UDP_LISTEN,
+        SHM_LISTEN,
+        NUM_SOURCES
+    };
+
+    SourceMixer();
+
+    // Load the "sources" object and "sourceMerge" mode, describing problems on 'error'
+    void parse(const Value &sources, const Value &merge, std::ostream &error);
+
+    bool isEnabled() const { return mEnabled; }
+
+    /*
+     * Take a Set Pixel Colors message from 'source'. Returns the message that its channel
+     * should show now, which may be 'msg' itself, or NULL if the channel is unchanged.
+     * Not thread-safe; the returned message is only good until the next call.
+     */
+    OPC::Message *mix(Source source, OPC::Message &msg);
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+    static const unsigned DEFAULT_TIMEOUT_MILLIS = 2000;
+
+    struct Layer {
+        std::vector<uint8_t> pixels;
+        struct timeval updated;
+        bool live;
+    };
+
+    struct SourceInfo {
+        unsigned priority;
+        unsigned timeoutMillis;
+        Layer layers[NUM_CHANNELS];
+    };
+
+    bool mEnabled;
+    bool mHighestTakesPrecedence;
+    SourceInfo mSources[NUM_SOURCES];
+    OPC::Message mOutput;
+
+    static bool isLive(const Layer &layer, unsigned timeoutMillis, const struct timeval &now);
+    static void maxBytes(uint8_t *dest, const uint8_t *src, unsigned length);
+};
@@ -23,11 +23,17 @@
 */
 
 #include "spidevice.h"
+#include "colorcurve.h"
 #include <iostream>
+#include <string.h>
+#include <stdio.h>
 
-#ifdef FCSERVER_HAS_WIRINGPI
-#include <wiringPi.h>
-#include <wiringPiSPI.h>
+#ifdef OS_LINUX
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
 #endif
 
 #ifndef SPI_FREQUENCY_MHZ
@@ -39,37 +45,226 @@
 SPIDevice::SPIDevice(const char *type, bool verbose)
     : mTypeString(type),
       mVerbose(verbose),
-      mPort(0)
+      mBus(0),
+      mPort(0),
+      mFd(-1),
+      mMaxTransfer(DEFAULT_MAX_TRANSFER),
+      mWriterThread(0),
+      mHasPending(false),
+      mFrameBarrier(false),
+      mClosing(false)
 {
     gettimeofday(&mTimestamp, NULL);
+
+    // Identity color correction until we're told otherwise
+    writeColorCorrection(Value());
 }
 
 SPIDevice::~SPIDevice()
 {
+    // The writer thread sends anything still queued before it exits
+    if (mWriterThread) {
+        mWriteMutex.lock();
+        mClosing = true;
+        mWriteCond.notify_one();
+        mWriteMutex.unlock();
+
+        mWriterThread->join();
+        delete mWriterThread;
+    }
 
+#ifdef OS_LINUX
+    if (mFd >= 0) {
+        close(mFd);
+    }
+#endif
 }
 
-int SPIDevice::open(uint32_t port)
+int SPIDevice::open(uint32_t bus, uint32_t port)
 {
+    mBus = bus;
     mPort = port;
 
-#ifdef FCSERVER_HAS_WIRINGPI
-    return wiringPiSPISetup(mPort, SPI_FREQUENCY);
+#ifdef OS_LINUX
+    /*
+     * Talk to the kernel's spidev driver directly. Ports are chip selects on a bus,
+     * as with the Raspberry Pi's /dev/spidev0.0 and /dev/spidev0.1.
+     */
+
+    char path[64];
+    snprintf(path, sizeof path, "/dev/spidev%u.%u", bus, port);
+
+    mFd = ::open(path, O_RDWR);
+    if (mFd < 0) {
+        if (mVerbose) {
+            std::clog << "Can't open " << path << ": " << strerror(errno) << "\n";
+        }
+        return -1;
+    }
+
+    uint8_t mode = SPI_MODE_0;
+    uint8_t bits = 8;
+    uint32_t speed = SPI_FREQUENCY;
+
+    if (ioctl(mFd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(mFd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+        ioctl(mFd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+        if (mVerbose) {
+            std::clog << "Can't configure " << path << ": " << strerror(errno) << "\n";
+        }
+        close(mFd);
+        mFd = -1;
+        return -1;
+    }
+
+    // Transfers larger than the driver's buffer fail, so find out how big it is
+    FILE *f = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+    if (f) {
+        unsigned bufsiz;
+        if (fscanf(f, "%u", &bufsiz) == 1 && bufsiz > 0) {
+            mMaxTransfer = bufsiz;
+        }
+        fclose(f);
+    }
+
+    mWriterThread = new tthread::thread(writerThreadFunc, this);
+    return 0;
 #else
     return -1;
 #endif
 }
 
-void SPIDevice::write(void* buffer, int length)
+void SPIDevice::write(const void *buffer, int length)
+{
+    // Latest frame wins. Never waits for the SPI bus.
+    queue(buffer, length, false, true);
+}
+
+void SPIDevice::append(const void *buffer, int length)
+{
+    queue(buffer, length, true, true);
+}
+
+void SPIDevice::queue(const void *buffer, int length, bool append, bool holdable)
 {
-#ifdef FCSERVER_HAS_WIRINGPI
-    wiringPiSPIDataRW(mPort, (unsigned char*)buffer, length);
+    const uint8_t *bytes = (const uint8_t*) buffer;
+    bool hold = holdable && mFrameBarrier;
+
+    mWriteMutex.lock();
+
+    std::vector<uint8_t> &dest = hold ? mHeld : mPending;
+    if (!append) {
+        dest.clear();
+    }
+    dest.insert(dest.end(), bytes, bytes + length);
+
+    if (!hold) {
+        mHasPending = true;
+        mWriteCond.notify_one();
+    }
+
+    mWriteMutex.unlock();
+}
+
+void SPIDevice::setFrameBarrier(bool enabled)
+{
+    mFrameBarrier = enabled;
+    if (!enabled) {
+        commitFrame();
+    }
+}
+
+void SPIDevice::commitFrame()
+{
+    mWriteMutex.lock();
+    if (!mHeld.empty()) {
+        mPending.swap(mHeld);
+        mHeld.clear();
+        mHasPending = true;
+        mWriteCond.notify_one();
+    }
+    mWriteMutex.unlock();
+}
+
+void SPIDevice::writerThreadFunc(void *arg)
+{
+    SPIDevice *self = (SPIDevice*) arg;
+    self->writerLoop();
+}
+
+void SPIDevice::writerLoop()
+{
+    for (;;) {
+        mWriteMutex.lock();
+        while (!mHasPending && !mClosing) {
+            mWriteCond.wait(mWriteMutex);
+        }
+        if (!mHasPending) {
+            mWriteMutex.unlock();
+            return;
+        }
+
+        // Take the pending bytes, and leave the old buffer behind for reuse
+        mSending.swap(mPending);
+        mPending.clear();
+        mHasPending = false;
+        mWriteMutex.unlock();
+
+        if (!mSending.empty()) {
+            transfer(&mSending[0], mSending.size());
+        }
+    }
+}
+
+void SPIDevice::transfer(const uint8_t *data, unsigned length)
+{
+#ifdef OS_LINUX
+    while (length) {
+        unsigned chunk = length < mMaxTransfer ? length : mMaxTransfer;
+
+        struct spi_ioc_transfer xfer;
+        memset(&xfer, 0, sizeof xfer);
+        xfer.tx_buf = (unsigned long) data;
+        xfer.len = chunk;
+        xfer.speed_hz = SPI_FREQUENCY;
+        xfer.bits_per_word = 8;
+
+        if (ioctl(mFd, SPI_IOC_MESSAGE(1), &xfer) < 0) {
+            if (mVerbose) {
+                std::clog << "Error writing to SPI bus " << mBus << " port " << mPort << ": " << strerror(errno) << "\n";
+            }
+            return;
+        }
+
+        data += chunk;
+        length -= chunk;
+    }
 #endif
 }
 
+bool SPIDevice::usesOpcChannel(unsigned channel)
+{
+    // By default, assume the device wants pixels from every channel.
+    return true;
+}
+
 void SPIDevice::writeColorCorrection(const Value &color)
 {
-    // Optional. By default, ignore color correction messages.
+    /*
+     * SPI LEDs have no color LUT of their own, so we apply one on the host. Devices
+     * look up each color byte in mColorLUT when they format a frame.
+     *
+     * 'color' takes the same options as a Fadecandy device.
+     */
+
+    ColorCurve curve;
+    curve.parse(color, mVerbose);
+
+    for (unsigned channel = 0; channel < 3; channel++) {
+        for (unsigned entry = 0; entry < 256; entry++) {
+            mColorLUT[channel][entry] = curve.evaluate16(channel, entry / 255.0);
+        }
+    }
 }
 
 bool SPIDevice::matchConfiguration(const Value &config)
@@ -79,12 +274,18 @@ bool SPIDevice::matchConfiguration(const Value &config)
     }
 
     const Value &vtype = config["type"];
+    const Value &vbus = config["bus"];
     const Value &vport = config["port"];
 
     if (!vtype.IsNull() && (!vtype.IsString() || strcmp(vtype.GetString(), mTypeString))) {
         return false;
     }
 
+    // No bus means bus 0, so older configurations stay unambiguous
+    if (vbus.IsNull() ? mBus != 0 : (!vbus.IsUint() || vbus.GetUint() != mBus)) {
+        return false;
+    }
+
     if (!vport.IsNull() && (!vport.IsUint() || vport.GetUint() != mPort)) {
         return false;
     }
@@ -121,10 +322,17 @@ void SPIDevice::writeMessage(Document &msg)
     msg.AddMember("error", "Unknown device-specific message type", msg.GetAllocator());
 }
 
+void SPIDevice::writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count)
+{
+    // Same answer writeMessage() gives for device types without a framebuffer
+    msg.AddMember("error", "Unknown device-specific message type", msg.GetAllocator());
+}
+
 void SPIDevice::describe(rapidjson::Value &object, Allocator &alloc)
 {
     object.AddMember("type", mTypeString, alloc);
 
+    object.AddMember("bus", mBus, alloc);
     object.AddMember("port", mPort, alloc);
 
     /*
@@ -26,7 +26,9 @@
 
 #include "rapidjson/document.h"
 #include "opc.h"
+#include "tinythread.h"
 #include <string>
+#include <vector>
 #include <libusb.h> // Also brings in gettimeofday() in a portable way
 
 class SPIDevice
@@ -39,10 +41,24 @@ public:
     SPIDevice(const char *type, bool verbose);
     virtual ~SPIDevice();
 
-    // Must be opened before any other methods are called.
-    virtual int open(uint32_t port);
+    // Must be opened before any other methods are called. Opens /dev/spidev<bus>.<port>.
+    virtual int open(uint32_t bus, uint32_t port);
 
-    virtual void write(void* buffer, int length);
+    // Queue a frame for output. The SPI transfer happens on a separate writer thread.
+    // If the previous frame hasn't started sending yet, this one replaces it.
+    virtual void write(const void *buffer, int length);
+
+    // Add more bytes to the end of the last frame queued with write(). If that frame
+    // is already on its way, these bytes go out on their own.
+    virtual void append(const void *buffer, int length);
+
+    /*
+     * With a frame barrier, queued frames are held until commitFrame(). Each device
+     * has its own writer thread, so committing every device at once starts all of
+     * the SPI buses together.
+     */
+    virtual void setFrameBarrier(bool enabled);
+    virtual void commitFrame();
 
     // Check a configuration. Does it describe this device?
     virtual bool matchConfiguration(const Value &config);
@@ -53,10 +69,16 @@ public:
     // Handle an incoming OPC message
     virtual void writeMessage(const OPC::Message &msg) = 0;
 
+    // Does this device need SetPixelColors messages for an OPC channel? Used for routing.
+    virtual bool usesOpcChannel(unsigned channel);
+
     // Handle a device-specific JSON message
     virtual void writeMessage(Document &msg);
 
-    // Write color LUT from parsed JSON
+    // Handle a device_pixels message whose pixel array was already decoded to bytes
+    virtual void writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count);
+
+    // Rebuild the color LUT from parsed JSON
     virtual void writeColorCorrection(const Value &color);
 
     // Describe this device by adding keys to a JSON object
@@ -70,8 +92,40 @@ protected:
     struct timeval mTimestamp;
     const char *mTypeString;
     bool mVerbose;
+    uint32_t mBus;
     uint32_t mPort;
 
+    // Color correction, sampled at every 8-bit input level. The output has 16 bits, so
+    // devices with more than 8 bits of output precision can use all of it.
+    uint16_t mColorLUT[3][256];
+
     // Utilities
     const Value *findConfigMap(const Value &config);
+
+    // Queue output, optionally exempt from the frame barrier
+    void queue(const void *buffer, int length, bool append, bool holdable);
+
+private:
+    // Largest single transfer the spidev driver accepts, unless /sys says otherwise
+    static const unsigned DEFAULT_MAX_TRANSFER = 4096;
+
+    int mFd;
+    unsigned mMaxTransfer;
+    tthread::thread *mWriterThread;
+
+    // Bytes waiting for the writer thread. Protected by mWriteMutex.
+    tthread::mutex mWriteMutex;
+    tthread::condition_variable mWriteCond;
+    std::vector<uint8_t> mPending;
+    std::vector<uint8_t> mHeld;
+    bool mHasPending;
+    bool mFrameBarrier;
+    bool mClosing;
+
+    // Owned by the writer thread
+    std::vector<uint8_t> mSending;
+
+    static void writerThreadFunc(void *arg);
+    void writerLoop();
+    void transfer(const uint8_t *data, unsigned length);
 };
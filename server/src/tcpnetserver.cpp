@@ -27,18 +27,26 @@
 
 #include "tcpnetserver.h"
 #include "version.h"
+#include "metrics.h"
+#include "trace.h"
 #include "libwebsockets.h"
 #include "rapidjson/stringbuffer.h"
 #include "rapidjson/writer.h"
 #include <iostream>
+#include <sstream>
 #include <algorithm>
+#include <stddef.h>
+#include <stdlib.h>
 
 
 TcpNetServer::TcpNetServer(OPC::callback_t opcCallback, jsonCallback_t jsonCallback,
     void *context, bool verbose)
     : mOpcCallback(opcCallback), mJsonCallback(jsonCallback),
-      mUserContext(context), mThread(0), mVerbose(verbose)
-{}
+      mUserContext(context), mThread(0), mVerbose(verbose),
+      mRelayContext(0), mRelayThread(0), mRelaySeq(0)
+{
+    memset(&mLastBroadcast, 0, sizeof mLastBroadcast);
+}
 
 bool TcpNetServer::start(const char *host, int port)
 {
@@ -95,7 +103,7 @@ bool TcpNetServer::startRelay(const char *host, int port)
     const int llVerbose = llNormal | LLL_NOTICE;
 
     static struct libwebsocket_protocols protocols[] = {
-        // Only one protocol for now. Handles HTTP as well as our default WebSockets protocol.
+        // The default, plain OPC messages
         {
             "fcserver-relay",       // Name
             lwsRelayCallback,       // Callback
@@ -103,6 +111,14 @@ bool TcpNetServer::startRelay(const char *host, int port)
             sizeof(OPC::Message),   // Max frame size / rx buffer
         },
 
+        // Opt-in delta encoding
+        {
+            "fcserver-relay-delta",
+            lwsRelayDeltaCallback,
+            sizeof(Client),
+            sizeof(OPC::Message),
+        },
+
         { NULL, NULL, 0, 0 }    // terminator
     };
 
@@ -133,7 +149,7 @@ bool TcpNetServer::startRelay(const char *host, int port)
 
     // Note that we pass ownership of all libwebsockets state to this new thread.
     // We shouldn't access it on the other threads afterwards.
-    mRelayThread = new tthread::thread(threadFunc, context);
+    mRelayThread = new tthread::thread(relayThreadFunc, context);
 
     return true;
 }
@@ -160,6 +176,22 @@ void TcpNetServer::threadFunc(void *arg)
     libwebsocket_context_destroy(context);
 }
 
+void TcpNetServer::relayThreadFunc(void *arg)
+{
+    struct libwebsocket_context *context = (libwebsocket_context*) arg;
+    TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
+
+    /*
+     * The relay thread only sends. We can't wake libwebsocket's poll() from another
+     * thread, so it uses a short timeout to pick up new messages promptly.
+     */
+    while (libwebsocket_service(context, RELAY_SERVICE_MILLIS) >= 0) {
+        self->flushRelay(context);
+    }
+
+    libwebsocket_context_destroy(context);
+}
+
 int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
     enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len)
 {
@@ -181,10 +213,15 @@ int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
         case LWS_CALLBACK_CLOSED_HTTP:
         case LWS_CALLBACK_DEL_POLL_FD:
             if (client && client->opcBuffer) {
-                free(client->opcBuffer);
+                OPCBuffer::release(client->opcBuffer);
                 client->opcBuffer = NULL;
             }
+            if (client && client->httpBuffer) {
+                free(client->httpBuffer);
+                client->httpBuffer = NULL;
+            }
             self->mClients.erase(wsi);
+            self->unsubscribeAll(wsi);
             break;
 
         case LWS_CALLBACK_ESTABLISHED:
@@ -222,36 +259,122 @@ int TcpNetServer::lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
 int TcpNetServer::lwsRelayCallback(libwebsocket_context *context, libwebsocket *wsi,
     enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len)
 {
-    /*
-     * Protocol callback for libwebsockets.
-     *
-     * Until we have a reason to support a non-default WebSockets protocol, this handles
-     * everything: plain HTTP, Open Pixel Control, and WebSockets.
-     *
-     * For HTTP, this serves simple static HTML documents which are included at compile-time
-     * from the 'http' directory. Our web UI interacts with the server via the public WebSockets API.
-     */
+    TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
+    return self->relayEvent(context, wsi, reason, (Client*) user, false);
+}
 
+int TcpNetServer::lwsRelayDeltaCallback(libwebsocket_context *context, libwebsocket *wsi,
+    enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len)
+{
     TcpNetServer *self = (TcpNetServer*) libwebsocket_context_user(context);
-    Client *client = (Client*) user;
+    return self->relayEvent(context, wsi, reason, (Client*) user, true);
+}
+
+int TcpNetServer::relayEvent(libwebsocket_context *context, libwebsocket *wsi,
+    enum libwebsocket_callback_reasons reason, Client *client, bool delta)
+{
+    /*
+     * Relay socket events, for either protocol. Relay clients only receive. 'delta' is
+     * true for clients that asked for the "fcserver-relay-delta" protocol.
+     */
 
     switch (reason) {
         case LWS_CALLBACK_CLOSED:
         case LWS_CALLBACK_CLOSED_HTTP:
         case LWS_CALLBACK_DEL_POLL_FD:
             if (client && client->opcBuffer) {
-                free(client->opcBuffer);
+                OPCBuffer::release(client->opcBuffer);
                 client->opcBuffer = NULL;
             }
-            if (self->mRelayClients.erase(wsi) > 0) {
-                lwsl_notice("Relay client disconnected!\n");
+            mRelayMutex.lock();
+            {
+                std::map<libwebsocket*, RelayClient>::iterator i = mRelayClients.find(wsi);
+                if (i != mRelayClients.end()) {
+                    std::deque<RelayBuffer*> &queue = i->second.queue;
+                    for (unsigned j = 0; j < queue.size(); ++j) {
+                        relayRelease(queue[j]);
+                    }
+                    std::map<unsigned, RelayBase> &bases = i->second.bases;
+                    for (std::map<unsigned, RelayBase>::iterator j = bases.begin(), e = bases.end(); j != e; ++j) {
+                        relayRelease(j->second.buffer);
+                    }
+                    mRelayClients.erase(i);
+                    lwsl_notice("Relay client disconnected!\n");
+                }
             }
+            mRelayMutex.unlock();
             break;
 
-        case LWS_CALLBACK_ESTABLISHED:
-            lwsl_notice("Relay client connected!\n");
-            self->mRelayClients.insert(wsi);
+        case LWS_CALLBACK_ESTABLISHED: {
+            lwsl_notice(delta ? "Relay client connected, with delta encoding!\n" : "Relay client connected!\n");
+            mRelayMutex.lock();
+            RelayClient &relayClient = mRelayClients[wsi];
+            relayClient.delta = delta;
+            mRelayMutex.unlock();
+            break;
+        }
+
+        case LWS_CALLBACK_SERVER_WRITEABLE: {
+            // Send this client's oldest queued message, and ask to come back for the rest
+            mRelayMutex.lock();
+            RelayClient &relayClient = mRelayClients[wsi];
+            RelayBuffer *buffer = 0;
+            if (!relayClient.queue.empty()) {
+                buffer = relayClient.queue.front();
+                relayClient.queue.pop_front();
+                if (!relayClient.queue.empty()) {
+                    libwebsocket_callback_on_writable(context, wsi);
+                }
+            }
+
+            // Only this thread uses 'bases', so it can be used after unlocking
+            std::map<unsigned, RelayBase> *bases = relayClient.delta ? &relayClient.bases : 0;
+            mRelayMutex.unlock();
+
+            if (buffer) {
+                RelayBuffer *oldBase = 0;
+                bool useDelta = false;
+
+                if (bases) {
+                    // Delta against the last message this client sent with the same key
+                    RelayBase &base = (*bases)[buffer->key];
+                    if (base.buffer && base.buffer->length == buffer->length && base.deltas < RELAY_KEYFRAME_INTERVAL) {
+                        if (buffer->baseSeq != base.buffer->seq) {
+                            relayEncodeDelta(buffer, base.buffer);
+                        }
+                        useDelta = buffer->delta != 0;
+                    }
+                    base.deltas = useDelta ? base.deltas + 1 : 0;
+
+                    // Our reference moves to the base
+                    oldBase = base.buffer;
+                    base.buffer = buffer;
+                }
+
+                int r;
+                if (useDelta) {
+                    r = libwebsocket_write(wsi, buffer->delta + LWS_SEND_BUFFER_PRE_PADDING,
+                        buffer->deltaLength, LWS_WRITE_BINARY);
+                } else {
+                    r = libwebsocket_write(wsi, buffer->data + LWS_SEND_BUFFER_PRE_PADDING,
+                        buffer->length, LWS_WRITE_BINARY);
+                }
+
+                mRelayMutex.lock();
+                if (oldBase) {
+                    relayRelease(oldBase);
+                }
+                if (!bases) {
+                    relayRelease(buffer);
+                }
+                mRelayMutex.unlock();
+
+                if (r < 0) {
+                    return -1;
+                }
+            }
             break;
+        }
 
         default:
             break;
@@ -266,42 +389,18 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
     /*
      * Open Pixel Control packet dispatch, and protocol detection.
      *
-     * Store the new packet in our protocol buffer. This should be large enough to never overflow,
-     * since our OPC buffer is large enough for two packets and the OPC max packet size is much larger
-     * than the network receive buffer.
-     *
-     * If we have no buffered data yet, we can do this without copying.
+     * Complete packets are dispatched straight out of libwebsockets' receive buffer.
+     * Only packets that span more than one read are reassembled in our OPC buffer,
+     * which is borrowed from a shared pool and returned when the client goes away.
      */
 
-    OPCBuffer *opcb;
-    uint8_t *buffer;
-    unsigned bufferLength;    
+    TRACE_SCOPE("opcRead", len);
 
-    // Allocate the buffer we use for OPC reassembly and protocol-detect.
+    // Get a buffer for OPC reassembly and protocol-detect.
     if (client.opcBuffer == NULL) {
-        opcb = (OPCBuffer*) malloc(sizeof *client.opcBuffer);
-        if (opcb == NULL) {
-            lwsl_err("ERROR: Out of memory allocating OPC reassembly buffer.\n");
-            return -1;
-        }
-        opcb->bufferLength = 0;
-        client.opcBuffer = opcb;
-    } else {
-        opcb = client.opcBuffer;
-    }
-
-    if (len + opcb->bufferLength > sizeof opcb->buffer) {
-        return -1;
-    }
-
-    if (opcb->bufferLength) {
-        memcpy(opcb->bufferLength + opcb->buffer, in, len);
-        buffer = opcb->buffer;
-        bufferLength = opcb->bufferLength + len;
-    } else {
-        buffer = in;
-        bufferLength = len;
+        client.opcBuffer = OPCBuffer::alloc();
     }
+    OPCBuffer *opcb = client.opcBuffer;
 
     if (client.state == CLIENT_STATE_PROTOCOL_DETECT) {
         /*
@@ -312,12 +411,22 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
          * are the first four bytes of the first OPC packet.
          */
 
+        uint8_t *buffer = in;
+        unsigned bufferLength = len;
+
+        if (opcb->length()) {
+            // Finish a short read from earlier
+            if (!opcb->append(in, len)) {
+                return -1;
+            }
+            buffer = opcb->data();
+            bufferLength = opcb->length();
+        }
+
         if (bufferLength < 4) {
             // Not enough data for protocol detect yet. Save this data for later.
-
-            if (buffer != opcb->buffer) {
-                memcpy(opcb->buffer, buffer, bufferLength);
-                opcb->bufferLength = bufferLength;
+            if (buffer == in) {
+                opcb->append(in, len);
             }
 
             // Do not pass this data on to libwebsocket yet
@@ -326,51 +435,29 @@ int TcpNetServer::opcRead(libwebsocket_context *context, libwebsocket *wsi,
 
         if (buffer[0] == 'G' && buffer[1] == 'E' && buffer[2] == 'T' && buffer[3] == ' ') {
             // Detected HTTP. Convert this to an HTTP client, and let libwebsockets handle
-            // all data received so far. We can jettison the OPC buffer at this point.
+            // all data received so far. We can jettison the OPC buffer afterwards.
 
-            free(client.opcBuffer);
-            client.opcBuffer = 0;
             client.state = CLIENT_STATE_HTTP;
+            int r = libwebsocket_read(context, wsi, buffer, bufferLength);
 
-            if (libwebsocket_read(context, wsi, buffer, bufferLength) < 0) {
-                return -1;
-            }
-            return 1;
+            OPCBuffer::release(client.opcBuffer);
+            client.opcBuffer = 0;
+
+            return r < 0 ? -1 : 1;
         }
 
         // Not HTTP. Handle this as an OPC socket.
         client.state = CLIENT_STATE_OPEN_PIXEL_CONTROL;
         lwsl_notice("New Open Pixel Control connection\n");
-    }
-
-    // Process any and all complete packets from our buffer
-    while (1) {
-
-        if (bufferLength < OPC::HEADER_BYTES) {
-            // Still waiting for a header
-            break;
-        }
-
-        OPC::Message *msg = (OPC::Message*) buffer;
-        unsigned msgLength = OPC::HEADER_BYTES + msg->length();
 
-        if (bufferLength < msgLength) {
-            // Waiting for more data
-            break;
+        if (buffer != in) {
+            // Everything so far is already in our buffer
+            opcb->dispatch(mOpcCallback, mUserContext);
+            return 1;
         }
-
-        // Complete packet.
-        mOpcCallback(*msg, mUserContext);
-
-        buffer += msgLength;
-        bufferLength -= msgLength;
     }
 
-    // If we have any residual data, save it for later.
-    if (bufferLength && buffer != opcb->buffer) {
-        memmove(opcb->buffer, buffer, bufferLength);
-    }
-    opcb->bufferLength = bufferLength;
+    opcb->receive(in, len, mOpcCallback, mUserContext);
 
     // Don't pass data on to libwebsockets
     return 1;
@@ -402,9 +489,18 @@ int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
      *
      * Note: To keep the size of fcserver down, we compress our HTTP documents.
      *       We don't bother supporting decompressing them. Instead, we always send
-     *       them back with deflate content-encoding.
+     *       them back with gzip content-encoding.
+     *
+     *       Our libwebsockets doesn't keep the Accept-Encoding or If-None-Match request
+     *       headers, so we can't negotiate or answer with 304s. Instead each document
+     *       has an ETag and a Cache-Control lifetime, so repeat loads can come from the
+     *       browser's cache.
      */
 
+    if (httpPathEqual(path, "/metrics")) {
+        return httpMetrics(context, wsi, client);
+    }
+
     HTTPDocument *doc = httpDocumentList;
 
     // Look for this path in the document list. If it isn't found, we'll serve the 404 doc.
@@ -421,14 +517,19 @@ int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
         "Server: %s\r\n"
         "Content-Type: %s\r\n"
         "Content-Length: %u\r\n"
-        "Content-Encoding: deflate\r\n"
+        "Content-Encoding: gzip\r\n"
+        "ETag: %s\r\n"
+        "Cache-Control: max-age=%d\r\n"
+        "Vary: Accept-Encoding\r\n"
         "Connection: close\r\n"
         "\r\n",
         doc->path ? 200 : 404,
         doc->path ? "OK" : "Not Found",
         kFCServerVersion,
         doc->contentType,
-        doc->contentLength
+        doc->contentLength,
+        doc->etag,
+        doc->maxAge
     );
 
     if (libwebsocket_write(wsi, (unsigned char*) buffer, size, LWS_WRITE_HTTP) < 0) {
@@ -443,6 +544,48 @@ int TcpNetServer::httpBegin(libwebsocket_context *context, libwebsocket *wsi,
     return 0;
 }
 
+int TcpNetServer::httpMetrics(libwebsocket_context *context, libwebsocket *wsi, Client &client)
+{
+    /*
+     * Prometheus metrics, generated for each request. Unlike our documents this
+     * isn't compressed, since scrapers may not ask for gzip.
+     */
+
+    std::ostringstream body;
+    Metrics::writePrometheus(body);
+    std::string text = body.str();
+
+    char header[512];
+    int headerSize = snprintf(header, sizeof header,
+        "HTTP/1.1 200 OK\r\n"
+        "Server: %s\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %u\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        kFCServerVersion,
+        unsigned(text.size())
+    );
+
+    if (libwebsocket_write(wsi, (unsigned char*) header, headerSize, LWS_WRITE_HTTP) < 0) {
+        return -1;
+    }
+
+    free(client.httpBuffer);
+    client.httpBuffer = (char*) malloc(text.size() + 1);
+    if (!client.httpBuffer) {
+        return -1;
+    }
+    memcpy(client.httpBuffer, text.c_str(), text.size() + 1);
+
+    client.httpBody = client.httpBuffer;
+    client.httpLength = text.size();
+    libwebsocket_callback_on_writable(context, wsi);
+
+    return 0;
+}
+
 int TcpNetServer::httpWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client)
 {
     if (!client.httpBody) {
@@ -470,19 +613,55 @@ int TcpNetServer::httpWrite(libwebsocket_context *context, libwebsocket *wsi, Cl
 
 int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len)
 {
-    // If this frame is binary, it's an OPC message. Does it parse?
+    // If this frame is binary, it holds OPC messages. Do they parse?
     if (lws_frame_is_binary(wsi)) {
-        OPC::Message *msg = (OPC::Message*) in;
+        return wsReadOPC(in, len);
+    }
 
-        if (len < OPC::HEADER_BYTES) {
-            lwsl_notice("NOTICE: Received binary WebSockets packet, but it's too small for an OPC header.\n");
-            return 0;
-        }
+    // Text frames are JSON encoded. Pixel data gets a fast path, without a DOM.
+    rapidjson::Document message;
+    if (mPixelReader.parse((const char*) in, message)) {
+        mJsonCallback(wsi, message, &mPixelReader, mUserContext);
+        return 0;
+    }
 
-        if (msg->lenLow != 0 || msg->lenHigh != 0) {
-            lwsl_notice("NOTICE: Received OPC packet over WebSockets with nonzero reserved (length) fields.\n");
-        }
+    // Everything else, or anything the fast path declined. Does that parse?
+    message.ParseInsitu<0>((char*) in);
 
+    if (message.HasParseError()) {
+        lwsl_notice("NOTICE: Parse error in received JSON, character %d: %s\n",
+            int(message.GetErrorOffset()), message.GetParseError());
+        return 0;
+    }
+
+    if (!message.IsObject()) {
+        lwsl_notice("NOTICE: Received JSON is not an object {}\n");
+        return 0;
+    }
+
+    mJsonCallback(wsi, message, 0, mUserContext);
+    return 0;
+}
+
+int TcpNetServer::wsReadOPC(uint8_t *in, size_t len)
+{
+    /*
+     * Binary WebSockets frames go straight to the OPC callback, without touching JSON.
+     *
+     * If the OPC length field is zero, the frame holds one message, and its length comes
+     * from the WebSockets frame. Otherwise it's a standard OPC stream. The frame holds one
+     * or more complete messages back to back, so a client can send all of its channels
+     * in one frame.
+     */
+
+    OPC::Message *msg = (OPC::Message*) in;
+
+    if (len < OPC::HEADER_BYTES) {
+        lwsl_notice("NOTICE: Received binary WebSockets packet, but it's too small for an OPC header.\n");
+        return 0;
+    }
+
+    if (msg->lenLow == 0 && msg->lenHigh == 0) {
         if (len > sizeof *msg) {
             lwsl_notice("NOTICE: Received oversized OPC packet over WebSockets. Truncating.\n");
             len = sizeof *msg;
@@ -490,26 +669,26 @@ int TcpNetServer::wsRead(libwebsocket_context *context, libwebsocket *wsi, Clien
 
         msg->setLength(len - OPC::HEADER_BYTES);
         mOpcCallback(*msg, mUserContext);
-
         return 0;
     }
 
-    // Text frames are JSON encoded. Does that parse?
-    rapidjson::Document message;
-    message.ParseInsitu<0>((char*) in);
+    while (len >= OPC::HEADER_BYTES) {
+        msg = (OPC::Message*) in;
+        unsigned msgLength = OPC::HEADER_BYTES + msg->length();
 
-    if (message.HasParseError()) {
-        lwsl_notice("NOTICE: Parse error in received JSON, character %d: %s\n",
-            int(message.GetErrorOffset()), message.GetParseError());
-        return 0;
+        if (len < msgLength) {
+            break;
+        }
+
+        mOpcCallback(*msg, mUserContext);
+        in += msgLength;
+        len -= msgLength;
     }
 
-    if (!message.IsObject()) {
-        lwsl_notice("NOTICE: Received JSON is not an object {}\n");
-        return 0;
+    if (len) {
+        lwsl_notice("NOTICE: Received binary WebSockets packet with an incomplete OPC message. Ignoring it.\n");
     }
 
-    mJsonCallback(wsi, message, mUserContext);
     return 0;
 }
 
@@ -542,15 +721,37 @@ int TcpNetServer::jsonBufferSend(jsonBuffer_t &buffer, libwebsocket *wsi)
 
 void TcpNetServer::flushBroadcastList()
 {
-    // Send any pending broadcast packets. These are enqueued by other threads on a list
-    // protected by mBroadcastMutex.
+    /*
+     * Send any pending broadcast packets. These are enqueued by other threads on a list
+     * protected by mBroadcastMutex.
+     *
+     * Flushes are rate-limited, so that a burst of events (like a flapping USB hub)
+     * coalesces into one message per type. Broadcasts describe complete state, so a
+     * client whose socket is already backed up just skips one; it will catch up on the
+     * next broadcast rather than piling more data onto a slow connection.
+     */
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int64_t elapsedMillis = int64_t(now.tv_sec - mLastBroadcast.tv_sec) * 1000 +
+        (now.tv_usec - mLastBroadcast.tv_usec) / 1000;
+    if (elapsedMillis >= 0 && elapsedMillis < BROADCAST_INTERVAL_MILLIS) {
+        return;
+    }
 
     mBroadcastMutex.lock();
-    for (std::vector<jsonBuffer_t*>::iterator buf = mBroadcastList.begin(); buf != mBroadcastList.end(); ++buf) {
-        for (std::set<libwebsocket*>::iterator cli = mClients.begin(); cli != mClients.end(); ++cli) {
-            jsonBufferSend(**buf, *cli);
+    if (!mBroadcastList.empty()) {
+        mLastBroadcast = now;
+    }
+    for (std::vector<Broadcast>::iterator buf = mBroadcastList.begin(); buf != mBroadcastList.end(); ++buf) {
+        const std::set<libwebsocket*> &clients = buf->subscribersOnly ? mSubscriptions[buf->type] : mClients;
+        for (std::set<libwebsocket*>::const_iterator cli = clients.begin(); cli != clients.end(); ++cli) {
+            if (!lws_send_pipe_choked(*cli)) {
+                jsonBufferSend(*buf->buffer, *cli);
+            }
         }
-        delete *buf;
+        delete buf->buffer;
     }
     mBroadcastList.clear();
     mBroadcastMutex.unlock();
@@ -558,29 +759,263 @@ void TcpNetServer::flushBroadcastList()
 
 void TcpNetServer::jsonBroadcast(rapidjson::Document &message)
 {
+    queueBroadcast(message, false);
+}
+
+void TcpNetServer::jsonPublish(rapidjson::Document &message)
+{
+    queueBroadcast(message, true);
+}
+
+void TcpNetServer::queueBroadcast(rapidjson::Document &message, bool subscribersOnly)
+{
+    const rapidjson::Value &vtype = message["type"];
+    std::string type = vtype.IsString() ? vtype.GetString() : "";
+
     jsonBuffer_t *buffer = new jsonBuffer_t();
     jsonBufferPrepare(*buffer, message);
 
     mBroadcastMutex.lock();
-    mBroadcastList.push_back(buffer);
+
+    // Replace an older message of the same type, if one is still waiting
+    std::vector<Broadcast>::iterator i;
+    for (i = mBroadcastList.begin(); i != mBroadcastList.end(); ++i) {
+        if (i->type == type) {
+            delete i->buffer;
+            i->buffer = buffer;
+            i->subscribersOnly = subscribersOnly;
+            break;
+        }
+    }
+
+    if (i == mBroadcastList.end()) {
+        Broadcast broadcast;
+        broadcast.type = type;
+        broadcast.buffer = buffer;
+        broadcast.subscribersOnly = subscribersOnly;
+        mBroadcastList.push_back(broadcast);
+    }
+
+    mBroadcastMutex.unlock();
+}
+
+void TcpNetServer::jsonSubscribe(libwebsocket *wsi, const char *type, bool subscribe)
+{
+    mBroadcastMutex.lock();
+    if (subscribe) {
+        mSubscriptions[type].insert(wsi);
+    } else {
+        mSubscriptions[type].erase(wsi);
+    }
+    mBroadcastMutex.unlock();
+}
+
+bool TcpNetServer::hasSubscribers(const char *type)
+{
+    mBroadcastMutex.lock();
+    std::map<std::string, std::set<libwebsocket*> >::iterator i = mSubscriptions.find(type);
+    bool result = i != mSubscriptions.end() && !i->second.empty();
+    mBroadcastMutex.unlock();
+    return result;
+}
+
+void TcpNetServer::unsubscribeAll(libwebsocket *wsi)
+{
+    mBroadcastMutex.lock();
+    std::map<std::string, std::set<libwebsocket*> >::iterator i;
+    for (i = mSubscriptions.begin(); i != mSubscriptions.end(); ++i) {
+        i->second.erase(wsi);
+    }
     mBroadcastMutex.unlock();
 }
 
 void TcpNetServer::relayMessage(OPC::Message &msg)
 {
-    if (mRelayClients.size()) {
-        int headerLen = 4;
-        int bufferLen = headerLen + msg.length();
-        unsigned char buffer[bufferLen];
-        buffer[0] = (unsigned char)msg.channel;
-        buffer[1] = (unsigned char)msg.command;
-        buffer[2] = (unsigned char)msg.lenHigh;
-        buffer[3] = (unsigned char)msg.lenLow;
-        for (int i=0; i < msg.length(); i++) {
-            buffer[headerLen+i] = (unsigned char)msg.data[i];
+    /*
+     * Serialize the message once, with the padding libwebsockets needs, and queue it
+     * for every relay client. The relay thread sends each client's queue in order, and
+     * does any delta encoding. If a client is too slow to keep up, its stale messages
+     * are dropped instead of blocking us.
+     */
+
+    mRelayMutex.lock();
+    bool wanted = !mRelayClients.empty();
+    mRelayMutex.unlock();
+
+    if (!wanted) {
+        return;
+    }
+
+    unsigned length = OPC::HEADER_BYTES + msg.length();
+    RelayBuffer *buffer = (RelayBuffer*) malloc(offsetof(RelayBuffer, data) +
+        LWS_SEND_BUFFER_PRE_PADDING + length + LWS_SEND_BUFFER_POST_PADDING);
+    if (!buffer) {
+        return;
+    }
+
+    buffer->refs = 1;
+    buffer->length = length;
+    buffer->key = (unsigned(msg.channel) << 8) | msg.command;
+    buffer->baseSeq = 0;
+    buffer->delta = 0;
+    buffer->deltaLength = 0;
+    memcpy(buffer->data + LWS_SEND_BUFFER_PRE_PADDING, &msg, length);
+
+    mRelayMutex.lock();
+    buffer->seq = ++mRelaySeq;
+    for (std::map<libwebsocket*, RelayClient>::iterator i = mRelayClients.begin(), e = mRelayClients.end(); i != e; ++i) {
+        relayEnqueue(i->second, buffer);
+    }
+    relayRelease(buffer);
+    mRelayMutex.unlock();
+}
+
+void TcpNetServer::relayEncodeDelta(RelayBuffer *buffer, const RelayBuffer *base)
+{
+    /*
+     * Try a Relay Delta SysEx for 'buffer', against an earlier message with the same key
+     * and length. Relay thread only. It replaces any delta against a different base, and
+     * it's kept only if it comes out smaller than the message itself:
+     *
+     *   Channel 0, command 0xFF, length, system and SysEx ID
+     *   1 byte    OPC channel of the message
+     *   1 byte    OPC command of the message
+     *   Runs of changed bytes, until the end:
+     *     2 bytes   Unchanged bytes to skip, big-endian
+     *     2 bytes   Changed byte count, big-endian
+     *     ...       New bytes
+     */
+
+    const uint8_t *prev = base->data + LWS_SEND_BUFFER_PRE_PADDING + OPC::HEADER_BYTES;
+    const uint8_t *next = buffer->data + LWS_SEND_BUFFER_PRE_PADDING + OPC::HEADER_BYTES;
+    unsigned size = buffer->length - OPC::HEADER_BYTES;
+
+    free(buffer->delta);
+    buffer->delta = 0;
+    buffer->deltaLength = 0;
+    buffer->baseSeq = base->seq;
+
+    uint8_t *delta = (uint8_t*) malloc(LWS_SEND_BUFFER_PRE_PADDING + buffer->length + LWS_SEND_BUFFER_POST_PADDING);
+    if (!delta) {
+        return;
+    }
+
+    uint8_t *out = delta + LWS_SEND_BUFFER_PRE_PADDING;
+    const unsigned header = OPC::HEADER_BYTES + 6;
+    unsigned pos = 0, length = header;
+
+    while (pos < size) {
+        unsigned first = pos;
+        while (first < size && prev[first] == next[first]) {
+            first++;
+        }
+        if (first == size) {
+            break;
+        }
+
+        // Extend the run across short gaps, which would cost more as a new run
+        unsigned end = first + 1;
+        while (end < size) {
+            if (prev[end] != next[end]) {
+                end++;
+                continue;
+            }
+            unsigned gap = 1;
+            while (gap < RELAY_DELTA_MIN_GAP && end + gap < size && prev[end + gap] == next[end + gap]) {
+                gap++;
+            }
+            if (gap == RELAY_DELTA_MIN_GAP || end + gap == size) {
+                break;
+            }
+            end += gap;
+        }
+
+        unsigned skip = first - pos, count = end - first;
+        if (length + 4 + count >= buffer->length) {
+            free(delta);
+            return;
+        }
+
+        out[length++] = skip >> 8;
+        out[length++] = skip;
+        out[length++] = count >> 8;
+        out[length++] = count;
+        memcpy(out + length, next + first, count);
+        length += count;
+        pos = end;
+    }
+
+    if (length >= buffer->length) {
+        // Too small a message to be worth it
+        free(delta);
+        return;
+    }
+
+    const uint8_t *msg = buffer->data + LWS_SEND_BUFFER_PRE_PADDING;
+    unsigned sysExLength = length - OPC::HEADER_BYTES;
+    out[0] = 0;
+    out[1] = OPC::SystemExclusive;
+    out[2] = sysExLength >> 8;
+    out[3] = sysExLength;
+    out[4] = uint8_t(OPC::FCRelayDelta >> 24);
+    out[5] = uint8_t(OPC::FCRelayDelta >> 16);
+    out[6] = uint8_t(OPC::FCRelayDelta >> 8);
+    out[7] = uint8_t(OPC::FCRelayDelta);
+    out[8] = msg[0];
+    out[9] = msg[1];
+
+    buffer->delta = delta;
+    buffer->deltaLength = length;
+}
+
+void TcpNetServer::flushRelay(libwebsocket_context *context)
+{
+    // Ask to write to every relay client with queued messages. Only the relay thread may do this.
+
+    mRelayMutex.lock();
+
+    for (std::map<libwebsocket*, RelayClient>::iterator i = mRelayClients.begin(), e = mRelayClients.end(); i != e; ++i) {
+        if (!i->second.queue.empty()) {
+            libwebsocket_callback_on_writable(context, i->first);
         }
-        for (std::set<libwebsocket*>::iterator cli = mRelayClients.begin(); cli != mRelayClients.end(); ++cli) {
-            libwebsocket_write(*cli, buffer, bufferLen, LWS_WRITE_BINARY);
+    }
+
+    mRelayMutex.unlock();
+}
+
+void TcpNetServer::relayEnqueue(RelayClient &client, RelayBuffer *buffer)
+{
+    /*
+     * Add a reference to 'buffer' to the end of this client's queue. Must be called with
+     * mRelayMutex held. A client that has drained its queue gets every message. One that
+     * hasn't only needs the newest message for each key, so an older one still waiting
+     * with the same key is dropped. A client that falls too far behind loses its oldest.
+     */
+
+    std::deque<RelayBuffer*> &queue = client.queue;
+
+    for (std::deque<RelayBuffer*>::iterator i = queue.begin(), e = queue.end(); i != e; ++i) {
+        if ((*i)->key == buffer->key) {
+            relayRelease(*i);
+            queue.erase(i);
+            break;
         }
     }
+
+    if (queue.size() >= RELAY_QUEUE_DEPTH) {
+        relayRelease(queue.front());
+        queue.pop_front();
+    }
+
+    buffer->refs++;
+    queue.push_back(buffer);
+}
+
+void TcpNetServer::relayRelease(RelayBuffer *buffer)
+{
+    // Drop one reference. Must be called with mRelayMutex held.
+    if (--buffer->refs == 0) {
+        free(buffer->delta);
+        free(buffer);
+    }
 }
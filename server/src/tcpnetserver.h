@@ -24,17 +24,26 @@
 #pragma once
 #include <stdint.h>
 #include <vector>
+#include <deque>
 #include <set>
+#include <map>
+#include <string>
+#include <sys/time.h>
 #include "rapidjson/document.h"
 #include "rapidjson/stringbuffer.h"
 #include "tinythread.h"
 #include "libwebsockets.h"
 #include "opc.h"
+#include "opcbuffer.h"
+#include "jsonpixelreader.h"
 
 
 class TcpNetServer {
 public:
-    typedef void (*jsonCallback_t)(libwebsocket *wsi, rapidjson::Document &message, void *context);
+    // If 'pixels' isn't NULL, this is a device_pixels message and its pixel array was
+    // decoded while parsing. The array isn't in 'message'; use pixels->pixels() instead.
+    typedef void (*jsonCallback_t)(libwebsocket *wsi, rapidjson::Document &message,
+        const JsonPixelReader *pixels, void *context);
 
     TcpNetServer(OPC::callback_t opcCallback, jsonCallback_t jsonCallback,
         void *context, bool verbose = false);
@@ -48,12 +57,29 @@ public:
     // Reply callback, for use only on the TcpNetServer thread. Call this inside jsonCallback.
     int jsonReply(libwebsocket *wsi, rapidjson::Document &message);
 
-    // Broadcast JSON to all clients, from any thread.
+    // Broadcast JSON to all clients, from any thread. Messages of the same type
+    // sent in quick succession are coalesced, and only the newest is delivered.
     void jsonBroadcast(rapidjson::Document &message);
 
-    // Sends an OPC message to clients connected to the relay socket
+    /*
+     * Some messages only go to clients that asked for them. Subscribe from jsonCallback,
+     * on the TcpNetServer thread. Subscriptions end when the client disconnects.
+     * jsonPublish() works like jsonBroadcast(), but only for subscribers to that type.
+     */
+    void jsonSubscribe(libwebsocket *wsi, const char *type, bool subscribe);
+    bool hasSubscribers(const char *type);
+    void jsonPublish(rapidjson::Document &message);
+
+    /*
+     * Sends an OPC message to clients connected to the relay socket, from any thread.
+     * Clients that ask for the "fcserver-relay-delta" protocol may get a Relay Delta
+     * SysEx instead, with only the bytes that changed since that channel's last message.
+     */
     void relayMessage(OPC::Message &msg);
 
+    // The event loop thread, once started
+    tthread::thread *getThread() { return mThread; }
+
 private:
     enum ClientState {
         CLIENT_STATE_PROTOCOL_DETECT = 0,
@@ -61,21 +87,57 @@ private:
         CLIENT_STATE_HTTP
     };
 
-    // In-memory database of static files to serve over HTTP
+    // In-memory database of static files to serve over HTTP, already gzip-compressed
     struct HTTPDocument {
         const char *path;
         const char *body;
         const char *contentType;
         int contentLength;
+        const char *etag;
+        int maxAge;
+    };
+
+    /*
+     * One serialized OPC message, shared by every relay client that still has it queued.
+     * Messages with the same channel and command share a 'key'. A message may also carry
+     * the last delta encoded for it, so delta clients with the same base can share it.
+     * Only the relay thread touches the delta.
+     */
+    struct RelayBuffer {
+        unsigned refs;
+        unsigned length;
+        unsigned key;
+        uint32_t seq;           // Position in the relay stream, starting at 1
+        uint32_t baseSeq;       // Message the delta was last tried against, zero for none
+        uint8_t *delta;         // Padding, delta message, padding. Zero if it wasn't smaller.
+        unsigned deltaLength;
+        uint8_t data[1];        // Padding, message, padding
+    };
+
+    // Last message a delta client sent for a key, and how many deltas it has sent since a whole one
+    struct RelayBase {
+        RelayBuffer *buffer;
+        unsigned deltas;
     };
 
-    // Buffer used for protocol-detection and Open Pixel Control. Big enough for two OPC packets.
-    // This buffer is jettisonned 
-    struct OPCBuffer {
-        unsigned bufferLength;
-        uint8_t buffer[2 * sizeof(OPC::Message)];
+    struct RelayClient {
+        std::deque<RelayBuffer*> queue;         // Messages not yet sent, oldest first
+        bool delta;
+        std::map<unsigned, RelayBase> bases;    // Only used by the relay thread. Buffers hold a reference.
     };
 
+    // How often the relay thread looks for new messages
+    static const unsigned RELAY_SERVICE_MILLIS = 5;
+
+    // Most messages a relay client may have queued. Past this, its oldest are dropped.
+    static const unsigned RELAY_QUEUE_DEPTH = 64;
+
+    // Delta clients get a whole message at least this often on each key
+    static const unsigned RELAY_KEYFRAME_INTERVAL = 100;
+
+    // Unchanged bytes shorter than this are sent along with the changed bytes around them
+    static const unsigned RELAY_DELTA_MIN_GAP = 4;
+
     struct Client {
         ClientState state;
 
@@ -83,6 +145,9 @@ private:
         const char *httpBody;
         int httpLength;
 
+        // Generated responses, owned by the client and freed on close
+        char *httpBuffer;
+
         // OPC and protocol-detection receive buffer.
         OPCBuffer *opcBuffer;
     };
@@ -96,22 +161,50 @@ private:
 
     void *mRelayContext;
     tthread::thread *mRelayThread;
-    std::set<libwebsocket*> mRelayClients;
+
+    // Relay clients, and the messages each one is waiting to send. Protected by mRelayMutex.
+    std::map<libwebsocket*, RelayClient> mRelayClients;
+    uint32_t mRelaySeq;
+    tthread::mutex mRelayMutex;
 
     typedef rapidjson::GenericStringBuffer<rapidjson::UTF8<> > jsonBuffer_t;
-    std::vector<jsonBuffer_t*> mBroadcastList;
+
+    // Pending broadcasts, at most one per message type
+    struct Broadcast {
+        std::string type;
+        jsonBuffer_t *buffer;
+        bool subscribersOnly;
+    };
+
+    // Minimum time between broadcast flushes, to let bursts of events coalesce
+    static const unsigned BROADCAST_INTERVAL_MILLIS = 100;
+
+    std::vector<Broadcast> mBroadcastList;
     tthread::mutex mBroadcastMutex;
 
+    // Clients subscribed to each message type. Also protected by mBroadcastMutex.
+    std::map<std::string, std::set<libwebsocket*> > mSubscriptions;
+    struct timeval mLastBroadcast;
+
+    // Streaming parser for device_pixels messages, used only on the server thread
+    JsonPixelReader mPixelReader;
+
     static HTTPDocument httpDocumentList[];
 
     // libwebsockets server
     static void threadFunc(void *arg);
+    static void relayThreadFunc(void *arg);
     static int lwsCallback(libwebsocket_context *context, libwebsocket *wsi,
         enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len);
     static int lwsRelayCallback(libwebsocket_context *context, libwebsocket *wsi,
         enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len);
+    static int lwsRelayDeltaCallback(libwebsocket_context *context, libwebsocket *wsi,
+        enum libwebsocket_callback_reasons reason, void *user, void *in, size_t len);
+    int relayEvent(libwebsocket_context *context, libwebsocket *wsi,
+        enum libwebsocket_callback_reasons reason, Client *client, bool delta);
 
     // HTTP Server
+    int httpMetrics(libwebsocket_context *context, libwebsocket *wsi, Client &client);
     int httpBegin(libwebsocket_context *context, libwebsocket *wsi, Client &client, const char *path);
     int httpWrite(libwebsocket_context *context, libwebsocket *wsi, Client &client);
     static bool httpPathEqual(const char *a, const char *b);
@@ -121,7 +214,16 @@ private:
 
     // WebSockets server
     int wsRead(libwebsocket_context *context, libwebsocket *wsi, Client &client, uint8_t *in, size_t len);
+    int wsReadOPC(uint8_t *in, size_t len);
     void jsonBufferPrepare(jsonBuffer_t &buffer, rapidjson::Value &value);
     int jsonBufferSend(jsonBuffer_t &buffer, libwebsocket *wsi);
     void flushBroadcastList();
+    void queueBroadcast(rapidjson::Document &message, bool subscribersOnly);
+    void unsubscribeAll(libwebsocket *wsi);
+
+    // Relay server
+    void flushRelay(libwebsocket_context *context);
+    void relayRelease(RelayBuffer *buffer);
+    void relayEnqueue(RelayClient &client, RelayBuffer *buffer);
+    void relayEncodeDelta(RelayBuffer *buffer, const RelayBuffer *base);
 };
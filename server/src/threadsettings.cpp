@@ -0,0 +1,249 @@
+/*
+ * Thread scheduling and memory locking options for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "threadsettings.h"
+#include <iostream>
+#include <string.h>
+#include <errno.h>
+
+#ifndef OS_WINDOWS
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+
+ThreadSettings::ThreadSettings()
+    : mLockMemory(false), mMemoryLocked(false)
+{
+    for (unsigned i = 0; i < NUM_GROUPS; ++i) {
+        mGroups[i].priority = 0;
+    }
+}
+
+const char *ThreadSettings::groupName(Group group)
+{
+    static const char *names[NUM_GROUPS] = { "usb", "listen", "opcListen", "udpListen", "shmListen" };
+    return names[group];
+}
+
+void ThreadSettings::parse(const Value &threads, const Value &lockMemory, std::ostream &error)
+{
+    if (lockMemory.IsBool()) {
+        mLockMemory = lockMemory.IsTrue();
+    } else if (!lockMemory.IsNull()) {
+        error << "The optional 'lockMemory' configuration key must be true or false.\n";
+    }
+
+    if (threads.IsNull()) {
+        return;
+    }
+    if (!threads.IsObject()) {
+        error << "The optional 'threads' configuration key must be an object.\n";
+        return;
+    }
+
+    for (Value::ConstMemberIterator i = threads.MemberBegin(), e = threads.MemberEnd(); i != e; ++i) {
+        unsigned index = 0;
+        while (index < NUM_GROUPS && strcmp(i->name.GetString(), groupName(Group(index)))) {
+            index++;
+        }
+        if (index == NUM_GROUPS) {
+            error << "Unknown thread group '" << i->name.GetString() << "' in 'threads'. Groups are "
+                "usb, listen, opcListen, udpListen and shmListen.\n";
+            continue;
+        }
+
+        const Value &group = i->value;
+        if (!group.IsObject()) {
+            error << "Each thread group in 'threads' must be an object.\n";
+            continue;
+        }
+
+        const Value &cpus = group["cpus"];
+        const Value &priority = group["priority"];
+        Settings &settings = mGroups[index];
+
+        if (cpus.IsArray()) {
+            for (unsigned j = 0; j < cpus.Size(); ++j) {
+                if (cpus[j].IsUint()) {
+                    settings.cpus.push_back(cpus[j].GetUint());
+                } else {
+                    error << "A thread group's 'cpus' must be a list of CPU numbers.\n";
+                    break;
+                }
+            }
+        } else if (!cpus.IsNull()) {
+            error << "A thread group's 'cpus' must be a list of CPU numbers.\n";
+        }
+
+        if (priority.IsUint() && priority.GetUint() >= 1 && priority.GetUint() <= unsigned(MAX_PRIORITY)) {
+            settings.priority = priority.GetUint();
+        } else if (!priority.IsNull()) {
+            error << "A thread group's 'priority' must be a real-time priority from 1 to " << MAX_PRIORITY << ".\n";
+        }
+    }
+}
+
+void ThreadSettings::apply(Group group, tthread::thread *thread)
+{
+    if (thread) {
+        applyToHandle(group, thread->native_handle());
+    }
+}
+
+#ifdef OS_WINDOWS
+
+void ThreadSettings::applyToCurrentThread(Group group)
+{
+    applyToHandle(group, GetCurrentThread());
+}
+
+void ThreadSettings::applyToHandle(Group group, tthread::thread::native_handle_type handle)
+{
+    const Settings &settings = mGroups[group];
+    if (!settings.cpus.empty() || settings.priority) {
+        std::clog << "Thread settings aren't supported on this platform.\n";
+    }
+}
+
+void ThreadSettings::lockMemory()
+{
+    if (mLockMemory) {
+        std::clog << "Memory locking isn't supported on this platform.\n";
+    }
+}
+
+#else
+
+void ThreadSettings::applyToCurrentThread(Group group)
+{
+    applyToHandle(group, pthread_self());
+}
+
+void ThreadSettings::applyToHandle(Group group, tthread::thread::native_handle_type handle)
+{
+    Settings &settings = mGroups[group];
+    if (settings.cpus.empty() && !settings.priority) {
+        return;
+    }
+
+    if (!settings.cpus.empty()) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (unsigned i = 0; i < settings.cpus.size(); ++i) {
+            if (settings.cpus[i] < CPU_SETSIZE) {
+                CPU_SET(settings.cpus[i], &set);
+            }
+        }
+        int err = pthread_setaffinity_np(handle, sizeof set, &set);
+        if (err) {
+            std::clog << "Can't pin a '" << groupName(group) << "' thread to its CPUs: " << strerror(err) << "\n";
+        }
+#else
+        std::clog << "CPU affinity isn't supported on this platform.\n";
+#endif
+    }
+
+    if (settings.priority) {
+        struct sched_param param;
+        memset(&param, 0, sizeof param);
+        param.sched_priority = settings.priority;
+        int err = pthread_setschedparam(handle, SCHED_FIFO, &param);
+        if (err) {
+            std::clog << "Can't give a '" << groupName(group) << "' thread real-time priority "
+                << settings.priority << ": " << strerror(err) << "\n";
+        }
+    }
+
+    // Ask the OS what we actually got
+
+    Effective effective;
+    int policy;
+    struct sched_param param;
+    if (pthread_getschedparam(handle, &policy, &param) == 0) {
+        effective.fifo = policy == SCHED_FIFO;
+        effective.priority = param.sched_priority;
+    } else {
+        effective.fifo = false;
+        effective.priority = 0;
+    }
+
+#ifdef __linux__
+    cpu_set_t set;
+    if (pthread_getaffinity_np(handle, sizeof set, &set) == 0) {
+        for (unsigned i = 0; i < CPU_SETSIZE; ++i) {
+            if (CPU_ISSET(i, &set)) {
+                effective.cpus.push_back(i);
+            }
+        }
+    }
+#endif
+
+    settings.threads.push_back(effective);
+}
+
+void ThreadSettings::lockMemory()
+{
+    if (!mLockMemory) {
+        return;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+        mMemoryLocked = true;
+    } else {
+        std::clog << "Can't lock fcserver's memory: " << strerror(errno) << "\n";
+    }
+}
+
+#endif
+
+void ThreadSettings::describe(Value &object, Allocator &alloc)
+{
+    object.AddMember("memory_locked", mMemoryLocked, alloc);
+    object.AddMember("threads", rapidjson::kObjectType, alloc);
+    Value &threads = object["threads"];
+
+    for (unsigned i = 0; i < NUM_GROUPS; ++i) {
+        const std::vector<Effective> &effective = mGroups[i].threads;
+        if (effective.empty()) {
+            continue;
+        }
+
+        Value list(rapidjson::kArrayType);
+        for (unsigned j = 0; j < effective.size(); ++j) {
+            Value cpus(rapidjson::kArrayType);
+            for (unsigned k = 0; k < effective[j].cpus.size(); ++k) {
+                cpus.PushBack(effective[j].cpus[k], alloc);
+            }
+
+            Value thread(rapidjson::kObjectType);
+            thread.AddMember("cpus", cpus, alloc);
+            thread.AddMember("policy", effective[j].fifo ? "fifo" : "other", alloc);
+            thread.AddMember("priority", effective[j].priority, alloc);
+            list.PushBack(thread, alloc);
+        }
+        threads.AddMember(groupName(Group(i)), list, alloc);
+    }
+}
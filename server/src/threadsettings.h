@@ -0,0 +1,96 @@
+/*
+ * Thread scheduling and memory locking options for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "tinythread.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+/*
+ * Optional real-time settings for fcserver's threads, for machines shared with other
+ * CPU-hungry work. The "threads" configuration object has an entry for each group of
+ * threads: "usb" (the USB main loop and any bus threads), "listen" (the WebSocket and
+ * HTTP server), and the "opcListen", "udpListen" and "shmListen" receivers. Each entry
+ * may pin its threads to a list of "cpus", and ask for SCHED_FIFO at a "priority".
+ * "lockMemory" keeps the whole process in RAM with mlockall().
+ *
+ * What each thread actually got is read back from the OS, since real-time scheduling
+ * usually needs privileges we may not have. Problems are logged, not fatal.
+ */
+
+class ThreadSettings
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+    enum Group {
+        USB,
+        LISTEN,
+        OPC_LISTEN,
+        UDP_LISTEN,
+        SHM_LISTEN,
+        NUM_GROUPS
+    };
+
+    static const int MAX_PRIORITY = 99;
+
+    ThreadSettings();
+
+    // Load the "threads" object and "lockMemory" flag, describing problems on 'error'
+    void parse(const Value &threads, const Value &lockMemory, std::ostream &error);
+
+    // Apply a group's settings to a running thread, or to the calling thread
+    void apply(Group group, tthread::thread *thread);
+    void applyToCurrentThread(Group group);
+
+    // Lock current and future memory, if configured
+    void lockMemory();
+
+    // Add what's in effect to a JSON object: a "threads" object and "memory_locked"
+    void describe(Value &object, Allocator &alloc);
+
+private:
+    // What one thread ended up with
+    struct Effective {
+        std::vector<unsigned> cpus;
+        bool fifo;
+        int priority;
+    };
+
+    struct Settings {
+        std::vector<unsigned> cpus;
+        int priority;       // 0 for the normal scheduler
+        std::vector<Effective> threads;
+    };
+
+    Settings mGroups[NUM_GROUPS];
+    bool mLockMemory;
+    bool mMemoryLocked;
+
+    static const char *groupName(Group group);
+    void applyToHandle(Group group, tthread::thread::native_handle_type handle);
+};
@@ -0,0 +1,120 @@
+/*
+ * Hot path trace points, with a ring buffer event log
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "trace.h"
+#include <libusb.h> // Also brings in gettimeofday() in a portable way
+
+Trace::Event Trace::sEvents[NUM_EVENTS];
+std::atomic<uint64_t> Trace::sNext(0);
+std::atomic<uint32_t> Trace::sNextThread(1);
+
+#ifdef _MSC_VER
+static __declspec(thread) uint32_t tThreadId;
+#else
+static __thread uint32_t tThreadId;
+#endif
+
+
+bool Trace::enabled()
+{
+#ifdef FCSERVER_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint64_t Trace::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+uint32_t Trace::threadId()
+{
+    // Small, stable numbers read better in the trace viewer than OS thread IDs
+    if (!tThreadId) {
+        tThreadId = sNextThread.fetch_add(1);
+    }
+    return tThreadId;
+}
+
+void Trace::record(const char *name, uint64_t begin, uint32_t arg)
+{
+    uint64_t index = sNext.fetch_add(1, std::memory_order_relaxed);
+    Event &e = sEvents[index & (NUM_EVENTS - 1)];
+
+    // Mark the slot as being written, then publish it with its sequence number
+    e.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    e.name = name;
+    e.begin = begin;
+    e.end = now();
+    e.thread = threadId();
+    e.arg = arg;
+
+    e.seq.store(index + 1, std::memory_order_release);
+}
+
+void Trace::dump(Value &list, Allocator &alloc)
+{
+    uint64_t next = sNext.load(std::memory_order_acquire);
+    uint64_t first = next > NUM_EVENTS ? next - NUM_EVENTS : 0;
+
+    for (uint64_t index = first; index < next; ++index) {
+        Event &e = sEvents[index & (NUM_EVENTS - 1)];
+
+        if (e.seq.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        const char *name = e.name;
+        uint64_t begin = e.begin;
+        uint64_t end = e.end;
+        uint32_t thread = e.thread;
+        uint32_t arg = e.arg;
+
+        // Skip anything overwritten while we were copying it
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (e.seq.load(std::memory_order_relaxed) != index + 1) {
+            continue;
+        }
+
+        // A zero begin time marks an instant event
+        Value event(rapidjson::kObjectType);
+        event.AddMember("name", name, alloc);
+        event.AddMember("ph", begin ? "X" : "i", alloc);
+        event.AddMember("ts", begin ? begin : end, alloc);
+        if (begin) {
+            event.AddMember("dur", end - begin, alloc);
+        } else {
+            event.AddMember("s", "t", alloc);
+        }
+        event.AddMember("pid", 1, alloc);
+        event.AddMember("tid", thread, alloc);
+        event.AddMember("args", rapidjson::kObjectType, alloc);
+        event["args"].AddMember("value", arg, alloc);
+        list.PushBack(event, alloc);
+    }
+}
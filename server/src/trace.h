@@ -0,0 +1,97 @@
+/*
+ * Hot path trace points, with a ring buffer event log
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include "rapidjson/document.h"
+
+
+/*
+ * Timestamped events from the hot path, kept in a fixed-size ring buffer.
+ *
+ * Trace points only exist when fcserver is built with FCSERVER_TRACE. Otherwise the
+ * macros below compile to nothing. Any thread may record events at once: each one
+ * claims a slot with a single atomic increment, and the slot's sequence number is
+ * written last so a reader can tell complete events from ones still being written.
+ * When the buffer wraps, the oldest events are overwritten.
+ *
+ * The log is dumped in the Chrome trace event format, for chrome://tracing or Perfetto.
+ */
+
+class Trace
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+    static const unsigned NUM_EVENTS = 1 << 16;
+
+    // Was tracing compiled in?
+    static bool enabled();
+
+    static uint64_t now();
+
+    // An event lasting from 'begin' until now, or an instant event if 'begin' is 0
+    static void record(const char *name, uint64_t begin, uint32_t arg = 0);
+
+    // Store the buffered events in 'list' as Chrome trace events, oldest first
+    static void dump(Value &list, Allocator &alloc);
+
+    // Records an event covering a block's lifetime
+    class Scope {
+    public:
+        Scope(const char *name, uint32_t arg = 0) : mName(name), mArg(arg), mBegin(now()) {}
+        ~Scope() { record(mName, mBegin, mArg); }
+    private:
+        const char *mName;
+        uint32_t mArg;
+        uint64_t mBegin;
+    };
+
+private:
+    struct Event {
+        std::atomic<uint64_t> seq;
+        const char *name;
+        uint64_t begin;
+        uint64_t end;
+        uint32_t thread;
+        uint32_t arg;
+    };
+
+    static Event sEvents[NUM_EVENTS];
+    static std::atomic<uint64_t> sNext;
+    static std::atomic<uint32_t> sNextThread;
+
+    static uint32_t threadId();
+};
+
+#ifdef FCSERVER_TRACE
+    #define TRACE_CONCAT2(a, b) a##b
+    #define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+    #define TRACE_SCOPE(name, ...) Trace::Scope TRACE_CONCAT(_trace_, __LINE__)(name, ##__VA_ARGS__)
+    #define TRACE_INSTANT(name, ...) Trace::record(name, 0, ##__VA_ARGS__)
+#else
+    #define TRACE_SCOPE(name, ...)
+    #define TRACE_INSTANT(name, ...)
+#endif
@@ -0,0 +1,183 @@
+/*
+ * Open Pixel Control over UDP for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "udpnetserver.h"
+#include <iostream>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef OS_WINDOWS
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+
+UdpNetServer::UdpNetServer(OPC::callback_t opcCallback, void *context, bool verbose)
+    : mOpcCallback(opcCallback), mUserContext(context), mVerbose(verbose),
+      mSocket(-1), mThread(0)
+{}
+
+#ifdef OS_WINDOWS
+
+bool UdpNetServer::start(const char *host, int port)
+{
+    std::clog << "Open Pixel Control over UDP isn't supported on this platform.\n";
+    return false;
+}
+
+void UdpNetServer::threadFunc(void *arg) {}
+void UdpNetServer::receiveLoop() {}
+bool UdpNetServer::isLate(const void *addr, unsigned addrLen, uint8_t channel, uint32_t sequence) { return false; }
+
+#else
+
+bool UdpNetServer::start(const char *host, int port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    char portStr[16];
+    snprintf(portStr, sizeof portStr, "%d", port);
+
+    struct addrinfo *addrs;
+    int r = getaddrinfo(host, portStr, &hints, &addrs);
+    if (r) {
+        std::clog << "Can't resolve UDP listen address: " << gai_strerror(r) << "\n";
+        return false;
+    }
+
+    for (struct addrinfo *a = addrs; a; a = a->ai_next) {
+        int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (bind(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            mSocket = fd;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(addrs);
+
+    if (mSocket < 0) {
+        std::clog << "Can't listen for UDP on " << (host ? host : "*") << ":" << port
+            << ": " << strerror(errno) << "\n";
+        return false;
+    }
+
+    // Ask for a larger receive buffer, so bursts of full-size frames aren't dropped
+    int bufferSize = 1024 * 1024;
+    setsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof bufferSize);
+
+    if (mVerbose) {
+        std::clog << "UDP listening on " << (host ? host : "*") << ":" << port << "\n";
+    }
+
+    mThread = new tthread::thread(threadFunc, this);
+    return true;
+}
+
+void UdpNetServer::threadFunc(void *arg)
+{
+    UdpNetServer *self = (UdpNetServer*) arg;
+    self->receiveLoop();
+}
+
+void UdpNetServer::receiveLoop()
+{
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof addr;
+
+        ssize_t r = recvfrom(mSocket, mBuffer, sizeof mBuffer, 0, (struct sockaddr*) &addr, &addrLen);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::clog << "Error receiving UDP: " << strerror(errno) << "\n";
+            return;
+        }
+
+        unsigned len = r;
+        OPC::Message *msg = (OPC::Message*) mBuffer;
+
+        if (len < OPC::HEADER_BYTES) {
+            continue;
+        }
+
+        unsigned msgLength = OPC::HEADER_BYTES + msg->length();
+
+        if (len == msgLength + 4) {
+            // Sequenced datagram
+            const uint8_t *s = mBuffer + msgLength;
+            uint32_t sequence = (uint32_t(s[0]) << 24) | (uint32_t(s[1]) << 16) |
+                                (uint32_t(s[2]) << 8)  |  uint32_t(s[3]);
+
+            if (isLate(&addr, addrLen, msg->channel, sequence)) {
+                continue;
+            }
+
+        } else if (len != msgLength) {
+            if (mVerbose) {
+                std::clog << "Ignoring UDP datagram that isn't exactly one OPC message\n";
+            }
+            continue;
+        }
+
+        mOpcCallback(*msg, mUserContext);
+    }
+}
+
+bool UdpNetServer::isLate(const void *addr, unsigned addrLen, uint8_t channel, uint32_t sequence)
+{
+    /*
+     * Has this sender already given us a newer message on this channel? Sequence numbers
+     * are compared with wraparound. A number far behind the last one means the sender
+     * restarted, so we start tracking it again.
+     */
+
+    std::string key((const char*) addr, addrLen);
+    key.push_back(char(channel));
+
+    std::map<std::string, uint32_t>::iterator i = mSequences.find(key);
+    if (i == mSequences.end()) {
+        mSequences[key] = sequence;
+        return false;
+    }
+
+    int32_t delta = int32_t(sequence - i->second);
+    if (delta <= 0 && delta > -SEQUENCE_WINDOW) {
+        return true;
+    }
+
+    i->second = sequence;
+    return false;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Open Pixel Control over UDP for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <map>
+#include <string>
+#include "tinythread.h"
+#include "opc.h"
+
+
+/*
+ * Listens for Open Pixel Control messages over UDP, one message per datagram.
+ *
+ * Each datagram holds one OPC message, optionally followed by a 4-byte big-endian
+ * sequence number. When senders include sequence numbers, datagrams that arrive
+ * after a newer one from the same sender and channel are dropped, so frames that
+ * were delayed on the network never overwrite newer ones.
+ */
+
+class UdpNetServer {
+public:
+    UdpNetServer(OPC::callback_t opcCallback, void *context, bool verbose = false);
+
+    // Start receiving on a separate thread
+    bool start(const char *host, int port);
+
+    tthread::thread *getThread() { return mThread; }
+
+private:
+    // Sequence numbers further behind than this mean the sender restarted
+    static const int32_t SEQUENCE_WINDOW = 256;
+
+    OPC::callback_t mOpcCallback;
+    void *mUserContext;
+    bool mVerbose;
+    int mSocket;
+    tthread::thread *mThread;
+
+    // Last sequence number seen for each sender address and OPC channel
+    std::map<std::string, uint32_t> mSequences;
+
+    // Receive buffer, with room for the largest OPC message and a sequence number
+    uint8_t mBuffer[sizeof(OPC::Message) + 4];
+
+    static void threadFunc(void *arg);
+    void receiveLoop();
+    bool isLate(const void *addr, unsigned addrLen, uint8_t channel, uint32_t sequence);
+};
@@ -0,0 +1,251 @@
+/*
+ * Per-bus USB event threads for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "usbbusthread.h"
+#include "metrics.h"
+#include "trace.h"
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+
+#ifndef OS_WINDOWS
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+
+USBBusThread::USBBusThread(uint8_t bus, tthread::recursive_mutex &eventMutex, bool verbose)
+    : mBus(bus), mEventMutex(eventMutex), mVerbose(verbose), mUSB(0), mThread(0),
+      mRetirePending(false), mWakeupPending(false)
+{
+    mWakeupPipe[0] = mWakeupPipe[1] = -1;
+}
+
+#ifdef OS_WINDOWS
+
+bool USBBusThread::start()
+{
+    std::clog << "Per-bus USB threads aren't supported on this platform.\n";
+    return false;
+}
+
+void USBBusThread::wake() {}
+bool USBBusThread::waitForEvents() { return false; }
+
+#else
+
+bool USBBusThread::start()
+{
+    if (libusb_init(&mUSB)) {
+        std::clog << "Error initializing a USB context for bus " << int(mBus) << "\n";
+        mUSB = 0;
+        return false;
+    }
+
+    if (pipe(mWakeupPipe) < 0) {
+        std::clog << "Can't create a wakeup pipe for USB bus " << int(mBus) << "\n";
+        libusb_exit(mUSB);
+        mUSB = 0;
+        mWakeupPipe[0] = mWakeupPipe[1] = -1;
+        return false;
+    }
+
+    for (unsigned i = 0; i < 2; ++i) {
+        fcntl(mWakeupPipe[i], F_SETFL, fcntl(mWakeupPipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(mWakeupPipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    mThread = new tthread::thread(threadFunc, this);
+
+    if (mVerbose) {
+        std::clog << "Handling USB bus " << int(mBus) << " on its own thread.\n";
+    }
+    return true;
+}
+
+void USBBusThread::wake()
+{
+    if (mWakeupPipe[1] >= 0 && !__atomic_exchange_n(&mWakeupPending, true, __ATOMIC_ACQ_REL)) {
+        char c = 0;
+        if (write(mWakeupPipe[1], &c, 1) < 0) {
+            // Pipe is full, so a wakeup is already on its way
+        }
+    }
+}
+
+bool USBBusThread::waitForEvents()
+{
+    // Our slice of FCServer::waitForEvents(): sleep on libusb's fds and our wakeup pipe
+
+    const libusb_pollfd **usbFds = libusb_get_pollfds(mUSB);
+    if (!usbFds) {
+        return false;
+    }
+
+    mPollFds.clear();
+
+    struct pollfd wakeup;
+    wakeup.fd = mWakeupPipe[0];
+    wakeup.events = POLLIN;
+    wakeup.revents = 0;
+    mPollFds.push_back(wakeup);
+
+    for (const libusb_pollfd **i = usbFds; *i; ++i) {
+        struct pollfd p;
+        p.fd = (*i)->fd;
+        p.events = (*i)->events;
+        p.revents = 0;
+        mPollFds.push_back(p);
+    }
+    free(usbFds);
+
+    int timeoutMillis = pollTimeoutMillis();
+    struct timeval usbTimeout;
+    if (libusb_get_next_timeout(mUSB, &usbTimeout) == 1) {
+        int usbMillis = usbTimeout.tv_sec * 1000 + (usbTimeout.tv_usec + 999) / 1000;
+        timeoutMillis = std::min(timeoutMillis, usbMillis);
+    }
+
+    poll(&mPollFds[0], mPollFds.size(), timeoutMillis);
+
+    if (mPollFds[0].revents & POLLIN) {
+        __atomic_store_n(&mWakeupPending, false, __ATOMIC_RELEASE);
+
+        char buffer[64];
+        while (read(mWakeupPipe[0], buffer, sizeof buffer) > 0);
+    }
+
+    return true;
+}
+
+#endif
+
+libusb_device *USBBusThread::findDevice(libusb_device *device)
+{
+    // Devices are the same if they have the same address on our bus
+
+    if (!mUSB || libusb_get_bus_number(device) != mBus) {
+        return 0;
+    }
+
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(mUSB, &list);
+    if (count < 0) {
+        return 0;
+    }
+
+    libusb_device *found = 0;
+    for (ssize_t i = 0; i < count; ++i) {
+        if (libusb_get_bus_number(list[i]) == mBus &&
+            libusb_get_device_address(list[i]) == libusb_get_device_address(device)) {
+            found = libusb_ref_device(list[i]);
+            break;
+        }
+    }
+
+    libusb_free_device_list(list, true);
+    return found;
+}
+
+void USBBusThread::setDevices(const std::vector<USBDevice*> &devices)
+{
+    mDevicesMutex.lock();
+    mDevices = devices;
+    mDevicesMutex.unlock();
+}
+
+void USBBusThread::copyDevices()
+{
+    /*
+     * Our thread works on a copy of the device list. A device that leaves the list stays
+     * alive until we delete it, after retire(), so a copy never holds a deleted device.
+     */
+
+    mDevicesMutex.lock();
+    mFlushDevices = mDevices;
+    mDevicesMutex.unlock();
+}
+
+void USBBusThread::retire(USBDevice *device)
+{
+    mRetired.push_back(device);
+    __atomic_store_n(&mRetirePending, true, __ATOMIC_RELEASE);
+    wake();
+}
+
+void USBBusThread::threadFunc(void *arg)
+{
+    static_cast<USBBusThread*>(arg)->eventLoop();
+}
+
+int USBBusThread::pollTimeoutMillis()
+{
+    int timeoutMillis = MAX_POLL_MILLIS;
+
+    copyDevices();
+    for (std::vector<USBDevice*>::iterator i = mFlushDevices.begin(), e = mFlushDevices.end(); i != e; ++i) {
+        int deviceMillis = (*i)->flushTimeoutMillis();
+        if (deviceMillis >= 0 && deviceMillis < timeoutMillis) {
+            timeoutMillis = deviceMillis;
+        }
+    }
+
+    return timeoutMillis;
+}
+
+void USBBusThread::eventLoop()
+{
+    for (;;) {
+        TRACE_SCOPE("usbBusLoop", mBus);
+
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = waitForEvents() ? 0 : pollTimeoutMillis() * 1000;
+
+        int err = libusb_handle_events_timeout_completed(mUSB, &timeout, 0);
+        if (err) {
+            Metrics::add(Metrics::USB_EVENT_ERRORS);
+            if (mVerbose) {
+                std::clog << "Error handling USB events on bus " << int(mBus) << ": "
+                    << libusb_strerror(libusb_error(err)) << "\n";
+            }
+        }
+
+        // Each device takes its own lock
+        copyDevices();
+        for (std::vector<USBDevice*>::iterator i = mFlushDevices.begin(), e = mFlushDevices.end(); i != e; ++i) {
+            (*i)->flush();
+        }
+
+        // Nothing else can be completing their transfers now, we're the only thread handling them
+        if (__atomic_load_n(&mRetirePending, __ATOMIC_ACQUIRE)) {
+            mEventMutex.lock();
+            for (std::vector<USBDevice*>::iterator i = mRetired.begin(), e = mRetired.end(); i != e; ++i) {
+                delete *i;
+            }
+            mRetired.clear();
+            __atomic_store_n(&mRetirePending, false, __ATOMIC_RELAXED);
+            mEventMutex.unlock();
+        }
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ * Per-bus USB event threads for Fadecandy
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include <libusb.h>
+#include "tinythread.h"
+#include "usbdevice.h"
+
+#ifndef OS_WINDOWS
+#include <poll.h>
+#endif
+
+
+/*
+ * Handles USB traffic for the devices on one bus, with a libusb context of its own.
+ *
+ * Normally every device shares the hotplug context, and the main loop reaps and submits
+ * transfers for all of them. With many boards across several host controllers, that one
+ * thread becomes the limit. A device can instead be opened through a USBBusThread's
+ * context, and then its transfer completions and flush() run here, in parallel with the
+ * other buses. Hotplug is still handled by the server, on its own context.
+ *
+ * Devices protect their USB state with their own lock, so flushing one here doesn't
+ * wait on the server's event lock, or on the other buses. We only take the event lock
+ * to delete retired devices.
+ */
+
+class USBBusThread {
+public:
+    USBBusThread(uint8_t bus, tthread::recursive_mutex &eventMutex, bool verbose = false);
+
+    // Start a libusb context for this bus, and handle its events on a separate thread
+    bool start();
+
+    // The same device as seen by our context, referenced. NULL if we can't see it (yet).
+    libusb_device *findDevice(libusb_device *device);
+
+    // Devices opened through our context. Safe from any thread.
+    void setDevices(const std::vector<USBDevice*> &devices);
+
+    // Delete a device opened through our context, once our thread is between events.
+    // Call with the event lock held, after the device is gone from setDevices().
+    void retire(USBDevice *device);
+
+    // Flush our devices as soon as possible. Safe from any thread.
+    void wake();
+
+    uint8_t getBus() const { return mBus; }
+    tthread::thread *getThread() { return mThread; }
+
+private:
+    // Longest we sleep when nothing is happening
+    static const unsigned MAX_POLL_MILLIS = 100;
+
+    uint8_t mBus;
+    tthread::recursive_mutex &mEventMutex;
+    bool mVerbose;
+    libusb_context *mUSB;
+    tthread::thread *mThread;
+
+    // Protected by mDevicesMutex. Our thread flushes a copy, in mFlushDevices.
+    std::vector<USBDevice*> mDevices;
+    std::vector<USBDevice*> mFlushDevices;
+    tthread::mutex mDevicesMutex;
+
+    // Protected by mEventMutex. mRetirePending is atomic, so we can skip the lock when it's clear.
+    std::vector<USBDevice*> mRetired;
+    bool mRetirePending;
+
+    // Self-pipe for wake(), as in the main loop. mWakeupPending is atomic.
+    int mWakeupPipe[2];
+    bool mWakeupPending;
+#ifndef OS_WINDOWS
+    std::vector<struct pollfd> mPollFds;
+#endif
+
+    static void threadFunc(void *arg);
+    void eventLoop();
+    bool waitForEvents();
+    int pollTimeoutMillis();
+    void copyDevices();
+};
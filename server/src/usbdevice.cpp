@@ -26,7 +26,8 @@
 
 
 USBDevice::USBDevice(libusb_device *device, const char *type, bool verbose)
-    : mDevice(libusb_ref_device(device)),
+    : mDevice(device ? libusb_ref_device(device) : 0),
+      mHandleDevice(mDevice),
       mHandle(0),
       mTypeString(type),
       mSerialString(0),
@@ -40,17 +41,75 @@ USBDevice::~USBDevice()
     if (mHandle) {
         libusb_close(mHandle);
     }
+    if (mHandleDevice && mHandleDevice != mDevice) {
+        libusb_unref_device(mHandleDevice);
+    }
     if (mDevice) {
         libusb_unref_device(mDevice);
     }
 }
 
+void USBDevice::setHandleDevice(libusb_device *device)
+{
+    if (mHandleDevice && mHandleDevice != mDevice) {
+        libusb_unref_device(mHandleDevice);
+    }
+    mHandleDevice = device;
+}
+
 bool USBDevice::probeAfterOpening()
 {
     // By default, any device is supported by the time we get to opening it.
     return true;
 }
 
+bool USBDevice::usesOpcChannel(unsigned channel)
+{
+    // By default, assume the device wants pixels from every channel.
+    return true;
+}
+
+void USBDevice::setFrameBarrier(bool enabled)
+{
+    // By default, devices send pixels as soon as they arrive.
+}
+
+void USBDevice::commitFrame()
+{
+    // Nothing held back by default
+}
+
+void USBDevice::syncClock()
+{
+    // No clock to sync by default
+}
+
+bool USBDevice::hasPixelLock()
+{
+    return false;
+}
+
+bool USBDevice::isQueueFull()
+{
+    // By default, devices never ask OPC clients to slow down.
+    return false;
+}
+
+bool USBDevice::readPixels(std::vector<uint8_t> &rgb, unsigned step)
+{
+    return false;
+}
+
+uint64_t USBDevice::timeMicros(const struct timeval &tv)
+{
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void USBDevice::readLatencyProbes(std::vector<LatencyProbe> &probes)
+{
+    // Optional. By default, probes are ignored like any other unknown SysEx.
+}
+
 void USBDevice::writeColorCorrection(const Value &color)
 {
     // Optional. By default, ignore color correction messages.
@@ -106,6 +165,31 @@ void USBDevice::writeMessage(Document &msg)
     msg.AddMember("error", "Unknown device-specific message type", msg.GetAllocator());
 }
 
+void USBDevice::writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count)
+{
+    // Same answer writeMessage() gives for device types without a framebuffer
+    msg.AddMember("error", "Unknown device-specific message type", msg.GetAllocator());
+}
+
+int USBDevice::flushTimeoutMillis()
+{
+    return -1;
+}
+
+int USBDevice::millisUntilRefresh(const struct timeval &last, unsigned rate)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    int64_t elapsed = (int64_t)(now.tv_sec - last.tv_sec) * 1000000 + (now.tv_usec - last.tv_usec);
+    int64_t interval = 1000000 / rate;
+
+    if (elapsed < 0 || elapsed >= interval) {
+        return 0;
+    }
+    return (interval - elapsed + 999) / 1000;
+}
+
 void USBDevice::describe(rapidjson::Value &object, Allocator &alloc)
 {
     object.AddMember("type", mTypeString, alloc);
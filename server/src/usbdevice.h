@@ -25,7 +25,9 @@
 
 #include "rapidjson/document.h"
 #include "opc.h"
+#include "tinythread.h"
 #include <string>
+#include <vector>
 #include <libusb.h> // Also brings in gettimeofday() in a portable way
 
 
@@ -59,6 +61,7 @@ public:
     typedef rapidjson::Document Document;
     typedef rapidjson::MemoryPoolAllocator<> Allocator;
 
+    // 'device' may be NULL for devices that are simulated rather than attached
     USBDevice(libusb_device *device, const char *type, bool verbose);
     virtual ~USBDevice();
 
@@ -77,32 +80,109 @@ public:
     // Handle an incoming OPC message
     virtual void writeMessage(const OPC::Message &msg) = 0;
 
+    // Does this device need SetPixelColors messages for an OPC channel? Used for routing.
+    virtual bool usesOpcChannel(unsigned channel);
+
     // Handle a device-specific JSON message
     virtual void writeMessage(Document &msg);
 
+    // Handle a device_pixels message whose pixel array was already decoded to bytes
+    virtual void writeDevicePixels(Document &msg, const uint8_t *pixels, unsigned count);
+
     // Write color LUT from parsed JSON
     virtual void writeColorCorrection(const Value &color);
 
-    // Deal with any I/O that results from completed transfers, outside the context of a completion callback
+    // Deal with any I/O that results from completed transfers, outside the context of a completion callback.
+    // On a USBBusThread this runs without the server's event lock.
     virtual void flush() = 0;
 
+    // How soon flush() must run again, for output on a timer. -1 if only USB events matter.
+    virtual int flushTimeoutMillis();
+
+    /*
+     * With a frame barrier, new pixels are held until commitFrame() so that
+     * the server can send a frame to every device back-to-back.
+     */
+    virtual void setFrameBarrier(bool enabled);
+    virtual void commitFrame();
+
+    // Tell the device our clock, for devices that schedule frames by it. Sent periodically.
+    virtual void syncClock();
+
+    /*
+     * Can pixel messages and commitFrame() reach this device from any thread, without
+     * the server's event lock? Devices that say so protect their own pixel state.
+     */
+    virtual bool hasPixelLock();
+
+    // Would a new frame have to wait for earlier frames to finish? Used for flow control,
+    // and may be called without the server's event lock.
+    virtual bool isQueueFull();
+
+    // Copy every 'step'th pixel as the device will show it, for monitoring. False if unsupported.
+    virtual bool readPixels(std::vector<uint8_t> &rgb, unsigned step);
+
+    /*
+     * A latency probe follows one frame from the OPC message that asked for it to the
+     * end of its USB transfer. Times are microseconds on the server's wall clock, zero
+     * for stages the frame never reached. The client's sequence number and timestamp
+     * are passed back untouched.
+     */
+    struct LatencyProbe {
+        uint32_t sequence;
+        uint64_t clientTime;
+        uint64_t received;
+        uint64_t mapped;
+        uint64_t submitted;
+        uint64_t completed;
+        unsigned framesPending;     // Frames already in the USB queue when this one was submitted
+        unsigned framesCoalesced;   // Newer frames that replaced it before it was submitted
+        bool error;
+    };
+
+    // Append and forget any latency probes that finished since the last call
+    virtual void readLatencyProbes(std::vector<LatencyProbe> &probes);
+
     // Describe this device by adding keys to a JSON object
     virtual void describe(Value &object, Allocator &alloc);
 
     virtual std::string getName() = 0;
 
     libusb_device *getDevice() { return mDevice; };
+
+    /*
+     * Open the same device through another libusb context, such as a USBBusThread's,
+     * taking over the reference to 'device'. Must be called before open().
+     */
+    void setHandleDevice(libusb_device *device);
+    libusb_device *getHandleDevice() { return mHandleDevice; }
+
     const char *getSerial() { return mSerialString; }
     const char *getTypeString() { return mTypeString; }
 
 protected:
     libusb_device *mDevice;
+    libusb_device *mHandleDevice;   // What mHandle is opened through, usually mDevice
     libusb_device_handle *mHandle;
     struct timeval mTimestamp;
     const char *mTypeString;
     const char *mSerialString;
     bool mVerbose;
 
+    /*
+     * Protects the state flush() shares with the rest of the device: its transfers, and
+     * the configuration it submits. A device on a USBBusThread is flushed there without
+     * the server's event lock, so flush() and every method that touches that state take
+     * this, after the event lock when both are held. Pixels may have a lock of their own.
+     */
+    tthread::recursive_mutex mDeviceMutex;
+
     // Utilities
     const Value *findConfigMap(const Value &config);
+
+    // For output capped at 'rate' frames per second: how long after 'last' until the next?
+    static int millisUntilRefresh(const struct timeval &last, unsigned rate);
+
+    // A timestamp in microseconds, as used by LatencyProbe
+    static uint64_t timeMicros(const struct timeval &tv);
 };
@@ -213,24 +213,33 @@ bool ARMDebug::memStoreAndVerify(uint32_t addr, const uint32_t *data, unsigned c
 
 bool ARMDebug::memStore(uint32_t addr, const uint32_t *data, unsigned count)
 {
+    /*
+     * Block writes don't wait for the memory port after every word. If the port is
+     * still busy, the debug port answers WAIT and dpWrite() retries, so consecutive
+     * DRW writes can go out back to back.
+     */
+
     if (!memWait())
         return false;
     if (!memWriteCSW(CSW_32BIT | CSW_ADDRINC_SINGLE))
         return false;
-    if (!apWrite(MEM_TAR, addr))
-        return false;
 
     while (count) {
-        log(LOG_TRACE_MEM, "MEM Store [%08x] %08x", addr, *data);
+        unsigned chunk = memChunkWords(addr, count);
 
-        if (!memWait())
-            return false;
-        if (!apWrite(MEM_DRW, *data))
+        if (!apWrite(MEM_TAR, addr))
             return false;
 
-        data++;
-        addr++;
-        count--;
+        for (unsigned i = 0; i < chunk; i++) {
+            log(LOG_TRACE_MEM, "MEM Store [%08x] %08x", addr, *data);
+
+            if (!apWrite(MEM_DRW, *data))
+                return false;
+
+            data++;
+            addr += 4;
+        }
+        count -= chunk;
     }
 
     return true;
@@ -238,29 +247,51 @@ bool ARMDebug::memStore(uint32_t addr, const uint32_t *data, unsigned count)
 
 bool ARMDebug::memLoad(uint32_t addr, uint32_t *data, unsigned count)
 {
+    /*
+     * AP reads are delayed by one transaction (see apRead), which suits block reads:
+     * each DRW read returns the word before it, and RDBUFF returns the last one without
+     * starting another read. That's one SWD transaction per word instead of four.
+     */
+
     if (!memWait())
         return false;
     if (!memWriteCSW(CSW_32BIT | CSW_ADDRINC_SINGLE))
         return false;
-    if (!apWrite(MEM_TAR, addr))
-        return false;
 
     while (count) {
-        if (!memWait())
+        unsigned chunk = memChunkWords(addr, count);
+        uint32_t dummyData;
+
+        if (!apWrite(MEM_TAR, addr))
             return false;
-        if (!apRead(MEM_DRW, *data))
+        if (!(dpSelect(MEM_DRW) && dpRead(MEM_DRW, true, dummyData)))
             return false;
 
-        log(LOG_TRACE_MEM, "MEM Load  [%08x] %08x", addr, *data);
+        for (unsigned i = 1; i < chunk; i++) {
+            if (!dpRead(MEM_DRW, true, data[i - 1]))
+                return false;
+        }
+        if (!dpRead(RDBUFF, false, data[chunk - 1]))
+            return false;
 
-        data++;
-        addr++;
-        count--;
+        for (unsigned i = 0; i < chunk; i++) {
+            log(LOG_TRACE_MEM, "MEM Load  [%08x] %08x", addr, *data);
+            data++;
+            addr += 4;
+        }
+        count -= chunk;
     }
 
     return true;
 }
 
+unsigned ARMDebug::memChunkWords(uint32_t addr, unsigned count)
+{
+    // TAR is only guaranteed to auto-increment within a 1 kB block
+    unsigned words = (0x400 - (addr & 0x3FF)) / 4;
+    return count < words ? count : words;
+}
+
 bool ARMDebug::memStoreByte(uint32_t addr, uint8_t data)
 {
     if (!memWait())
@@ -131,6 +131,7 @@ protected:
     // Internal MEM-AP functions
     bool memWait();
     bool memWriteCSW(uint32_t data);
+    unsigned memChunkWords(uint32_t addr, unsigned count);
 
     // Poll for an expected value
     bool dpReadPoll(unsigned addr, uint32_t &data, uint32_t mask, uint32_t expected, unsigned retries = DEFAULT_RETRIES);
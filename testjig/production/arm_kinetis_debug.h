@@ -73,6 +73,7 @@ public:
             FlashProgrammer(ARMKinetisDebug &target, const uint32_t *image, unsigned numSectors);
             bool begin();
             bool isComplete();
+            bool isVerifyingFlash() { return isVerifying; }
             bool next();
 
         private:
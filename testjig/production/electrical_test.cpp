@@ -124,7 +124,7 @@ bool ElectricalTest::initTarget()
     return true;
 }
 
-void ElectricalTest::setPowerSupplyVoltage(float volts)
+void ElectricalTest::startPowerSupplyVoltage(float volts)
 {
     // Set the variable power supply voltage. Usable range is from 0V to system VUSB.
 
@@ -132,66 +132,145 @@ void ElectricalTest::setPowerSupplyVoltage(float volts)
     pinMode(powerPWMPin, OUTPUT);
     analogWriteFrequency(powerPWMPin, 1000000);
     analogWrite(powerPWMPin, pwm);
+}
 
+bool ElectricalTest::isSupplySettled(float volts, uint32_t startMillis)
+{
     /*
-     * Time for the PSU to settle. Our testjig's power supply settles very
-     * fast (<1ms), but the capacitors on the target need more time to charge.
+     * Our testjig's power supply settles very fast (<1ms), but the capacitors on the
+     * target need more time to charge. Instead of always waiting as long as that can
+     * take, the supply has settled once VUSB reads close to 'volts' twice in a row.
+     * After supplyMaxSettleMillis it has settled regardless, and the test decides.
      */
-    delay(150);
+
+    const float tolerance = 0.05;
+    uint32_t elapsed = millis() - startMillis;
+
+    if (elapsed >= supplyMaxSettleMillis)
+        return true;
+    if (elapsed < supplyMinSettleMillis)
+        return false;
+
+    float first = analogVolts(analogTargetVUsbPin);
+    delay(2);
+    float second = analogVolts(analogTargetVUsbPin);
+
+    return fabsf(first - volts) < tolerance && fabsf(second - volts) < tolerance;
 }
 
-bool ElectricalTest::testBoostConverter()
+void ElectricalTest::setPowerSupplyVoltage(float volts)
+{
+    startPowerSupplyVoltage(volts);
+
+    uint32_t start = millis();
+    while (!isSupplySettled(volts, start));
+}
+
+void ElectricalTest::beginBoostTest()
 {
     target.log(logLevel, "ETEST: Testing boost converter");
+    boostSupply = 5.0;
+    boostSettling = false;
+}
 
+bool ElectricalTest::isBoostTestComplete()
+{
     // Test over a range of input voltages
-    for (float supply = 5.0; supply > 3.5; supply -= 0.2) {
+    return !(boostSupply > 3.5);
+}
 
-        // Turn all outputs on
+bool ElectricalTest::stepBoostTest()
+{
+    if (isBoostTestComplete())
+        return true;
+
+    if (!boostSettling) {
+        /*
+         * Turn all outputs on, and adjust the power supply. The target may have been
+         * reset since the last step, as it is after flash programming, so set the
+         * output pin directions again too.
+         */
+        for (unsigned n = 0; n < 8; n++) {
+            if (!target.pinMode(outPin(n), OUTPUT))
+                return false;
+        }
         if (!target.digitalWritePort(outPin(0), 0xFF))
             return false;
 
-        // Adjust power supply
-        setPowerSupplyVoltage(supply);
-
-        // Collect all relevant voltages
-        float vusb = analogVolts(analogTargetVUsbPin);
-        float vcc = analogVolts(analogTarget33vPin);
-        float v0 = analogVolts(0);
-        float v1 = analogVolts(1);
-        float v2 = analogVolts(2);
-        float v3 = analogVolts(3);
-        float v4 = analogVolts(4);
-        float v5 = analogVolts(5);
-        float v6 = analogVolts(6);
-        float v7 = analogVolts(7);
-
-        target.log(logLevel,
-            "  Supply at %.1fv : Target vusb=%.2fv vcc=%.2fv outputs=["
-            "%.2fv %.2fv %.2fv %.2fv %.2fv %.2fv %.2fv %.2fv]",
-            supply, vusb, vcc, v0, v1, v2, v3, v4, v5, v6, v7);
-
-        if (!analogThresholdFromSample(vusb, analogTargetVUsbPin, supply)) return false;
-        if (!analogThresholdFromSample(vcc, analogTarget33vPin, 3.3)) return false;
-        if (!analogThresholdFromSample(v0, 0, 5.0)) return false;
-        if (!analogThresholdFromSample(v1, 1, 5.0)) return false;
-        if (!analogThresholdFromSample(v2, 2, 5.0)) return false;
-        if (!analogThresholdFromSample(v3, 3, 5.0)) return false;
-        if (!analogThresholdFromSample(v4, 4, 5.0)) return false;
-        if (!analogThresholdFromSample(v5, 5, 5.0)) return false;
-        if (!analogThresholdFromSample(v6, 6, 5.0)) return false;
-        if (!analogThresholdFromSample(v7, 7, 5.0)) return false;
-
-        // Also make sure we can turn outputs off properly
-        if (!target.digitalWritePort(outPin(0), 0x00))
+        startPowerSupplyVoltage(boostSupply);
+        boostSettleStart = millis();
+        boostSettling = true;
+        return true;
+    }
+
+    if (!isSupplySettled(boostSupply, boostSettleStart))
+        return true;
+
+    boostSettling = false;
+    if (!testBoostConverterAt(boostSupply))
+        return false;
+
+    boostSupply -= 0.2;
+    if (isBoostTestComplete()) {
+        // Done! Go back to a nominal 5V supply for the rest of the tests.
+        setPowerSupplyVoltage(5.0);
+    }
+    return true;
+}
+
+bool ElectricalTest::finishBoostTest()
+{
+    while (!isBoostTestComplete()) {
+        if (!stepBoostTest())
             return false;
-        for (unsigned n = 0; n < 8; n++)
-            if (!analogThreshold(n, 0))
-                return false;
     }
+    return true;
+}
+
+bool ElectricalTest::testBoostConverter()
+{
+    beginBoostTest();
+    return finishBoostTest();
+}
+
+bool ElectricalTest::testBoostConverterAt(float supply)
+{
+    // With all outputs on and the supply settled at 'supply', collect all relevant voltages
+
+    float vusb = analogVolts(analogTargetVUsbPin);
+    float vcc = analogVolts(analogTarget33vPin);
+    float v0 = analogVolts(0);
+    float v1 = analogVolts(1);
+    float v2 = analogVolts(2);
+    float v3 = analogVolts(3);
+    float v4 = analogVolts(4);
+    float v5 = analogVolts(5);
+    float v6 = analogVolts(6);
+    float v7 = analogVolts(7);
+
+    target.log(logLevel,
+        "  Supply at %.1fv : Target vusb=%.2fv vcc=%.2fv outputs=["
+        "%.2fv %.2fv %.2fv %.2fv %.2fv %.2fv %.2fv %.2fv]",
+        supply, vusb, vcc, v0, v1, v2, v3, v4, v5, v6, v7);
+
+    if (!analogThresholdFromSample(vusb, analogTargetVUsbPin, supply)) return false;
+    if (!analogThresholdFromSample(vcc, analogTarget33vPin, 3.3)) return false;
+    if (!analogThresholdFromSample(v0, 0, 5.0)) return false;
+    if (!analogThresholdFromSample(v1, 1, 5.0)) return false;
+    if (!analogThresholdFromSample(v2, 2, 5.0)) return false;
+    if (!analogThresholdFromSample(v3, 3, 5.0)) return false;
+    if (!analogThresholdFromSample(v4, 4, 5.0)) return false;
+    if (!analogThresholdFromSample(v5, 5, 5.0)) return false;
+    if (!analogThresholdFromSample(v6, 6, 5.0)) return false;
+    if (!analogThresholdFromSample(v7, 7, 5.0)) return false;
+
+    // Also make sure we can turn outputs off properly
+    if (!target.digitalWritePort(outPin(0), 0x00))
+        return false;
+    for (unsigned n = 0; n < 8; n++)
+        if (!analogThreshold(n, 0))
+            return false;
 
-    // Done! Go back to a nominal 5V supply. We'll want this to be stable for flash programming.
-    setPowerSupplyVoltage(5.0);
     return true;
 }
 
@@ -339,7 +418,7 @@ bool ElectricalTest::testSerialConnections()
     return true;
 }
 
-bool ElectricalTest::runAll()
+bool ElectricalTest::runBeforeBoostTest()
 {
     target.log(logLevel, "ETEST: Beginning electrical test");
 
@@ -358,6 +437,14 @@ bool ElectricalTest::runAll()
     if (!testSerialConnections())
         return false;
 
+    return true;
+}
+
+bool ElectricalTest::runAll()
+{
+    if (!runBeforeBoostTest())
+        return false;
+
     // Now try dialing down the power supply voltage, and make sure it still works
     if (!testBoostConverter())
         return false;
@@ -28,17 +28,38 @@ class ElectricalTest
 {
 public:
     ElectricalTest(ARMKinetisDebug &target, int logLevel = ARMDebug::LOG_NORMAL)
-        : target(target), logLevel(logLevel) {}
+        : target(target), logLevel(logLevel), boostSupply(0), boostSettling(false) {}
 
     void powerOff();    // Turn off target power supply
     bool powerOn();     // Set target power supply to default voltage
 
     bool runAll();      // All normal electrical tests
 
+    /*
+     * The same tests, split so the boost converter test can overlap something else.
+     * It spends most of its time waiting for the supply to settle at each voltage, so
+     * stepBoostTest() returns right away while it waits. Call it again until
+     * isBoostTestComplete(), or use finishBoostTest() to wait it out.
+     */
+    bool runBeforeBoostTest();
+    void beginBoostTest();
+    bool stepBoostTest();
+    bool isBoostTestComplete();
+    bool finishBoostTest();
+
 private:
     ARMKinetisDebug &target;
     int logLevel;
 
+    // Power supply settling, see isSupplySettled()
+    static const unsigned supplyMinSettleMillis = 10;
+    static const unsigned supplyMaxSettleMillis = 150;
+
+    // Boost converter test progress
+    float boostSupply;
+    bool boostSettling;
+    uint32_t boostSettleStart;
+
     const int LOG_ERROR = ARMDebug::LOG_ERROR;
 
     // Pin number for an LED output
@@ -47,6 +68,8 @@ private:
     }
 
     void setPowerSupplyVoltage(float volts);
+    void startPowerSupplyVoltage(float volts);
+    bool isSupplySettled(float volts, uint32_t startMillis);
     float analogVolts(int pin);
     bool analogThresholdFromSample(float volts, int pin, float nominal, float tolerance = 0.30);
     bool analogThreshold(int pin, float nominal, float tolerance = 0.30);
@@ -55,6 +78,7 @@ private:
     bool testAllOutputPatterns();
     bool testUSBConnections();
     bool testBoostConverter();
+    bool testBoostConverterAt(float supply);
     bool testSerialConnections();
     bool testHighZ(int pin);
     bool testPull(int pin, bool state);
@@ -27,7 +27,7 @@
 #include "firmware_data.h"
 
 
-bool FcRemote::installFirmware()
+bool FcRemote::installFirmware(bool (*whileVerifying)())
 {
     // Install firmware, blinking both target and local LEDs in unison.
 
@@ -40,6 +40,7 @@ bool FcRemote::installFirmware()
     while (!programmer.isComplete()) {
         blink = !blink;
         if (!programmer.next()) return false;
+        if (whileVerifying && programmer.isVerifyingFlash() && !whileVerifying()) return false;
         if (!setLED(blink)) return false;
         digitalWrite(ledPin, blink);
     }
@@ -105,25 +106,43 @@ bool FcRemote::setPixel(unsigned index, int red, int green, int blue)
         target.memStoreByte(packet + idOffset + 2, constrain(blue, 0, 255));
 }
 
-float FcRemote::measureFrameRate(float minDuration)
+float FcRemote::measureFrameRate(float minFPS, float maxFPS, float maxDuration)
 {
-    // Use the end-to-end LED data signal to measure the overall system frame rate.
-    // Gaps of >50us indicate frame boundaries
+    /*
+     * Use the end-to-end LED data signal to measure the overall system frame rate.
+     * Gaps of >50us indicate frame boundaries.
+     *
+     * We time each frame from one gap to the next. Frame times are steady, so once we
+     * have enough of them, their mean is known closely. We stop when the mean, give or
+     * take four standard errors, is either all inside or all outside the allowed range
+     * of frame times. A frame rate right at a limit uses the whole maxDuration.
+     */
+
+    const unsigned minFrames = 32;
+    const float errorBound = 4.0;
+    const float shortestFrame = 1e6 / maxFPS;
+    const float longestFrame = 1e6 / minFPS;
 
     pinMode(dataFeedbackPin, INPUT);
 
-    uint32_t minMicros = minDuration * 1000000;
+    uint32_t maxMicros = maxDuration * 1000000;
     uint32_t startTime = micros();
     uint32_t gapStart = 0;
+    uint32_t lastFrame = 0;
     bool inGap = false;
     uint32_t frames = 0;
     uint32_t duration;
     bool anyData = false;
 
+    // Running mean and variance of frame times, in microseconds
+    unsigned count = 0;
+    float mean = 0;
+    float m2 = 0;
+
     while (1) {
         uint32_t now = micros();
         duration = now - startTime;
-        if (duration >= minMicros)
+        if (duration >= maxMicros)
             break;
 
         if (digitalRead(dataFeedbackPin)) {
@@ -142,10 +161,28 @@ float FcRemote::measureFrameRate(float minDuration)
             // We've seen data, and
             // We just found an inter-frame gap
             inGap = true;
-            frames++;
+            if (frames++) {
+                float t = now - lastFrame;
+                float delta = t - mean;
+                count++;
+                mean += delta / count;
+                m2 += delta * (t - mean);
+            }
+            lastFrame = now;
+
+            if (count >= minFrames) {
+                float error = errorBound * sqrtf(m2 / (count - 1) / count);
+                bool inside = mean - error >= shortestFrame && mean + error <= longestFrame;
+                bool outside = mean + error < shortestFrame || mean - error > longestFrame;
+                if (inside || outside)
+                    break;
+            }
         }
     }
 
+    if (count) {
+        return 1e6 / mean;
+    }
     return frames / (duration * 1e-6);
 }
 
@@ -155,7 +192,7 @@ bool FcRemote::testFrameRate()
     const float maxFPS = 450;
 
     target.log(target.LOG_NORMAL, "FPS: Measuring frame rate...");
-    float fps = measureFrameRate();
+    float fps = measureFrameRate(goalFPS, maxFPS);
     target.log(target.LOG_NORMAL, "FPS: Measured %.2f frames/sec", fps);
 
     if (fps > maxFPS) {
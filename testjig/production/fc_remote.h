@@ -29,7 +29,8 @@ class FcRemote
 public:
     FcRemote(ARMKinetisDebug &target) : target(target) {}
 
-    bool installFirmware();
+    // Optionally call 'whileVerifying' after each sector is verified. False aborts.
+    bool installFirmware(bool (*whileVerifying)() = 0);
     bool boot();
 
     // Set remote LED
@@ -38,8 +39,11 @@ public:
     // Set control flags
     bool setFlags(uint8_t cflag);
 
-    // Measure actual frame rate of Fadecandy firmware
-    float measureFrameRate(float minDuration = 1.0);
+    /*
+     * Measure actual frame rate of Fadecandy firmware. Measuring stops early once the
+     * rate is clearly inside or outside the range from minFPS to maxFPS.
+     */
+    float measureFrameRate(float minFPS, float maxFPS, float maxDuration = 1.0);
     bool testFrameRate();
 
     // Direct framebuffer access
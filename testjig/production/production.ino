@@ -57,6 +57,11 @@ void success()
     }
 }
 
+bool stepBoostTest()
+{
+    return etest.stepBoostTest();
+}
+
 void loop()
 {
     // Keep target power supply off when we're not using it
@@ -76,11 +81,19 @@ void loop()
         return;
 
     // Run an electrical test, to verify that the target board is okay
-    if (!etest.runAll())
+    if (!etest.runBeforeBoostTest())
         return;
 
-    // Program firmware, blinking both LEDs in unison for status.
-    if (!remote.installFirmware())
+    /*
+     * Program firmware, blinking both LEDs in unison for status. The boost converter
+     * test sweeps the supply voltage while the firmware is verified, which only reads
+     * flash, and measures at each voltage once it has settled. Then finish the sweep,
+     * if verifying took less time.
+     */
+    etest.beginBoostTest();
+    if (!remote.installFirmware(stepBoostTest))
+        return;
+    if (!etest.finishBoostTest())
         return;
 
     // Boot the target